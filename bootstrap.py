@@ -59,10 +59,6 @@ for src in glob.glob('src/*.cc'):
     if src.endswith('bench.cc'):
         continue
 
-    filename = os.path.basename(src)
-    if filename == 'browse.cc':  # Depends on generated header.
-        continue
-
     if sys.platform.startswith('win32'):
         if src.endswith('-posix.cc'):
             continue
@@ -85,7 +81,6 @@ if vcdir:
 else:
     args = shlex.split(os.environ.get('CXX', 'g++'))
     cflags.extend(['-Wno-deprecated',
-                   '-DNINJA_PYTHON="' + sys.executable + '"',
                    '-DNINJA_BOOTSTRAP'])
     if sys.platform.startswith('win32'):
         cflags.append('-D_WIN32_WINNT=0x0501')
@@ -101,6 +96,10 @@ if vcdir:
     args.extend(['/link', '/out:' + binary])
 else:
     args.extend(['-o', binary])
+    if sys.platform.startswith('win32'):
+        args.append('-lpsapi')
+    else:
+        args.append('-lpthread')
 
 if options.verbose:
     print ' '.join(args)
@@ -113,8 +112,7 @@ if options.verbose:
 
 if sys.platform.startswith('win32'):
     print 'Building ninja using itself...'
-    run([sys.executable, 'configure.py', '--with-ninja=%s' % binary] +
-        conf_args)
+    run([sys.executable, 'configure.py'] + conf_args)
     run(['./' + binary] + verbose)
 
     # Copy the new executable over the bootstrap one.
@@ -129,9 +127,7 @@ Done!
 
 Note: to work around Windows file locking, where you can't rebuild an
 in-use binary, to run ninja after making any changes to build ninja itself
-you should run ninja.bootstrap instead.  Your build is also configured to
-use ninja.bootstrap.exe as the MSVC helper; see the --with-ninja flag of
-the --help output of configure.py."""
+you should run ninja.bootstrap instead."""
 else:
     print 'Building ninja using itself...'
     run([sys.executable, 'configure.py'] + conf_args)
@@ -45,9 +45,6 @@ parser.add_option('--with-gtest', metavar='PATH',
 parser.add_option('--with-python', metavar='EXE',
                   help='use EXE as the Python interpreter',
                   default=os.path.basename(sys.executable))
-parser.add_option('--with-ninja', metavar='NAME',
-                  help="name for ninja binary for -t msvc (MSVC only)",
-                  default="ninja")
 (options, args) = parser.parse_args()
 if args:
     print 'ERROR: extra unparsed command-line arguments:', args
@@ -127,8 +124,7 @@ if platform == 'windows':
               # Disable size_t -> int truncation warning.
               # We never have strings or arrays larger than 2**31.
               '/wd4267',
-              '/DNOMINMAX', '/D_CRT_SECURE_NO_WARNINGS',
-              '/DNINJA_PYTHON="%s"' % options.with_python]
+              '/DNOMINMAX', '/D_CRT_SECURE_NO_WARNINGS']
     ldflags = ['/DEBUG', '/libpath:$builddir']
     if not options.debug:
         cflags += ['/Ox', '/DNDEBUG', '/GL']
@@ -139,8 +135,7 @@ else:
               '-Wno-unused-parameter',
               '-fno-rtti',
               '-fno-exceptions',
-              '-fvisibility=hidden', '-pipe',
-              '-DNINJA_PYTHON="%s"' % options.with_python]
+              '-fvisibility=hidden', '-pipe']
     if options.debug:
         cflags += ['-D_GLIBCXX_DEBUG', '-D_GLIBCXX_DEBUG_PEDANTIC']
         cflags.remove('-fno-rtti')  # Needed for above pedanticness.
@@ -149,7 +144,7 @@ else:
     if 'clang' in os.path.basename(CXX):
         cflags += ['-fcolor-diagnostics']
     if platform == 'mingw':
-        cflags += ['-D_WIN32_WINNT=0x0501']
+        cflags += ['-D_WIN32_WINNT=0x0600']
     ldflags = ['-L$builddir']
 libs = []
 
@@ -169,7 +164,7 @@ else:
 
 def shell_escape(str):
     """Escape str such that it's interpreted as a single argument by the shell."""
-    # This isn't complete, but it's just enough to make NINJA_PYTHON work.
+    # This isn't complete, but it's just enough for the flags passed here.
     if platform in ('windows', 'mingw'):
       return str
     if '"' in str:
@@ -185,14 +180,10 @@ n.variable('ldflags', ' '.join(shell_escape(flag) for flag in ldflags))
 n.newline()
 
 if platform == 'windows':
-    compiler = '$cxx'
-    if options.with_ninja:
-        compiler = ('%s -t msvc -o $out -- $cxx /showIncludes' %
-                    options.with_ninja)
     n.rule('cxx',
-        command='%s $cflags -c $in /Fo$out' % compiler,
-        depfile='$out.d',
-        description='CXX $out')
+        command='$cxx /showIncludes $cflags -c $in /Fo$out',
+        description='CXX $out',
+        deps='msvc')
 else:
     n.rule('cxx',
         command='$cxx -MMD -MT $out -MF $out.d $cflags -c $in -o $out',
@@ -226,19 +217,6 @@ n.newline()
 
 objs = []
 
-if platform not in ('solaris', 'mingw', 'windows'):
-    n.comment('browse_py.h is used to inline browse.py.')
-    n.rule('inline',
-           command='src/inline.sh $varname < $in > $out',
-           description='INLINE $out')
-    n.build(built('browse_py.h'), 'inline', src('browse.py'),
-            implicit='src/inline.sh',
-            variables=[('varname', 'kBrowsePy')])
-    n.newline()
-
-    objs += cxx('browse', order_only=built('browse_py.h'))
-    n.newline()
-
 n.comment('the depfile parser and ninja lexers are generated using re2c.')
 def has_re2c():
     import subprocess
@@ -260,23 +238,39 @@ else:
 n.newline()
 
 n.comment('Core source files all build into ninja library.')
-for name in ['build',
+for name in ['arena',
+             'build',
+             'build_estimate',
              'build_log',
+             'clparser',
              'clean',
+             'critical_path',
              'depfile_parser',
+             'deps_log',
              'disk_interface',
              'edit_distance',
              'eval_env',
+             'event_stream',
              'explain',
+             'file_watcher',
              'graph',
              'graphviz',
+             'io_uring',
+             'jobserver',
              'lexer',
+             'manifest_cache',
              'manifest_parser',
+             'memstats',
              'metrics',
              'state',
+             'subninja_index',
+             'subprocess',
+             'thread_pool',
+             'trace',
              'util']:
     objs += cxx(name)
 if platform in ('mingw', 'windows'):
+    objs += cxx('jobserver-win32')
     objs += cxx('subprocess-win32')
     if platform == 'windows':
         objs += cxx('includes_normalize-win32')
@@ -285,6 +279,13 @@ if platform in ('mingw', 'windows'):
         objs += cxx('minidump-win32')
     objs += cc('getopt')
 else:
+    objs += cxx('action_cache-posix')
+    objs += cxx('browse-posix')
+    objs += cxx('http_cache-posix')
+    objs += cxx('jobserver-posix')
+    objs += cxx('remote-posix')
+    objs += cxx('server-posix')
+    objs += cxx('status_writer-posix')
     objs += cxx('subprocess-posix')
 if platform == 'windows':
     ninja_lib = n.build(built('ninja.lib'), 'ar', objs)
@@ -296,6 +297,10 @@ if platform == 'windows':
     libs.append('ninja.lib')
 else:
     libs.append('-lninja')
+if platform == 'mingw':
+    libs.append('-lpsapi')
+if platform not in ('mingw', 'windows'):
+    libs.append('-lpthread')
 
 all_targets = []
 
@@ -335,15 +340,29 @@ elif platform == 'windows':
 else:
     test_libs.extend(['-lgtest_main', '-lgtest'])
 
-for name in ['build_log_test',
+for name in ['arena_test',
+             'build_estimate_test',
+             'build_log_test',
              'build_test',
+             'clparser_test',
              'clean_test',
+             'critical_path_test',
              'depfile_parser_test',
+             'deps_log_test',
              'disk_interface_test',
              'edit_distance_test',
+             'eval_env_test',
+             'event_stream_test',
+             'file_watcher_test',
              'graph_test',
+             'graphviz_test',
+             'hash_map_test',
+             'jobserver_test',
              'lexer_test',
+             'manifest_cache_test',
              'manifest_parser_test',
+             'memstats_test',
+             'metrics_test',
              'state_test',
              'subprocess_test',
              'test',
@@ -352,9 +371,11 @@ for name in ['build_log_test',
 if platform == 'windows':
     for name in ['includes_normalize_test', 'msvc_helper_test']:
         objs += cxx(name, variables=[('cflags', test_cflags)])
+else:
+    for name in ['action_cache_test', 'browse_test', 'http_cache_test',
+                 'remote_test', 'status_writer_test']:
+        objs += cxx(name, variables=[('cflags', test_cflags)])
 
-if platform != 'mingw' and platform != 'windows':
-    test_libs.append('-lpthread')
 ninja_test = n.build(binary('ninja_test'), 'link', objs, implicit=ninja_lib,
                      variables=[('ldflags', test_ldflags),
                                 ('libs', test_libs)])
@@ -366,17 +387,40 @@ n.comment('Ancilliary executables.')
 objs = cxx('parser_perftest')
 all_targets += n.build(binary('parser_perftest'), 'link', objs,
                        implicit=ninja_lib, variables=[('libs', libs)])
+objs = cxx('manifest_perftest')
+all_targets += n.build(binary('manifest_perftest'), 'link', objs,
+                       implicit=ninja_lib, variables=[('libs', libs)])
 objs = cxx('build_log_perftest')
 all_targets += n.build(binary('build_log_perftest'), 'link', objs,
                        implicit=ninja_lib, variables=[('libs', libs)])
+objs = cxx('build_perftest')
+all_targets += n.build(binary('build_perftest'), 'link', objs,
+                       implicit=ninja_lib, variables=[('libs', libs)])
 objs = cxx('canon_perftest')
 all_targets += n.build(binary('canon_perftest'), 'link', objs,
                        implicit=ninja_lib, variables=[('libs', libs)])
+if platform == 'windows':
+    objs = cxx('clparser_perftest')
+    all_targets += n.build(binary('clparser_perftest'), 'link', objs,
+                           implicit=ninja_lib, variables=[('libs', libs)])
+if platform not in ('mingw', 'windows'):
+    objs = cxx('subprocess_perftest')
+    all_targets += n.build(binary('subprocess_perftest'), 'link', objs,
+                           implicit=ninja_lib, variables=[('libs', libs)])
 objs = cxx('hash_collision_bench')
 all_targets += n.build(binary('hash_collision_bench'), 'link', objs,
                               implicit=ninja_lib, variables=[('libs', libs)])
 n.newline()
 
+if platform not in ('mingw', 'windows'):
+    n.comment('Time no-op and incremental builds of a generated tree.')
+    n.rule('bench',
+           command='%s %s --ninja ./ninja' % (options.with_python,
+                                              os.path.normpath('misc/bench.py')),
+           description='BENCH')
+    n.build('bench', 'bench', ninja)
+    n.newline()
+
 n.comment('Generate a graph using the "graph" tool.')
 n.rule('gendot',
        command='./ninja -t graph all > $out')
@@ -0,0 +1,269 @@
+#!/usr/bin/env python
+
+# Copyright 2011 Google Inc. All Rights Reserved.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+"""time ninja end to end on a generated build: a no-op build, and the
+builds after touching one header and one source file.
+
+The tree is generated from a seed, so the same options make the same
+tree.  Its commands only write their outputs (and depfiles), so what is
+timed is ninja.  Each run is reported as a line of JSON: wall time,
+user and system time and peak RSS (with its commands'), the commands
+run, and the metrics and counters of -d stats; with strace in the PATH, one more run of each scenario
+counts ninja's system calls.  A line per scenario sums the runs up.
+"""
+
+import json
+import optparse
+import os
+import random
+import re
+import shutil
+import subprocess
+import sys
+import tempfile
+import time
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+import ninja_syntax
+
+
+def write(line):
+    sys.stdout.write(line + '\n')
+    sys.stdout.flush()
+
+
+def generate(options, root):
+    """Write the tree into root, returning the header the most sources
+    include and a source."""
+    rand = random.Random(options.seed)
+    for d in ('src', 'hdr', 'sub'):
+        os.mkdir(os.path.join(root, d))
+    headers = ['hdr/h%d.h' % i for i in range(options.headers)]
+    for h in headers:
+        open(os.path.join(root, h), 'w').close()
+
+    # Each source lists the headers it "includes", which its command
+    # copies into its depfile.
+    sources = []
+    included = {}
+    for i in range(options.edges):
+        src = 'src/d%d/f%d.c' % (i // 100, i)
+        if i % 100 == 0:
+            os.mkdir(os.path.join(root, os.path.dirname(src)))
+        includes = rand.sample(headers, min(options.includes, len(headers)))
+        for h in includes:
+            included[h] = included.get(h, 0) + 1
+        f = open(os.path.join(root, src), 'w')
+        f.write(' '.join(includes) + '\n')
+        f.close()
+        sources.append((src, includes))
+
+    def write_manifest(stale):
+        n = ninja_syntax.Writer(open(os.path.join(root, 'build.ninja'), 'w'))
+        if options.depfiles:
+            n.rule('cc', "{ printf '%s: ' $out; cat $in; } > $out.d && "
+                   'touch $out', depfile='$out.d', deps='gcc')
+        else:
+            n.rule('cc', 'touch $out')
+        n.rule('ar', 'touch $out')
+        n.rule('link', 'touch $out')
+        n.rule('stale', 'touch $out')
+        for i in range(stale):
+            n.build('stale/s%d.o' % i, 'stale')
+
+        # The objects of each 100 sources make a library, whose edges
+        # are in a subninja of their own if there are any.
+        libs = []
+        subninjas = {}
+        for i in range(0, len(sources), 100):
+            lib = 'lib/l%d.a' % (i // 100)
+            w = n
+            if options.subninjas:
+                sub = 'sub/s%d.ninja' % ((i // 100) % options.subninjas)
+                if sub not in subninjas:
+                    subninjas[sub] = ninja_syntax.Writer(
+                        open(os.path.join(root, sub), 'w'))
+                w = subninjas[sub]
+            objs = []
+            for src, includes in sources[i:i + 100]:
+                obj = 'obj/' + src[4:-2] + '.o'
+                w.build(obj, 'cc', src,
+                        implicit=None if options.depfiles else includes)
+                objs.append(obj)
+            w.build(lib, 'ar', objs)
+            libs.append(lib)
+        for sub in sorted(subninjas):
+            n.subninja(sub)
+        n.build('app', 'link', libs)
+        n.default('app')
+        for w in [n] + list(subninjas.values()):
+            w.output.close()
+
+    # The log gets entries for outputs the manifest no longer has, as
+    # the logs of long-lived trees do.
+    if options.stale_log:
+        write_manifest(options.stale_log)
+        run_ninja(options, root, ['stale/s%d.o' % i
+                                  for i in range(options.stale_log)])
+    write_manifest(0)
+
+    header = max(sorted(included), key=lambda h: included[h])
+    return header, sources[0][0]
+
+
+def run_ninja(options, root, args=[], strace=None):
+    """Run ninja in root, returning its output and its rusage."""
+    cmd = [options.ninja, '-C', root] + args
+    if strace:
+        cmd = ['strace', '-c', '-o', strace] + cmd
+    start = time.time()
+    proc = subprocess.Popen(cmd, stdout=subprocess.PIPE,
+                            stderr=subprocess.STDOUT)
+    output = proc.stdout.read().decode('utf-8', 'replace')
+    _, status, usage = os.wait4(proc.pid, 0)
+    wall = time.time() - start
+    proc.returncode = 0  # Reaped already.
+    if status != 0:
+        sys.stderr.write(output)
+        sys.exit('bench: %s failed' % ' '.join(cmd))
+    return output, wall, usage
+
+
+def parse_stats(output):
+    """The metrics and counters -d stats printed in output."""
+    metrics = {}
+    counters = {}
+    table = None
+    for line in output.splitlines():
+        fields = [f.strip() for f in line.split('\t')]
+        if fields[0] in ('metric', 'counter'):
+            table = fields[0]
+            continue
+        if not line.strip():
+            table = None
+        if table is None or len(fields) < 3:
+            continue
+        if table == 'metric':
+            metrics[fields[0]] = {'count': int(fields[1]),
+                                  'total_ms': float(fields[-1])}
+        else:
+            counters[fields[0]] = int(fields[2])
+    return metrics, counters
+
+
+def parse_strace(path):
+    """System call counts from the summary of strace -c."""
+    calls = {}
+    for line in open(path):
+        fields = line.split()
+        # % time, seconds, usecs/call, calls, [errors,] syscall
+        if len(fields) >= 5 and re.match(r'^[\d.]+$', fields[0]):
+            calls[fields[-1]] = int(fields[3])
+    return calls
+
+
+def bench(options, root, name, touch):
+    walls = []
+    for run in range(options.runs):
+        if touch:
+            os.utime(os.path.join(root, touch), None)
+        output, wall, usage = run_ninja(options, root, ['-d', 'stats'])
+        metrics, counters = parse_stats(output)
+        walls.append(wall * 1000)
+        write(json.dumps({
+            'scenario': name,
+            'run': run,
+            'wall_ms': round(wall * 1000, 1),
+            'user_ms': round(usage.ru_utime * 1000, 1),
+            'sys_ms': round(usage.ru_stime * 1000, 1),
+            'maxrss_kb': usage.ru_maxrss,
+            'commands': len(re.findall(r'^\[\d+/\d+\]', output, re.M)),
+            'metrics': metrics,
+            'counters': counters,
+        }, sort_keys=True))
+
+    syscalls = None
+    if options.strace:
+        if touch:
+            os.utime(os.path.join(root, touch), None)
+        trace = os.path.join(root, '.strace')
+        run_ninja(options, root, strace=trace)
+        syscalls = parse_strace(trace)
+        os.unlink(trace)
+
+    walls.sort()
+    write(json.dumps({
+        'scenario': name,
+        'summary': True,
+        'wall_ms_min': round(walls[0], 1),
+        'wall_ms_median': round(walls[len(walls) // 2], 1),
+        'syscalls': syscalls,
+    }, sort_keys=True))
+
+
+def main():
+    parser = optparse.OptionParser(usage='%prog [options]')
+    parser.add_option('--ninja', default='./ninja',
+                      help='the ninja binary to time [%default]')
+    parser.add_option('--edges', type='int', default=10000,
+                      help='compile edges [%default]')
+    parser.add_option('--headers', type='int', default=1000,
+                      help='headers to include [%default]')
+    parser.add_option('--includes', type='int', default=50,
+                      help='headers each source includes [%default]')
+    parser.add_option('--no-depfiles', dest='depfiles',
+                      action='store_false', default=True,
+                      help='list headers in the manifest, rather than in '
+                      'depfiles kept in the deps log')
+    parser.add_option('--subninjas', type='int', default=0,
+                      help='spread the compile edges over this many '
+                      'subninjas [%default]')
+    parser.add_option('--stale-log', type='int', default=0,
+                      help='build log entries of outputs no longer in the '
+                      'manifest [%default]')
+    parser.add_option('--runs', type='int', default=5,
+                      help='runs of each scenario [%default]')
+    parser.add_option('--seed', type='int', default=1,
+                      help='the seed of the tree [%default]')
+    parser.add_option('--dir', help='generate the tree here, and keep it')
+    (options, args) = parser.parse_args()
+    if args:
+        parser.error('unexpected arguments: %s' % ' '.join(args))
+    options.ninja = os.path.abspath(options.ninja)
+    options.strace = any(
+        os.access(os.path.join(d, 'strace'), os.X_OK)
+        for d in os.environ.get('PATH', '').split(os.pathsep))
+
+    root = options.dir or tempfile.mkdtemp(prefix='ninja-bench.')
+    if options.dir:
+        os.makedirs(root)
+    try:
+        header, source = generate(options, root)
+        config = dict((k, getattr(options, k)) for k in (
+            'edges', 'headers', 'includes', 'depfiles', 'subninjas',
+            'stale_log', 'runs', 'seed'))
+        write(json.dumps({'config': config}, sort_keys=True))
+        run_ninja(options, root)
+        bench(options, root, 'noop', None)
+        bench(options, root, 'touch-header', header)
+        bench(options, root, 'touch-leaf', source)
+    finally:
+        if not options.dir:
+            shutil.rmtree(root)
+
+
+if __name__ == '__main__':
+    main()
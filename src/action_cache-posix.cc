@@ -0,0 +1,548 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "action_cache.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/fs.h>
+#endif
+
+#include <algorithm>
+
+#include "build_log.h"
+#include "depfile_parser.h"
+#include "disk_interface.h"
+#include "graph.h"
+#include "http_cache.h"
+
+// Layout of the cache directory:
+// - deps/KEY: the files the depfile of the command under the first key
+//   listed, one per line;
+// - entries/KEY: a directory with the outputs of the command under the
+//   second key, named by their index, and the depfile after them.
+// Reading a file or directory marks it used, by its mtime.
+//
+// On the remote cache server, "ac/KEY" under the first key is the list
+// of deps as above; under the second key it has a line for each file of
+// the entry, "-" if the command didn't write it, or the name of its
+// contents, "cas/HASH-SIZE", and its mode in octal.
+
+namespace {
+
+string KeyName(uint64_t key) {
+  char name[20];
+  snprintf(name, sizeof(name), "%016llx", (unsigned long long)key);
+  return name;
+}
+
+/// The lines of \a contents, a list written by Store().
+vector<string> SplitLines(const string& contents) {
+  vector<string> lines;
+  for (size_t start = 0, end; start < contents.size(); start = end + 1) {
+    end = contents.find('\n', start);
+    if (end == string::npos)
+      end = contents.size();
+    lines.push_back(contents.substr(start, end - start));
+  }
+  return lines;
+}
+
+/// \a str quoted for /bin/sh.
+string ShellQuote(const string& str) {
+  string quoted = "'";
+  for (size_t i = 0; i < str.size(); ++i) {
+    if (str[i] == '\'')
+      quoted += "'\\''";
+    else
+      quoted += str[i];
+  }
+  return quoted + "'";
+}
+
+void PutU64(string* buf, uint64_t value) {
+  buf->append((const char*)&value, sizeof(value));
+}
+
+/// The files a command writes that the cache keeps: its outputs, then
+/// its depfile, which Builder::FinishEdge() reads after it.
+vector<string> CachedFiles(Edge* edge) {
+  vector<string> files;
+  for (vector<Node*>::iterator i = edge->outputs_.begin();
+       i != edge->outputs_.end(); ++i) {
+    files.push_back((*i)->path());
+  }
+  string depfile = edge->EvaluateDepFile();
+  if (!depfile.empty())
+    files.push_back(depfile);
+  return files;
+}
+
+/// Copy \a from to a new file \a to, sharing its blocks if the file
+/// system can.
+bool CopyFile(const string& from, const string& to) {
+  int in = open(from.c_str(), O_RDONLY);
+  if (in < 0)
+    return false;
+  struct stat st;
+  if (fstat(in, &st) < 0) {
+    close(in);
+    return false;
+  }
+  unlink(to.c_str());
+  int out = open(to.c_str(), O_WRONLY | O_CREAT | O_TRUNC, st.st_mode & 0777);
+  if (out < 0) {
+    close(in);
+    return false;
+  }
+  bool ok = false;
+#ifdef FICLONE
+  ok = ioctl(out, FICLONE, in) == 0;
+#endif
+  if (!ok) {
+    ok = true;
+    char buf[64 << 10];
+    ssize_t len;
+    while ((len = read(in, buf, sizeof(buf))) != 0) {
+      if (len < 0 && errno == EINTR)
+        continue;
+      if (len < 0 || write(out, buf, len) != len) {
+        ok = false;
+        break;
+      }
+    }
+  }
+  close(in);
+  if (close(out) < 0)
+    ok = false;
+  if (!ok)
+    unlink(to.c_str());
+  return ok;
+}
+
+/// Remove \a path, and everything under it if it is a directory.
+void RemoveTree(const string& path) {
+  struct stat st;
+  if (lstat(path.c_str(), &st) < 0)
+    return;
+  if (S_ISDIR(st.st_mode)) {
+    if (DIR* dir = opendir(path.c_str())) {
+      while (struct dirent* entry = readdir(dir)) {
+        string name = entry->d_name;
+        if (name != "." && name != "..")
+          RemoveTree(path + "/" + name);
+      }
+      closedir(dir);
+    }
+    rmdir(path.c_str());
+  } else {
+    unlink(path.c_str());
+  }
+}
+
+/// The bytes used by the files at or under \a path.
+int64_t TreeSize(const string& path) {
+  struct stat st;
+  if (lstat(path.c_str(), &st) < 0)
+    return 0;
+  if (!S_ISDIR(st.st_mode))
+    return st.st_size;
+  int64_t size = 0;
+  if (DIR* dir = opendir(path.c_str())) {
+    while (struct dirent* entry = readdir(dir)) {
+      string name = entry->d_name;
+      if (name != "." && name != "..")
+        size += TreeSize(path + "/" + name);
+    }
+    closedir(dir);
+  }
+  return size;
+}
+
+/// A file or entry of the cache, for Trim().
+struct Item {
+  string path;
+  int64_t size;
+  time_t used;
+  bool operator<(const Item& other) const { return used < other.used; }
+};
+
+}  // anonymous namespace
+
+ActionCache::ActionCache(const string& dir, int64_t max_size)
+    : hits_(0), misses_(0), stored_(0), remote_lookups_(0), remote_hits_(0),
+      uploads_(0), dir_(dir), max_size_(max_size) {
+  mkdir(dir_.c_str(), 0777);
+  mkdir((dir_ + "/deps").c_str(), 0777);
+  mkdir((dir_ + "/entries").c_str(), 0777);
+}
+
+uint64_t ActionCache::Digest(const string& path) {
+  struct stat st;
+  if (stat(path.c_str(), &st) < 0 || !S_ISREG(st.st_mode))
+    return 0;
+  // Whole seconds would miss a file rewritten, at the same size, in the
+  // second it was digested.
+  int64_t mtime = StatTimestamp(st);
+  map<string, Digested>::iterator i = digests_.find(path);
+  if (i != digests_.end() && i->second.mtime == mtime &&
+      i->second.size == (int64_t)st.st_size) {
+    return i->second.digest;
+  }
+  string contents, err;
+  if (::ReadFile(path, &contents, &err) < 0)
+    return 0;
+  Digested digested;
+  digested.mtime = mtime;
+  digested.size = st.st_size;
+  // 0 is for files that aren't there.
+  digested.digest = BuildLog::LogEntry::HashCommand(contents) | 1;
+  digests_[path] = digested;
+  return digested.digest;
+}
+
+uint64_t ActionCache::InputsKey(Edge* edge) {
+  string buf;
+  PutU64(&buf, edge->GetCommandHash());
+  // Those the depfile named last time, if known, are left to the second
+  // key, so that the first is the same whether they are known or not.
+  // Order-only inputs only say what must be built first; what the
+  // command reads of them its depfile says too.
+  EdgeInputs::iterator end =
+      edge->inputs_.end() - edge->order_only_deps_ - edge->depfile_deps_;
+  for (EdgeInputs::iterator i = edge->inputs_.begin(); i != end; ++i) {
+    buf += (*i)->path();
+    buf += '\0';
+    PutU64(&buf, Digest((*i)->path()));
+  }
+  return BuildLog::LogEntry::HashCommand(buf);
+}
+
+uint64_t ActionCache::EntryKey(uint64_t inputs_key,
+                               const vector<string>& deps) {
+  string buf;
+  PutU64(&buf, inputs_key);
+  for (vector<string>::const_iterator i = deps.begin(); i != deps.end(); ++i) {
+    buf += *i;
+    buf += '\0';
+    PutU64(&buf, Digest(*i));
+  }
+  return BuildLog::LogEntry::HashCommand(buf);
+}
+
+bool ActionCache::Restore(Edge* edge) {
+  uint64_t inputs_key = InputsKey(edge);
+  string deps_path = dir_ + "/deps/" + KeyName(inputs_key);
+  string contents, err;
+  if (::ReadFile(deps_path, &contents, &err) < 0) {
+    ++misses_;
+    pending_[edge] = inputs_key;
+    return false;
+  }
+  vector<string> deps = SplitLines(contents);
+  string entry = dir_ + "/entries/" + KeyName(EntryKey(inputs_key, deps));
+
+  struct stat st;
+  if (stat(entry.c_str(), &st) < 0) {
+    ++misses_;
+    pending_[edge] = inputs_key;
+    return false;
+  }
+  vector<string> files = CachedFiles(edge);
+  for (size_t i = 0; i < files.size(); ++i) {
+    char name[16];
+    snprintf(name, sizeof(name), "/%d", (int)i);
+    string from = entry + name;
+    if (access(from.c_str(), F_OK) < 0) {
+      // The command didn't write it.
+      unlink(files[i].c_str());
+      continue;
+    }
+    if (!CopyFile(from, files[i])) {
+      ++misses_;
+      pending_[edge] = inputs_key;
+      return false;
+    }
+  }
+  utimes(entry.c_str(), NULL);
+  utimes(deps_path.c_str(), NULL);
+  ++hits_;
+  return true;
+}
+
+void ActionCache::Store(Edge* edge) {
+  map<Edge*, uint64_t>::iterator pending = pending_.find(edge);
+  if (pending == pending_.end())
+    return;
+  uint64_t inputs_key = pending->second;
+  pending_.erase(pending);
+  bool upload = remote() && !fetched_.erase(edge);
+
+  vector<string> files = CachedFiles(edge);
+  vector<string> deps;
+  if (!edge->rule().depfile().empty()) {
+    string contents, err;
+    if (::ReadFile(files.back(), &contents, &err) < 0)
+      return;
+    DepfileParser parser;
+    if (!parser.Parse(&contents, &err))
+      return;
+    for (vector<StringPiece>::iterator i = parser.ins_.begin();
+         i != parser.ins_.end(); ++i) {
+      string path = i->AsString();
+      if (CanonicalizePath(&path, &err))
+        deps.push_back(path);
+    }
+  }
+
+  uint64_t entry_key = EntryKey(inputs_key, deps);
+  string entry = dir_ + "/entries/" + KeyName(entry_key);
+  if (access(entry.c_str(), F_OK) == 0)
+    return;
+  string temp = dir_ + "/entries/tmp.XXXXXX";
+  if (!mkdtemp(&temp[0]))
+    return;
+  for (size_t i = 0; i < files.size(); ++i) {
+    char name[16];
+    snprintf(name, sizeof(name), "/%d", (int)i);
+    if (access(files[i].c_str(), F_OK) < 0)
+      continue;
+    if (!CopyFile(files[i], temp + name)) {
+      RemoveTree(temp);
+      return;
+    }
+  }
+  if (rename(temp.c_str(), entry.c_str()) < 0) {
+    // Another build stored it first.
+    RemoveTree(temp);
+    return;
+  }
+
+  string list;
+  for (vector<string>::iterator i = deps.begin(); i != deps.end(); ++i) {
+    if (!list.empty())
+      list += '\n';
+    list += *i;
+  }
+  string deps_path = dir_ + "/deps/" + KeyName(inputs_key);
+  string temp_deps = deps_path + ".tmp";
+  FILE* f = fopen(temp_deps.c_str(), "wb");
+  if (!f)
+    return;
+  bool written = fwrite(list.data(), 1, list.size(), f) == list.size();
+  if (fclose(f) != 0 || !written || rename(temp_deps.c_str(),
+                                           deps_path.c_str()) < 0) {
+    unlink(temp_deps.c_str());
+    return;
+  }
+  ++stored_;
+  if (upload)
+    StartUpload(inputs_key, entry_key, (int)files.size());
+}
+
+void ActionCache::SetRemote(const string& url, const string& ninja_command) {
+  remote_url_ = url;
+  ninja_command_ = ninja_command;
+}
+
+string ActionCache::FetchCommand(Edge* edge) {
+  map<Edge*, uint64_t>::iterator pending = pending_.find(edge);
+  if (!remote() || pending == pending_.end())
+    return "";
+  ++remote_lookups_;
+  string command = ShellQuote(ninja_command_) + " -t remote-cache fetch " +
+      ShellQuote(remote_url_) + " " + ShellQuote(dir_) + " " +
+      KeyName(pending->second);
+  vector<string> files = CachedFiles(edge);
+  for (vector<string>::iterator i = files.begin(); i != files.end(); ++i)
+    command += " " + ShellQuote(*i);
+  return command;
+}
+
+void ActionCache::Fetched(Edge* edge) {
+  ++remote_hits_;
+  fetched_.insert(edge);
+}
+
+void ActionCache::StartUpload(uint64_t inputs_key, uint64_t entry_key,
+                              int count) {
+  char count_str[16];
+  snprintf(count_str, sizeof(count_str), "%d", count);
+  string inputs_name = KeyName(inputs_key), entry_name = KeyName(entry_key);
+  const char* argv[] = {
+    ninja_command_.c_str(), "-t", "remote-cache", "store",
+    remote_url_.c_str(), dir_.c_str(), inputs_name.c_str(),
+    entry_name.c_str(), count_str, NULL
+  };
+
+  // Twice forked, so that the upload outlives the build without being
+  // left for it to wait for.
+  pid_t pid = fork();
+  if (pid < 0)
+    return;
+  if (pid == 0) {
+    setsid();
+    if (fork() == 0) {
+      int null_fd = open("/dev/null", O_RDWR);
+      if (null_fd >= 0) {
+        dup2(null_fd, 0);
+        dup2(null_fd, 1);
+        dup2(null_fd, 2);
+      }
+      // The build blocks the signals it handles, and the mask is kept
+      // across exec.
+      sigset_t set;
+      sigemptyset(&set);
+      sigprocmask(SIG_SETMASK, &set, NULL);
+      execvp(argv[0], const_cast<char**>(argv));
+    }
+    _exit(0);
+  }
+  waitpid(pid, NULL, 0);
+  ++uploads_;
+}
+
+int ActionCache::FetchRemote(const string& url, uint64_t inputs_key,
+                             const vector<string>& files, string* err) {
+  HttpCacheClient client;
+  if (!client.Init(url, err))
+    return -1;
+  string contents;
+  int found = client.Get("ac/" + KeyName(inputs_key), &contents, err);
+  if (found <= 0)
+    return found;
+  uint64_t entry_key = EntryKey(inputs_key, SplitLines(contents));
+  found = client.Get("ac/" + KeyName(entry_key), &contents, err);
+  if (found <= 0)
+    return found;
+  vector<string> lines = SplitLines(contents);
+  if (lines.size() != files.size())
+    return 0;
+  for (size_t i = 0; i < files.size(); ++i) {
+    if (lines[i] == "-") {
+      // The command didn't write it.
+      unlink(files[i].c_str());
+      continue;
+    }
+    size_t space = lines[i].find(' ');
+    if (space == string::npos)
+      return 0;
+    int mode = (int)strtol(lines[i].c_str() + space + 1, NULL, 8);
+    found = client.GetFile(lines[i].substr(0, space), files[i], mode, err);
+    if (found <= 0)
+      return found;
+  }
+  return 1;
+}
+
+bool ActionCache::UploadRemote(const string& url, uint64_t inputs_key,
+                               uint64_t entry_key, int count, string* err) {
+  HttpCacheClient client;
+  if (!client.Init(url, err))
+    return false;
+  string entry = dir_ + "/entries/" + KeyName(entry_key);
+  string list;
+  for (int i = 0; i < count; ++i) {
+    if (i > 0)
+      list += '\n';
+    char name[16];
+    snprintf(name, sizeof(name), "/%d", i);
+    string path = entry + name;
+    struct stat st;
+    if (stat(path.c_str(), &st) < 0) {
+      list += "-";
+      continue;
+    }
+    string contents;
+    if (::ReadFile(path, &contents, err) < 0)
+      return false;
+    char blob[64];
+    snprintf(blob, sizeof(blob), "cas/%016llx-%llu",
+             (unsigned long long)BuildLog::LogEntry::HashCommand(contents),
+             (unsigned long long)contents.size());
+    // Contents many entries share, like those of an empty file, go once.
+    int have = client.Head(blob, err);
+    if (have < 0 || (have == 0 && !client.Put(blob, contents, err)))
+      return false;
+    char mode[16];
+    snprintf(mode, sizeof(mode), " %o", (int)(st.st_mode & 0777));
+    list += blob;
+    list += mode;
+  }
+  string deps;
+  if (::ReadFile(dir_ + "/deps/" + KeyName(inputs_key), &deps, err) < 0)
+    return false;
+  // The entry before the list that leads to it.
+  return client.Put("ac/" + KeyName(entry_key), list, err) &&
+         client.Put("ac/" + KeyName(inputs_key), deps, err);
+}
+
+void ActionCache::Trim() {
+  vector<Item> items;
+  int64_t total = 0;
+  const char* kSubdirs[] = { "/deps", "/entries" };
+  for (size_t d = 0; d < sizeof(kSubdirs) / sizeof(kSubdirs[0]); ++d) {
+    string subdir = dir_ + kSubdirs[d];
+    DIR* dir = opendir(subdir.c_str());
+    if (!dir)
+      continue;
+    while (struct dirent* entry = readdir(dir)) {
+      string name = entry->d_name;
+      if (name == "." || name == "..")
+        continue;
+      Item item;
+      item.path = subdir + "/" + name;
+      struct stat st;
+      if (lstat(item.path.c_str(), &st) < 0)
+        continue;
+      item.used = st.st_mtime;
+      item.size = TreeSize(item.path);
+      total += item.size;
+      items.push_back(item);
+    }
+    closedir(dir);
+  }
+  if (total <= max_size_)
+    return;
+
+  // Go down to a little under the limit, so as not to trim again on the
+  // next build.
+  int64_t target = max_size_ - max_size_ / 10;
+  sort(items.begin(), items.end());
+  for (vector<Item>::iterator i = items.begin();
+       i != items.end() && total > target; ++i) {
+    RemoveTree(i->path);
+    total -= i->size;
+  }
+}
+
+void ActionCache::Report() const {
+  printf("action cache: %d restored, %d not found, %d stored\n", hits_,
+         misses_, stored_);
+  if (remote()) {
+    printf("remote cache: %d looked up, %d fetched, %d uploads started\n",
+           remote_lookups_, remote_hits_, uploads_);
+  }
+}
@@ -0,0 +1,142 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef NINJA_ACTION_CACHE_H_
+#define NINJA_ACTION_CACHE_H_
+
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+using namespace std;
+
+#include "util.h"  // int64_t
+
+struct Edge;
+
+/// A cache of the outputs of commands, so that a command run before on
+/// the same inputs, e.g. on another branch, needn't run again: its
+/// outputs are copied out of the cache instead.
+///
+/// An entry is found in two steps.  The first key hashes the command and
+/// the contents of the inputs the manifest gives it; under it the cache
+/// keeps the list of the files the command's depfile said it read last
+/// time.  The entry itself is under a second key, which adds the contents
+/// of those files, so that a command whose headers changed isn't taken
+/// for one whose didn't, even in a build that doesn't know its headers
+/// yet.
+///
+/// Outputs are copied rather than linked, as commands may write their
+/// outputs in place (a compiler truncates the object file it writes);
+/// where the file system can share the copy's blocks (reflinks on
+/// Linux), that is as cheap.
+///
+/// The cache can have a remote backend, an HTTP cache server shared with
+/// other machines, which is looked in when the outputs aren't here.  The
+/// build doesn't wait for it: a lookup runs as a process of its own,
+/// "ninja -t remote-cache fetch", beside the commands running, and writes
+/// the outputs it finds straight to where they go; what is stored here is
+/// uploaded by a process left running in the background.  On the server
+/// the same two keys name "ac/KEY", the list of files read and the
+/// entry, and each file of an entry is stored once, by the hash of its
+/// contents, as "cas/HASH-SIZE".  POSIX only.
+struct ActionCache {
+  /// Keep the cache in \a dir, which Trim() keeps within \a max_size
+  /// bytes.
+  ActionCache(const string& dir, int64_t max_size);
+
+  /// Copy the outputs of \a edge's command out of the cache, if there.
+  /// If not, remember the key to Store() them under once the command
+  /// has run.
+  bool Restore(Edge* edge);
+
+  /// Store the outputs of \a edge's command, which has just succeeded,
+  /// unless they were just restored.  Must be called before its depfile
+  /// is removed.
+  void Store(Edge* edge);
+
+  /// Also look in, and upload to, the HTTP cache server at \a url, with
+  /// \a ninja_command's "-t remote-cache".
+  void SetRemote(const string& url, const string& ninja_command);
+  bool remote() const { return !remote_url_.empty(); }
+
+  /// The command that looks for the outputs of \a edge's command in the
+  /// remote cache, after Restore() didn't find them here, and writes them
+  /// if found; it exits with 0 if it did.  Empty if there is nothing to
+  /// look for.
+  string FetchCommand(Edge* edge);
+
+  /// The command of FetchCommand() found \a edge's outputs: Store() them
+  /// here, but don't upload them back.
+  void Fetched(Edge* edge);
+
+  /// For "ninja -t remote-cache fetch": write \a files, the outputs and
+  /// depfile of the command under \a inputs_key, from the server at
+  /// \a url.  Returns 1, 0 if the server doesn't have them, or -1
+  /// filling in \a err.
+  int FetchRemote(const string& url, uint64_t inputs_key,
+                  const vector<string>& files, string* err);
+
+  /// For "ninja -t remote-cache store": upload the entry stored here
+  /// under \a inputs_key and \a entry_key, of \a count files, to the
+  /// server at \a url.
+  bool UploadRemote(const string& url, uint64_t inputs_key,
+                    uint64_t entry_key, int count, string* err);
+
+  /// Remove the entries least recently used until the cache is within
+  /// its size.
+  void Trim();
+
+  /// Print how often the cache was used, for -d stats.
+  void Report() const;
+
+  /// Edges restored, not found and stored.
+  int hits_;
+  int misses_;
+  int stored_;
+  /// Edges looked up in the remote cache, found there and uploaded.
+  int remote_lookups_;
+  int remote_hits_;
+  int uploads_;
+
+ private:
+  /// The hash of the contents of \a path, or 0 if it can't be read.
+  uint64_t Digest(const string& path);
+  /// The first key, from the command and the inputs in the manifest.
+  uint64_t InputsKey(Edge* edge);
+  /// The key of the entry, from \a inputs_key and the files in \a deps.
+  uint64_t EntryKey(uint64_t inputs_key, const vector<string>& deps);
+  /// Start "ninja -t remote-cache store" for the entry just stored, and
+  /// don't wait for it.
+  void StartUpload(uint64_t inputs_key, uint64_t entry_key, int count);
+
+  string dir_;
+  int64_t max_size_;
+  /// The first key of each command running whose outputs weren't there.
+  map<Edge*, uint64_t> pending_;
+  /// Those of pending_ whose outputs came from the remote cache.
+  set<Edge*> fetched_;
+  string remote_url_;
+  string ninja_command_;
+  /// Digest() of each path, with the mtime (in nanoseconds, as
+  /// TimeStamp) and size it had.
+  struct Digested {
+    int64_t mtime;
+    int64_t size;
+    uint64_t digest;
+  };
+  map<string, Digested> digests_;
+};
+
+#endif  // NINJA_ACTION_CACHE_H_
@@ -0,0 +1,245 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "action_cache.h"
+
+#include <dirent.h>
+#include <signal.h>
+#include <stdio.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "disk_interface.h"
+#include "graph.h"
+#include "http_cache.h"
+#include "state.h"
+#include "test.h"
+
+namespace {
+
+struct ActionCacheTest : public StateTestWithBuiltinRules {
+  virtual void SetUp() {
+    temp_dir_.CreateAndEnter("ninja_action_cache_test");
+    ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"rule cc\n"
+"  command = cc $in -o $out\n"
+"  depfile = $out.d\n"
+"build out.o: cc in.c\n"
+"build other.o: cat in.c\n"));
+    edge_ = GetNode("out.o")->in_edge();
+  }
+  virtual void TearDown() {
+    temp_dir_.Cleanup();
+  }
+
+  /// Write the files out.o's command writes, as if it had run.
+  void RunCommand(const string& output, const string& header) {
+    ASSERT_TRUE(disk_.WriteFile("out.o", output));
+    ASSERT_TRUE(disk_.WriteFile("out.o.d", "out.o: in.c " + header + "\n"));
+  }
+
+  string Read(const string& path) {
+    string err;
+    return disk_.ReadFile(path, &err);
+  }
+
+  ScopedTempDir temp_dir_;
+  RealDiskInterface disk_;
+  Edge* edge_;
+};
+
+TEST_F(ActionCacheTest, StoreAndRestore) {
+  ASSERT_TRUE(disk_.WriteFile("in.c", "int main;"));
+  ASSERT_TRUE(disk_.WriteFile("a.h", "#define A 1"));
+  {
+    ActionCache cache("cache", 1 << 20);
+    EXPECT_FALSE(cache.Restore(edge_));
+    RunCommand("object", "a.h");
+    cache.Store(edge_);
+    EXPECT_EQ(1, cache.stored_);
+  }
+
+  unlink("out.o");
+  unlink("out.o.d");
+  ActionCache cache("cache", 1 << 20);
+  EXPECT_TRUE(cache.Restore(edge_));
+  EXPECT_EQ("object", Read("out.o"));
+  EXPECT_EQ("out.o: in.c a.h\n", Read("out.o.d"));
+  // Nothing to store for a command that didn't run.
+  cache.Store(edge_);
+  EXPECT_EQ(0, cache.stored_);
+
+  // Another command on the same input is another entry.
+  EXPECT_FALSE(cache.Restore(GetNode("other.o")->in_edge()));
+  EXPECT_EQ(1, cache.hits_);
+  EXPECT_EQ(1, cache.misses_);
+}
+
+TEST_F(ActionCacheTest, ChangedInputs) {
+  ASSERT_TRUE(disk_.WriteFile("in.c", "int main;"));
+  ASSERT_TRUE(disk_.WriteFile("a.h", "#define A 1"));
+  {
+    ActionCache cache("cache", 1 << 20);
+    EXPECT_FALSE(cache.Restore(edge_));
+    RunCommand("object", "a.h");
+    cache.Store(edge_);
+  }
+
+  // A header only the depfile names, which the build doesn't know of.
+  ASSERT_TRUE(disk_.WriteFile("a.h", "#define A 2"));
+  {
+    ActionCache cache("cache", 1 << 20);
+    EXPECT_FALSE(cache.Restore(edge_));
+    RunCommand("object 2", "a.h");
+    cache.Store(edge_);
+  }
+
+  // Both versions are kept.
+  ASSERT_TRUE(disk_.WriteFile("a.h", "#define A 1"));
+  {
+    ActionCache cache("cache", 1 << 20);
+    EXPECT_TRUE(cache.Restore(edge_));
+    EXPECT_EQ("object", Read("out.o"));
+  }
+
+  ASSERT_TRUE(disk_.WriteFile("in.c", "int main2;"));
+  ActionCache cache("cache", 1 << 20);
+  EXPECT_FALSE(cache.Restore(edge_));
+}
+
+TEST_F(ActionCacheTest, RewrittenAtSameSize) {
+  ASSERT_TRUE(disk_.WriteFile("in.c", "int main;"));
+  ASSERT_TRUE(disk_.WriteFile("a.h", "#define A 1"));
+  ActionCache cache("cache", 1 << 20);
+  EXPECT_FALSE(cache.Restore(edge_));
+  RunCommand("object", "a.h");
+  cache.Store(edge_);
+  unlink("out.o");
+  EXPECT_TRUE(cache.Restore(edge_));
+
+  // Most likely in the same second as it was digested, which mustn't
+  // keep the old digest.
+  usleep(50 * 1000);
+  ASSERT_TRUE(disk_.WriteFile("in.c", "int mian;"));
+  EXPECT_FALSE(cache.Restore(edge_));
+}
+
+TEST_F(ActionCacheTest, Trim) {
+  ASSERT_TRUE(disk_.WriteFile("in.c", "int main;"));
+  ASSERT_TRUE(disk_.WriteFile("a.h", "#define A 1"));
+  {
+    ActionCache cache("cache", 1);
+    EXPECT_FALSE(cache.Restore(edge_));
+    RunCommand("object", "a.h");
+    cache.Store(edge_);
+    cache.Trim();
+  }
+  ActionCache cache("cache", 1);
+  EXPECT_FALSE(cache.Restore(edge_));
+}
+
+TEST_F(ActionCacheTest, Remote) {
+  ASSERT_TRUE(disk_.WriteFile("in.c", "int main;"));
+  ASSERT_TRUE(disk_.WriteFile("a.h", "#define A 1"));
+
+  // A port unlikely to be in use, so that tests run side by side don't
+  // collide.
+  int port = 20000 + (getpid() + 13) % 20000;
+  pid_t server = fork();
+  ASSERT_LE(0, server);
+  if (server == 0) {
+    string err;
+    _exit(ServeHttpCache("localhost", port, "served", &err) ? 0 : 1);
+  }
+  char url[64];
+  snprintf(url, sizeof(url), "http://localhost:%d", port);
+
+  // Stored on one machine...
+  uint64_t inputs_key, entry_key;
+  {
+    ActionCache cache("cache", 1 << 20);
+    EXPECT_FALSE(cache.Restore(edge_));
+    RunCommand("object", "a.h");
+    cache.Store(edge_);
+    ASSERT_EQ(1, cache.stored_);
+  }
+  {
+    // ...whose entry is the only one there.
+    ActionCache cache("cache", 1 << 20);
+    EXPECT_TRUE(cache.Restore(edge_));
+    cache.SetRemote(url, "ninja");
+    EXPECT_EQ("", cache.FetchCommand(edge_));
+  }
+  vector<string> files;
+  files.push_back("out.o");
+  files.push_back("out.o.d");
+  string err;
+  // The keys, as the remote cache, knowing nothing yet, can't tell them.
+  {
+    ActionCache cache("cache2", 1 << 20);
+    EXPECT_FALSE(cache.Restore(edge_));
+    cache.SetRemote(url, "ninja");
+    string fetch = cache.FetchCommand(edge_);
+    size_t start = fetch.find("'cache2' ") + 9;
+    inputs_key = strtoull(fetch.c_str() + start, NULL, 16);
+    EXPECT_EQ("'ninja' -t remote-cache fetch '" + string(url) +
+              "' 'cache2' " + fetch.substr(start, 16) +
+              " 'out.o' 'out.o.d'", fetch);
+  }
+  int found = -1;
+  for (int tries = 0; tries < 100 && found < 0; ++tries) {
+    ActionCache cache("cache2", 1 << 20);
+    found = cache.FetchRemote(url, inputs_key, files, &err);
+    if (found < 0)
+      usleep(20 * 1000);
+  }
+  EXPECT_EQ(0, found);
+
+  DIR* dir = opendir("cache/entries");
+  ASSERT_TRUE(dir != NULL);
+  entry_key = 0;
+  while (struct dirent* entry = readdir(dir)) {
+    if (entry->d_name[0] != '.')
+      entry_key = strtoull(entry->d_name, NULL, 16);
+  }
+  closedir(dir);
+  {
+    ActionCache cache("cache", 1 << 20);
+    EXPECT_TRUE(cache.UploadRemote(url, inputs_key, entry_key, 2, &err))
+        << err;
+  }
+
+  // ...and fetched on another.
+  unlink("out.o");
+  unlink("out.o.d");
+  {
+    ActionCache cache("cache2", 1 << 20);
+    EXPECT_EQ(1, cache.FetchRemote(url, inputs_key, files, &err)) << err;
+    EXPECT_EQ("object", Read("out.o"));
+    EXPECT_EQ("out.o: in.c a.h\n", Read("out.o.d"));
+  }
+
+  // Not if a header changed.
+  ASSERT_TRUE(disk_.WriteFile("a.h", "#define A 2"));
+  {
+    ActionCache cache("cache2", 1 << 20);
+    EXPECT_EQ(0, cache.FetchRemote(url, inputs_key, files, &err));
+  }
+
+  kill(server, SIGTERM);
+  int status;
+  waitpid(server, &status, 0);
+}
+
+}  // anonymous namespace
@@ -0,0 +1,60 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "arena.h"
+
+#include <stdlib.h>
+
+#include "util.h"
+
+// make_pair() takes it by reference, so it needs a definition.
+const size_t Arena::kBlockSize;
+
+Arena::~Arena() {
+  for (vector<pair<char*, size_t> >::iterator i = blocks_.begin();
+       i != blocks_.end(); ++i) {
+    free(i->first);
+  }
+}
+
+size_t Arena::bytes_allocated() const {
+  size_t total = 0;
+  for (vector<pair<char*, size_t> >::const_iterator i = blocks_.begin();
+       i != blocks_.end(); ++i) {
+    total += i->second;
+  }
+  return total;
+}
+
+void* Arena::AllocateSlow(size_t size) {
+  // Large requests get a block of their own so as not to waste the
+  // rest of the current one.
+  if (size > kBlockSize / 4) {
+    char* block = (char*)malloc(size);
+    if (!block)
+      Fatal("out of memory");
+    blocks_.push_back(make_pair(block, size));
+    bytes_used_ += size;
+    return block;
+  }
+
+  char* block = (char*)malloc(kBlockSize);
+  if (!block)
+    Fatal("out of memory");
+  blocks_.push_back(make_pair(block, kBlockSize));
+  next_ = block + size;
+  remaining_ = kBlockSize - size;
+  bytes_used_ += size;
+  return block;
+}
@@ -0,0 +1,63 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef NINJA_ARENA_H_
+#define NINJA_ARENA_H_
+
+#include <stddef.h>
+
+#include <vector>
+using namespace std;
+
+/// A bump allocator: memory is carved out of large blocks and only freed,
+/// all at once, when the Arena is destroyed.  Destructors of objects
+/// placed in it aren't run unless the owner does so.
+struct Arena {
+  Arena() : next_(NULL), remaining_(0), bytes_used_(0) {}
+  ~Arena();
+
+  /// Return \a size bytes suitably aligned for any object.
+  void* Allocate(size_t size) {
+    size = (size + kAlignment - 1) & ~(kAlignment - 1);
+    if (size > remaining_)
+      return AllocateSlow(size);
+    char* result = next_;
+    next_ += size;
+    remaining_ -= size;
+    bytes_used_ += size;
+    return result;
+  }
+
+  /// Bytes handed out by Allocate().
+  size_t bytes_used() const { return bytes_used_; }
+  /// Bytes obtained from the system, including unused tails of blocks.
+  size_t bytes_allocated() const;
+
+ private:
+  static const size_t kAlignment = 8;
+  static const size_t kBlockSize = 256 * 1024;
+
+  void* AllocateSlow(size_t size);
+
+  char* next_;
+  size_t remaining_;
+  size_t bytes_used_;
+  /// Each block with its size.
+  vector<pair<char*, size_t> > blocks_;
+
+  Arena(const Arena&);
+  void operator=(const Arena&);
+};
+
+#endif  // NINJA_ARENA_H_
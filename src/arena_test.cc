@@ -0,0 +1,57 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "arena.h"
+
+#include <string.h>
+
+#include <gtest/gtest.h>
+
+namespace {
+
+TEST(Arena, Alignment) {
+  Arena arena;
+  char* a = (char*)arena.Allocate(1);
+  char* b = (char*)arena.Allocate(3);
+  EXPECT_EQ(0u, (size_t)a % 8);
+  EXPECT_EQ(0u, (size_t)b % 8);
+  EXPECT_EQ(a + 8, b);
+  EXPECT_EQ(16u, arena.bytes_used());
+}
+
+TEST(Arena, ManyBlocks) {
+  Arena arena;
+  const size_t kSize = 1000;
+  vector<char*> allocated;
+  for (int i = 0; i < 1000; ++i) {
+    char* p = (char*)arena.Allocate(kSize);
+    memset(p, i & 0xff, kSize);
+    allocated.push_back(p);
+  }
+  for (int i = 0; i < 1000; ++i)
+    EXPECT_EQ((char)(i & 0xff), allocated[i][kSize - 1]);
+  EXPECT_EQ(1000 * 1000u, arena.bytes_used());
+  EXPECT_GE(arena.bytes_allocated(), arena.bytes_used());
+}
+
+TEST(Arena, LargeAllocation) {
+  Arena arena;
+  char* small = (char*)arena.Allocate(16);
+  char* large = (char*)arena.Allocate(1 << 20);
+  memset(large, 0, 1 << 20);
+  // The current block is still used for small allocations.
+  EXPECT_EQ(small + 16, (char*)arena.Allocate(16));
+}
+
+}  // anonymous namespace
@@ -0,0 +1,257 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "browse.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <set>
+#include <vector>
+
+#include "graph.h"
+#include "remote.h"
+#include "state.h"
+#include "util.h"
+
+namespace {
+
+const char kPageHeader[] =
+"<!DOCTYPE html>\n"
+"<style>\n"
+"body {\n"
+"    font-family: sans;\n"
+"    font-size: 0.8em;\n"
+"    margin: 4ex;\n"
+"}\n"
+"h1 {\n"
+"    font-weight: normal;\n"
+"    font-size: 140%;\n"
+"    text-align: center;\n"
+"    margin: 0;\n"
+"}\n"
+"h2 {\n"
+"    font-weight: normal;\n"
+"    font-size: 120%;\n"
+"}\n"
+"tt {\n"
+"    font-family: WebKitHack, monospace;\n"
+"    white-space: nowrap;\n"
+"}\n"
+".filelist {\n"
+"  -webkit-columns: auto 2;\n"
+"}\n"
+"</style>\n";
+
+string HtmlEscape(const string& s) {
+  string out;
+  for (string::const_iterator i = s.begin(); i != s.end(); ++i) {
+    switch (*i) {
+    case '&': out += "&amp;"; break;
+    case '<': out += "&lt;"; break;
+    case '>': out += "&gt;"; break;
+    case '"': out += "&quot;"; break;
+    default: out += *i;
+    }
+  }
+  return out;
+}
+
+/// \a s %-escaped for the query of a URL, leaving '/' readable.
+string UrlEncode(const string& s) {
+  string out;
+  for (string::const_iterator i = s.begin(); i != s.end(); ++i) {
+    unsigned char c = *i;
+    if (isalnum(c) || strchr("-_.~/", c)) {
+      out += c;
+    } else {
+      char buf[4];
+      snprintf(buf, sizeof(buf), "%%%02X", c);
+      out += buf;
+    }
+  }
+  return out;
+}
+
+string UrlDecode(const string& s) {
+  string out;
+  for (size_t i = 0; i < s.size(); ++i) {
+    if (s[i] == '%' && i + 2 < s.size() && isxdigit(s[i + 1]) &&
+        isxdigit(s[i + 2])) {
+      out += (char)strtol(s.substr(i + 1, 2).c_str(), NULL, 16);
+      i += 2;
+    } else {
+      out += s[i];
+    }
+  }
+  return out;
+}
+
+/// A list of links to the pages of \a files, sorted, each followed by
+/// the note paired with it.
+string FileList(vector<pair<string, string> >* files) {
+  sort(files->begin(), files->end());
+  string html = "<div class=filelist>\n";
+  for (vector<pair<string, string> >::iterator i = files->begin();
+       i != files->end(); ++i) {
+    html += "<tt><a href=\"?" + HtmlEscape(UrlEncode(i->first)) + "\">" +
+        HtmlEscape(i->first) + "</a>" + i->second + "</tt><br>\n";
+  }
+  return html + "</div>\n";
+}
+
+/// Start a web browser on \a url, not waiting for it.
+void OpenBrowser(const string& url) {
+  // Nothing else is run, so children needn't be waited for.
+  signal(SIGCHLD, SIG_IGN);
+  if (fork() != 0)
+    return;
+  int null_fd = open("/dev/null", O_RDWR);
+  dup2(null_fd, 1);
+  dup2(null_fd, 2);
+#ifdef __APPLE__
+  execlp("open", "open", url.c_str(), (char*)NULL);
+#else
+  execlp("xdg-open", "xdg-open", url.c_str(), (char*)NULL);
+#endif
+  _exit(1);
+}
+
+/// Answer the one request read from \a fd.
+void ServeRequest(int fd, State* state, const string& initial_target) {
+  string request;
+  while (request.find("\r\n\r\n") == string::npos) {
+    char buf[4096];
+    ssize_t len = read(fd, buf, sizeof(buf));
+    if (len < 0 && errno == EINTR)
+      continue;
+    if (len <= 0 || request.size() > (64 << 10))
+      return;
+    request.append(buf, len);
+  }
+
+  // "GET /?path HTTP/1.1"
+  size_t space = request.find(' ');
+  size_t space2 = space == string::npos ? string::npos :
+      request.find(' ', space + 1);
+  string target = space2 == string::npos ? "" :
+      request.substr(space + 1, space2 - space - 1);
+  string status = "200 OK";
+  string headers = "Content-Type: text/html; charset=utf-8\r\n";
+  string body;
+  if (request.compare(0, space, "GET") != 0) {
+    status = "405 Method Not Allowed";
+  } else if (target == "/") {
+    status = "302 Found";
+    headers = "Location: /?" + UrlEncode(initial_target) + "\r\n";
+  } else if (target.compare(0, 2, "/?") == 0) {
+    body = BrowsePage(state, UrlDecode(target.substr(2)));
+  } else {
+    status = "404 Not Found";
+  }
+
+  char length[48];
+  snprintf(length, sizeof(length), "Content-Length: %d\r\n",
+           (int)body.size());
+  string response = "HTTP/1.0 " + status + "\r\n" + headers + length +
+      "Connection: close\r\n\r\n" + body;
+  SendAll(fd, response.data(), response.size());
+}
+
+}  // anonymous namespace
+
+string BrowsePage(State* state, const string& path) {
+  string page = kPageHeader;
+  page += "<h1><tt>" + HtmlEscape(path) + "</tt></h1>\n";
+  Node* node = state->LookupNode(path);
+  if (!node) {
+    page += "<h2>unknown path</h2>\n";
+    return page;
+  }
+
+  Edge* edge = node->in_edge();
+  if (edge && !edge->inputs_.empty()) {
+    page += "<h2>target is built using rule <tt>" +
+        HtmlEscape(edge->rule().name()) + "</tt> of</h2>\n";
+    vector<pair<string, string> > inputs;
+    for (size_t i = 0; i < edge->inputs_.size(); ++i) {
+      const char* note = "";
+      if (edge->is_implicit(i))
+        note = " (implicit)";
+      else if (edge->is_order_only(i))
+        note = " (order-only)";
+      inputs.push_back(make_pair(edge->inputs_[i]->path(), note));
+    }
+    page += FileList(&inputs);
+  }
+
+  // The edges using the file are summarized by what they build.
+  set<string> seen;
+  vector<pair<string, string> > outputs;
+  for (vector<Edge*>::const_iterator e = node->out_edges().begin();
+       e != node->out_edges().end(); ++e) {
+    for (vector<Node*>::iterator out = (*e)->outputs_.begin();
+         out != (*e)->outputs_.end(); ++out) {
+      if (seen.insert((*out)->path()).second)
+        outputs.push_back(make_pair((*out)->path(), ""));
+    }
+  }
+  if (!outputs.empty()) {
+    page += "<h2>dependent edges build:</h2>\n";
+    page += FileList(&outputs);
+  }
+  return page;
+}
+
+bool RunBrowse(State* state, int port, const string& initial_target,
+               bool open_browser, string* err) {
+  int listen_fd = ListenTcp("localhost", port, err);
+  if (listen_fd < 0)
+    return false;
+
+  char url[64];
+  snprintf(url, sizeof(url), "http://localhost:%d", port);
+  printf("Web server running on %s, ctl-C to abort...\n", url);
+  fflush(stdout);
+  if (open_browser)
+    OpenBrowser(url);
+
+  // One request at a time, each on a connection of its own: pages are
+  // quick to make, and nothing needs locking.
+  for (;;) {
+    int fd = accept(listen_fd, NULL, NULL);
+    if (fd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      *err = string("accept: ") + strerror(errno);
+      close(listen_fd);
+      return false;
+    }
+    SetCloseOnExec(fd);
+    // Don't let a client that went quiet hold up the others.
+    struct timeval timeout = { 10, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    ServeRequest(fd, state, initial_target);
+    close(fd);
+  }
+}
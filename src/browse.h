@@ -15,13 +15,20 @@
 #ifndef NINJA_BROWSE_H_
 #define NINJA_BROWSE_H_
 
+#include <string>
+using namespace std;
+
 struct State;
 
-/// Run in "browse" mode, which execs a Python webserver.
-/// \a ninja_command is the command used to invoke ninja.
-/// \a initial_target is the first target to load.
-/// This function does not return if it runs successfully.
-void RunBrowsePython(State* state, const char* ninja_command,
-                     const char* initial_target);
+/// The HTML page of "browse" mode for the file \a path: the rule building
+/// it and its inputs, and what the edges using it build.
+string BrowsePage(State* state, const string& path);
+
+/// Run in "browse" mode: serve pages of \a state's graph over HTTP on
+/// \a port, one request at a time, starting from \a initial_target, and
+/// open a web browser on them if \a open_browser.  Returns false, filling
+/// in \a err, if it can't; otherwise runs until interrupted.  POSIX only.
+bool RunBrowse(State* state, int port, const string& initial_target,
+               bool open_browser, string* err);
 
 #endif  // NINJA_BROWSE_H_
@@ -0,0 +1,55 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "browse.h"
+
+#include "test.h"
+
+struct BrowseTest : public StateTestWithBuiltinRules {
+  virtual void SetUp() {
+    ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"build out: cat b a | gen.h || dir\n"
+"build a&b: cat out\n"
+"build c: cat out\n"));
+  }
+};
+
+TEST_F(BrowseTest, Inputs) {
+  string page = BrowsePage(&state_, "out");
+  EXPECT_NE(string::npos, page.find("<h1><tt>out</tt></h1>"));
+  EXPECT_NE(string::npos, page.find("rule <tt>cat</tt> of"));
+  // Sorted, with how each is used.
+  size_t a = page.find("<a href=\"?a\">a</a></tt>");
+  size_t b = page.find("<a href=\"?b\">b</a></tt>");
+  ASSERT_NE(string::npos, a);
+  ASSERT_NE(string::npos, b);
+  EXPECT_LT(a, b);
+  EXPECT_NE(string::npos,
+            page.find("<a href=\"?dir\">dir</a> (order-only)</tt>"));
+  EXPECT_NE(string::npos,
+            page.find("<a href=\"?gen.h\">gen.h</a> (implicit)</tt>"));
+}
+
+TEST_F(BrowseTest, Outputs) {
+  string page = BrowsePage(&state_, "out");
+  EXPECT_NE(string::npos, page.find("dependent edges build:"));
+  // Escaped for the URL and the HTML.
+  EXPECT_NE(string::npos, page.find("<a href=\"?a%26b\">a&amp;b</a>"));
+  EXPECT_NE(string::npos, page.find("<a href=\"?c\">c</a>"));
+
+  page = BrowsePage(&state_, "c");
+  EXPECT_EQ(string::npos, page.find("dependent edges build:"));
+  page = BrowsePage(&state_, "nonesuch");
+  EXPECT_NE(string::npos, page.find("unknown path"));
+}
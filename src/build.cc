@@ -15,14 +15,15 @@
 #include "build.h"
 
 #include <assert.h>
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #ifdef _WIN32
 #include <windows.h>
 #else
 #include <unistd.h>
-#include <sys/ioctl.h>
 #include <sys/time.h>
 #endif
 
@@ -30,18 +31,48 @@
 #include <sys/termios.h>
 #endif
 
+#include <algorithm>
+
+#ifndef _WIN32
+#include "action_cache.h"
+#endif
 #include "build_log.h"
+#include "clparser.h"
+#include "depfile_parser.h"
+#include "deps_log.h"
 #include "disk_interface.h"
+#include "event_stream.h"
 #include "graph.h"
+#include "jobserver.h"
+#include "remote.h"
 #include "state.h"
 #include "subprocess.h"
+#include "thread_pool.h"
+#include "trace.h"
+#ifndef _WIN32
+#include "status_writer.h"
+#endif
 #include "util.h"
 
+namespace {
+
+/// How long the status line on a smart terminal is shown at least, so
+/// that it isn't redrawn at every edge started and finished: a terminal
+/// over a slow connection can't keep up with that.
+const int64_t kStatusIntervalMillis = 50;
+
+/// What a command that failed in the last build adds to its critical
+/// time, and so to those of the commands it waits on: more than a build
+/// takes, so that they all go before any other.
+const int64_t kFailedLastTime = (int64_t)1 << 40;
+
+}  // anonymous namespace
+
 BuildStatus::BuildStatus(const BuildConfig& config)
     : config_(config),
       start_time_millis_(GetTimeMillis()),
       started_edges_(0), finished_edges_(0), total_edges_(0),
-      have_blank_line_(true), progress_status_format_(NULL),
+      have_blank_line_(true), writer_(NULL), progress_status_format_(NULL),
       overall_rate_(), current_rate_(config.parallelism) {
 #ifndef _WIN32
   const char* term = getenv("TERM");
@@ -64,17 +95,37 @@ BuildStatus::BuildStatus(const BuildConfig& config)
   progress_status_format_ = getenv("NINJA_STATUS");
   if (!progress_status_format_)
     progress_status_format_ = "[%s/%t] ";
+
+#ifndef _WIN32
+  if (smart_terminal_) {
+    fflush(stdout);
+    writer_ = new StatusWriter(1, kStatusIntervalMillis);
+  }
+#endif
+}
+
+BuildStatus::~BuildStatus() {
+#ifndef _WIN32
+  delete writer_;
+#endif
 }
 
 void BuildStatus::PlanHasTotalEdges(int total) {
+  if (config_.events && total != total_edges_)
+    config_.events->PlanHasTotalEdges(total);
   total_edges_ = total;
 }
 
 void BuildStatus::BuildEdgeStarted(Edge* edge) {
   int start_time = (int)(GetTimeMillis() - start_time_millis_);
-  running_edges_.insert(make_pair(edge, start_time));
+  if ((size_t)edge->id() >= start_times_.size())
+    start_times_.resize(edge->id() + 1);
+  start_times_[edge->id()] = start_time;
   ++started_edges_;
 
+  if (config_.events)
+    config_.events->EdgeStarted(edge, start_time);
+
   PrintStatus(edge);
 }
 
@@ -86,10 +137,13 @@ void BuildStatus::BuildEdgeFinished(Edge* edge,
   int64_t now = GetTimeMillis();
   ++finished_edges_;
 
-  RunningEdgeMap::iterator i = running_edges_.find(edge);
-  *start_time = i->second;
+  *start_time = start_times_[edge->id()];
   *end_time = (int)(now - start_time_millis_);
-  running_edges_.erase(i);
+
+  if (config_.events) {
+    config_.events->EdgeFinished(edge, success, *start_time, *end_time,
+                                 output);
+  }
 
   if (config_.verbosity == BuildConfig::QUIET)
     return;
@@ -98,12 +152,13 @@ void BuildStatus::BuildEdgeFinished(Edge* edge,
     PrintStatus(edge);
 
   if (!success || !output.empty()) {
+    string text;
     if (smart_terminal_)
-      printf("\n");
+      text = "\n";
 
     // Print the command that is spewing before printing its output.
     if (!success)
-      printf("FAILED: %s\n", edge->EvaluateCommand().c_str());
+      text += "FAILED: " + edge->EvaluateCommand() + "\n";
 
     // ninja sets stdout and stderr of subprocesses to a pipe, to be able to
     // check if the output is empty. Some compilers, e.g. clang, check
@@ -117,22 +172,41 @@ void BuildStatus::BuildEdgeFinished(Edge* edge,
     // only a few hundred available on some systems, and ninja can launch
     // thousands of parallel compile commands.)
     // TODO: There should be a flag to disable escape code stripping.
-    string final_output;
     if (!smart_terminal_)
-      final_output = StripAnsiEscapeCodes(output);
+      text += StripAnsiEscapeCodes(output);
     else
-      final_output = output;
+      text += output;
 
-    if (!final_output.empty())
-      printf("%s", final_output.c_str());
+    PrintOutput(text);
 
     have_blank_line_ = true;
   }
 }
 
+void BuildStatus::BuildEdgeDropped(Edge* edge) {
+  // It is counted again when it starts again.
+  --started_edges_;
+}
+
 void BuildStatus::BuildFinished() {
-  if (smart_terminal_ && !have_blank_line_)
-    printf("\n");
+  if (smart_terminal_ && !have_blank_line_) {
+    PrintOutput("\n");
+    have_blank_line_ = true;
+  }
+#ifndef _WIN32
+  if (writer_)
+    writer_->Flush();
+#endif
+}
+
+void BuildStatus::PrintOutput(const string& text) {
+#ifndef _WIN32
+  if (writer_) {
+    writer_->Write(text);
+    return;
+  }
+#endif
+  printf("%s", text.c_str());
 }
 
 string BuildStatus::FormatProgressStatus(
@@ -218,14 +292,12 @@ void BuildStatus::PrintStatus(Edge* edge) {
   GetConsoleScreenBufferInfo(console_, &csbi);
 #endif
 
+#ifdef _WIN32
   if (smart_terminal_) {
-#ifndef _WIN32
-    printf("\r");  // Print over previous line, if any.
-#else
     csbi.dwCursorPosition.X = 0;
     SetConsoleCursorPosition(console_, csbi.dwCursorPosition);
-#endif
   }
+#endif
 
   if (finished_edges_ == 0) {
     overall_rate_.Restart();
@@ -233,26 +305,18 @@ void BuildStatus::PrintStatus(Edge* edge) {
   }
   to_print = FormatProgressStatus(progress_status_format_) + to_print;
 
+#ifdef _WIN32
   if (smart_terminal_ && !force_full_command) {
-#ifndef _WIN32
-    // Limit output to width of the terminal if provided so we don't cause
-    // line-wrapping.
-    winsize size;
-    if ((ioctl(0, TIOCGWINSZ, &size) == 0) && size.ws_col) {
-      to_print = ElideMiddle(to_print, size.ws_col);
-    }
-#else
     // Don't use the full width or console will move to next line.
     size_t width = static_cast<size_t>(csbi.dwSize.X) - 1;
     to_print = ElideMiddle(to_print, width);
-#endif
   }
+#endif
 
   if (smart_terminal_ && !force_full_command) {
 #ifndef _WIN32
-    printf("%s", to_print.c_str());
-    printf("\x1B[K");  // Clear to end of line.
-    fflush(stdout);
+    // Drawn over the previous line, limited to the width of the terminal.
+    writer_->SetStatus(to_print);
     have_blank_line_ = false;
 #else
     // We don't want to have the cursor spamming back and forth, so
@@ -281,42 +345,70 @@ void BuildStatus::PrintStatus(Edge* edge) {
   }
 }
 
-Plan::Plan() : command_edges_(0), wanted_edges_(0) {}
+Plan::Plan() : speculate_(false), fallback_duration_(1), command_edges_(0),
+               wanted_edges_(0) {}
 
 bool Plan::AddTarget(Node* node, string* err) {
-  vector<Node*> stack;
-  return AddSubTarget(node, &stack, err);
+  AddStack stack;
+  bool added = AddSubTarget(node, &stack, err);
+
+  // Go through the inputs of the edges on the stack depth first, without
+  // recursing, as chains of edges can be very long.
+  while (!stack.empty()) {
+    Edge* edge = stack.back().first->in_edge();
+    size_t next = stack.back().second++;
+    if (next == edge->inputs_.size()) {
+      // All inputs are in; the edge comes after the ones making them.
+      adding_[edge->id()] = false;
+      planned_.push_back(edge);
+      stack.pop_back();
+      continue;
+    }
+    if (!AddSubTarget(edge->inputs_[next], &stack, err) && !err->empty()) {
+      for (AddStack::iterator i = stack.begin(); i != stack.end(); ++i)
+        adding_[i->first->in_edge()->id()] = false;
+      return false;
+    }
+  }
+  return added;
 }
 
-bool Plan::AddSubTarget(Node* node, vector<Node*>* stack, string* err) {
+bool Plan::AddSubTarget(Node* node, AddStack* stack, string* err) {
   Edge* edge = node->in_edge();
   if (!edge) {  // Leaf node.
     if (node->dirty()) {
       string referenced;
       if (!stack->empty())
-        referenced = ", needed by '" + stack->back()->path() + "',";
+        referenced = ", needed by '" + stack->back().first->path() + "',";
       *err = "'" + node->path() + "'" + referenced + " missing "
              "and no known rule to make it";
     }
     return false;
   }
 
-  if (CheckDependencyCycle(node, stack, err))
+  size_t id = edge->id();
+  if (id < adding_.size() && adding_[id]) {
+    ReportDependencyCycle(node, stack, err);
     return false;
+  }
 
   if (edge->outputs_ready())
     return false;  // Don't need to do anything.
 
-  // If an entry in want_ does not already exist for edge, create an entry which
-  // maps to false, indicating that we do not want to build this entry itself.
-  pair<map<Edge*, bool>::iterator, bool> want_ins =
-    want_.insert(make_pair(edge, false));
-  bool& want = want_ins.first->second;
+  // If the edge isn't in the plan yet, add it, not wanting to build it
+  // itself for now.
+  if (id >= want_.size()) {
+    want_.resize(id + 1, kNotPlanned);
+    adding_.resize(id + 1, false);
+  }
+  bool newly_planned = want_[id] == kNotPlanned;
+  if (newly_planned)
+    want_[id] = kWantNothing;
 
   // If we do need to build edge and we haven't already marked it as wanted,
   // mark it now.
-  if (node->dirty() && !want) {
-    want = true;
+  if (node->dirty() && want_[id] != kWantToBuild) {
+    want_[id] = kWantToBuild;
     ++wanted_edges_;
     if (edge->AllInputsReady())
       ready_.insert(edge);
@@ -324,56 +416,190 @@ bool Plan::AddSubTarget(Node* node, vector<Node*>* stack, string* err) {
       ++command_edges_;
   }
 
-  if (!want_ins.second)
+  if (!newly_planned)
     return true;  // We've already processed the inputs.
 
-  stack->push_back(node);
-  for (vector<Node*>::iterator i = edge->inputs_.begin();
-       i != edge->inputs_.end(); ++i) {
-    if (!AddSubTarget(*i, stack, err) && !err->empty())
-      return false;
-  }
-  assert(stack->back() == node);
-  stack->pop_back();
-
+  adding_[id] = true;
+  stack->push_back(make_pair(node, 0));
   return true;
 }
 
-bool Plan::CheckDependencyCycle(Node* node, vector<Node*>* stack, string* err) {
-  vector<Node*>::reverse_iterator ri =
-      find(stack->rbegin(), stack->rend(), node);
-  if (ri == stack->rend())
-    return false;
+void Plan::ReportDependencyCycle(Node* node, AddStack* stack, string* err) {
+  // The cycle starts where the stack reaches node's edge, perhaps through
+  // another of its outputs; name node there too, so that the cycle is
+  // seen to close.
+  AddStack::iterator start = stack->begin();
+  while (start->first->in_edge() != node->in_edge())
+    ++start;
+
+  *err = "dependency cycle: " + node->path();
+  for (AddStack::iterator i = start + 1; i != stack->end(); ++i)
+    err->append(" -> " + i->first->path());
+  err->append(" -> " + node->path());
+}
 
-  // Add this node onto the stack to make it clearer where the loop
-  // is.
-  stack->push_back(node);
+void Plan::ComputeCriticalPath(BuildLog* build_log) {
+  // Look up how long each command took last time.
+  // Until then, -1 stands for unknown.
+  vector<int64_t> durations(want_.size(), -1);
+  int64_t known_total = 0;
+  int known_count = 0;
+  for (vector<Edge*>::iterator i = planned_.begin(); i != planned_.end();
+       ++i) {
+    Edge* edge = *i;
+    if (want(edge) == kNotPlanned)
+      continue;
+    if (edge->is_phony()) {
+      durations[edge->id()] = 0;
+      continue;
+    }
+    int64_t duration = build_log ? build_log->LastDuration(edge) : -1;
+    if (duration >= 0) {
+      durations[edge->id()] = duration;
+      known_total += duration;
+      ++known_count;
+    }
+  }
 
-  vector<Node*>::iterator start = find(stack->begin(), stack->end(), node);
-  *err = "dependency cycle: ";
-  for (vector<Node*>::iterator i = start; i != stack->end(); ++i) {
-    if (i != start)
-      err->append(" -> ");
-    err->append((*i)->path());
+  // Edges that haven't run before get the average; with no history at
+  // all, every command counts the same.
+  fallback_duration_ = known_count ? known_total / known_count : 1;
+  for (vector<int64_t>::iterator i = durations.begin(); i != durations.end();
+       ++i) {
+    if (*i < 0)
+      *i = fallback_duration_;
   }
-  return true;
+
+  // Commands that failed last time, and those they wait on, go first,
+  // so that a build still broken fails within seconds.
+  for (vector<Edge*>::iterator i = planned_.begin(); i != planned_.end();
+       ++i) {
+    Edge* edge = *i;
+    if (build_log && want(edge) != kNotPlanned && !edge->is_phony() &&
+        build_log->LastFailed(edge)) {
+      durations[edge->id()] += kFailedLastTime;
+    }
+  }
+
+  // The order of ready_ depends on the times, so build it anew.
+  vector<Edge*> ready(ready_.begin(), ready_.end());
+  ready_.clear();
+
+  // Each edge is planned after those making its inputs, so going
+  // backwards, the times of all the edges waiting on it are known.
+  for (vector<Edge*>::reverse_iterator i = planned_.rbegin();
+       i != planned_.rend(); ++i) {
+    Edge* edge = *i;
+    if (want(edge) == kNotPlanned)
+      continue;
+    int64_t longest_dependent = 0;
+    for (vector<Node*>::iterator o = edge->outputs_.begin();
+         o != edge->outputs_.end(); ++o) {
+      for (vector<Edge*>::const_iterator d = (*o)->out_edges().begin();
+           d != (*o)->out_edges().end(); ++d) {
+        if (want(*d) != kNotPlanned)
+          longest_dependent = max(longest_dependent, (*d)->critical_time_);
+      }
+    }
+    edge->critical_time_ = durations[edge->id()] + longest_dependent;
+  }
+  ready_.insert(ready.begin(), ready.end());
 }
 
 Edge* Plan::FindWork() {
-  if (ready_.empty())
-    return NULL;
-  set<Edge*>::iterator i = ready_.begin();
-  Edge* edge = *i;
-  ready_.erase(i);
-  return edge;
+  while (!ready_.empty()) {
+    set<Edge*, EdgeCriticalPathCmp>::iterator i = ready_.begin();
+    Edge* edge = *i;
+    ready_.erase(i);
+    // Edges whose pool is full wait in it until it has room again.
+    if (!edge->pool_->HasRoomFor(edge)) {
+      edge->pool_->DelayEdge(edge);
+      continue;
+    }
+    edge->pool_->EdgeScheduled(edge);
+    // Those waiting on a restat edge may go ahead of it.
+    if (speculate_ && edge->rule().restat()) {
+      for (vector<Node*>::iterator i = edge->outputs_.begin();
+           i != edge->outputs_.end(); ++i) {
+        AddSpeculable(*i);
+      }
+    }
+    return edge;
+  }
+  return NULL;
+}
+
+void Plan::DeferWork(Edge* edge) {
+  edge->pool_->EdgeFinished(edge);
+  ready_.insert(edge);
+}
+
+Edge* Plan::FindSpeculativeWork() {
+  while (!speculable_.empty()) {
+    set<Edge*, EdgeCriticalPathCmp>::iterator i = speculable_.begin();
+    Edge* edge = *i;
+    speculable_.erase(i);
+    if (!CanSpeculate(edge) || !edge->pool_->HasRoomFor(edge))
+      continue;
+    edge->pool_->EdgeScheduled(edge);
+    if ((size_t)edge->id() >= speculation_.size())
+      speculation_.resize(edge->id() + 1, kNotSpeculated);
+    speculation_[edge->id()] = kSpeculating;
+    return edge;
+  }
+  return NULL;
+}
+
+void Plan::DropSpeculation(Edge* edge) {
+  speculation_[edge->id()] = kSpeculated;
+  edge->pool_->EdgeFinished(edge);
+  edge->pool_->RetrieveReadyEdges(&ready_);
+  if (want(edge) == kWantToBuild && edge->AllInputsReady())
+    ready_.insert(edge);
+}
+
+bool Plan::CanSpeculate(const Edge* edge) const {
+  size_t id = edge->id();
+  if (want(edge) != kWantToBuild || edge->is_phony() ||
+      (id < speculation_.size() && speculation_[id] != kNotSpeculated))
+    return false;
+  // Each input not ready must be one a restat edge, ready itself, would
+  // most likely leave as it is: it is there already.
+  bool waiting = false;
+  for (EdgeInputs::const_iterator i = edge->inputs_.begin();
+       i != edge->inputs_.end(); ++i) {
+    Edge* in_edge = (*i)->in_edge();
+    if (!in_edge || in_edge->outputs_ready())
+      continue;
+    if (in_edge->is_phony() || !in_edge->rule().restat() ||
+        want(in_edge) != kWantToBuild || !in_edge->AllInputsReady() ||
+        !(*i)->exists())
+      return false;
+    waiting = true;
+  }
+  return waiting;
+}
+
+void Plan::AddSpeculable(Node* node) {
+  for (vector<Edge*>::const_iterator i = node->out_edges().begin();
+       i != node->out_edges().end(); ++i) {
+    if (CanSpeculate(*i))
+      speculable_.insert(*i);
+  }
 }
 
 void Plan::EdgeFinished(Edge* edge) {
-  map<Edge*, bool>::iterator i = want_.find(edge);
-  assert(i != want_.end());
-  if (i->second)
+  Want edge_want = want(edge);
+  assert(edge_want != kNotPlanned);
+  if (edge_want == kWantToBuild) {
     --wanted_edges_;
-  want_.erase(i);
+    // Only edges we wanted ran, taking up room in their pool.
+    edge->pool_->EdgeFinished(edge);
+    edge->pool_->RetrieveReadyEdges(&ready_);
+  }
+  want_[edge->id()] = kNotPlanned;
+  if (speculating(edge))
+    speculation_[edge->id()] = kSpeculated;
   edge->outputs_ready_ = true;
 
   // Check off any nodes we were waiting for with this edge.
@@ -383,69 +609,94 @@ void Plan::EdgeFinished(Edge* edge) {
   }
 }
 
+void Plan::EdgeFailed(Edge* edge) {
+  if (speculating(edge))
+    speculation_[edge->id()] = kSpeculated;
+  edge->pool_->EdgeFinished(edge);
+  edge->pool_->RetrieveReadyEdges(&ready_);
+}
+
 void Plan::NodeFinished(Node* node) {
   // See if we we want any edges from this node.
   for (vector<Edge*>::const_iterator i = node->out_edges().begin();
        i != node->out_edges().end(); ++i) {
-    map<Edge*, bool>::iterator want_i = want_.find(*i);
-    if (want_i == want_.end())
+    Want edge_want = want(*i);
+    if (edge_want == kNotPlanned)
       continue;
 
     // See if the edge is now ready.
     if ((*i)->AllInputsReady()) {
-      if (want_i->second) {
-        ready_.insert(*i);
+      if (edge_want == kWantToBuild) {
+        // One run early is the Builder's to finish.
+        if (!speculating(*i))
+          ready_.insert(*i);
       } else {
         // We do not need to build this edge, but we might need to build one of
         // its dependents.
         EdgeFinished(*i);
       }
+    } else if (speculate_ && edge_want == kWantToBuild && CanSpeculate(*i)) {
+      speculable_.insert(*i);
     }
   }
 }
 
-void Plan::CleanNode(DependencyScan* scan, Node* node) {
-  node->set_dirty(false);
+void Plan::CleanNodes(DependencyScan* scan, const vector<Node*>& nodes) {
+  // Step out from the nodes cleaned, one layer of edges at a time.
+  vector<Node*> cleaned = nodes;
+  while (!cleaned.empty()) {
+    vector<Edge*> edges;
+    set<Edge*> seen;
+    for (vector<Node*>::iterator ni = cleaned.begin(); ni != cleaned.end();
+         ++ni) {
+      (*ni)->set_dirty(false);
+      for (vector<Edge*>::const_iterator ei = (*ni)->out_edges().begin();
+           ei != (*ni)->out_edges().end(); ++ei) {
+        if (seen.insert(*ei).second)
+          edges.push_back(*ei);
+      }
+    }
+    cleaned.clear();
 
-  for (vector<Edge*>::const_iterator ei = node->out_edges().begin();
-       ei != node->out_edges().end(); ++ei) {
-    // Don't process edges that we don't actually want.
-    map<Edge*, bool>::iterator want_i = want_.find(*ei);
-    if (want_i == want_.end() || !want_i->second)
-      continue;
+    for (vector<Edge*>::iterator ei = edges.begin(); ei != edges.end();
+         ++ei) {
+      // Don't process edges that we don't actually want, nor those run
+      // early, whose outputs are being written.
+      if (want(*ei) != kWantToBuild || speculating(*ei))
+        continue;
+
+      // If all non-order-only inputs for this edge are now clean,
+      // we might have changed the dirty state of the outputs.
+      EdgeInputs::iterator begin = (*ei)->inputs_.begin(),
+                           end = (*ei)->inputs_.end() - (*ei)->order_only_deps_;
+      if (find_if(begin, end, mem_fun(&Node::dirty)) != end)
+        continue;
 
-    // If all non-order-only inputs for this edge are now clean,
-    // we might have changed the dirty state of the outputs.
-    vector<Node*>::iterator begin = (*ei)->inputs_.begin(),
-                            end = (*ei)->inputs_.end() - (*ei)->order_only_deps_;
-    if (find_if(begin, end, mem_fun(&Node::dirty)) == end) {
-      // Recompute most_recent_input and command.
+      // Recompute most_recent_input.
       Node* most_recent_input = NULL;
-      for (vector<Node*>::iterator ni = begin; ni != end; ++ni) {
+      for (EdgeInputs::iterator ni = begin; ni != end; ++ni) {
         if (!most_recent_input || (*ni)->mtime() > most_recent_input->mtime())
           most_recent_input = *ni;
       }
-      string command = (*ei)->EvaluateCommand(true);
-
-      // Now, recompute the dirty state of each output.
+      // Now, recompute the dirty state of each output; those clean are
+      // cleaned in the next step.
       bool all_outputs_clean = true;
       for (vector<Node*>::iterator ni = (*ei)->outputs_.begin();
            ni != (*ei)->outputs_.end(); ++ni) {
         if (!(*ni)->dirty())
           continue;
 
-        if (scan->RecomputeOutputDirty(*ei, most_recent_input,
-                                       command, *ni)) {
+        if (scan->RecomputeOutputDirty(*ei, most_recent_input, *ni)) {
           (*ni)->MarkDirty();
           all_outputs_clean = false;
         } else {
-          CleanNode(scan, *ni);
+          cleaned.push_back(*ni);
         }
       }
 
       // If we cleaned all outputs, mark the node as not wanted.
       if (all_outputs_clean) {
-        want_i->second = false;
+        want_[(*ei)->id()] = kWantNothing;
         --wanted_edges_;
         if (!(*ei)->is_phony())
           --command_edges_;
@@ -455,78 +706,737 @@ void Plan::CleanNode(DependencyScan* scan, Node* node) {
 }
 
 void Plan::Dump() {
-  printf("pending: %d\n", (int)want_.size());
-  for (map<Edge*, bool>::iterator i = want_.begin(); i != want_.end(); ++i) {
-    if (i->second)
+  int pending = 0;
+  for (vector<Edge*>::iterator i = planned_.begin(); i != planned_.end(); ++i)
+    pending += want(*i) != kNotPlanned;
+  printf("pending: %d\n", pending);
+  for (vector<Edge*>::iterator i = planned_.begin(); i != planned_.end();
+       ++i) {
+    Want edge_want = want(*i);
+    if (edge_want == kNotPlanned)
+      continue;
+    if (edge_want == kWantToBuild)
       printf("want ");
-    i->first->Dump();
+    (*i)->Dump();
   }
   printf("ready: %d\n", (int)ready_.size());
 }
 
+namespace {
+
+/// Smoothed pressure above which ParallelismController backs off, and
+/// below which it takes on more jobs.
+const double kHighPressure = 0.20;
+const double kLowPressure = 0.05;
+
+/// How often RealCommandRunner samples the pressure, in milliseconds.
+const int64_t kPressureSampleInterval = 250;
+
+}  // anonymous namespace
+
+ParallelismController::ParallelismController(int floor, int ceiling)
+    : floor_(floor), ceiling_(max(floor, ceiling)), parallelism_(ceiling_),
+      pressure_(0.0), samples_(0), lowered_(0), raised_(0),
+      lowest_(ceiling_), first_sample_(0), last_sample_(0),
+      parallelism_time_(0.0) {}
+
+void ParallelismController::Update(double cpu, double io, int running,
+                                   int64_t now) {
+  double pressure = max(cpu, io);
+  if (samples_++ == 0) {
+    first_sample_ = now;
+    pressure_ = pressure;
+  } else {
+    parallelism_time_ += parallelism_ * (double)(now - last_sample_);
+    pressure_ = (pressure_ + pressure) / 2;
+  }
+  last_sample_ = now;
+
+  if (pressure_ > kHighPressure && parallelism_ > floor_) {
+    parallelism_ = max(floor_, parallelism_ - max(1, parallelism_ / 4));
+    lowest_ = min(lowest_, parallelism_);
+    ++lowered_;
+  } else if (pressure_ < kLowPressure && running >= parallelism_ &&
+             parallelism_ < ceiling_) {
+    // Only take on more when the jobs allowed are all in use; otherwise
+    // the low pressure says nothing about running more.
+    ++parallelism_;
+    ++raised_;
+  }
+}
+
+void ParallelismController::Report() const {
+  int64_t elapsed = last_sample_ - first_sample_;
+  double average = elapsed > 0 ? parallelism_time_ / elapsed : parallelism_;
+  printf("adaptive parallelism: %d samples, lowered %d times, "
+         "raised %d times\n", samples_, lowered_, raised_);
+  printf("jobs between %d and %d: average %.1f, lowest %d, last %d "
+         "(pressure %.2f)\n", floor_, ceiling_, average, lowest_,
+         parallelism_, pressure_);
+}
+
 struct RealCommandRunner : public CommandRunner {
-  explicit RealCommandRunner(const BuildConfig& config) : config_(config) {}
-  virtual ~RealCommandRunner() {}
+  RealCommandRunner(const BuildConfig& config, BuildLog* build_log);
+  virtual ~RealCommandRunner() { ReleaseTokens(0); }
   virtual bool CanRunMore();
+  virtual bool CanRunEdge(Edge* edge);
   virtual bool StartCommand(Edge* edge);
   virtual Edge* WaitForCommand(ExitStatus* status, string* output);
+  virtual ResourceUsage LastUsage() { return last_usage_; }
   virtual vector<Edge*> GetActiveEdges();
   virtual void Abort();
+  virtual void Report();
+
+  /// Whether there is room for another command on this machine.
+  bool CanRunLocally();
+
+  /// Whether \a edge's command fits in the memory left.
+  bool FitsInMemory(Edge* edge);
+
+  /// How much memory \a edge's command used last time, or 0 if unknown.
+  int64_t PredictPeakRSS(Edge* edge);
+
+  /// Run \a edge's command on this machine.
+  bool StartLocally(Edge* edge);
+
+  /// Run \a command as \a edge's.
+  bool StartSubprocess(Edge* edge, const string& command);
+
+  /// Done with \a edge's command, which has been waited for.
+  virtual void FinishCommand(Edge* edge);
+
+  /// The commands running on this machine, and finished but not yet
+  /// waited for, counting each batch, open or running, as one.
+  virtual int LocalCommands() {
+    return (int)(subproc_to_edge_.size() - lookups_.size() +
+                 open_batches_.size());
+  }
+
+  /// Whether \a edge's outputs are looked up in the remote cache before
+  /// its command runs.
+  bool LooksUp(Edge* edge);
+
+  /// Start the commands of missed_ there is room for.
+  void StartMissed();
+
+  /// Give jobserver tokens back until \a keep are left.
+  void ReleaseTokens(int keep);
+
+  /// Whether \a edge's command runs in a batch, with others of its rule
+  /// that are ready to start with it, one after another in one shell:
+  /// one started process and pipe rather than one per command, for
+  /// rules with "batch" set whose commands are too quick to be worth
+  /// them.  Each command still runs in a subshell of its own, and its
+  /// exit code and output are told apart in what the shell writes.
+  bool Batches(Edge* edge);
+  /// Whether \a edge can join an open batch, which takes no more room.
+  bool JoinsBatch(Edge* edge);
+  /// Start the open batch of \a rule, or all of them.
+  void StartBatch(const Rule* rule);
+  void StartBatches();
 
   const BuildConfig& config_;
+  BuildLog* build_log_;
   SubprocessSet subprocs_;
   map<Subprocess*, Edge*> subproc_to_edge_;
+
+  /// See BuildConfig::max_memory; 0 for no limit.
+  int64_t memory_limit_;
+  /// The predicted memory use of each running command, and their sum.
+  map<Edge*, int64_t> predicted_rss_;
+  int64_t running_rss_;
+  ResourceUsage last_usage_;
+
+  /// See BuildConfig::adaptive_parallelism.
+  PressureSampler pressure_sampler_;
+  ParallelismController parallelism_;
+  int64_t last_pressure_sample_;
+
+  /// Tokens taken from config_.jobserver, one for each command running
+  /// beyond the first, and perhaps one for a command about to start.
+  int tokens_;
+
+  /// The edges whose outputs are being looked up in the remote cache of
+  /// config_.action_cache.  A lookup takes no room of the commands'.
+  set<Edge*> lookups_;
+  /// Those that weren't found, whose commands run as there is room, ahead
+  /// of new ones.
+  deque<Edge*> missed_;
+  /// Those whose commands failed to start, to report as failed.
+  deque<Edge*> failed_to_start_;
+
+  /// The commands of a batch, how long they took between them last time,
+  /// and what the shell writes after each, before its exit code.
+  struct Batch {
+    Batch() : millis(0), script_size(0) {}
+    vector<Edge*> edges;
+    int64_t millis;
+    size_t script_size;
+    string marker;
+  };
+  /// The batch of each rule still taking commands; each takes a job
+  /// from when it is opened.
+  map<const Rule*, Batch> open_batches_;
+  /// The batches running, by their shell, which subproc_to_edge_ has as
+  /// their first command's.
+  map<Subprocess*, Batch> batches_;
+  /// The commands of finished batches not yet waited for.
+  struct BatchResult {
+    Edge* edge;
+    ExitStatus status;
+    string output;
+  };
+  deque<BatchResult> batch_results_;
+  int batches_started_;
+
+  /// Hand out what each command of \a batch, which \a subproc ran and
+  /// has been waited for, did, through batch_results_.
+  void FinishBatch(Subprocess* subproc, const Batch& batch);
 };
 
+RealCommandRunner::RealCommandRunner(const BuildConfig& config,
+                                     BuildLog* build_log)
+    : config_(config), build_log_(build_log),
+      memory_limit_(config.max_memory), running_rss_(0),
+      parallelism_(1, config.parallelism), last_pressure_sample_(0),
+      tokens_(0), batches_started_(0) {
+  // Where it can't be told, there's no limit.
+  if (memory_limit_ < 0)
+    memory_limit_ = max(GetAvailableMemory(), (int64_t)0);
+  if (config_.numa_placement)
+    subprocs_.SetPlacement(GetNumaNodes());
+  if (config_.adaptive_parallelism) {
+    // The first sample is what the next is measured from.
+    double cpu, io;
+    pressure_sampler_.Sample(&cpu, &io);
+    last_pressure_sample_ = GetTimeMillis();
+  }
+}
+
 vector<Edge*> RealCommandRunner::GetActiveEdges() {
   vector<Edge*> edges;
   for (map<Subprocess*, Edge*>::iterator i = subproc_to_edge_.begin();
-       i != subproc_to_edge_.end(); ++i)
-    edges.push_back(i->second);
+       i != subproc_to_edge_.end(); ++i) {
+    map<Subprocess*, Batch>::iterator batch = batches_.find(i->first);
+    if (batch == batches_.end())
+      edges.push_back(i->second);
+    else
+      edges.insert(edges.end(), batch->second.edges.begin(),
+                   batch->second.edges.end());
+  }
+  for (map<const Rule*, Batch>::iterator i = open_batches_.begin();
+       i != open_batches_.end(); ++i) {
+    edges.insert(edges.end(), i->second.edges.begin(),
+                 i->second.edges.end());
+  }
+  edges.insert(edges.end(), missed_.begin(), missed_.end());
   return edges;
 }
 
 void RealCommandRunner::Abort() {
   subprocs_.Clear();
+  subproc_to_edge_.clear();
+  lookups_.clear();
+  missed_.clear();
+  failed_to_start_.clear();
+  open_batches_.clear();
+  batches_.clear();
+  batch_results_.clear();
+  ReleaseTokens(0);
+  predicted_rss_.clear();
+  running_rss_ = 0;
+}
+
+void RealCommandRunner::Report() {
+  if (config_.adaptive_parallelism)
+    parallelism_.Report();
 }
 
+void RealCommandRunner::ReleaseTokens(int keep) {
+  for (; tokens_ > keep; --tokens_)
+    config_.jobserver->Release();
+}
+
+namespace {
+
+/// How many lookups in the remote cache run at once, at most.
+const size_t kMaxLookups = 32;
+
+/// When a batch starts without waiting for more commands: once they took
+/// this long last time, or its script is this big, well within the
+/// longest argument Linux takes.
+const int64_t kMaxBatchMillis = 500;
+const size_t kMaxBatchScript = 64 << 10;
+
+}  // anonymous namespace
+
 bool RealCommandRunner::CanRunMore() {
-  return ((int)subprocs_.running_.size()) < config_.parallelism
-    && ((subprocs_.running_.empty() || config_.max_load_average <= 0.0f)
-        || GetLoadAverage() < config_.max_load_average);
+  StartMissed();
+  if (!missed_.empty())
+    return false;
+  // Any edge to run next is looked up first, which takes no room.
+  if (config_.action_cache && config_.action_cache->remote() &&
+      lookups_.size() < kMaxLookups)
+    return true;
+  if (CanRunLocally())
+    return true;
+  // A command may yet join a batch; CanRunEdge() says which.
+  for (map<const Rule*, Batch>::iterator i = open_batches_.begin();
+       i != open_batches_.end(); ++i) {
+    if ((int)i->second.edges.size() < i->first->batch())
+      return true;
+  }
+  return false;
+}
+
+bool RealCommandRunner::CanRunLocally() {
+  int running = LocalCommands();
+  bool can_run;
+  if (config_.adaptive_parallelism) {
+    int64_t now = GetTimeMillis();
+    double cpu, io;
+    if (now - last_pressure_sample_ >= kPressureSampleInterval) {
+      last_pressure_sample_ = now;
+      if (pressure_sampler_.Sample(&cpu, &io))
+        parallelism_.Update(cpu, io, running, now);
+    }
+    can_run = running < parallelism_.parallelism();
+  } else {
+    can_run = running < config_.parallelism
+      && ((running == 0 || config_.max_load_average <= 0.0f)
+          || GetLoadAverage() < config_.max_load_average);
+  }
+  if (!can_run || !config_.jobserver)
+    return can_run;
+
+  // The first command needs no token; each one after it does.
+  if (running < 1 + tokens_)
+    return true;
+  if (!config_.jobserver->Acquire())
+    return false;
+  ++tokens_;
+  return true;
+}
+
+bool RealCommandRunner::CanRunEdge(Edge* edge) {
+  if (LooksUp(edge) || JoinsBatch(edge))
+    return true;
+  // CanRunMore() may have been true for a lookup, or for a batch.
+  if (!CanRunLocally())
+    return false;
+  return FitsInMemory(edge);
+}
+
+bool RealCommandRunner::FitsInMemory(Edge* edge) {
+  // One command at a time always fits, however big.
+  if (memory_limit_ == 0 || LocalCommands() == 0)
+    return true;
+  return running_rss_ + PredictPeakRSS(edge) <= memory_limit_;
+}
+
+bool RealCommandRunner::LooksUp(Edge* edge) {
+#ifndef _WIN32
+  // As Builder::StartEdge() restores from the cache.
+  return config_.action_cache && config_.action_cache->remote() &&
+         !edge->rule().generator() && edge->GetDepsType() != "msvc";
+#else
+  return false;
+#endif
+}
+
+int64_t RealCommandRunner::PredictPeakRSS(Edge* edge) {
+  if (!build_log_ || edge->outputs_.empty())
+    return 0;
+  BuildLog::LogEntry* entry =
+      build_log_->LookupByOutput(edge->outputs_[0]);
+  return entry ? entry->usage.peak_rss : 0;
 }
 
 bool RealCommandRunner::StartCommand(Edge* edge) {
-  string command = edge->EvaluateCommand();
-  Subprocess* subproc = subprocs_.Add(command);
+#ifndef _WIN32
+  if (LooksUp(edge)) {
+    string fetch = config_.action_cache->FetchCommand(edge);
+    if (!fetch.empty()) {
+      if (!StartSubprocess(edge, fetch))
+        return false;
+      lookups_.insert(edge);
+      return true;
+    }
+  }
+#endif
+  if (Batches(edge)) {
+    const Rule* rule = &edge->rule();
+    size_t size = edge->EvaluateCommand().size();
+    map<const Rule*, Batch>::iterator open = open_batches_.find(rule);
+    if (open != open_batches_.end() &&
+        open->second.script_size + size > kMaxBatchScript) {
+      StartBatch(rule);
+    }
+    Batch& batch = open_batches_[rule];
+    batch.edges.push_back(edge);
+    batch.millis += max(build_log_ ? build_log_->LastDuration(edge) : 0,
+                        (int64_t)0);
+    batch.script_size += size;
+    if ((int)batch.edges.size() >= rule->batch() ||
+        batch.millis >= kMaxBatchMillis ||
+        batch.script_size >= kMaxBatchScript) {
+      StartBatch(rule);
+    }
+    return true;
+  }
+  return StartLocally(edge);
+}
+
+bool RealCommandRunner::Batches(Edge* edge) {
+#ifndef _WIN32
+  return edge->rule().batch() > 1;
+#else
+  return false;
+#endif
+}
+
+bool RealCommandRunner::JoinsBatch(Edge* edge) {
+  if (!Batches(edge) || LooksUp(edge))
+    return false;
+  map<const Rule*, Batch>::const_iterator open =
+      open_batches_.find(&edge->rule());
+  return open != open_batches_.end() &&
+         (int)open->second.edges.size() < edge->rule().batch();
+}
+
+void RealCommandRunner::StartBatch(const Rule* rule) {
+  map<const Rule*, Batch>::iterator open = open_batches_.find(rule);
+  if (open == open_batches_.end())
+    return;
+  Batch batch = open->second;
+  open_batches_.erase(open);
+
+  // Each exit code follows the command's output, after a marker no
+  // command prints.
+  char marker[64];
+  snprintf(marker, sizeof(marker), "ninja-batch-%d-%d", (int)getpid(),
+           ++batches_started_);
+  batch.marker = string("\036") + marker + " ";
+  string script;
+  for (vector<Edge*>::iterator i = batch.edges.begin();
+       i != batch.edges.end(); ++i) {
+    script += "(\n" + (*i)->EvaluateCommand() + "\n)\n";
+    script += string("printf '\\036%s %d\\n' ") + marker + " $?\n";
+  }
+  METRIC_COUNT("commands batched", (int)batch.edges.size());
+
+  Subprocess* subproc = subprocs_.Add(script, true);
+  if (!subproc) {
+    failed_to_start_.insert(failed_to_start_.end(), batch.edges.begin(),
+                            batch.edges.end());
+    return;
+  }
+  subproc->SplitOutput(batch.marker);
+  subproc_to_edge_.insert(make_pair(subproc, batch.edges[0]));
+  batches_.insert(make_pair(subproc, batch));
+}
+
+void RealCommandRunner::StartBatches() {
+  while (!open_batches_.empty())
+    StartBatch(open_batches_.begin()->first);
+}
+
+void RealCommandRunner::FinishBatch(Subprocess* subproc,
+                                    const Batch& batch) {
+  // The output was split at each marker, so each command's is cut short
+  // on its own if too long.
+  const vector<string>& parts = subproc->output_parts();
+  for (size_t i = 0; i < batch.edges.size(); ++i) {
+    BatchResult result;
+    result.edge = batch.edges[i];
+    if (i < parts.size()) {
+      size_t mark = parts[i].rfind(batch.marker);
+      result.output = parts[i].substr(0, mark);
+      const char* code = parts[i].c_str() + mark + batch.marker.size();
+      result.status = atoi(code) == 0 ? ExitSuccess : ExitFailure;
+    } else {
+      // The shell died.
+      result.status = ExitFailure;
+      if (i == parts.size())
+        result.output = subproc->GetOutput();
+      result.output +=
+          "ninja: lost the exit code of this command, run in a batch\n";
+    }
+    batch_results_.push_back(result);
+  }
+}
+
+bool RealCommandRunner::StartLocally(Edge* edge) {
+  if (!StartSubprocess(edge, edge->EvaluateCommand()))
+    return false;
+  int64_t predicted = PredictPeakRSS(edge);
+  predicted_rss_[edge] = predicted;
+  running_rss_ += predicted;
+
+  return true;
+}
+
+bool RealCommandRunner::StartSubprocess(Edge* edge, const string& command) {
+  Subprocess* subproc = subprocs_.Add(command, edge->rule().shell());
   if (!subproc)
     return false;
   subproc_to_edge_.insert(make_pair(subproc, edge));
-
   return true;
 }
 
+void RealCommandRunner::StartMissed() {
+  while (!missed_.empty() && CanRunLocally() && FitsInMemory(missed_.front())) {
+    Edge* edge = missed_.front();
+    missed_.pop_front();
+    if (!StartLocally(edge))
+      failed_to_start_.push_back(edge);
+  }
+}
+
 Edge* RealCommandRunner::WaitForCommand(ExitStatus* status, string* output) {
-  Subprocess* subproc;
-  while ((subproc = subprocs_.NextFinished()) == NULL) {
-    bool interrupted = subprocs_.DoWork();
-    if (interrupted) {
-      *status = ExitInterrupted;
-      return 0;
+  for (;;) {
+    StartMissed();
+    // Nothing more is joining the open batches for now.
+    StartBatches();
+    if (!failed_to_start_.empty()) {
+      Edge* edge = failed_to_start_.front();
+      failed_to_start_.pop_front();
+      *status = ExitFailure;
+      *output = "command '" + edge->EvaluateCommand() + "' failed to start";
+      last_usage_ = ResourceUsage();
+      return edge;
     }
+    if (!batch_results_.empty()) {
+      BatchResult& result = batch_results_.front();
+      Edge* edge = result.edge;
+      *status = result.status;
+      output->swap(result.output);
+      batch_results_.pop_front();
+      last_usage_ = ResourceUsage();
+      return edge;
+    }
+
+    Subprocess* subproc;
+    while ((subproc = subprocs_.NextFinished()) == NULL) {
+      bool interrupted = subprocs_.DoWork();
+      if (interrupted) {
+        *status = ExitInterrupted;
+        return 0;
+      }
+    }
+
+    *status = subproc->Finish();
+    *output = subproc->GetOutput();
+    last_usage_ = subproc->usage();
+
+    map<Subprocess*, Edge*>::iterator i = subproc_to_edge_.find(subproc);
+    Edge* edge = i->second;
+    subproc_to_edge_.erase(i);
+    map<Subprocess*, Batch>::iterator batch = batches_.find(subproc);
+    if (batch != batches_.end()) {
+      FinishBatch(subproc, batch->second);
+      batches_.erase(batch);
+      delete subproc;
+      FinishCommand(edge);
+      continue;
+    }
+    delete subproc;
+
+#ifndef _WIN32
+    if (lookups_.erase(edge) && *status != ExitInterrupted) {
+      if (*status != ExitSuccess) {
+        // Not in the remote cache: run the command after all.
+        missed_.push_back(edge);
+        continue;
+      }
+      config_.action_cache->Fetched(edge);
+      output->clear();
+      last_usage_ = ResourceUsage();
+    }
+#endif
+    FinishCommand(edge);
+    return edge;
   }
+}
 
-  *status = subproc->Finish();
-  *output = subproc->GetOutput();
+void RealCommandRunner::FinishCommand(Edge* edge) {
+  map<Edge*, int64_t>::iterator p = predicted_rss_.find(edge);
+  if (p != predicted_rss_.end()) {
+    running_rss_ -= p->second;
+    predicted_rss_.erase(p);
+  }
+  // Hand the finished command's token back, for whoever needs one next.
+  if (config_.jobserver)
+    ReleaseTokens(max(LocalCommands() - 1, 0));
+}
 
-  map<Subprocess*, Edge*>::iterator i = subproc_to_edge_.find(subproc);
-  Edge* edge = i->second;
-  subproc_to_edge_.erase(i);
+#ifndef _WIN32
+/// A RealCommandRunner that also runs the commands of rules marked
+/// "remote" on the workers in BuildConfig::remote_workers, keeping each
+/// as busy as it has slots for on top of the commands run here.  Such a
+/// command runs here when no worker has a slot free and this machine
+/// does.  The commands run remotely go through "ninja -t remote-exec",
+/// which uploads their inputs, waits for them and writes back their
+/// outputs; as a local process it reports the output and exit code,
+/// and is interrupted, like any other command.
+struct RemoteCommandRunner : public RealCommandRunner {
+  RemoteCommandRunner(const BuildConfig& config, BuildLog* build_log);
+  virtual ~RemoteCommandRunner();
+  virtual bool CanRunMore();
+  virtual bool CanRunEdge(Edge* edge);
+  virtual bool StartCommand(Edge* edge);
+  virtual void Abort();
+  virtual void Report();
+  virtual void FinishCommand(Edge* edge);
+  virtual int LocalCommands() {
+    return RealCommandRunner::LocalCommands() - (int)remote_edges_.size();
+  }
 
-  delete subproc;
-  return edge;
+  /// A worker with a slot free, or -1.
+  int FreeWorker() const;
+
+  /// Free slots per worker in config_.remote_workers.
+  vector<int> free_slots_;
+  /// The worker each command running remotely runs on.
+  map<Edge*, int> remote_edges_;
+  /// Where the jobs for "ninja -t remote-exec" are written.
+  string job_dir_;
+  int remote_commands_;
+};
+
+RemoteCommandRunner::RemoteCommandRunner(const BuildConfig& config,
+                                         BuildLog* build_log)
+    : RealCommandRunner(config, build_log), remote_commands_(0) {
+  for (vector<string>::const_iterator i = config.remote_workers.begin();
+       i != config.remote_workers.end(); ++i) {
+    string err;
+    int slots = QueryRemoteSlots(*i, &err);
+    if (slots <= 0)
+      Warning("remote worker %s: %s; not using it", i->c_str(), err.c_str());
+    free_slots_.push_back(max(slots, 0));
+  }
+  char dir[] = "/tmp/ninja-remote-XXXXXX";
+  if (mkdtemp(dir)) {
+    job_dir_ = dir;
+  } else {
+    Warning("mkdtemp: %s; running all commands here", strerror(errno));
+    free_slots_.assign(free_slots_.size(), 0);
+  }
+}
+
+RemoteCommandRunner::~RemoteCommandRunner() {
+  if (!job_dir_.empty())
+    rmdir(job_dir_.c_str());
+}
+
+int RemoteCommandRunner::FreeWorker() const {
+  // The worker with the most slots free, to spread the load.
+  int best = -1;
+  for (size_t i = 0; i < free_slots_.size(); ++i) {
+    if (free_slots_[i] > 0 && (best < 0 || free_slots_[i] > free_slots_[best]))
+      best = (int)i;
+  }
+  return best;
+}
+
+bool RemoteCommandRunner::CanRunMore() {
+  return FreeWorker() >= 0 || RealCommandRunner::CanRunMore();
+}
+
+bool RemoteCommandRunner::CanRunEdge(Edge* edge) {
+  if (edge->rule().remote() && FreeWorker() >= 0)
+    return true;
+  if (LooksUp(edge))
+    return true;
+  // A slot on a worker made CanRunMore() true; this one has to run here.
+  return CanRunLocally() && FitsInMemory(edge);
+}
+
+bool RemoteCommandRunner::StartCommand(Edge* edge) {
+  int worker = edge->rule().remote() ? FreeWorker() : -1;
+  if (worker < 0)
+    return RealCommandRunner::StartCommand(edge);
+
+  RemoteJob job;
+  job.command = edge->EvaluateCommand();
+  for (EdgeInputs::iterator i = edge->inputs_.begin();
+       i != edge->inputs_.end(); ++i) {
+    job.inputs.push_back((*i)->path());
+  }
+  // The response file is written before the command starts.
+  if (edge->HasRspFile())
+    job.inputs.push_back(edge->GetRspFile());
+  string extra = edge->EvaluateRemoteInputs();
+  for (size_t start = 0, end; start < extra.size(); start = end + 1) {
+    end = extra.find(' ', start);
+    if (end == string::npos)
+      end = extra.size();
+    if (end > start)
+      job.inputs.push_back(extra.substr(start, end - start));
+  }
+  for (vector<Node*>::iterator i = edge->outputs_.begin();
+       i != edge->outputs_.end(); ++i) {
+    job.outputs.push_back((*i)->path());
+  }
+  string depfile = edge->EvaluateDepFile();
+  if (!depfile.empty())
+    job.outputs.push_back(depfile);
+
+  char name[32];
+  snprintf(name, sizeof(name), "/%d", edge->id());
+  string path = job_dir_ + name;
+  string err;
+  if (!job.Save(path, &err)) {
+    Error("%s", err.c_str());
+    return false;
+  }
+  if (!StartSubprocess(edge, config_.ninja_command + " -t remote-exec " +
+                       config_.remote_workers[worker] + " " + path)) {
+    unlink(path.c_str());
+    return false;
+  }
+  --free_slots_[worker];
+  remote_edges_[edge] = worker;
+  ++remote_commands_;
+  return true;
 }
 
+void RemoteCommandRunner::FinishCommand(Edge* edge) {
+  map<Edge*, int>::iterator i = remote_edges_.find(edge);
+  if (i != remote_edges_.end()) {
+    ++free_slots_[i->second];
+    remote_edges_.erase(i);
+    char name[32];
+    snprintf(name, sizeof(name), "/%d", edge->id());
+    unlink((job_dir_ + name).c_str());
+  }
+  RealCommandRunner::FinishCommand(edge);
+}
+
+void RemoteCommandRunner::Abort() {
+  for (map<Edge*, int>::iterator i = remote_edges_.begin();
+       i != remote_edges_.end(); ++i) {
+    ++free_slots_[i->second];
+    char name[32];
+    snprintf(name, sizeof(name), "/%d", i->first->id());
+    unlink((job_dir_ + name).c_str());
+  }
+  remote_edges_.clear();
+  RealCommandRunner::Abort();
+}
+
+void RemoteCommandRunner::Report() {
+  RealCommandRunner::Report();
+  int slots = 0;
+  for (vector<int>::iterator i = free_slots_.begin();
+       i != free_slots_.end(); ++i) {
+    slots += *i;
+  }
+  printf("remote execution: %d workers, %d slots, %d commands run "
+         "remotely\n", (int)free_slots_.size(), slots, remote_commands_);
+}
+#endif  // _WIN32
+
 /// A CommandRunner that doesn't actually run the commands.
 struct DryRunCommandRunner : public CommandRunner {
   virtual ~DryRunCommandRunner() {}
@@ -551,42 +1461,124 @@ struct DryRunCommandRunner : public CommandRunner {
   queue<Edge*> finished_;
 };
 
+namespace {
+
+/// The directory of the output \a path, as made_dirs_ names it.
+string OutputDir(const string& path) {
+#ifdef _WIN32
+  string::size_type slash = path.find_last_of("/\\");
+#else
+  string::size_type slash = path.rfind('/');
+#endif
+  return slash == string::npos ? string() : path.substr(0, slash);
+}
+
+}  // anonymous namespace
+
+/// Creates the directories of an edge's outputs and writes its rspfile,
+/// which would otherwise hold up starting the commands after it on file
+/// system latency.  The rspfile's contents, often a link's thousands of
+/// inputs, are evaluated here too, straight into the file.
+struct Builder::PrepareTask : public ThreadPool::Task {
+  PrepareTask(DiskInterface* disk_interface, Edge* edge)
+      : disk_interface_(disk_interface), edge_(edge), success_(false) {}
+
+  virtual void Run() {
+    for (vector<string>::iterator i = outputs_.begin();
+         i != outputs_.end(); ++i) {
+      if (!disk_interface_->MakeDirs(*i))
+        return;
+    }
+    if (!rspfile_.empty() && !edge_->WriteRspFile(disk_interface_, rspfile_))
+      return;
+    success_ = true;
+  }
+
+  DiskInterface* disk_interface_;
+  Edge* edge_;
+  /// Outputs, one per directory, whose directories to make.
+  vector<string> outputs_;
+  string rspfile_;
+  bool success_;
+};
+
 Builder::Builder(State* state, const BuildConfig& config,
-                 BuildLog* log, DiskInterface* disk_interface)
+                 BuildLog* build_log, DepsLog* deps_log,
+                 DiskInterface* disk_interface)
     : state_(state), config_(config), disk_interface_(disk_interface),
-      scan_(state, log, disk_interface) {
+      scan_(state, build_log, deps_log, disk_interface), io_pool_(NULL) {
   status_ = new BuildStatus(config);
+  scan_.set_content_digests(config.content_digests);
 }
 
 Builder::~Builder() {
   Cleanup();
+  delete status_;
+  // Let the tasks running finish before deleting them.
+  delete io_pool_;
+  for (map<Edge*, PrepareTask*>::iterator i = prepare_tasks_.begin();
+       i != prepare_tasks_.end(); ++i) {
+    delete i->second;
+  }
 }
 
 void Builder::Cleanup() {
+  // Commands that finished are done with, even if the build was
+  // interrupted; make sure the log says so.
+  if (scan_.build_log() && !scan_.build_log()->Flush())
+    Error("writing build log: %s", strerror(errno));
+
   if (command_runner_.get()) {
     vector<Edge*> active_edges = command_runner_->GetActiveEdges();
     command_runner_->Abort();
 
     for (vector<Edge*>::iterator i = active_edges.begin();
          i != active_edges.end(); ++i) {
-      bool has_depfile = !(*i)->rule_->depfile().empty();
-      for (vector<Node*>::iterator ni = (*i)->outputs_.begin();
-           ni != (*i)->outputs_.end(); ++ni) {
-        // Only delete this output if it was actually modified.  This is
-        // important for things like the generator where we don't want to
-        // delete the manifest file if we can avoid it.  But if the rule
-        // uses a depfile, always delete.  (Consider the case where we
-        // need to rebuild an output because of a modified header file
-        // mentioned in a depfile, and the command touches its depfile
-        // but is interrupted before it touches its output file.)
-        if (has_depfile ||
-            (*ni)->mtime() != disk_interface_->Stat((*ni)->path()))
-          disk_interface_->RemoveFile((*ni)->path());
-      }
-      if (has_depfile)
-        disk_interface_->RemoveFile((*i)->EvaluateDepFile());
+      RemoveOutputs(*i);
+      plan_.EdgeFailed(*i);
     }
   }
+  // Those run early and done wrote outputs from inputs that were never
+  // finished, and hold their room.  (Those still running were above.)
+  for (map<Edge*, Speculation>::iterator i = speculations_.begin();
+       i != speculations_.end(); ++i) {
+    if (!i->second.finished)
+      continue;
+    RemoveOutputs(i->first);
+    plan_.EdgeFailed(i->first);
+  }
+  speculations_.clear();
+  // Those found to run next, and those restored from the action cache
+  // but not yet finished, hold their room too.
+  for (deque<Edge*>::iterator i = prepared_.begin(); i != prepared_.end(); ++i)
+    plan_.EdgeFailed(*i);
+  prepared_.clear();
+  for (; !restored_.empty(); restored_.pop())
+    plan_.EdgeFailed(restored_.front());
+}
+
+void Builder::RemoveOutputs(Edge* edge) {
+  bool has_depfile = !edge->rule_->depfile().empty();
+  for (vector<Node*>::iterator ni = edge->outputs_.begin();
+       ni != edge->outputs_.end(); ++ni) {
+    // Only delete this output if it was actually modified.  This is
+    // important for things like the generator where we don't want to
+    // delete the manifest file if we can avoid it.  But if the rule
+    // uses a depfile, always delete.  (Consider the case where we
+    // need to rebuild an output because of a modified header file
+    // mentioned in a depfile, and the command touches its depfile
+    // but is interrupted before it touches its output file.)
+    if (has_depfile ||
+        (*ni)->mtime() != disk_interface_->Stat((*ni)->path()))
+      disk_interface_->RemoveFile((*ni)->path());
+  }
+  if (has_depfile)
+    disk_interface_->RemoveFile(edge->EvaluateDepFile());
+}
+
+void Builder::PrefetchTargets(const vector<Node*>& targets) {
+  if (config_.scan_threads > 0)
+    scan_.Prefetch(targets, config_.scan_threads);
 }
 
 Node* Builder::AddTarget(const string& name, string* err) {
@@ -601,7 +1593,8 @@ Node* Builder::AddTarget(const string& name, string* err) {
 }
 
 bool Builder::AddTarget(Node* node, string* err) {
-  node->StatIfNecessary(disk_interface_);
+  METRIC_RECORD("dependency scan");
+  scan_.StatIfNecessary(node);
   if (Edge* in_edge = node->in_edge()) {
     if (!scan_.RecomputeDirty(in_edge, err))
       return false;
@@ -621,8 +1614,10 @@ bool Builder::AlreadyUpToDate() const {
 
 bool Builder::Build(string* err) {
   assert(!AlreadyUpToDate());
+  METRIC_RECORD("build");
 
   status_->PlanHasTotalEdges(plan_.command_edge_count());
+  plan_.ComputeCriticalPath(scan_.build_log());
   int pending_commands = 0;
   int failures_allowed = config_.failures_allowed;
 
@@ -630,10 +1625,20 @@ bool Builder::Build(string* err) {
   if (!command_runner_.get()) {
     if (config_.dry_run)
       command_runner_.reset(new DryRunCommandRunner);
+#ifndef _WIN32
+    else if (!config_.remote_workers.empty())
+      command_runner_.reset(new RemoteCommandRunner(config_,
+                                                    scan_.build_log()));
+#endif
     else
-      command_runner_.reset(new RealCommandRunner(config_));
+      command_runner_.reset(new RealCommandRunner(config_,
+                                                  scan_.build_log()));
   }
 
+  if (config_.io_threads > 0 && !io_pool_)
+    io_pool_ = new ThreadPool(config_.io_threads);
+  plan_.set_speculate(config_.speculate && !config_.dry_run);
+
   // This main loop runs the entire build process.
   // It is structured like this:
   // First, we attempt to start as many commands as allowed by the
@@ -642,9 +1647,21 @@ bool Builder::Build(string* err) {
   // If we can do neither of those, the build is stuck, and we report
   // an error.
   while (plan_.more_to_do()) {
+    if (failures_allowed)
+      PrepareMore();
+
     // See if we can start any more commands.
     if (failures_allowed && command_runner_->CanRunMore()) {
-      if (Edge* edge = plan_.FindWork()) {
+      Edge* edge = NextEdge();
+      bool deferred = false;
+      // Wait for running commands to free up what this one needs.
+      if (edge && !edge->is_phony() && pending_commands &&
+          !command_runner_->CanRunEdge(edge)) {
+        plan_.DeferWork(edge);
+        edge = NULL;
+        deferred = true;
+      }
+      if (edge) {
         if (!StartEdge(edge, err)) {
           status_->BuildFinished();
           return false;
@@ -658,17 +1675,46 @@ bool Builder::Build(string* err) {
         // We made some progress; go back to the main loop.
         continue;
       }
+
+      // With nothing ready to start, start something that may be.
+      if (!deferred && pending_commands &&
+          (edge = plan_.FindSpeculativeWork())) {
+        if (!command_runner_->CanRunEdge(edge)) {
+          plan_.DropSpeculation(edge);
+        } else {
+          METRIC_COUNT("commands run early", 1);
+          speculations_[edge] = Speculation();
+          if (!StartEdge(edge, err)) {
+            status_->BuildFinished();
+            return false;
+          }
+          ++pending_commands;
+          continue;
+        }
+      }
     }
 
     // See if we can reap any finished commands.
     if (pending_commands) {
       ExitStatus status;
       string output;
-      Edge* edge = command_runner_->WaitForCommand(&status, &output);
+      Edge* edge;
+      ResourceUsage usage;
+      if (!restored_.empty()) {
+        edge = restored_.front();
+        restored_.pop();
+        status = ExitSuccess;
+      } else {
+        edge = command_runner_->WaitForCommand(&status, &output);
+        usage = command_runner_->LastUsage();
+      }
       if (edge && status != ExitInterrupted) {
         bool success = (status == ExitSuccess);
         --pending_commands;
-        FinishEdge(edge, success, output);
+        if (speculations_.count(edge) &&
+            !SpeculationFinished(edge, success, output, usage))
+          continue;
+        FinishEdge(edge, success, output, usage);
         if (!success) {
           if (failures_allowed)
             failures_allowed--;
@@ -711,26 +1757,93 @@ bool Builder::Build(string* err) {
   return true;
 }
 
+Builder::PrepareTask* Builder::NewPrepareTask(Edge* edge) {
+  PrepareTask* task = new PrepareTask(disk_interface_, edge);
+  set<string> dirs;
+  for (vector<Node*>::iterator i = edge->outputs_.begin();
+       i != edge->outputs_.end(); ++i) {
+    string dir = OutputDir((*i)->path());
+    if (made_dirs_.count(dir) == 0 && dirs.insert(dir).second)
+      task->outputs_.push_back((*i)->path());
+  }
+  if (edge->HasRspFile())
+    task->rspfile_ = edge->GetRspFile();
+  if (task->outputs_.empty() && task->rspfile_.empty()) {
+    delete task;
+    return NULL;
+  }
+  return task;
+}
+
+void Builder::PrepareMore() {
+  if (!io_pool_)
+    return;
+  while (prepared_.size() < (size_t)config_.io_threads) {
+    Edge* edge = plan_.FindWork();
+    if (!edge)
+      break;
+    prepared_.push_back(edge);
+    // An edge put back with Plan::DeferWork() is prepared already.
+    if (edge->is_phony() || prepare_tasks_.count(edge))
+      continue;
+    if (PrepareTask* task = NewPrepareTask(edge)) {
+      prepare_tasks_[edge] = task;
+      io_pool_->Post(task);
+    }
+  }
+}
+
+Edge* Builder::NextEdge() {
+  if (prepared_.empty())
+    return plan_.FindWork();
+  Edge* edge = prepared_.front();
+  prepared_.pop_front();
+  return edge;
+}
+
 bool Builder::StartEdge(Edge* edge, string* err) {
   if (edge->is_phony())
     return true;
 
   status_->BuildEdgeStarted(edge);
-
-  // Create directories necessary for outputs.
-  // XXX: this will block; do we care?
-  for (vector<Node*>::iterator i = edge->outputs_.begin();
-       i != edge->outputs_.end(); ++i) {
-    if (!disk_interface_->MakeDirs((*i)->path()))
+  if (g_tracer)
+    TraceEdgeStarted(edge);
+
+  // Create directories necessary for outputs, and the response file if
+  // needed, unless PrepareMore() already set about it.
+  PrepareTask* task;
+  map<Edge*, PrepareTask*>::iterator i = prepare_tasks_.find(edge);
+  if (i != prepare_tasks_.end()) {
+    task = i->second;
+    prepare_tasks_.erase(i);
+    io_pool_->Wait(task);
+  } else {
+    task = NewPrepareTask(edge);
+    if (task)
+      task->Run();
+  }
+  if (task) {
+    bool success = task->success_;
+    if (success) {
+      for (vector<string>::iterator p = task->outputs_.begin();
+           p != task->outputs_.end(); ++p) {
+        made_dirs_.insert(OutputDir(*p));
+      }
+    }
+    delete task;
+    if (!success)
       return false;
   }
 
-  // Create response file, if needed
-  // XXX: this may also block; do we care?
-  if (edge->HasRspFile()) {
-    if (!disk_interface_->WriteFile(edge->GetRspFile(), edge->GetRspFileContent()))
-      return false;
+#ifndef _WIN32
+  // The cache keys on the deps in a depfile; "msvc" deps aren't in one.
+  if (config_.action_cache && !config_.dry_run &&
+      !edge->rule().generator() && edge->GetDepsType() != "msvc" &&
+      config_.action_cache->Restore(edge)) {
+    restored_.push(edge);
+    return true;
   }
+#endif
 
   // start command computing and run it
   if (!command_runner_->StartCommand(edge)) {
@@ -741,13 +1854,39 @@ bool Builder::StartEdge(Edge* edge, string* err) {
   return true;
 }
 
-void Builder::FinishEdge(Edge* edge, bool success, const string& output) {
+void Builder::FinishEdge(Edge* edge, bool success,
+                         const string& command_output,
+                         const ResourceUsage& usage) {
   TimeStamp restat_mtime = 0;
+  uint64_t input_digest = 0;
+  int outputs_cleaned = 0;
+  string output = command_output;
+
+#ifndef _WIN32
+  // Before the depfile goes.
+  if (success && config_.action_cache && !edge->is_phony())
+    config_.action_cache->Store(edge);
+#endif
+
+  vector<Node*> deps_nodes;
+  string deps_type = edge->GetDepsType();
+  bool record_deps = success && !config_.dry_run && !deps_type.empty();
+  // /showIncludes lines are taken out of the output even of a failed
+  // command: they would bury its errors.
+  if (record_deps || deps_type == "msvc") {
+    string err;
+    if (!ExtractDeps(edge, deps_type, &output, &deps_nodes, &err)) {
+      if (!output.empty())
+        output.append("\n");
+      output.append(err);
+      success = false;
+      record_deps = false;
+    }
+  }
 
   if (success) {
     if (edge->rule().restat() && !config_.dry_run) {
-      bool node_cleaned = false;
-
+      vector<Node*> cleaned;
       for (vector<Node*>::iterator i = edge->outputs_.begin();
            i != edge->outputs_.end(); ++i) {
         TimeStamp new_mtime = disk_interface_->Stat((*i)->path());
@@ -755,17 +1894,25 @@ void Builder::FinishEdge(Edge* edge, bool success, const string& output) {
           // The rule command did not change the output.  Propagate the clean
           // state through the build graph.
           // Note that this also applies to nonexistent outputs (mtime == 0).
-          plan_.CleanNode(&scan_, *i);
-          node_cleaned = true;
+          cleaned.push_back(*i);
+        } else if (!speculations_.empty()) {
+          SpeculationsStale(*i);
         }
       }
 
-      if (node_cleaned) {
+      if (!cleaned.empty()) {
+        plan_.CleanNodes(&scan_, cleaned);
+        outputs_cleaned += (int)cleaned.size();
+
         // If any output was cleaned, find the most recent mtime of any
-        // (existing) non-order-only input or the depfile.
-        for (vector<Node*>::iterator i = edge->inputs_.begin();
+        // (existing) non-order-only input or the depfile.  A clean input
+        // wasn't written during the build, or a restat found it as it
+        // was, so its mtime is known; the commands that wrote the others
+        // may have changed theirs.
+        for (EdgeInputs::iterator i = edge->inputs_.begin();
              i != edge->inputs_.end() - edge->order_only_deps_; ++i) {
-          TimeStamp input_mtime = disk_interface_->Stat((*i)->path());
+          TimeStamp input_mtime = (*i)->dirty() || !(*i)->status_known() ?
+              disk_interface_->Stat((*i)->path()) : (*i)->mtime();
           if (input_mtime > restat_mtime)
             restat_mtime = input_mtime;
         }
@@ -782,19 +1929,235 @@ void Builder::FinishEdge(Edge* edge, bool success, const string& output) {
       }
     }
 
+    if (scan_.content_digests() && !config_.dry_run && !edge->is_phony()) {
+      // Like restat, but by contents: an output rewritten as it was
+      // doesn't make what depends on it dirty, whatever its mtime.
+      vector<Node*> cleaned;
+      for (vector<Node*>::iterator i = edge->outputs_.begin();
+           i != edge->outputs_.end(); ++i) {
+        const DepsLog::Digest* old = scan_.deps_log() ?
+            scan_.deps_log()->GetDigest(*i) : NULL;
+        uint64_t old_digest = old ? old->digest : 0;
+        (*i)->set_mtime(disk_interface_->Stat((*i)->path()));
+        uint64_t digest = scan_.NodeDigest(*i);
+        if (old_digest != 0 && digest == old_digest)
+          cleaned.push_back(*i);
+      }
+      if (!cleaned.empty()) {
+        plan_.CleanNodes(&scan_, cleaned);
+        outputs_cleaned += (int)cleaned.size();
+        status_->PlanHasTotalEdges(plan_.command_edge_count());
+      }
+
+      // The deps of a depfile without "deps" are only known once it is
+      // loaded again, so their edges go by mtimes.
+      if (record_deps)
+        input_digest = scan_.InputsDigest(edge, &deps_nodes);
+      else if (edge->rule().depfile().empty())
+        input_digest = scan_.InputsDigest(edge);
+    }
+
     // delete the response file on success (if exists)
     if (edge->HasRspFile())
       disk_interface_->RemoveFile(edge->GetRspFile());
 
     plan_.EdgeFinished(edge);
+  } else {
+    plan_.EdgeFailed(edge);
+    // Those run early on its outputs will never have their inputs ready.
+    if (!speculations_.empty()) {
+      for (vector<Node*>::iterator o = edge->outputs_.begin();
+           o != edge->outputs_.end(); ++o)
+        SpeculationsStale(*o);
+    }
   }
 
   if (edge->is_phony())
     return;
 
+  if (g_tracer)
+    TraceEdgeFinished(edge, success, outputs_cleaned);
+
   int start_time, end_time;
   status_->BuildEdgeFinished(edge, success, output, &start_time, &end_time);
-  if (success && scan_.build_log())
-    scan_.build_log()->RecordCommand(edge, start_time, end_time, restat_mtime);
+  // A failure is noted for the next build to run the command early.
+  if (scan_.build_log() &&
+      !(success ?
+        scan_.build_log()->RecordCommand(edge, start_time, end_time,
+                                         restat_mtime, usage, input_digest) :
+        scan_.build_log()->RecordFailure(edge, start_time, end_time))) {
+    Error("writing build log: %s", strerror(errno));
+  }
+
+  if (record_deps && scan_.deps_log()) {
+    // Deps are recorded against the first output, with the mtime it had
+    // when they were read; see DependencyScan::LoadDepsFromLog().
+    Node* out = edge->outputs_[0];
+    TimeStamp deps_mtime = disk_interface_->Stat(out->path());
+    if (!scan_.deps_log()->RecordDeps(out, deps_mtime, deps_nodes))
+      Error("writing deps log: %s", strerror(errno));
+  }
+
+  if (success && !speculations_.empty())
+    FinishSpeculations(edge);
+}
+
+bool Builder::SpeculationFinished(Edge* edge, bool success,
+                                  const string& output,
+                                  const ResourceUsage& usage) {
+  Speculation& speculation = speculations_[edge];
+  // Once its inputs are ready, it ran as it would have; before, it may
+  // have failed for want of them.
+  bool ready = edge->AllInputsReady();
+  if (speculation.stale || (!success && !ready)) {
+    DropSpeculation(edge);
+    return false;
+  }
+  if (ready) {
+    speculations_.erase(edge);
+    return true;
+  }
+  speculation.finished = true;
+  speculation.output = output;
+  speculation.usage = usage;
+  return false;
+}
+
+void Builder::DropSpeculation(Edge* edge) {
+  METRIC_COUNT("commands run early, again", 1);
+  speculations_.erase(edge);
+  // What it wrote is from stale inputs; left in place, it would look
+  // up to date next time.
+  RemoveOutputs(edge);
+  status_->BuildEdgeDropped(edge);
+  if (g_tracer)
+    TraceEdgeFinished(edge, false, 0);
+  plan_.DropSpeculation(edge);
+}
+
+void Builder::SpeculationsStale(Node* node) {
+  for (vector<Edge*>::const_iterator i = node->out_edges().begin();
+       i != node->out_edges().end(); ++i) {
+    map<Edge*, Speculation>::iterator s = speculations_.find(*i);
+    if (s == speculations_.end())
+      continue;
+    // One still running is dropped once done.
+    if (s->second.finished)
+      DropSpeculation(*i);
+    else
+      s->second.stale = true;
+  }
+}
+
+void Builder::FinishSpeculations(Edge* edge) {
+  vector<Edge*> ready;
+  for (vector<Node*>::iterator o = edge->outputs_.begin();
+       o != edge->outputs_.end(); ++o) {
+    for (vector<Edge*>::const_iterator i = (*o)->out_edges().begin();
+         i != (*o)->out_edges().end(); ++i) {
+      map<Edge*, Speculation>::iterator s = speculations_.find(*i);
+      if (s != speculations_.end() && s->second.finished &&
+          (*i)->AllInputsReady() &&
+          find(ready.begin(), ready.end(), *i) == ready.end())
+        ready.push_back(*i);
+    }
+  }
+  for (vector<Edge*>::iterator i = ready.begin(); i != ready.end(); ++i) {
+    Speculation speculation = speculations_[*i];
+    speculations_.erase(*i);
+    FinishEdge(*i, true, speculation.output, speculation.usage);
+  }
+}
+
+void Builder::TraceEdgeStarted(Edge* edge) {
+  TracedJob job;
+  job.slot = find(trace_slots_taken_.begin(), trace_slots_taken_.end(),
+                  false) - trace_slots_taken_.begin();
+  if (job.slot == (int)trace_slots_taken_.size())
+    trace_slots_taken_.push_back(true);
+  else
+    trace_slots_taken_[job.slot] = true;
+  job.start = GetTimeMicros();
+  if ((size_t)edge->id() >= traced_jobs_.size())
+    traced_jobs_.resize(edge->id() + 1);
+  traced_jobs_[edge->id()] = job;
+}
+
+void Builder::TraceEdgeFinished(Edge* edge, bool success,
+                                int outputs_cleaned) {
+  const TracedJob& job = traced_jobs_[edge->id()];
+  trace_slots_taken_[job.slot] = false;
+
+  string name = edge->GetDescription();
+  if (name.empty())
+    name = edge->outputs_[0]->path();
+  char buf[64];
+  string args = "\"output\":" + JSONString(edge->outputs_[0]->path());
+  snprintf(buf, sizeof(buf), ",\"success\":%s", success ? "true" : "false");
+  args += buf;
+  if (edge->rule().restat() || scan_.content_digests()) {
+    snprintf(buf, sizeof(buf), ",\"outputs unchanged\":%d", outputs_cleaned);
+    args += buf;
+  }
+  g_tracer->JobSpan(name, job.slot, job.start, GetTimeMicros(), args);
+}
+
+bool Builder::ExtractDeps(Edge* edge, const string& deps_type,
+                          string* output, vector<Node*>* deps_nodes,
+                          string* err) {
+  if (deps_type == "msvc") {
+    // Straight from the output, with no depfile to write and read back.
+    CLParser parser;
+    string filtered_output;
+    parser.Parse(*output, &filtered_output);
+    output->swap(filtered_output);
+    deps_nodes->reserve(parser.includes_.size());
+    for (set<string>::iterator i = parser.includes_.begin();
+         i != parser.includes_.end(); ++i) {
+      deps_nodes->push_back(state_->GetNode(*i));
+    }
+    return true;
+  }
+
+  if (deps_type != "gcc") {
+    *err = "unknown deps type '" + deps_type + "'";
+    return false;
+  }
+
+  string depfile = edge->EvaluateDepFile();
+  if (depfile.empty()) {
+    *err = "edge with deps=gcc but no depfile makes no sense";
+    return false;
+  }
+
+  string content = disk_interface_->ReadFile(depfile, err);
+  if (!err->empty())
+    return false;
+  if (content.empty()) {
+    // A command that wrote no depfile has no deps to record.
+    return true;
+  }
+
+  DepfileParser deps;
+  if (!deps.Parse(&content, err)) {
+    *err = depfile + ": " + *err;
+    return false;
+  }
+
+  if (!CanonicalizePaths(&deps.ins_, err))
+    return false;
+  deps_nodes->reserve(deps.ins_.size());
+  for (vector<StringPiece>::iterator i = deps.ins_.begin();
+       i != deps.ins_.end(); ++i) {
+    deps_nodes->push_back(state_->GetNode(*i));
+  }
+
+  if (!config_.keep_depfiles) {
+    if (disk_interface_->RemoveFile(depfile) < 0) {
+      *err = "deleting depfile: " + depfile;
+      return false;
+    }
+  }
+  return true;
 }
 
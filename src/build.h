@@ -15,6 +15,7 @@
 #ifndef NINJA_BUILD_H_
 #define NINJA_BUILD_H_
 
+#include <deque>
 #include <map>
 #include <set>
 #include <string>
@@ -26,14 +27,21 @@
 #include "graph.h"  // XXX needed for DependencyScan; should rearrange.
 #include "exit_status.h"
 #include "metrics.h"
+#include "resource_usage.h"
 #include "util.h"  // int64_t
 
+struct ActionCache;
 struct BuildLog;
 struct BuildStatus;
+struct DepsLog;
 struct DiskInterface;
 struct Edge;
+struct EventStream;
+struct Jobserver;
 struct Node;
 struct State;
+struct StatusWriter;
+struct ThreadPool;
 
 /// Plan stores the state of a build plan: what we intend to build,
 /// which steps we're ready to execute.
@@ -49,6 +57,41 @@ struct Plan {
   // Returns NULL if there's no work to do.
   Edge* FindWork();
 
+  /// Put back an edge FindWork() returned that can't be started yet.
+  void DeferWork(Edge* edge);
+
+  /// With set_speculate(), pop a wanted edge whose inputs are ready but
+  /// for those of restat edges that are ready to run themselves, or
+  /// running, longest critical path first, to run on the chance that
+  /// they leave those inputs as they are.  It takes room in its pool as
+  /// FindWork()'s do, and isn't made ready when its inputs are, nor
+  /// cleaned by CleanNodes(): the caller finishes it once they are
+  /// ready, or drops it.  Each edge is tried once.  Returns NULL if there
+  /// is none.
+  Edge* FindSpeculativeWork();
+  void set_speculate(bool speculate) { speculate_ = speculate; }
+  bool speculating(const Edge* edge) const {
+    size_t id = edge->id();
+    return id < speculation_.size() && speculation_[id] == kSpeculating;
+  }
+
+  /// Give up on an edge FindSpeculativeWork() returned, its command done
+  /// with: it is run as any other once its inputs are ready.
+  void DropSpeculation(Edge* edge);
+
+  /// Weigh each wanted edge by how long it and the longest chain of
+  /// edges waiting on it took to run last time, per \a build_log (which
+  /// may be NULL), so that FindWork() starts the longest chains first.
+  /// Edges the log doesn't know are assumed to take as long as the
+  /// known ones do on average.  Edges whose commands failed last time,
+  /// and the edges they wait on, go before all others.  Call once all
+  /// targets are added.
+  void ComputeCriticalPath(BuildLog* build_log);
+
+  /// How long ComputeCriticalPath() took the commands the log doesn't
+  /// know to take, in milliseconds.
+  int64_t fallback_duration() const { return fallback_duration_; }
+
   /// Returns true if there's more work to be done.
   bool more_to_do() const { return wanted_edges_; }
 
@@ -59,25 +102,86 @@ struct Plan {
   /// tests.
   void EdgeFinished(Edge* edge);
 
-  /// Clean the given node during the build.
-  void CleanNode(DependencyScan* scan, Node* node);
+  /// Give back the room in its pool of an edge whose command failed or
+  /// was cut short.  What waits on it stays unbuilt.
+  void EdgeFailed(Edge* edge);
+
+  /// Clean the given nodes during the build, which a restat found their
+  /// commands left as they were, and what that leaves clean in turn.
+  /// Each edge they lead to is looked at once per step out from them,
+  /// however many of its inputs were cleaned, so cleaning all of an
+  /// edge's outputs at once is cheaper than one by one.
+  void CleanNodes(DependencyScan* scan, const vector<Node*>& nodes);
+  void CleanNode(DependencyScan* scan, Node* node) {
+    CleanNodes(scan, vector<Node*>(1, node));
+  }
 
   /// Number of edges with commands to run.
   int command_edge_count() const { return command_edges_; }
 
 private:
-  bool AddSubTarget(Node* node, vector<Node*>* stack, string* err);
-  bool CheckDependencyCycle(Node* node, vector<Node*>* stack, string* err);
+  /// Nodes whose in-edges are having their inputs added, outermost
+  /// first, each with the index of the next input to add.
+  typedef vector<pair<Node*, size_t> > AddStack;
+
+  /// Add \a node's in-edge to the plan.  If its inputs need adding too,
+  /// push it onto \a stack for AddTarget() to go through them.  Returns
+  /// false if the edge needn't be built, or on error.
+  bool AddSubTarget(Node* node, AddStack* stack, string* err);
+  void ReportDependencyCycle(Node* node, AddStack* stack, string* err);
   void NodeFinished(Node* node);
 
-  /// Keep track of which edges we want to build in this plan.  If this map does
-  /// not contain an entry for an edge, we do not want to build the entry or its
-  /// dependents.  If an entry maps to false, we do not want to build it, but we
-  /// might want to build one of its dependents.  If the entry maps to true, we
-  /// want to build it.
-  map<Edge*, bool> want_;
+  /// Whether FindSpeculativeWork() may return \a edge.
+  bool CanSpeculate(const Edge* edge) const;
+  /// Note those of the edges using \a node's outputs that may be run
+  /// early, for FindSpeculativeWork().
+  void AddSpeculable(Node* node);
+
+  /// Where an edge stands in the plan.  An edge that isn't in the plan
+  /// is neither built nor needed by anything we build.  One that is in
+  /// the plan but not wanted needn't be built itself, but one of its
+  /// dependents might need to be.
+  enum Want {
+    kNotPlanned,
+    kWantNothing,
+    kWantToBuild
+  };
+
+  Want want(const Edge* edge) const {
+    size_t id = edge->id();
+    return id < want_.size() ? want_[id] : kNotPlanned;
+  }
+
+  /// The Want of each edge, by Edge::id(); the plan can touch hundreds
+  /// of thousands of edges, several times each, so this is a flat array
+  /// rather than a map.
+  vector<Want> want_;
+
+  /// Whether each edge, by id, is on the AddStack; reaching it again
+  /// from its own inputs means there is a cycle.
+  vector<bool> adding_;
+
+  /// Every edge ever added to the plan, for the few walks over all of
+  /// it, each after the edges making its inputs; those since finished
+  /// are kNotPlanned again.
+  vector<Edge*> planned_;
+
+  /// Edges whose inputs are all ready, longest critical path first.
+  set<Edge*, EdgeCriticalPathCmp> ready_;
+
+  bool speculate_;
+  /// Edges that may be run early; see FindSpeculativeWork().  Some may
+  /// not be any more, and are skipped.
+  set<Edge*, EdgeCriticalPathCmp> speculable_;
+  /// Whether each edge, by id, has been run early.
+  enum Speculation {
+    kNotSpeculated,
+    kSpeculating,
+    kSpeculated
+  };
+  vector<char> speculation_;
 
-  set<Edge*> ready_;
+  int64_t fallback_duration_;
 
   /// Total number of edges that have commands (not phony).
   int command_edges_;
@@ -86,23 +190,72 @@ private:
   int wanted_edges_;
 };
 
+/// Decides how many commands to run at once, between a floor and a
+/// ceiling, from samples of how contended the machine is.  While tasks
+/// wait for a CPU or for I/O much of the time, it backs off by a quarter
+/// of the jobs; while they seldom do and all the jobs it allows are
+/// running, it takes on one more.  Samples are smoothed so that a brief
+/// spike doesn't halve the build.
+struct ParallelismController {
+  ParallelismController(int floor, int ceiling);
+
+  /// Take in the share of the time, from 0 to 1, that tasks waited for
+  /// a CPU and for I/O since the previous sample, taken at \a now (in
+  /// milliseconds) with \a running commands running.
+  void Update(double cpu, double io, int running, int64_t now);
+
+  int parallelism() const { return parallelism_; }
+
+  /// Print what was decided over the build, for -d stats.
+  void Report() const;
+
+  int floor_;
+  int ceiling_;
+  int parallelism_;
+  /// The smoothed larger of the CPU and I/O pressure.
+  double pressure_;
+
+  int samples_;
+  int lowered_;
+  int raised_;
+  int lowest_;
+  /// When the first and latest samples were taken, and the parallelism
+  /// over the time between, summed per millisecond.
+  int64_t first_sample_;
+  int64_t last_sample_;
+  double parallelism_time_;
+};
+
 /// CommandRunner is an interface that wraps running the build
 /// subcommands.  This allows tests to abstract out running commands.
 /// RealCommandRunner is an implementation that actually runs commands.
 struct CommandRunner {
   virtual ~CommandRunner() {}
   virtual bool CanRunMore() = 0;
+  /// Whether \a edge may start now that CanRunMore() said a command can,
+  /// given what it needs besides a slot.
+  virtual bool CanRunEdge(Edge* /* edge */) { return true; }
   virtual bool StartCommand(Edge* edge) = 0;
   /// Wait for a command to complete.
   virtual Edge* WaitForCommand(ExitStatus* status, string* output) = 0;
+  /// What the command WaitForCommand() last returned used, as far as
+  /// known.
+  virtual ResourceUsage LastUsage() { return ResourceUsage(); }
   virtual vector<Edge*> GetActiveEdges() { return vector<Edge*>(); }
   virtual void Abort() {}
+  /// Print stats on how commands were run, for -d stats.
+  virtual void Report() {}
 };
 
 /// Options (e.g. verbosity, parallelism) passed to a build.
 struct BuildConfig {
   BuildConfig() : verbosity(NORMAL), dry_run(false), parallelism(1),
-                  failures_allowed(1), max_load_average(-0.0f) {}
+                  failures_allowed(1), max_load_average(-0.0f),
+                  adaptive_parallelism(false), jobserver(NULL),
+                  action_cache(NULL),
+                  max_memory(-1), scan_threads(0), keep_depfiles(false),
+                  sync_log(false), content_digests(false), io_threads(0),
+                  numa_placement(false), speculate(false), events(NULL) {}
 
   enum Verbosity {
     NORMAL,
@@ -116,17 +269,71 @@ struct BuildConfig {
   /// The maximum load average we must not exceed. A negative value
   /// means that we do not have any limit.
   double max_load_average;
+  /// Run fewer than \a parallelism commands, down to one, while the
+  /// machine is contended; see ParallelismController.  Overrides
+  /// \a max_load_average.
+  bool adaptive_parallelism;
+  /// The pool to take a token from for each command run beyond the
+  /// first, or NULL to run up to \a parallelism regardless.
+  Jobserver* jobserver;
+  /// Where to take the outputs of commands run before on the same
+  /// inputs from, rather than running them, and to keep those of the
+  /// commands run; NULL for nowhere.
+  ActionCache* action_cache;
+  /// The most memory, in bytes, that the commands running at once may
+  /// be expected to use, going by how much each used last time per the
+  /// build log.  0 means no limit; a negative value means the memory
+  /// available when the build starts.
+  int64_t max_memory;
+  /// Threads to stat files and read depfiles on before scanning the
+  /// targets; see DependencyScan::Prefetch().  0 scans serially.
+  int scan_threads;
+  /// Leave depfiles in place once their deps are in the deps log.
+  bool keep_depfiles;
+  /// Write each finished command to the build log before going on,
+  /// rather than in batches; see BuildLog::SetBatching().
+  bool sync_log;
+  /// The workers, as "HOST:PORT", to run the commands of rules marked
+  /// "remote" on, in addition to those run here; see RemoteJob.
+  vector<string> remote_workers;
+  /// How to run this ninja, for "ninja -t remote-exec".
+  string ninja_command;
+  /// Go by the contents of files as well as their mtimes: an output
+  /// older than its inputs is still clean if their contents are what they
+  /// were when it was built, and an output its command rewrote as it was
+  /// doesn't make what depends on it dirty.  Digests of contents are kept
+  /// in the deps log and build log.
+  bool content_digests;
+  /// Threads to create the directories of outputs and write rspfiles on,
+  /// for as many commands ahead of starting them.  0 does that on the
+  /// build's thread as each command starts.
+  int io_threads;
+  /// Spread the commands over the machine's NUMA nodes, each bound to
+  /// one node's CPUs; see SubprocessSet::SetPlacement().
+  bool numa_placement;
+  /// With jobs to spare, run commands waiting only on restat commands
+  /// before those finish, and keep what they did if the restat commands
+  /// leave their outputs as they were; see Plan::FindSpeculativeWork().
+  bool speculate;
+  /// Where to write what the build does for programs to read, or NULL.
+  EventStream* events;
 };
 
 /// Builder wraps the build process: starting commands, updating status.
 struct Builder {
   Builder(State* state, const BuildConfig& config,
-          BuildLog* log, DiskInterface* disk_interface);
+          BuildLog* build_log, DepsLog* deps_log,
+          DiskInterface* disk_interface);
   ~Builder();
 
   /// Clean up after interrupted commands by deleting output files.
   void Cleanup();
 
+  /// Prefetch what AddTarget() will need for \a targets, if the config
+  /// asks for it, so that adding them doesn't wait on file system
+  /// latency for one file at a time.
+  void PrefetchTargets(const vector<Node*>& targets);
+
   Node* AddTarget(const string& name, string* err);
 
   /// Add a target to the build, scanning dependencies.
@@ -141,13 +348,26 @@ struct Builder {
   bool Build(string* err);
 
   bool StartEdge(Edge* edge, string* err);
-  void FinishEdge(Edge* edge, bool success, const string& output);
+  /// \a usage is what the command used, for the build log.
+  void FinishEdge(Edge* edge, bool success, const string& output,
+                  const ResourceUsage& usage = ResourceUsage());
+
+  /// Read the deps a finished command reported, for the deps log, the
+  /// way \a deps_type says.  For "msvc" they are in its \a output, from
+  /// which they are removed.
+  bool ExtractDeps(Edge* edge, const string& deps_type, string* output,
+                   vector<Node*>* deps_nodes, string* err);
 
   /// Used for tests.
   void SetBuildLog(BuildLog* log) {
     scan_.set_build_log(log);
   }
 
+  /// See DependencyScan::UseMtimes().
+  void UseMtimes(const vector<TimeStamp>& mtimes) {
+    scan_.UseMtimes(mtimes);
+  }
+
   State* state_;
   const BuildConfig& config_;
   Plan plan_;
@@ -155,8 +375,80 @@ struct Builder {
   BuildStatus* status_;
 
  private:
+  struct PrepareTask;
+
+  /// A task creating the directories of \a edge's outputs that aren't
+  /// in made_dirs_ and writing its rspfile, or NULL if there is nothing
+  /// to do.
+  PrepareTask* NewPrepareTask(Edge* edge);
+  /// Take edges to run next from the plan, up to config_.io_threads, and
+  /// start preparing them on io_pool_.
+  void PrepareMore();
+  /// The edge to start next: the first of prepared_, else one from the
+  /// plan.
+  Edge* NextEdge();
+
+  /// For -d trace: give \a edge the first job slot free, and record its
+  /// span on that slot's track once finished.  \a outputs_cleaned is how
+  /// many outputs restat, or the contents digests, found unchanged.
+  void TraceEdgeStarted(Edge* edge);
+  void TraceEdgeFinished(Edge* edge, bool success, int outputs_cleaned);
+
+  /// Delete the outputs \a edge's command wrote, and its depfile.
+  void RemoveOutputs(Edge* edge);
+
+  /// A command Plan::FindSpeculativeWork() gave, whose inputs may not be
+  /// ready yet.
+  struct Speculation {
+    Speculation() : finished(false), stale(false) {}
+    /// Whether it succeeded, its output and usage kept for when its
+    /// inputs are ready.
+    bool finished;
+    /// Whether an input it read changed after, so it is to be run again.
+    bool stale;
+    string output;
+    ResourceUsage usage;
+  };
+  /// Take the result of \a edge's command, run early.  Returns true if
+  /// the edge is to be finished now; otherwise it waits for its inputs,
+  /// or is dropped.
+  bool SpeculationFinished(Edge* edge, bool success, const string& output,
+                           const ResourceUsage& usage);
+  /// Forget \a edge's command, run early, and what it wrote; it is run
+  /// again if it is still wanted.
+  void DropSpeculation(Edge* edge);
+  /// \a node was changed, or failed to build: those run early that read
+  /// it are run again.
+  void SpeculationsStale(Node* node);
+  /// Finish those run early, and done, that \a edge's outputs were the
+  /// last inputs of.
+  void FinishSpeculations(Edge* edge);
+
   DiskInterface* disk_interface_;
   DependencyScan scan_;
+  /// Edges started whose outputs StartEdge() took from the action cache,
+  /// to finish as if their commands had run.
+  queue<Edge*> restored_;
+  /// The directories of outputs made, or found, so far, which aren't
+  /// looked at again.
+  set<string> made_dirs_;
+  /// Where PrepareMore() prepares edges; NULL without config_.io_threads.
+  ThreadPool* io_pool_;
+  /// Edges taken from the plan by PrepareMore(), in order, and what is
+  /// being done for them.
+  deque<Edge*> prepared_;
+  map<Edge*, PrepareTask*> prepare_tasks_;
+  /// The job slot and start time of each running edge, by Edge::id(),
+  /// and which slots are taken, for -d trace.
+  struct TracedJob {
+    int slot;
+    int64_t start;
+  };
+  vector<TracedJob> traced_jobs_;
+  vector<bool> trace_slots_taken_;
+  /// The commands running, or done, that Plan::FindSpeculativeWork()
+  /// gave.
+  map<Edge*, Speculation> speculations_;
 
   // Unimplemented copy ctor and operator= ensure we don't copy the auto_ptr.
   Builder(const Builder &other);        // DO NOT IMPLEMENT
@@ -164,12 +456,17 @@ struct Builder {
 };
 
 /// Tracks the status of a build: completion fraction, printing updates.
+/// On a smart terminal the status line is drawn by a StatusWriter, at
+/// most kStatusIntervalMillis apart, except on Windows.
 struct BuildStatus {
   explicit BuildStatus(const BuildConfig& config);
+  ~BuildStatus();
   void PlanHasTotalEdges(int total);
   void BuildEdgeStarted(Edge* edge);
   void BuildEdgeFinished(Edge* edge, bool success, const string& output,
                          int* start_time, int* end_time);
+  /// \a edge's command, started, is to be run again.
+  void BuildEdgeDropped(Edge* edge);
   void BuildFinished();
 
   /// Format the progress status string by replacing the placeholders.
@@ -180,6 +477,8 @@ struct BuildStatus {
 
  private:
   void PrintStatus(Edge* edge);
+  /// Print \a text as it is, after the status line.
+  void PrintOutput(const string& text);
 
   const BuildConfig& config_;
 
@@ -190,12 +489,13 @@ struct BuildStatus {
 
   bool have_blank_line_;
 
-  /// Map of running edge to time the edge started running.
-  typedef map<Edge*, int> RunningEdgeMap;
-  RunningEdgeMap running_edges_;
+  /// The time each running edge started, by Edge::id().
+  vector<int> start_times_;
 
   /// Whether we can do fancy terminal control codes.
   bool smart_terminal_;
+  /// What prints on the smart terminal, or NULL to print here.
+  StatusWriter* writer_;
 
   /// The custom progress status format to use.
   const char* progress_status_format_;
@@ -0,0 +1,211 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "build_estimate.h"
+
+#include <stdio.h>
+
+#include <algorithm>
+
+#include "build_log.h"
+#include "graph.h"
+
+namespace {
+
+/// How many spans Print() shows the utilization over, and the width of
+/// its bars.
+const int kUtilizationSpans = 20;
+const int kBarWidth = 40;
+
+}  // anonymous namespace
+
+BuildEstimate::BuildEstimate(const BuildConfig& config, BuildLog* build_log,
+                             const Plan* plan)
+    : config_(config), build_log_(build_log), plan_(plan), now_(0),
+      last_(NULL), guessed_(0), total_work_(0),
+      memory_limit_(config.max_memory), running_rss_(0) {
+  if (memory_limit_ < 0)
+    memory_limit_ = max(GetAvailableMemory(), (int64_t)0);
+}
+
+bool BuildEstimate::CanRunMore() {
+  return (int)running_.size() < config_.parallelism;
+}
+
+bool BuildEstimate::CanRunEdge(Edge* edge) {
+  if (memory_limit_ == 0 || running_.empty())
+    return true;
+  return running_rss_ + PredictPeakRSS(edge) <= memory_limit_;
+}
+
+bool BuildEstimate::StartCommand(Edge* edge) {
+  int64_t ready;
+  Edge* after = LastInput(edge, &ready);
+  int64_t duration = Duration(edge);
+  Job* j = job(edge);
+  j->start = now_;
+  j->ready = ready;
+  j->finish = now_ + duration;
+  j->after = after;
+  total_work_ += duration;
+  running_rss_ += PredictPeakRSS(edge);
+  running_[make_pair(j->finish, (int)started_.size())] = edge;
+  started_.push_back(edge);
+  return true;
+}
+
+Edge* BuildEstimate::WaitForCommand(ExitStatus* status, string* output) {
+  if (running_.empty()) {
+    *status = ExitFailure;
+    return NULL;
+  }
+  map<pair<int64_t, int>, Edge*>::iterator first = running_.begin();
+  Edge* edge = first->second;
+  now_ = first->first.first;
+  running_.erase(first);
+  running_rss_ -= PredictPeakRSS(edge);
+  last_ = edge;
+  *status = ExitSuccess;
+  return edge;
+}
+
+vector<Edge*> BuildEstimate::GetActiveEdges() {
+  vector<Edge*> edges;
+  for (map<pair<int64_t, int>, Edge*>::iterator i = running_.begin();
+       i != running_.end(); ++i)
+    edges.push_back(i->second);
+  return edges;
+}
+
+void BuildEstimate::Abort() {
+  running_.clear();
+  running_rss_ = 0;
+}
+
+vector<Edge*> BuildEstimate::LimitingPath() const {
+  vector<Edge*> path;
+  for (Edge* edge = last_; edge; edge = jobs_[edge->id()].after)
+    path.push_back(edge);
+  reverse(path.begin(), path.end());
+  return path;
+}
+
+vector<double> BuildEstimate::Utilization(int spans) const {
+  vector<double> busy(spans);
+  if (now_ <= 0)
+    return busy;
+  double width = now_ / (double)spans;
+  for (vector<Edge*>::const_iterator i = started_.begin();
+       i != started_.end(); ++i) {
+    const Job& j = jobs_[(*i)->id()];
+    int last = min((int)(j.finish / width), spans - 1);
+    for (int span = (int)(j.start / width); span <= last; ++span) {
+      double from = max((double)j.start, span * width);
+      double to = min((double)j.finish, (span + 1) * width);
+      if (to > from)
+        busy[span] += (to - from) / width;
+    }
+  }
+  return busy;
+}
+
+void BuildEstimate::Print() const {
+  printf("estimated time  %.3f s, %d commands at -j %d\n", now_ / 1000.0,
+         commands(), config_.parallelism);
+  printf("total work      %.3f s", total_work_ / 1000.0);
+  if (guessed_) {
+    printf(", taking the %d commands not in the build log to take the "
+           "average", guessed_);
+  }
+  printf("\n");
+  if (now_ > 0)
+    printf("parallelism     %.1fx\n", total_work_ / (double)now_);
+
+  printf("\n%8s %8s\n", "from s", "busy");
+  vector<double> busy = Utilization(kUtilizationSpans);
+  for (int span = 0; span < kUtilizationSpans && now_ > 0; ++span) {
+    double share = busy[span] / config_.parallelism;
+    printf("%8.3f %7.0f%%  %s\n",
+           now_ / 1000.0 * span / kUtilizationSpans, share * 100,
+           string((size_t)(share * kBarWidth + 0.5), '#').c_str());
+  }
+
+  // Each waits for the one before, then perhaps for room to start.
+  printf("\n%8s %8s %8s  %s\n", "start s", "wait s", "time s", "output");
+  vector<Edge*> path = LimitingPath();
+  for (vector<Edge*>::iterator i = path.begin(); i != path.end(); ++i) {
+    const Job& j = jobs_[(*i)->id()];
+    printf("%8.3f %8.3f %8.3f  %s\n", j.start / 1000.0,
+           (j.start - j.ready) / 1000.0, (j.finish - j.start) / 1000.0,
+           (*i)->outputs_[0]->path().c_str());
+  }
+}
+
+BuildEstimate::Job* BuildEstimate::job(const Edge* edge) {
+  if ((size_t)edge->id() >= jobs_.size())
+    jobs_.resize(edge->id() + 1);
+  return &jobs_[edge->id()];
+}
+
+Edge* BuildEstimate::LastInput(Edge* edge, int64_t* finish) {
+  Edge* last = NULL;
+  *finish = 0;
+  for (EdgeInputs::iterator i = edge->inputs_.begin();
+       i != edge->inputs_.end(); ++i) {
+    Edge* in_edge = (*i)->in_edge();
+    if (!in_edge)
+      continue;
+    Edge* command;
+    int64_t in_finish;
+    if (in_edge->is_phony()) {
+      // Ready once its own inputs are; it may stand for many commands.
+      if (!job(in_edge)->looked) {
+        Edge* after = LastInput(in_edge, &in_finish);
+        Job* j = job(in_edge);
+        j->after = after;
+        j->finish = in_finish;
+        j->looked = true;
+      }
+      command = job(in_edge)->after;
+      in_finish = job(in_edge)->finish;
+    } else {
+      // Not started means it didn't need to run.
+      command = in_edge;
+      in_finish = job(in_edge)->finish;
+      if (job(in_edge)->start < 0)
+        command = NULL;
+    }
+    if (command && (!last || in_finish > *finish)) {
+      last = command;
+      *finish = in_finish;
+    }
+  }
+  return last;
+}
+
+int64_t BuildEstimate::Duration(Edge* edge) {
+  int64_t duration = build_log_ ? build_log_->LastDuration(edge) : -1;
+  if (duration >= 0)
+    return duration;
+  ++guessed_;
+  return plan_->fallback_duration();
+}
+
+int64_t BuildEstimate::PredictPeakRSS(Edge* edge) {
+  if (!build_log_ || edge->outputs_.empty())
+    return 0;
+  BuildLog::LogEntry* entry =
+      build_log_->LookupByOutput(edge->outputs_[0]);
+  return entry ? entry->usage.peak_rss : 0;
+}
@@ -0,0 +1,117 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef NINJA_BUILD_ESTIMATE_H_
+#define NINJA_BUILD_ESTIMATE_H_
+
+#include <map>
+#include <vector>
+using namespace std;
+
+#include "build.h"
+
+/// Runs a dry run's commands on a clock of its own, each taking as long
+/// as it took last time per the build log, so that the Builder schedules
+/// them as it would for real -- longest chains first, within -j, -m and
+/// the pools -- and how long the build will take can be told before
+/// starting it.  Commands the log doesn't know take the average, as in
+/// Plan::ComputeCriticalPath().  For "ninja --estimate".
+///
+/// -l, remote workers and the action cache aren't foreseen: commands run
+/// up to -j at once, here.
+struct BuildEstimate : public CommandRunner {
+  /// \a build_log may be NULL.  \a plan is the plan of the Builder this
+  /// runs the commands of.
+  BuildEstimate(const BuildConfig& config, BuildLog* build_log,
+                const Plan* plan);
+
+  virtual bool CanRunMore();
+  virtual bool CanRunEdge(Edge* edge);
+  virtual bool StartCommand(Edge* edge);
+  virtual Edge* WaitForCommand(ExitStatus* status, string* output);
+  virtual vector<Edge*> GetActiveEdges();
+  virtual void Abort();
+
+  /// The time since the build started, in milliseconds: once it is over,
+  /// how long it would take.
+  int64_t now() const { return now_; }
+  /// How many commands were started, and how many of them the log
+  /// didn't know.
+  int commands() const { return (int)started_.size(); }
+  int guessed() const { return guessed_; }
+  /// The time the commands take between them, in milliseconds.
+  int64_t total_work() const { return total_work_; }
+
+  /// The commands the build waits on last, in the order they run: the
+  /// one to finish last, the one among its inputs it waited on last,
+  /// and so on.  Between each, a command may wait for room to start.
+  vector<Edge*> LimitingPath() const;
+
+  /// When \a edge's command would start, and finish, and when its last
+  /// input would be ready.
+  int64_t Start(const Edge* edge) const { return jobs_[edge->id()].start; }
+  int64_t Finish(const Edge* edge) const { return jobs_[edge->id()].finish; }
+  int64_t Ready(const Edge* edge) const { return jobs_[edge->id()].ready; }
+
+  /// The average number of commands running over each of \a spans equal
+  /// spans of the build.
+  vector<double> Utilization(int spans) const;
+
+  /// Print the estimate: how long, how busy the jobs would be over time,
+  /// and the limiting path.
+  void Print() const;
+
+ private:
+  /// What is known of an edge, by Edge::id().
+  struct Job {
+    Job() : start(-1), ready(0), finish(-1), after(NULL), looked(false) {}
+    int64_t start;
+    int64_t ready;
+    /// For a phony edge, when its last input was ready.
+    int64_t finish;
+    /// The command among its inputs it waited on last, or NULL.
+    Edge* after;
+    /// For a phony edge, whether finish and after are known.
+    bool looked;
+  };
+  Job* job(const Edge* edge);
+
+  /// The command \a edge's inputs wait on last, looking through phony
+  /// edges, filling in when it finishes; NULL with 0 if none ran.
+  Edge* LastInput(Edge* edge, int64_t* finish);
+
+  int64_t Duration(Edge* edge);
+  int64_t PredictPeakRSS(Edge* edge);
+
+  const BuildConfig& config_;
+  BuildLog* build_log_;
+  const Plan* plan_;
+
+  int64_t now_;
+  vector<Job> jobs_;
+  /// The commands started, in order.
+  vector<Edge*> started_;
+  /// Those running, by when they finish and then the order started.
+  map<pair<int64_t, int>, Edge*> running_;
+  /// The last to finish so far.
+  Edge* last_;
+  int guessed_;
+  int64_t total_work_;
+
+  /// As in RealCommandRunner: see BuildConfig::max_memory.
+  int64_t memory_limit_;
+  int64_t running_rss_;
+};
+
+#endif  // NINJA_BUILD_ESTIMATE_H_
@@ -0,0 +1,133 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "build_estimate.h"
+
+#include "build_log.h"
+#include "graph.h"
+#include "test.h"
+
+struct BuildEstimateTest : public StateTestWithBuiltinRules {
+  virtual void SetUp() {
+    ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"pool serial\n"
+"  depth = 1\n"
+"rule serial\n"
+"  command = cat $in > $out\n"
+"  pool = serial\n"
+"build a.o: serial a.c\n"
+"build b.o: cat b.c\n"
+"build c.o: cat c.c\n"
+"build gen.h: serial gen.in\n"
+"build d.o: cat d.c || gen.h\n"
+"build objs: phony a.o b.o c.o d.o\n"
+"build app: cat objs\n"));
+    const char* sources[] = { "a.c", "b.c", "c.c", "d.c", "gen.in" };
+    for (size_t i = 0; i < sizeof(sources) / sizeof(sources[0]); ++i)
+      fs_.Create(sources[i], 1, "");
+    config_.dry_run = true;
+    config_.verbosity = BuildConfig::QUIET;
+    config_.max_memory = 0;
+  }
+
+  void Record(const char* output, int duration) {
+    build_log_.RecordCommand(GetNode(output)->in_edge(), 0, duration);
+  }
+
+  void RecordAll() {
+    Record("a.o", 30);
+    Record("b.o", 10);
+    Record("c.o", 10);
+    Record("gen.h", 50);
+    Record("d.o", 20);
+    Record("app", 5);
+  }
+
+  /// Estimate building app at -j \a parallelism.
+  void Estimate(int parallelism) {
+    config_.parallelism = parallelism;
+    state_.Reset();
+    builder_.reset(new Builder(&state_, config_, &build_log_, NULL, &fs_));
+    estimate_ = new BuildEstimate(config_, &build_log_, &builder_->plan_);
+    builder_->command_runner_.reset(estimate_);
+    string err;
+    EXPECT_TRUE(builder_->AddTarget("app", &err));
+    ASSERT_EQ("", err);
+    EXPECT_TRUE(builder_->Build(&err));
+    EXPECT_EQ("", err);
+  }
+
+  int64_t Start(const char* output) {
+    return estimate_->Start(GetNode(output)->in_edge());
+  }
+
+  VirtualFileSystem fs_;
+  BuildLog build_log_;
+  BuildConfig config_;
+  auto_ptr<Builder> builder_;
+  BuildEstimate* estimate_;
+};
+
+TEST_F(BuildEstimateTest, Schedule) {
+  RecordAll();
+  // gen.h and a.o can't run at once, so b.o and c.o run beside gen.h,
+  // and a.o waits for it, then holds up app.
+  Estimate(2);
+  EXPECT_EQ(6, estimate_->commands());
+  EXPECT_EQ(0, estimate_->guessed());
+  EXPECT_EQ(125, estimate_->total_work());
+  EXPECT_EQ(85, estimate_->now());
+  EXPECT_EQ(0, Start("gen.h"));
+  EXPECT_EQ(0, Start("b.o"));
+  EXPECT_EQ(10, Start("c.o"));
+  EXPECT_EQ(50, Start("a.o"));
+  EXPECT_EQ(50, Start("d.o"));
+  EXPECT_EQ(80, Start("app"));
+
+  vector<Edge*> path = estimate_->LimitingPath();
+  ASSERT_EQ(2u, path.size());
+  EXPECT_EQ("a.o", path[0]->outputs_[0]->path());
+  EXPECT_EQ(0, estimate_->Ready(path[0]));
+  EXPECT_EQ("app", path[1]->outputs_[0]->path());
+  EXPECT_EQ(80, estimate_->Ready(path[1]));
+
+  // Two running until 20, then gen.h; both from 50 to 70, then one.
+  vector<double> busy = estimate_->Utilization(17);
+  EXPECT_DOUBLE_EQ(2.0, busy[0]);
+  EXPECT_DOUBLE_EQ(1.0, busy[5]);
+  EXPECT_DOUBLE_EQ(2.0, busy[10]);
+  EXPECT_DOUBLE_EQ(1.0, busy[16]);
+
+  // One at a time, the build takes as long as its commands.  (The dry
+  // run recorded them as taking no time.)
+  RecordAll();
+  Estimate(1);
+  EXPECT_EQ(125, estimate_->now());
+}
+
+TEST_F(BuildEstimateTest, Unlogged) {
+  // Those not in the log take the average of those that are.
+  Record("a.o", 40);
+  Record("b.o", 20);
+  Estimate(8);
+  EXPECT_EQ(4, estimate_->guessed());
+  EXPECT_EQ(40 + 20 + 4 * 30, estimate_->total_work());
+  // gen.h, then a.o once the pool has room, then app.
+  EXPECT_EQ(30 + 40 + 30, estimate_->now());
+  vector<Edge*> path = estimate_->LimitingPath();
+  ASSERT_EQ(2u, path.size());
+  EXPECT_EQ("a.o", path[0]->outputs_[0]->path());
+  EXPECT_EQ(0, estimate_->Ready(path[0]));
+  EXPECT_EQ(30, estimate_->Start(path[0]));
+}
@@ -18,29 +18,71 @@
 #include <stdlib.h>
 #include <string.h>
 
-#ifndef _WIN32
+#ifdef _WIN32
+#include <io.h>  // _chsize
+#include <process.h>  // _getpid
+#else
 #define __STDC_FORMAT_MACROS
 #include <inttypes.h>
+#include <pthread.h>
+#include <sys/time.h>
 #include <unistd.h>
 #endif
 
+#include <algorithm>
+
 #include "build.h"
 #include "graph.h"
 #include "metrics.h"
+#include "thread_pool.h"
 #include "util.h"
 
 // Implementation details:
-// Each run's log appends to the log file.
-// To load, we run through all log entries in series, throwing away
-// older runs.
-// Once the number of redundant entries exceeds a threshold, we write
-// out a new file and replace the existing one with it.
+// Each run's log appends to the log file.  Recorded commands are queued
+// and handed to a writer thread in batches, one batch at a time.
+// Once the number of entries appended since the log was last rewritten
+// exceeds a threshold, we write out a new file and replace the existing
+// one with it.
+//
+// The file is in host byte order; it is never shared between machines.
+// After the signature and a uint32 version come three uint32s: the
+// number of buckets in the index, the number of indexed records, and the
+// size of the path table.  Then come the buckets, each 1 + the number of
+// a record or 0 for an empty one, found by linear probing from the hash
+// of the path; the records; and the path table.  Each record is a
+// Record, whose path is at path_offset in the path table.  Entries
+// recorded since the index was written follow, each a Record holding
+// the complement of its path's size instead of an offset, then the path.
+// The complement catches a record cut short or garbled.
+//
+// Versions 7, 8 and 9 were the same but for records that ended before
+// peak_rss, input_digest and user_millis respectively.  Logs in the
+// older text format start with kTextSignature: a line per entry, with
+// tab-separated fields.  Both are loaded, and rewritten in the current
+// format before anything is appended.
 
 namespace {
 
-const char kFileSignature[] = "# ninja log v%d\n";
+const char kTextSignature[] = "# ninja log v%d\n";
 const int kOldestSupportedVersion = 4;
-const int kCurrentVersion = 5;
+const int kCurrentTextVersion = 6;
+
+const char kFileSignature[] = "# ninjalog\n";
+const uint32_t kCurrentVersion = 10;
+const size_t kHeaderSize = sizeof(kFileSignature) - 1 + 4 * sizeof(uint32_t);
+
+/// When to recompact on load: once more than this many entries have been
+/// appended since the last recompaction, and they are more than a
+/// kCompactionRatio'th of the indexed ones.
+const int kMinCompactionEntryCount = 100;
+const int kCompactionRatio = 3;
+
+/// Record::flags of a failed command.
+const uint32_t kRecordFailed = 1;
+
+/// Default batching; see BuildLog::SetBatching().
+const size_t kBatchBytes = 64 << 10;
+const int kBatchMillis = 100;
 
 // 64bit MurmurHash2, by Austin Appleby
 #if defined(_MSC_VER)
@@ -48,12 +90,15 @@ const int kCurrentVersion = 5;
 #else   // defined(_MSC_VER)
 #define BIG_CONSTANT(x) (x##LLU)
 #endif // !defined(_MSC_VER)
+const uint64_t kMurmurSeed = 0xDECAFBADDECAFBADull;
+const uint64_t kMurmurM = BIG_CONSTANT(0xc6a4a7935bd1e995);
+const int kMurmurR = 47;
+
 inline
 uint64_t MurmurHash64A(const void* key, size_t len) {
-  static const uint64_t seed = 0xDECAFBADDECAFBADull;
-  const uint64_t m = BIG_CONSTANT(0xc6a4a7935bd1e995);
-  const int r = 47;
-  uint64_t h = seed ^ (len * m);
+  const uint64_t m = kMurmurM;
+  const int r = kMurmurR;
+  uint64_t h = kMurmurSeed ^ (len * m);
   const uint64_t * data = (const uint64_t *)key;
   const uint64_t * end = data + (len/8);
   while(data != end) {
@@ -83,26 +128,389 @@ uint64_t MurmurHash64A(const void* key, size_t len) {
 }
 #undef BIG_CONSTANT
 
+/// Map the log at \a path into \a file.  Returns -errno and fills in
+/// \a err on error.
+int OpenLogFile(const string& path, MappedFile* file, string* err) {
+#ifndef _WIN32
+  return file->Open(path, err);
+#else
+  // MappedFile reads in text mode on Windows.
+  FILE* f = fopen(path.c_str(), "rb");
+  if (!f) {
+    err->assign(strerror(errno));
+    return -errno;
+  }
+  string contents;
+  char buf[64 << 10];
+  size_t len;
+  while ((len = fread(buf, 1, sizeof(buf), f)) > 0)
+    contents.append(buf, len);
+  if (ferror(f)) {
+    err->assign(strerror(errno));
+    fclose(f);
+    return -errno;
+  }
+  fclose(f);
+  file->Adopt(&contents);
+  return 0;
+#endif
+}
 
 }  // namespace
 
+struct BuildLog::Record {
+  uint32_t path_offset;
+  uint32_t path_size;
+  uint64_t command_hash;
+  int start_time;
+  int end_time;
+  TimeStamp restat_mtime;
+  int64_t peak_rss;
+  uint64_t input_digest;
+  /// The rest of ResourceUsage.
+  uint32_t user_millis;
+  uint32_t system_millis;
+  uint32_t blocks_read;
+  uint32_t blocks_written;
+  uint32_t context_switches;
+  /// kRecordFailed, or 0; always 0 in logs before this was kept.
+  uint32_t flags;
+};
+
+namespace {
+
+/// Records of version 7, 8 and 9 logs, which are Record cut short.
+struct RecordV7 {
+  uint32_t path_offset;
+  uint32_t path_size;
+  uint64_t command_hash;
+  int start_time;
+  int end_time;
+  TimeStamp restat_mtime;
+};
+
+struct RecordV8 {
+  RecordV7 v7;
+  int64_t peak_rss;
+};
+
+struct RecordV9 {
+  RecordV8 v8;
+  uint64_t input_digest;
+};
+
+}  // namespace
+
+struct BuildLog::CompactTask : public ThreadPool::Task {
+  CompactTask(BuildLog* log, const string& temp_path)
+      : log_(log), temp_path_(temp_path), ok_(false) {}
+
+  virtual void Run() {
+    ok_ = log_->CompactInto(temp_path_, &err_);
+  }
+
+  BuildLog* log_;
+  string temp_path_;
+  bool ok_;
+  string err_;
+};
+
+struct BuildLog::Writer {
+  Writer(FILE* file, size_t batch_bytes, int batch_millis);
+  /// Flush() and stop the thread.
+  ~Writer();
+
+  /// Queue \a data to be written once the batch is due.
+  void Append(const string& data);
+
+  /// Write what is queued if the batch is due and there is no thread
+  /// to, which is always so on Windows.
+  void WriteIfDue();
+
+  /// Write everything queued, and wait until it is written.
+  void Flush();
+
+  /// The first error a write ran into since the last call, or 0.
+  int TakeError();
+
+ private:
+  /// Whether what is queued should be written now.
+  bool Due() const;
+
+  /// Write \a data to file_.  Returns an errno on failure, else 0.
+  int Write(const string& data);
+  /// Note \a error, unless one was already.
+  void NoteError(int error) {
+    if (!error_)
+      error_ = error;
+  }
+
+  void Lock();
+  void Unlock();
+
+  FILE* file_;
+  size_t batch_bytes_;
+  int batch_millis_;
+  bool started_;
+
+  /// Guarded by mutex_, which cond_ signals changes to.
+  string pending_;
+  /// When the first record in pending_ was queued.
+  int64_t pending_since_;
+  /// Whether the thread is writing what it took out of pending_.
+  bool writing_;
+  /// Whether to write pending_ now rather than when due.
+  bool flushing_;
+  bool quit_;
+  int error_;
+
+#ifndef _WIN32
+  static void* ThreadMain(void* writer);
+  void Run();
+
+  pthread_t thread_;
+  pthread_mutex_t mutex_;
+  pthread_cond_t cond_;
+#endif
+};
+
+BuildLog::Writer::Writer(FILE* file, size_t batch_bytes, int batch_millis)
+    : file_(file), batch_bytes_(batch_bytes), batch_millis_(batch_millis),
+      started_(false), pending_since_(0), writing_(false), flushing_(false),
+      quit_(false), error_(0) {
+#ifndef _WIN32
+  pthread_mutex_init(&mutex_, NULL);
+  pthread_cond_init(&cond_, NULL);
+  int ret = pthread_create(&thread_, NULL, ThreadMain, this);
+  if (ret != 0)
+    Warning("pthread_create: %s", strerror(ret));  // Writes when due.
+  else
+    started_ = true;
+#endif
+}
+
+BuildLog::Writer::~Writer() {
+  Flush();
+#ifndef _WIN32
+  if (started_) {
+    Lock();
+    quit_ = true;
+    pthread_cond_broadcast(&cond_);
+    Unlock();
+    pthread_join(thread_, NULL);
+  }
+  pthread_cond_destroy(&cond_);
+  pthread_mutex_destroy(&mutex_);
+#endif
+}
+
+void BuildLog::Writer::Append(const string& data) {
+  Lock();
+  if (pending_.empty())
+    pending_since_ = GetTimeMillis();
+  pending_.append(data);
+#ifndef _WIN32
+  // The thread waits untimed for the first record, and timed for more.
+  if (pending_.size() == data.size() || pending_.size() >= batch_bytes_)
+    pthread_cond_broadcast(&cond_);
+#endif
+  Unlock();
+}
+
+void BuildLog::Writer::WriteIfDue() {
+  if (started_)
+    return;
+  if (Due())
+    Flush();
+}
+
+void BuildLog::Writer::Flush() {
+  Lock();
+  if (!started_) {
+    // Do what the thread would.
+    string data;
+    data.swap(pending_);
+    if (!data.empty())
+      NoteError(Write(data));
+  } else {
+#ifndef _WIN32
+    flushing_ = true;
+    pthread_cond_broadcast(&cond_);
+    while (!pending_.empty() || writing_)
+      pthread_cond_wait(&cond_, &mutex_);
+    flushing_ = false;
+#endif
+  }
+  Unlock();
+}
+
+int BuildLog::Writer::TakeError() {
+  Lock();
+  int error = error_;
+  error_ = 0;
+  Unlock();
+  return error;
+}
+
+bool BuildLog::Writer::Due() const {
+  return !pending_.empty() &&
+      (flushing_ || pending_.size() >= batch_bytes_ ||
+       GetTimeMillis() - pending_since_ >= batch_millis_);
+}
+
+int BuildLog::Writer::Write(const string& data) {
+  if (fwrite(data.data(), data.size(), 1, file_) < 1 ||
+      fflush(file_) != 0) {
+    return errno ? errno : EIO;
+  }
+  return 0;
+}
+
+#ifdef _WIN32
+
+void BuildLog::Writer::Lock() {}
+
+void BuildLog::Writer::Unlock() {}
+
+#else  // !_WIN32
+
+void BuildLog::Writer::Lock() {
+  pthread_mutex_lock(&mutex_);
+}
+
+void BuildLog::Writer::Unlock() {
+  pthread_mutex_unlock(&mutex_);
+}
+
+// static
+void* BuildLog::Writer::ThreadMain(void* writer) {
+  static_cast<Writer*>(writer)->Run();
+  return NULL;
+}
+
+void BuildLog::Writer::Run() {
+  Lock();
+  for (;;) {
+    // Wait for the batch to be due, however long it is since a record
+    // was last queued.
+    while (!Due() && !quit_) {
+      if (pending_.empty()) {
+        pthread_cond_wait(&cond_, &mutex_);
+        continue;
+      }
+      int64_t wait = pending_since_ + batch_millis_ - GetTimeMillis();
+      struct timeval now;
+      gettimeofday(&now, NULL);
+      int64_t deadline_usec = now.tv_usec + wait * 1000;
+      struct timespec deadline;
+      deadline.tv_sec = now.tv_sec + deadline_usec / 1000000;
+      deadline.tv_nsec = (deadline_usec % 1000000) * 1000;
+      pthread_cond_timedwait(&cond_, &mutex_, &deadline);
+    }
+    if (pending_.empty())
+      break;  // Quitting, with nothing left to write.
+
+    string data;
+    data.swap(pending_);
+    writing_ = true;
+    Unlock();
+    // Nothing else touches file_ meanwhile.
+    int error = Write(data);
+    Lock();
+    NoteError(error);
+    writing_ = false;
+    pthread_cond_broadcast(&cond_);
+  }
+  Unlock();
+}
+
+#endif  // _WIN32
+
 // static
 uint64_t BuildLog::LogEntry::HashCommand(StringPiece command) {
   return MurmurHash64A(command.str_, command.len_);
 }
 
+BuildLog::LogEntry::CommandHasher::CommandHasher(uint64_t len)
+    : hash_(kMurmurSeed ^ (len * kMurmurM)), tail_len_(0) {}
+
+void BuildLog::LogEntry::CommandHasher::Mix(const char* block) {
+  // MurmurHash64A's loop, a block at a time.
+  uint64_t k;
+  memcpy(&k, block, sizeof(k));
+  k *= kMurmurM;
+  k ^= k >> kMurmurR;
+  k *= kMurmurM;
+  hash_ ^= k;
+  hash_ *= kMurmurM;
+}
+
+void BuildLog::LogEntry::CommandHasher::Update(StringPiece piece) {
+  const char* data = piece.str_;
+  size_t len = piece.len_;
+  if (tail_len_ > 0) {
+    size_t take = min(len, sizeof(tail_) - tail_len_);
+    memcpy(tail_ + tail_len_, data, take);
+    tail_len_ += take;
+    data += take;
+    len -= take;
+    if (tail_len_ < sizeof(tail_))
+      return;
+    Mix(tail_);
+    tail_len_ = 0;
+  }
+  const char* end = data + (len & ~(size_t)7);
+  for (; data != end; data += 8)
+    Mix(data);
+  tail_len_ = len & 7;
+  memcpy(tail_, data, tail_len_);
+}
+
+uint64_t BuildLog::LogEntry::CommandHasher::Finish() {
+  // MurmurHash64A's tail and final mix.
+  uint64_t h = hash_;
+  const unsigned char* data = (const unsigned char*)tail_;
+  // Byte i goes i bytes up, as in the original's falling-through switch.
+  if (tail_len_ > 0) {
+    for (size_t i = 0; i < tail_len_; ++i)
+      h ^= uint64_t(data[i]) << (8 * i);
+    h *= kMurmurM;
+  }
+  h ^= h >> kMurmurR;
+  h *= kMurmurM;
+  h ^= h >> kMurmurR;
+  return h;
+}
+
+unsigned BuildLog::next_serial_ = 1;
+
 BuildLog::BuildLog()
-  : log_file_(NULL), needs_recompaction_(false) {}
+  : serial_(next_serial_++), log_file_(NULL), needs_recompaction_(false),
+    batch_bytes_(kBatchBytes), batch_millis_(kBatchMillis), writer_(NULL),
+    compact_task_(NULL), compactor_(NULL), bucket_count_(0),
+    buckets_(NULL), records_(NULL), record_count_(0), paths_(NULL),
+    paths_size_(0), tail_end_(NULL) {}
 
 BuildLog::~BuildLog() {
   Close();
+  for (Entries::iterator i = entries_.begin(); i != entries_.end(); ++i)
+    delete i->second;
 }
 
-bool BuildLog::OpenForWrite(const string& path, string* err) {
+bool BuildLog::OpenForWrite(const string& path, string* err,
+                            const BuildLogUser* user) {
+  // A loaded binary log is compacted while the build runs; a text one
+  // has to be converted before anything is appended to it.
+  bool compact = false;
   if (needs_recompaction_) {
     Close();
-    if (!Recompact(path, err))
-      return false;
+    if (tail_end_) {
+      compact = true;
+    } else {
+      printf("Recompacting log...\n");
+      if (!Recompact(path, err, user))
+        return false;
+    }
   }
 
   log_file_ = fopen(path.c_str(), "ab");
@@ -110,52 +518,206 @@ bool BuildLog::OpenForWrite(const string& path, string* err) {
     *err = strerror(errno);
     return false;
   }
-  setvbuf(log_file_, NULL, _IOLBF, BUFSIZ);
   SetCloseOnExec(fileno(log_file_));
 
   // Opening a file in append mode doesn't set the file pointer to the file's
   // end on Windows. Do that explicitly.
   fseek(log_file_, 0, SEEK_END);
 
+  // Load() stops at damage, so what is appended after it would be lost
+  // were the compaction not to finish.  Nothing reads file_ past it.
+  if (compact && tail_end_ != file_.data_ + file_.size_) {
+    long good_size = (long)(tail_end_ - file_.data_);
+#ifdef _WIN32
+    int ret = _chsize(_fileno(log_file_), good_size);
+#else
+    int ret = ftruncate(fileno(log_file_), good_size);
+#endif
+    if (ret < 0) {
+      *err = strerror(errno);
+      fclose(log_file_);
+      log_file_ = NULL;
+      return false;
+    }
+    fseek(log_file_, 0, SEEK_END);
+  }
+
   if (ftell(log_file_) == 0) {
-    if (fprintf(log_file_, kFileSignature, kCurrentVersion) < 0) {
+    // An empty index.
+    const uint32_t header[4] = { kCurrentVersion, 0, 0, 0 };
+    if (fwrite(kFileSignature, sizeof(kFileSignature) - 1, 1,
+               log_file_) < 1 ||
+        fwrite(header, sizeof(header), 1, log_file_) < 1 ||
+        fflush(log_file_) != 0) {
       *err = strerror(errno);
       return false;
     }
   }
 
+  writer_ = new Writer(log_file_, batch_bytes_, batch_millis_);
+  if (compact)
+    StartCompaction(path, user);
   return true;
 }
 
-void BuildLog::RecordCommand(Edge* edge, int start_time, int end_time,
-                             TimeStamp restat_mtime) {
-  string command = edge->EvaluateCommand(true);
+bool BuildLog::RecordCommand(Edge* edge, int start_time, int end_time,
+                             TimeStamp restat_mtime,
+                             const ResourceUsage& usage,
+                             uint64_t input_digest) {
+  uint64_t command_hash = edge->GetCommandHash();
   for (vector<Node*>::iterator out = edge->outputs_.begin();
        out != edge->outputs_.end(); ++out) {
-    const string& path = (*out)->path();
-    Entries::iterator i = entries_.find(path);
-    LogEntry* log_entry;
-    if (i != entries_.end()) {
-      log_entry = i->second;
-    } else {
-      log_entry = new LogEntry;
-      log_entry->output = path;
-      entries_.insert(Entries::value_type(log_entry->output, log_entry));
-    }
-    log_entry->command_hash = LogEntry::HashCommand(command);
+    LogEntry* log_entry = EntryFor(*out);
+    log_entry->command_hash = command_hash;
     log_entry->start_time = start_time;
     log_entry->end_time = end_time;
     log_entry->restat_mtime = restat_mtime;
+    log_entry->usage = usage;
+    log_entry->input_digest = input_digest;
+    log_entry->failed = false;
 
     if (log_file_)
-      WriteEntry(log_file_, *log_entry);
+      WriteRecord(*log_entry);
   }
+  return WriteBatch();
+}
+
+bool BuildLog::RecordFailure(Edge* edge, int start_time, int end_time) {
+  for (vector<Node*>::iterator out = edge->outputs_.begin();
+       out != edge->outputs_.end(); ++out) {
+    LogEntry* log_entry = LookupByOutput(*out);
+    if (!log_entry) {
+      // No command hash matches, so the output stays dirty.
+      log_entry = EntryFor(*out);
+      log_entry->start_time = start_time;
+      log_entry->end_time = end_time;
+    }
+    log_entry->failed = true;
+
+    if (log_file_)
+      WriteRecord(*log_entry);
+  }
+  return WriteBatch();
+}
+
+bool BuildLog::WriteBatch() {
+  if (!log_file_)
+    return true;
+  if (batch_bytes_ == 0)
+    writer_->Flush();
+  else
+    writer_->WriteIfDue();
+  return TakeWriteError();
+}
+
+bool BuildLog::Flush() {
+  if (!log_file_)
+    return true;
+  writer_->Flush();
+  return TakeWriteError();
 }
 
 void BuildLog::Close() {
-  if (log_file_)
+  if (log_file_) {
+    Flush();
+    delete writer_;
+    writer_ = NULL;
     fclose(log_file_);
+  }
   log_file_ = NULL;
+  FinishCompaction();
+}
+
+bool BuildLog::IsOpenAt(const string& path) const {
+  return log_file_ && IsSameFile(fileno(log_file_), path);
+}
+
+void BuildLog::StartCompaction(const string& path,
+                               const BuildLogUser* user) {
+  compact_path_ = path;
+  dead_paths_.clear();
+  if (user) {
+    for (uint32_t i = 0; i < record_count_; ++i) {
+      Record record;
+      memcpy(&record, records_ + i * sizeof(record), sizeof(record));
+      StringPiece indexed = IndexedPath(record);
+      if (indexed.len_ != 0 && user->IsPathDead(indexed))
+        dead_paths_.insert(indexed.AsString());
+    }
+    const char* p = paths_ + paths_size_;
+    while (p < tail_end_) {
+      Record record;
+      StringPiece appended;
+      p = ReadAppended(p, tail_end_, &record, &appended);
+      if (!p)
+        break;
+      if (!dead_paths_.count(appended.AsString()) &&
+          user->IsPathDead(appended)) {
+        dead_paths_.insert(appended.AsString());
+      }
+    }
+  }
+  // Another ninja may recompact the same log meanwhile, as one run by
+  // hand beside a build server, so the file is this process's own.
+  char suffix[32];
+#ifdef _WIN32
+  snprintf(suffix, sizeof(suffix), ".recompact.%d", _getpid());
+#else
+  snprintf(suffix, sizeof(suffix), ".recompact.%d", (int)getpid());
+#endif
+  string temp_path = path + suffix;
+  // Don't build on a left-over from a compaction that was cut short.
+  unlink(temp_path.c_str());
+  compact_task_ = new CompactTask(this, temp_path);
+  compactor_ = new ThreadPool(1);
+  compactor_->Post(compact_task_);
+  needs_recompaction_ = false;
+}
+
+void BuildLog::FinishCompaction() {
+  if (!compact_task_)
+    return;
+  compactor_->Wait(compact_task_);
+  delete compactor_;
+  compactor_ = NULL;
+  const string& temp_path = compact_task_->temp_path_;
+  bool ok = compact_task_->ok_;
+  string err = compact_task_->err_;
+
+  // Add what was appended to the log meanwhile, and replace it.
+  if (ok) {
+    FILE* f = fopen(temp_path.c_str(), "ab");
+    if (!f ||
+        (!compacted_appends_.empty() &&
+         fwrite(compacted_appends_.data(), compacted_appends_.size(), 1,
+                f) < 1) ||
+        fclose(f) != 0) {
+      ok = false;
+      err = strerror(errno);
+    }
+  }
+  if (ok && ((unlink(compact_path_.c_str()) < 0 && errno != ENOENT) ||
+             rename(temp_path.c_str(), compact_path_.c_str()) < 0)) {
+    ok = false;
+    err = strerror(errno);
+  }
+  if (!ok) {
+    // The log is as it was, so the next load tries again.
+    Warning("recompacting build log: %s", err.c_str());
+    unlink(temp_path.c_str());
+  }
+
+  delete compact_task_;
+  compact_task_ = NULL;
+  compacted_appends_.clear();
+}
+
+bool BuildLog::TakeWriteError() {
+  int error = writer_->TakeError();
+  if (!error)
+    return true;
+  errno = error;
+  return false;
 }
 
 class LineReader {
@@ -212,6 +774,205 @@ class LineReader {
 
 bool BuildLog::Load(const string& path, string* err) {
   METRIC_RECORD(".ninja_log load");
+  // What nodes found missing before may be there now.
+  serial_ = next_serial_++;
+  int ret = OpenLogFile(path, &file_, err);
+  if (ret == -ENOENT) {
+    err->clear();
+    return true;
+  }
+  if (ret < 0)
+    return false;
+
+  if (file_.size_ == 0)
+    return true;
+
+  const char kTextPrefix[] = "# ninja log v";
+  if (file_.size_ >= sizeof(kTextPrefix) - 1 &&
+      memcmp(file_.data_, kTextPrefix, sizeof(kTextPrefix) - 1) == 0) {
+    string empty;
+    file_.Adopt(&empty);
+    return LoadText(path, err);
+  }
+
+  if (LoadOldVersion())
+    return true;
+
+  const char* p = MapIndex();
+  if (!p) {
+    string empty;
+    file_.Adopt(&empty);
+    *err = ("build log version invalid, perhaps due to being too old; "
+            "starting over");
+    unlink(path.c_str());
+    // Don't report this as a failure.  An empty build log will cause
+    // us to rebuild the outputs anyway.
+    return true;
+  }
+
+  // Read the entries appended since the index was written.
+  int appended_entry_count = 0;
+  const char* end = file_.data_ + file_.size_;
+  bool damaged = false;
+  while (p < end) {
+    Record record;
+    StringPiece output;
+    const char* next = ReadAppended(p, end, &record, &output);
+    if (!next) {
+      damaged = true;
+      tail_end_ = p;
+      break;
+    }
+    p = next;
+
+    LogEntry* entry;
+    Entries::iterator i = entries_.find(output);
+    if (i != entries_.end()) {
+      entry = i->second;
+    } else {
+      entry = new LogEntry;
+      entry->output = output.AsString();
+      entries_.insert(Entries::value_type(entry->output, entry));
+    }
+    FillEntry(record, entry);
+    ++appended_entry_count;
+  }
+
+  if (damaged) {
+    // Keep what came before the damage, e.g. a record half written when
+    // a build was interrupted; the rest goes when the log is rewritten
+    // on the next open.
+    needs_recompaction_ = true;
+  } else if (appended_entry_count > kMinCompactionEntryCount &&
+             appended_entry_count * kCompactionRatio > (int)record_count_) {
+    needs_recompaction_ = true;
+  }
+
+  return true;
+}
+
+bool BuildLog::LoadOldVersion() {
+  const char* data = file_.data_;
+  const char* end = data + file_.size_;
+  uint32_t header[4];
+  if (file_.size_ < kHeaderSize ||
+      memcmp(data, kFileSignature, sizeof(kFileSignature) - 1) != 0) {
+    return false;
+  }
+  memcpy(header, data + sizeof(kFileSignature) - 1, sizeof(header));
+  if (header[0] < 7 || header[0] > 9)
+    return false;
+  // The fields they lack are left 0.
+  size_t record_size = header[0] == 7 ? sizeof(RecordV7) :
+      header[0] == 8 ? sizeof(RecordV8) : sizeof(RecordV9);
+  uint32_t bucket_count = header[1];
+  uint32_t record_count = header[2];
+  uint32_t paths_size = header[3];
+  uint64_t index_size = (uint64_t)bucket_count * sizeof(uint32_t) +
+      (uint64_t)record_count * record_size + paths_size;
+  if (index_size > file_.size_ - kHeaderSize)
+    return false;
+  const char* records = data + kHeaderSize + bucket_count * sizeof(uint32_t);
+  const char* paths = records + record_count * record_size;
+
+  // The indexed records, then the appended ones, which supersede them;
+  // anything damaged is dropped.
+  const char* p = paths + paths_size;
+  for (uint32_t i = 0; i < record_count || p < end; ++i) {
+    Record record;
+    memset(&record, 0, sizeof(record));
+    StringPiece output;
+    if (i < record_count) {
+      memcpy(&record, records + i * record_size, record_size);
+      if (record.path_offset > paths_size ||
+          record.path_size > paths_size - record.path_offset) {
+        continue;
+      }
+      output = StringPiece(paths + record.path_offset, record.path_size);
+    } else {
+      if ((size_t)(end - p) < record_size)
+        break;
+      memcpy(&record, p, record_size);
+      p += record_size;
+      if (record.path_offset != ~record.path_size ||
+          (size_t)(end - p) < record.path_size) {
+        break;
+      }
+      output = StringPiece(p, record.path_size);
+      p += record.path_size;
+    }
+
+    LogEntry* entry;
+    Entries::iterator e = entries_.find(output);
+    if (e != entries_.end()) {
+      entry = e->second;
+    } else {
+      entry = new LogEntry;
+      entry->output = output.AsString();
+      entries_.insert(Entries::value_type(entry->output, entry));
+    }
+    FillEntry(record, entry);
+  }
+
+  string empty;
+  file_.Adopt(&empty);
+  needs_recompaction_ = true;
+  return true;
+}
+
+const char* BuildLog::MapIndex() {
+  bucket_count_ = record_count_ = paths_size_ = 0;
+  buckets_ = records_ = paths_ = tail_end_ = NULL;
+
+  const char* data = file_.data_;
+  if (file_.size_ < kHeaderSize ||
+      memcmp(data, kFileSignature, sizeof(kFileSignature) - 1) != 0) {
+    return NULL;
+  }
+  uint32_t header[4];
+  memcpy(header, data + sizeof(kFileSignature) - 1, sizeof(header));
+  if (header[0] != kCurrentVersion)
+    return NULL;
+  uint32_t bucket_count = header[1];
+  uint32_t record_count = header[2];
+  uint32_t paths_size = header[3];
+  // Keep at least one bucket empty, so that probing always stops.
+  if ((bucket_count & (bucket_count - 1)) != 0 ||
+      (bucket_count == 0 && record_count != 0) ||
+      (bucket_count != 0 && record_count >= bucket_count)) {
+    return NULL;
+  }
+  uint64_t index_size = (uint64_t)bucket_count * sizeof(uint32_t) +
+      (uint64_t)record_count * sizeof(Record) + paths_size;
+  if (index_size > file_.size_ - kHeaderSize)
+    return NULL;
+
+  bucket_count_ = bucket_count;
+  buckets_ = data + kHeaderSize;
+  record_count_ = record_count;
+  records_ = buckets_ + bucket_count * sizeof(uint32_t);
+  paths_size_ = paths_size;
+  paths_ = records_ + record_count * sizeof(Record);
+  tail_end_ = file_.data_ + file_.size_;
+  return paths_ + paths_size;
+}
+
+// static
+const char* BuildLog::ReadAppended(const char* p, const char* end,
+                                   Record* record, StringPiece* path) {
+  if ((size_t)(end - p) < sizeof(*record))
+    return NULL;
+  memcpy(record, p, sizeof(*record));
+  p += sizeof(*record);
+  if (record->path_offset != ~record->path_size ||
+      (size_t)(end - p) < record->path_size) {
+    return NULL;
+  }
+  *path = StringPiece(p, record->path_size);
+  return p + record->path_size;
+}
+
+bool BuildLog::LoadText(const string& path, string* err) {
   FILE* file = fopen(path.c_str(), "r");
   if (!file) {
     if (errno == ENOENT)
@@ -221,15 +982,13 @@ bool BuildLog::Load(const string& path, string* err) {
   }
 
   int log_version = 0;
-  int unique_entry_count = 0;
-  int total_entry_count = 0;
 
   LineReader reader(file);
   char* line_start = 0;
   char* line_end = 0;
   while (reader.ReadLine(&line_start, &line_end)) {
     if (!log_version) {
-      sscanf(line_start, kFileSignature, &log_version);
+      sscanf(line_start, kTextSignature, &log_version);
 
       if (log_version < kOldestSupportedVersion) {
         *err = ("build log version invalid, perhaps due to being too old; "
@@ -271,7 +1030,10 @@ bool BuildLog::Load(const string& path, string* err) {
     if (!end)
       continue;
     *end = 0;
-    restat_mtime = atol(start);
+    restat_mtime = strtoll(start, NULL, 10);
+    // Until version 6, mtimes were in seconds.
+    if (log_version < 6)
+      restat_mtime *= 1000000000LL;
     start = end + 1;
 
     end = (char*)memchr(start, kFieldSeparator, line_end - start);
@@ -290,9 +1052,7 @@ bool BuildLog::Load(const string& path, string* err) {
       entry = new LogEntry;
       entry->output = output;
       entries_.insert(Entries::value_type(entry->output, entry));
-      ++unique_entry_count;
     }
-    ++total_entry_count;
 
     entry->start_time = start_time;
     entry->end_time = end_time;
@@ -312,17 +1072,8 @@ bool BuildLog::Load(const string& path, string* err) {
     return true; // file was empty
   }
 
-  // Decide whether it's time to rebuild the log:
-  // - if we're upgrading versions
-  // - if it's getting large
-  int kMinCompactionEntryCount = 100;
-  int kCompactionRatio = 3;
-  if (log_version < kCurrentVersion) {
-    needs_recompaction_ = true;
-  } else if (total_entry_count > kMinCompactionEntryCount &&
-             total_entry_count > unique_entry_count * kCompactionRatio) {
-    needs_recompaction_ = true;
-  }
+  // Rewrite the log in the binary format.
+  needs_recompaction_ = true;
 
   return true;
 }
@@ -331,36 +1082,206 @@ BuildLog::LogEntry* BuildLog::LookupByOutput(const string& path) {
   Entries::iterator i = entries_.find(path);
   if (i != entries_.end())
     return i->second;
-  return NULL;
+
+  Record record;
+  if (!FindIndexed(path, &record))
+    return NULL;
+  LogEntry* entry = new LogEntry;
+  entry->output = path;
+  FillEntry(record, entry);
+  entries_.insert(Entries::value_type(entry->output, entry));
+  return entry;
+}
+
+BuildLog::LogEntry* BuildLog::LookupByOutput(Node* output) {
+  LogEntry* entry;
+  if (!output->cached_log_entry(serial_, &entry)) {
+    entry = LookupByOutput(output->path());
+    output->cache_log_entry(serial_, entry);
+  }
+  return entry;
+}
+
+BuildLog::LogEntry* BuildLog::EntryFor(Node* output) {
+  LogEntry* entry = NULL;
+  if (!output->cached_log_entry(serial_, &entry)) {
+    Entries::iterator i = entries_.find(output->path());
+    if (i != entries_.end())
+      entry = i->second;
+  }
+  if (!entry) {
+    entry = new LogEntry;
+    entry->output = output->path();
+    entries_.insert(Entries::value_type(entry->output, entry));
+  }
+  output->cache_log_entry(serial_, entry);
+  return entry;
+}
+
+int64_t BuildLog::LastDuration(Edge* edge) {
+  if (edge->outputs_.empty())
+    return -1;
+  LogEntry* entry = LookupByOutput(edge->outputs_[0]);
+  if (!entry || entry->end_time < entry->start_time)
+    return -1;
+  return entry->end_time - entry->start_time;
+}
+
+bool BuildLog::LastFailed(Edge* edge) {
+  if (edge->outputs_.empty())
+    return false;
+  LogEntry* entry = LookupByOutput(edge->outputs_[0]);
+  return entry && entry->failed;
+}
+
+bool BuildLog::FindIndexed(StringPiece path, Record* record) const {
+  if (!bucket_count_)
+    return false;
+  uint32_t mask = bucket_count_ - 1;
+  uint32_t bucket = (uint32_t)MurmurHash64A(path.str_, path.len_) & mask;
+  for (uint32_t probes = 0; probes < bucket_count_; ++probes) {
+    uint32_t slot;
+    memcpy(&slot, buckets_ + bucket * sizeof(slot), sizeof(slot));
+    if (slot == 0 || slot > record_count_)
+      return false;
+    memcpy(record, records_ + (slot - 1) * sizeof(*record), sizeof(*record));
+    if (IndexedPath(*record) == path)
+      return true;
+    bucket = (bucket + 1) & mask;
+  }
+  return false;
+}
+
+StringPiece BuildLog::IndexedPath(const Record& record) const {
+  if (record.path_offset > paths_size_ ||
+      record.path_size > paths_size_ - record.path_offset) {
+    return StringPiece();
+  }
+  return StringPiece(paths_ + record.path_offset, record.path_size);
+}
+
+bool BuildLog::IndexedEntry(uint32_t i, LogEntry* entry) {
+  Record record;
+  memcpy(&record, records_ + i * sizeof(record), sizeof(record));
+  StringPiece path = IndexedPath(record);
+  if (path.len_ == 0 || entries_.find(path) != entries_.end())
+    return false;
+  entry->output.assign(path.str_, path.len_);
+  FillEntry(record, entry);
+  return true;
 }
 
 void BuildLog::WriteEntry(FILE* f, const LogEntry& entry) {
-  fprintf(f, "%d\t%d\t%d\t%s\t%" PRIx64 "\n",
+  fprintf(f, "%d\t%d\t%" PRId64 "\t%s\t%" PRIx64 "\n",
           entry.start_time, entry.end_time, entry.restat_mtime,
           entry.output.c_str(), entry.command_hash);
 }
 
-bool BuildLog::Recompact(const string& path, string* err) {
-  printf("Recompacting log...\n");
+// static
+BuildLog::Record BuildLog::MakeRecord(const LogEntry& entry,
+                                      uint32_t path_offset) {
+  Record record;
+  record.path_offset = path_offset;
+  record.path_size = (uint32_t)entry.output.size();
+  record.command_hash = entry.command_hash;
+  record.start_time = entry.start_time;
+  record.end_time = entry.end_time;
+  record.restat_mtime = entry.restat_mtime;
+  record.peak_rss = entry.usage.peak_rss;
+  record.input_digest = entry.input_digest;
+  record.user_millis = (uint32_t)entry.usage.user_millis;
+  record.system_millis = (uint32_t)entry.usage.system_millis;
+  record.blocks_read = (uint32_t)entry.usage.blocks_read;
+  record.blocks_written = (uint32_t)entry.usage.blocks_written;
+  record.context_switches = (uint32_t)entry.usage.context_switches;
+  record.flags = entry.failed ? kRecordFailed : 0;
+  return record;
+}
 
-  string temp_path = path + ".recompact";
-  FILE* f = fopen(temp_path.c_str(), "wb");
-  if (!f) {
-    *err = strerror(errno);
-    return false;
+// static
+void BuildLog::FillEntry(const Record& record, LogEntry* entry) {
+  entry->command_hash = record.command_hash;
+  entry->start_time = record.start_time;
+  entry->end_time = record.end_time;
+  entry->restat_mtime = record.restat_mtime;
+  entry->usage.peak_rss = record.peak_rss;
+  entry->input_digest = record.input_digest;
+  entry->usage.user_millis = record.user_millis;
+  entry->usage.system_millis = record.system_millis;
+  entry->usage.blocks_read = record.blocks_read;
+  entry->usage.blocks_written = record.blocks_written;
+  entry->usage.context_switches = record.context_switches;
+  entry->failed = (record.flags & kRecordFailed) != 0;
+}
+
+void BuildLog::WriteRecord(const LogEntry& entry) {
+  Record record = MakeRecord(entry, ~(uint32_t)entry.output.size());
+  string data((const char*)&record, sizeof(record));
+  data.append(entry.output);
+  if (compact_task_)
+    compacted_appends_.append(data);
+  writer_->Append(data);
+}
+
+void BuildLog::GetEntries(vector<LogEntry>* entries) {
+  LogEntry entry;
+  for (uint32_t i = 0; i < record_count_; ++i) {
+    if (IndexedEntry(i, &entry))
+      entries->push_back(entry);
   }
+  for (Entries::iterator i = entries_.begin(); i != entries_.end(); ++i)
+    entries->push_back(*i->second);
+}
 
-  if (fprintf(f, kFileSignature, kCurrentVersion) < 0) {
-    *err = strerror(errno);
-    fclose(f);
+bool BuildLog::Export(FILE* f) {
+  if (fprintf(f, kTextSignature, kCurrentTextVersion) < 0)
     return false;
+  LogEntry entry;
+  for (uint32_t i = 0; i < record_count_; ++i) {
+    if (IndexedEntry(i, &entry))
+      WriteEntry(f, entry);
   }
+  for (Entries::iterator i = entries_.begin(); i != entries_.end(); ++i)
+    WriteEntry(f, *i->second);
+  return fflush(f) == 0 && !ferror(f);
+}
+
+bool BuildLog::Recompact(const string& path, string* err,
+                         const BuildLogUser* user) {
+  METRIC_RECORD(".ninja_log recompact");
+
+  // A compaction already under way reads file_, and replaces the log.
+  FinishCompaction();
 
+  // The latest entry for each output, indexed or not.
+  vector<Record> records;
+  string paths;
+  LogEntry indexed;
+  for (uint32_t i = 0; i < record_count_; ++i) {
+    if (!IndexedEntry(i, &indexed) ||
+        (user && user->IsPathDead(indexed.output))) {
+      continue;
+    }
+    records.push_back(MakeRecord(indexed, (uint32_t)paths.size()));
+    paths.append(indexed.output);
+  }
   for (Entries::iterator i = entries_.begin(); i != entries_.end(); ++i) {
-    WriteEntry(f, *i->second);
+    if (user && user->IsPathDead(i->first))
+      continue;
+    records.push_back(MakeRecord(*i->second, (uint32_t)paths.size()));
+    paths.append(i->second->output);
   }
 
-  fclose(f);
+  string temp_path = path + ".recompact";
+  if (!WriteIndexed(temp_path, records, paths, err))
+    return false;
+
+  // Let go of the old file before replacing it, and map the new one.
+  string empty;
+  file_.Adopt(&empty);
+  MapIndex();
+  needs_recompaction_ = false;
+
   if (unlink(path.c_str()) < 0) {
     *err = strerror(errno);
     return false;
@@ -371,5 +1292,100 @@ bool BuildLog::Recompact(const string& path, string* err) {
     return false;
   }
 
+  string map_err;
+  if (OpenLogFile(path, &file_, &map_err) < 0 || !MapIndex() ||
+      tail_end_ != file_.data_ + file_.size_) {
+    // The entries_ are all that's left; the next load sees the rest.
+    string empty;
+    file_.Adopt(&empty);
+    MapIndex();
+  }
+
+  return true;
+}
+
+bool BuildLog::CompactInto(const string& temp_path, string* err) const {
+  // The latest record for each output, from the mapped file alone: the
+  // main thread is changing entries_.  Appended records come first, and
+  // later ones win.
+  vector<Record> records;
+  string paths;
+  ExternalStringHashMap<size_t>::Type latest;
+  const char* p = paths_ + paths_size_;
+  while (p < tail_end_) {
+    Record record;
+    StringPiece path;
+    p = ReadAppended(p, tail_end_, &record, &path);
+    if (!p)
+      break;
+    if (!dead_paths_.empty() && dead_paths_.count(path.AsString()))
+      continue;
+    pair<ExternalStringHashMap<size_t>::Type::iterator, bool> inserted =
+        latest.insert(make_pair(path, records.size()));
+    record.path_offset = (uint32_t)paths.size();
+    if (inserted.second) {
+      records.push_back(record);
+      paths.append(path.str_, path.len_);
+    } else {
+      record.path_offset = records[inserted.first->second].path_offset;
+      records[inserted.first->second] = record;
+    }
+  }
+  for (uint32_t i = 0; i < record_count_; ++i) {
+    Record record;
+    memcpy(&record, records_ + i * sizeof(record), sizeof(record));
+    StringPiece path = IndexedPath(record);
+    if (path.len_ == 0 || latest.find(path) != latest.end() ||
+        (!dead_paths_.empty() && dead_paths_.count(path.AsString()))) {
+      continue;
+    }
+    record.path_offset = (uint32_t)paths.size();
+    records.push_back(record);
+    paths.append(path.str_, path.len_);
+  }
+  return WriteIndexed(temp_path, records, paths, err);
+}
+
+// static
+bool BuildLog::WriteIndexed(const string& path, const vector<Record>& records,
+                            const string& paths, string* err) {
+  // Index them in a table at most half full.
+  uint32_t bucket_count = records.empty() ? 0 : 2;
+  while (bucket_count < 2 * records.size())
+    bucket_count *= 2;
+  vector<uint32_t> buckets(bucket_count);
+  for (uint32_t i = 0; i < records.size(); ++i) {
+    uint32_t bucket = (uint32_t)MurmurHash64A(
+        paths.data() + records[i].path_offset, records[i].path_size);
+    bucket &= bucket_count - 1;
+    while (buckets[bucket])
+      bucket = (bucket + 1) & (bucket_count - 1);
+    buckets[bucket] = i + 1;
+  }
+
+  FILE* f = fopen(path.c_str(), "wb");
+  if (!f) {
+    *err = strerror(errno);
+    return false;
+  }
+
+  const uint32_t header[4] = {
+    kCurrentVersion, bucket_count, (uint32_t)records.size(),
+    (uint32_t)paths.size()
+  };
+  if (fwrite(kFileSignature, sizeof(kFileSignature) - 1, 1, f) < 1 ||
+      fwrite(header, sizeof(header), 1, f) < 1 ||
+      (!buckets.empty() &&
+       fwrite(&buckets[0], sizeof(buckets[0]), buckets.size(), f) <
+           buckets.size()) ||
+      (!records.empty() &&
+       fwrite(&records[0], sizeof(records[0]), records.size(), f) <
+           records.size()) ||
+      (!paths.empty() && fwrite(paths.data(), paths.size(), 1, f) < 1)) {
+    *err = strerror(errno);
+    fclose(f);
+    return false;
+  }
+  fclose(f);
   return true;
 }
@@ -16,15 +16,76 @@
 #define NINJA_BUILD_LOG_H_
 
 #include <map>
+#include <set>
 #include <string>
 #include <stdio.h>
 using namespace std;
 
 #include "hash_map.h"
+#include "resource_usage.h"
 #include "timestamp.h"
 #include "util.h"  // uint64_t
 
 struct Edge;
+struct Node;
+struct ThreadPool;
+
+/// Can answer questions about the manifest for the BuildLog.
+struct BuildLogUser {
+  /// Whether \a path is gone for good, so that its entry can be dropped.
+  /// Only called when recompacting, from the thread that opened the log,
+  /// and doesn't have to be fast.
+  virtual bool IsPathDead(StringPiece path) const = 0;
+
+ protected:
+  virtual ~BuildLogUser() {}
+};
+
+/// What the BuildLog knows of the command that last wrote an output.
+struct BuildLogEntry {
+  BuildLogEntry()
+      : command_hash(0), start_time(0), end_time(0), restat_mtime(0),
+        input_digest(0), failed(false) {}
+
+  string output;
+  uint64_t command_hash;
+  int start_time;
+  int end_time;
+  TimeStamp restat_mtime;
+  /// Not kept in the text format.
+  ResourceUsage usage;
+  uint64_t input_digest;
+  /// Whether the command failed when it last ran.  Not kept in the text
+  /// format either.
+  bool failed;
+
+  static uint64_t HashCommand(StringPiece command);
+
+  /// HashCommand() of a string given a piece at a time, for commands
+  /// too big to want in one string.  The hash starts from the length
+  /// of the whole, so that has to be known first.
+  struct CommandHasher {
+    explicit CommandHasher(uint64_t len);
+    void Update(StringPiece piece);
+    uint64_t Finish();
+
+   private:
+    void Mix(const char* block);
+
+    uint64_t hash_;
+    /// The bytes after the last whole block.
+    char tail_[8];
+    size_t tail_len_;
+  };
+
+  // Used by tests.
+  bool operator==(const BuildLogEntry& o) {
+    return output == o.output && command_hash == o.command_hash &&
+        start_time == o.start_time && end_time == o.end_time &&
+        restat_mtime == o.restat_mtime && usage == o.usage &&
+        input_digest == o.input_digest && failed == o.failed;
+  }
+};
 
 /// Store a log of every command ran for every build.
 /// It has a few uses:
@@ -33,51 +94,203 @@ struct Edge;
 ///    when we need to rebuild due to the command changing
 /// 2) timing information, perhaps for generating reports
 /// 3) restat information
+///
+/// The log is a binary file that is memory-mapped on load: an index of
+/// the entries as of the last recompaction, which LookupByOutput()
+/// searches in place, followed by the entries recorded since.  Only the
+/// latter, and entries that are looked up, become LogEntry objects.
+/// Logs in the older text format are still loaded, and rewritten in the
+/// binary one; Export() writes the text format.
+///
+/// Recorded commands are written in batches, on a thread of their own,
+/// so that a slow disk doesn't hold up the build; see SetBatching().
 struct BuildLog {
   BuildLog();
   ~BuildLog();
 
-  bool OpenForWrite(const string& path, string* err);
-  void RecordCommand(Edge* edge, int start_time, int end_time,
-                     TimeStamp restat_mtime = 0);
+  /// If \a user is given, a recompaction leaves out the entries of the
+  /// paths it says are dead.
+  bool OpenForWrite(const string& path, string* err,
+                    const BuildLogUser* user = NULL);
+  /// Returns false with errno set if writing earlier commands failed.
+  /// \a usage is what the command used of the machine; \a input_digest
+  /// is that of the contents of its inputs, see
+  /// DependencyScan::InputsDigest(), or 0 if not known.
+  bool RecordCommand(Edge* edge, int start_time, int end_time,
+                     TimeStamp restat_mtime = 0,
+                     const ResourceUsage& usage = ResourceUsage(),
+                     uint64_t input_digest = 0);
+  /// Note that \a edge's command failed, so that the next build can run
+  /// it early; see LastFailed().  What is known of a command that ran
+  /// before is kept, but for that; for one that didn't, the times are
+  /// those of the failed run.  Returns false as RecordCommand() does.
+  bool RecordFailure(Edge* edge, int start_time, int end_time);
+  /// Write out every command recorded so far and wait for it to be
+  /// written.  Returns false with errno set if a write failed since
+  /// this or RecordCommand() last returned.
+  bool Flush();
   void Close();
 
+  /// Whether the log is open for writing as the file at \a path, which
+  /// another process may have replaced since, as by recompacting it.
+  bool IsOpenAt(const string& path) const;
+
+  /// Start writing recorded commands once \a max_bytes of them are
+  /// waiting, or \a max_millis after the oldest waiting one was recorded
+  /// (on Windows, once one is recorded that long after it).  Until then
+  /// they are lost if ninja dies, and their outputs rebuilt next time.
+  /// Both 0 writes each one before RecordCommand() returns.  Call before
+  /// OpenForWrite().
+  void SetBatching(size_t max_bytes, int max_millis) {
+    batch_bytes_ = max_bytes;
+    batch_millis_ = max_millis;
+  }
+
   /// Load the on-disk log.
   bool Load(const string& path, string* err);
 
-  struct LogEntry {
-    string output;
-    uint64_t command_hash;
-    int start_time;
-    int end_time;
-    TimeStamp restat_mtime;
-
-    static uint64_t HashCommand(StringPiece command);
-
-    // Used by tests.
-    bool operator==(const LogEntry& o) {
-      return output == o.output && command_hash == o.command_hash &&
-          start_time == o.start_time && end_time == o.end_time &&
-          restat_mtime == o.restat_mtime;
-    }
-  };
+  typedef BuildLogEntry LogEntry;
 
   /// Lookup a previously-run command by its output path.
   LogEntry* LookupByOutput(const string& path);
+  /// The same, by its output node, on which what is found is kept: the
+  /// build looks up each output more than once, and this doesn't hash
+  /// its path again.
+  LogEntry* LookupByOutput(Node* output);
 
-  /// Serialize an entry into a log file.
+  /// How long \a edge's command took when it last ran, in milliseconds,
+  /// or -1 if the log doesn't know.
+  int64_t LastDuration(Edge* edge);
+
+  /// Whether \a edge's command failed when it last ran.
+  bool LastFailed(Edge* edge);
+
+  /// Serialize an entry into a log file in the text format.
   void WriteEntry(FILE* f, const LogEntry& entry);
 
-  /// Rewrite the known log entries, throwing away old data.
-  bool Recompact(const string& path, string* err);
+  /// Every entry, indexed or not.
+  void GetEntries(vector<LogEntry>* entries);
+
+  /// Write every entry to \a f in the text format, signature included.
+  /// Returns false with errno set on a write error.
+  bool Export(FILE* f);
+
+  /// Rewrite the known log entries, throwing away old data, and those
+  /// of the paths \a user says are dead, if given.
+  bool Recompact(const string& path, string* err,
+                 const BuildLogUser* user = NULL);
 
+  /// Whether OpenForWrite() left a compaction running; Close() finishes
+  /// it.  Used by tests.
+  bool compacting() const { return compact_task_ != NULL; }
+
+  /// The entries that are LogEntry objects so far: those recorded since
+  /// the log was last recompacted, and those looked up.
   typedef ExternalStringHashMap<LogEntry*>::Type Entries;
   const Entries& entries() const { return entries_; }
 
  private:
+  friend struct MemoryStats;
+
+  /// On-disk form of an entry; see build_log.cc.
+  struct Record;
+
+  /// Load a log in the text format.
+  bool LoadText(const string& path, string* err);
+  /// Load file_ if it is a log in the binary format of version 7, 8 or
+  /// 9, whose records lacked fields at their end.
+  bool LoadOldVersion();
+
+  /// Point the index at file_'s.  Returns where the records appended
+  /// after the index start, or NULL if file_ isn't a log in the binary
+  /// format, leaving the index empty.
+  const char* MapIndex();
+  /// Find \a path in the index and copy its record to \a record.
+  bool FindIndexed(StringPiece path, Record* record) const;
+  /// The output path of an indexed record, or an empty one if damaged.
+  StringPiece IndexedPath(const Record& record) const;
+  /// Fill in \a entry from the \a i'th indexed record, unless entries_
+  /// supersedes it.
+  bool IndexedEntry(uint32_t i, LogEntry* entry);
+  /// Read the appended record at \a p, returning the end of it, or NULL
+  /// if it is damaged or cut short by \a end.
+  static const char* ReadAppended(const char* p, const char* end,
+                                  Record* record, StringPiece* path);
+
+  static Record MakeRecord(const LogEntry& entry, uint32_t path_offset);
+  /// Fill in \a entry, but for its output, from \a record.
+  static void FillEntry(const Record& record, LogEntry* entry);
+  /// Write a log with an index of \a records, whose paths are in
+  /// \a paths, to \a path.
+  static bool WriteIndexed(const string& path, const vector<Record>& records,
+                           const string& paths, string* err);
+  /// Write the mapped log, compacted and without dead_paths_, to
+  /// \a temp_path.  Safe to run on another thread while the log is
+  /// written to.
+  bool CompactInto(const string& temp_path, string* err) const;
+  /// Compact the log at \a path on a thread of its own, leaving out the
+  /// paths \a user says are dead.
+  void StartCompaction(const string& path, const BuildLogUser* user);
+  /// Wait for StartCompaction()'s work, add what was appended since,
+  /// and replace the log with the result.
+  void FinishCompaction();
+
+  /// \a output's entry, made if there is none, without looking in the
+  /// index: the caller is about to supersede it.
+  LogEntry* EntryFor(Node* output);
+
+  /// Queue \a entry for log_file_ as a binary record.
+  void WriteRecord(const LogEntry& entry);
+  /// Write the queued records if batching is off, or if the batch is
+  /// due and the Writer has no thread to.  Returns false as
+  /// RecordCommand() does.
+  bool WriteBatch();
+  /// Report and forget the first error the Writer ran into.
+  bool TakeWriteError();
+
   Entries entries_;
+  /// This log's number for Node::cached_log_entry(), renewed by Load():
+  /// nodes may outlive a log, and a log a State.
+  unsigned serial_;
+  static unsigned next_serial_;
   FILE* log_file_;
   bool needs_recompaction_;
+
+  size_t batch_bytes_;
+  int batch_millis_;
+  /// Queues records and writes them to log_file_, which nothing else
+  /// touches while it is open, in batches from a thread of its own.
+  struct Writer;
+  Writer* writer_;
+
+  /// The compaction started by OpenForWrite(), if it's still running,
+  /// the log it replaces, and the records appended since it started.
+  struct CompactTask;
+  CompactTask* compact_task_;
+  ThreadPool* compactor_;
+  string compact_path_;
+  string compacted_appends_;
+  /// The paths the compaction leaves out, found before it starts as the
+  /// BuildLogUser may not be called from its thread.
+  set<string> dead_paths_;
+
+  /// The log file as of Load(), for the indexed entries.
+  MappedFile file_;
+  /// Buckets of the index in file_; a power of two, or 0.
+  uint32_t bucket_count_;
+  /// The index: each bucket is 1 + the number of the record in it, or 0.
+  const char* buckets_;
+  /// The indexed records, and the paths they refer to.
+  const char* records_;
+  uint32_t record_count_;
+  const char* paths_;
+  uint32_t paths_size_;
+  /// Where the records appended after the index end: at the end of
+  /// file_, or where they are damaged.  NULL if file_ isn't a binary log.
+  const char* tail_end_;
+
+  BuildLog(const BuildLog&);
+  void operator=(const BuildLog&);
 };
 
 #endif // NINJA_BUILD_LOG_H_
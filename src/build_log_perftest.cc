@@ -12,133 +12,298 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+// Benchmarks of the build log: recording commands, loading logs with
+// and without an index, recompacting and looking up outputs.  Reports
+// time per operation, throughput and peak RSS, as text, CSV or JSON, so
+// that runs with the same options can be compared across versions.
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include "getopt.h"
+#else
+#define __STDC_FORMAT_MACROS
+#include <getopt.h>
+#include <inttypes.h>
+#include <unistd.h>
+#endif
+#include <sys/stat.h>
 
 #include "build_log.h"
 #include "graph.h"
 #include "manifest_parser.h"
+#include "metrics.h"
 #include "state.h"
 #include "util.h"
-#include "metrics.h"
 
-#ifndef _WIN32
-#include <unistd.h>
-#endif
+namespace {
 
 const char kTestFilename[] = "BuildLogPerfTest-tempfile";
 
-bool WriteTestData(string* err) {
-  BuildLog log;
+struct Options {
+  Options()
+      : outputs(100000), duplicates(1), command_size(4000), finish_rate(0),
+        runs(5), format("text") {}
 
-  if (!log.OpenForWrite(kTestFilename, err))
-    return false;
-
-  /*
-  A histogram of command lengths in chromium. For example, 407 builds,
-  1.4% of all builds, had commands longer than 32 bytes but shorter than 64.
-       32    407   1.4%
-       64    183   0.6%
-      128   1461   5.1%
-      256    791   2.8%
-      512   1314   4.6%
-     1024   6114  21.3%
-     2048  11759  41.0%
-     4096   2056   7.2%
-     8192   4567  15.9%
-    16384     13   0.0%
-    32768      4   0.0%
-    65536      5   0.0%
-  The average command length is 4.1 kB and there were 28674 commands in total,
-  which makes for a total log size of ~120 MB (also counting output filenames).
-
-  Based on this, write 30000 many 4 kB long command lines.
-  */
+  /// Distinct outputs in the log.
+  int outputs;
+  /// Times each output is recorded, as if by that many full builds.
+  int duplicates;
+  /// Length of the commands, which only affects hashing them.
+  int command_size;
+  /// Commands finishing per second while recording, or 0 for as fast as
+  /// RecordCommand() goes.
+  int finish_rate;
+  int runs;
+  string format;
+};
 
-  // ManifestParser is the only object allowed to create Rules.
-  const size_t kRuleSize = 4000;
-  string long_rule_command = "gcc ";
-  for (int i = 0; long_rule_command.size() < kRuleSize; ++i) {
-    char buf[80];
-    sprintf(buf, "-I../../and/arbitrary/but/fairly/long/path/suffixed/%d ", i);
-    long_rule_command += buf;
-  }
-  long_rule_command += "$in -o $out\n";
+/// The best of the runs of one benchmark.
+struct Result {
+  Result(const char* name) : name(name), ops(0), bytes(0), seconds(-1) {}
 
-  State state;
-  ManifestParser parser(&state, NULL);
-  if (!parser.ParseTest("rule cxx\n  command = " + long_rule_command, err))
-    return false;
-
-  // Create build edges. Using ManifestParser is as fast as using the State api
-  // for edge creation, so just use that.
-  const int kNumCommands = 30000;
-  string build_rules;
-  for (int i = 0; i < kNumCommands; ++i) {
-    char buf[80];
-    sprintf(buf, "build input%d.o: cxx input%d.cc\n", i, i);
-    build_rules += buf;
+  void Add(double run_seconds, int64_t run_ops, int64_t run_bytes) {
+    if (seconds < 0 || run_seconds < seconds) {
+      seconds = run_seconds;
+      ops = run_ops;
+      bytes = run_bytes;
+    }
+  }
+  double NanosPerOp() const { return ops ? seconds * 1e9 / ops : 0; }
+  double MegabytesPerSecond() const {
+    return seconds > 0 ? bytes / 1048576.0 / seconds : 0;
   }
 
-  if (!parser.ParseTest(build_rules, err))
-    return false;
+  const char* name;
+  int64_t ops;
+  /// Bytes read or written, or 0 if that isn't meaningful.
+  int64_t bytes;
+  double seconds;
+};
 
-  for (int i = 0; i < kNumCommands; ++i) {
-    log.RecordCommand(state.edges_[i],
-                      /*start_time=*/100 * i,
-                      /*end_time=*/100 * i + 1,
-                      /*restat_mtime=*/0);
+int64_t FileSize(const char* path) {
+  struct stat st;
+  if (stat(path, &st) < 0)
+    return 0;
+  return st.st_size;
+}
+
+/// Build a manifest with one edge per output, all running a command of
+/// about \a options.command_size bytes.
+bool CreateEdges(const Options& options, State* state, string* err) {
+  // ManifestParser is the only object allowed to create Rules.
+  string command = "gcc ";
+  for (int i = 0; (int)command.size() < options.command_size; ++i) {
+    char buf[80];
+    snprintf(buf, sizeof(buf),
+             "-I../../and/arbitrary/but/fairly/long/path/suffixed/%d ", i);
+    command += buf;
   }
+  command += "$in -o $out\n";
 
-  return true;
+  // Using ManifestParser is as fast as using the State api for edge
+  // creation, so just use that.
+  string manifest = "rule cxx\n  command = " + command;
+  for (int i = 0; i < options.outputs; ++i) {
+    char buf[128];
+    snprintf(buf, sizeof(buf),
+             "build out/obj/module%d/file%d.o: cxx ../../src/module%d/file%d.cc\n",
+             i / 100, i, i / 100, i);
+    manifest += buf;
+  }
+  ManifestParser parser(state, NULL);
+  return parser.ParseTest(manifest, err);
 }
 
-int main() {
-  vector<int> times;
+/// Record every edge options.duplicates times into a new log, at
+/// options.finish_rate; returns the seconds spent in the log.
+double RecordCommands(const Options& options, State* state) {
+  unlink(kTestFilename);
+  BuildLog log;
   string err;
+  if (!log.OpenForWrite(kTestFilename, &err))
+    Fatal("opening log: %s", err.c_str());
 
-  if (!WriteTestData(&err)) {
-    fprintf(stderr, "Failed to write test data: %s\n", err.c_str());
-    return 1;
+  Stopwatch total;
+  total.Restart();
+  double seconds = 0;
+  int64_t count = 0;
+  for (int d = 0; d < options.duplicates; ++d) {
+    for (size_t i = 0; i < state->edges_.size(); ++i, ++count) {
+      if (options.finish_rate) {
+        // Wait, busily, for the next command to finish.
+        while (total.Elapsed() < (double)count / options.finish_rate) {
+        }
+      }
+      Stopwatch call;
+      call.Restart();
+      log.RecordCommand(state->edges_[i], 100 * d, 100 * d + 1,
+                        /*restat_mtime=*/0);
+      seconds += call.Elapsed();
+    }
   }
+  Stopwatch close;
+  close.Restart();
+  log.Close();
+  return seconds + close.Elapsed();
+}
 
-  {
-    // Read once to warm up disk cache.
-    BuildLog log;
-    if (!log.Load(kTestFilename, &err)) {
-      fprintf(stderr, "Failed to read test data: %s\n", err.c_str());
-      return 1;
+void Usage() {
+  printf(
+"usage: build_log_perftest [options]\n"
+"\n"
+"options:\n"
+"  -n N  distinct outputs [default=100000]\n"
+"  -d N  times each output is recorded [default=1]\n"
+"  -c N  command length [default=4000]\n"
+"  -f N  commands finishing per second while recording, 0 for no limit\n"
+"        [default=0]\n"
+"  -r N  runs, of which the fastest is reported [default=5]\n"
+"  -o FORMAT  text, csv or json [default=text]\n");
+}
+
+void Report(const Options& options, const vector<Result>& results,
+            int64_t log_size) {
+  long peak_rss = GetPeakRSS();
+  if (options.format == "csv") {
+    printf("benchmark,outputs,duplicates,ops,ns_per_op,mb_per_s,"
+           "peak_rss_kb\n");
+    for (size_t i = 0; i < results.size(); ++i) {
+      const Result& r = results[i];
+      printf("%s,%d,%d,%" PRId64 ",%.1f,%.1f,%ld\n", r.name, options.outputs,
+             options.duplicates, r.ops, r.NanosPerOp(),
+             r.MegabytesPerSecond(), peak_rss);
+    }
+  } else if (options.format == "json") {
+    printf("{\"outputs\": %d, \"duplicates\": %d, \"command_size\": %d, "
+           "\"finish_rate\": %d, \"log_bytes\": %" PRId64 ", "
+           "\"peak_rss_kb\": %ld, \"results\": [",
+           options.outputs, options.duplicates, options.command_size,
+           options.finish_rate, log_size, peak_rss);
+    for (size_t i = 0; i < results.size(); ++i) {
+      const Result& r = results[i];
+      printf("%s\n  {\"benchmark\": \"%s\", \"ops\": %" PRId64 ", "
+             "\"ns_per_op\": %.1f, \"mb_per_s\": %.1f}",
+             i ? "," : "", r.name, r.ops, r.NanosPerOp(),
+             r.MegabytesPerSecond());
     }
+    printf("\n]}\n");
+  } else {
+    printf("%d outputs recorded %d times each, %.1f MB log\n",
+           options.outputs, options.duplicates, log_size / 1048576.0);
+    for (size_t i = 0; i < results.size(); ++i) {
+      const Result& r = results[i];
+      printf("%-14s %10" PRId64 " ops %9.1fms %10.1f ns/op", r.name, r.ops,
+             r.seconds * 1000, r.NanosPerOp());
+      if (r.bytes)
+        printf(" %8.1f MB/s", r.MegabytesPerSecond());
+      printf("\n");
+    }
+    printf("peak RSS: %ld kB\n", peak_rss);
   }
-  const int kNumRepetitions = 5;
-  for (int i = 0; i < kNumRepetitions; ++i) {
-    int64_t start = GetTimeMillis();
-    BuildLog log;
-    if (!log.Load(kTestFilename, &err)) {
-      fprintf(stderr, "Failed to read test data: %s\n", err.c_str());
-      return 1;
+}
+
+}  // anonymous namespace
+
+int main(int argc, char* argv[]) {
+  Options options;
+  int opt;
+  while ((opt = getopt(argc, argv, "n:d:c:f:r:o:h")) != -1) {
+    int value = atoi(optarg ? optarg : "0");
+    switch (opt) {
+      case 'n': options.outputs = value; break;
+      case 'd': options.duplicates = value; break;
+      case 'c': options.command_size = value; break;
+      case 'f': options.finish_rate = value; break;
+      case 'r': options.runs = value; break;
+      case 'o': options.format = optarg; break;
+      default:
+        Usage();
+        return 1;
     }
-    int delta = (int)(GetTimeMillis() - start);
-    printf("%dms\n", delta);
-    times.push_back(delta);
+  }
+  if (options.outputs < 1 || options.duplicates < 1 ||
+      options.command_size < 0 || options.finish_rate < 0 ||
+      options.runs < 1 ||
+      (options.format != "text" && options.format != "csv" &&
+       options.format != "json")) {
+    Usage();
+    return 1;
   }
 
-  int min = times[0];
-  int max = times[0];
-  float total = 0;
-  for (size_t i = 0; i < times.size(); ++i) {
-    total += times[i];
-    if (times[i] < min)
-      min = times[i];
-    else if (times[i] > max)
-      max = times[i];
+  State state;
+  string err;
+  if (!CreateEdges(options, &state, &err)) {
+    fprintf(stderr, "build_log_perftest: %s\n", err.c_str());
+    return 1;
+  }
+  vector<string> hits, misses;
+  for (size_t i = 0; i < state.edges_.size(); ++i) {
+    hits.push_back(state.edges_[i]->outputs_[0]->path());
+    misses.push_back(hits.back() + ".missing");
   }
+  // Look outputs up out of order, as a build would.
+  for (size_t i = hits.size() - 1; i > 0; --i) {
+    size_t j = (i * 2654435761u) % (i + 1);
+    swap(hits[i], hits[j]);
+  }
+
+  vector<Result> results;
+  Result record("record"), load_appended("load_appended"),
+      recompact("recompact"), load_indexed("load_indexed"),
+      lookup_hit("lookup_hit"), lookup_miss("lookup_miss");
+  int64_t records = (int64_t)options.outputs * options.duplicates;
+  int64_t log_size = 0;
+  for (int run = 0; run < options.runs; ++run) {
+    double seconds = RecordCommands(options, &state);
+    int64_t appended_size = FileSize(kTestFilename);
+    record.Add(seconds, records, appended_size);
 
-  printf("min %dms  max %dms  avg %.1fms\n",
-         min, max, total / times.size());
+    Stopwatch timer;
+    {
+      BuildLog log;
+      timer.Restart();
+      if (!log.Load(kTestFilename, &err))
+        Fatal("loading log: %s", err.c_str());
+      load_appended.Add(timer.Elapsed(), records, appended_size);
 
+      timer.Restart();
+      if (!log.Recompact(kTestFilename, &err))
+        Fatal("recompacting log: %s", err.c_str());
+      log_size = FileSize(kTestFilename);
+      recompact.Add(timer.Elapsed(), options.outputs, log_size);
+    }
+
+    BuildLog log;
+    timer.Restart();
+    if (!log.Load(kTestFilename, &err))
+      Fatal("loading log: %s", err.c_str());
+    load_indexed.Add(timer.Elapsed(), options.outputs, log_size);
+
+    timer.Restart();
+    for (size_t i = 0; i < hits.size(); ++i) {
+      if (!log.LookupByOutput(hits[i]))
+        Fatal("%s missing from log", hits[i].c_str());
+    }
+    lookup_hit.Add(timer.Elapsed(), hits.size(), 0);
+
+    timer.Restart();
+    for (size_t i = 0; i < misses.size(); ++i) {
+      if (log.LookupByOutput(misses[i]))
+        Fatal("%s found in log", misses[i].c_str());
+    }
+    lookup_miss.Add(timer.Elapsed(), misses.size(), 0);
+  }
   unlink(kTestFilename);
 
+  results.push_back(record);
+  results.push_back(load_appended);
+  results.push_back(recompact);
+  results.push_back(load_indexed);
+  results.push_back(lookup_hit);
+  results.push_back(lookup_miss);
+  Report(options, results, log_size);
   return 0;
 }
-
@@ -66,9 +66,209 @@ TEST_F(BuildLogTest, WriteRead) {
   ASSERT_EQ("out", e1->output);
 }
 
+TEST_F(BuildLogTest, CommandHasher) {
+  string text;
+  for (int i = 0; i < 100; ++i)
+    text.push_back('a' + i % 26);
+  // Split in two and in three everywhere, the pieces hash as the whole.
+  for (size_t i = 0; i <= text.size(); ++i) {
+    for (size_t j = i; j <= text.size(); j += 7) {
+      BuildLog::LogEntry::CommandHasher hasher(text.size());
+      hasher.Update(StringPiece(text.data(), i));
+      hasher.Update(StringPiece(text.data() + i, j - i));
+      hasher.Update(StringPiece(text.data() + j, text.size() - j));
+      ASSERT_EQ(BuildLog::LogEntry::HashCommand(text), hasher.Finish())
+          << i << " " << j;
+    }
+  }
+  BuildLog::LogEntry::CommandHasher empty(0);
+  EXPECT_EQ(BuildLog::LogEntry::HashCommand(""), empty.Finish());
+}
+
+TEST_F(BuildLogTest, NanosecondRestatMtime) {
+  AssertParse(&state_,
+"build out: cat in\n");
+
+  // More than fits in 32 bits, and not a whole second.
+  const TimeStamp kMtime = 1357924680123456789LL;
+  BuildLog log1;
+  string err;
+  EXPECT_TRUE(log1.OpenForWrite(kTestFilename, &err));
+  ASSERT_EQ("", err);
+  log1.RecordCommand(state_.edges_[0], 15, 18, kMtime);
+  log1.Close();
+
+  BuildLog log2;
+  EXPECT_TRUE(log2.Load(kTestFilename, &err));
+  ASSERT_EQ("", err);
+  BuildLog::LogEntry* e = log2.LookupByOutput("out");
+  ASSERT_TRUE(e);
+  EXPECT_EQ(kMtime, e->restat_mtime);
+}
+
+TEST_F(BuildLogTest, ResourceUsage) {
+  AssertParse(&state_,
+"build out: cat mid\n"
+"build mid: cat in\n");
+
+  ResourceUsage usage;
+  usage.user_millis = 1500;
+  usage.system_millis = 200;
+  usage.peak_rss = 5LL << 30;
+  usage.blocks_read = 30;
+  usage.blocks_written = 40;
+  usage.context_switches = 50;
+  BuildLog log1;
+  string err;
+  EXPECT_TRUE(log1.OpenForWrite(kTestFilename, &err));
+  ASSERT_EQ("", err);
+  log1.RecordCommand(state_.edges_[0], 15, 18, 0, usage);
+  log1.RecordCommand(state_.edges_[1], 20, 25);
+  log1.Close();
+
+  BuildLog log2;
+  EXPECT_TRUE(log2.Load(kTestFilename, &err));
+  ASSERT_EQ("", err);
+  ASSERT_TRUE(log2.LookupByOutput("out"));
+  EXPECT_TRUE(usage == log2.LookupByOutput("out")->usage);
+  EXPECT_TRUE(log2.Recompact(kTestFilename, &err));
+  ASSERT_EQ("", err);
+
+  BuildLog log3;
+  EXPECT_TRUE(log3.Load(kTestFilename, &err));
+  ASSERT_EQ("", err);
+  ASSERT_TRUE(log3.LookupByOutput("out"));
+  EXPECT_TRUE(usage == log3.LookupByOutput("out")->usage);
+  ASSERT_TRUE(log3.LookupByOutput("mid"));
+  EXPECT_TRUE(ResourceUsage() == log3.LookupByOutput("mid")->usage);
+
+  vector<BuildLog::LogEntry> entries;
+  log3.GetEntries(&entries);
+  EXPECT_EQ(2u, entries.size());
+}
+
+TEST_F(BuildLogTest, InputDigest) {
+  AssertParse(&state_,
+"build out: cat mid\n"
+"build mid: cat in\n");
+
+  const uint64_t kDigest = 0x123456789abcdef1ULL;
+  BuildLog log1;
+  string err;
+  EXPECT_TRUE(log1.OpenForWrite(kTestFilename, &err));
+  ASSERT_EQ("", err);
+  log1.RecordCommand(state_.edges_[0], 15, 18, 0, ResourceUsage(), kDigest);
+  log1.RecordCommand(state_.edges_[1], 20, 25);
+  log1.Close();
+
+  BuildLog log2;
+  EXPECT_TRUE(log2.Load(kTestFilename, &err));
+  ASSERT_EQ("", err);
+  ASSERT_TRUE(log2.LookupByOutput("out"));
+  EXPECT_EQ(kDigest, log2.LookupByOutput("out")->input_digest);
+  ASSERT_TRUE(log2.LookupByOutput("mid"));
+  EXPECT_EQ(0u, log2.LookupByOutput("mid")->input_digest);
+}
+
+TEST_F(BuildLogTest, Failure) {
+  AssertParse(&state_,
+"build out: cat mid\n"
+"build mid: cat in\n");
+
+  BuildLog log1;
+  string err;
+  EXPECT_TRUE(log1.OpenForWrite(kTestFilename, &err));
+  ASSERT_EQ("", err);
+  log1.RecordCommand(state_.edges_[0], 15, 18);
+  EXPECT_TRUE(log1.RecordFailure(state_.edges_[0], 30, 31));
+  EXPECT_TRUE(log1.RecordFailure(state_.edges_[1], 20, 25));
+  log1.Close();
+
+  // A command known before keeps what was known of it.
+  BuildLog log2;
+  EXPECT_TRUE(log2.Load(kTestFilename, &err));
+  ASSERT_EQ("", err);
+  BuildLog::LogEntry* out = log2.LookupByOutput("out");
+  ASSERT_TRUE(out);
+  EXPECT_TRUE(out->failed);
+  EXPECT_EQ(state_.edges_[0]->GetCommandHash(), out->command_hash);
+  EXPECT_EQ(3, log2.LastDuration(state_.edges_[0]));
+  BuildLog::LogEntry* mid = log2.LookupByOutput("mid");
+  ASSERT_TRUE(mid);
+  EXPECT_TRUE(log2.LastFailed(state_.edges_[1]));
+  EXPECT_NE(state_.edges_[1]->GetCommandHash(), mid->command_hash);
+
+  // Until it succeeds, and across a recompaction.
+  EXPECT_TRUE(log2.OpenForWrite(kTestFilename, &err));
+  log2.RecordCommand(state_.edges_[1], 40, 45);
+  EXPECT_FALSE(log2.LastFailed(state_.edges_[1]));
+  log2.Close();
+  BuildLog log3;
+  EXPECT_TRUE(log3.Load(kTestFilename, &err));
+  EXPECT_TRUE(log3.Recompact(kTestFilename, &err));
+  ASSERT_EQ("", err);
+  BuildLog log4;
+  EXPECT_TRUE(log4.Load(kTestFilename, &err));
+  EXPECT_TRUE(log4.LastFailed(state_.edges_[0]));
+  EXPECT_FALSE(log4.LastFailed(state_.edges_[1]));
+}
+
+TEST_F(BuildLogTest, UpgradeVersion7) {
+  // A version 7 log with one indexed entry, superseded by an appended one,
+  // and another appended one.
+  struct RecordV7 {
+    uint32_t path_offset;
+    uint32_t path_size;
+    uint64_t command_hash;
+    int start_time;
+    int end_time;
+    TimeStamp restat_mtime;
+  };
+  string log = "# ninjalog\n";
+  const uint32_t header[4] = { 7, 2, 1, 3 };
+  const uint32_t buckets[2] = { 1, 0 };
+  log.append((const char*)header, sizeof(header));
+  log.append((const char*)buckets, sizeof(buckets));
+  RecordV7 indexed = { 0, 3, 1, 10, 20, 0 };
+  log.append((const char*)&indexed, sizeof(indexed));
+  log.append("out");
+  RecordV7 appended[2] = { { ~3u, 3, 2, 30, 40, 0 }, { ~3u, 3, 3, 50, 60, 0 } };
+  log.append((const char*)&appended[0], sizeof(appended[0]));
+  log.append("out");
+  log.append((const char*)&appended[1], sizeof(appended[1]));
+  log.append("mid");
+  FILE* f = fopen(kTestFilename, "wb");
+  ASSERT_TRUE(f);
+  fwrite(log.data(), log.size(), 1, f);
+  fclose(f);
+
+  BuildLog log1;
+  string err;
+  EXPECT_TRUE(log1.Load(kTestFilename, &err));
+  ASSERT_EQ("", err);
+  BuildLog::LogEntry* e = log1.LookupByOutput("out");
+  ASSERT_TRUE(e);
+  EXPECT_EQ(2u, e->command_hash);
+  EXPECT_EQ(30, e->start_time);
+  EXPECT_EQ(0, e->usage.peak_rss);
+  EXPECT_EQ(0u, e->input_digest);
+  ASSERT_TRUE(log1.LookupByOutput("mid"));
+
+  // It is rewritten in the current format before anything is appended.
+  EXPECT_TRUE(log1.OpenForWrite(kTestFilename, &err));
+  ASSERT_EQ("", err);
+  log1.Close();
+  BuildLog log2;
+  EXPECT_TRUE(log2.Load(kTestFilename, &err));
+  ASSERT_EQ("", err);
+  e = log2.LookupByOutput("out");
+  ASSERT_TRUE(e);
+  EXPECT_EQ(2u, e->command_hash);
+  ASSERT_TRUE(log2.LookupByOutput("mid"));
+}
+
 TEST_F(BuildLogTest, FirstWriteAddsSignature) {
-  const char kExpectedVersion[] = "# ninja log vX\n";
-  const size_t kVersionPos = strlen(kExpectedVersion) - 2;  // Points at 'X'.
+  const char kExpectedSignature[] = "# ninjalog\n";
 
   BuildLog log;
   string contents, err;
@@ -79,11 +279,10 @@ TEST_F(BuildLogTest, FirstWriteAddsSignature) {
 
   ASSERT_EQ(0, ReadFile(kTestFilename, &contents, &err));
   ASSERT_EQ("", err);
-  if (contents.size() >= kVersionPos)
-    contents[kVersionPos] = 'X';
-  EXPECT_EQ(kExpectedVersion, contents);
+  EXPECT_EQ(0u, contents.find(kExpectedSignature));
+  size_t size = contents.size();
 
-  // Opening the file anew shouldn't add a second version string.
+  // Opening the file anew shouldn't add a second signature.
   EXPECT_TRUE(log.OpenForWrite(kTestFilename, &err));
   ASSERT_EQ("", err);
   log.Close();
@@ -91,9 +290,322 @@ TEST_F(BuildLogTest, FirstWriteAddsSignature) {
   contents.clear();
   ASSERT_EQ(0, ReadFile(kTestFilename, &contents, &err));
   ASSERT_EQ("", err);
-  if (contents.size() >= kVersionPos)
-    contents[kVersionPos] = 'X';
-  EXPECT_EQ(kExpectedVersion, contents);
+  EXPECT_EQ(size, contents.size());
+}
+
+TEST_F(BuildLogTest, IndexedLookup) {
+  AssertParse(&state_,
+"build out: cat mid\n"
+"build mid: cat in\n");
+
+  BuildLog log1;
+  string err;
+  EXPECT_TRUE(log1.OpenForWrite(kTestFilename, &err));
+  ASSERT_EQ("", err);
+  log1.RecordCommand(state_.edges_[0], 15, 18);
+  log1.RecordCommand(state_.edges_[1], 20, 25);
+  log1.Close();
+  EXPECT_TRUE(log1.Recompact(kTestFilename, &err));
+  ASSERT_EQ("", err);
+
+  // Indexed entries are only read when looked up.
+  BuildLog log2;
+  EXPECT_TRUE(log2.Load(kTestFilename, &err));
+  ASSERT_EQ("", err);
+  EXPECT_EQ(0u, log2.entries().size());
+  BuildLog::LogEntry* e = log2.LookupByOutput("mid");
+  ASSERT_TRUE(e);
+  EXPECT_EQ(20, e->start_time);
+  EXPECT_EQ(25, e->end_time);
+  EXPECT_EQ(1u, log2.entries().size());
+  EXPECT_TRUE(*e == *log1.LookupByOutput("mid"));
+  EXPECT_FALSE(log2.LookupByOutput("in"));
+
+  // Entries appended after the index supersede it.
+  EXPECT_TRUE(log2.OpenForWrite(kTestFilename, &err));
+  ASSERT_EQ("", err);
+  log2.RecordCommand(state_.edges_[0], 30, 35);
+  log2.Close();
+
+  BuildLog log3;
+  EXPECT_TRUE(log3.Load(kTestFilename, &err));
+  ASSERT_EQ("", err);
+  e = log3.LookupByOutput("out");
+  ASSERT_TRUE(e);
+  EXPECT_EQ(30, e->start_time);
+  e = log3.LookupByOutput("mid");
+  ASSERT_TRUE(e);
+  EXPECT_EQ(20, e->start_time);
+
+  // Recompacting keeps both kinds.
+  EXPECT_TRUE(log3.Recompact(kTestFilename, &err));
+  ASSERT_EQ("", err);
+  BuildLog log4;
+  EXPECT_TRUE(log4.Load(kTestFilename, &err));
+  ASSERT_EQ("", err);
+  e = log4.LookupByOutput("out");
+  ASSERT_TRUE(e);
+  EXPECT_EQ(30, e->start_time);
+  e = log4.LookupByOutput("mid");
+  ASSERT_TRUE(e);
+  EXPECT_EQ(20, e->start_time);
+}
+
+TEST_F(BuildLogTest, LookupByNode) {
+  AssertParse(&state_,
+"build out: cat mid\n"
+"build mid: cat in\n");
+  Node* out = GetNode("out");
+  Node* mid = GetNode("mid");
+
+  BuildLog log1;
+  string err;
+  EXPECT_TRUE(log1.OpenForWrite(kTestFilename, &err));
+  ASSERT_EQ("", err);
+  log1.RecordCommand(state_.edges_[1], 20, 25);
+  log1.Close();
+
+  // What each node finds is kept on it, found or not.
+  BuildLog log2;
+  EXPECT_TRUE(log2.Load(kTestFilename, &err));
+  ASSERT_EQ("", err);
+  EXPECT_FALSE(log2.LookupByOutput(out));
+  BuildLog::LogEntry* e = log2.LookupByOutput(mid);
+  ASSERT_TRUE(e);
+  EXPECT_EQ(20, e->start_time);
+  EXPECT_EQ(e, log2.LookupByOutput(mid));
+  EXPECT_EQ(e, log2.LookupByOutput("mid"));
+
+  // Recording a command finds its outputs again.
+  log2.RecordCommand(state_.edges_[0], 30, 35);
+  e = log2.LookupByOutput(out);
+  ASSERT_TRUE(e);
+  EXPECT_EQ(30, e->start_time);
+  EXPECT_EQ(e, log2.LookupByOutput("out"));
+
+  // Another log doesn't go by what this one found.
+  BuildLog log3;
+  EXPECT_TRUE(log3.Load(kTestFilename, &err));
+  ASSERT_EQ("", err);
+  EXPECT_FALSE(log3.LookupByOutput(out));
+  e = log3.LookupByOutput(mid);
+  ASSERT_TRUE(e);
+  EXPECT_NE(e, log2.LookupByOutput(mid));
+}
+
+TEST_F(BuildLogTest, Batching) {
+  AssertParse(&state_,
+"build out: cat mid\n"
+"build mid: cat in\n");
+
+  // Nothing reaches the file until a batch is full or flushed.
+  BuildLog log1;
+  string err;
+  log1.SetBatching(1 << 20, 1000000);
+  EXPECT_TRUE(log1.OpenForWrite(kTestFilename, &err));
+  ASSERT_EQ("", err);
+  EXPECT_TRUE(log1.RecordCommand(state_.edges_[0], 15, 18));
+  {
+    BuildLog log2;
+    EXPECT_TRUE(log2.Load(kTestFilename, &err));
+    ASSERT_EQ("", err);
+    EXPECT_FALSE(log2.LookupByOutput("out"));
+  }
+  EXPECT_TRUE(log1.Flush());
+  {
+    BuildLog log2;
+    EXPECT_TRUE(log2.Load(kTestFilename, &err));
+    ASSERT_EQ("", err);
+    EXPECT_TRUE(log2.LookupByOutput("out"));
+  }
+
+  // Unless batching is off.
+  log1.Close();
+  log1.SetBatching(0, 0);
+  EXPECT_TRUE(log1.OpenForWrite(kTestFilename, &err));
+  ASSERT_EQ("", err);
+  EXPECT_TRUE(log1.RecordCommand(state_.edges_[1], 20, 25));
+  {
+    BuildLog log2;
+    EXPECT_TRUE(log2.Load(kTestFilename, &err));
+    ASSERT_EQ("", err);
+    EXPECT_TRUE(log2.LookupByOutput("mid"));
+  }
+  log1.Close();
+}
+
+#ifndef _WIN32
+TEST_F(BuildLogTest, BatchWrittenWhenDue) {
+  AssertParse(&state_, "build out: cat in\n");
+
+  // A batch is written once due, even if nothing is recorded after it.
+  BuildLog log1;
+  string err;
+  log1.SetBatching(1 << 20, 10);
+  EXPECT_TRUE(log1.OpenForWrite(kTestFilename, &err));
+  ASSERT_EQ("", err);
+  EXPECT_TRUE(log1.RecordCommand(state_.edges_[0], 15, 18));
+  bool written = false;
+  for (int i = 0; i < 500 && !written; ++i) {
+    usleep(10000);
+    BuildLog log2;
+    EXPECT_TRUE(log2.Load(kTestFilename, &err));
+    ASSERT_EQ("", err);
+    written = log2.LookupByOutput("out") != NULL;
+  }
+  EXPECT_TRUE(written);
+  log1.Close();
+}
+#endif
+
+TEST_F(BuildLogTest, CompactWhileBuilding) {
+  AssertParse(&state_,
+"build out: cat mid\n"
+"build mid: cat in\n");
+
+  BuildLog log1;
+  string err;
+  EXPECT_TRUE(log1.OpenForWrite(kTestFilename, &err));
+  ASSERT_EQ("", err);
+  log1.RecordCommand(state_.edges_[0], 15, 18);
+  log1.RecordCommand(state_.edges_[1], 20, 25);
+  log1.Close();
+
+  // Damage the end of the log, which makes the next open compact it.
+  FILE* f = fopen(kTestFilename, "ab");
+  fputs("garbage", f);
+  fclose(f);
+
+  BuildLog log2;
+  EXPECT_TRUE(log2.Load(kTestFilename, &err));
+  ASSERT_EQ("", err);
+  EXPECT_TRUE(log2.OpenForWrite(kTestFilename, &err));
+  ASSERT_EQ("", err);
+  EXPECT_TRUE(log2.compacting());
+  log2.RecordCommand(state_.edges_[0], 30, 35);
+  EXPECT_TRUE(log2.Flush());
+  {
+    // Were ninja to die now, what was recorded isn't behind the damage.
+    BuildLog log4;
+    EXPECT_TRUE(log4.Load(kTestFilename, &err));
+    ASSERT_EQ("", err);
+    BuildLog::LogEntry* e = log4.LookupByOutput("out");
+    ASSERT_TRUE(e);
+    EXPECT_EQ(30, e->start_time);
+  }
+  log2.Close();
+  EXPECT_FALSE(log2.compacting());
+
+  // The compacted log has both what was there and what was recorded
+  // while it was compacted, and no damage.
+  BuildLog log3;
+  EXPECT_TRUE(log3.Load(kTestFilename, &err));
+  ASSERT_EQ("", err);
+  BuildLog::LogEntry* e = log3.LookupByOutput("out");
+  ASSERT_TRUE(e);
+  EXPECT_EQ(30, e->start_time);
+  e = log3.LookupByOutput("mid");
+  ASSERT_TRUE(e);
+  EXPECT_EQ(20, e->start_time);
+  EXPECT_TRUE(log3.OpenForWrite(kTestFilename, &err));
+  ASSERT_EQ("", err);
+  EXPECT_FALSE(log3.compacting());
+  log3.Close();
+}
+
+struct TestBuildLogUser : public BuildLogUser {
+  virtual bool IsPathDead(StringPiece path) const {
+    return dead.count(path.AsString()) != 0;
+  }
+  set<string> dead;
+};
+
+TEST_F(BuildLogTest, DropDeadPaths) {
+  AssertParse(&state_,
+"build out: cat mid\n"
+"build mid: cat in\n");
+
+  BuildLog log1;
+  string err;
+  EXPECT_TRUE(log1.OpenForWrite(kTestFilename, &err));
+  ASSERT_EQ("", err);
+  log1.RecordCommand(state_.edges_[0], 15, 18);
+  log1.RecordCommand(state_.edges_[1], 20, 25);
+  log1.Close();
+
+  TestBuildLogUser user;
+  user.dead.insert("mid");
+  BuildLog log2;
+  EXPECT_TRUE(log2.Load(kTestFilename, &err));
+  ASSERT_EQ("", err);
+  EXPECT_TRUE(log2.Recompact(kTestFilename, &err, &user));
+  ASSERT_EQ("", err);
+
+  BuildLog log3;
+  EXPECT_TRUE(log3.Load(kTestFilename, &err));
+  ASSERT_EQ("", err);
+  EXPECT_TRUE(log3.LookupByOutput("out"));
+  EXPECT_FALSE(log3.LookupByOutput("mid"));
+
+  // Likewise when compacting while building.
+  log3.Close();
+  FILE* f = fopen(kTestFilename, "ab");
+  fputs("garbage", f);
+  fclose(f);
+  user.dead.insert("out");
+  BuildLog log4;
+  EXPECT_TRUE(log4.Load(kTestFilename, &err));
+  ASSERT_EQ("", err);
+  EXPECT_TRUE(log4.OpenForWrite(kTestFilename, &err, &user));
+  ASSERT_EQ("", err);
+  EXPECT_TRUE(log4.compacting());
+  log4.Close();
+
+  BuildLog log5;
+  EXPECT_TRUE(log5.Load(kTestFilename, &err));
+  ASSERT_EQ("", err);
+  EXPECT_FALSE(log5.LookupByOutput("out"));
+}
+
+TEST_F(BuildLogTest, ImportAndExportText) {
+  FILE* f = fopen(kTestFilename, "wb");
+  fprintf(f, "# ninja log v6\n");
+  fprintf(f, "123\t456\t1357924680123456789\tout\t1234abcd\n");
+  fclose(f);
+
+  // Loading a text log and opening it rewrites it in binary.
+  BuildLog log1;
+  string err;
+  EXPECT_TRUE(log1.Load(kTestFilename, &err));
+  ASSERT_EQ("", err);
+  EXPECT_TRUE(log1.OpenForWrite(kTestFilename, &err));
+  ASSERT_EQ("", err);
+  log1.Close();
+
+  string contents;
+  ASSERT_EQ(0, ReadFile(kTestFilename, &contents, &err));
+  EXPECT_EQ(0u, contents.find("# ninjalog\n"));
+
+  BuildLog log2;
+  EXPECT_TRUE(log2.Load(kTestFilename, &err));
+  ASSERT_EQ("", err);
+  BuildLog::LogEntry* e = log2.LookupByOutput("out");
+  ASSERT_TRUE(e);
+  EXPECT_EQ(123, e->start_time);
+  EXPECT_EQ(456, e->end_time);
+  EXPECT_EQ(1357924680123456789LL, e->restat_mtime);
+  EXPECT_EQ(0x1234abcdu, e->command_hash);
+
+  // Not over the log, which log2 has mapped.
+  const char kExportFilename[] = "BuildLogTest-export";
+  f = fopen(kExportFilename, "wb");
+  EXPECT_TRUE(log2.Export(f));
+  fclose(f);
+  contents.clear();
+  ASSERT_EQ(0, ReadFile(kExportFilename, &contents, &err));
+  unlink(kExportFilename);
+  EXPECT_EQ("# ninja log v6\n"
+            "123\t456\t1357924680123456789\tout\t1234abcd\n", contents);
 }
 
 TEST_F(BuildLogTest, DoubleEntry) {
@@ -183,7 +695,8 @@ TEST_F(BuildLogTest, SpacesInOutputV4) {
   ASSERT_TRUE(e);
   ASSERT_EQ(123, e->start_time);
   ASSERT_EQ(456, e->end_time);
-  ASSERT_EQ(456, e->restat_mtime);
+  // Before v6, mtimes were in seconds.
+  ASSERT_EQ(456000000000LL, e->restat_mtime);
   ASSERT_NO_FATAL_FAILURE(AssertHash("command", e->command_hash));
 }
 
@@ -207,14 +720,14 @@ TEST_F(BuildLogTest, DuplicateVersionHeader) {
   ASSERT_TRUE(e);
   ASSERT_EQ(123, e->start_time);
   ASSERT_EQ(456, e->end_time);
-  ASSERT_EQ(456, e->restat_mtime);
+  ASSERT_EQ(456000000000LL, e->restat_mtime);
   ASSERT_NO_FATAL_FAILURE(AssertHash("command", e->command_hash));
 
   e = log.LookupByOutput("out2");
   ASSERT_TRUE(e);
   ASSERT_EQ(456, e->start_time);
   ASSERT_EQ(789, e->end_time);
-  ASSERT_EQ(789, e->restat_mtime);
+  ASSERT_EQ(789000000000LL, e->restat_mtime);
   ASSERT_NO_FATAL_FAILURE(AssertHash("command2", e->command_hash));
 }
 
@@ -242,6 +755,24 @@ TEST_F(BuildLogTest, VeryLongInputLine) {
   ASSERT_TRUE(e);
   ASSERT_EQ(456, e->start_time);
   ASSERT_EQ(789, e->end_time);
-  ASSERT_EQ(789, e->restat_mtime);
+  ASSERT_EQ(789000000000LL, e->restat_mtime);
   ASSERT_NO_FATAL_FAILURE(AssertHash("command2", e->command_hash));
 }
+
+TEST_F(BuildLogTest, IsOpenAt) {
+  BuildLog log;
+  string err;
+  EXPECT_FALSE(log.IsOpenAt(kTestFilename));
+  EXPECT_TRUE(log.OpenForWrite(kTestFilename, &err));
+  ASSERT_EQ("", err);
+  EXPECT_TRUE(log.IsOpenAt(kTestFilename));
+
+  // Another process recompacting the log replaces it.
+  string temp_path = string(kTestFilename) + ".recompact";
+  FILE* f = fopen(temp_path.c_str(), "wb");
+  ASSERT_TRUE(f != NULL);
+  fclose(f);
+  ASSERT_EQ(0, rename(temp_path.c_str(), kTestFilename));
+  EXPECT_FALSE(log.IsOpenAt(kTestFilename));
+  log.Close();
+}
@@ -0,0 +1,203 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Times the Builder's bookkeeping over a generated graph: scanning and
+// adding the target, Plan::AddTarget() on its own, and a dry run of the
+// whole build, so that no command or file system time is included.
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#ifdef _WIN32
+#include "getopt.h"
+#else
+#include <getopt.h>
+#endif
+
+#include "build.h"
+#include "disk_interface.h"
+#include "manifest_parser.h"
+#include "metrics.h"
+#include "state.h"
+#include "util.h"
+
+namespace {
+
+struct Options {
+  Options() : objects(100000), dirty_percent(100), runs(5) {}
+
+  /// Compile edges; they are linked 100 at a time into libraries, and
+  /// the libraries into one binary.
+  int objects;
+  /// Share of the sources that changed since the last build.
+  int dirty_percent;
+  int runs;
+};
+
+/// A DiskInterface over the generated graph: every output exists, and
+/// sources are newer than it if they are among those changed.
+struct GraphDiskInterface : public DiskInterface {
+  explicit GraphDiskInterface(int dirty_percent)
+      : dirty_percent_(dirty_percent) {}
+
+  virtual TimeStamp Stat(const string& path) {
+    if (path.compare(0, 4, "src/") != 0)
+      return 1;
+    // The number of the source is all that differs between them.
+    int number = atoi(path.c_str() + path.find_last_of('f') + 1);
+    return number % 100 < dirty_percent_ ? 2 : 1;
+  }
+  virtual bool MakeDir(const string& path) { return true; }
+  virtual bool WriteFile(const string& path, const string& contents) {
+    return true;
+  }
+  virtual string ReadFile(const string& path, string* err) { return ""; }
+  virtual int RemoveFile(const string& path) { return 0; }
+
+  int dirty_percent_;
+};
+
+/// A manifest of \a objects compiles, each with a few of the headers
+/// of its module, archived per module and linked into "all".
+string GenerateManifest(int objects) {
+  string out =
+    "rule cxx\n"
+    "  command = c++ -c $in -o $out\n"
+    "rule ar\n"
+    "  command = ar rcs $out $in\n"
+    "rule link\n"
+    "  command = c++ -o $out $in\n";
+  char buf[256];
+  int modules = (objects + 99) / 100;
+  for (int i = 0; i < objects; ++i) {
+    int module = i / 100;
+    snprintf(buf, sizeof(buf),
+             "build obj/m%d/f%d.o: cxx src/m%d/f%d.cc |"
+             " src/m%d/f%d.h src/m%d/f%d.h src/m%d/f%d.h\n",
+             module, i, module, i, module, i, module, module * 100 + 99,
+             module, module * 100 + (i * 7) % 100);
+    out += buf;
+  }
+  for (int module = 0; module < modules; ++module) {
+    snprintf(buf, sizeof(buf), "build lib/m%d.a: ar", module);
+    out += buf;
+    for (int i = module * 100; i < objects && i < (module + 1) * 100; ++i) {
+      snprintf(buf, sizeof(buf), " obj/m%d/f%d.o", module, i);
+      out += buf;
+    }
+    out += "\n";
+  }
+  out += "build all: link";
+  for (int module = 0; module < modules; ++module) {
+    snprintf(buf, sizeof(buf), " lib/m%d.a", module);
+    out += buf;
+  }
+  out += "\n";
+  return out;
+}
+
+void Usage() {
+  printf(
+"usage: build_perftest [options]\n"
+"\n"
+"options:\n"
+"  -n N  compile edges [default=100000]\n"
+"  -p N  percent of the sources changed [default=100]\n"
+"  -r N  runs, of which the fastest is reported [default=5]\n");
+}
+
+}  // anonymous namespace
+
+int main(int argc, char* argv[]) {
+  Options options;
+  int opt;
+  while ((opt = getopt(argc, argv, "n:p:r:h")) != -1) {
+    int value = atoi(optarg ? optarg : "0");
+    switch (opt) {
+      case 'n': options.objects = value; break;
+      case 'p': options.dirty_percent = value; break;
+      case 'r': options.runs = value; break;
+      default:
+        Usage();
+        return 1;
+    }
+  }
+  if (options.objects < 1 || options.dirty_percent < 0 ||
+      options.dirty_percent > 100 || options.runs < 1) {
+    Usage();
+    return 1;
+  }
+
+  string manifest = GenerateManifest(options.objects);
+  GraphDiskInterface disk_interface(options.dirty_percent);
+  BuildConfig config;
+  config.verbosity = BuildConfig::QUIET;
+  config.dry_run = true;
+
+  int64_t best_add = -1, best_plan = -1, best_build = -1;
+  int edges = 0, commands = 0;
+  for (int run = 0; run < options.runs; ++run) {
+    // Building changes the state of the graph, so each run gets its own.
+    State state;
+    ManifestParser parser(&state, NULL);
+    string err;
+    if (!parser.ParseTest(manifest, &err)) {
+      fprintf(stderr, "build_perftest: %s\n", err.c_str());
+      return 1;
+    }
+    edges = (int)state.edges_.size();
+
+    Builder builder(&state, config, NULL, NULL, &disk_interface);
+    int64_t start = GetTimeMillis();
+    Node* target = builder.AddTarget("all", &err);
+    if (!target && !err.empty()) {
+      fprintf(stderr, "build_perftest: %s\n", err.c_str());
+      return 1;
+    }
+    int64_t add = GetTimeMillis() - start;
+
+    // The scan is done now, so this is the plan alone.
+    start = GetTimeMillis();
+    Plan plan;
+    plan.AddTarget(target, &err);
+    int64_t plan_add = GetTimeMillis() - start;
+
+    int64_t build = 0;
+    commands = builder.plan_.command_edge_count();
+    if (!builder.AlreadyUpToDate()) {
+      start = GetTimeMillis();
+      if (!builder.Build(&err)) {
+        fprintf(stderr, "build_perftest: %s\n", err.c_str());
+        return 1;
+      }
+      build = GetTimeMillis() - start;
+    }
+
+    if (best_add < 0 || add < best_add)
+      best_add = add;
+    if (best_plan < 0 || plan_add < best_plan)
+      best_plan = plan_add;
+    if (best_build < 0 || build < best_build)
+      best_build = build;
+    printf("run %d: add %dms, plan %dms, build %dms\n", run + 1, (int)add,
+           (int)plan_add, (int)build);
+  }
+
+  printf("%d edges, %d commands to run\n", edges, commands);
+  printf("scan and add target: %dms\n", (int)best_add);
+  printf("Plan::AddTarget: %dms\n", (int)best_plan);
+  printf("dry run: %dms\n", (int)best_build);
+  printf("peak RSS: %ld kB\n", GetPeakRSS());
+  return 0;
+}
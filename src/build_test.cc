@@ -14,7 +14,12 @@
 
 #include "build.h"
 
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
 #include "build_log.h"
+#include "deps_log.h"
 #include "graph.h"
 #include "test.h"
 
@@ -176,10 +181,308 @@ TEST_F(PlanTest, DependencyCycle) {
   ASSERT_EQ("dependency cycle: out -> mid -> in -> pre -> out", err);
 }
 
+// A cycle back to another output of an edge on the way is still a cycle,
+// and is reported as closing on the output reached.
+TEST_F(PlanTest, DependencyCycleThroughOtherOutput) {
+  AssertParse(&state_,
+"build out other: cat mid\n"
+"build mid: cat other\n");
+  GetNode("out")->MarkDirty();
+  GetNode("other")->MarkDirty();
+  GetNode("mid")->MarkDirty();
+
+  string err;
+  EXPECT_FALSE(plan_.AddTarget(GetNode("out"), &err));
+  ASSERT_EQ("dependency cycle: other -> mid -> other", err);
+}
+
+// Planning doesn't recurse once per edge down a chain, which would run
+// out of stack on a long enough one.
+TEST_F(PlanTest, DeepChain) {
+  const int kDepth = 200000;
+  string manifest;
+  char buf[64];
+  for (int i = 1; i <= kDepth; ++i) {
+    snprintf(buf, sizeof(buf), "build n%d: cat n%d\n", i, i - 1);
+    manifest += buf;
+  }
+  AssertParse(&state_, manifest.c_str());
+  for (int i = 1; i <= kDepth; ++i) {
+    snprintf(buf, sizeof(buf), "n%d", i);
+    GetNode(buf)->MarkDirty();
+  }
+
+  string err;
+  snprintf(buf, sizeof(buf), "n%d", kDepth);
+  EXPECT_TRUE(plan_.AddTarget(GetNode(buf), &err));
+  EXPECT_EQ("", err);
+  EXPECT_EQ(kDepth, plan_.command_edge_count());
+  plan_.ComputeCriticalPath(NULL);
+
+  for (int i = 1; i <= kDepth; ++i) {
+    Edge* edge = plan_.FindWork();
+    ASSERT_TRUE(edge);
+    snprintf(buf, sizeof(buf), "n%d", i);
+    ASSERT_EQ(buf, edge->outputs_[0]->path());
+    plan_.EdgeFinished(edge);
+  }
+  EXPECT_FALSE(plan_.more_to_do());
+}
+
+// Test that the longest chain of commands, going by the build log,
+// starts first, and that commands the log doesn't know count as
+// average ones.
+TEST_F(PlanTest, CriticalPathFirst) {
+  AssertParse(&state_,
+"build out: cat link quick\n"
+"build quick: cat in\n"
+"build new: cat in\n"
+"build link: cat obj\n"
+"build obj: cat in\n");
+  const char* kOutputs[] = { "out", "quick", "new", "link", "obj" };
+  for (size_t i = 0; i < sizeof(kOutputs) / sizeof(kOutputs[0]); ++i)
+    GetNode(kOutputs[i])->MarkDirty();
+
+  string err;
+  EXPECT_TRUE(plan_.AddTarget(GetNode("out"), &err));
+  EXPECT_TRUE(plan_.AddTarget(GetNode("new"), &err));
+  ASSERT_EQ("", err);
+
+  BuildLog log;
+  log.RecordCommand(GetNode("out")->in_edge(), 0, 10);
+  log.RecordCommand(GetNode("quick")->in_edge(), 0, 10);
+  log.RecordCommand(GetNode("link")->in_edge(), 0, 200);
+  log.RecordCommand(GetNode("obj")->in_edge(), 0, 20);
+  plan_.ComputeCriticalPath(&log);
+
+  EXPECT_EQ(230, GetNode("obj")->in_edge()->critical_time_);
+  EXPECT_EQ(20, GetNode("quick")->in_edge()->critical_time_);
+  EXPECT_EQ(60, GetNode("new")->in_edge()->critical_time_);
+
+  Edge* edge = plan_.FindWork();
+  ASSERT_TRUE(edge);
+  EXPECT_EQ("obj", edge->outputs_[0]->path());
+  edge = plan_.FindWork();
+  ASSERT_TRUE(edge);
+  EXPECT_EQ("new", edge->outputs_[0]->path());
+  edge = plan_.FindWork();
+  ASSERT_TRUE(edge);
+  EXPECT_EQ("quick", edge->outputs_[0]->path());
+  ASSERT_FALSE(plan_.FindWork());
+}
+
+TEST_F(PlanTest, FailedFirst) {
+  AssertParse(&state_,
+"build out: cat link broken\n"
+"build broken: cat gen\n"
+"build gen: cat in\n"
+"build link: cat obj\n"
+"build obj: cat in\n");
+  const char* kOutputs[] = { "out", "broken", "gen", "link", "obj" };
+  for (size_t i = 0; i < sizeof(kOutputs) / sizeof(kOutputs[0]); ++i)
+    GetNode(kOutputs[i])->MarkDirty();
+
+  string err;
+  EXPECT_TRUE(plan_.AddTarget(GetNode("out"), &err));
+  ASSERT_EQ("", err);
+
+  BuildLog log;
+  log.RecordCommand(GetNode("link")->in_edge(), 0, 200);
+  log.RecordCommand(GetNode("obj")->in_edge(), 0, 20);
+  log.RecordFailure(GetNode("broken")->in_edge(), 0, 1);
+  plan_.ComputeCriticalPath(&log);
+
+  // What broken waits on goes before obj's longer chain, then broken.
+  Edge* edge = plan_.FindWork();
+  ASSERT_TRUE(edge);
+  EXPECT_EQ("gen", edge->outputs_[0]->path());
+  edge = plan_.FindWork();
+  ASSERT_TRUE(edge);
+  EXPECT_EQ("obj", edge->outputs_[0]->path());
+  plan_.EdgeFinished(GetNode("gen")->in_edge());
+  edge = plan_.FindWork();
+  ASSERT_TRUE(edge);
+  EXPECT_EQ("broken", edge->outputs_[0]->path());
+}
+
+TEST_F(PlanTest, PoolDepth) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"pool link\n"
+"  depth = 2\n"
+"rule ld\n"
+"  command = ld $in > $out\n"
+"  pool = link\n"
+"build out1: ld in\n"
+"build out2: ld in\n"
+"build out3: ld in\n"
+"build heavy: ld in\n"
+"  pool_weight = 2\n"
+"build cc: cat in\n"
+"build all: phony out1 out2 out3 heavy cc\n"));
+  const char* kOutputs[] = { "out1", "out2", "out3", "heavy", "cc", "all" };
+  for (size_t i = 0; i < sizeof(kOutputs) / sizeof(kOutputs[0]); ++i)
+    GetNode(kOutputs[i])->MarkDirty();
+  string err;
+  EXPECT_TRUE(plan_.AddTarget(GetNode("all"), &err));
+  ASSERT_EQ("", err);
+
+  // The pool takes two light edges, or the heavy one, at a time; other
+  // edges aren't held up.
+  Edge* out1 = plan_.FindWork();
+  ASSERT_TRUE(out1);
+  EXPECT_EQ("out1", out1->outputs_[0]->path());
+  Edge* out2 = plan_.FindWork();
+  ASSERT_TRUE(out2);
+  EXPECT_EQ("out2", out2->outputs_[0]->path());
+  Edge* cc = plan_.FindWork();
+  ASSERT_TRUE(cc);
+  EXPECT_EQ("cc", cc->outputs_[0]->path());
+  ASSERT_FALSE(plan_.FindWork());
+  EXPECT_EQ(2, state_.LookupPool("link")->current_use());
+
+  plan_.EdgeFinished(cc);
+  ASSERT_FALSE(plan_.FindWork());
+
+  plan_.EdgeFinished(out1);
+  Edge* out3 = plan_.FindWork();
+  ASSERT_TRUE(out3);
+  EXPECT_EQ("out3", out3->outputs_[0]->path());
+  ASSERT_FALSE(plan_.FindWork());
+
+  plan_.EdgeFinished(out2);
+  ASSERT_FALSE(plan_.FindWork());
+  plan_.EdgeFinished(out3);
+  Edge* heavy = plan_.FindWork();
+  ASSERT_TRUE(heavy);
+  EXPECT_EQ("heavy", heavy->outputs_[0]->path());
+  EXPECT_EQ(2, state_.LookupPool("link")->current_use());
+  plan_.EdgeFinished(heavy);
+
+  Edge* all = plan_.FindWork();
+  ASSERT_TRUE(all);
+  EXPECT_EQ("all", all->outputs_[0]->path());
+  plan_.EdgeFinished(all);
+  ASSERT_FALSE(plan_.more_to_do());
+  EXPECT_EQ(0, state_.LookupPool("link")->current_use());
+}
+
+TEST_F(PlanTest, Speculate) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"rule gen\n"
+"  command = gen $out\n"
+"  restat = 1\n"
+"build gen.h: gen gen.in\n"
+"build new.h: gen gen.in\n"
+"build a.o: cat a.c | gen.h\n"
+"build b.o: cat b.c | gen.h\n"
+"build c.o: cat c.c | new.h\n"
+"build d.o: cat d.c | a.o\n"
+"build all: phony a.o b.o c.o d.o\n"));
+  const char* kOutputs[] = {
+    "gen.h", "new.h", "a.o", "b.o", "c.o", "d.o", "all"
+  };
+  for (size_t i = 0; i < sizeof(kOutputs) / sizeof(kOutputs[0]); ++i)
+    GetNode(kOutputs[i])->MarkDirty();
+  GetNode("gen.h")->set_mtime(1);
+  GetNode("new.h")->MarkMissing();
+  plan_.set_speculate(true);
+  string err;
+  EXPECT_TRUE(plan_.AddTarget(GetNode("all"), &err));
+  ASSERT_EQ("", err);
+
+  // Nothing is run early before the restat edges are underway.
+  ASSERT_FALSE(plan_.FindSpeculativeWork());
+  Edge* gen = plan_.FindWork();
+  Edge* gen_new = plan_.FindWork();
+  ASSERT_TRUE(gen && gen_new);
+  ASSERT_FALSE(plan_.FindWork());
+
+  // a.o and b.o wait only on gen.h, which is there; c.o waits on new.h,
+  // which isn't, and d.o on a command without restat.
+  Edge* a = plan_.FindSpeculativeWork();
+  Edge* b = plan_.FindSpeculativeWork();
+  ASSERT_TRUE(a && b);
+  EXPECT_EQ("a.o", a->outputs_[0]->path());
+  EXPECT_EQ("b.o", b->outputs_[0]->path());
+  EXPECT_TRUE(plan_.speculating(a));
+  ASSERT_FALSE(plan_.FindSpeculativeWork());
+
+  // b.o is given up on, once done, and isn't tried again.  Neither is
+  // ready before gen.h is.
+  plan_.DropSpeculation(b);
+  EXPECT_FALSE(plan_.speculating(b));
+  ASSERT_FALSE(plan_.FindWork());
+
+  // Then b.o is run as usual; a.o is the caller's to finish.
+  plan_.EdgeFinished(gen);
+  plan_.EdgeFinished(gen_new);
+  Edge* edge = plan_.FindWork();
+  ASSERT_TRUE(edge);
+  EXPECT_EQ("b.o", edge->outputs_[0]->path());
+  plan_.EdgeFinished(edge);
+  edge = plan_.FindWork();
+  ASSERT_TRUE(edge);
+  EXPECT_EQ("c.o", edge->outputs_[0]->path());
+  plan_.EdgeFinished(edge);
+  ASSERT_FALSE(plan_.FindWork());
+  ASSERT_FALSE(plan_.FindSpeculativeWork());
+
+  plan_.EdgeFinished(a);
+  EXPECT_FALSE(plan_.speculating(a));
+  edge = plan_.FindWork();
+  ASSERT_TRUE(edge);
+  EXPECT_EQ("d.o", edge->outputs_[0]->path());
+  plan_.EdgeFinished(edge);
+  edge = plan_.FindWork();
+  ASSERT_TRUE(edge);
+  EXPECT_EQ("all", edge->outputs_[0]->path());
+  plan_.EdgeFinished(edge);
+  ASSERT_FALSE(plan_.more_to_do());
+}
+
+TEST(ParallelismControllerTest, BacksOffUnderPressure) {
+  ParallelismController controller(2, 16);
+  EXPECT_EQ(16, controller.parallelism());
+
+  // Each sample of high pressure takes off a quarter, down to the floor.
+  controller.Update(0.5, 0.0, 16, 0);
+  EXPECT_EQ(12, controller.parallelism());
+  controller.Update(0.0, 0.5, 12, 250);
+  EXPECT_EQ(9, controller.parallelism());
+  for (int i = 0; i < 10; ++i)
+    controller.Update(1.0, 1.0, 9, 500 + 250 * i);
+  EXPECT_EQ(2, controller.parallelism());
+  EXPECT_EQ(2, controller.lowest_);
+}
+
+TEST(ParallelismControllerTest, RaisesOnlyWhenSaturated) {
+  ParallelismController controller(1, 4);
+  controller.Update(0.3, 0.0, 4, 0);
+  EXPECT_EQ(3, controller.parallelism());
+
+  // The pressure is smoothed, so it takes a few quiet samples to come
+  // back, and none while jobs allowed are left unused.
+  controller.Update(0.0, 0.0, 3, 250);
+  controller.Update(0.0, 0.0, 3, 500);
+  EXPECT_EQ(3, controller.parallelism());
+  controller.Update(0.0, 0.0, 2, 750);
+  EXPECT_EQ(3, controller.parallelism());
+  controller.Update(0.0, 0.0, 3, 1000);
+  EXPECT_EQ(4, controller.parallelism());
+  controller.Update(0.0, 0.0, 4, 1250);
+  EXPECT_EQ(4, controller.parallelism());
+  EXPECT_EQ(1, controller.lowered_);
+  EXPECT_EQ(1, controller.raised_);
+
+  // A brief spike is smoothed over.
+  controller.Update(0.3, 0.0, 4, 1500);
+  EXPECT_EQ(4, controller.parallelism());
+}
+
 struct BuildTest : public StateTestWithBuiltinRules,
                    public CommandRunner {
   BuildTest() : config_(MakeConfig()),
-                builder_(&state_, config_, NULL, &fs_),
+                builder_(&state_, config_, NULL, NULL, &fs_),
                 now_(1), last_command_(NULL), status_(config_) {
     builder_.command_runner_.reset(this);
     AssertParse(&state_,
@@ -218,6 +521,8 @@ struct BuildTest : public StateTestWithBuiltinRules,
 
   vector<string> commands_ran_;
   Edge* last_command_;
+  /// What commands print.
+  string command_output_;
   BuildStatus status_;
 };
 
@@ -261,8 +566,9 @@ bool BuildTest::StartCommand(Edge* edge) {
   return true;
 }
 
-Edge* BuildTest::WaitForCommand(ExitStatus* status, string* /* output */) {
+Edge* BuildTest::WaitForCommand(ExitStatus* status, string* output) {
   if (Edge* edge = last_command_) {
+    *output = command_output_;
     if (edge->rule().name() == "interrupt" ||
         edge->rule().name() == "touch-interrupt") {
       *status = ExitInterrupted;
@@ -467,12 +773,37 @@ TEST_F(BuildTest, MakeDirs) {
 #endif
 }
 
+TEST_F(BuildTest, MakeDirsOnce) {
+#ifdef _WIN32
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"build subdir\\a: cat in1\n"
+"build subdir\\b: cat in1\n"
+"build all: phony subdir\\a subdir\\b\n"));
+#else
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"build subdir/a: cat in1\n"
+"build subdir/b: cat in1\n"
+"build all: phony subdir/a subdir/b\n"));
+#endif
+  string err;
+  EXPECT_TRUE(builder_.AddTarget("all", &err));
+  EXPECT_EQ("", err);
+  now_ = 0;  // Make all stat()s return file not found.
+  EXPECT_TRUE(builder_.Build(&err));
+  ASSERT_EQ("", err);
+  ASSERT_EQ(2u, commands_ran_.size());
+  // Not again for the second output, though it still isn't found.
+  ASSERT_EQ(1u, fs_.directories_made_.size());
+  EXPECT_EQ("subdir", fs_.directories_made_[0]);
+}
+
 TEST_F(BuildTest, DepFileMissing) {
   string err;
   ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
 "rule cc\n  command = cc $in\n  depfile = $out.d\n"
 "build foo.o: cc foo.c\n"));
   fs_.Create("foo.c", now_, "");
+  fs_.Create("foo.o", now_, "");
 
   EXPECT_TRUE(builder_.AddTarget("foo.o", &err));
   ASSERT_EQ("", err);
@@ -489,6 +820,7 @@ TEST_F(BuildTest, DepFileOK) {
   Edge* edge = state_.edges_.back();
 
   fs_.Create("foo.c", now_, "");
+  fs_.Create("foo.o", now_, "");
   GetNode("bar.h")->MarkDirty();  // Mark bar.h as missing.
   fs_.Create("foo.o.d", now_, "foo.o: blah.h bar.h\n");
   EXPECT_TRUE(builder_.AddTarget("foo.o", &err));
@@ -512,6 +844,7 @@ TEST_F(BuildTest, DepFileParseError) {
 "rule cc\n  command = cc $in\n  depfile = $out.d\n"
 "build foo.o: cc foo.c\n"));
   fs_.Create("foo.c", now_, "");
+  fs_.Create("foo.o", now_, "");
   fs_.Create("foo.o.d", now_, "randomtext\n");
   EXPECT_FALSE(builder_.AddTarget("foo.o", &err));
   EXPECT_EQ("expected depfile 'foo.o.d' to mention 'foo.o', got 'randomtext'",
@@ -525,6 +858,9 @@ TEST_F(BuildTest, OrderOnlyDeps) {
 "build foo.o: cc foo.c || otherfile\n"));
   Edge* edge = state_.edges_.back();
 
+  // An old foo.o, as the depfile is only read for existing outputs.
+  fs_.Create("foo.o", now_, "");
+  now_++;
   fs_.Create("foo.c", now_, "");
   fs_.Create("otherfile", now_, "");
   fs_.Create("foo.o.d", now_, "foo.o: blah.h bar.h\n");
@@ -716,6 +1052,206 @@ TEST_F(BuildTest, SwallowFailuresLimit) {
   ASSERT_EQ("cannot make progress due to previous errors", err);
 }
 
+TEST_F(BuildTest, PoolFailure) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"pool p\n"
+"  depth = 1\n"
+"rule fail\n"
+"  command = fail\n"
+"  pool = p\n"
+"rule touch\n"
+"  command = touch $out\n"
+"  pool = p\n"
+"build a: fail\n"
+"build b: touch\n"
+"build c: touch\n"));
+
+  // A failed command gives its room in the pool to the others.
+  config_.failures_allowed = 11;
+
+  string err;
+  EXPECT_TRUE(builder_.AddTarget("a", &err));
+  EXPECT_TRUE(builder_.AddTarget("b", &err));
+  EXPECT_TRUE(builder_.AddTarget("c", &err));
+  ASSERT_EQ("", err);
+
+  EXPECT_FALSE(builder_.Build(&err));
+  ASSERT_EQ(3u, commands_ran_.size());
+  EXPECT_EQ("cannot make progress due to previous errors", err);
+  EXPECT_EQ(0, state_.LookupPool("p")->current_use());
+}
+
+TEST_F(BuildTest, PoolInterrupted) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"pool p\n"
+"  depth = 1\n"
+"rule interrupt\n"
+"  command = interrupt\n"
+"  pool = p\n"
+"build a: interrupt\n"));
+
+  string err;
+  EXPECT_TRUE(builder_.AddTarget("a", &err));
+  ASSERT_EQ("", err);
+  EXPECT_FALSE(builder_.Build(&err));
+  EXPECT_EQ("interrupted by user", err);
+  EXPECT_EQ(1, state_.LookupPool("p")->current_use());
+
+  // Cleaning up after it gives back its room.
+  builder_.Cleanup();
+  EXPECT_EQ(0, state_.LookupPool("p")->current_use());
+}
+
+/// Runs up to three commands at once, finishing the last started first,
+/// so that commands are run early on restat edges not yet done.
+struct BuildSpeculateTest : public BuildTest {
+  BuildSpeculateTest() {
+    config_.speculate = true;
+    now_ = 3;
+    fs_.Create("gen.in", 2, "");
+    fs_.Create("gen.h", 1, "");
+    fs_.Create("out", 1, "");
+  }
+
+  // CommandRunner impl
+  virtual bool CanRunMore();
+  virtual bool StartCommand(Edge* edge);
+  virtual Edge* WaitForCommand(ExitStatus* status, string* output);
+  virtual vector<Edge*> GetActiveEdges();
+  virtual void Abort();
+
+  vector<Edge*> active_;
+};
+
+bool BuildSpeculateTest::CanRunMore() {
+  return active_.size() < 3;
+}
+
+bool BuildSpeculateTest::StartCommand(Edge* edge) {
+  string command = edge->EvaluateCommand();
+  commands_ran_.push_back(command);
+  if (command.compare(0, 6, "touch ") == 0) {
+    for (vector<Node*>::iterator out = edge->outputs_.begin();
+         out != edge->outputs_.end(); ++out) {
+      fs_.Create((*out)->path(), now_, "");
+    }
+  }
+  active_.push_back(edge);
+  return true;
+}
+
+Edge* BuildSpeculateTest::WaitForCommand(ExitStatus* status, string* output) {
+  if (active_.empty()) {
+    *status = ExitFailure;
+    return NULL;
+  }
+  Edge* edge = active_.back();
+  string command = edge->EvaluateCommand();
+  if (command == "interrupt") {
+    *status = ExitInterrupted;
+    return NULL;
+  }
+  *status = command == "fail" ? ExitFailure : ExitSuccess;
+  active_.pop_back();
+  return edge;
+}
+
+vector<Edge*> BuildSpeculateTest::GetActiveEdges() {
+  return active_;
+}
+
+void BuildSpeculateTest::Abort() {
+  active_.clear();
+}
+
+TEST_F(BuildSpeculateTest, StaleOutputsRemoved) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"rule gen\n"
+"  command = touch $out\n"
+"  restat = 1\n"
+"rule touch\n"
+"  command = touch $out\n"
+"rule fail\n"
+"  command = fail\n"
+"build gen.h: gen gen.in\n"
+"build out: touch gen.h\n"
+"build f: fail\n"));
+
+  string err;
+  EXPECT_TRUE(builder_.AddTarget("out", &err));
+  EXPECT_TRUE(builder_.AddTarget("f", &err));
+  ASSERT_EQ("", err);
+  // out is run early and done, then f fails, then gen.h changes: what
+  // out wrote from the old gen.h must not look up to date next time.
+  EXPECT_FALSE(builder_.Build(&err));
+  EXPECT_EQ("subcommand failed", err);
+  ASSERT_EQ(3u, commands_ran_.size());
+  EXPECT_EQ("touch out", commands_ran_[2]);
+  EXPECT_EQ(3, fs_.Stat("gen.h"));
+  EXPECT_EQ(0, fs_.Stat("out"));
+}
+
+TEST_F(BuildSpeculateTest, Interrupted) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"pool p\n"
+"  depth = 1\n"
+"rule gen\n"
+"  command = interrupt\n"
+"  restat = 1\n"
+"rule touch\n"
+"  command = touch $out\n"
+"  pool = p\n"
+"build gen.h: gen gen.in\n"
+"build out: touch gen.h\n"));
+
+  string err;
+  EXPECT_TRUE(builder_.AddTarget("out", &err));
+  ASSERT_EQ("", err);
+  EXPECT_FALSE(builder_.Build(&err));
+  EXPECT_EQ("interrupted by user", err);
+  ASSERT_EQ(2u, commands_ran_.size());
+  EXPECT_EQ("touch out", commands_ran_[1]);
+  EXPECT_EQ(1, state_.LookupPool("p")->current_use());
+
+  // out, run early and done, is cleaned up after too.
+  builder_.Cleanup();
+  EXPECT_EQ(0, state_.LookupPool("p")->current_use());
+  EXPECT_EQ(1, fs_.Stat("gen.h"));
+  EXPECT_EQ(0, fs_.Stat("out"));
+}
+
+TEST_F(BuildSpeculateTest, InputFailed) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"pool p\n"
+"  depth = 1\n"
+"rule gen\n"
+"  command = fail\n"
+"  restat = 1\n"
+"rule touch\n"
+"  command = touch $out\n"
+"rule ptouch\n"
+"  command = touch $out\n"
+"  pool = p\n"
+"build gen.h: gen gen.in\n"
+"build out: ptouch gen.h\n"
+"build y: touch\n"
+"build z: ptouch y\n"));
+  config_.failures_allowed = 3;
+
+  string err;
+  EXPECT_TRUE(builder_.AddTarget("out", &err));
+  EXPECT_TRUE(builder_.AddTarget("z", &err));
+  ASSERT_EQ("", err);
+  // out, run early, holds p's only room until gen.h fails to build.
+  EXPECT_FALSE(builder_.Build(&err));
+  EXPECT_EQ("cannot make progress due to previous errors", err);
+  ASSERT_EQ(4u, commands_ran_.size());
+  EXPECT_EQ("touch out", commands_ran_[2]);
+  EXPECT_EQ("touch z", commands_ran_[3]);
+  EXPECT_EQ(0, state_.LookupPool("p")->current_use());
+  EXPECT_EQ(0, fs_.Stat("out"));
+}
+
 struct BuildWithLogTest : public BuildTest {
   BuildWithLogTest() {
     builder_.SetBuildLog(&build_log_);
@@ -812,6 +1348,55 @@ TEST_F(BuildWithLogTest, RestatTest) {
   ASSERT_EQ(2u, commands_ran_.size());
 }
 
+TEST_F(BuildWithLogTest, ContentDigests) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"rule cc\n"
+"  command = cc\n"
+"build out1: cc in\n"
+"build out2: cat out1\n"));
+
+  config_.content_digests = true;
+  DepsLog deps_log;  // Kept in memory.
+  Builder builder(&state_, config_, &build_log_, &deps_log, &fs_);
+  builder.command_runner_.reset(this);
+
+  fs_.Create("in", now_, "a");
+  string err;
+  EXPECT_TRUE(builder.AddTarget("out2", &err));
+  ASSERT_EQ("", err);
+  EXPECT_TRUE(builder.Build(&err));
+  ASSERT_EQ("", err);
+  EXPECT_EQ(2u, commands_ran_.size());
+
+  // Touching the input leaves everything up to date.
+  now_++;
+  fs_.Create("in", now_, "a");
+  commands_ran_.clear();
+  state_.Reset();
+  EXPECT_TRUE(builder.AddTarget("out2", &err));
+  ASSERT_EQ("", err);
+  EXPECT_TRUE(builder.AlreadyUpToDate());
+
+  // Changing it rebuilds out1, but "cc" writes it as it was, so out2
+  // isn't rebuilt, now or later.
+  now_++;
+  fs_.Create("in", now_, "b");
+  state_.Reset();
+  EXPECT_TRUE(builder.AddTarget("out2", &err));
+  ASSERT_EQ("", err);
+  EXPECT_TRUE(builder.Build(&err));
+  ASSERT_EQ("", err);
+  ASSERT_EQ(1u, commands_ran_.size());
+  EXPECT_EQ("cc", commands_ran_[0]);
+
+  state_.Reset();
+  EXPECT_TRUE(builder.AddTarget("out2", &err));
+  ASSERT_EQ("", err);
+  EXPECT_TRUE(builder.AlreadyUpToDate());
+
+  builder.command_runner_.release();
+}
+
 TEST_F(BuildWithLogTest, RestatMissingFile) {
   // If a restat rule doesn't create its output, and the output didn't
   // exist before the rule was run, consider that behavior equivalent
@@ -907,6 +1492,46 @@ TEST_F(BuildWithLogTest, RestatMissingInput) {
   ASSERT_EQ(restat_mtime, log_entry->restat_mtime);
 }
 
+TEST_F(BuildWithLogTest, RestatCleansAllOutputs) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"rule true\n"
+"  command = true\n"
+"  restat = 1\n"
+"build h1 h2: true in\n"
+"build o1: cat h1 h2\n"
+"build o2: cat h1\n"
+"build all: cat o1 o2\n"));
+
+  fs_.Create("h1", now_, "");
+  fs_.Create("h2", now_, "");
+  now_++;
+  fs_.Create("in", now_, "");
+  string err;
+  EXPECT_TRUE(builder_.AddTarget("all", &err));
+  ASSERT_EQ("", err);
+  EXPECT_TRUE(builder_.Build(&err));
+  ASSERT_EQ("", err);
+  ASSERT_EQ(4u, commands_ran_.size());
+
+  // Neither header changes, so nothing that uses them runs.
+  TimeStamp in_mtime = ++now_;
+  fs_.Create("in", now_, "");
+  commands_ran_.clear();
+  state_.Reset();
+  EXPECT_TRUE(builder_.AddTarget("all", &err));
+  ASSERT_EQ("", err);
+  int planned = builder_.plan_.command_edge_count();
+  EXPECT_TRUE(builder_.Build(&err));
+  ASSERT_EQ("", err);
+  ASSERT_EQ(1u, commands_ran_.size());
+  EXPECT_EQ(planned - 3, builder_.plan_.command_edge_count());
+
+  // The input's mtime, as the scan found it, is logged.
+  BuildLog::LogEntry* log_entry = build_log_.LookupByOutput("h2");
+  ASSERT_TRUE(NULL != log_entry);
+  EXPECT_EQ(in_mtime, log_entry->restat_mtime);
+}
+
 struct BuildDryRun : public BuildWithLogTest {
   BuildDryRun() {
     config_.dry_run = true;
@@ -1135,3 +1760,146 @@ TEST_F(BuildTest, StatusFormatReplacePlaceholder) {
   EXPECT_EQ("[%/s0/t0/r0/u0/f0]",
             status_.FormatProgressStatus("[%%/s%s/t%t/r%r/u%u/f%f]"));
 }
+
+/// Builds against a real deps log, with fresh state for each build as
+/// separate ninja runs would have.
+struct BuildWithDepsLogTest : public BuildTest {
+  virtual void SetUp() {
+    unlink(kTestFilename);
+  }
+  virtual void TearDown() {
+    unlink(kTestFilename);
+  }
+
+  static const char kTestFilename[];
+  static const char kManifest[];
+};
+
+const char BuildWithDepsLogTest::kTestFilename[] = "BuildWithDepsLogTest-log";
+const char BuildWithDepsLogTest::kManifest[] =
+"rule cc\n"
+"  command = cc $in\n"
+"  depfile = $out.d\n"
+"  deps = gcc\n"
+"build out.o: cc in.c\n";
+
+TEST_F(BuildWithDepsLogTest, RecordsAndUsesDeps) {
+  fs_.Create("in.c", now_, "");
+  fs_.Create("header.h", now_, "");
+  {
+    State state;
+    ASSERT_NO_FATAL_FAILURE(AssertParse(&state, kManifest));
+    DepsLog deps_log;
+    string err;
+    ASSERT_TRUE(deps_log.OpenForWrite(kTestFilename, &err));
+    ASSERT_EQ("", err);
+
+    Builder builder(&state, config_, NULL, &deps_log, &fs_);
+    builder.command_runner_.reset(this);
+    fs_.Create("out.o.d", now_, "out.o: in.c header.h\n");
+    EXPECT_TRUE(builder.AddTarget("out.o", &err));
+    ASSERT_EQ("", err);
+    EXPECT_TRUE(builder.Build(&err));
+    EXPECT_EQ("", err);
+    builder.command_runner_.release();
+    ASSERT_EQ(1u, commands_ran_.size());
+
+    // The depfile is read once, into the log, and then goes.
+    EXPECT_EQ(1u, fs_.files_removed_.count("out.o.d"));
+    DepsLog::Deps* deps = deps_log.GetDeps(state.GetNode("out.o"));
+    ASSERT_TRUE(deps);
+    ASSERT_EQ(2, deps->node_count);
+    EXPECT_EQ("in.c", deps->nodes[0]->path());
+    EXPECT_EQ("header.h", deps->nodes[1]->path());
+  }
+
+  // The next run finds the deps in the log, without a depfile.
+  {
+    State state;
+    ASSERT_NO_FATAL_FAILURE(AssertParse(&state, kManifest));
+    DepsLog deps_log;
+    string err;
+    ASSERT_TRUE(deps_log.Load(kTestFilename, &state, &err));
+    ASSERT_EQ("", err);
+
+    Builder builder(&state, config_, NULL, &deps_log, &fs_);
+    EXPECT_TRUE(builder.AddTarget("out.o", &err));
+    ASSERT_EQ("", err);
+    EXPECT_TRUE(builder.AlreadyUpToDate());
+    Edge* edge = state.GetNode("out.o")->in_edge();
+    ASSERT_EQ(3u, edge->inputs_.size());
+    EXPECT_EQ("header.h", edge->inputs_[2]->path());
+  }
+
+  // A change to a header a command reported makes its output dirty.
+  now_++;
+  fs_.Create("header.h", now_, "");
+  {
+    State state;
+    ASSERT_NO_FATAL_FAILURE(AssertParse(&state, kManifest));
+    DepsLog deps_log;
+    string err;
+    ASSERT_TRUE(deps_log.Load(kTestFilename, &state, &err));
+    ASSERT_EQ("", err);
+
+    Builder builder(&state, config_, NULL, &deps_log, &fs_);
+    EXPECT_TRUE(builder.AddTarget("out.o", &err));
+    ASSERT_EQ("", err);
+    EXPECT_FALSE(builder.AlreadyUpToDate());
+  }
+}
+
+TEST_F(BuildWithDepsLogTest, MsvcDepsFromOutput) {
+  fs_.Create("in.c", now_, "");
+  State state;
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state,
+"rule cc\n"
+"  command = cl /showIncludes -c $in\n"
+"  deps = msvc\n"
+"build out.o: cc in.c\n"));
+  DepsLog deps_log;
+  string err;
+  ASSERT_TRUE(deps_log.OpenForWrite(kTestFilename, &err));
+  ASSERT_EQ("", err);
+
+  Builder builder(&state, config_, NULL, &deps_log, &fs_);
+  builder.command_runner_.reset(this);
+  command_output_ = "in.c\r\n"
+                    "Note: including file: ./header.h\r\n"
+                    "Note: including file:  C:\\Program Files\\VC\\stdio.h\r\n"
+                    "Note: including file:   sub/../other.h\r\n";
+  EXPECT_TRUE(builder.AddTarget("out.o", &err));
+  ASSERT_EQ("", err);
+  EXPECT_TRUE(builder.Build(&err));
+  EXPECT_EQ("", err);
+  builder.command_runner_.release();
+  ASSERT_EQ(1u, commands_ran_.size());
+
+  // The headers go straight into the log, less the system one, with no
+  // depfile read.
+  EXPECT_TRUE(fs_.files_read_.empty());
+  DepsLog::Deps* deps = deps_log.GetDeps(state.GetNode("out.o"));
+  ASSERT_TRUE(deps);
+  ASSERT_EQ(2, deps->node_count);
+  EXPECT_EQ("header.h", deps->nodes[0]->path());
+  EXPECT_EQ("other.h", deps->nodes[1]->path());
+}
+
+TEST_F(BuildWithDepsLogTest, MissingDepsMeansDirty) {
+  fs_.Create("in.c", now_, "");
+  fs_.Create("out.o", now_, "");
+
+  // An output that is up to date by its inputs, but that the log has no
+  // deps for, is rebuilt to find them out.
+  State state;
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state, kManifest));
+  DepsLog deps_log;
+  string err;
+  ASSERT_TRUE(deps_log.Load(kTestFilename, &state, &err));
+  ASSERT_EQ("", err);
+
+  Builder builder(&state, config_, NULL, &deps_log, &fs_);
+  EXPECT_TRUE(builder.AddTarget("out.o", &err));
+  ASSERT_EQ("", err);
+  EXPECT_FALSE(builder.AlreadyUpToDate());
+}
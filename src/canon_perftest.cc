@@ -18,39 +18,79 @@
 #include "util.h"
 #include "metrics.h"
 
-const char kPath[] =
-    "../../third_party/WebKit/Source/WebCore/"
-    "platform/leveldb/LevelDBWriteBatch.cpp";
+// Paths of the kinds found in manifests and depfiles: relative paths out
+// of the build directory, system headers, generated files, and some that
+// need real work.
+const char* kPaths[] = {
+  "../../third_party/WebKit/Source/WebCore/"
+      "platform/leveldb/LevelDBWriteBatch.cpp",
+  "../../base/memory/scoped_ptr.h",
+  "../../content/browser/renderer_host/render_widget_host_view_aura.cc",
+  "obj/content/browser/renderer_host/content_browser.render_widget.o",
+  "gen/protoc_out/chrome/browser/sync/protocol/sync.pb.h",
+  "/usr/include/x86_64-linux-gnu/bits/stdio2.h",
+  "/usr/lib/gcc/x86_64-linux-gnu/4.6/include/stddef.h",
+  "/usr/include/c++/4.6/bits/stl_algobase.h",
+  "foo.h",
+  "src/util.cc",
+  "../../third_party/skia/include/core/../config/SkUserConfig.h",
+  "./gen/webkit/bindings/V8HTMLElement.h",
+  "../../v8/src/../include/v8.h",
+  "../../ui/gfx/./rect.h",
+};
+const int kNumPaths = sizeof(kPaths) / sizeof(kPaths[0]);
 
-int main() {
-  vector<int> times;
-  string err;
+typedef bool (*CanonicalizeFunction)(char* path, size_t* len, string* err);
 
-  char buf[200];
-  size_t len = strlen(kPath);
-  strcpy(buf, kPath);
+/// Nanoseconds per path for \a canonicalize over kPaths, at best of a few
+/// runs.
+double Measure(CanonicalizeFunction canonicalize) {
+  // Copies of the corpus to canonicalize in place, restored between runs.
+  const int kCopies = 20000;
+  string pristine;
+  vector<size_t> offsets, lengths;
+  for (int copy = 0; copy < kCopies; ++copy) {
+    for (int i = 0; i < kNumPaths; ++i) {
+      offsets.push_back(pristine.size());
+      lengths.push_back(strlen(kPaths[i]));
+      pristine.append(kPaths[i]);
+      pristine.push_back('\0');
+    }
+  }
 
-  for (int j = 0; j < 5; ++j) {
-    const int kNumRepetitions = 2000000;
+  string err;
+  int64_t best = 0;
+  for (int run = 0; run < 10; ++run) {
+    string buf = pristine;
     int64_t start = GetTimeMillis();
-    for (int i = 0; i < kNumRepetitions; ++i) {
-      CanonicalizePath(buf, &len, &err);
+    for (size_t i = 0; i < offsets.size(); ++i) {
+      size_t len = lengths[i];
+      canonicalize(&buf[offsets[i]], &len, &err);
     }
-    int delta = (int)(GetTimeMillis() - start);
-    times.push_back(delta);
+    int64_t delta = GetTimeMillis() - start;
+    if (run == 0 || delta < best)
+      best = delta;
   }
+  return best * 1e6 / offsets.size();
+}
 
-  int min = times[0];
-  int max = times[0];
-  float total = 0;
-  for (size_t i = 0; i < times.size(); ++i) {
-    total += times[i];
-    if (times[i] < min)
-      min = times[i];
-    else if (times[i] > max)
-      max = times[i];
+int main() {
+  // Check that the two agree before timing them.
+  for (int i = 0; i < kNumPaths; ++i) {
+    string scalar = kPaths[i], vector = kPaths[i], err;
+    size_t scalar_len = scalar.size(), vector_len = vector.size();
+    CanonicalizePathScalar(&scalar[0], &scalar_len, &err);
+    CanonicalizePath(&vector[0], &vector_len, &err);
+    if (scalar.substr(0, scalar_len) != vector.substr(0, vector_len)) {
+      printf("mismatch on %s: %s vs %s\n", kPaths[i],
+             scalar.substr(0, scalar_len).c_str(),
+             vector.substr(0, vector_len).c_str());
+      return 1;
+    }
   }
 
-  printf("min %dms  max %dms  avg %.1fms\n",
-         min, max, total / times.size());
+  printf("%d paths, ns per path:\n", kNumPaths);
+  printf("scalar %.1f\n", Measure(CanonicalizePathScalar));
+  printf("vector %.1f\n", Measure(CanonicalizePath));
+  return 0;
 }
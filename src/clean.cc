@@ -19,19 +19,78 @@
 #include <stdio.h>
 #include <string.h>
 #include <sys/stat.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include <algorithm>
+#include <map>
 
 #include "disk_interface.h"
 #include "graph.h"
 #include "state.h"
+#include "thread_pool.h"
 #include "util.h"
 
+#ifndef _WIN32
+namespace {
+
+/// How many files of a directory one task removes, so that big
+/// directories are spread over the threads too.
+const size_t kFilesPerTask = 256;
+
+}  // anonymous namespace
+
+/// Removes files of one directory relative to a descriptor of it, so
+/// that the directory is looked up once rather than for every file.
+struct Cleaner::RemoveTask : public ThreadPool::Task {
+  virtual void Run();
+
+  string dir;
+  /// The files, by index in pending_ and by name in dir.
+  vector<size_t> files;
+  vector<const char*> names;
+  /// What removing each gave: 0 or an errno.
+  vector<int> errors;
+};
+
+void Cleaner::RemoveTask::Run() {
+  errors.resize(names.size());
+  int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+  int open_error = errno;
+  for (size_t i = 0; i < names.size(); ++i) {
+    if (fd < 0) {
+      errors[i] = open_error;
+    } else if (unlinkat(fd, names[i], 0) < 0) {
+      // Like remove(), take directories too.
+      errors[i] = errno;
+      if (errno == EISDIR || errno == EPERM) {
+        if (unlinkat(fd, names[i], AT_REMOVEDIR) == 0)
+          errors[i] = 0;
+        else if (errno != ENOTDIR)
+          errors[i] = errno;
+      }
+    } else {
+      errors[i] = 0;
+    }
+  }
+  if (fd >= 0)
+    close(fd);
+}
+#endif
+
 Cleaner::Cleaner(State* state, const BuildConfig& config)
   : state_(state),
     config_(config),
-    removed_(),
     cleaned_files_count_(0),
     disk_interface_(new RealDiskInterface),
-    status_(0) {
+    status_(0),
+#ifdef _WIN32
+    parallel_(false) {
+#else
+    parallel_(true) {
+#endif
 }
 
 Cleaner::Cleaner(State* state,
@@ -39,10 +98,10 @@ Cleaner::Cleaner(State* state,
                  DiskInterface* disk_interface)
   : state_(state),
     config_(config),
-    removed_(),
     cleaned_files_count_(0),
     disk_interface_(disk_interface),
-    status_(0) {
+    status_(0),
+    parallel_(false) {
 }
 
 int Cleaner::RemoveFile(const string& path) {
@@ -59,25 +118,93 @@ void Cleaner::Report(const string& path) {
     printf("Remove %s\n", path.c_str());
 }
 
+void Cleaner::Remove(Node* node) {
+  size_t id = node->id();
+  if (id >= removed_nodes_.size())
+    removed_nodes_.resize(id + 1);
+  if (removed_nodes_[id])
+    return;
+  removed_nodes_[id] = true;
+  DoRemove(node->path());
+}
+
 void Cleaner::Remove(const string& path) {
-  if (!IsAlreadyRemoved(path)) {
-    removed_.insert(path);
-    if (config_.dry_run) {
-      if (FileExists(path))
-        Report(path);
-    } else {
-      int ret = RemoveFile(path);
-      if (ret == 0)
-        Report(path);
-      else if (ret == -1)
-        status_ = 1;
-    }
+  // Depfiles and response files are sometimes in the graph too.
+  if (Node* node = state_->LookupNode(path))
+    Remove(node);
+  else if (removed_paths_.insert(path).second)
+    DoRemove(path);
+}
+
+void Cleaner::DoRemove(const string& path) {
+  if (config_.dry_run) {
+    if (FileExists(path))
+      Report(path);
+  } else if (parallel_ && config_.parallelism > 1) {
+    pending_.push_back(path);
+  } else {
+    int ret = RemoveFile(path);
+    if (ret == 0)
+      Report(path);
+    else if (ret == -1)
+      status_ = 1;
   }
 }
 
-bool Cleaner::IsAlreadyRemoved(const string& path) {
-  set<string>::iterator i = removed_.find(path);
-  return (i != removed_.end());
+void Cleaner::FinishRemovals() {
+#ifndef _WIN32
+  if (pending_.empty())
+    return;
+
+  map<string, RemoveTask*> filling;
+  vector<RemoveTask*> tasks;
+  for (size_t i = 0; i < pending_.size(); ++i) {
+    const string& path = pending_[i];
+    size_t slash = path.rfind('/');
+    string dir = ".";
+    if (slash != string::npos)
+      dir = path.substr(0, max(slash, (size_t)1));
+    RemoveTask*& task = filling[dir];
+    if (!task || task->files.size() == kFilesPerTask) {
+      task = new RemoveTask;
+      task->dir = dir;
+      tasks.push_back(task);
+    }
+    task->files.push_back(i);
+    task->names.push_back(path.c_str() +
+                          (slash == string::npos ? 0 : slash + 1));
+  }
+
+  {
+    ThreadPool pool(min(config_.parallelism, (int)tasks.size()));
+    for (vector<RemoveTask*>::iterator i = tasks.begin(); i != tasks.end();
+         ++i) {
+      pool.Post(*i);
+    }
+    for (vector<RemoveTask*>::iterator i = tasks.begin(); i != tasks.end();
+         ++i) {
+      pool.Wait(*i);
+    }
+  }
+
+  // Report in the order the files were found, as when removing serially.
+  vector<int> errors(pending_.size());
+  for (vector<RemoveTask*>::iterator i = tasks.begin(); i != tasks.end();
+       ++i) {
+    for (size_t j = 0; j < (*i)->files.size(); ++j)
+      errors[(*i)->files[j]] = (*i)->errors[j];
+    delete *i;
+  }
+  for (size_t i = 0; i < pending_.size(); ++i) {
+    if (errors[i] == 0) {
+      Report(pending_[i]);
+    } else if (errors[i] != ENOENT) {
+      Error("remove(%s): %s", pending_[i].c_str(), strerror(errors[i]));
+      status_ = 1;
+    }
+  }
+  pending_.clear();
+#endif
 }
 
 void Cleaner::PrintHeader() {
@@ -109,7 +236,7 @@ int Cleaner::CleanAll(bool generator) {
       continue;
     for (vector<Node*>::iterator out_node = (*e)->outputs_.begin();
          out_node != (*e)->outputs_.end(); ++out_node) {
-      Remove((*out_node)->path());
+      Remove(*out_node);
     }
     // Remove the depfile
     if (!(*e)->rule().depfile().empty())
@@ -118,6 +245,7 @@ int Cleaner::CleanAll(bool generator) {
     if ((*e)->HasRspFile()) 
       Remove((*e)->GetRspFile());      
   }
+  FinishRemovals();
   PrintFooter();
   return status_;
 }
@@ -126,13 +254,13 @@ void Cleaner::DoCleanTarget(Node* target) {
   if (Edge* e = target->in_edge()) {
     // Do not try to remove phony targets
     if (!e->is_phony()) {
-      Remove(target->path());
+      Remove(target);
       if (!target->in_edge()->rule().depfile().empty())
         Remove(target->in_edge()->EvaluateDepFile());
       if (e->HasRspFile())
         Remove(e->GetRspFile());
     }
-    for (vector<Node*>::iterator n = e->inputs_.begin(); n != e->inputs_.end();
+    for (EdgeInputs::iterator n = e->inputs_.begin(); n != e->inputs_.end();
          ++n) {
       DoCleanTarget(*n);
     }
@@ -145,6 +273,7 @@ int Cleaner::CleanTarget(Node* target) {
   Reset();
   PrintHeader();
   DoCleanTarget(target);
+  FinishRemovals();
   PrintFooter();
   return status_;
 }
@@ -178,6 +307,7 @@ int Cleaner::CleanTargets(int target_count, char* targets[]) {
       status_ = 1;
     }
   }
+  FinishRemovals();
   PrintFooter();
   return status_;
 }
@@ -190,7 +320,7 @@ void Cleaner::DoCleanRule(const Rule* rule) {
     if ((*e)->rule().name() == rule->name()) {
       for (vector<Node*>::iterator out_node = (*e)->outputs_.begin();
            out_node != (*e)->outputs_.end(); ++out_node) {
-        Remove((*out_node)->path());
+        Remove(*out_node);
         if (!(*e)->rule().depfile().empty())
           Remove((*e)->EvaluateDepFile());
         if ((*e)->HasRspFile()) 
@@ -206,6 +336,7 @@ int Cleaner::CleanRule(const Rule* rule) {
   Reset();
   PrintHeader();
   DoCleanRule(rule);
+  FinishRemovals();
   PrintFooter();
   return status_;
 }
@@ -241,6 +372,23 @@ int Cleaner::CleanRules(int rule_count, char* rules[]) {
       status_ = 1;
     }
   }
+  FinishRemovals();
+  PrintFooter();
+  return status_;
+}
+
+int Cleaner::CleanDead(const vector<BuildLog::LogEntry>& entries) {
+  Reset();
+  PrintHeader();
+  for (vector<BuildLog::LogEntry>::const_iterator i = entries.begin();
+       i != entries.end(); ++i) {
+    // A file that is now an input, say one generated before and checked
+    // in since, isn't touched.
+    Node* node = state_->LookupNode(i->output);
+    if (!node || (!node->in_edge() && node->out_edges().empty()))
+      Remove(i->output);
+  }
+  FinishRemovals();
   PrintFooter();
   return status_;
 }
@@ -248,5 +396,6 @@ int Cleaner::CleanRules(int rule_count, char* rules[]) {
 void Cleaner::Reset() {
   status_ = 0;
   cleaned_files_count_ = 0;
-  removed_.clear();
+  removed_nodes_.clear();
+  removed_paths_.clear();
 }
@@ -17,8 +17,10 @@
 
 #include <set>
 #include <string>
+#include <vector>
 
 #include "build.h"
+#include "build_log.h"
 
 using namespace std;
 
@@ -29,7 +31,9 @@ struct DiskInterface;
 
 class Cleaner {
  public:
-  /// Build a cleaner object with a real disk interface.
+  /// Build a cleaner object with a real disk interface.  Unless on
+  /// Windows, files are then removed by up to config.parallelism threads,
+  /// a directory at a time.
   Cleaner(State* state, const BuildConfig& config);
 
   /// Build a cleaner object with the given @a disk_interface
@@ -62,6 +66,11 @@ class Cleaner {
   /// Clean the file produced by the given @a rules.
   /// @return non-zero if an error occurs.
   int CleanRules(int rule_count, char* rules[]);
+  /// Clean the files of the given build log @a entries that are no longer
+  /// built: those not in the graph, or in it only as left-overs of the
+  /// deps log, neither built nor used by any edge.
+  /// @return non-zero if an error occurs.
+  int CleanDead(const vector<BuildLog::LogEntry>& entries);
 
   /// @return the number of file cleaned.
   int cleaned_files_count() const {
@@ -81,10 +90,14 @@ class Cleaner {
   /// @returns whether the file @a path exists.
   bool FileExists(const string& path);
   void Report(const string& path);
+  /// Remove the file of @a node only if it has not been already removed.
+  void Remove(Node* node);
   /// Remove the given @a path file only if it has not been already removed.
   void Remove(const string& path);
-  /// @return whether the given @a path has already been removed.
-  bool IsAlreadyRemoved(const string& path);
+  /// Remove @a path, which has not been removed yet.
+  void DoRemove(const string& path);
+  /// Remove the files queued by DoRemove() in parallel, and report them.
+  void FinishRemovals();
   /// Helper recursive method for CleanTarget().
   void DoCleanTarget(Node* target);
   void PrintHeader();
@@ -92,12 +105,21 @@ class Cleaner {
   void DoCleanRule(const Rule* rule);
   void Reset();
 
+  struct RemoveTask;
+
   State* state_;
   const BuildConfig& config_;
-  set<string> removed_;
+  /// What has been removed: files in the graph by Node::id(), others
+  /// (depfiles and response files) by path.
+  vector<bool> removed_nodes_;
+  set<string> removed_paths_;
   int cleaned_files_count_;
   DiskInterface* disk_interface_;
   int status_;
+  /// Whether files are removed by FinishRemovals() rather than right away.
+  bool parallel_;
+  /// The files waiting for FinishRemovals().
+  vector<string> pending_;
 };
 
 #endif  // NINJA_CLEAN_H_
@@ -14,6 +14,7 @@
 
 #include "clean.h"
 #include "build.h"
+#include "disk_interface.h"
 
 #include "test.h"
 
@@ -372,3 +373,60 @@ TEST_F(CleanTest, CleanPhony) {
   EXPECT_EQ(2, cleaner.cleaned_files_count());
   EXPECT_NE(0, fs_.Stat("phony"));
 }
+
+TEST_F(CleanTest, CleanDead) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"build out1: cat src1\n"
+"build out2: cat gen\n"));
+  // As left in the graph by the deps log.
+  state_.GetNode("orphan");
+  const char* outputs[] = { "out1", "gone", "gen", "orphan" };
+  vector<BuildLog::LogEntry> entries;
+  for (size_t i = 0; i < sizeof(outputs) / sizeof(outputs[0]); ++i) {
+    fs_.Create(outputs[i], 1, "");
+    entries.push_back(BuildLog::LogEntry());
+    entries.back().output = outputs[i];
+  }
+
+  Cleaner cleaner(&state_, config_, &fs_);
+  EXPECT_EQ(0, cleaner.CleanDead(entries));
+  EXPECT_EQ(2, cleaner.cleaned_files_count());
+  EXPECT_EQ(0, fs_.Stat("gone"));
+  EXPECT_EQ(0, fs_.Stat("orphan"));
+  // Still built, or now a source.
+  EXPECT_NE(0, fs_.Stat("out1"));
+  EXPECT_NE(0, fs_.Stat("gen"));
+}
+
+#ifndef _WIN32
+TEST_F(CleanTest, CleanAllParallel) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"rule cc\n"
+"  command = cc $in > $out\n"
+"  depfile = $out.d\n"
+"build a/x.o: cc x.c\n"
+"build a/y.o: cc y.c\n"
+"build b/z.o: cc z.c\n"
+"build top: cat a/x.o b/z.o\n"
+"build missing: cat\n"));
+  ScopedTempDir temp_dir;
+  temp_dir.CreateAndEnter("ninja_clean_test");
+  RealDiskInterface disk;
+  disk.MakeDir("a");
+  disk.MakeDir("b");
+  const char* files[] = { "a/x.o", "a/x.o.d", "a/y.o", "b/z.o", "top" };
+  for (size_t i = 0; i < sizeof(files) / sizeof(files[0]); ++i)
+    ASSERT_TRUE(disk.WriteFile(files[i], ""));
+
+  config_.parallelism = 4;
+  Cleaner cleaner(&state_, config_);
+  EXPECT_EQ(0, cleaner.CleanAll());
+  EXPECT_EQ(5, cleaner.cleaned_files_count());
+  for (size_t i = 0; i < sizeof(files) / sizeof(files[0]); ++i)
+    EXPECT_EQ(0, disk.Stat(files[i])) << files[i];
+
+  EXPECT_EQ(0, cleaner.CleanAll());
+  EXPECT_EQ(0, cleaner.cleaned_files_count());
+  temp_dir.Cleanup();
+}
+#endif
@@ -0,0 +1,92 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <stdio.h>
+
+#include "clparser.h"
+#include "metrics.h"
+#include "util.h"
+
+// Includes of the kinds a compile lists: the project's own, relative and
+// absolute, and system headers.
+const char* kIncludes[] = {
+  "..\\..\\base\\memory\\scoped_ptr.h",
+  "..\\..\\base\\basictypes.h",
+  "..\\..\\base\\compiler_specific.h",
+  "..\\..\\base\\logging.h",
+  "..\\..\\base\\..\\build\\build_config.h",
+  "..\\..\\content\\browser\\renderer_host\\render_widget_host_impl.h",
+  "..\\..\\content\\public\\browser\\render_widget_host.h",
+  "..\\..\\third_party\\skia\\include\\core\\..\\config\\SkUserConfig.h",
+  "..\\..\\ui\\gfx\\.\\rect.h",
+  "gen\\protoc_out\\chrome\\browser\\sync\\protocol\\sync.pb.h",
+  "c:\\src\\chrome\\src\\ui\\gfx\\size.h",
+  "C:\\Program Files (x86)\\Microsoft Visual Studio 10.0\\VC\\INCLUDE\\"
+      "string",
+  "C:\\Program Files (x86)\\Microsoft Visual Studio 10.0\\VC\\INCLUDE\\"
+      "xstring",
+  "C:\\Program Files (x86)\\Microsoft SDKs\\Windows\\v7.0A\\include\\"
+      "windows.h",
+};
+const int kNumIncludes = sizeof(kIncludes) / sizeof(kIncludes[0]);
+
+int main(int argc, char* argv[]) {
+  // The output of one compile, recorded from cl.exe /showIncludes, or
+  // made up of kIncludes.
+  string output;
+  if (argc > 1) {
+    string err;
+    if (ReadFile(argv[1], &output, &err) < 0) {
+      fprintf(stderr, "%s: %s\n", argv[1], err.c_str());
+      return 1;
+    }
+  } else {
+    output = "foo.cc\r\n";
+    for (int copy = 0; copy < 100; ++copy) {
+      for (int i = 0; i < kNumIncludes; ++i) {
+        output += "Note: including file: ";
+        output.append(copy % 4, ' ');
+        output += kIncludes[i];
+        output += "\r\n";
+      }
+    }
+  }
+  int lines = 0;
+  for (size_t i = 0; i < output.size(); ++i)
+    lines += output[i] == '\n';
+
+  // The first compile normalizes every path; the ones after it find most
+  // in IncludesNormalize's cache, as the compiles of a build do.
+  const int kCompiles = 100;
+  int64_t first = 0, rest = 0;
+  size_t includes = 0;
+  for (int compile = 0; compile < kCompiles; ++compile) {
+    CLParser parser;
+    string filtered;
+    int64_t start = GetTimeMillis();
+    parser.Parse(output, &filtered);
+    int64_t delta = GetTimeMillis() - start;
+    if (compile == 0)
+      first = delta;
+    else
+      rest += delta;
+    includes = parser.includes_.size();
+  }
+
+  printf("%d lines, %d distinct includes, ms per compile:\n",
+         lines, (int)includes);
+  printf("first  %d\n", (int)first);
+  printf("others %.2f\n", (double)rest / (kCompiles - 1));
+  return 0;
+}
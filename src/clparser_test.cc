@@ -0,0 +1,57 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "clparser.h"
+
+#include "test.h"
+
+TEST(CLParserTest, ShowIncludes) {
+  ASSERT_EQ("", CLParser::FilterShowIncludes(""));
+
+  ASSERT_EQ("", CLParser::FilterShowIncludes("Sample compiler output"));
+  ASSERT_EQ("c:\\Some Files\\foobar.h",
+            CLParser::FilterShowIncludes("Note: including file: "
+                                         "c:\\Some Files\\foobar.h"));
+  ASSERT_EQ("c:\\initspaces.h",
+            CLParser::FilterShowIncludes("Note: including file:    "
+                                         "c:\\initspaces.h"));
+}
+
+TEST(CLParserTest, FilterInputFilename) {
+  ASSERT_TRUE(CLParser::FilterInputFilename("foobar.cc"));
+  ASSERT_TRUE(CLParser::FilterInputFilename("foo bar.cc"));
+  ASSERT_TRUE(CLParser::FilterInputFilename("baz.c"));
+
+  ASSERT_FALSE(CLParser::FilterInputFilename(
+                   "src\\cl_helper.cc(166) : fatal error C1075: end "
+                   "of file found ..."));
+}
+
+TEST(CLParserTest, Parse) {
+  CLParser parser;
+  string output;
+  parser.Parse("foo.cc\r\n"
+               "Note: including file:  foo.h\r\n"
+               "Note: including file: C:\\Program Files\\VC\\stdio.h\r\n"
+               "foo.cc(3): warning C4101: 'x': unreferenced local variable\r\n"
+               "Note: including file:   foo.h\r\n"
+               "Note: including file: bar.h\r\n",
+               &output);
+  EXPECT_EQ("foo.cc(3): warning C4101: 'x': unreferenced local variable\n",
+            output);
+  // System headers are left out, and each file is kept once.
+  ASSERT_EQ(2u, parser.includes_.size());
+  EXPECT_EQ("bar.h", *parser.includes_.begin());
+  EXPECT_EQ("foo.h", *parser.includes_.rbegin());
+}
@@ -0,0 +1,135 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "critical_path.h"
+
+#include <algorithm>
+
+#include "build_log.h"
+#include "graph.h"
+
+void CriticalPath::Compute(const vector<Node*>& targets,
+                           BuildLog* build_log) {
+  durations_.clear();
+  edges.clear();
+  guessed = 0;
+
+  // Find the edges the targets depend on, with how long each command
+  // took last time; -2 stands for unknown until the average is.
+  vector<Edge*> stack;
+  for (vector<Node*>::const_iterator i = targets.begin();
+       i != targets.end(); ++i) {
+    if ((*i)->in_edge())
+      stack.push_back((*i)->in_edge());
+  }
+  int64_t known_total = 0;
+  int known_count = 0;
+  int64_t logged_start = 0, logged_end = 0;
+  while (!stack.empty()) {
+    Edge* edge = stack.back();
+    stack.pop_back();
+    size_t id = edge->id();
+    if (id >= durations_.size())
+      durations_.resize(id + 1, -1);
+    if (durations_[id] != -1)
+      continue;
+    for (EdgeInputs::iterator i = edge->inputs_.begin();
+         i != edge->inputs_.end(); ++i) {
+      if ((*i)->in_edge())
+        stack.push_back((*i)->in_edge());
+    }
+
+    if (edge->is_phony()) {
+      durations_[id] = 0;
+      continue;
+    }
+    edges.push_back(edge);
+    int64_t duration = build_log ? build_log->LastDuration(edge) : -1;
+    if (duration < 0) {
+      durations_[id] = -2;
+      ++guessed;
+      continue;
+    }
+    durations_[id] = duration;
+    known_total += duration;
+    ++known_count;
+    BuildLog::LogEntry* entry =
+        build_log->LookupByOutput(edge->outputs_[0]);
+    if (known_count == 1 || entry->start_time < logged_start)
+      logged_start = entry->start_time;
+    if (known_count == 1 || entry->end_time > logged_end)
+      logged_end = entry->end_time;
+  }
+  logged_work = known_total;
+  logged_span = logged_end - logged_start;
+
+  // As in Plan::ComputeCriticalPath().
+  int64_t fallback = known_count ? known_total / known_count : 1;
+  total_work = 0;
+  for (vector<Edge*>::iterator i = edges.begin(); i != edges.end(); ++i) {
+    int64_t& duration = durations_[(*i)->id()];
+    if (duration == -2)
+      duration = fallback;
+    total_work += duration;
+  }
+
+  finish_.assign(durations_.size(), -2);
+  prev_.assign(durations_.size(), NULL);
+  Edge* last = NULL;
+  length = 0;
+  for (vector<Node*>::const_iterator i = targets.begin();
+       i != targets.end(); ++i) {
+    Edge* edge = (*i)->in_edge();
+    if (edge && (!last || Finish(edge) > length)) {
+      last = edge;
+      length = Finish(edge);
+    }
+  }
+
+  path.clear();
+  for (Edge* edge = last; edge; edge = prev_[edge->id()]) {
+    if (!edge->is_phony())
+      path.push_back(edge);
+  }
+  reverse(path.begin(), path.end());
+}
+
+int64_t CriticalPath::Duration(const Edge* edge) const {
+  return durations_[edge->id()];
+}
+
+int64_t CriticalPath::Finish(Edge* edge) {
+  int64_t& finish = finish_[edge->id()];
+  if (finish != -2)
+    return finish;
+  finish = -1;
+  int64_t longest = 0;
+  Edge* prev = NULL;
+  for (EdgeInputs::iterator i = edge->inputs_.begin();
+       i != edge->inputs_.end(); ++i) {
+    Edge* in_edge = (*i)->in_edge();
+    if (!in_edge)
+      continue;
+    int64_t in_finish = Finish(in_edge);
+    if (in_finish < 0)
+      continue;  // A cycle; the build would stop at it.
+    if (!prev || in_finish > longest) {
+      longest = in_finish;
+      prev = in_edge;
+    }
+  }
+  finish = durations_[edge->id()] + longest;
+  prev_[edge->id()] = prev;
+  return finish;
+}
@@ -0,0 +1,74 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef NINJA_CRITICAL_PATH_H_
+#define NINJA_CRITICAL_PATH_H_
+
+#include <vector>
+using namespace std;
+
+#include "util.h"  // int64_t
+
+struct BuildLog;
+struct Edge;
+struct Node;
+
+/// The longest chain of commands some targets wait on, going by how long
+/// each took when it last ran, as the build log has it: however many jobs
+/// run at once, building the targets from scratch takes at least that
+/// long.  Commands are weighed as Plan::ComputeCriticalPath() weighs them,
+/// those the log doesn't know by the average of those it does.  For
+/// "ninja -t critpath".
+struct CriticalPath {
+  CriticalPath() : length(0), total_work(0), guessed(0), logged_work(0),
+                   logged_span(0) {}
+
+  /// Find the path to \a targets.  \a build_log may be NULL.  Runs in time
+  /// linear in the size of the graph the targets depend on.
+  void Compute(const vector<Node*>& targets, BuildLog* build_log);
+
+  /// The weight of \a edge, in milliseconds.
+  int64_t Duration(const Edge* edge) const;
+
+  /// The commands on the path, in the order they run.
+  vector<Edge*> path;
+  /// The sum of their weights, in milliseconds.
+  int64_t length;
+  /// The sum of the weights of all the commands the targets depend on.
+  int64_t total_work;
+  /// Those commands.
+  vector<Edge*> edges;
+  /// How many of them the log didn't know.
+  int guessed;
+  /// Of those it knew, the time they took between them, and from when
+  /// the first started to when the last ended: as if they ran in the
+  /// last build, which is so if it built the targets from scratch.
+  int64_t logged_work;
+  int64_t logged_span;
+
+ private:
+  /// The length of the longest chain of commands ending with \a edge's,
+  /// filling in finish_ and prev_ for it; -1 if \a edge is on a cycle
+  /// being followed.
+  int64_t Finish(Edge* edge);
+
+  /// By Edge::id(): the weight of each edge seen, or -1 for none yet;
+  /// the length of the longest chain ending with it, or -1 while it is
+  /// being found and -2 before; and the edge before it on that chain.
+  vector<int64_t> durations_;
+  vector<int64_t> finish_;
+  vector<Edge*> prev_;
+};
+
+#endif  // NINJA_CRITICAL_PATH_H_
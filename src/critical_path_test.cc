@@ -0,0 +1,92 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "critical_path.h"
+
+#include "build_log.h"
+#include "graph.h"
+#include "test.h"
+
+struct CriticalPathTest : public StateTestWithBuiltinRules {
+  virtual void SetUp() {
+    ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"build a.o: cat a.c\n"
+"build b.o: cat b.c\n"
+"build gen.h: cat gen.in\n"
+"build c.o: cat c.c || gen.h\n"
+"build lib: cat a.o b.o\n"
+"build app: cat lib c.o\n"
+"build all: phony app\n"));
+  }
+
+  void Record(const char* output, int start, int end) {
+    build_log_.RecordCommand(GetNode(output)->in_edge(), start, end);
+  }
+
+  BuildLog build_log_;
+};
+
+TEST_F(CriticalPathTest, LongestChain) {
+  Record("a.o", 0, 30);
+  Record("b.o", 0, 10);
+  Record("gen.h", 0, 50);
+  Record("c.o", 50, 70);
+  Record("lib", 30, 35);
+  Record("app", 70, 80);
+
+  vector<Node*> targets(1, GetNode("all"));
+  CriticalPath critical_path;
+  critical_path.Compute(targets, &build_log_);
+
+  // gen.h, c.o and app take 80, against a.o, lib and app's 45.
+  ASSERT_EQ(3u, critical_path.path.size());
+  EXPECT_EQ("gen.h", critical_path.path[0]->outputs_[0]->path());
+  EXPECT_EQ("c.o", critical_path.path[1]->outputs_[0]->path());
+  EXPECT_EQ("app", critical_path.path[2]->outputs_[0]->path());
+  EXPECT_EQ(80, critical_path.length);
+  EXPECT_EQ(50, critical_path.Duration(critical_path.path[0]));
+  EXPECT_EQ(6u, critical_path.edges.size());
+  EXPECT_EQ(125, critical_path.total_work);
+  EXPECT_EQ(0, critical_path.guessed);
+  EXPECT_EQ(125, critical_path.logged_work);
+  EXPECT_EQ(80, critical_path.logged_span);
+
+  // Only what lib depends on.
+  targets[0] = GetNode("lib");
+  critical_path.Compute(targets, &build_log_);
+  ASSERT_EQ(2u, critical_path.path.size());
+  EXPECT_EQ("a.o", critical_path.path[0]->outputs_[0]->path());
+  EXPECT_EQ(35, critical_path.length);
+  EXPECT_EQ(45, critical_path.total_work);
+}
+
+TEST_F(CriticalPathTest, Unlogged) {
+  // Those not in the log take the average of those that are.
+  Record("a.o", 0, 100);
+  Record("b.o", 0, 20);
+
+  vector<Node*> targets(1, GetNode("app"));
+  CriticalPath critical_path;
+  critical_path.Compute(targets, &build_log_);
+  EXPECT_EQ(4, critical_path.guessed);
+  EXPECT_EQ(120 + 4 * 60, critical_path.total_work);
+  // a.o, lib and app.
+  EXPECT_EQ(220, critical_path.length);
+
+  // With no log, every command counts the same.
+  critical_path.Compute(targets, NULL);
+  EXPECT_EQ(6, critical_path.guessed);
+  EXPECT_EQ(3, critical_path.length);
+  EXPECT_EQ(0, critical_path.logged_span);
+}
@@ -15,6 +15,114 @@
 
 #include "depfile_parser.h"
 
+#include <string.h>
+
+#include "util.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define NINJA_DEPFILE_SSE2
+#elif (defined(__ARM_NEON) || defined(__ARM_NEON__)) && defined(__GNUC__)
+#include <arm_neon.h>
+#define NINJA_DEPFILE_NEON
+#endif
+
+bool DepfileParser::vector_scan_ = true;
+
+namespace {
+
+#if defined(NINJA_DEPFILE_SSE2) || defined(NINJA_DEPFILE_NEON)
+#define NINJA_DEPFILE_VECTOR
+
+/// Return a mask of the bytes in the aligned 16-byte block at \a block
+/// that aren't plain path characters, [a-zA-Z0-9+,/_:.~()@=-], as the
+/// state machine below has them: the ranges "()", "+,-./0-9:", "@A-Z"
+/// and "a-z", and "=", "_" and "~".  Each byte gets kMaskBitsPerByte
+/// bits.
+#ifdef NINJA_DEPFILE_SSE2
+const int kMaskBitsPerByte = 1;
+
+/// Bytes from 0x80 up compare as negative, so are in none of the ranges.
+inline __m128i InRange(__m128i v, char first, char last) {
+  return _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8(first - 1)),
+                       _mm_cmplt_epi8(v, _mm_set1_epi8(last + 1)));
+}
+
+NINJA_NO_SANITIZE_ADDRESS
+inline uint64_t NonPlainMask(const char* block) {
+  __m128i v = _mm_load_si128((const __m128i*)block);
+  __m128i plain = _mm_or_si128(
+      _mm_or_si128(InRange(v, '(', ')'), InRange(v, '+', ':')),
+      _mm_or_si128(InRange(v, '@', 'Z'), InRange(v, 'a', 'z')));
+  plain = _mm_or_si128(plain, _mm_or_si128(
+      _mm_cmpeq_epi8(v, _mm_set1_epi8('=')),
+      _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('_')),
+                   _mm_cmpeq_epi8(v, _mm_set1_epi8('~')))));
+  return ~(unsigned)_mm_movemask_epi8(plain) & 0xffff;
+}
+#else  // NINJA_DEPFILE_NEON
+const int kMaskBitsPerByte = 4;
+
+inline uint8x16_t InRange(uint8x16_t v, char first, char last) {
+  return vandq_u8(vcgeq_u8(v, vdupq_n_u8(first)),
+                  vcleq_u8(v, vdupq_n_u8(last)));
+}
+
+NINJA_NO_SANITIZE_ADDRESS
+inline uint64_t NonPlainMask(const char* block) {
+  uint8x16_t v = vld1q_u8((const uint8_t*)block);
+  uint8x16_t plain = vorrq_u8(
+      vorrq_u8(InRange(v, '(', ')'), InRange(v, '+', ':')),
+      vorrq_u8(InRange(v, '@', 'Z'), InRange(v, 'a', 'z')));
+  plain = vorrq_u8(plain, vorrq_u8(
+      vceqq_u8(v, vdupq_n_u8('=')),
+      vorrq_u8(vceqq_u8(v, vdupq_n_u8('_')),
+               vceqq_u8(v, vdupq_n_u8('~')))));
+  // Narrow each byte of the comparison to a nibble.
+  uint8x8_t nibbles = vshrn_n_u16(vreinterpretq_u16_u8(vmvnq_u8(plain)), 4);
+  return vget_lane_u64(vreinterpret_u64_u8(nibbles), 0);
+}
+#endif
+
+inline int CountTrailingZeros(uint64_t mask) {
+#ifdef _MSC_VER
+  unsigned long index;
+  if (_BitScanForward(&index, (unsigned long)mask))
+    return (int)index;
+  _BitScanForward(&index, (unsigned long)(mask >> 32));
+  return (int)index + 32;
+#else
+  return __builtin_ctzll(mask);
+#endif
+}
+
+/// Return the first byte at or after \a p that isn't a plain path
+/// character.  Only whole aligned blocks are loaded; they may extend
+/// past the NUL that terminates the input but never past the page
+/// holding it.
+NINJA_NO_SANITIZE_ADDRESS
+char* ScanPlain(char* p) {
+  size_t offset = (uintptr_t)p & 15;
+  const char* block = p - offset;
+  uint64_t mask = NonPlainMask(block);
+  mask &= ~(uint64_t)0 << (offset * kMaskBitsPerByte);
+  while (!mask) {
+    block += 16;
+    mask = NonPlainMask(block);
+  }
+  return (char*)block + CountTrailingZeros(mask) / kMaskBitsPerByte;
+}
+
+#endif  // NINJA_DEPFILE_SSE2 || NINJA_DEPFILE_NEON
+
+}  // anonymous namespace
+
+// static
+void DepfileParser::SetVectorScan(bool enabled) {
+  vector_scan_ = enabled;
+}
+
 // A note on backslashes in Makefiles, from reading the docs:
 // Backslash-newline is the line continuation character.
 // Backslash-# escapes a # (otherwise meaningful as a comment start).
@@ -45,6 +153,31 @@ bool DepfileParser::Parse(string* content, string* err) {
     for (;;) {
       // start: beginning of the current parsed span.
       const char* start = in;
+#ifdef NINJA_DEPFILE_VECTOR
+      // Take the separators before a filename, a span of plain text a
+      // block at a time and what ends it as the state machine below
+      // would, leaving it only backslash escapes.
+      if (vector_scan_) {
+        if (out == filename) {
+          // Each would end an empty filename, which is skipped.
+          while (*in == ' ' || *in == '\n' || *in == '\r' || *in == '\t' ||
+                 (*in == '\\' && in[1] == '\n'))
+            in += *in == '\\' ? 2 : 1;
+          start = out = filename = in;
+        }
+        in = ScanPlain(in);
+        int len = (int)(in - start);
+        if (out < start)
+          memmove(out, start, len);
+        out += len;
+        if (*in != '\\' || in[1] == '\n') {
+          // Anything else ends the filename, a line continuation too.
+          in += *in == '\\' ? 2 : 1;
+          break;
+        }
+        start = in;
+      }
+#endif
       
     {
       char yych;
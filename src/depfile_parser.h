@@ -28,8 +28,17 @@ struct DepfileParser {
   /// pointers within it.
   bool Parse(string* content, string* err);
 
+  /// Choose whether to skip runs of plain path characters with SIMD
+  /// instructions where the platform has them (the default), or to go
+  /// through every byte in the state machine.  Used to compare the two
+  /// in benchmarks.
+  static void SetVectorScan(bool enabled);
+
   StringPiece out_;
   vector<StringPiece> ins_;
+
+ private:
+  static bool vector_scan_;
 };
 
 #endif // NINJA_DEPFILE_PARSER_H_
@@ -135,3 +135,31 @@ TEST_F(DepfileParserTest, RejectMultipleDifferentOutputs) {
   string err;
   EXPECT_FALSE(Parse("foo bar: x y z", &err));
 }
+
+TEST_F(DepfileParserTest, VectorScan) {
+  // Parse the same depfile with and without the vectorized scanning,
+  // with escapes, odd characters and the end at each offset in a block.
+  const char* kDepfile =
+      "out/obj/some/long/path/to/an/object.o: ../../src/a\\ b.cc \\\n"
+      "  /usr/include/c++/12/bits/stl_algobase.h foo\\#bar.h \\\n"
+      "  C:\\Windows\\ Kits/10/Include/um/windows.h\tx\\$y.h\r\n"
+      "  dir/\xc3\xa9t\xc3\xa9.h \\\\z.h \\\n";
+  for (int offset = 0; offset < 32; ++offset) {
+    string prefix(offset, 'p');
+    string input = prefix + kDepfile + prefix + "\\";
+    string results[2];
+    for (int vector = 0; vector < 2; ++vector) {
+      DepfileParser::SetVectorScan(vector != 0);
+      DepfileParser parser;
+      string content = input;
+      string err;
+      EXPECT_TRUE(parser.Parse(&content, &err));
+      ASSERT_EQ("", err);
+      results[vector] = parser.out_.AsString();
+      for (size_t i = 0; i < parser.ins_.size(); ++i)
+        results[vector] += "|" + parser.ins_[i].AsString();
+    }
+    EXPECT_EQ(results[0], results[1]);
+  }
+  DepfileParser::SetVectorScan(true);
+}
@@ -0,0 +1,472 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "deps_log.h"
+
+#include <errno.h>
+#include <string.h>
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+#include "graph.h"
+#include "metrics.h"
+#include "state.h"
+#include "util.h"
+
+// Implementation details:
+// The file is in host byte order; it is never shared between machines.
+// After the signature and a uint32 version come records, each a uint32
+// header holding the size of the rest of the record, with the high bit
+// set for deps records and the next one for digest records:
+// - a path record is the path, padded with NULs to a multiple of 4
+//   bytes, and the complement of the id it gets, which is the number of
+//   path records before it.  The checksum catches a record cut short.
+// - a deps record is the output's id, its mtime as two uint32s (low
+//   half first), then the ids of its deps.
+// - a digest record is a file's id, its mtime and the digest of its
+//   contents, each as two uint32s.
+// Version 1 was the same without digest records.
+
+namespace {
+
+const char kFileSignature[] = "# ninjadeps\n";
+const uint32_t kCurrentVersion = 2;
+const uint32_t kDepsRecord = 0x80000000;
+const uint32_t kDigestRecord = 0x40000000;
+const uint32_t kDigestRecordSize = 20;
+
+/// Records are small; anything larger is damage.
+const uint32_t kMaxRecordSize = (1 << 19) - 1;
+
+/// When to recompact on load: once the log holds this many deps records,
+/// and this many times as many as there are outputs.
+const int kMinCompactionEntryCount = 1000;
+const int kCompactionRatio = 3;
+
+}  // anonymous namespace
+
+DepsLog::DepsLog() : needs_recompaction_(false), file_(NULL) {}
+
+DepsLog::~DepsLog() {
+  Close();
+  for (vector<Deps*>::iterator i = deps_.begin(); i != deps_.end(); ++i)
+    delete *i;
+}
+
+bool DepsLog::OpenForWrite(const string& path, string* err) {
+  if (needs_recompaction_) {
+    if (!Recompact(path, err))
+      return false;
+  }
+
+  file_ = fopen(path.c_str(), "ab");
+  if (!file_) {
+    *err = strerror(errno);
+    return false;
+  }
+  SetCloseOnExec(fileno(file_));
+
+  // Opening a file in append mode doesn't set the file pointer to the file's
+  // end on Windows. Do that explicitly.
+  fseek(file_, 0, SEEK_END);
+
+  if (ftell(file_) == 0) {
+    if (fwrite(kFileSignature, sizeof(kFileSignature) - 1, 1, file_) < 1 ||
+        fwrite(&kCurrentVersion, sizeof(kCurrentVersion), 1, file_) < 1 ||
+        fflush(file_) != 0) {
+      *err = strerror(errno);
+      return false;
+    }
+  }
+
+  return true;
+}
+
+bool DepsLog::RecordDeps(Node* node, TimeStamp mtime,
+                         const vector<Node*>& nodes) {
+  return RecordDeps(node, mtime, (int)nodes.size(),
+                    nodes.empty() ? NULL : (Node**)&nodes.front());
+}
+
+bool DepsLog::RecordDeps(Node* node, TimeStamp mtime, int node_count,
+                         Node** nodes) {
+  // Track whether there's any new data to be recorded.
+  bool made_change = false;
+
+  // Assign ids to all nodes that are missing one.
+  if (GetId(node) < 0) {
+    if (!RecordId(node))
+      return false;
+    made_change = true;
+  }
+  for (int i = 0; i < node_count; ++i) {
+    if (GetId(nodes[i]) < 0) {
+      if (!RecordId(nodes[i]))
+        return false;
+      made_change = true;
+    }
+  }
+
+  // See if the new data is different than the existing data, if any.
+  if (!made_change) {
+    Deps* deps = GetDeps(node);
+    if (!deps || deps->mtime != mtime || deps->node_count != node_count) {
+      made_change = true;
+    } else {
+      for (int i = 0; i < node_count; ++i) {
+        if (deps->nodes[i] != nodes[i]) {
+          made_change = true;
+          break;
+        }
+      }
+    }
+  }
+
+  // Don't write anything if there's no new info.
+  if (!made_change)
+    return true;
+
+  // Update on-disk representation.
+  if (file_) {
+    uint32_t size = 4 * (3 + node_count);
+    if (size > kMaxRecordSize) {
+      errno = ERANGE;
+      return false;
+    }
+    vector<uint32_t> record;
+    record.reserve(4 + node_count);
+    record.push_back(size | kDepsRecord);
+    record.push_back(GetId(node));
+    record.push_back((uint32_t)mtime);
+    record.push_back((uint32_t)((uint64_t)mtime >> 32));
+    for (int i = 0; i < node_count; ++i)
+      record.push_back(GetId(nodes[i]));
+    if (fwrite(&record[0], sizeof(uint32_t), record.size(), file_) <
+        record.size() || fflush(file_) != 0) {
+      return false;
+    }
+  }
+
+  // Update in-memory representation.
+  Deps* deps = new Deps(mtime, node_count);
+  for (int i = 0; i < node_count; ++i)
+    deps->nodes[i] = nodes[i];
+  UpdateDeps(GetId(node), deps);
+
+  return true;
+}
+
+bool DepsLog::RecordDigest(Node* node, TimeStamp mtime, uint64_t digest) {
+  if (GetId(node) < 0 && !RecordId(node))
+    return false;
+  int id = GetId(node);
+  if (id < (int)digests_.size() && digests_[id].mtime == mtime &&
+      digests_[id].digest == digest) {
+    return true;
+  }
+
+  if (file_) {
+    uint32_t record[6] = {
+      kDigestRecordSize | kDigestRecord, (uint32_t)id,
+      (uint32_t)mtime, (uint32_t)((uint64_t)mtime >> 32),
+      (uint32_t)digest, (uint32_t)(digest >> 32)
+    };
+    if (fwrite(record, sizeof(record), 1, file_) < 1 || fflush(file_) != 0)
+      return false;
+  }
+
+  if (id >= (int)digests_.size())
+    digests_.resize(id + 1);
+  digests_[id].mtime = mtime;
+  digests_[id].digest = digest;
+  return true;
+}
+
+void DepsLog::Close() {
+  if (file_)
+    fclose(file_);
+  file_ = NULL;
+}
+
+bool DepsLog::IsOpenAt(const string& path) const {
+  return file_ && IsSameFile(fileno(file_), path);
+}
+
+bool DepsLog::Load(const string& path, State* state, string* err) {
+  METRIC_RECORD(".ninja_deps load");
+  FILE* f = fopen(path.c_str(), "rb");
+  if (!f) {
+    if (errno == ENOENT)
+      return true;
+    *err = strerror(errno);
+    return false;
+  }
+  string data;
+  char buf[64 << 10];
+  size_t len;
+  while ((len = fread(buf, 1, sizeof(buf), f)) > 0)
+    data.append(buf, len);
+  bool read_failed = ferror(f) != 0;
+  fclose(f);
+  if (read_failed) {
+    *err = strerror(errno);
+    return false;
+  }
+
+  const size_t kHeaderSize = sizeof(kFileSignature) - 1 + sizeof(uint32_t);
+  uint32_t version = 0;
+  if (data.size() >= kHeaderSize &&
+      memcmp(data.data(), kFileSignature, sizeof(kFileSignature) - 1) == 0) {
+    memcpy(&version, data.data() + sizeof(kFileSignature) - 1,
+           sizeof(version));
+  }
+  if (version != kCurrentVersion && version != 1) {
+    *err = "deps log version invalid, perhaps due to being too old; "
+           "starting over";
+    unlink(path.c_str());
+    // Don't report this as a failure.  An empty deps log will cause
+    // us to rebuild the outputs anyway.
+    return true;
+  }
+
+  int unique_record_count = 0;
+  int total_record_count = 0;
+  const char* p = data.data() + kHeaderSize;
+  const char* end = data.data() + data.size();
+  bool damaged = false;
+  while (p < end) {
+    uint32_t header;
+    if (end - p < (ptrdiff_t)sizeof(header)) {
+      damaged = true;
+      break;
+    }
+    memcpy(&header, p, sizeof(header));
+    uint32_t size = header & ~(kDepsRecord | kDigestRecord);
+    const char* record = p + sizeof(header);
+    if (size > kMaxRecordSize || size % 4 != 0 || (size_t)(end - record) < size) {
+      damaged = true;
+      break;
+    }
+    p = record + size;
+
+    if (header & kDigestRecord) {
+      uint32_t fields[kDigestRecordSize / 4];
+      if (size != kDigestRecordSize || (header & kDepsRecord)) {
+        damaged = true;
+        break;
+      }
+      memcpy(fields, record, size);
+      if (fields[0] >= nodes_.size()) {
+        damaged = true;
+        break;
+      }
+      uint32_t id = fields[0];
+      if (id >= digests_.size())
+        digests_.resize(id + 1);
+      if (digests_[id].mtime == -1)
+        ++unique_record_count;
+      ++total_record_count;
+      digests_[id].mtime = (TimeStamp)(((uint64_t)fields[2] << 32) | fields[1]);
+      digests_[id].digest = ((uint64_t)fields[4] << 32) | fields[3];
+    } else if (header & kDepsRecord) {
+      if (size < 12) {
+        damaged = true;
+        break;
+      }
+      vector<uint32_t> ids(size / 4);
+      memcpy(&ids[0], record, size);
+      bool valid = true;
+      for (size_t i = 0; i < ids.size(); ++i) {
+        // Skip the mtime.
+        if (i == 1 || i == 2)
+          continue;
+        if (ids[i] >= nodes_.size()) {
+          valid = false;
+          break;
+        }
+      }
+      if (!valid) {
+        damaged = true;
+        break;
+      }
+      TimeStamp mtime = (TimeStamp)(((uint64_t)ids[2] << 32) | ids[1]);
+      int deps_count = (int)ids.size() - 3;
+      Deps* deps = new Deps(mtime, deps_count);
+      for (int i = 0; i < deps_count; ++i)
+        deps->nodes[i] = nodes_[ids[3 + i]];
+
+      int out_id = ids[0];
+      if (out_id >= (int)deps_.size() || !deps_[out_id])
+        ++unique_record_count;
+      UpdateDeps(out_id, deps);
+      ++total_record_count;
+    } else {
+      if (size < 4) {
+        damaged = true;
+        break;
+      }
+      uint32_t checksum;
+      memcpy(&checksum, record + size - 4, sizeof(checksum));
+      if (checksum != ~(uint32_t)nodes_.size()) {
+        damaged = true;
+        break;
+      }
+      // Strip the padding.
+      size_t path_size = size - 4;
+      while (path_size > 0 && record[path_size - 1] == '\0')
+        --path_size;
+      Node* node = state->GetNode(StringPiece(record, path_size));
+      if (GetId(node) >= 0) {
+        damaged = true;
+        break;
+      }
+      if ((size_t)node->id() >= ids_.size())
+        ids_.resize(node->id() + 1, -1);
+      ids_[node->id()] = (int)nodes_.size();
+      nodes_.push_back(node);
+    }
+  }
+
+  if (damaged) {
+    // Keep what came before the damage, e.g. a record half written when
+    // a build was interrupted; the rest goes when the log is rewritten
+    // on the next open.
+    needs_recompaction_ = true;
+  } else if (total_record_count > kMinCompactionEntryCount &&
+             total_record_count > unique_record_count * kCompactionRatio) {
+    needs_recompaction_ = true;
+  } else if (version != kCurrentVersion) {
+    // Rewritten with the current version before anything is appended.
+    needs_recompaction_ = true;
+  }
+
+  return true;
+}
+
+DepsLog::Deps* DepsLog::GetDeps(Node* node) {
+  int id = GetId(node);
+  if (id < 0 || id >= (int)deps_.size())
+    return NULL;
+  return deps_[id];
+}
+
+const DepsLog::Digest* DepsLog::GetDigest(Node* node) const {
+  int id = GetId(node);
+  if (id < 0 || id >= (int)digests_.size() || digests_[id].mtime == -1)
+    return NULL;
+  return &digests_[id];
+}
+
+bool DepsLog::Recompact(const string& path, string* err) {
+  METRIC_RECORD(".ninja_deps recompact");
+  printf("Recompacting deps...\n");
+
+  Close();
+  string temp_path = path + ".recompact";
+
+  // OpenForWrite() opens for append.  Make sure it's not appending to a
+  // left-over file from a previous recompaction attempt that crashed
+  // somehow.
+  unlink(temp_path.c_str());
+
+  DepsLog new_log;
+  if (!new_log.OpenForWrite(temp_path, err))
+    return false;
+
+  // new_log gives out ids afresh, to only the nodes it writes.
+  for (int old_id = 0; old_id < (int)deps_.size(); ++old_id) {
+    Deps* deps = deps_[old_id];
+    if (!deps)
+      continue;
+    // Drop the deps of files no longer built with "deps".
+    Node* node = nodes_[old_id];
+    if (!node->in_edge() || node->in_edge()->rule_->deps().empty())
+      continue;
+    if (!new_log.RecordDeps(node, deps->mtime, deps->node_count,
+                            deps->nodes)) {
+      *err = strerror(errno);
+      new_log.Close();
+      return false;
+    }
+  }
+  for (int old_id = 0; old_id < (int)digests_.size(); ++old_id) {
+    const Digest& digest = digests_[old_id];
+    if (digest.mtime != -1 &&
+        !new_log.RecordDigest(nodes_[old_id], digest.mtime, digest.digest)) {
+      *err = strerror(errno);
+      new_log.Close();
+      return false;
+    }
+  }
+  new_log.Close();
+
+  // All nodes now have ids that refer to new_log, so steal its data.
+  nodes_.swap(new_log.nodes_);
+  ids_.swap(new_log.ids_);
+  deps_.swap(new_log.deps_);
+  digests_.swap(new_log.digests_);
+  needs_recompaction_ = false;
+
+  if (unlink(path.c_str()) < 0) {
+    *err = strerror(errno);
+    return false;
+  }
+
+  if (rename(temp_path.c_str(), path.c_str()) < 0) {
+    *err = strerror(errno);
+    return false;
+  }
+
+  return true;
+}
+
+int DepsLog::GetId(Node* node) const {
+  size_t id = node->id();
+  return id < ids_.size() ? ids_[id] : -1;
+}
+
+bool DepsLog::RecordId(Node* node) {
+  const string& path = node->path();
+  size_t padding = (4 - path.size() % 4) % 4;  // Pad path to 4 byte boundary.
+  uint32_t size = (uint32_t)(path.size() + padding + 4);
+  if (size > kMaxRecordSize) {
+    errno = ERANGE;
+    return false;
+  }
+
+  int id = (int)nodes_.size();
+  if (file_) {
+    uint32_t checksum = ~(uint32_t)id;
+    if (fwrite(&size, sizeof(size), 1, file_) < 1 ||
+        fwrite(path.data(), path.size(), 1, file_) < 1 ||
+        (padding && fwrite("\0\0", padding, 1, file_) < 1) ||
+        fwrite(&checksum, sizeof(checksum), 1, file_) < 1) {
+      return false;
+    }
+  }
+
+  if ((size_t)node->id() >= ids_.size())
+    ids_.resize(node->id() + 1, -1);
+  ids_[node->id()] = id;
+  nodes_.push_back(node);
+  return true;
+}
+
+void DepsLog::UpdateDeps(int out_id, Deps* deps) {
+  if (out_id >= (int)deps_.size())
+    deps_.resize(out_id + 1);
+  delete deps_[out_id];
+  deps_[out_id] = deps;
+}
@@ -0,0 +1,125 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef NINJA_DEPS_LOG_H_
+#define NINJA_DEPS_LOG_H_
+
+#include <stdio.h>
+
+#include <string>
+#include <vector>
+using namespace std;
+
+#include "timestamp.h"
+#include "util.h"  // uint64_t
+
+struct Node;
+struct State;
+
+/// The dependencies that commands report as they run (e.g. the headers
+/// a C file includes), for rules with "deps" set.  Ninja reads each
+/// command's depfile once, when the command finishes, and records what
+/// it lists here; later builds load the whole log on startup instead of
+/// reading and parsing every depfile again.
+///
+/// With content digests on (see BuildConfig::content_digests), it also
+/// keeps the digest of the contents of each file read or written, with
+/// the mtime it had, so that a file is only read again once it changes.
+///
+/// The file is only ever appended to during a build, so that an
+/// interrupted build loses at most the record being written, and is
+/// read in one go on startup.  Paths are written once each and then
+/// referred to by their index, so a record is a short list of integers.
+struct DepsLog {
+  DepsLog();
+  ~DepsLog();
+
+  // Writing (build-time) interface.
+  bool OpenForWrite(const string& path, string* err);
+  /// Record that \a node, as of \a mtime, depends on \a nodes.  Returns
+  /// false with errno set on a write error; unchanged deps aren't
+  /// written again.
+  bool RecordDeps(Node* node, TimeStamp mtime, const vector<Node*>& nodes);
+  bool RecordDeps(Node* node, TimeStamp mtime, int node_count, Node** nodes);
+  /// Record that \a node's contents, as of \a mtime, have \a digest.
+  /// Returns false with errno set on a write error.
+  bool RecordDigest(Node* node, TimeStamp mtime, uint64_t digest);
+  void Close();
+
+  /// Whether the log is open for writing as the file at \a path, which
+  /// another process may have replaced since, as by recompacting it.
+  bool IsOpenAt(const string& path) const;
+
+  // Reading (startup-time) interface.
+  struct Deps {
+    Deps(TimeStamp mtime, int node_count)
+        : mtime(mtime), node_count(node_count),
+          nodes(new Node*[node_count]) {}
+    ~Deps() { delete [] nodes; }
+    /// The mtime of the output when its deps were recorded.
+    TimeStamp mtime;
+    int node_count;
+    Node** nodes;
+  };
+  /// Load the log at \a path, creating nodes in \a state for the paths
+  /// in it.  A log that is damaged partway is loaded up to the damage
+  /// and rewritten by the next OpenForWrite().
+  bool Load(const string& path, State* state, string* err);
+  /// The last deps recorded for \a node, or NULL.
+  Deps* GetDeps(Node* node);
+
+  /// The digest last recorded for \a node, and the mtime it had then.
+  struct Digest {
+    Digest() : mtime(-1), digest(0) {}
+    TimeStamp mtime;
+    uint64_t digest;
+  };
+  /// Returns NULL if none was.
+  const Digest* GetDigest(Node* node) const;
+
+  /// Rewrite the log with only the latest deps of each output that is
+  /// still built with "deps", throwing away old data.
+  bool Recompact(const string& path, string* err);
+  /// Whether OpenForWrite() will Recompact() first.
+  bool needs_recompaction() const { return needs_recompaction_; }
+
+  /// Used for tests.
+  const vector<Node*>& nodes() const { return nodes_; }
+  const vector<Deps*>& deps() const { return deps_; }
+
+ private:
+  /// The log's id for \a node, or -1 if it has none yet.
+  int GetId(Node* node) const;
+  /// Write a path record for \a node, giving it the next id.
+  bool RecordId(Node* node);
+  /// Make \a deps the deps of the node with log id \a out_id.
+  void UpdateDeps(int out_id, Deps* deps);
+
+  bool needs_recompaction_;
+  FILE* file_;
+
+  /// Nodes by log id.
+  vector<Node*> nodes_;
+  /// Log ids by Node::id(), with -1 for nodes the log doesn't know.
+  vector<int> ids_;
+  /// Deps by the log id of their output, or NULL.
+  vector<Deps*> deps_;
+  /// Digests by log id, with an mtime of -1 where there is none.
+  vector<Digest> digests_;
+
+  DepsLog(const DepsLog&);
+  void operator=(const DepsLog&);
+};
+
+#endif  // NINJA_DEPS_LOG_H_
@@ -0,0 +1,397 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "deps_log.h"
+
+#include <sys/stat.h>
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+#include "disk_interface.h"
+#include "graph.h"
+#include "util.h"
+#include "test.h"
+
+namespace {
+
+const char kTestFilename[] = "DepsLogTest-tempfile";
+
+struct DepsLogTest : public testing::Test {
+  virtual void SetUp() {
+    // In case a crashing test left a stale file behind.
+    unlink(kTestFilename);
+  }
+  virtual void TearDown() {
+    unlink(kTestFilename);
+  }
+};
+
+/// The size of the file at \a path.
+int FileSize(const char* path) {
+  struct stat st;
+  return stat(path, &st) == 0 ? (int)st.st_size : -1;
+}
+
+TEST_F(DepsLogTest, WriteRead) {
+  State state1;
+  DepsLog log1;
+  string err;
+  EXPECT_TRUE(log1.OpenForWrite(kTestFilename, &err));
+  ASSERT_EQ("", err);
+
+  // More than fits in 32 bits, to check the mtime's high half.
+  const TimeStamp kMtime = 1357924680123456789LL;
+  {
+    vector<Node*> deps;
+    deps.push_back(state1.GetNode("foo.h"));
+    deps.push_back(state1.GetNode("bar.h"));
+    log1.RecordDeps(state1.GetNode("out.o"), kMtime, deps);
+
+    deps.clear();
+    deps.push_back(state1.GetNode("foo.h"));
+    deps.push_back(state1.GetNode("bar2.h"));
+    log1.RecordDeps(state1.GetNode("out2.o"), 2, deps);
+
+    DepsLog::Deps* log_deps = log1.GetDeps(state1.GetNode("out.o"));
+    ASSERT_TRUE(log_deps);
+    ASSERT_EQ(kMtime, log_deps->mtime);
+    ASSERT_EQ(2, log_deps->node_count);
+    ASSERT_EQ("foo.h", log_deps->nodes[0]->path());
+    ASSERT_EQ("bar.h", log_deps->nodes[1]->path());
+  }
+
+  log1.Close();
+
+  State state2;
+  DepsLog log2;
+  EXPECT_TRUE(log2.Load(kTestFilename, &state2, &err));
+  ASSERT_EQ("", err);
+
+  ASSERT_EQ(log1.nodes().size(), log2.nodes().size());
+  for (int i = 0; i < (int)log1.nodes().size(); ++i)
+    ASSERT_EQ(log1.nodes()[i]->path(), log2.nodes()[i]->path());
+
+  // Spot-check the entries in log2.
+  DepsLog::Deps* log_deps = log2.GetDeps(state2.GetNode("out2.o"));
+  ASSERT_TRUE(log_deps);
+  ASSERT_EQ(2, log_deps->mtime);
+  ASSERT_EQ(2, log_deps->node_count);
+  ASSERT_EQ("foo.h", log_deps->nodes[0]->path());
+  ASSERT_EQ("bar2.h", log_deps->nodes[1]->path());
+  ASSERT_EQ(kMtime, log2.GetDeps(state2.GetNode("out.o"))->mtime);
+  ASSERT_FALSE(log2.GetDeps(state2.GetNode("foo.h")));
+}
+
+// Verify that adding the same deps twice doesn't grow the file.
+TEST_F(DepsLogTest, DoubleEntry) {
+  int file_size;
+  {
+    State state;
+    DepsLog log;
+    string err;
+    EXPECT_TRUE(log.OpenForWrite(kTestFilename, &err));
+    ASSERT_EQ("", err);
+
+    vector<Node*> deps;
+    deps.push_back(state.GetNode("foo.h"));
+    deps.push_back(state.GetNode("bar.h"));
+    log.RecordDeps(state.GetNode("out.o"), 1, deps);
+    log.Close();
+
+    file_size = FileSize(kTestFilename);
+    ASSERT_GT(file_size, 0);
+  }
+
+  // Now reload the file, and re-add the same deps.
+  {
+    State state;
+    DepsLog log;
+    string err;
+    EXPECT_TRUE(log.Load(kTestFilename, &state, &err));
+
+    EXPECT_TRUE(log.OpenForWrite(kTestFilename, &err));
+    ASSERT_EQ("", err);
+
+    vector<Node*> deps;
+    deps.push_back(state.GetNode("foo.h"));
+    deps.push_back(state.GetNode("bar.h"));
+    log.RecordDeps(state.GetNode("out.o"), 1, deps);
+    log.Close();
+
+    ASSERT_EQ(file_size, FileSize(kTestFilename));
+  }
+}
+
+// Verify that recompaction keeps only the latest deps of outputs that
+// are still built with "deps".
+TEST_F(DepsLogTest, Recompact) {
+  const char kManifest[] =
+"rule cc\n"
+"  command = cc\n"
+"  depfile = $out.d\n"
+"  deps = gcc\n"
+"build out.o: cc\n"
+"build other_out.o: cc\n";
+
+  int file_size;
+  {
+    State state;
+    ASSERT_NO_FATAL_FAILURE(AssertParse(&state, kManifest));
+    DepsLog log;
+    string err;
+    ASSERT_TRUE(log.OpenForWrite(kTestFilename, &err));
+    ASSERT_EQ("", err);
+
+    vector<Node*> deps;
+    deps.push_back(state.GetNode("foo.h"));
+    deps.push_back(state.GetNode("bar.h"));
+    log.RecordDeps(state.GetNode("out.o"), 1, deps);
+
+    deps.clear();
+    deps.push_back(state.GetNode("foo.h"));
+    deps.push_back(state.GetNode("baz.h"));
+    log.RecordDeps(state.GetNode("other_out.o"), 1, deps);
+
+    // A second record for out.o, making the first one dead weight.
+    deps.clear();
+    deps.push_back(state.GetNode("foo.h"));
+    log.RecordDeps(state.GetNode("out.o"), 2, deps);
+    log.Close();
+
+    file_size = FileSize(kTestFilename);
+    ASSERT_GT(file_size, 0);
+  }
+
+  // other_out.o is no longer built with "deps".
+  {
+    State state;
+    ASSERT_NO_FATAL_FAILURE(AssertParse(&state,
+"rule cc\n"
+"  command = cc\n"
+"  depfile = $out.d\n"
+"  deps = gcc\n"
+"build out.o: cc\n"
+"build other_out.o: phony\n"));
+    DepsLog log;
+    string err;
+    ASSERT_TRUE(log.Load(kTestFilename, &state, &err));
+    ASSERT_TRUE(log.Recompact(kTestFilename, &err));
+    ASSERT_EQ("", err);
+
+    DepsLog::Deps* deps = log.GetDeps(state.GetNode("out.o"));
+    ASSERT_TRUE(deps);
+    ASSERT_EQ(2, deps->mtime);
+    ASSERT_EQ(1, deps->node_count);
+    ASSERT_EQ("foo.h", deps->nodes[0]->path());
+    ASSERT_FALSE(log.GetDeps(state.GetNode("other_out.o")));
+    ASSERT_LT(FileSize(kTestFilename), file_size);
+  }
+
+  // The recompacted log loads with the same contents.
+  {
+    State state;
+    DepsLog log;
+    string err;
+    ASSERT_TRUE(log.Load(kTestFilename, &state, &err));
+    ASSERT_EQ("", err);
+    ASSERT_EQ(2u, log.nodes().size());
+    DepsLog::Deps* deps = log.GetDeps(state.GetNode("out.o"));
+    ASSERT_TRUE(deps);
+    ASSERT_EQ(2, deps->mtime);
+    ASSERT_FALSE(log.GetDeps(state.GetNode("other_out.o")));
+  }
+}
+
+// Verify that digests are kept by mtime, and survive recompaction.
+TEST_F(DepsLogTest, Digests) {
+  {
+    State state;
+    DepsLog log;
+    string err;
+    ASSERT_TRUE(log.OpenForWrite(kTestFilename, &err));
+    ASSERT_EQ("", err);
+
+    ASSERT_TRUE(log.RecordDigest(state.GetNode("foo.h"), 1, 0x1234));
+    ASSERT_TRUE(log.RecordDigest(state.GetNode("bar.h"), 2, 0x5678));
+    ASSERT_TRUE(log.RecordDigest(state.GetNode("foo.h"), 3, 0x9abc));
+    log.Close();
+  }
+
+  {
+    State state;
+    DepsLog log;
+    string err;
+    ASSERT_TRUE(log.Load(kTestFilename, &state, &err));
+    ASSERT_EQ("", err);
+    const DepsLog::Digest* digest = log.GetDigest(state.GetNode("foo.h"));
+    ASSERT_TRUE(digest);
+    EXPECT_EQ(3, digest->mtime);
+    EXPECT_EQ(0x9abcu, digest->digest);
+    EXPECT_FALSE(log.GetDigest(state.GetNode("baz.h")));
+
+    ASSERT_TRUE(log.Recompact(kTestFilename, &err));
+    ASSERT_EQ("", err);
+  }
+
+  {
+    State state;
+    DepsLog log;
+    string err;
+    ASSERT_TRUE(log.Load(kTestFilename, &state, &err));
+    ASSERT_EQ("", err);
+    const DepsLog::Digest* digest = log.GetDigest(state.GetNode("bar.h"));
+    ASSERT_TRUE(digest);
+    EXPECT_EQ(2, digest->mtime);
+    EXPECT_EQ(0x5678u, digest->digest);
+    digest = log.GetDigest(state.GetNode("foo.h"));
+    ASSERT_TRUE(digest);
+    EXPECT_EQ(3, digest->mtime);
+  }
+}
+
+// Verify that a log from another version is thrown away with a warning.
+TEST_F(DepsLogTest, InvalidHeader) {
+  const char* kInvalidHeaders[] = {
+    "",                              // Empty file.
+    "# ninjad",                      // Truncated first line.
+    "# ninjadeps\n",                 // No version int.
+    "# ninjadeps\n\001\002",         // Truncated version int.
+    "# ninjadeps\n\001\002\003\004"  // Invalid version int.
+  };
+  for (size_t i = 0; i < sizeof(kInvalidHeaders) / sizeof(kInvalidHeaders[0]);
+       ++i) {
+    FILE* deps_log = fopen(kTestFilename, "wb");
+    ASSERT_TRUE(deps_log != NULL);
+    ASSERT_EQ(strlen(kInvalidHeaders[i]),
+              fwrite(kInvalidHeaders[i], 1, strlen(kInvalidHeaders[i]),
+                     deps_log));
+    ASSERT_EQ(0, fclose(deps_log));
+
+    string err;
+    DepsLog log;
+    State state;
+    ASSERT_TRUE(log.Load(kTestFilename, &state, &err));
+    EXPECT_EQ("deps log version invalid, perhaps due to being too old; "
+              "starting over", err);
+    EXPECT_EQ(-1, FileSize(kTestFilename));
+  }
+}
+
+// Verify that a log cut short anywhere loads up to the last whole record,
+// and can be appended to afterwards.
+TEST_F(DepsLogTest, Truncated) {
+  {
+    State state;
+    DepsLog log;
+    string err;
+    EXPECT_TRUE(log.OpenForWrite(kTestFilename, &err));
+    ASSERT_EQ("", err);
+
+    vector<Node*> deps;
+    deps.push_back(state.GetNode("foo.h"));
+    deps.push_back(state.GetNode("bar.h"));
+    log.RecordDeps(state.GetNode("out.o"), 1, deps);
+
+    deps.clear();
+    deps.push_back(state.GetNode("foo.h"));
+    deps.push_back(state.GetNode("bar2.h"));
+    log.RecordDeps(state.GetNode("out2.o"), 2, deps);
+    log.Close();
+  }
+
+  string contents;
+  {
+    string err;
+    RealDiskInterface disk;
+    contents = disk.ReadFile(kTestFilename, &err);
+    ASSERT_EQ("", err);
+  }
+
+  // Cut the file short at every size past the header, and check that a
+  // shorter file never loads more than a longer one.
+  const int kHeaderSize = 16;
+  int node_count = 5;
+  int deps_count = 2;
+  for (int size = (int)contents.size(); size > kHeaderSize; --size) {
+    FILE* f = fopen(kTestFilename, "wb");
+    ASSERT_TRUE(f != NULL);
+    ASSERT_EQ((size_t)size, fwrite(contents.data(), 1, size, f));
+    ASSERT_EQ(0, fclose(f));
+
+    State state;
+    DepsLog log;
+    string err;
+    EXPECT_TRUE(log.Load(kTestFilename, &state, &err));
+    EXPECT_EQ("", err);
+
+    int new_deps_count = 0;
+    for (vector<DepsLog::Deps*>::const_iterator i = log.deps().begin();
+         i != log.deps().end(); ++i) {
+      if (*i)
+        ++new_deps_count;
+    }
+    ASSERT_GE(node_count, (int)log.nodes().size());
+    ASSERT_GE(deps_count, new_deps_count);
+    node_count = (int)log.nodes().size();
+    deps_count = new_deps_count;
+  }
+
+  // The damage goes when the log is opened again, after which it takes
+  // new records.
+  {
+    State state;
+    DepsLog log;
+    string err;
+    EXPECT_TRUE(log.Load(kTestFilename, &state, &err));
+    EXPECT_TRUE(log.OpenForWrite(kTestFilename, &err));
+    ASSERT_EQ("", err);
+    vector<Node*> deps;
+    deps.push_back(state.GetNode("new.h"));
+    ASSERT_TRUE(log.RecordDeps(state.GetNode("out.o"), 3, deps));
+    log.Close();
+  }
+  {
+    State state;
+    DepsLog log;
+    string err;
+    EXPECT_TRUE(log.Load(kTestFilename, &state, &err));
+    ASSERT_EQ("", err);
+    DepsLog::Deps* deps = log.GetDeps(state.GetNode("out.o"));
+    ASSERT_TRUE(deps);
+    ASSERT_EQ(3, deps->mtime);
+    ASSERT_EQ(1, deps->node_count);
+    ASSERT_EQ("new.h", deps->nodes[0]->path());
+  }
+}
+
+}  // anonymous namespace
+
+TEST_F(DepsLogTest, IsOpenAt) {
+  DepsLog log;
+  string err;
+  EXPECT_TRUE(log.OpenForWrite(kTestFilename, &err));
+  ASSERT_EQ("", err);
+  EXPECT_TRUE(log.IsOpenAt(kTestFilename));
+
+  // Another process recompacting the log replaces it.
+  string temp_path = string(kTestFilename) + ".recompact";
+  FILE* f = fopen(temp_path.c_str(), "wb");
+  ASSERT_TRUE(f != NULL);
+  fclose(f);
+  ASSERT_EQ(0, rename(temp_path.c_str(), kTestFilename));
+  EXPECT_FALSE(log.IsOpenAt(kTestFilename));
+  log.Close();
+  EXPECT_FALSE(log.IsOpenAt(kTestFilename));
+}
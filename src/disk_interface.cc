@@ -23,8 +23,20 @@
 #ifdef _WIN32
 #include <windows.h>
 #include <direct.h>  // _mkdir
+#ifndef FIND_FIRST_EX_LARGE_FETCH
+// Windows 7 and up; older versions fail the listing, and Stat() does.
+#define FIND_FIRST_EX_LARGE_FETCH 2
+#endif
+#else
+#include <dirent.h>
+#include <fcntl.h>
 #endif
 
+#include <algorithm>
+
+#include "eval_env.h"
+#include "io_uring.h"
+#include "metrics.h"
 #include "util.h"
 
 namespace {
@@ -44,6 +56,38 @@ string DirName(const string& path) {
   return path.substr(0, slash_pos);
 }
 
+/// Writes what is evaluated into it to a file, through stdio's buffer.
+struct FileSink : public EvalSink {
+  explicit FileSink(FILE* file) : file_(file), failed_(false) {}
+  virtual void Append(StringPiece text) {
+    if (!failed_ && fwrite(text.str_, 1, text.len_, file_) < text.len_)
+      failed_ = true;
+  }
+  FILE* file_;
+  bool failed_;
+};
+
+/// Compares what is evaluated into it with the contents of a file.
+struct CompareSink : public EvalSink {
+  explicit CompareSink(FILE* file) : file_(file), same_(true) {}
+  virtual void Append(StringPiece text) {
+    char buf[4096];
+    while (same_ && text.len_ > 0) {
+      size_t len = min(text.len_, sizeof(buf));
+      if (fread(buf, 1, len, file_) < len ||
+          memcmp(buf, text.str_, len) != 0) {
+        same_ = false;
+      }
+      text.str_ += len;
+      text.len_ -= len;
+    }
+  }
+  /// Whether the file held what was evaluated, and no more.
+  bool Same() { return same_ && getc(file_) == EOF; }
+  FILE* file_;
+  bool same_;
+};
+
 int MakeDir(const string& path) {
 #ifdef _WIN32
   return _mkdir(path.c_str());
@@ -52,10 +96,199 @@ int MakeDir(const string& path) {
 #endif
 }
 
+#ifdef _WIN32
+/// The modification time in \a filetime, which is in 100-nanosecond
+/// increments since the Windows epoch.  We don't much care about epoch
+/// correctness but we do want the resulting value to fit in an integer.
+TimeStamp FileTimeTimestamp(const FILETIME& filetime) {
+  uint64_t mtime = ((uint64_t)filetime.dwHighDateTime << 32) |
+    ((uint64_t)filetime.dwLowDateTime);
+  // 1600 epoch -> 2000 epoch (subtract 400 years), so that nanoseconds
+  // fit.
+  mtime -= 12622770400LL * (1000000000LL / 100);
+  return (TimeStamp)mtime * 100;  // 100ns -> ns.
+}
+
+/// How the stat cache keys \a path: file names are case-insensitive, and
+/// either slash separates them.
+string StatCacheKey(const string& path) {
+  string key = path;
+  for (size_t i = 0; i < key.size(); ++i)
+    key[i] = key[i] == '/' ? '\\' : (char)tolower((unsigned char)key[i]);
+  return key;
+}
+
+/// Read every entry of \a dir, with its mtime, into \a entries, keyed by
+/// StatCacheKey().  One FindFirstFileEx() listing costs about as much as
+/// stat()ing a file or two through the filters scanning each open.  A
+/// missing directory has no entries.  Returns false on other errors.
+/// There is no \a ring here; it is always NULL.
+bool ReadDir(const string& dir, map<string, TimeStamp>* entries,
+             IoUring* ring) {
+  METRIC_COUNT("directories read", 1);
+  WIN32_FIND_DATAA data;
+  HANDLE find = FindFirstFileExA((dir + "\\*").c_str(), FindExInfoBasic,
+                                 &data, FindExSearchNameMatch, NULL,
+                                 FIND_FIRST_EX_LARGE_FETCH);
+  if (find == INVALID_HANDLE_VALUE) {
+    DWORD err = GetLastError();
+    return err == ERROR_FILE_NOT_FOUND || err == ERROR_PATH_NOT_FOUND ||
+           err == ERROR_DIRECTORY;
+  }
+  do {
+    const char* name = data.cFileName;
+    if (name[0] == '.' && (!name[1] || (name[1] == '.' && !name[2])))
+      continue;
+    (*entries)[StatCacheKey(name)] = FileTimeTimestamp(data.ftLastWriteTime);
+  } while (FindNextFileA(find, &data));
+  bool ok = GetLastError() == ERROR_NO_MORE_FILES;
+  FindClose(find);
+  return ok;
+}
+#else
+/// Stat every entry of \a dir into \a entries, all at once through
+/// \a ring if it isn't NULL.  A missing directory has no entries.
+/// Returns false on other errors.
+bool ReadDir(const string& dir, map<string, TimeStamp>* entries,
+             IoUring* ring) {
+  METRIC_COUNT("directories read", 1);
+  DIR* d = opendir(dir.c_str());
+  if (!d)
+    return errno == ENOENT || errno == ENOTDIR;
+  int fd = dirfd(d);
+  errno = 0;
+  vector<const char*> names;
+  while (struct dirent* entry = readdir(d)) {
+    const char* name = entry->d_name;
+    if (name[0] == '.' && (!name[1] || (name[1] == '.' && !name[2])))
+      continue;
+    map<string, TimeStamp>::iterator i =
+        entries->insert(make_pair(string(name), (TimeStamp)-1)).first;
+    if (ring) {
+      names.push_back(i->first.c_str());
+      continue;
+    }
+    struct stat st;
+    if (fstatat(fd, name, &st, 0) < 0) {
+      // A dangling symlink is missing, as for stat(); leave anything
+      // else for Stat() to report.
+      i->second = errno == ENOENT ? 0 : -1;
+      errno = 0;
+    } else {
+      i->second = StatTimestamp(st);
+    }
+  }
+  bool ok = errno == 0;
+  if (ok && ring) {
+    vector<TimeStamp> mtimes;
+    ring->StatAt(fd, names, &mtimes);
+    for (size_t i = 0; i < names.size(); ++i)
+      (*entries)[names[i]] = mtimes[i];
+  }
+  closedir(d);
+  return ok;
+}
+
+/// How the stat cache keys \a path.
+string StatCacheKey(const string& path) {
+  return path;
+}
+#endif
+
+/// Split \a path into the directory holding it and its name, keyed as
+/// the stat cache has them.  Returns false for paths it doesn't cache.
+bool SplitStatCachePath(const string& path, string* dir, string* name) {
+#ifdef _WIN32
+  // Past MAX_PATH, Stat() reports an error; "c:file" is relative to c:'s
+  // own working directory.
+  if (path.size() > MAX_PATH)
+    return false;
+  string::size_type slash = path.find_last_of("/\\");
+  if (slash == string::npos) {
+    if (path.find(':') != string::npos)
+      return false;
+    *dir = ".";
+    *name = StatCacheKey(path);
+  } else {
+    *dir = StatCacheKey(slash == 0 ? "\\" : path.substr(0, slash));
+    if (*dir->rbegin() == ':')
+      *dir += '\\';
+    *name = StatCacheKey(path.substr(slash + 1));
+  }
+#else
+  string::size_type slash = path.rfind('/');
+  if (slash == string::npos) {
+    *dir = ".";
+    *name = path;
+  } else {
+    *dir = slash == 0 ? "/" : path.substr(0, slash);
+    *name = path.substr(slash + 1);
+  }
+#endif
+  return !name->empty() && *name != "." && *name != "..";
+}
+
+/// Look \a name up in the entries from ReadDir().  Returns false if it
+/// couldn't be stat()ed, or if the entries can't tell.
+bool LookUpEntry(const map<string, TimeStamp>& entries, const string& name,
+                 TimeStamp* mtime) {
+  map<string, TimeStamp>::const_iterator i = entries.find(name);
+  if (i == entries.end()) {
+#ifdef _WIN32
+    // StatCacheKey() only folds the case of ASCII letters, and the
+    // listing has no 8.3 names such as PROGRA~1.
+    for (size_t j = 0; j < name.size(); ++j) {
+      if ((unsigned char)name[j] >= 0x80 || name[j] == '~')
+        return false;
+    }
+#endif
+    *mtime = 0;
+    return true;
+  }
+  *mtime = i->second;
+  return *mtime != -1;
+}
+
 }  // namespace
 
+#ifndef _WIN32
+TimeStamp StatTimestamp(const struct stat& st) {
+#if defined(__APPLE__) && !defined(_POSIX_C_SOURCE)
+  return (TimeStamp)st.st_mtimespec.tv_sec * 1000000000LL +
+      st.st_mtimespec.tv_nsec;
+#elif defined(__linux__) || defined(__FreeBSD__) || \
+    (defined(_POSIX_C_SOURCE) && _POSIX_C_SOURCE >= 200809L)
+  return (TimeStamp)st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+#else
+  return (TimeStamp)st.st_mtime * 1000000000LL;
+#endif
+}
+#endif
+
 // DiskInterface ---------------------------------------------------------------
 
+bool DiskInterface::WriteEvaluatedFile(const string& path,
+                                       const EvalString& contents,
+                                       Env* env) {
+  return WriteFile(path, contents.Evaluate(env));
+}
+
+void DiskInterface::StatMany(const vector<string>& paths,
+                             vector<TimeStamp>* mtimes) {
+  mtimes->resize(paths.size());
+  for (size_t i = 0; i < paths.size(); ++i)
+    (*mtimes)[i] = Stat(paths[i]);
+}
+
+void DiskInterface::ReadFiles(const vector<string>& paths,
+                              vector<string>* contents,
+                              vector<string>* errs) {
+  contents->assign(paths.size(), string());
+  errs->assign(paths.size(), string());
+  for (size_t i = 0; i < paths.size(); ++i)
+    (*contents)[i] = ReadFile(paths[i], &(*errs)[i]);
+}
+
 bool DiskInterface::MakeDirs(const string& path) {
   string dir = DirName(path);
   if (dir.empty())
@@ -75,7 +308,17 @@ bool DiskInterface::MakeDirs(const string& path) {
 
 // RealDiskInterface -----------------------------------------------------------
 
+RealDiskInterface::~RealDiskInterface() {
+  for (vector<IoUring*>::iterator i = rings_.begin(); i != rings_.end(); ++i)
+    delete *i;
+}
+
 TimeStamp RealDiskInterface::Stat(const string& path) {
+  TimeStamp mtime;
+  if (use_stat_cache_ && StatCached(path, &mtime))
+    return mtime;
+  METRIC_COUNT("files stat'ed", 1);
+
 #ifdef _WIN32
   // MSDN: "Naming Files, Paths, and Namespaces"
   // http://msdn.microsoft.com/en-us/library/windows/desktop/aa365247(v=vs.85).aspx
@@ -92,15 +335,7 @@ TimeStamp RealDiskInterface::Stat(const string& path) {
           GetLastErrorString().c_str());
     return -1;
   }
-  const FILETIME& filetime = attrs.ftLastWriteTime;
-  // FILETIME is in 100-nanosecond increments since the Windows epoch.
-  // We don't much care about epoch correctness but we do want the
-  // resulting value to fit in an integer.
-  uint64_t mtime = ((uint64_t)filetime.dwHighDateTime << 32) |
-    ((uint64_t)filetime.dwLowDateTime);
-  mtime /= 1000000000LL / 100; // 100ns -> s.
-  mtime -= 12622770400LL;  // 1600 epoch -> 2000 epoch (subtract 400 years).
-  return (TimeStamp)mtime;
+  return FileTimeTimestamp(attrs.ftLastWriteTime);
 #else
   struct stat st;
   if (stat(path.c_str(), &st) < 0) {
@@ -109,11 +344,12 @@ TimeStamp RealDiskInterface::Stat(const string& path) {
     Error("stat(%s): %s", path.c_str(), strerror(errno));
     return -1;
   }
-  return st.st_mtime;
+  return StatTimestamp(st);
 #endif
 }
 
 bool RealDiskInterface::WriteFile(const string& path, const string& contents) {
+  InvalidateStatCache(path);
   FILE * fp = fopen(path.c_str(), "w");
   if (fp == NULL) {
     Error("WriteFile(%s): Unable to create file. %s", path.c_str(), strerror(errno));
@@ -134,8 +370,46 @@ bool RealDiskInterface::WriteFile(const string& path, const string& contents) {
   return true;
 }
 
+bool RealDiskInterface::WriteEvaluatedFile(const string& path,
+                                           const EvalString& contents,
+                                           Env* env) {
+  if (FILE* fp = fopen(path.c_str(), "r")) {
+    CompareSink compare(fp);
+    contents.Evaluate(env, &compare);
+    bool same = compare.Same();
+    fclose(fp);
+    if (same)
+      return true;
+  }
+
+  InvalidateStatCache(path);
+  FILE* fp = fopen(path.c_str(), "w");
+  if (fp == NULL) {
+    Error("WriteFile(%s): Unable to create file. %s", path.c_str(), strerror(errno));
+    return false;
+  }
+
+  FileSink sink(fp);
+  contents.Evaluate(env, &sink);
+  if (sink.failed_) {
+    Error("WriteFile(%s): Unable to write to the file. %s", path.c_str(), strerror(errno));
+    fclose(fp);
+    return false;
+  }
+
+  if (fclose(fp) == EOF) {
+    Error("WriteFile(%s): Unable to close the file. %s", path.c_str(), strerror(errno));
+    return false;
+  }
+
+  return true;
+}
+
 bool RealDiskInterface::MakeDir(const string& path) {
+  InvalidateStatCache(path);
   if (::MakeDir(path) < 0) {
+    if (errno == EEXIST)
+      return true;  // Made meanwhile, e.g. by another thread.
     Error("mkdir(%s): %s", path.c_str(), strerror(errno));
     return false;
   }
@@ -153,6 +427,7 @@ string RealDiskInterface::ReadFile(const string& path, string* err) {
 }
 
 int RealDiskInterface::RemoveFile(const string& path) {
+  InvalidateStatCache(path);
   if (remove(path.c_str()) < 0) {
     switch (errno) {
       case ENOENT:
@@ -165,3 +440,127 @@ int RealDiskInterface::RemoveFile(const string& path) {
     return 0;
   }
 }
+
+void RealDiskInterface::StatMany(const vector<string>& paths,
+                                 vector<TimeStamp>* mtimes) {
+  mtimes->assign(paths.size(), -1);
+  vector<size_t> left;
+  for (size_t i = 0; i < paths.size(); ++i) {
+    if (!use_stat_cache_ || !StatCached(paths[i], &(*mtimes)[i]))
+      left.push_back(i);
+  }
+
+  IoUring* ring = left.empty() ? NULL : AcquireRing();
+  if (ring) {
+    METRIC_COUNT("files stat'ed together", (int)left.size());
+    vector<const char*> names;
+    for (size_t j = 0; j < left.size(); ++j)
+      names.push_back(paths[left[j]].c_str());
+    vector<TimeStamp> ring_mtimes;
+    ring->Stat(names, &ring_mtimes);
+    ReleaseRing(ring);
+    for (size_t j = 0; j < left.size(); ++j)
+      (*mtimes)[left[j]] = ring_mtimes[j];
+  }
+
+  // Stat() the rest, and again those that failed, to report them.
+  for (size_t j = 0; j < left.size(); ++j) {
+    if ((*mtimes)[left[j]] == -1)
+      (*mtimes)[left[j]] = Stat(paths[left[j]]);
+  }
+}
+
+void RealDiskInterface::ReadFiles(const vector<string>& paths,
+                                  vector<string>* contents,
+                                  vector<string>* errs) {
+  contents->assign(paths.size(), string());
+  errs->assign(paths.size(), string());
+  vector<bool> ok(paths.size());
+  if (IoUring* ring = paths.empty() ? NULL : AcquireRing()) {
+    ring->ReadFiles(paths, contents, &ok);
+    ReleaseRing(ring);
+  }
+  for (size_t i = 0; i < paths.size(); ++i) {
+    if (ok[i])
+      METRIC_COUNT("bytes read", (int)(*contents)[i].size());
+    else
+      (*contents)[i] = ReadFile(paths[i], &(*errs)[i]);
+  }
+}
+
+IoUring* RealDiskInterface::AcquireRing() {
+  if (!use_io_uring_)
+    return NULL;
+  {
+    ScopedLock lock(&rings_mutex_);
+    if (io_uring_unavailable_)
+      return NULL;
+    if (!rings_.empty()) {
+      IoUring* ring = rings_.back();
+      rings_.pop_back();
+      return ring;
+    }
+  }
+  IoUring* ring = new IoUring;
+  if (!ring->Init()) {
+    delete ring;
+    ScopedLock lock(&rings_mutex_);
+    io_uring_unavailable_ = true;
+    return NULL;
+  }
+  return ring;
+}
+
+void RealDiskInterface::ReleaseRing(IoUring* ring) {
+  if (!ring)
+    return;
+  ScopedLock lock(&rings_mutex_);
+  rings_.push_back(ring);
+}
+
+void RealDiskInterface::AllowStatCache(bool allow) {
+  ScopedLock lock(&stat_cache_mutex_);
+  use_stat_cache_ = allow;
+  if (!use_stat_cache_)
+    stat_cache_.clear();
+}
+
+bool RealDiskInterface::StatCached(const string& path, TimeStamp* mtime) {
+  string dir, name;
+  if (!SplitStatCachePath(path, &dir, &name))
+    return false;
+
+  {
+    ScopedLock lock(&stat_cache_mutex_);
+    StatCache::const_iterator i = stat_cache_.find(dir);
+    if (i != stat_cache_.end())
+      return LookUpEntry(i->second, name, mtime);
+  }
+
+  // Read the directory without holding the lock, so that other threads
+  // can carry on with other directories.
+  DirCache entries;
+  IoUring* ring = AcquireRing();
+  bool read = ReadDir(dir, &entries, ring);
+  ReleaseRing(ring);
+  if (!read)
+    return false;
+  ScopedLock lock(&stat_cache_mutex_);
+  if (!use_stat_cache_)
+    return LookUpEntry(entries, name, mtime);
+  DirCache& cached = stat_cache_[dir];
+  if (cached.empty())
+    cached.swap(entries);
+  return LookUpEntry(cached, name, mtime);
+}
+
+void RealDiskInterface::InvalidateStatCache(const string& path) {
+  ScopedLock lock(&stat_cache_mutex_);
+  if (stat_cache_.empty())
+    return;
+  string dir, name;
+  if (SplitStatCachePath(path, &dir, &name))
+    stat_cache_.erase(dir);
+  // The path may be a directory being created.
+  stat_cache_.erase(StatCacheKey(path));
+}
@@ -15,11 +15,23 @@
 #ifndef NINJA_DISK_INTERFACE_H_
 #define NINJA_DISK_INTERFACE_H_
 
+#include <map>
 #include <string>
+#include <vector>
 using namespace std;
 
+#include "thread_pool.h"
 #include "timestamp.h"
 
+struct Env;
+struct EvalString;
+struct IoUring;
+
+#ifndef _WIN32
+/// The modification time in \a st, at full resolution.
+TimeStamp StatTimestamp(const struct stat& st);
+#endif
+
 /// Interface for accessing the disk.
 ///
 /// Abstract so it can be mocked out for tests.  The real implementation
@@ -31,6 +43,11 @@ struct DiskInterface {
   /// other errors.
   virtual TimeStamp Stat(const string& path) = 0;
 
+  /// Stat() each of \a paths into \a mtimes.  An implementation may
+  /// have the disk work on them at once; the default stats them in turn.
+  virtual void StatMany(const vector<string>& paths,
+                        vector<TimeStamp>* mtimes);
+
   /// Create a directory, returning false on failure.
   virtual bool MakeDir(const string& path) = 0;
 
@@ -38,9 +55,19 @@ struct DiskInterface {
   /// Returns true on success, false on failure
   virtual bool WriteFile(const string& path, const string& contents) = 0;
 
+  /// Create a file with the contents \a contents evaluates to in \a env.
+  /// The default evaluates them into a string for WriteFile().
+  virtual bool WriteEvaluatedFile(const string& path,
+                                  const EvalString& contents, Env* env);
+
   /// Read a file to a string.  Fill in |err| on error.
   virtual string ReadFile(const string& path, string* err) = 0;
 
+  /// ReadFile() each of \a paths into \a contents, with its error in
+  /// \a errs.  As for StatMany(), the default reads them in turn.
+  virtual void ReadFiles(const vector<string>& paths,
+                         vector<string>* contents, vector<string>* errs);
+
   /// Remove the file named @a path. It behaves like 'rm -f path' so no errors
   /// are reported if it does not exists.
   /// @returns 0 if the file has been removed,
@@ -55,12 +82,74 @@ struct DiskInterface {
 
 /// Implementation of DiskInterface that actually hits the disk.
 struct RealDiskInterface : public DiskInterface {
-  virtual ~RealDiskInterface() {}
+  RealDiskInterface()
+      : use_stat_cache_(false), use_io_uring_(false),
+        io_uring_unavailable_(false) {}
+  virtual ~RealDiskInterface();
   virtual TimeStamp Stat(const string& path);
   virtual bool MakeDir(const string& path);
   virtual bool WriteFile(const string& path, const string& contents);
+  /// Writes the contents as they are evaluated, e.g. a response file of
+  /// tens of thousands of paths, without building them up first.  A file
+  /// that already has them, as one a failed command left, is left alone.
+  virtual bool WriteEvaluatedFile(const string& path,
+                                  const EvalString& contents, Env* env);
   virtual string ReadFile(const string& path, string* err);
   virtual int RemoveFile(const string& path);
+
+  /// Through an io_uring, where the kernel has it, if AllowIoUring()
+  /// said to; except that those the stat cache answers are stat'ed
+  /// from it.
+  virtual void StatMany(const vector<string>& paths,
+                        vector<TimeStamp>* mtimes);
+  virtual void ReadFiles(const vector<string>& paths,
+                         vector<string>* contents, vector<string>* errs);
+
+  /// Whether Stat() may answer from a cache of whole directories, each
+  /// read (with readdir() and fstatat(), or on Windows one
+  /// FindFirstFileEx() listing) the first time a file in it is asked
+  /// about.  This saves resolving, or on Windows opening, every file's
+  /// full path.  The cache only notices changes made through this
+  /// object, so allow it only while nothing else writes files, e.g.
+  /// while deciding what to build.  Disallowing it drops the cache.
+  void AllowStatCache(bool allow);
+
+  /// Whether StatMany(), ReadFiles() and the stat cache's reading of
+  /// directories may batch their system calls through an io_uring; see
+  /// IoUring.  Disallowed to begin with: the kernel hands each stat and
+  /// open to a worker thread, which costs more than the system calls
+  /// saved while the files' metadata is cached, as it mostly is.
+  void AllowIoUring(bool allow) { use_io_uring_ = allow; }
+
+ private:
+  /// The mtimes of a directory's entries, or -1 where they couldn't be
+  /// had.  Empty if the directory doesn't exist.
+  typedef map<string, TimeStamp> DirCache;
+  typedef map<string, DirCache> StatCache;
+
+  /// Stat \a path from the cache, reading its directory if needed.
+  /// Returns false if the cache can't answer.
+  bool StatCached(const string& path, TimeStamp* mtime);
+  /// Forget what is cached about \a path, which is about to change.
+  void InvalidateStatCache(const string& path);
+
+  /// A ring no other thread is using, or NULL where io_uring can't be
+  /// used; hand it back with ReleaseRing().
+  IoUring* AcquireRing();
+  void ReleaseRing(IoUring* ring);
+
+  bool use_stat_cache_;
+  /// Stat() may be called from several threads; see
+  /// DependencyScan::Prefetch().
+  Mutex stat_cache_mutex_;
+  StatCache stat_cache_;
+
+  bool use_io_uring_;
+  /// The rings set up and not in use, guarded by rings_mutex_, and
+  /// whether setting one up failed.
+  Mutex rings_mutex_;
+  vector<IoUring*> rings_;
+  bool io_uring_unavailable_;
 };
 
 #endif  // NINJA_DISK_INTERFACE_H_
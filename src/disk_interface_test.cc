@@ -17,10 +17,13 @@
 #ifdef _WIN32
 #include <io.h>
 #include <windows.h>
+#else
+#include <utime.h>
 #endif
 
 #include "disk_interface.h"
 #include "graph.h"
+#include "io_uring.h"
 #include "test.h"
 
 namespace {
@@ -91,6 +94,33 @@ TEST_F(DiskInterfaceTest, ReadFile) {
   EXPECT_EQ("", err);
 }
 
+TEST_F(DiskInterfaceTest, WriteEvaluatedFile) {
+  BindingEnv env;
+  env.AddBinding("in", "a.o b.o");
+  EvalString contents;
+  contents.AddText("-o app ");
+  contents.AddSpecial("in");
+  string err;
+  ASSERT_TRUE(disk_.WriteEvaluatedFile("app.rsp", contents, &env));
+  EXPECT_EQ("-o app a.o b.o", disk_.ReadFile("app.rsp", &err));
+
+#ifndef _WIN32
+  // The same contents again leave the file alone...
+  struct utimbuf times = { 1, 1 };
+  ASSERT_EQ(0, utime("app.rsp", &times));
+  ASSERT_TRUE(disk_.WriteEvaluatedFile("app.rsp", contents, &env));
+  EXPECT_EQ(1000000000, disk_.Stat("app.rsp"));
+#endif
+
+  // ...but not more or less of them.
+  env.AddBinding("in", "a.o b.o c.o");
+  ASSERT_TRUE(disk_.WriteEvaluatedFile("app.rsp", contents, &env));
+  EXPECT_EQ("-o app a.o b.o c.o", disk_.ReadFile("app.rsp", &err));
+  env.AddBinding("in", "a.o");
+  ASSERT_TRUE(disk_.WriteEvaluatedFile("app.rsp", contents, &env));
+  EXPECT_EQ("-o app a.o", disk_.ReadFile("app.rsp", &err));
+}
+
 TEST_F(DiskInterfaceTest, MakeDirs) {
   EXPECT_TRUE(disk_.MakeDirs("path/with/double//slash/"));
 }
@@ -103,9 +133,142 @@ TEST_F(DiskInterfaceTest, RemoveFile) {
   EXPECT_EQ(1, disk_.RemoveFile("does not exist"));
 }
 
+TEST_F(DiskInterfaceTest, StatCache) {
+  ASSERT_TRUE(disk_.MakeDir("subdir"));
+  ASSERT_TRUE(Touch("subdir/file"));
+  ASSERT_TRUE(Touch("notadir"));
+  TimeStamp mtime = disk_.Stat("subdir/file");
+  ASSERT_GT(mtime, 1);
+
+  disk_.AllowStatCache(true);
+  EXPECT_EQ(mtime, disk_.Stat("subdir/file"));
+  EXPECT_EQ(0, disk_.Stat("subdir/nosuchfile"));
+  EXPECT_EQ(0, disk_.Stat("nosuchdir/nosuchfile"));
+  EXPECT_EQ(0, disk_.Stat("notadir/nosuchfile"));
+  EXPECT_GT(disk_.Stat("subdir"), 1);
+
+  // Changes made behind the cache's back go unnoticed...
+  ASSERT_TRUE(Touch("subdir/other"));
+  EXPECT_EQ(0, disk_.Stat("subdir/other"));
+  // ...but changes made through the interface don't.
+  ASSERT_TRUE(disk_.WriteFile("subdir/written", ""));
+  EXPECT_GT(disk_.Stat("subdir/written"), 1);
+  ASSERT_TRUE(disk_.MakeDir("nosuchdir"));
+  ASSERT_TRUE(disk_.WriteFile("nosuchdir/file", ""));
+  EXPECT_GT(disk_.Stat("nosuchdir/file"), 1);
+  EXPECT_EQ(0, disk_.RemoveFile("subdir/file"));
+  EXPECT_EQ(0, disk_.Stat("subdir/file"));
+
+  disk_.AllowStatCache(false);
+  EXPECT_GT(disk_.Stat("subdir/other"), 1);
+}
+
+TEST_F(DiskInterfaceTest, StatMany) {
+  ASSERT_TRUE(disk_.MakeDir("subdir"));
+  ASSERT_TRUE(Touch("subdir/file"));
+  ASSERT_TRUE(Touch("notadir"));
+  vector<string> paths;
+  paths.push_back("subdir/file");
+  paths.push_back("subdir");
+  paths.push_back("nosuchfile");
+  paths.push_back("notadir/nosuchfile");
+  paths.push_back("notadir");
+
+  // Through an io_uring where there is one, through the stat cache, and
+  // a file at a time, all as Stat() has them.
+  for (int way = 0; way < 3; ++way) {
+    disk_.AllowIoUring(way == 0);
+    disk_.AllowStatCache(way == 1);
+    vector<TimeStamp> mtimes;
+    disk_.StatMany(paths, &mtimes);
+    ASSERT_EQ(paths.size(), mtimes.size());
+    EXPECT_GT(mtimes[0], 1);
+    EXPECT_EQ(0, mtimes[2]);
+    for (size_t i = 0; i < paths.size(); ++i)
+      EXPECT_EQ(disk_.Stat(paths[i]), mtimes[i]) << paths[i];
+  }
+  disk_.AllowStatCache(false);
+}
+
+TEST_F(DiskInterfaceTest, ReadFiles) {
+  // Bigger than one read.
+  string big(200 << 10, 'x');
+  big[123456] = 'y';
+  ASSERT_TRUE(disk_.WriteFile("big", big));
+  ASSERT_TRUE(disk_.WriteFile("small", "small"));
+  ASSERT_TRUE(disk_.WriteFile("empty", ""));
+  vector<string> paths;
+  paths.push_back("big");
+  paths.push_back("small");
+  paths.push_back("empty");
+  paths.push_back("nosuchfile");
+
+  for (int way = 0; way < 2; ++way) {
+    disk_.AllowIoUring(way == 0);
+    vector<string> contents, errs;
+    disk_.ReadFiles(paths, &contents, &errs);
+    ASSERT_EQ(paths.size(), contents.size());
+    ASSERT_EQ(paths.size(), errs.size());
+    EXPECT_TRUE(big == contents[0]);
+    EXPECT_EQ("small", contents[1]);
+    EXPECT_EQ("", contents[2]);
+    EXPECT_EQ("", contents[3]);
+    for (size_t i = 0; i < paths.size(); ++i)
+      EXPECT_EQ("", errs[i]) << paths[i];
+  }
+}
+
+TEST_F(DiskInterfaceTest, IoUring) {
+  IoUring ring;
+  if (!ring.Init())
+    return;  // Not on this system.
+
+  // More than go in the ring at once.
+  vector<string> paths;
+  for (int i = 0; i < IoUring::kEntries + 10; ++i) {
+    char path[16];
+    sprintf(path, "f%d", i);
+    paths.push_back(path);
+    if (i % 2 == 0) {
+      ASSERT_TRUE(Touch(path));
+    }
+  }
+  vector<const char*> names;
+  for (size_t i = 0; i < paths.size(); ++i)
+    names.push_back(paths[i].c_str());
+  vector<TimeStamp> mtimes;
+  ring.Stat(names, &mtimes);
+  ASSERT_EQ(paths.size(), mtimes.size());
+  for (size_t i = 0; i < paths.size(); ++i)
+    EXPECT_EQ(disk_.Stat(paths[i]), mtimes[i]) << paths[i];
+
+  vector<string> contents;
+  vector<bool> ok;
+  ring.ReadFiles(paths, &contents, &ok);
+  for (size_t i = 0; i < paths.size(); ++i)
+    EXPECT_EQ(i % 2 == 0, (bool)ok[i]) << paths[i];
+}
+
+#ifdef _WIN32
+TEST_F(DiskInterfaceTest, StatCacheWindows) {
+  ASSERT_TRUE(disk_.MakeDir("subdir"));
+  ASSERT_TRUE(Touch("subdir\\File"));
+  TimeStamp mtime = disk_.Stat("subdir\\File");
+  ASSERT_GT(mtime, 1);
+
+  // Either slash, and any case, find the same entry.
+  disk_.AllowStatCache(true);
+  EXPECT_EQ(mtime, disk_.Stat("subdir/file"));
+  EXPECT_EQ(mtime, disk_.Stat("SUBDIR\\FILE"));
+  ASSERT_TRUE(disk_.WriteFile("subdir/written", ""));
+  EXPECT_GT(disk_.Stat("Subdir\\Written"), 1);
+  disk_.AllowStatCache(false);
+}
+#endif
+
 struct StatTest : public StateTestWithBuiltinRules,
                   public DiskInterface {
-  StatTest() : scan_(&state_, NULL, this) {}
+  StatTest() : scan_(&state_, NULL, NULL, this) {}
 
   // DiskInterface implementation.
   virtual TimeStamp Stat(const string& path);
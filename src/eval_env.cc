@@ -14,40 +14,141 @@
 
 #include "eval_env.h"
 
+#include <algorithm>
+#include <deque>
+
+#include "hash_map.h"
+#include "thread_pool.h"
+
+namespace {
+
+/// All interned variable names.  A deque never moves its elements, so the
+/// keys of ids and the references returned by Symbol::name() stay valid.
+struct SymbolTable {
+  Mutex mutex;
+  deque<string> names;
+  ExternalStringHashMap<int>::Type ids;
+};
+
+SymbolTable* GetSymbolTable() {
+  static SymbolTable* table = new SymbolTable;
+  return table;
+}
+
+/// Orders bindings by symbol, for searching a sorted Bindings vector.
+struct BindingLess {
+  bool operator()(const pair<Symbol, string>& binding, Symbol var) const {
+    return binding.first < var;
+  }
+};
+
+}  // anonymous namespace
+
+// static
+Symbol Symbol::Intern(StringPiece name) {
+  SymbolTable* table = GetSymbolTable();
+  ScopedLock lock(&table->mutex);
+  ExternalStringHashMap<int>::Type::iterator i = table->ids.find(name);
+  if (i != table->ids.end())
+    return Symbol(i->second);
+  int id = (int)table->names.size();
+  table->names.push_back(name.AsString());
+  table->ids[table->names.back()] = id;
+  return Symbol(id);
+}
+
+// static
+bool Symbol::Find(StringPiece name, Symbol* symbol) {
+  SymbolTable* table = GetSymbolTable();
+  ScopedLock lock(&table->mutex);
+  ExternalStringHashMap<int>::Type::iterator i = table->ids.find(name);
+  if (i == table->ids.end())
+    return false;
+  *symbol = Symbol(i->second);
+  return true;
+}
+
+const string& Symbol::name() const {
+  SymbolTable* table = GetSymbolTable();
+  ScopedLock lock(&table->mutex);
+  return table->names[id_];
+}
+
 string BindingEnv::LookupVariable(const string& var) {
-  map<string, string>::iterator i = bindings_.find(var);
-  if (i != bindings_.end())
-    return i->second;
+  Symbol symbol;
+  if (Symbol::Find(var, &symbol))
+    return LookupSymbol(symbol);
   if (parent_)
     return parent_->LookupVariable(var);
   return "";
 }
 
+string BindingEnv::LookupSymbol(Symbol var) {
+  Bindings::iterator i = lower_bound(bindings_.begin(), bindings_.end(), var,
+                                     BindingLess());
+  if (i != bindings_.end() && i->first == var)
+    return i->second;
+  if (parent_)
+    return parent_->LookupSymbol(var);
+  return "";
+}
+
+void BindingEnv::AppendSymbol(Symbol var, EvalSink* sink) {
+  Bindings::iterator i = lower_bound(bindings_.begin(), bindings_.end(), var,
+                                     BindingLess());
+  if (i != bindings_.end() && i->first == var)
+    sink->Append(i->second);
+  else if (parent_)
+    parent_->AppendSymbol(var, sink);
+}
+
 void BindingEnv::AddBinding(const string& key, const string& val) {
-  bindings_[key] = val;
+  AddBinding(Symbol::Intern(key), val);
+}
+
+void BindingEnv::AddBinding(Symbol key, const string& val) {
+  Bindings::iterator i = lower_bound(bindings_.begin(), bindings_.end(), key,
+                                     BindingLess());
+  if (i != bindings_.end() && i->first == key)
+    i->second = val;
+  else
+    bindings_.insert(i, make_pair(key, val));
 }
 
 string EvalString::Evaluate(Env* env) const {
   string result;
   for (TokenList::const_iterator i = parsed_.begin(); i != parsed_.end(); ++i) {
-    if (i->second == RAW)
-      result.append(i->first);
+    if (i->type == RAW)
+      result.append(i->text);
     else
-      result.append(env->LookupVariable(i->first));
+      result.append(env->LookupSymbol(i->symbol));
   }
   return result;
 }
 
+void EvalString::Evaluate(Env* env, EvalSink* sink) const {
+  for (TokenList::const_iterator i = parsed_.begin(); i != parsed_.end(); ++i) {
+    if (i->type == RAW)
+      sink->Append(i->text);
+    else
+      env->AppendSymbol(i->symbol, sink);
+  }
+}
+
 void EvalString::AddText(StringPiece text) {
   // Add it to the end of an existing RAW token if possible.
-  if (!parsed_.empty() && parsed_.back().second == RAW) {
-    parsed_.back().first.append(text.str_, text.len_);
+  if (!parsed_.empty() && parsed_.back().type == RAW) {
+    parsed_.back().text.append(text.str_, text.len_);
   } else {
-    parsed_.push_back(make_pair(text.AsString(), RAW));
+    parsed_.push_back(Token());
+    parsed_.back().type = RAW;
+    parsed_.back().text.assign(text.str_, text.len_);
   }
 }
 void EvalString::AddSpecial(StringPiece text) {
-  parsed_.push_back(make_pair(text.AsString(), SPECIAL));
+  parsed_.push_back(Token());
+  parsed_.back().type = SPECIAL;
+  parsed_.back().symbol = Symbol::Intern(text);
 }
 
 string EvalString::Serialize() const {
@@ -55,9 +156,12 @@ string EvalString::Serialize() const {
   for (TokenList::const_iterator i = parsed_.begin();
        i != parsed_.end(); ++i) {
     result.append("[");
-    if (i->second == SPECIAL)
+    if (i->type == SPECIAL) {
       result.append("$");
-    result.append(i->first);
+      result.append(i->symbol.name());
+    } else {
+      result.append(i->text);
+    }
     result.append("]");
   }
   return result;
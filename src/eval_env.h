@@ -22,10 +22,55 @@ using namespace std;
 
 #include "string_piece.h"
 
+/// A variable name interned as a small integer, so that scopes can be
+/// searched without comparing strings.  Symbols are process-wide and are
+/// never freed.
+struct Symbol {
+  Symbol() : id_(-1) {}
+
+  /// Return the symbol for \a name, adding it if necessary.  Safe to call
+  /// from several threads at once.
+  static Symbol Intern(StringPiece name);
+
+  /// Look up \a name without adding it.  Returns false if no symbol of
+  /// that name was ever interned, in which case no BindingEnv binds it.
+  static bool Find(StringPiece name, Symbol* symbol);
+
+  const string& name() const;
+
+  bool operator==(const Symbol& other) const { return id_ == other.id_; }
+  bool operator!=(const Symbol& other) const { return id_ != other.id_; }
+  bool operator<(const Symbol& other) const { return id_ < other.id_; }
+
+ private:
+  explicit Symbol(int id) : id_(id) {}
+  int id_;
+};
+
+/// What an EvalString can be evaluated into a piece at a time, rather
+/// than into one string.
+struct EvalSink {
+  virtual ~EvalSink() {}
+  virtual void Append(StringPiece text) = 0;
+};
+
 /// An interface for a scope for variable (e.g. "$foo") lookups.
 struct Env {
   virtual ~Env() {}
   virtual string LookupVariable(const string& var) = 0;
+
+  /// Look up an interned variable.  The default goes through its name;
+  /// Envs on hot paths override it.
+  virtual string LookupSymbol(Symbol var) {
+    return LookupVariable(var.name());
+  }
+
+  /// Append the value of an interned variable to \a sink.  The default
+  /// goes through LookupSymbol(); Envs whose values are large or already
+  /// at hand override it to save the copy.
+  virtual void AppendSymbol(Symbol var, EvalSink* sink) {
+    sink->Append(LookupSymbol(var));
+  }
 };
 
 /// An Env which contains a mapping of variables to values
@@ -35,10 +80,19 @@ struct BindingEnv : public Env {
   explicit BindingEnv(Env* parent) : parent_(parent) {}
   virtual ~BindingEnv() {}
   virtual string LookupVariable(const string& var);
+  virtual string LookupSymbol(Symbol var);
+  virtual void AppendSymbol(Symbol var, EvalSink* sink);
   void AddBinding(const string& key, const string& val);
+  void AddBinding(Symbol key, const string& val);
 
 private:
-  map<string, string> bindings_;
+  friend struct ManifestCache;
+  friend struct MemoryStats;
+  friend struct SubninjaIndex;
+
+  /// Bindings in this scope, sorted by symbol.
+  typedef vector<pair<Symbol, string> > Bindings;
+  Bindings bindings_;
   Env* parent_;
 };
 
@@ -46,6 +100,8 @@ private:
 /// Can be evaluated relative to an Env.
 struct EvalString {
   string Evaluate(Env* env) const;
+  /// Evaluate into \a sink, without building the whole string.
+  void Evaluate(Env* env, EvalSink* sink) const;
 
   void Clear() { parsed_.clear(); }
   bool empty() const { return parsed_.empty(); }
@@ -58,8 +114,17 @@ struct EvalString {
   string Serialize() const;
 
 private:
+  friend struct ManifestCache;
+  friend struct MemoryStats;
+
   enum TokenType { RAW, SPECIAL };
-  typedef vector<pair<string, TokenType> > TokenList;
+  /// Either literal text or, for SPECIAL, a variable reference.
+  struct Token {
+    TokenType type;
+    string text;
+    Symbol symbol;
+  };
+  typedef vector<Token> TokenList;
   TokenList parsed_;
 };
 
@@ -0,0 +1,76 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "eval_env.h"
+
+#include <gtest/gtest.h>
+
+namespace {
+
+TEST(Symbol, Intern) {
+  Symbol a = Symbol::Intern("eval_env_test_a");
+  EXPECT_EQ(a, Symbol::Intern("eval_env_test_a"));
+  EXPECT_NE(a, Symbol::Intern("eval_env_test_b"));
+  EXPECT_EQ("eval_env_test_a", a.name());
+
+  Symbol found;
+  EXPECT_TRUE(Symbol::Find("eval_env_test_a", &found));
+  EXPECT_EQ(a, found);
+  EXPECT_FALSE(Symbol::Find("eval_env_test_never_interned", &found));
+}
+
+TEST(BindingEnv, Scopes) {
+  BindingEnv outer;
+  outer.AddBinding("a", "outer_a");
+  outer.AddBinding("b", "outer_b");
+  BindingEnv inner(&outer);
+  inner.AddBinding("b", "inner_b");
+  inner.AddBinding("c", "inner_c");
+  inner.AddBinding("c", "inner_c2");
+
+  EXPECT_EQ("outer_a", inner.LookupVariable("a"));
+  EXPECT_EQ("inner_b", inner.LookupVariable("b"));
+  EXPECT_EQ("inner_c2", inner.LookupVariable("c"));
+  EXPECT_EQ("outer_b", outer.LookupVariable("b"));
+  EXPECT_EQ("", outer.LookupVariable("c"));
+  EXPECT_EQ("", inner.LookupVariable("eval_env_test_unbound"));
+
+  EXPECT_EQ("inner_b", inner.LookupSymbol(Symbol::Intern("b")));
+}
+
+/// An Env that only implements lookups by name.
+struct NameEnv : public Env {
+  virtual string LookupVariable(const string& var) {
+    return "<" + var + ">";
+  }
+};
+
+TEST(BindingEnv, NonBindingParent) {
+  NameEnv names;
+  BindingEnv env(&names);
+  env.AddBinding("x", "1");
+  EXPECT_EQ("1", env.LookupVariable("x"));
+  EXPECT_EQ("<eval_env_test_other>",
+            env.LookupVariable("eval_env_test_other"));
+
+  EvalString eval;
+  eval.AddText("x=");
+  eval.AddSpecial("x");
+  eval.AddText(" y=");
+  eval.AddSpecial("eval_env_test_y");
+  EXPECT_EQ("x=1 y=<eval_env_test_y>", eval.Evaluate(&env));
+  EXPECT_EQ("[x=][$x][ y=][$eval_env_test_y]", eval.Serialize());
+}
+
+}  // anonymous namespace
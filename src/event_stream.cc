@@ -0,0 +1,160 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "event_stream.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "graph.h"
+#include "metrics.h"
+#include "trace.h"
+
+struct EventStream::WriteTask : public ThreadPool::Task {
+  explicit WriteTask(FILE* file) : file_(file), error_(0) {}
+
+  virtual void Run() {
+    if (fwrite(data_.data(), data_.size(), 1, file_) < 1 ||
+        fflush(file_) != 0) {
+      error_ = errno ? errno : EIO;
+    }
+    data_.clear();
+  }
+
+  FILE* file_;
+  string data_;
+  int error_;
+};
+
+EventStream::EventStream()
+    : file_(NULL), pending_since_(0), write_task_(NULL), writing_(false),
+      writer_(NULL) {}
+
+EventStream::~EventStream() {
+  Close();
+}
+
+bool EventStream::Open(const string& where, string* err) {
+  char* end;
+  long fd = strtol(where.c_str(), &end, 10);
+  if (!where.empty() && *end == '\0') {
+#ifdef _WIN32
+    file_ = _fdopen((int)fd, "w");
+#else
+    file_ = fdopen((int)fd, "w");
+#endif
+  } else {
+    file_ = fopen(where.c_str(), "w");
+  }
+  if (!file_) {
+    *err = strerror(errno);
+    return false;
+  }
+  write_task_ = new WriteTask(file_);
+  writer_ = new ThreadPool(1);
+  return true;
+}
+
+void EventStream::PlanHasTotalEdges(int total) {
+  char buf[64];
+  snprintf(buf, sizeof(buf), "{\"event\":\"plan\",\"total\":%d}\n", total);
+  Add(buf);
+}
+
+void EventStream::EdgeStarted(Edge* edge, int time) {
+  char buf[64];
+  snprintf(buf, sizeof(buf), "{\"event\":\"start\",\"id\":%d,\"time\":%d,",
+           edge->id(), time);
+  string event = buf;
+  event += "\"outputs\":[";
+  for (vector<Node*>::iterator i = edge->outputs_.begin();
+       i != edge->outputs_.end(); ++i) {
+    if (i != edge->outputs_.begin())
+      event += ',';
+    event += JSONString((*i)->path());
+  }
+  event += "],\"description\":";
+  string description = edge->GetDescription();
+  event += JSONString(description.empty() ? edge->EvaluateCommand()
+                                          : description);
+  event += "}\n";
+  Add(event);
+}
+
+void EventStream::EdgeFinished(Edge* edge, bool success, int start_time,
+                               int end_time, const string& output) {
+  char buf[128];
+  snprintf(buf, sizeof(buf),
+           "{\"event\":\"finish\",\"id\":%d,\"success\":%s,\"start\":%d,"
+           "\"end\":%d,\"output\":",
+           edge->id(), success ? "true" : "false", start_time, end_time);
+  Add(buf + JSONString(output) + "}\n");
+}
+
+void EventStream::BuildFinished(bool success, const string& error) {
+  Add(string("{\"event\":\"result\",\"success\":") +
+      (success ? "true" : "false") + ",\"error\":" + JSONString(error) +
+      "}\n");
+  StartWrite(true);
+}
+
+void EventStream::Close() {
+  if (file_) {
+    StartWrite(true);
+    if (writing_)
+      writer_->Wait(write_task_);
+    writing_ = false;
+    fclose(file_);
+    file_ = NULL;
+  }
+  delete writer_;
+  writer_ = NULL;
+  delete write_task_;
+  write_task_ = NULL;
+}
+
+void EventStream::Add(const string& event) {
+  if (!file_)
+    return;
+  if (pending_.empty())
+    pending_since_ = GetTimeMillis();
+  pending_ += event;
+  if (pending_.size() >= kBatchBytes ||
+      GetTimeMillis() - pending_since_ >= kBatchMillis) {
+    StartWrite(pending_.size() >= kMaxPendingBytes);
+  }
+}
+
+void EventStream::StartWrite(bool wait) {
+  if (pending_.empty())
+    return;
+  if (writing_) {
+    if (!wait && !writer_->Done(write_task_))
+      return;
+    writer_->Wait(write_task_);
+    writing_ = false;
+    if (write_task_->error_) {
+      // The reader is gone; the build goes on without it.
+      Warning("writing events: %s", strerror(write_task_->error_));
+      fclose(file_);
+      file_ = NULL;
+      pending_.clear();
+      return;
+    }
+  }
+  write_task_->data_.swap(pending_);
+  writer_->Post(write_task_);
+  writing_ = true;
+}
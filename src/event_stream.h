@@ -0,0 +1,86 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef NINJA_EVENT_STREAM_H_
+#define NINJA_EVENT_STREAM_H_
+
+#include <stdio.h>
+
+#include <string>
+using namespace std;
+
+#include "thread_pool.h"
+#include "util.h"  // int64_t
+
+struct Edge;
+
+/// Writes what a build does as a stream of events, one JSON object per
+/// line, for --events: for CI and dashboards to follow a build without
+/// scraping its status lines.  Events are kept and written in batches on
+/// a thread of their own, so that a slow reader doesn't hold up the
+/// build.  Each has an "event" key, one of:
+///
+///   plan    "total": the commands to run, sent again as restat changes it
+///   start   "id", "outputs", "description", "time"
+///   finish  "id", "success", "start", "end", "output"
+///   result  "success", "error"
+///
+/// "id" is the same for an edge's start and finish; times are in
+/// milliseconds since the build started.
+struct EventStream {
+  EventStream();
+  /// Close().
+  ~EventStream();
+
+  /// Start writing to \a where: a file descriptor number, such as that
+  /// of a pipe or socket the caller opened, or else a path to write.
+  /// Returns false, filling in \a err, if it can't be used.
+  bool Open(const string& where, string* err);
+
+  void PlanHasTotalEdges(int total);
+  void EdgeStarted(Edge* edge, int time);
+  void EdgeFinished(Edge* edge, bool success, int start_time, int end_time,
+                    const string& output);
+  /// The build is over: \a error is why, if it didn't succeed.
+  void BuildFinished(bool success, const string& error);
+
+  /// Write all kept and stop.
+  void Close();
+
+  /// How long an event may be kept, and how much may be kept, before it
+  /// is written, if the last batch is written by then.
+  static const int64_t kBatchMillis = 100;
+  static const size_t kBatchBytes = 64 << 10;
+  /// How much may be kept while the last batch is being written, before
+  /// waiting for it.
+  static const size_t kMaxPendingBytes = 16 << 20;
+
+ private:
+  struct WriteTask;
+
+  /// Keep \a event, and write it and those kept if due.
+  void Add(const string& event);
+  /// Post what is kept for writing, if the last batch is written or if
+  /// \a wait, waiting for it.
+  void StartWrite(bool wait);
+
+  FILE* file_;
+  string pending_;
+  int64_t pending_since_;
+  WriteTask* write_task_;
+  bool writing_;
+  ThreadPool* writer_;
+};
+
+#endif  // NINJA_EVENT_STREAM_H_
@@ -0,0 +1,79 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "event_stream.h"
+
+#include "disk_interface.h"
+#include "graph.h"
+#include "test.h"
+
+struct EventStreamTest : public StateTestWithBuiltinRules {
+  virtual void SetUp() {
+    temp_dir_.CreateAndEnter("ninja_event_stream_test");
+  }
+
+  virtual void TearDown() {
+    temp_dir_.Cleanup();
+  }
+
+  ScopedTempDir temp_dir_;
+};
+
+TEST_F(EventStreamTest, Events) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"rule touch\n"
+"  command = touch $out\n"
+"  description = TOUCH $out\n"
+"build out1 out2: touch in\n"
+"build \"quoted\": cat in\n"));
+  Edge* touch = GetNode("out1")->in_edge();
+  Edge* cat = GetNode("\"quoted\"")->in_edge();
+
+  EventStream events;
+  string err;
+  ASSERT_TRUE(events.Open("events.json", &err)) << err;
+  events.PlanHasTotalEdges(2);
+  events.EdgeStarted(touch, 0);
+  events.EdgeStarted(cat, 5);
+  events.EdgeFinished(cat, false, 5, 10, "cat: in: No such file\n");
+  events.EdgeFinished(touch, true, 0, 20, "");
+  events.BuildFinished(false, "subcommand failed");
+  events.Close();
+
+  RealDiskInterface disk_interface;
+  char expected[512];
+  snprintf(expected, sizeof(expected),
+"{\"event\":\"plan\",\"total\":2}\n"
+"{\"event\":\"start\",\"id\":%d,\"time\":0,\"outputs\":[\"out1\",\"out2\"],"
+  "\"description\":\"TOUCH out1 out2\"}\n"
+"{\"event\":\"start\",\"id\":%d,\"time\":5,\"outputs\":[\"\\\"quoted\\\"\"],"
+  "\"description\":\"cat in > \\\"quoted\\\"\"}\n"
+"{\"event\":\"finish\",\"id\":%d,\"success\":false,\"start\":5,\"end\":10,"
+  "\"output\":\"cat: in: No such file\\u000a\"}\n"
+"{\"event\":\"finish\",\"id\":%d,\"success\":true,\"start\":0,\"end\":20,"
+  "\"output\":\"\"}\n"
+"{\"event\":\"result\",\"success\":false,\"error\":\"subcommand failed\"}\n",
+           touch->id(), cat->id(), cat->id(), touch->id());
+  EXPECT_EQ(expected, disk_interface.ReadFile("events.json", &err));
+}
+
+TEST_F(EventStreamTest, BadPath) {
+  EventStream events;
+  string err;
+  EXPECT_FALSE(events.Open("no/such/dir/events.json", &err));
+  EXPECT_EQ("No such file or directory", err);
+  // Events are dropped.
+  events.PlanHasTotalEdges(1);
+  events.Close();
+}
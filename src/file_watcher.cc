@@ -0,0 +1,203 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "file_watcher.h"
+
+#include <algorithm>
+
+#ifdef __linux__
+#include <errno.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+FileWatcher::FileWatcher() : fd_(-1), generation_(0), last_watched_(false) {}
+
+#ifdef __linux__
+
+namespace {
+
+/// The directory holding \a path, named as in the paths beside it.
+string DirName(const string& path) {
+  string::size_type slash = path.rfind('/');
+  if (slash == string::npos)
+    return ".";
+  if (slash == 0)
+    return "/";
+  return path.substr(0, slash);
+}
+
+/// The path of \a name in \a dir, named as DirName() names it.
+string JoinPath(const string& dir, const char* name) {
+  if (dir == ".")
+    return name;
+  if (dir == "/")
+    return dir + name;
+  return dir + "/" + name;
+}
+
+/// Anything that may change a file's mtime or existence, and the
+/// directory itself going away.
+const uint32_t kWatchMask = IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE |
+    IN_DELETE | IN_DELETE_SELF | IN_MODIFY | IN_MOVE_SELF | IN_MOVED_FROM |
+    IN_MOVED_TO;
+
+}  // anonymous namespace
+
+FileWatcher::~FileWatcher() {
+  if (fd_ >= 0)
+    close(fd_);
+}
+
+bool FileWatcher::Watch(const string& path) {
+  string dir = DirName(path);
+  if (dir == last_dir_)
+    return last_watched_;
+  last_dir_ = dir;
+  last_watched_ = WatchDir(dir);
+  return last_watched_;
+}
+
+bool FileWatcher::WatchDir(const string& dir) {
+  // Moving or removing a directory further up changes what the path
+  // leads to, and only that directory's own watch hears of it.
+  string parent = DirName(dir);
+  bool parent_watched = parent == dir || WatchDir(parent);
+
+  map<string, Watched>::iterator i = watches_.find(dir);
+  if (i != watches_.end())
+    return parent_watched && i->second.generation < generation_;
+
+  if (fd_ < 0) {
+    fd_ = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd_ < 0)
+      return false;
+  }
+  // This fails for a directory that doesn't exist (yet), and once the
+  // user's limit on watches is reached; Watch() tries again next time.
+  int wd = inotify_add_watch(fd_, dir.c_str(), kWatchMask);
+  if (wd < 0)
+    return false;
+  Watched watched = { wd, generation_ };
+  watches_[dir] = watched;
+  dirs_[wd].push_back(dir);
+  return false;
+}
+
+bool FileWatcher::ReadChanges(vector<string>* changed,
+                              vector<string>* gone_dirs) {
+  ++generation_;
+  last_dir_.clear();
+  if (fd_ < 0)
+    return true;
+
+  char buf[64 * 1024]
+      __attribute__((aligned(__alignof__(struct inotify_event))));
+  for (;;) {
+    ssize_t len = read(fd_, buf, sizeof(buf));
+    if (len < 0 && errno == EINTR)
+      continue;
+    if (len < 0 && errno == EAGAIN)
+      return true;
+    if (len <= 0) {
+      Clear();
+      return false;
+    }
+
+    for (char* p = buf; p < buf + len; ) {
+      const struct inotify_event* event = (struct inotify_event*)p;
+      p += sizeof(struct inotify_event) + event->len;
+      if (event->mask & (IN_Q_OVERFLOW | IN_UNMOUNT)) {
+        Clear();
+        return false;
+      }
+      map<int, vector<string> >::iterator dir = dirs_.find(event->wd);
+      if (dir == dirs_.end())
+        continue;
+      if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) {
+        // Its names lead elsewhere now, or nowhere, as may those of the
+        // directories below it.
+        vector<string> names = dir->second;
+        for (vector<string>::iterator d = names.begin(); d != names.end();
+             ++d) {
+          gone_dirs->push_back(*d);
+          Forget(*d);
+        }
+        continue;
+      }
+      if (!event->len)
+        continue;
+      for (vector<string>::iterator d = dir->second.begin();
+           d != dir->second.end(); ++d) {
+        changed->push_back(JoinPath(*d, event->name));
+      }
+    }
+  }
+}
+
+void FileWatcher::Forget(const string& dir) {
+  for (map<string, Watched>::iterator i = watches_.begin();
+       i != watches_.end(); ) {
+    if (!InDir(i->first, dir)) {
+      ++i;
+      continue;
+    }
+    int wd = i->second.wd;
+    vector<string>& names = dirs_[wd];
+    names.erase(find(names.begin(), names.end(), i->first));
+    if (names.empty()) {
+      // Fails harmlessly for a directory that's gone, which the kernel
+      // has stopped watching already.
+      inotify_rm_watch(fd_, wd);
+      dirs_.erase(wd);
+    }
+    watches_.erase(i++);
+  }
+}
+
+void FileWatcher::Clear() {
+  close(fd_);
+  fd_ = -1;
+  watches_.clear();
+  dirs_.clear();
+  last_dir_.clear();
+}
+
+#else  // __linux__
+
+FileWatcher::~FileWatcher() {}
+
+bool FileWatcher::Watch(const string& path) {
+  return false;
+}
+
+bool FileWatcher::ReadChanges(vector<string>* changed,
+                              vector<string>* gone_dirs) {
+  ++generation_;
+  return true;
+}
+
+void FileWatcher::Clear() {}
+
+#endif  // __linux__
+
+// static
+bool FileWatcher::InDir(const string& path, const string& dir) {
+  if (dir == ".")
+    return path.empty() || path[0] != '/';
+  if (dir == "/")
+    return !path.empty() && path[0] == '/';
+  return path.compare(0, dir.size(), dir) == 0 &&
+      (path.size() == dir.size() || path[dir.size()] == '/');
+}
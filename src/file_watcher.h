@@ -0,0 +1,83 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef NINJA_FILE_WATCHER_H_
+#define NINJA_FILE_WATCHER_H_
+
+#include <map>
+#include <string>
+#include <vector>
+using namespace std;
+
+/// Watches the directories of files for changes, so that a long-lived
+/// process (see "ninja -t server") can go on using the mtimes it looked
+/// up earlier for the files that haven't changed.  Uses inotify on
+/// Linux; elsewhere nothing is watched, and no mtime can be trusted.
+///
+/// Only a file's own entry is watched: a change to what a symlink
+/// points at, or inside a directory, goes unseen.  The directories
+/// above a file are watched too, for their being moved or removed.
+struct FileWatcher {
+  FileWatcher();
+  ~FileWatcher();
+
+  /// Watch the directory holding \a path and those above it, if they
+  /// aren't already.  Returns true if they were all being watched at
+  /// the last ReadChanges(), in which case ReadChanges() tells of any
+  /// change to \a path since then.
+  bool Watch(const string& path);
+
+  /// Add the paths of the files that have changed since the last call
+  /// to \a changed, as they were passed to Watch(), and those of the
+  /// watched directories that were moved or removed to \a gone_dirs;
+  /// anything in those may have changed (see InDir()).  Returns false
+  /// if changes may have been missed (the kernel dropped events); every
+  /// file may then have changed, and watching starts over.
+  bool ReadChanges(vector<string>* changed, vector<string>* gone_dirs);
+
+  /// Whether \a path names something in the directory \a dir, or below
+  /// it, going by their names alone.
+  static bool InDir(const string& path, const string& dir);
+
+ private:
+  /// Watch() for a directory, and the ones above it.
+  bool WatchDir(const string& dir);
+
+  /// Stop watching \a dir and the directories below it.
+  void Forget(const string& dir);
+
+  /// Stop watching everything.
+  void Clear();
+
+  int fd_;
+
+  struct Watched {
+    int wd;
+    /// The value of generation_ when the watch was added.
+    int generation;
+  };
+  /// Watched directories by name, and the names by watch descriptor
+  /// (there's more than one if a directory goes by several names).
+  map<string, Watched> watches_;
+  map<int, vector<string> > dirs_;
+  /// Calls to ReadChanges() so far.
+  int generation_;
+
+  /// The result of Watch() for the directory it last looked up, as
+  /// neighbouring paths tend to share directories.
+  string last_dir_;
+  bool last_watched_;
+};
+
+#endif  // NINJA_FILE_WATCHER_H_
@@ -0,0 +1,135 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "file_watcher.h"
+
+#include <algorithm>
+
+#ifdef __linux__
+#include <unistd.h>
+#endif
+
+#include "disk_interface.h"
+#include "test.h"
+
+#ifdef __linux__
+
+namespace {
+
+class FileWatcherTest : public testing::Test {
+ public:
+  virtual void SetUp() {
+    // These tests watch real directories, so create a temp dir.
+    temp_dir_.CreateAndEnter("Ninja-FileWatcherTest");
+    ASSERT_TRUE(disk_.MakeDir("subdir"));
+    ASSERT_TRUE(disk_.WriteFile("file", ""));
+    ASSERT_TRUE(disk_.WriteFile("subdir/file", ""));
+  }
+
+  virtual void TearDown() {
+    temp_dir_.Cleanup();
+  }
+
+  bool Changed(const vector<string>& changed, const string& path) {
+    return find(changed.begin(), changed.end(), path) != changed.end();
+  }
+
+  ScopedTempDir temp_dir_;
+  RealDiskInterface disk_;
+  FileWatcher watcher_;
+};
+
+TEST_F(FileWatcherTest, ReportsChanges) {
+  // Changes only count from the ReadChanges() after a directory's first
+  // Watch().
+  EXPECT_FALSE(watcher_.Watch("file"));
+  EXPECT_FALSE(watcher_.Watch("subdir/file"));
+  EXPECT_FALSE(watcher_.Watch("subdir/other"));
+  vector<string> changed;
+  vector<string> gone_dirs;
+  EXPECT_TRUE(watcher_.ReadChanges(&changed, &gone_dirs));
+  EXPECT_TRUE(changed.empty());
+  EXPECT_TRUE(watcher_.Watch("file"));
+  EXPECT_TRUE(watcher_.Watch("subdir/other"));
+
+  ASSERT_TRUE(disk_.WriteFile("subdir/file", "changed"));
+  ASSERT_TRUE(disk_.WriteFile("subdir/new", ""));
+  ASSERT_EQ(0, disk_.RemoveFile("file"));
+  EXPECT_TRUE(watcher_.ReadChanges(&changed, &gone_dirs));
+  EXPECT_TRUE(Changed(changed, "subdir/file"));
+  EXPECT_TRUE(Changed(changed, "subdir/new"));
+  EXPECT_TRUE(Changed(changed, "file"));
+  EXPECT_FALSE(Changed(changed, "subdir/other"));
+
+  changed.clear();
+  EXPECT_TRUE(watcher_.ReadChanges(&changed, &gone_dirs));
+  EXPECT_TRUE(changed.empty());
+}
+
+TEST_F(FileWatcherTest, MissingDirectory) {
+  EXPECT_FALSE(watcher_.Watch("nosuchdir/file"));
+  vector<string> changed;
+  vector<string> gone_dirs;
+  EXPECT_TRUE(watcher_.ReadChanges(&changed, &gone_dirs));
+  EXPECT_FALSE(watcher_.Watch("nosuchdir/file"));
+}
+
+TEST_F(FileWatcherTest, DirectoryRemoved) {
+  EXPECT_FALSE(watcher_.Watch("subdir/file"));
+  vector<string> changed;
+  vector<string> gone_dirs;
+  EXPECT_TRUE(watcher_.ReadChanges(&changed, &gone_dirs));
+  ASSERT_EQ(0, disk_.RemoveFile("subdir/file"));
+  ASSERT_EQ(0, rmdir("subdir"));
+
+  // Anything under it may have changed; the rest is still watched.
+  EXPECT_TRUE(watcher_.ReadChanges(&changed, &gone_dirs));
+  EXPECT_TRUE(Changed(gone_dirs, "subdir"));
+  EXPECT_FALSE(watcher_.Watch("subdir/file"));
+  EXPECT_TRUE(watcher_.Watch("file"));
+}
+
+TEST_F(FileWatcherTest, DirectoryAboveMoved) {
+  ASSERT_TRUE(disk_.MakeDir("subdir/deeper"));
+  ASSERT_TRUE(disk_.WriteFile("subdir/deeper/file", ""));
+  EXPECT_FALSE(watcher_.Watch("subdir/deeper/file"));
+  vector<string> changed;
+  vector<string> gone_dirs;
+  EXPECT_TRUE(watcher_.ReadChanges(&changed, &gone_dirs));
+  EXPECT_TRUE(watcher_.Watch("subdir/deeper/file"));
+
+  // Only the directory that moved hears of it, yet the paths below it
+  // now lead elsewhere.
+  ASSERT_EQ(0, rename("subdir", "moved"));
+  ASSERT_TRUE(disk_.MakeDir("subdir"));
+  EXPECT_TRUE(watcher_.ReadChanges(&changed, &gone_dirs));
+  EXPECT_TRUE(Changed(gone_dirs, "subdir"));
+  EXPECT_TRUE(FileWatcher::InDir("subdir/deeper/file", gone_dirs[0]));
+  EXPECT_FALSE(watcher_.Watch("subdir/deeper/file"));
+  EXPECT_TRUE(watcher_.Watch("file"));
+}
+
+TEST(FileWatcher, InDir) {
+  EXPECT_TRUE(FileWatcher::InDir("a/b", "a"));
+  EXPECT_TRUE(FileWatcher::InDir("a", "a"));
+  EXPECT_FALSE(FileWatcher::InDir("ab/c", "a"));
+  EXPECT_TRUE(FileWatcher::InDir("a/b", "."));
+  EXPECT_FALSE(FileWatcher::InDir("/a/b", "."));
+  EXPECT_TRUE(FileWatcher::InDir("/a/b", "/"));
+  EXPECT_FALSE(FileWatcher::InDir("a/b", "/"));
+}
+
+}  // anonymous namespace
+
+#endif  // __linux__
@@ -15,28 +15,82 @@
 #include "graph.h"
 
 #include <assert.h>
+#include <errno.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef _WIN32
+#define __STDC_FORMAT_MACROS
+#include <inttypes.h>
+#endif
+
+#include <memory>
 
 #include "build_log.h"
 #include "depfile_parser.h"
+#include "deps_log.h"
 #include "disk_interface.h"
 #include "explain.h"
 #include "manifest_parser.h"
 #include "metrics.h"
 #include "state.h"
+#include "thread_pool.h"
 #include "util.h"
 
+EdgeInputs::~EdgeInputs() {
+  free(nodes_);
+}
+
+void EdgeInputs::reserve(size_t count) {
+  if (count <= capacity_)
+    return;
+  nodes_ = (Node**)realloc(nodes_, count * sizeof(Node*));
+  if (!nodes_)
+    Fatal("out of memory");
+  capacity_ = (unsigned int)count;
+}
+
+EdgeInputs::iterator EdgeInputs::insert_gap(iterator pos, size_t count) {
+  size_t offset = pos - nodes_;
+  reserve(size_ + count);
+  memmove(nodes_ + offset + count, nodes_ + offset,
+          (size_ - offset) * sizeof(Node*));
+  size_ += (unsigned int)count;
+  return nodes_ + offset;
+}
+
+void EdgeInputs::erase(iterator first, iterator last) {
+  memmove(first, last, (end() - last) * sizeof(Node*));
+  size_ -= (unsigned int)(last - first);
+}
+
 bool Node::Stat(DiskInterface* disk_interface) {
   METRIC_RECORD("node stat");
-  mtime_ = disk_interface->Stat(path_);
-  return mtime_ > 0;
+  status_->mtime = disk_interface->Stat(path_);
+  return status_->mtime > 0;
 }
 
 bool DependencyScan::RecomputeDirty(Edge* edge, string* err) {
   bool dirty = false;
   edge->outputs_ready_ = true;
 
-  if (!edge->rule_->depfile().empty()) {
+  // An edge with a missing output is dirty whatever its depfile says, so
+  // don't read the depfile, or stat the files it lists, to find out.  The
+  // deps it would add can't make the edge any less ready either; like on
+  // a first build, the order-only deps in the manifest see to generated
+  // headers.
+  Node* missing_output = FindMissingOutput(edge);
+  if (missing_output) {
+    EXPLAIN("output %s doesn't exist", missing_output->path().c_str());
+    dirty = true;
+  } else if (!edge->rule_->deps().empty()) {
+    if (!LoadDepsFromLog(edge, err)) {
+      if (!err->empty())
+        return false;
+      dirty = true;
+    }
+  } else if (!edge->rule_->depfile().empty()) {
     if (!LoadDepFile(edge, err)) {
       if (!err->empty())
         return false;
@@ -48,9 +102,9 @@ bool DependencyScan::RecomputeDirty(Edge* edge, string* err) {
 
   // Visit all inputs; we're dirty if any of the inputs are dirty.
   Node* most_recent_input = NULL;
-  for (vector<Node*>::iterator i = edge->inputs_.begin();
+  for (EdgeInputs::iterator i = edge->inputs_.begin();
        i != edge->inputs_.end(); ++i) {
-    if ((*i)->StatIfNecessary(disk_interface_)) {
+    if (StatIfNecessary(*i)) {
       if (Edge* in_edge = (*i)->in_edge()) {
         if (!RecomputeDirty(in_edge, err))
           return false;
@@ -85,12 +139,10 @@ bool DependencyScan::RecomputeDirty(Edge* edge, string* err) {
   // We may also be dirty due to output state: missing outputs, out of
   // date outputs, etc.  Visit all outputs and determine whether they're dirty.
   if (!dirty) {
-    string command = edge->EvaluateCommand(true);
-
     for (vector<Node*>::iterator i = edge->outputs_.begin();
          i != edge->outputs_.end(); ++i) {
-      (*i)->StatIfNecessary(disk_interface_);
-      if (RecomputeOutputDirty(edge, most_recent_input, command, *i)) {
+      StatIfNecessary(*i);
+      if (RecomputeOutputDirty(edge, most_recent_input, *i)) {
         dirty = true;
         break;
       }
@@ -101,7 +153,7 @@ bool DependencyScan::RecomputeDirty(Edge* edge, string* err) {
   // their dirty state if necessary.
   for (vector<Node*>::iterator i = edge->outputs_.begin();
        i != edge->outputs_.end(); ++i) {
-    (*i)->StatIfNecessary(disk_interface_);
+    StatIfNecessary(*i);
     if (dirty)
       (*i)->MarkDirty();
   }
@@ -117,9 +169,21 @@ bool DependencyScan::RecomputeDirty(Edge* edge, string* err) {
   return true;
 }
 
+Node* DependencyScan::FindMissingOutput(Edge* edge) {
+  // Phony edges write no outputs; see RecomputeOutputDirty().
+  if (edge->is_phony())
+    return NULL;
+  for (vector<Node*>::iterator i = edge->outputs_.begin();
+       i != edge->outputs_.end(); ++i) {
+    StatIfNecessary(*i);
+    if (!(*i)->exists())
+      return *i;
+  }
+  return NULL;
+}
+
 bool DependencyScan::RecomputeOutputDirty(Edge* edge,
                                           Node* most_recent_input,
-                                          const string& command,
                                           Node* output) {
   if (edge->is_phony()) {
     // Phony edges don't write any output.  Outputs are only dirty if
@@ -141,17 +205,23 @@ bool DependencyScan::RecomputeOutputDirty(Edge* edge,
     // rule in a previous run and stored the most recent input mtime in the
     // build log.  Use that mtime instead, so that the file will only be
     // considered dirty if an input was modified since the previous run.
+    // With content digests, it is also clean if its inputs have the
+    // contents they had when it was built, whatever their mtimes.
     TimeStamp most_recent_stamp = most_recent_input->mtime();
-    if (edge->rule_->restat() && build_log() &&
-        (entry = build_log()->LookupByOutput(output->path()))) {
-      if (entry->restat_mtime < most_recent_stamp) {
-        EXPLAIN("restat of output %s older than most recent input %s (%d vs %d)",
+    if ((edge->rule_->restat() || content_digests_) && build_log())
+      entry = build_log()->LookupByOutput(output);
+    if (edge->rule_->restat() && entry) {
+      if (entry->restat_mtime < most_recent_stamp &&
+          !InputsUnchanged(edge, entry->input_digest)) {
+        EXPLAIN("restat of output %s older than most recent input %s "
+                "(%" PRId64 " vs %" PRId64 ")",
             output->path().c_str(), most_recent_input->path().c_str(),
             entry->restat_mtime, most_recent_stamp);
         return true;
       }
-    } else {
-      EXPLAIN("output %s older than most recent input %s (%d vs %d)",
+    } else if (!entry || !InputsUnchanged(edge, entry->input_digest)) {
+      EXPLAIN("output %s older than most recent input %s "
+              "(%" PRId64 " vs %" PRId64 ")",
           output->path().c_str(), most_recent_input->path().c_str(),
           output->mtime(), most_recent_stamp);
       return true;
@@ -162,8 +232,8 @@ bool DependencyScan::RecomputeOutputDirty(Edge* edge,
   // But if this is a generator rule, the command changing does not make us
   // dirty.
   if (!edge->rule_->generator() && build_log()) {
-    if (entry || (entry = build_log()->LookupByOutput(output->path()))) {
-      if (BuildLog::LogEntry::HashCommand(command) != entry->command_hash) {
+    if (entry || (entry = build_log()->LookupByOutput(output))) {
+      if (edge->GetCommandHash() != entry->command_hash) {
         EXPLAIN("command line changed for %s", output->path().c_str());
         return true;
       }
@@ -177,8 +247,56 @@ bool DependencyScan::RecomputeOutputDirty(Edge* edge,
   return false;
 }
 
+bool DependencyScan::InputsUnchanged(Edge* edge, uint64_t input_digest) {
+  return content_digests_ && input_digest != 0 &&
+      InputsDigest(edge) == input_digest;
+}
+
+uint64_t DependencyScan::NodeDigest(Node* node) {
+  StatIfNecessary(node);
+  if (!node->exists())
+    return 0;
+  if (deps_log_) {
+    const DepsLog::Digest* digest = deps_log_->GetDigest(node);
+    if (digest && digest->mtime == node->mtime())
+      return digest->digest;
+  }
+  string err;
+  string contents = disk_interface_->ReadFile(node->path(), &err);
+  if (!err.empty())
+    return 0;
+  // Never 0, which is a missing file.
+  uint64_t digest = BuildLog::LogEntry::HashCommand(contents) | 1;
+  if (deps_log_ && !deps_log_->RecordDigest(node, node->mtime(), digest))
+    Error("recording digest of %s: %s", node->path().c_str(),
+          strerror(errno));
+  return digest;
+}
+
+uint64_t DependencyScan::InputsDigest(Edge* edge, const vector<Node*>* deps) {
+  string digests;
+  EdgeInputs::iterator end = edge->inputs_.end() - edge->order_only_deps_;
+  if (deps)
+    end -= edge->depfile_deps_;
+  for (EdgeInputs::iterator i = edge->inputs_.begin(); i != end; ++i) {
+    uint64_t digest = NodeDigest(*i);
+    digests.append((*i)->path());
+    digests.append(reinterpret_cast<const char*>(&digest), sizeof(digest));
+  }
+  if (deps) {
+    for (vector<Node*>::const_iterator i = deps->begin(); i != deps->end();
+         ++i) {
+      uint64_t digest = NodeDigest(*i);
+      digests.append((*i)->path());
+      digests.append(reinterpret_cast<const char*>(&digest), sizeof(digest));
+    }
+  }
+  // Never 0, which is no digest recorded.
+  return BuildLog::LogEntry::HashCommand(digests) | 1;
+}
+
 bool Edge::AllInputsReady() const {
-  for (vector<Node*>::const_iterator i = inputs_.begin();
+  for (EdgeInputs::const_iterator i = inputs_.begin();
        i != inputs_.end(); ++i) {
     if ((*i)->in_edge() && !(*i)->in_edge()->outputs_ready())
       return false;
@@ -186,64 +304,158 @@ bool Edge::AllInputsReady() const {
   return true;
 }
 
+namespace {
+
+/// Collects what is evaluated into it in a string.
+struct StringSink : public EvalSink {
+  explicit StringSink(string* out) : out_(out) {}
+  virtual void Append(StringPiece text) { out_->append(text.str_, text.len_); }
+  string* out_;
+};
+
+/// Measures what is evaluated into it.
+struct LengthSink : public EvalSink {
+  LengthSink() : len_(0) {}
+  virtual void Append(StringPiece text) { len_ += text.len_; }
+  uint64_t len_;
+};
+
+/// Hashes what is evaluated into it.
+struct HashSink : public EvalSink {
+  explicit HashSink(uint64_t len) : hasher_(len) {}
+  virtual void Append(StringPiece text) { hasher_.Update(text); }
+  BuildLog::LogEntry::CommandHasher hasher_;
+};
+
+}  // anonymous namespace
+
 /// An Env for an Edge, providing $in and $out.
 struct EdgeEnv : public Env {
   explicit EdgeEnv(Edge* edge) : edge_(edge) {}
   virtual string LookupVariable(const string& var);
+  virtual string LookupSymbol(Symbol var);
+  /// Appends the paths of $in and $out one by one.
+  virtual void AppendSymbol(Symbol var, EvalSink* sink);
 
   /// Given a span of Nodes, construct a list of paths suitable for a command
   /// line.  XXX here is where shell-escaping of e.g spaces should happen.
-  string MakePathList(vector<Node*>::iterator begin,
-                      vector<Node*>::iterator end,
-                      char sep);
+  template<typename Iterator>
+  string MakePathList(Iterator begin, Iterator end, char sep);
+  /// MakePathList() into \a sink.
+  template<typename Iterator>
+  void AppendPathList(Iterator begin, Iterator end, char sep, EvalSink* sink);
 
   Edge* edge_;
 };
 
 string EdgeEnv::LookupVariable(const string& var) {
-  if (var == "in" || var == "in_newline") {
+  return LookupSymbol(Symbol::Intern(var));
+}
+
+string EdgeEnv::LookupSymbol(Symbol var) {
+  static const Symbol kIn = Symbol::Intern("in");
+  static const Symbol kInNewline = Symbol::Intern("in_newline");
+  static const Symbol kOut = Symbol::Intern("out");
+
+  if (var == kIn || var == kInNewline) {
     int explicit_deps_count = edge_->inputs_.size() - edge_->implicit_deps_ -
       edge_->order_only_deps_;
     return MakePathList(edge_->inputs_.begin(),
                         edge_->inputs_.begin() + explicit_deps_count,
-                        var == "in" ? ' ' : '\n');
-  } else if (var == "out") {
+                        var == kIn ? ' ' : '\n');
+  } else if (var == kOut) {
     return MakePathList(edge_->outputs_.begin(),
                         edge_->outputs_.end(),
                         ' ');
   } else if (edge_->env_) {
-    return edge_->env_->LookupVariable(var);
+    return edge_->env_->LookupSymbol(var);
   } else {
     // XXX should we warn here?
     return string();
   }
 }
 
-string EdgeEnv::MakePathList(vector<Node*>::iterator begin,
-                             vector<Node*>::iterator end,
-                             char sep) {
-  string result;
-  for (vector<Node*>::iterator i = begin; i != end; ++i) {
-    if (!result.empty())
-      result.push_back(sep);
+void EdgeEnv::AppendSymbol(Symbol var, EvalSink* sink) {
+  static const Symbol kIn = Symbol::Intern("in");
+  static const Symbol kInNewline = Symbol::Intern("in_newline");
+  static const Symbol kOut = Symbol::Intern("out");
+
+  if (var == kIn || var == kInNewline) {
+    int explicit_deps_count = edge_->inputs_.size() - edge_->implicit_deps_ -
+      edge_->order_only_deps_;
+    AppendPathList(edge_->inputs_.begin(),
+                   edge_->inputs_.begin() + explicit_deps_count,
+                   var == kIn ? ' ' : '\n', sink);
+  } else if (var == kOut) {
+    AppendPathList(edge_->outputs_.begin(), edge_->outputs_.end(), ' ', sink);
+  } else if (edge_->env_) {
+    edge_->env_->AppendSymbol(var, sink);
+  }
+}
+
+template<typename Iterator>
+void EdgeEnv::AppendPathList(Iterator begin, Iterator end, char sep,
+                             EvalSink* sink) {
+  for (Iterator i = begin; i != end; ++i) {
+    if (i != begin)
+      sink->Append(StringPiece(&sep, 1));
     const string& path = (*i)->path();
     if (path.find(" ") != string::npos) {
-      result.append("\"");
-      result.append(path);
-      result.append("\"");
+      sink->Append("\"");
+      sink->Append(path);
+      sink->Append("\"");
     } else {
-      result.append(path);
+      sink->Append(path);
     }
   }
+}
+
+template<typename Iterator>
+string EdgeEnv::MakePathList(Iterator begin, Iterator end, char sep) {
+  string result;
+  StringSink sink(&result);
+  AppendPathList(begin, end, sep, &sink);
   return result;
 }
 
 string Edge::EvaluateCommand(bool incl_rsp_file) {
+  if (!command_known_) {
+    EdgeEnv env(this);
+    command_ = rule_->command().Evaluate(&env);
+    command_known_ = true;
+  }
+  if (incl_rsp_file && HasRspFile())
+    return command_ + ";rspfile=" + GetRspFileContent();
+  return command_;
+}
+
+void Edge::EvaluateCommand(bool incl_rsp_file, EvalSink* sink) {
   EdgeEnv env(this);
-  string command = rule_->command().Evaluate(&env);
-  if (incl_rsp_file && HasRspFile()) 
-    command += ";rspfile=" + GetRspFileContent();
-  return command;
+  if (command_known_)
+    sink->Append(command_);
+  else
+    rule_->command().Evaluate(&env, sink);
+  if (incl_rsp_file && HasRspFile()) {
+    sink->Append(";rspfile=");
+    rule_->rspfile_content().Evaluate(&env, sink);
+  }
+}
+
+uint64_t Edge::GetCommandHash() {
+  if (!command_hash_known_) {
+    // Most edges are only hashed, to check them against the build log,
+    // and a static link's command and response file can be tens of MB:
+    // hash them a piece at a time, as evaluated, rather than build the
+    // string.  The hash needs the length first, so that comes from an
+    // evaluation of its own.
+    LengthSink length;
+    EvaluateCommand(true, &length);
+    HashSink hash(length.len_);
+    EvaluateCommand(true, &hash);
+    command_hash_ = hash.hasher_.Finish();
+    command_hash_known_ = true;
+  }
+  return command_hash_;
 }
 
 string Edge::EvaluateDepFile() {
@@ -251,6 +463,26 @@ string Edge::EvaluateDepFile() {
   return rule_->depfile().Evaluate(&env);
 }
 
+string Edge::EvaluatePool() {
+  EdgeEnv env(this);
+  return rule_->pool().Evaluate(&env);
+}
+
+string Edge::EvaluatePoolWeight() {
+  EdgeEnv env(this);
+  return rule_->pool_weight().Evaluate(&env);
+}
+
+string Edge::EvaluateRemoteInputs() {
+  EdgeEnv env(this);
+  return rule_->remote_inputs().Evaluate(&env);
+}
+
+string Edge::GetDepsType() {
+  EdgeEnv env(this);
+  return rule_->deps().Evaluate(&env);
+}
+
 string Edge::GetDescription() {
   EdgeEnv env(this);
   return rule_->description().Evaluate(&env);
@@ -270,22 +502,357 @@ string Edge::GetRspFileContent() {
   return rule_->rspfile_content().Evaluate(&env);
 }
 
+bool Edge::WriteRspFile(DiskInterface* disk_interface, const string& path) {
+  EdgeEnv env(this);
+  return disk_interface->WriteEvaluatedFile(path, rule_->rspfile_content(),
+                                            &env);
+}
+
+/// A depfile read from disk and parsed, possibly ahead of time on
+/// another thread by DependencyScan::Prefetch().
+struct DepFileData {
+  explicit DepFileData(const string& path)
+      : path_(path), canonicalized_(false) {}
+
+  /// Read and parse the file.  Safe to call on any thread.
+  void Read(DiskInterface* disk_interface) {
+    string err;
+    string content = disk_interface->ReadFile(path_, &err);
+    Parse(&content, err);
+  }
+
+  /// Parse \a content, which the file was read as, taking it; \a err
+  /// is the error reading it, if any.  Safe to call on any thread.
+  void Parse(string* content, const string& err) {
+    content_.swap(*content);
+    err_ = err;
+    if (!err_.empty() || content_.empty())
+      return;
+    string parse_err;
+    if (!parser_.Parse(&content_, &parse_err))
+      err_ = path_ + ": " + parse_err;
+  }
+
+  /// Canonicalize the parsed inputs in place, once; later calls return
+  /// the first call's result.  Main thread only, as CanonicalizePath()
+  /// records metrics.
+  bool Canonicalize(string* err) {
+    if (!canonicalized_) {
+      canonicalized_ = true;
+      CanonicalizePaths(&parser_.ins_, &canonicalize_err_);
+    }
+    *err = canonicalize_err_;
+    return canonicalize_err_.empty();
+  }
+
+  /// True if the file was read and parsed fine but is empty or missing.
+  bool missing() const { return err_.empty() && content_.empty(); }
+
+  string path_;
+  /// The parser's results point into this.
+  string content_;
+  /// An error reading or parsing the file.
+  string err_;
+  DepfileParser parser_;
+  bool canonicalized_;
+  string canonicalize_err_;
+};
+
+namespace {
+
+/// A batch of the stats and depfile reads done by Prefetch(), so that
+/// the thread pool isn't handed one tiny task per file, and the
+/// DiskInterface can have the disk work on the whole batch at once.
+struct PrefetchTask : public ThreadPool::Task {
+  explicit PrefetchTask(DiskInterface* disk_interface)
+      : disk_interface_(disk_interface) {}
+
+  virtual void Run() {
+    vector<string> paths;
+    for (size_t i = 0; i < nodes_.size(); ++i)
+      paths.push_back(nodes_[i]->path());
+    disk_interface_->StatMany(paths, &mtimes_);
+
+    paths.clear();
+    for (size_t i = 0; i < depfiles_.size(); ++i)
+      paths.push_back(depfiles_[i]->path_);
+    vector<string> contents, errs;
+    disk_interface_->ReadFiles(paths, &contents, &errs);
+    for (size_t i = 0; i < depfiles_.size(); ++i)
+      depfiles_[i]->Parse(&contents[i], errs[i]);
+  }
+
+  DiskInterface* disk_interface_;
+  vector<Node*> nodes_;
+  vector<TimeStamp> mtimes_;
+  vector<DepFileData*> depfiles_;
+};
+
+/// Gathers work for Prefetch() into PrefetchTasks, and posts each one as
+/// soon as it is full so the workers start while the graph is walked.
+struct PrefetchQueue {
+  PrefetchQueue(ThreadPool* pool, DiskInterface* disk_interface)
+      : pool_(pool), disk_interface_(disk_interface), task_(NULL),
+        task_size_(0) {}
+  ~PrefetchQueue() {
+    delete task_;
+    for (vector<PrefetchTask*>::iterator i = tasks_.begin();
+         i != tasks_.end(); ++i) {
+      delete *i;
+    }
+  }
+
+  void AddNode(Node* node) {
+    Task()->nodes_.push_back(node);
+    MaybePost();
+  }
+
+  void AddDepFile(DepFileData* depfile) {
+    Task()->depfiles_.push_back(depfile);
+    MaybePost();
+  }
+
+  /// Post what has been added so far and wait for all of it, storing
+  /// the stat results in \a mtimes by node id.  Errors are left out, to
+  /// be hit (and reported) again by the scan.
+  void Finish(vector<TimeStamp>* mtimes) {
+    Post();
+    for (vector<PrefetchTask*>::iterator t = tasks_.begin();
+         t != tasks_.end(); ++t) {
+      pool_->Wait(*t);
+      for (size_t i = 0; i < (*t)->nodes_.size(); ++i) {
+        if ((*t)->mtimes_[i] != -1)
+          (*mtimes)[(*t)->nodes_[i]->id()] = (*t)->mtimes_[i];
+      }
+    }
+  }
+
+ private:
+  enum { kBatchSize = 64 };
+
+  PrefetchTask* Task() {
+    if (!task_)
+      task_ = new PrefetchTask(disk_interface_);
+    return task_;
+  }
+
+  void MaybePost() {
+    if (++task_size_ == kBatchSize)
+      Post();
+  }
+
+  void Post() {
+    if (!task_)
+      return;
+    tasks_.push_back(task_);
+    pool_->Post(task_);
+    task_ = NULL;
+    task_size_ = 0;
+  }
+
+  ThreadPool* pool_;
+  DiskInterface* disk_interface_;
+  PrefetchTask* task_;
+  int task_size_;
+  vector<PrefetchTask*> tasks_;
+};
+
+}  // anonymous namespace
+
+DependencyScan::~DependencyScan() {
+  for (map<Edge*, DepFileData*>::iterator i = prefetched_depfiles_.begin();
+       i != prefetched_depfiles_.end(); ++i) {
+    delete i->second;
+  }
+}
+
+void DependencyScan::Prefetch(const vector<Node*>& targets, int threads) {
+  METRIC_RECORD("dependency prefetch");
+  ThreadPool pool(threads);
+  prefetched_mtimes_.resize(state_->nodes_.size(), -1);
+  vector<bool> node_seen(state_->nodes_.size());
+  vector<bool> edge_seen(state_->edges_.size());
+  vector<Edge*> edges;
+  vector<Edge*> deps_edges;
+  vector<pair<Edge*, DepFileData*> > depfiles;
+  vector<DepsLog::Deps*> logged_deps;
+
+  // Stat what RecomputeDirty() will.  Like RecomputeDirty(), don't look
+  // past nodes whose status is already known.  Nodes given mtimes by
+  // UseMtimes() are visited, not stat'ed.
+  {
+    PrefetchQueue queue(&pool, disk_interface_);
+    for (vector<Node*>::const_iterator i = targets.begin();
+         i != targets.end(); ++i) {
+      if (node_seen[(*i)->id()])
+        continue;
+      node_seen[(*i)->id()] = true;
+      if (!(*i)->status_known() && prefetched_mtimes_[(*i)->id()] == -1)
+        queue.AddNode(*i);
+      Edge* edge = (*i)->in_edge();
+      if (edge && !edge_seen[edge->id()]) {
+        edge_seen[edge->id()] = true;
+        edges.push_back(edge);
+      }
+    }
+
+    while (!edges.empty()) {
+      Edge* edge = edges.back();
+      edges.pop_back();
+
+      if (!edge->rule_->deps().empty() ||
+          (!edge->rule_->depfile().empty() &&
+           prefetched_depfiles_.find(edge) == prefetched_depfiles_.end())) {
+        deps_edges.push_back(edge);
+      }
+
+      for (vector<Node*>::iterator i = edge->outputs_.begin();
+           i != edge->outputs_.end(); ++i) {
+        if (node_seen[(*i)->id()])
+          continue;
+        node_seen[(*i)->id()] = true;
+        if (!(*i)->status_known() && prefetched_mtimes_[(*i)->id()] == -1)
+          queue.AddNode(*i);
+      }
+
+      for (EdgeInputs::iterator i = edge->inputs_.begin();
+           i != edge->inputs_.end(); ++i) {
+        if (node_seen[(*i)->id()])
+          continue;
+        node_seen[(*i)->id()] = true;
+        if ((*i)->status_known())
+          continue;
+        if (prefetched_mtimes_[(*i)->id()] == -1)
+          queue.AddNode(*i);
+        Edge* in_edge = (*i)->in_edge();
+        if (in_edge && !edge_seen[in_edge->id()]) {
+          edge_seen[in_edge->id()] = true;
+          edges.push_back(in_edge);
+        }
+      }
+    }
+
+    queue.Finish(&prefetched_mtimes_);
+  }
+
+  // Read the depfiles RecomputeDirty() will load, which now that the
+  // outputs have been stat'ed leaves out those of edges it won't.
+  {
+    PrefetchQueue queue(&pool, disk_interface_);
+    for (vector<Edge*>::iterator i = deps_edges.begin();
+         i != deps_edges.end(); ++i) {
+      Edge* edge = *i;
+      if (HasMissingOutput(edge))
+        continue;
+      if (!edge->rule_->deps().empty()) {
+        DepsLog::Deps* deps =
+            deps_log_ ? deps_log_->GetDeps(edge->outputs_[0]) : NULL;
+        if (deps)
+          logged_deps.push_back(deps);
+      } else {
+        DepFileData* depfile = new DepFileData(edge->EvaluateDepFile());
+        depfiles.push_back(make_pair(edge, depfile));
+        queue.AddDepFile(depfile);
+      }
+    }
+    queue.Finish(&prefetched_mtimes_);
+  }
+
+  // Stat the inputs the depfiles and the deps log add.  Nodes are created
+  // for the depfiles' now rather than in LoadDepFile(), which would create
+  // them anyway.
+  PrefetchQueue queue(&pool, disk_interface_);
+  for (vector<DepsLog::Deps*>::iterator i = logged_deps.begin();
+       i != logged_deps.end(); ++i) {
+    for (int j = 0; j < (*i)->node_count; ++j) {
+      Node* node = (*i)->nodes[j];
+      size_t id = node->id();
+      if (node_seen[id])
+        continue;
+      node_seen[id] = true;
+      if (!node->status_known() && prefetched_mtimes_[id] == -1)
+        queue.AddNode(node);
+    }
+  }
+  for (vector<pair<Edge*, DepFileData*> >::iterator i = depfiles.begin();
+       i != depfiles.end(); ++i) {
+    prefetched_depfiles_[i->first] = i->second;
+    DepFileData* depfile = i->second;
+    string err;
+    if (!depfile->err_.empty() || depfile->missing() ||
+        !depfile->Canonicalize(&err)) {
+      continue;
+    }
+    for (vector<StringPiece>::iterator in = depfile->parser_.ins_.begin();
+         in != depfile->parser_.ins_.end(); ++in) {
+      Node* node = state_->GetNode(*in);
+      size_t id = node->id();
+      if (id >= prefetched_mtimes_.size()) {
+        prefetched_mtimes_.resize(id + 1, -1);
+        node_seen.resize(id + 1);
+      }
+      if (node_seen[id])
+        continue;
+      node_seen[id] = true;
+      if (!node->status_known() && prefetched_mtimes_[id] == -1)
+        queue.AddNode(node);
+    }
+  }
+  queue.Finish(&prefetched_mtimes_);
+}
+
+bool DependencyScan::HasMissingOutput(Edge* edge) const {
+  if (edge->is_phony())
+    return false;
+  for (vector<Node*>::iterator i = edge->outputs_.begin();
+       i != edge->outputs_.end(); ++i) {
+    TimeStamp mtime;
+    if ((*i)->status_known())
+      mtime = (*i)->mtime();
+    else
+      mtime = prefetched_mtimes_[(*i)->id()];
+    // -1 is a failed stat, which the scan will report.
+    if (mtime == 0)
+      return true;
+  }
+  return false;
+}
+
+bool DependencyScan::StatIfNecessary(Node* node) {
+  if (node->status_known())
+    return false;
+  size_t id = node->id();
+  if (id < prefetched_mtimes_.size() && prefetched_mtimes_[id] != -1) {
+    node->set_mtime(prefetched_mtimes_[id]);
+    prefetched_mtimes_[id] = -1;
+    return true;
+  }
+  node->Stat(disk_interface_);
+  return true;
+}
+
 bool DependencyScan::LoadDepFile(Edge* edge, string* err) {
   METRIC_RECORD("depfile load");
-  string path = edge->EvaluateDepFile();
-  string content = disk_interface_->ReadFile(path, err);
-  if (!err->empty())
+  auto_ptr<DepFileData> data;
+  map<Edge*, DepFileData*>::iterator prefetched =
+      prefetched_depfiles_.find(edge);
+  if (prefetched != prefetched_depfiles_.end()) {
+    data.reset(prefetched->second);
+    prefetched_depfiles_.erase(prefetched);
+  } else {
+    data.reset(new DepFileData(edge->EvaluateDepFile()));
+    data->Read(disk_interface_);
+  }
+  if (!data->err_.empty()) {
+    *err = data->err_;
     return false;
+  }
   // On a missing depfile: return false and empty *err.
-  if (content.empty())
+  if (data->missing())
     return false;
 
-  DepfileParser depfile;
-  string depfile_err;
-  if (!depfile.Parse(&content, &depfile_err)) {
-    *err = path + ": " + depfile_err;
-    return false;
-  }
+  const string& path = data->path_;
+  DepfileParser& depfile = data->parser_;
 
   // Check that this depfile matches the edge's output.
   Node* first_output = edge->outputs_[0];
@@ -296,47 +863,78 @@ bool DependencyScan::LoadDepFile(Edge* edge, string* err) {
     return false;
   }
 
-  // Preallocate space in edge->inputs_ to be filled in below.
-  edge->inputs_.insert(edge->inputs_.end() - edge->order_only_deps_,
-                       depfile.ins_.size(), 0);
-  edge->implicit_deps_ += depfile.ins_.size();
-  vector<Node*>::iterator implicit_dep =
-      edge->inputs_.end() - edge->order_only_deps_ - depfile.ins_.size();
+  if (!data->Canonicalize(err))
+    return false;
+
+  // Make room in edge->inputs_ to be filled in below.
+  EdgeInputs::iterator implicit_dep =
+      AddDepsSpace(edge, (int)depfile.ins_.size());
 
   // Add all its in-edges.
   for (vector<StringPiece>::iterator i = depfile.ins_.begin();
        i != depfile.ins_.end(); ++i, ++implicit_dep) {
-    if (!CanonicalizePath(const_cast<char*>(i->str_), &i->len_, err))
-      return false;
+    AddDep(edge, state_->GetNode(*i), implicit_dep);
+  }
 
-    Node* node = state_->GetNode(*i);
-    *implicit_dep = node;
-    node->AddOutEdge(edge);
-
-    // If we don't have a edge that generates this input already,
-    // create one; this makes us not abort if the input is missing,
-    // but instead will rebuild in that circumstance.
-    if (!node->in_edge()) {
-      Edge* phony_edge = state_->AddEdge(&State::kPhonyRule);
-      node->set_in_edge(phony_edge);
-      phony_edge->outputs_.push_back(node);
-
-      // RecomputeDirty might not be called for phony_edge if a previous call
-      // to RecomputeDirty had caused the file to be stat'ed.  Because previous
-      // invocations of RecomputeDirty would have seen this node without an
-      // input edge (and therefore ready), we have to set outputs_ready_ to true
-      // to avoid a potential stuck build.  If we do call RecomputeDirty for
-      // this node, it will simply set outputs_ready_ to the correct value.
-      phony_edge->outputs_ready_ = true;
-    }
+  return true;
+}
+
+bool DependencyScan::LoadDepsFromLog(Edge* edge, string* err) {
+  Node* output = edge->outputs_[0];
+  DepsLog::Deps* deps = deps_log_ ? deps_log_->GetDeps(output) : NULL;
+  if (!deps) {
+    EXPLAIN("deps for '%s' are missing", output->path().c_str());
+    return false;
+  }
+
+  // Deps are invalid if the output is newer than the deps.
+  StatIfNecessary(output);
+  if (output->mtime() > deps->mtime) {
+    EXPLAIN("stored deps info out of date for '%s' (%" PRId64 " vs %" PRId64
+            ")", output->path().c_str(), deps->mtime, output->mtime());
+    return false;
   }
 
+  EdgeInputs::iterator implicit_dep = AddDepsSpace(edge, deps->node_count);
+  for (int i = 0; i < deps->node_count; ++i, ++implicit_dep)
+    AddDep(edge, deps->nodes[i], implicit_dep);
   return true;
 }
 
+EdgeInputs::iterator DependencyScan::AddDepsSpace(Edge* edge, int count) {
+  EdgeInputs::iterator gap = edge->inputs_.insert_gap(
+      edge->inputs_.end() - edge->order_only_deps_, count);
+  edge->implicit_deps_ += count;
+  edge->depfile_deps_ += count;
+  return gap;
+}
+
+void DependencyScan::AddDep(Edge* edge, Node* node,
+                            EdgeInputs::iterator slot) {
+  *slot = node;
+  node->AddOutEdge(edge);
+
+  // If we don't have a edge that generates this input already,
+  // create one; this makes us not abort if the input is missing,
+  // but instead will rebuild in that circumstance.
+  if (!node->in_edge()) {
+    Edge* phony_edge = state_->AddEdge(&State::kPhonyRule);
+    node->set_in_edge(phony_edge);
+    phony_edge->outputs_.push_back(node);
+
+    // RecomputeDirty might not be called for phony_edge if a previous call
+    // to RecomputeDirty had caused the file to be stat'ed.  Because previous
+    // invocations of RecomputeDirty would have seen this node without an
+    // input edge (and therefore ready), we have to set outputs_ready_ to true
+    // to avoid a potential stuck build.  If we do call RecomputeDirty for
+    // this node, it will simply set outputs_ready_ to the correct value.
+    phony_edge->outputs_ready_ = true;
+  }
+}
+
 void Edge::Dump(const char* prefix) const {
   printf("%s[ ", prefix);
-  for (vector<Node*>::const_iterator i = inputs_.begin();
+  for (EdgeInputs::const_iterator i = inputs_.begin();
        i != inputs_.end() && *i != NULL; ++i) {
     printf("%s ", (*i)->path().c_str());
   }
@@ -353,7 +951,7 @@ bool Edge::is_phony() const {
 }
 
 void Node::Dump(const char* prefix) const {
-    printf("%s <%s 0x%p> mtime: %d%s, (:%s), ",
+    printf("%s <%s 0x%p> mtime: %" PRId64 "%s, (:%s), ",
            prefix, path().c_str(), this,
            mtime(), mtime()?"":" (:missing)",
            dirty()?" dirty":" clean");
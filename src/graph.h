@@ -15,6 +15,7 @@
 #ifndef NINJA_GRAPH_H_
 #define NINJA_GRAPH_H_
 
+#include <map>
 #include <string>
 #include <vector>
 using namespace std;
@@ -22,19 +23,43 @@ using namespace std;
 #include "eval_env.h"
 #include "timestamp.h"
 
+struct BuildLogEntry;
+struct DepFileData;
 struct DiskInterface;
 struct Edge;
 
+/// The part of a Node that changes while deciding what to build.  State
+/// keeps these together, apart from the rest of the nodes, so that going
+/// over all of them (e.g. in State::Reset()) touches little memory.
+struct NodeStatus {
+  NodeStatus() : mtime(-1), dirty(false) {}
+
+  /// Possible values of mtime:
+  ///   -1: file hasn't been examined
+  ///   0:  we looked, and file doesn't exist
+  ///   >0: actual file's mtime
+  TimeStamp mtime;
+
+  /// Dirty is true when the underlying file is out-of-date.
+  /// But note that Edge::outputs_ready_ is also used in judging which
+  /// edges to build.
+  bool dirty;
+};
+
 /// Information about a node in the dependency graph: the file, whether
 /// it's dirty, mtime, etc.
 struct Node {
-  explicit Node(const string& path)
+  /// Nodes are created by State, which assigns each a dense \a id and
+  /// a \a status to keep.
+  Node(const string& path, int id, NodeStatus* status)
       : path_(path),
-        mtime_(-1),
-        dirty_(false),
-        in_edge_(NULL) {}
+        id_(id),
+        log_serial_(0),
+        status_(status),
+        in_edge_(NULL),
+        log_entry_(NULL) {}
 
-  /// Return true if the file exists (mtime_ got a value).
+  /// Return true if the file exists (mtime got a value).
   bool Stat(DiskInterface* disk_interface);
 
   /// Return true if we needed to stat.
@@ -47,50 +72,62 @@ struct Node {
 
   /// Mark as not-yet-stat()ed and not dirty.
   void ResetState() {
-    mtime_ = -1;
-    dirty_ = false;
+    *status_ = NodeStatus();
   }
 
   /// Mark the Node as already-stat()ed and missing.
   void MarkMissing() {
-    mtime_ = 0;
+    status_->mtime = 0;
   }
 
   bool exists() const {
-    return mtime_ != 0;
+    return status_->mtime != 0;
   }
 
   bool status_known() const {
-    return mtime_ != -1;
+    return status_->mtime != -1;
   }
 
   const string& path() const { return path_; }
-  TimeStamp mtime() const { return mtime_; }
+  /// Index of the node in State::nodes_.
+  int id() const { return id_; }
 
-  bool dirty() const { return dirty_; }
-  void set_dirty(bool dirty) { dirty_ = dirty; }
-  void MarkDirty() { dirty_ = true; }
+  TimeStamp mtime() const { return status_->mtime; }
+  /// Use an mtime that was already looked up for this file.
+  void set_mtime(TimeStamp mtime) { status_->mtime = mtime; }
+
+  bool dirty() const { return status_->dirty; }
+  void set_dirty(bool dirty) { status_->dirty = dirty; }
+  void MarkDirty() { status_->dirty = true; }
 
   Edge* in_edge() const { return in_edge_; }
   void set_in_edge(Edge* edge) { in_edge_ = edge; }
 
   const vector<Edge*>& out_edges() const { return out_edges_; }
   void AddOutEdge(Edge* edge) { out_edges_.push_back(edge); }
+  void ClearOutEdges() { out_edges_.clear(); }
+
+  /// The entry BuildLog::LookupByOutput() found for this node, which may
+  /// be NULL, if it was in the log numbered \a log_serial.  Returns false
+  /// if that log hasn't looked it up.
+  bool cached_log_entry(unsigned log_serial, BuildLogEntry** entry) const {
+    if (log_serial != log_serial_)
+      return false;
+    *entry = log_entry_;
+    return true;
+  }
+  void cache_log_entry(unsigned log_serial, BuildLogEntry* entry) {
+    log_serial_ = log_serial;
+    log_entry_ = entry;
+  }
 
   void Dump(const char* prefix="") const;
 
 private:
   string path_;
-  /// Possible values of mtime_:
-  ///   -1: file hasn't been examined
-  ///   0:  we looked, and file doesn't exist
-  ///   >0: actual file's mtime
-  TimeStamp mtime_;
-
-  /// Dirty is true when the underlying file is out-of-date.
-  /// But note that Edge::outputs_ready_ is also used in judging which
-  /// edges to build.
-  bool dirty_;
+  int id_;
+  unsigned log_serial_;
+  NodeStatus* status_;
 
   /// The Edge that produces this Node, or NULL when there is no
   /// known edge to produce it.
@@ -98,23 +135,38 @@ private:
 
   /// All Edges that use this Node as an input.
   vector<Edge*> out_edges_;
+
+  BuildLogEntry* log_entry_;
 };
 
 /// An invokable build command and associated metadata (description, etc.).
 struct Rule {
   explicit Rule(const string& name)
-      : name_(name), generator_(false), restat_(false) {}
+      : name_(name), generator_(false), restat_(false), remote_(false),
+        shell_(false), batch_(0) {}
 
   const string& name() const { return name_; }
 
   bool generator() const { return generator_; }
   bool restat() const { return restat_; }
+  /// Whether the command may run on a remote worker; see RemoteJob.
+  bool remote() const { return remote_; }
+  /// Whether the command always runs through /bin/sh, even if it needs
+  /// nothing of it; see SubprocessSet::Add().
+  bool shell() const { return shell_; }
+  /// The most commands of this rule that may run one after another in
+  /// one shell, or 0; see RealCommandRunner.
+  int batch() const { return batch_; }
 
   const EvalString& command() const { return command_; }
   const EvalString& description() const { return description_; }
   const EvalString& depfile() const { return depfile_; }
+  const EvalString& deps() const { return deps_; }
   const EvalString& rspfile() const { return rspfile_; }
   const EvalString& rspfile_content() const { return rspfile_content_; }
+  const EvalString& pool() const { return pool_; }
+  const EvalString& pool_weight() const { return pool_weight_; }
+  const EvalString& remote_inputs() const { return remote_inputs_; }
 
   /// Used by a test.
   void set_command(const EvalString& command) { command_ = command; }
@@ -122,27 +174,91 @@ struct Rule {
  private:
   // Allow the parsers to reach into this object and fill out its fields.
   friend struct ManifestParser;
+  friend struct ManifestCache;
 
   string name_;
 
   bool generator_;
   bool restat_;
+  bool remote_;
+  bool shell_;
+  int batch_;
 
   EvalString command_;
   EvalString description_;
   EvalString depfile_;
+  EvalString deps_;
   EvalString rspfile_;
   EvalString rspfile_content_;
+  EvalString pool_;
+  EvalString pool_weight_;
+  EvalString remote_inputs_;
 };
 
 struct BuildLog;
+struct DepsLog;
 struct Node;
+struct Pool;
 struct State;
 
+/// The inputs of an Edge, kept in a single array sized to fit: explicit
+/// inputs first, then implicit ones, then order-only ones.  Works like
+/// the parts of vector<Node*> the graph needs, in half the space.
+struct EdgeInputs {
+  typedef Node** iterator;
+  typedef Node* const* const_iterator;
+
+  EdgeInputs() : nodes_(NULL), size_(0), capacity_(0) {}
+  ~EdgeInputs();
+
+  iterator begin() { return nodes_; }
+  iterator end() { return nodes_ + size_; }
+  const_iterator begin() const { return nodes_; }
+  const_iterator end() const { return nodes_ + size_; }
+
+  size_t size() const { return size_; }
+  size_t capacity() const { return capacity_; }
+  bool empty() const { return size_ == 0; }
+  Node*& operator[](size_t index) { return nodes_[index]; }
+  Node* operator[](size_t index) const { return nodes_[index]; }
+
+  /// Make room for \a count inputs in all, allocating exactly that many.
+  void reserve(size_t count);
+
+  void push_back(Node* node) {
+    if (size_ == capacity_)
+      reserve(size_ ? 2 * size_ : 4);
+    nodes_[size_++] = node;
+  }
+
+  /// Open a gap of \a count entries before \a pos, moving only the
+  /// entries after it, and return the start of the gap.
+  iterator insert_gap(iterator pos, size_t count);
+
+  /// Remove the entries in [first, last), keeping the allocation.
+  void erase(iterator first, iterator last);
+
+ private:
+  Node** nodes_;
+  unsigned int size_;
+  unsigned int capacity_;
+
+  EdgeInputs(const EdgeInputs&);
+  void operator=(const EdgeInputs&);
+};
+
 /// An edge in the dependency graph; links between Nodes using Rules.
 struct Edge {
-  Edge() : rule_(NULL), env_(NULL), outputs_ready_(false), implicit_deps_(0),
-           order_only_deps_(0) {}
+  /// Edges are created by State, which assigns each a dense \a id.
+  explicit Edge(int id)
+      : id_(id), rule_(NULL), pool_(NULL), pool_weight_(1), env_(NULL),
+        outputs_ready_(false),
+        command_known_(false), command_hash_known_(false),
+        critical_time_(0), implicit_deps_(0), order_only_deps_(0),
+        depfile_deps_(0) {}
+
+  /// Index of the edge in State::edges_.
+  int id() const { return id_; }
 
   /// Return true if all inputs' in-edges are ready.
   bool AllInputsReady() const;
@@ -150,8 +266,26 @@ struct Edge {
   /// Expand all variables in a command and return it as a string.
   /// If incl_rsp_file is enabled, the string will also contain the
   /// full contents of a response file (if applicable)
+  /// The command without the response file is evaluated once and kept.
   string EvaluateCommand(bool incl_rsp_file = false);  // XXX move to env, take env ptr
+  /// EvaluateCommand() into \a sink, a piece at a time.
+  void EvaluateCommand(bool incl_rsp_file, EvalSink* sink);
+
+  /// Return the hash of EvaluateCommand(true), as recorded in the build
+  /// log.  Computed once and kept; the full command itself is never
+  /// built, as it is only needed here and response files can be very
+  /// large.
+  uint64_t GetCommandHash();
   string EvaluateDepFile();
+  /// The rule's pool and pool weight, evaluated for this edge.
+  string EvaluatePool();
+  string EvaluatePoolWeight();
+  /// What the command reads besides its inputs when run remotely.
+  string EvaluateRemoteInputs();
+  /// How the command reports its deps to the deps log ("gcc": in a
+  /// depfile, read once after it runs; "msvc": in its output, as cl.exe's
+  /// /showIncludes does), or empty for none.
+  string GetDepsType();
   string GetDescription();
 
   /// Does the edge use a response file?
@@ -163,30 +297,52 @@ struct Edge {
   /// Get the contents of the response file
   string GetRspFileContent();
 
+  /// Write the response file to \a path, as its contents are evaluated.
+  bool WriteRspFile(DiskInterface* disk_interface, const string& path);
+
   void Dump(const char* prefix="") const;
 
+  int id_;
   const Rule* rule_;
-  vector<Node*> inputs_;
+  /// The pool limiting how many edges like this one run at once, and
+  /// how much of its depth this edge takes up.
+  Pool* pool_;
+  int pool_weight_;
+  EdgeInputs inputs_;
   vector<Node*> outputs_;
   Env* env_;
   bool outputs_ready_;
 
+  // Neither the bindings nor the explicit inputs and outputs change once
+  // an edge is loaded (depfiles only add implicit deps), so these never
+  // need invalidating.
+  string command_;
+  bool command_known_;
+  uint64_t command_hash_;
+  bool command_hash_known_;
+
+  /// Estimated milliseconds from starting this edge until everything
+  /// in the plan that depends on it is done, but far more if it or
+  /// something depending on it failed last time; see
+  /// Plan::ComputeCriticalPath().
+  int64_t critical_time_;
+
   const Rule& rule() const { return *rule_; }
   bool outputs_ready() const { return outputs_ready_; }
 
-  // XXX There are three types of inputs.
+  // There are three types of inputs, stored in that order in inputs_.
   // 1) explicit deps, which show up as $in on the command line;
   // 2) implicit deps, which the target depends on implicitly (e.g. C headers),
   //                   and changes in them cause the target to rebuild;
   // 3) order-only deps, which are needed before the target builds but which
   //                     don't cause the target to rebuild.
-  // Currently we stuff all of these into inputs_ and keep counts of #2 and #3
-  // when we need to compute subsets.  This is suboptimal; should think of a
-  // better representation.  (Could make each pointer into a pair of a pointer
-  // and a type of input, or if memory matters could use the low bits of the
-  // pointer...)
+  // The counts of #2 and #3 tell them apart.
   int implicit_deps_;
   int order_only_deps_;
+  /// How many of the implicit deps were loaded from the depfile or the
+  /// deps log; they are the last of them.  State::Reset() drops them
+  /// again.
+  int depfile_deps_;
   bool is_implicit(size_t index) {
     return index >= inputs_.size() - order_only_deps_ - implicit_deps_ &&
         !is_order_only(index);
@@ -198,27 +354,64 @@ struct Edge {
   bool is_phony() const;
 };
 
+/// Orders ready edges longest critical path first, then by id so that
+/// edges with no estimate come out in manifest order.
+struct EdgeCriticalPathCmp {
+  bool operator()(const Edge* a, const Edge* b) const {
+    if (a->critical_time_ != b->critical_time_)
+      return a->critical_time_ > b->critical_time_;
+    return a->id_ < b->id_;
+  }
+};
+
 
 /// DependencyScan manages the process of scanning the files in a graph
 /// and updating the dirty/outputs_ready state of all the nodes and edges.
 struct DependencyScan {
-  DependencyScan(State* state, BuildLog* build_log,
+  DependencyScan(State* state, BuildLog* build_log, DepsLog* deps_log,
                  DiskInterface* disk_interface)
-      : state_(state), build_log_(build_log),
-        disk_interface_(disk_interface) {}
+      : state_(state), build_log_(build_log), deps_log_(deps_log),
+        disk_interface_(disk_interface), content_digests_(false) {}
+  ~DependencyScan();
+
+  /// Stat the nodes that RecomputeDirty() will visit from \a targets, and
+  /// read and parse the depfiles it will load, on \a threads threads (none
+  /// runs everything on this one).  RecomputeDirty() then uses the
+  /// results instead of waiting on the disk for one file at a time; what
+  /// it decides, and explains, is unchanged.  The DiskInterface's Stat()
+  /// and ReadFile() are called concurrently.
+  void Prefetch(const vector<Node*>& targets, int threads);
+
+  /// Like Node::StatIfNecessary(), but uses the result of Prefetch() if
+  /// there is one.
+  bool StatIfNecessary(Node* node);
+
+  /// Take \a mtimes, by node id with -1 where unknown, as the mtimes of
+  /// the files instead of stat'ing them; e.g. ones a FileWatcher says
+  /// are current.  Call before Prefetch(), which then skips them.
+  void UseMtimes(const vector<TimeStamp>& mtimes) {
+    prefetched_mtimes_ = mtimes;
+  }
 
   /// Examine inputs, outputs, and command lines to judge whether an edge
-  /// needs to be re-run, and update outputs_ready_ and each outputs' |dirty_|
+  /// needs to be re-run, and update outputs_ready_ and each outputs' |dirty|
   /// state accordingly.
   /// Returns false on failure.
   bool RecomputeDirty(Edge* edge, string* err);
 
+  /// Stat \a edge's outputs, and return the first that doesn't exist, if
+  /// it isn't phony.  Such an edge is dirty without looking at its deps.
+  Node* FindMissingOutput(Edge* edge);
+
   /// Recompute whether a given single output should be marked dirty.
   /// Returns true if so.
   bool RecomputeOutputDirty(Edge* edge, Node* most_recent_input,
-                            const string& command, Node* output);
+                            Node* output);
 
   bool LoadDepFile(Edge* edge, string* err);
+  /// Like LoadDepFile(), for an edge whose deps are in the deps log.
+  /// Returns false if they aren't, or are older than the output.
+  bool LoadDepsFromLog(Edge* edge, string* err);
 
   BuildLog* build_log() const {
     return build_log_;
@@ -227,10 +420,56 @@ struct DependencyScan {
     build_log_ = log;
   }
 
+  DepsLog* deps_log() const {
+    return deps_log_;
+  }
+
+  /// Whether an output older than its inputs is still up to date if the
+  /// contents of its inputs are what they were when it was built; see
+  /// BuildConfig::content_digests.
+  bool content_digests() const {
+    return content_digests_;
+  }
+  void set_content_digests(bool content_digests) {
+    content_digests_ = content_digests;
+  }
+
+  /// The digest of the contents of \a node, which has been stat'ed, or 0
+  /// if it doesn't exist.  The file is only read if the deps log has no
+  /// digest of it as of its mtime; the digest is then recorded there.
+  uint64_t NodeDigest(Node* node);
+
+  /// The digest of the contents of \a edge's inputs, but for the
+  /// order-only ones, which goes in its build log entry.  If \a deps, the
+  /// deps its command just reported take the place of those loaded from
+  /// its depfile or the deps log.
+  uint64_t InputsDigest(Edge* edge, const vector<Node*>* deps = NULL);
+
  private:
+  /// Add \a count deps, from the depfile or the deps log, to \a edge's
+  /// implicit deps, returning where they go.
+  EdgeInputs::iterator AddDepsSpace(Edge* edge, int count);
+  /// Make \a node, a dep of \a edge, one of its inputs.
+  void AddDep(Edge* edge, Node* node, EdgeInputs::iterator slot);
+
+  /// Like FindMissingOutput(), for Prefetch() between its stats and the
+  /// scan: from the stats it made, without stat'ing.
+  bool HasMissingOutput(Edge* edge) const;
+
+  /// Whether content_digests_ says \a edge's inputs are as they were
+  /// when its output was built, whose build log entry has \a input_digest.
+  bool InputsUnchanged(Edge* edge, uint64_t input_digest);
+
   State* state_;
   BuildLog* build_log_;
+  DepsLog* deps_log_;
   DiskInterface* disk_interface_;
+  bool content_digests_;
+
+  /// Results of Prefetch() (or UseMtimes()) that RecomputeDirty() hasn't
+  /// used yet.  Stats are by node id, with -1 where there is none.
+  vector<TimeStamp> prefetched_mtimes_;
+  map<Edge*, DepFileData*> prefetched_depfiles_;
 };
 
 #endif  // NINJA_GRAPH_H_
@@ -14,10 +14,12 @@
 
 #include "graph.h"
 
+#include "build_log.h"
+
 #include "test.h"
 
 struct GraphTest : public StateTestWithBuiltinRules {
-  GraphTest() : scan_(&state_, NULL, &fs_) {}
+  GraphTest() : scan_(&state_, NULL, NULL, &fs_) {}
 
   VirtualFileSystem fs_;
   DependencyScan scan_;
@@ -187,3 +189,237 @@ TEST_F(GraphTest, DepfileRemoved) {
   ASSERT_EQ("", err);
   EXPECT_TRUE(GetNode("out.o")->dirty());
 }
+
+TEST_F(GraphTest, DepfileAfterImplicitAndOrderOnly) {
+  // Deps from the depfile go between the manifest's implicit and
+  // order-only inputs.
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"rule catdep\n"
+"  depfile = $out.d\n"
+"  command = cat $in > $out\n"
+"build out.o: catdep foo.cc | foo.h || order\n"));
+  fs_.Create("foo.cc", 1, "");
+  fs_.Create("out.o", 1, "");
+  fs_.Create("out.o.d", 1, "out.o: bar.h baz.h\n");
+
+  Edge* edge = GetNode("out.o")->in_edge();
+  string err;
+  EXPECT_TRUE(scan_.RecomputeDirty(edge, &err));
+  ASSERT_EQ("", err);
+
+  ASSERT_EQ(5u, edge->inputs_.size());
+  EXPECT_EQ(3, edge->implicit_deps_);
+  EXPECT_EQ(1, edge->order_only_deps_);
+  const char* expected[] = { "foo.cc", "foo.h", "bar.h", "baz.h", "order" };
+  for (size_t i = 0; i < edge->inputs_.size(); ++i)
+    EXPECT_EQ(expected[i], edge->inputs_[i]->path());
+  EXPECT_TRUE(edge->is_implicit(3));
+  EXPECT_TRUE(edge->is_order_only(4));
+  EXPECT_EQ("cat foo.cc > out.o", edge->EvaluateCommand());
+}
+
+TEST_F(GraphTest, ResetDropsDepfileDeps) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"rule catdep\n"
+"  depfile = $out.d\n"
+"  command = cat $in > $out\n"
+"build out.o: catdep foo.cc | foo.h || order\n"));
+  fs_.Create("foo.cc", 1, "");
+  fs_.Create("out.o", 1, "");
+  fs_.Create("out.o.d", 1, "out.o: bar.h\n");
+
+  Edge* edge = GetNode("out.o")->in_edge();
+  string err;
+  EXPECT_TRUE(scan_.RecomputeDirty(edge, &err));
+  ASSERT_EQ("", err);
+  ASSERT_EQ(4u, edge->inputs_.size());
+  ASSERT_EQ(1u, GetNode("bar.h")->out_edges().size());
+
+  // The depfile changes between builds.
+  state_.Reset();
+  ASSERT_EQ(3u, edge->inputs_.size());
+  EXPECT_EQ(1, edge->implicit_deps_);
+  EXPECT_EQ("order", edge->inputs_[2]->path());
+  EXPECT_TRUE(GetNode("bar.h")->out_edges().empty());
+  EXPECT_EQ(1u, GetNode("foo.h")->out_edges().size());
+
+  fs_.Create("out.o.d", 2, "out.o: baz.h\n");
+  EXPECT_TRUE(scan_.RecomputeDirty(edge, &err));
+  ASSERT_EQ("", err);
+  ASSERT_EQ(4u, edge->inputs_.size());
+  EXPECT_EQ("baz.h", edge->inputs_[2]->path());
+  EXPECT_TRUE(GetNode("bar.h")->out_edges().empty());
+}
+
+TEST_F(GraphTest, DepfileSkippedForMissingOutput) {
+  const char kManifest[] =
+"rule catdep\n"
+"  depfile = $out.d\n"
+"  command = cat $in > $out\n"
+"build out.o: catdep foo.cc || order\n"
+"build order: catdep order.in\n";
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_, kManifest));
+  fs_.Create("foo.cc", 1, "");
+  fs_.Create("order.in", 1, "");
+  // Left behind by a build whose output has since been deleted; not even
+  // valid for it, so reading it would be an error.
+  fs_.Create("out.o.d", 1, "other.o: foo.h\n");
+
+  string err;
+  EXPECT_TRUE(scan_.RecomputeDirty(GetNode("out.o")->in_edge(), &err));
+  ASSERT_EQ("", err);
+  EXPECT_TRUE(fs_.files_read_.empty());
+  EXPECT_TRUE(GetNode("out.o")->dirty());
+  EXPECT_FALSE(GetNode("out.o")->in_edge()->outputs_ready());
+  EXPECT_FALSE(GetNode("foo.h")->status_known());
+  // Its order-only input is still looked at, to be built first.
+  EXPECT_TRUE(GetNode("order")->dirty());
+
+  // The same goes for Prefetch().
+  State state;
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state, kManifest));
+  DependencyScan scan(&state, NULL, NULL, &fs_);
+  scan.Prefetch(vector<Node*>(1, state.LookupNode("out.o")), 0);
+  EXPECT_TRUE(scan.RecomputeDirty(state.LookupNode("out.o")->in_edge(),
+                                  &err));
+  ASSERT_EQ("", err);
+  EXPECT_TRUE(fs_.files_read_.empty());
+  EXPECT_TRUE(state.LookupNode("out.o")->dirty());
+}
+
+TEST_F(GraphTest, CommandHash) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"rule link\n"
+"  command = link @$out.rsp\n"
+"  rspfile = $out.rsp\n"
+"  rspfile_content = $in\n"
+"build out: link a.o b.o\n"));
+
+  Edge* edge = GetNode("out")->in_edge();
+  EXPECT_EQ(BuildLog::LogEntry::HashCommand(
+                "link @out.rsp;rspfile=a.o b.o"),
+            edge->GetCommandHash());
+  EXPECT_EQ("link @out.rsp", edge->EvaluateCommand());
+  EXPECT_EQ("link @out.rsp;rspfile=a.o b.o", edge->EvaluateCommand(true));
+  EXPECT_EQ(BuildLog::LogEntry::HashCommand(
+                "link @out.rsp;rspfile=a.o b.o"),
+            edge->GetCommandHash());
+}
+
+TEST_F(GraphTest, CommandHashOfPieces) {
+  // The hash is of the command as evaluated: bindings of each scope,
+  // quoted paths and the response file, in pieces of every length.
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"flags = -O2\n"
+"rule link\n"
+"  command = link $flags $extra -o $out @$out.rsp\n"
+"  rspfile = $out.rsp\n"
+"  rspfile_content = $in_newline\n"
+"build my$ app: link a.o with$ space.o a/much/longer/path/to/c.o\n"
+"  extra = -Wl,--gc-sections\n"));
+
+  Edge* edge = GetNode("my app")->in_edge();
+  string command = edge->EvaluateCommand(true);
+  EXPECT_EQ("link -O2 -Wl,--gc-sections -o \"my app\" @\"my app\".rsp;"
+            "rspfile=a.o\n\"with space.o\"\na/much/longer/path/to/c.o", command);
+  EXPECT_EQ(BuildLog::LogEntry::HashCommand(command),
+            edge->GetCommandHash());
+}
+
+TEST_F(GraphTest, PrefetchMatchesSerialScan) {
+  const char kManifest[] =
+"rule catdep\n"
+"  depfile = $out.d\n"
+"  command = cat $in > $out\n"
+"build mid.o: catdep mid.cc\n"
+"build out.o: catdep foo.cc mid.o || order\n";
+  fs_.Create("foo.cc", 1, "");
+  fs_.Create("mid.cc", 1, "");
+  fs_.Create("order", 1, "");
+  fs_.Create("bar.h", 3, "");
+  fs_.Create("mid.o", 2, "");
+  fs_.Create("mid.o.d", 2, "mid.o: mid.cc\n");
+  fs_.Create("out.o", 2, "");
+  fs_.Create("out.o.d", 2, "out.o: ./bar.h\n");
+
+  State serial_state;
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&serial_state, kManifest));
+  DependencyScan serial_scan(&serial_state, NULL, NULL, &fs_);
+  string err;
+  EXPECT_TRUE(serial_scan.RecomputeDirty(
+      serial_state.LookupNode("out.o")->in_edge(), &err));
+  ASSERT_EQ("", err);
+
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_, kManifest));
+  fs_.files_read_.clear();
+  vector<Node*> targets(1, GetNode("out.o"));
+  scan_.Prefetch(targets, 0);
+  EXPECT_EQ(2u, fs_.files_read_.size());
+  EXPECT_FALSE(GetNode("bar.h")->status_known());
+  EXPECT_TRUE(scan_.RecomputeDirty(GetNode("out.o")->in_edge(), &err));
+  ASSERT_EQ("", err);
+  // The scan used the depfiles that were read ahead.
+  EXPECT_EQ(2u, fs_.files_read_.size());
+
+  for (vector<Node*>::iterator i = serial_state.nodes_.begin();
+       i != serial_state.nodes_.end(); ++i) {
+    Node* node = GetNode((*i)->path());
+    EXPECT_EQ((*i)->mtime(), node->mtime()) << node->path();
+    EXPECT_EQ((*i)->dirty(), node->dirty()) << node->path();
+  }
+  EXPECT_TRUE(GetNode("out.o")->dirty());
+  EXPECT_FALSE(GetNode("mid.o")->dirty());
+  EXPECT_EQ(4u, GetNode("out.o")->in_edge()->inputs_.size());
+}
+
+TEST_F(GraphTest, UseMtimes) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"build out: cat mid\n"
+"build mid: cat in\n"));
+  fs_.Create("in", 1, "");
+  fs_.Create("mid", 2, "");
+  fs_.Create("out", 3, "");
+
+  // Mtimes from an earlier look at the files win over the disk's.
+  vector<TimeStamp> mtimes(state_.nodes_.size(), -1);
+  mtimes[GetNode("in")->id()] = 4;
+  mtimes[GetNode("out")->id()] = 5;
+  scan_.UseMtimes(mtimes);
+  vector<Node*> targets(1, GetNode("out"));
+  scan_.Prefetch(targets, 0);
+  string err;
+  EXPECT_TRUE(scan_.RecomputeDirty(GetNode("out")->in_edge(), &err));
+  ASSERT_EQ("", err);
+
+  EXPECT_EQ(4, GetNode("in")->mtime());
+  EXPECT_EQ(2, GetNode("mid")->mtime());
+  EXPECT_EQ(5, GetNode("out")->mtime());
+  EXPECT_TRUE(GetNode("mid")->dirty());
+  EXPECT_TRUE(GetNode("out")->dirty());
+}
+
+TEST_F(GraphTest, PrefetchOnThreads) {
+  string manifest = "build out: cat in0\n";
+  for (int i = 0; i < 500; ++i) {
+    char buf[64];
+    snprintf(buf, sizeof(buf), "build in%d: cat in%d\n", i, i + 1);
+    manifest += buf;
+  }
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_, manifest.c_str()));
+  fs_.Create("in500", 1, "");
+  for (int i = 0; i < 500; ++i) {
+    char buf[64];
+    snprintf(buf, sizeof(buf), "in%d", i);
+    fs_.Create(buf, 2, "");
+  }
+
+  vector<Node*> targets(1, GetNode("out"));
+  scan_.Prefetch(targets, 4);
+  string err;
+  EXPECT_TRUE(scan_.RecomputeDirty(GetNode("out")->in_edge(), &err));
+  ASSERT_EQ("", err);
+  EXPECT_TRUE(GetNode("out")->dirty());
+  EXPECT_FALSE(GetNode("in0")->dirty());
+  EXPECT_EQ(2, GetNode("in0")->mtime());
+  EXPECT_EQ(1, GetNode("in500")->mtime());
+}
@@ -18,60 +18,191 @@
 
 #include "graph.h"
 
-void GraphViz::AddTarget(Node* node) {
-  if (visited_nodes_.find(node) != visited_nodes_.end())
+namespace {
+
+/// How much output to gather before writing it.
+const size_t kBufferSize = 1 << 20;
+
+/// Mark \a id in \a visited, growing it as needed.  Returns false if it
+/// was already.
+bool Visit(vector<bool>* visited, int id) {
+  if ((size_t)id >= visited->size())
+    visited->resize(id + 1);
+  if ((*visited)[id])
+    return false;
+  (*visited)[id] = true;
+  return true;
+}
+
+bool StartsWith(const string& path, const string& prefix) {
+  return path.compare(0, prefix.size(), prefix) == 0;
+}
+
+}  // anonymous namespace
+
+void GraphViz::AddTarget(Node* target) {
+  if (Excluded(target) || !Visit(&visited_nodes_, target->id()))
     return;
 
-  printf("\"%p\" [label=\"%s\"]\n", node, node->path().c_str());
-  visited_nodes_.insert(node);
+  // Breadth first, so that depths count from the nearest target, and
+  // without recursing, as chains of edges can be long.
+  vector<pair<Node*, int> > queue;
+  queue.push_back(make_pair(target, 0));
+  for (size_t i = 0; i < queue.size(); ++i) {
+    Node* node = queue[i].first;
+    int depth = queue[i].second;
+    Edge* edge = node->in_edge();
+    if (edge && hidden_rules_.count(edge->rule().name()))
+      edge = NULL;
+    bool truncated = edge && max_depth_ >= 0 && depth >= max_depth_;
+    AddNode(node, truncated);
+    if (!edge || truncated || !Visit(&visited_edges_, edge->id()))
+      continue;
 
-  Edge* edge = node->in_edge();
+    for (vector<Node*>::iterator out = edge->outputs_.begin();
+         out != edge->outputs_.end(); ++out) {
+      if (!Excluded(*out) && Visit(&visited_nodes_, (*out)->id()))
+        AddNode(*out, false);
+    }
+    AddEdge(edge);
+    for (EdgeInputs::iterator in = edge->inputs_.begin();
+         in != edge->inputs_.end(); ++in) {
+      if (!Excluded(*in) && Visit(&visited_nodes_, (*in)->id()))
+        queue.push_back(make_pair(*in, depth + 1));
+    }
+  }
+}
 
-  if (!edge) {
-    // Leaf node.
-    // Draw as a rect?
+void GraphViz::AddNode(Node* node, bool truncated) {
+  int cluster = Cluster(node);
+  if (cluster >= 0) {
+    if ((size_t)cluster >= drawn_clusters_.size())
+      drawn_clusters_.resize(collapsed_.size());
+    if (drawn_clusters_[cluster])
+      return;
+    drawn_clusters_[cluster] = true;
+    Write("\"" + Name(node) + "\" [label=\"" + collapsed_[cluster] +
+          "...\", shape=box3d]\n");
     return;
   }
+  Write("\"" + Name(node) + "\" [label=\"" + node->path() + "\"" +
+        (truncated ? ", style=dashed" : "") + "]\n");
+}
 
-  if (visited_edges_.find(edge) != visited_edges_.end())
+void GraphViz::AddEdge(Edge* edge) {
+  // An edge building files of one cluster is drawn as arrows into it
+  // from the inputs outside it.
+  int cluster = Cluster(edge->outputs_[0]);
+  for (vector<Node*>::iterator out = edge->outputs_.begin();
+       cluster >= 0 && out != edge->outputs_.end(); ++out) {
+    if (Cluster(*out) != cluster)
+      cluster = -1;
+  }
+  if (cluster >= 0) {
+    for (EdgeInputs::iterator in = edge->inputs_.begin();
+         in != edge->inputs_.end(); ++in) {
+      if (!Excluded(*in) && Cluster(*in) != cluster) {
+        bool order_only = edge->is_order_only(in - edge->inputs_.begin());
+        AddArrow(Name(*in), Name(edge->outputs_[0]),
+                 order_only ? " [style=dotted]" : "");
+      }
+    }
     return;
-  visited_edges_.insert(edge);
+  }
 
-  if (edge->inputs_.size() == 1 && edge->outputs_.size() == 1) {
+  // Excluded inputs don't count.
+  size_t only_input = 0;
+  int inputs = 0;
+  for (size_t i = 0; i < edge->inputs_.size(); ++i) {
+    if (!Excluded(edge->inputs_[i])) {
+      only_input = i;
+      ++inputs;
+    }
+  }
+  if (inputs == 1 && edge->outputs_.size() == 1 &&
+      !edge->is_order_only(only_input)) {
     // Can draw simply.
     // Note extra space before label text -- this is cosmetic and feels
     // like a graphviz bug.
-    printf("\"%p\" -> \"%p\" [label=\" %s\"]\n",
-           edge->inputs_[0], edge->outputs_[0], edge->rule_->name().c_str());
-  } else {
-    printf("\"%p\" [label=\"%s\", shape=ellipse]\n",
-           edge, edge->rule_->name().c_str());
-    for (vector<Node*>::iterator out = edge->outputs_.begin();
-         out != edge->outputs_.end(); ++out) {
-      printf("\"%p\" -> \"%p\"\n", edge, *out);
-    }
-    for (vector<Node*>::iterator in = edge->inputs_.begin();
-         in != edge->inputs_.end(); ++in) {
-      const char* order_only = "";
-      if (edge->is_order_only(in - edge->inputs_.begin()))
-        order_only = " style=dotted";
-      printf("\"%p\" -> \"%p\" [arrowhead=none%s]\n", (*in), edge, order_only);
-    }
+    AddArrow(Name(edge->inputs_[only_input]), Name(edge->outputs_[0]),
+             " [label=\" " + edge->rule_->name() + "\"]");
+    return;
   }
 
-  for (vector<Node*>::iterator in = edge->inputs_.begin();
+  char name[32];
+  snprintf(name, sizeof(name), "e%d", edge->id());
+  Write(string("\"") + name + "\" [label=\"" + edge->rule_->name() +
+        "\", shape=ellipse]\n");
+  for (vector<Node*>::iterator out = edge->outputs_.begin();
+       out != edge->outputs_.end(); ++out) {
+    if (!Excluded(*out))
+      AddArrow(name, Name(*out), "");
+  }
+  for (EdgeInputs::iterator in = edge->inputs_.begin();
        in != edge->inputs_.end(); ++in) {
-    AddTarget(*in);
+    if (Excluded(*in))
+      continue;
+    const char* order_only = "";
+    if (edge->is_order_only(in - edge->inputs_.begin()))
+      order_only = " style=dotted";
+    AddArrow(Name(*in), name, string(" [arrowhead=none") + order_only + "]");
+  }
+}
+
+void GraphViz::AddArrow(const string& from, const string& to,
+                        const string& attrs) {
+  if ((from[0] == 'c' || to[0] == 'c') &&
+      !cluster_arrows_.insert(make_pair(from, to)).second) {
+    return;
+  }
+  Write("\"" + from + "\" -> \"" + to + "\"" + attrs + "\n");
+}
+
+int GraphViz::Cluster(Node* node) const {
+  for (size_t i = 0; i < collapsed_.size(); ++i) {
+    if (StartsWith(node->path(), collapsed_[i]))
+      return (int)i;
+  }
+  return -1;
+}
+
+bool GraphViz::Excluded(Node* node) const {
+  for (vector<string>::const_iterator i = excluded_.begin();
+       i != excluded_.end(); ++i) {
+    if (StartsWith(node->path(), *i))
+      return true;
+  }
+  return false;
+}
+
+string GraphViz::Name(Node* node) const {
+  char name[32];
+  int cluster = Cluster(node);
+  if (cluster >= 0)
+    snprintf(name, sizeof(name), "c%d", cluster);
+  else
+    snprintf(name, sizeof(name), "n%d", node->id());
+  return name;
+}
+
+void GraphViz::Write(const string& text) {
+  buffer_ += text;
+  if (buffer_.size() >= kBufferSize) {
+    fwrite(buffer_.data(), 1, buffer_.size(), out_);
+    buffer_.clear();
   }
 }
 
 void GraphViz::Start() {
-  printf("digraph ninja {\n");
-  printf("rankdir=\"LR\"\n");
-  printf("node [fontsize=10, shape=box, height=0.25]\n");
-  printf("edge [fontsize=10]\n");
+  Write("digraph ninja {\n");
+  Write("rankdir=\"LR\"\n");
+  Write("node [fontsize=10, shape=box, height=0.25]\n");
+  Write("edge [fontsize=10]\n");
 }
 
 void GraphViz::Finish() {
-  printf("}\n");
+  Write("}\n");
+  fwrite(buffer_.data(), 1, buffer_.size(), out_);
+  buffer_.clear();
+  fflush(out_);
 }
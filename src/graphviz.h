@@ -15,20 +15,67 @@
 #ifndef NINJA_GRAPHVIZ_H_
 #define NINJA_GRAPHVIZ_H_
 
+#include <stdio.h>
+
 #include <set>
+#include <string>
+#include <vector>
 using namespace std;
 
 struct Node;
 struct Edge;
 
-/// Runs the process of creating GraphViz .dot file output.
+/// Runs the process of creating GraphViz .dot file output.  For a graph
+/// too big to draw whole, what is drawn can be cut down: to the files
+/// near the targets, without the files of some directories or the edges
+/// of some rules, and with the files of some directories drawn as one.
 struct GraphViz {
+  explicit GraphViz(FILE* out = stdout) : out_(out), max_depth_(-1) {}
+
+  /// Only draw files at most \a depth edges from the targets; those at
+  /// the limit are dashed, as there is more behind them.  -1 draws all.
+  void set_max_depth(int depth) { max_depth_ = depth; }
+  /// Leave out the files whose paths start with \a prefix, and what
+  /// only they lead to.
+  void Exclude(const string& prefix) { excluded_.push_back(prefix); }
+  /// Draw the outputs of edges of \a rule as if they were sources.
+  void HideRule(const string& rule) { hidden_rules_.insert(rule); }
+  /// Draw the files whose paths start with \a prefix as one node.
+  void Collapse(const string& prefix) { collapsed_.push_back(prefix); }
+
   void Start();
   void AddTarget(Node* node);
   void Finish();
 
-  set<Node*> visited_nodes_;
-  set<Edge*> visited_edges_;
+ private:
+  /// The index in collapsed_ of the prefix of \a node's path, or -1.
+  int Cluster(Node* node) const;
+  bool Excluded(Node* node) const;
+  /// The name of \a node in the output, its cluster's if collapsed.
+  string Name(Node* node) const;
+  /// Draw \a node, or its cluster, once.
+  void AddNode(Node* node, bool truncated);
+  /// Draw \a edge, whose inputs and outputs are drawn or to be.
+  void AddEdge(Edge* edge);
+  /// Draw an arrow, once if it involves a cluster.
+  void AddArrow(const string& from, const string& to, const string& attrs);
+  void Write(const string& text);
+
+  FILE* out_;
+  /// What is written but not yet flushed to out_.
+  string buffer_;
+  int max_depth_;
+  vector<string> excluded_;
+  set<string> hidden_rules_;
+  vector<string> collapsed_;
+
+  /// By Node::id() and Edge::id(): what has been reached.
+  vector<bool> visited_nodes_;
+  vector<bool> visited_edges_;
+  /// The clusters drawn, by index in collapsed_.
+  vector<bool> drawn_clusters_;
+  /// The arrows to or from clusters drawn.
+  set<pair<string, string> > cluster_arrows_;
 };
 
 #endif  // NINJA_GRAPHVIZ_H_
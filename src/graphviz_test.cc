@@ -0,0 +1,110 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "graphviz.h"
+
+#include "graph.h"
+#include "test.h"
+
+struct GraphVizTest : public StateTestWithBuiltinRules {
+  virtual void SetUp() {
+    ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"rule cc\n"
+"  command = cc $in -o $out\n"
+"build out/a.o: cc a.c | /usr/include/stdio.h\n"
+"build out/b.o: cc b.c\n"
+"build lib/x.o: cc x.c\n"
+"build lib/libx.a: cat lib/x.o\n"
+"build app: cat out/a.o out/b.o lib/libx.a\n"));
+    file_ = tmpfile();
+    ASSERT_TRUE(file_);
+  }
+
+  virtual void TearDown() {
+    fclose(file_);
+  }
+
+  /// Draw app with \a graph, and return the lines drawn between the
+  /// header and the closing brace.
+  string Draw(GraphViz* graph) {
+    graph->Start();
+    graph->AddTarget(GetNode("app"));
+    graph->Finish();
+    rewind(file_);
+    string out;
+    char buf[256];
+    int line = 0;
+    while (fgets(buf, sizeof(buf), file_)) {
+      if (++line > 4 && buf[0] != '}')
+        out += buf;
+    }
+    return out;
+  }
+
+  /// The name of the node of \a path in the output.
+  string Name(const char* path) {
+    char name[32];
+    snprintf(name, sizeof(name), "n%d", GetNode(path)->id());
+    return name;
+  }
+
+  FILE* file_;
+};
+
+TEST_F(GraphVizTest, DepthLimit) {
+  GraphViz graph(file_);
+  graph.set_max_depth(1);
+  string out = Draw(&graph);
+  EXPECT_NE(string::npos, out.find("[label=\"app\"]"));
+  EXPECT_NE(string::npos, out.find("[label=\"out/a.o\", style=dashed]"));
+  EXPECT_NE(string::npos, out.find("[label=\"lib/libx.a\", style=dashed]"));
+  EXPECT_EQ(string::npos, out.find("a.c"));
+  EXPECT_EQ(string::npos, out.find("x.o"));
+}
+
+TEST_F(GraphVizTest, ExcludeAndHideRule) {
+  GraphViz graph(file_);
+  graph.Exclude("/usr/");
+  graph.HideRule("cat");
+  string out = Draw(&graph);
+  // app is drawn as a source.
+  EXPECT_EQ("\"" + Name("app") + "\" [label=\"app\"]\n", out);
+
+  fclose(file_);
+  file_ = tmpfile();
+  GraphViz graph2(file_);
+  graph2.Exclude("/usr/");
+  out = Draw(&graph2);
+  EXPECT_EQ(string::npos, out.find("stdio.h"));
+  EXPECT_NE(string::npos, out.find("\"" + Name("a.c") + "\" -> \"" +
+                                   Name("out/a.o") + "\" [label=\" cc\"]"));
+}
+
+TEST_F(GraphVizTest, Collapse) {
+  GraphViz graph(file_);
+  graph.Collapse("out/");
+  graph.Collapse("lib/");
+  string out = Draw(&graph);
+  // One node each, and one arrow from each into app's edge.
+  EXPECT_NE(string::npos, out.find("\"c0\" [label=\"out/...\", shape=box3d]"));
+  EXPECT_NE(string::npos, out.find("\"c1\" [label=\"lib/...\", shape=box3d]"));
+  EXPECT_EQ(string::npos, out.find("out/a.o"));
+  EXPECT_EQ(string::npos, out.find("lib/x.o"));
+  size_t first = out.find("\"c0\" -> ");
+  ASSERT_NE(string::npos, first);
+  EXPECT_EQ(string::npos, out.find("\"c0\" -> ", first + 1));
+  // The sources go into the clusters.
+  EXPECT_NE(string::npos, out.find("\"" + Name("a.c") + "\" -> \"c0\""));
+  EXPECT_NE(string::npos, out.find("\"" + Name("x.c") + "\" -> \"c1\""));
+}
@@ -17,8 +17,23 @@
 #include <algorithm>
 using namespace std;
 
+#include <stdio.h>
+#include <string.h>
 #include <time.h>
 
+#include "hash_map.h"
+#include "metrics.h"
+
+// With -m, compares lookup and insert throughput of the path hash map
+// with the platform's hash_map instead of counting collisions.
+
+#ifdef _MSC_VER
+typedef hash_map<StringPiece, int, StringPieceCmp> ChainedMap;
+#else
+typedef hash_map<StringPiece, int> ChainedMap;
+#endif
+typedef StringPieceHashMap<int> FlatMap;
+
 int random(int low, int high) {
   return int(low + (rand() / double(RAND_MAX)) * (high - low) + 0.5);
 }
@@ -30,7 +45,57 @@ void RandomCommand(char** s) {
     (*s)[i] = (char)random(32, 127);
 }
 
-int main() {
+/// Time inserting \a keys into a map of type \a Map, then looking all of
+/// them up, plus as many keys that are missing.
+template<typename Map>
+void TimeMap(const char* name, const vector<string>& keys,
+             const vector<string>& missing) {
+  int64_t start = GetTimeMillis();
+  Map map;
+  for (size_t i = 0; i < keys.size(); ++i)
+    map[keys[i]] = (int)i;
+  int64_t inserted = GetTimeMillis();
+  int found = 0;
+  for (int rep = 0; rep < 5; ++rep) {
+    for (size_t i = 0; i < keys.size(); ++i)
+      found += map.find(keys[i]) != map.end();
+  }
+  int64_t hits = GetTimeMillis();
+  for (int rep = 0; rep < 5; ++rep) {
+    for (size_t i = 0; i < missing.size(); ++i)
+      found += map.find(missing[i]) != map.end();
+  }
+  int64_t misses = GetTimeMillis();
+
+  double n = (double)keys.size();
+  printf("%-8s insert %5.1fns  hit %5.1fns  miss %5.1fns  (%d found)\n",
+         name, (inserted - start) * 1e6 / n, (hits - inserted) * 1e6 / n / 5,
+         (misses - hits) * 1e6 / missing.size() / 5, found);
+}
+
+void BenchmarkMaps() {
+  // Paths shaped like a large build's outputs.
+  const int kKeys = 1000 * 1000;
+  vector<string> keys, missing;
+  for (int i = 0; i < kKeys; ++i) {
+    char buf[80];
+    sprintf(buf, "out/obj/third_party/module%d/source_file%d.o", i / 64, i);
+    keys.push_back(buf);
+    sprintf(buf, "out/obj/third_party/module%d/source_file%d.h", i / 64, i);
+    missing.push_back(buf);
+  }
+  random_shuffle(keys.begin(), keys.end());
+
+  TimeMap<ChainedMap>("hash_map", keys, missing);
+  TimeMap<FlatMap>("flat", keys, missing);
+}
+
+int main(int argc, char** argv) {
+  if (argc > 1 && strcmp(argv[1], "-m") == 0) {
+    BenchmarkMaps();
+    return 0;
+  }
+
   const int N = 20 * 1000 * 1000;
 
   // Leak these, else 10% of the runtime is spent destroying strings.
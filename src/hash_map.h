@@ -15,6 +15,10 @@
 #ifndef NINJA_MAP_H_
 #define NINJA_MAP_H_
 
+#include <utility>
+#include <vector>
+using namespace std;
+
 #include "string_piece.h"
 
 // MurmurHash2, by Austin Appleby
@@ -93,17 +97,157 @@ struct hash<StringPiece> {
 }
 #endif
 
+/// A hash map from StringPiece to \a V using open addressing: entries
+/// live in one flat array, with collisions resolved by linear probing,
+/// and each slot keeps its key's hash so that probing and growing rarely
+/// touch the key's characters.  Supports just the hash_map operations
+/// ninja uses.  Inserting invalidates iterators.
+template<typename V>
+struct StringPieceHashMap {
+  typedef StringPiece key_type;
+  typedef pair<StringPiece, V> value_type;
+
+  struct Slot {
+    Slot() : hash(0) {}
+    /// The hash of the key, or 0 if the slot is empty.
+    unsigned int hash;
+    value_type value;
+  };
+
+  struct iterator {
+    iterator() : slot_(NULL), end_(NULL) {}
+    iterator(Slot* slot, Slot* end) : slot_(slot), end_(end) {
+      SkipEmpty();
+    }
+
+    value_type& operator*() const { return slot_->value; }
+    value_type* operator->() const { return &slot_->value; }
+    iterator& operator++() {
+      ++slot_;
+      SkipEmpty();
+      return *this;
+    }
+    bool operator==(const iterator& other) const {
+      return slot_ == other.slot_;
+    }
+    bool operator!=(const iterator& other) const {
+      return slot_ != other.slot_;
+    }
+
+   private:
+    friend struct StringPieceHashMap;
+    void SkipEmpty() {
+      while (slot_ != end_ && !slot_->hash)
+        ++slot_;
+    }
+    Slot* slot_;
+    Slot* end_;
+  };
+
+  StringPieceHashMap() : size_(0) {}
+
+  iterator begin() { return iterator(first_slot(), end_slot()); }
+  iterator end() { return iterator(end_slot(), end_slot()); }
+
+  size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+  size_t bucket_count() const { return slots_.size(); }
+
+  iterator find(StringPiece key) {
+    if (slots_.empty())
+      return end();
+    unsigned int hash = Hash(key);
+    size_t mask = slots_.size() - 1;
+    for (size_t i = hash & mask; ; i = (i + 1) & mask) {
+      Slot* slot = &slots_[i];
+      if (!slot->hash)
+        return end();
+      if (slot->hash == hash && slot->value.first == key)
+        return iterator(slot, end_slot());
+    }
+  }
+
+  pair<iterator, bool> insert(const value_type& value) {
+    // Keep the table at most 3/4 full so probe sequences stay short.
+    if ((size_ + 1) * 4 > slots_.size() * 3)
+      Grow();
+    unsigned int hash = Hash(value.first);
+    size_t mask = slots_.size() - 1;
+    size_t i = hash & mask;
+    for (; slots_[i].hash; i = (i + 1) & mask) {
+      Slot* slot = &slots_[i];
+      if (slot->hash == hash && slot->value.first == value.first)
+        return make_pair(iterator(slot, end_slot()), false);
+    }
+    slots_[i].hash = hash;
+    slots_[i].value = value;
+    ++size_;
+    return make_pair(iterator(&slots_[i], end_slot()), true);
+  }
+
+  V& operator[](StringPiece key) {
+    return insert(value_type(key, V())).first->second;
+  }
+
+  void erase(iterator it) {
+    // Shift later entries of the probe sequence back into the hole, so
+    // that lookups never stop early at it.
+    size_t mask = slots_.size() - 1;
+    size_t hole = it.slot_ - first_slot();
+    for (size_t i = (hole + 1) & mask; slots_[i].hash; i = (i + 1) & mask) {
+      size_t home = slots_[i].hash & mask;
+      // Move the entry unless its home lies cyclically in (hole, i].
+      bool stays = hole < i ? (hole < home && home <= i)
+                            : (hole < home || home <= i);
+      if (!stays) {
+        slots_[hole] = slots_[i];
+        hole = i;
+      }
+    }
+    slots_[hole] = Slot();
+    --size_;
+  }
+
+  void clear() {
+    slots_.clear();
+    size_ = 0;
+  }
+
+ private:
+  static unsigned int Hash(StringPiece key) {
+    unsigned int hash = MurmurHash2(key.str_, key.len_);
+    return hash ? hash : 1;
+  }
+
+  Slot* first_slot() { return slots_.empty() ? NULL : &slots_[0]; }
+  Slot* end_slot() { return first_slot() + slots_.size(); }
+
+  void Grow() {
+    vector<Slot> old;
+    old.swap(slots_);
+    slots_.resize(old.empty() ? 16 : old.size() * 2);
+    size_t mask = slots_.size() - 1;
+    for (typename vector<Slot>::iterator i = old.begin(); i != old.end(); ++i) {
+      if (!i->hash)
+        continue;
+      size_t j = i->hash & mask;
+      while (slots_[j].hash)
+        j = (j + 1) & mask;
+      slots_[j] = *i;
+    }
+  }
+
+  vector<Slot> slots_;
+  size_t size_;
+};
+
 /// A template for hash_maps keyed by a StringPiece whose string is
 /// owned externally (typically by the values).  Use like:
 /// ExternalStringHash<Foo*>::Type foos; to make foos into a hash
 /// mapping StringPiece => Foo*.
 template<typename V>
 struct ExternalStringHashMap {
-#ifdef _MSC_VER
-  typedef hash_map<StringPiece, V, StringPieceCmp> Type;
-#else
-  typedef hash_map<StringPiece, V> Type;
-#endif
+  typedef StringPieceHashMap<V> Type;
 };
 
 #endif // NINJA_MAP_H_
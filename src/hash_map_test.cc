@@ -0,0 +1,89 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "hash_map.h"
+
+#include <stdio.h>
+
+#include <map>
+#include <string>
+
+#include <gtest/gtest.h>
+
+namespace {
+
+typedef StringPieceHashMap<int> Map;
+
+TEST(StringPieceHashMap, Basic) {
+  Map map;
+  EXPECT_TRUE(map.empty());
+  EXPECT_TRUE(map.find("a") == map.end());
+  EXPECT_TRUE(map.begin() == map.end());
+
+  EXPECT_TRUE(map.insert(Map::value_type("a", 1)).second);
+  EXPECT_FALSE(map.insert(Map::value_type("a", 2)).second);
+  map["b"] = 3;
+  EXPECT_EQ(2u, map.size());
+  EXPECT_EQ(1, map.find("a")->second);
+  EXPECT_EQ(3, map["b"]);
+  EXPECT_TRUE(map.find("ab") == map.end());
+
+  map.erase(map.find("a"));
+  EXPECT_EQ(1u, map.size());
+  EXPECT_TRUE(map.find("a") == map.end());
+  EXPECT_EQ(3, map.find("b")->second);
+}
+
+TEST(StringPieceHashMap, ManyKeys) {
+  // Compare against std::map through growing and erasing, which shuffles
+  // entries along their probe sequences.
+  const int kKeys = 5000;
+  vector<string> keys;
+  for (int i = 0; i < kKeys; ++i) {
+    char buf[32];
+    sprintf(buf, "path/to/file%d.o", i);
+    keys.push_back(buf);
+  }
+
+  Map map;
+  std::map<string, int> expected;
+  for (int i = 0; i < kKeys; ++i) {
+    map[keys[i]] = i;
+    expected[keys[i]] = i;
+  }
+  EXPECT_LE(map.size() * 4, map.bucket_count() * 3);
+  for (int i = 0; i < kKeys; i += 3) {
+    map.erase(map.find(keys[i]));
+    expected.erase(keys[i]);
+  }
+
+  ASSERT_EQ(expected.size(), map.size());
+  size_t count = 0;
+  for (Map::iterator i = map.begin(); i != map.end(); ++i) {
+    ++count;
+    EXPECT_EQ(expected[i->first.AsString()], i->second);
+  }
+  EXPECT_EQ(expected.size(), count);
+  for (int i = 0; i < kKeys; ++i) {
+    Map::iterator found = map.find(keys[i]);
+    if (i % 3 == 0) {
+      EXPECT_TRUE(found == map.end());
+    } else {
+      ASSERT_TRUE(found != map.end());
+      EXPECT_EQ(i, found->second);
+    }
+  }
+}
+
+}  // anonymous namespace
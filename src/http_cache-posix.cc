@@ -0,0 +1,541 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "http_cache.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "disk_interface.h"
+#include "remote.h"
+#include "util.h"
+
+namespace {
+
+string Lower(const string& str) {
+  string lower = str;
+  for (size_t i = 0; i < lower.size(); ++i) {
+    if (lower[i] >= 'A' && lower[i] <= 'Z')
+      lower[i] += 'a' - 'A';
+  }
+  return lower;
+}
+
+string Trim(const string& str) {
+  size_t start = str.find_first_not_of(" \t");
+  if (start == string::npos)
+    return "";
+  return str.substr(start, str.find_last_not_of(" \t") + 1 - start);
+}
+
+bool WriteFd(int fd, const char* data, size_t size) {
+  while (size > 0) {
+    ssize_t len = write(fd, data, size);
+    if (len < 0 && errno == EINTR)
+      continue;
+    if (len <= 0)
+      return false;
+    data += len;
+    size -= len;
+  }
+  return true;
+}
+
+string StatusError(const string& method, const string& path, int status) {
+  char buf[16];
+  snprintf(buf, sizeof(buf), "%d", status);
+  return method + " " + path + ": HTTP status " + buf;
+}
+
+bool IsSuccess(int status) {
+  return status >= 200 && status < 300;
+}
+
+volatile sig_atomic_t g_quit = 0;
+
+void HandleServerSignal(int signum) {
+  g_quit = 1;
+}
+
+/// Answer the requests on the connection \a fd, for ServeHttpCache().
+void ServeConnection(int fd, const string& dir) {
+  RealDiskInterface disk_interface;
+  string buf;
+  for (;;) {
+    // The request line and headers.
+    size_t end;
+    while ((end = buf.find("\r\n\r\n")) == string::npos) {
+      char chunk[64 << 10];
+      ssize_t len = read(fd, chunk, sizeof(chunk));
+      if (len < 0 && errno == EINTR)
+        continue;
+      if (len <= 0 || buf.size() > (1 << 20))
+        return;
+      buf.append(chunk, len);
+    }
+    string head = buf.substr(0, end);
+    buf.erase(0, end + 4);
+
+    size_t line_end = head.find("\r\n");
+    string request_line = head.substr(0, line_end);
+    int64_t content_length = 0;
+    bool close_after = false;
+    while (line_end != string::npos) {
+      size_t start = line_end + 2;
+      line_end = head.find("\r\n", start);
+      string header = head.substr(start, line_end == string::npos ?
+                                  string::npos : line_end - start);
+      size_t colon = header.find(':');
+      if (colon == string::npos)
+        continue;
+      string name = Lower(Trim(header.substr(0, colon)));
+      string value = Trim(header.substr(colon + 1));
+      if (name == "content-length")
+        content_length = strtoll(value.c_str(), NULL, 10);
+      else if (name == "connection" && Lower(value) == "close")
+        close_after = true;
+    }
+    if (content_length < 0)
+      return;
+
+    // The body, if any.
+    while ((int64_t)buf.size() < content_length) {
+      char chunk[64 << 10];
+      ssize_t len = read(fd, chunk, sizeof(chunk));
+      if (len < 0 && errno == EINTR)
+        continue;
+      if (len <= 0)
+        return;
+      buf.append(chunk, len);
+    }
+    string body = buf.substr(0, content_length);
+    buf.erase(0, content_length);
+
+    size_t space = request_line.find(' ');
+    size_t space2 = space == string::npos ? string::npos :
+        request_line.find(' ', space + 1);
+    if (space2 == string::npos)
+      return;
+    string method = request_line.substr(0, space);
+    string path = request_line.substr(space + 1, space2 - space - 1);
+    path = path.substr(0, path.find('?'));
+
+    const char* status = "200 OK";
+    string reply_body;
+    int64_t reply_length = 0;
+    if (path.empty() || path[0] != '/' ||
+        (path + "/").find("/../") != string::npos) {
+      status = "400 Bad Request";
+    } else if (method == "GET" || method == "HEAD") {
+      string file = dir + path;
+      struct stat st;
+      if (stat(file.c_str(), &st) < 0 || !S_ISREG(st.st_mode)) {
+        status = "404 Not Found";
+      } else if (method == "HEAD") {
+        reply_length = st.st_size;
+      } else {
+        string err;
+        if (::ReadFile(file, &reply_body, &err) < 0)
+          status = "404 Not Found";
+        reply_length = reply_body.size();
+      }
+    } else if (method == "PUT") {
+      string file = dir + path;
+      string temp = file + ".tmp";
+      char pid[16];
+      snprintf(pid, sizeof(pid), "%d", (int)getpid());
+      temp += pid;
+      if (!disk_interface.MakeDirs(file) ||
+          !disk_interface.WriteFile(temp, body) ||
+          rename(temp.c_str(), file.c_str()) < 0) {
+        unlink(temp.c_str());
+        status = "500 Internal Server Error";
+      } else {
+        status = "201 Created";
+      }
+    } else {
+      status = "405 Method Not Allowed";
+    }
+    if (status[0] != '2')
+      reply_length = 0;
+
+    char header[128];
+    snprintf(header, sizeof(header),
+             "HTTP/1.1 %s\r\nContent-Length: %lld\r\n\r\n", status,
+             (long long)reply_length);
+    string reply = header;
+    if (method != "HEAD")
+      reply += reply_body;
+    if (!SendAll(fd, reply.data(), reply.size()) || close_after)
+      return;
+  }
+}
+
+}  // anonymous namespace
+
+HttpCacheClient::HttpCacheClient()
+    : port_(80), fd_(-1), buf_pos_(0), content_length_(-1), chunked_(false),
+      close_(false) {}
+
+HttpCacheClient::~HttpCacheClient() {
+  Disconnect();
+}
+
+bool HttpCacheClient::Init(const string& url, string* err) {
+  const string kScheme = "http://";
+  if (url.compare(0, kScheme.size(), kScheme) != 0) {
+    *err = "expected http://HOST[:PORT][/PREFIX], not '" + url + "'";
+    return false;
+  }
+  size_t slash = url.find('/', kScheme.size());
+  string address = url.substr(kScheme.size(), slash == string::npos ?
+                              string::npos : slash - kScheme.size());
+  prefix_ = slash == string::npos ? "" : url.substr(slash);
+  while (!prefix_.empty() && prefix_[prefix_.size() - 1] == '/')
+    prefix_.resize(prefix_.size() - 1);
+
+  size_t colon = address.rfind(':');
+  if (colon != string::npos && address.find(']', colon) == string::npos) {
+    char* end;
+    port_ = strtol(address.c_str() + colon + 1, &end, 10);
+    if (*end != '\0' || port_ <= 0 || port_ > 65535) {
+      *err = "bad port in '" + url + "'";
+      return false;
+    }
+    address.resize(colon);
+  }
+  if (address.size() > 2 && address[0] == '[' &&
+      address[address.size() - 1] == ']') {
+    address = address.substr(1, address.size() - 2);
+  }
+  if (address.empty()) {
+    *err = "no host in '" + url + "'";
+    return false;
+  }
+  host_ = address;
+  return true;
+}
+
+void HttpCacheClient::Disconnect() {
+  if (fd_ >= 0)
+    close(fd_);
+  fd_ = -1;
+  buf_.clear();
+  buf_pos_ = 0;
+}
+
+int HttpCacheClient::Fill(string* err) {
+  if (buf_pos_ == buf_.size()) {
+    buf_.clear();
+    buf_pos_ = 0;
+  }
+  char chunk[64 << 10];
+  for (;;) {
+    ssize_t len = read(fd_, chunk, sizeof(chunk));
+    if (len < 0 && errno == EINTR)
+      continue;
+    if (len < 0) {
+      *err = string("read: ") + strerror(errno);
+      return -1;
+    }
+    buf_.append(chunk, len);
+    return (int)len;
+  }
+}
+
+bool HttpCacheClient::ReadLine(string* line, string* err) {
+  size_t end;
+  while ((end = buf_.find("\r\n", buf_pos_)) == string::npos) {
+    int len = Fill(err);
+    if (len <= 0) {
+      if (len == 0)
+        *err = host_ + ": connection closed";
+      return false;
+    }
+  }
+  line->assign(buf_, buf_pos_, end - buf_pos_);
+  buf_pos_ = end + 2;
+  return true;
+}
+
+bool HttpCacheClient::Take(int64_t size, string* contents, int fd,
+                           string* err) {
+  while (size != 0) {
+    if (buf_pos_ == buf_.size()) {
+      int len = Fill(err);
+      if (len < 0)
+        return false;
+      if (len == 0) {
+        // Until the end of the connection, for a body of unknown length.
+        if (size < 0)
+          return true;
+        *err = host_ + ": connection closed";
+        return false;
+      }
+    }
+    size_t avail = buf_.size() - buf_pos_;
+    size_t len = size < 0 || (int64_t)avail < size ? avail : (size_t)size;
+    if (fd >= 0) {
+      if (!WriteFd(fd, buf_.data() + buf_pos_, len)) {
+        *err = string("write: ") + strerror(errno);
+        return false;
+      }
+    } else {
+      contents->append(buf_, buf_pos_, len);
+    }
+    buf_pos_ += len;
+    if (size > 0)
+      size -= len;
+  }
+  return true;
+}
+
+bool HttpCacheClient::ReadBody(string* contents, int fd, string* err) {
+  bool ok = true;
+  if (chunked_) {
+    string line;
+    for (;;) {
+      if (!ReadLine(&line, err)) {
+        ok = false;
+        break;
+      }
+      int64_t size = strtoll(line.c_str(), NULL, 16);
+      if (size == 0) {
+        // Skip the trailers.
+        while ((ok = ReadLine(&line, err)) && !line.empty()) {}
+        break;
+      }
+      if (size < 0 || !Take(size, contents, fd, err) ||
+          !ReadLine(&line, err)) {
+        ok = false;
+        break;
+      }
+    }
+  } else {
+    if (content_length_ < 0)
+      close_ = true;
+    ok = Take(content_length_, contents, fd, err);
+  }
+  if (!ok || close_)
+    Disconnect();
+  return ok;
+}
+
+int HttpCacheClient::TryRequest(const string& request, string* err) {
+  if (fd_ < 0) {
+    fd_ = ConnectTcp(host_, port_, err);
+    if (fd_ < 0)
+      return -1;
+  }
+  if (!SendAll(fd_, request.data(), request.size())) {
+    *err = host_ + ": " + strerror(errno);
+    Disconnect();
+    return -1;
+  }
+
+  // "HTTP/1.1 200 OK", then the headers up to an empty line.
+  string line;
+  if (!ReadLine(&line, err)) {
+    Disconnect();
+    return -1;
+  }
+  size_t space = line.find(' ');
+  if (line.compare(0, 5, "HTTP/") != 0 || space == string::npos) {
+    *err = host_ + ": bad response '" + line + "'";
+    Disconnect();
+    return -1;
+  }
+  int status = atoi(line.c_str() + space + 1);
+  content_length_ = -1;
+  chunked_ = false;
+  close_ = line.compare(0, 8, "HTTP/1.0") == 0;
+  for (;;) {
+    if (!ReadLine(&line, err)) {
+      Disconnect();
+      return -1;
+    }
+    if (line.empty())
+      break;
+    size_t colon = line.find(':');
+    if (colon == string::npos)
+      continue;
+    string name = Lower(Trim(line.substr(0, colon)));
+    string value = Lower(Trim(line.substr(colon + 1)));
+    if (name == "content-length")
+      content_length_ = strtoll(value.c_str(), NULL, 10);
+    else if (name == "transfer-encoding")
+      chunked_ = value.find("chunked") != string::npos;
+    else if (name == "connection")
+      close_ = value == "close";
+  }
+  return status;
+}
+
+int HttpCacheClient::Request(const string& method, const string& path,
+                             const string& body, string* err) {
+  string request = method + " " + prefix_ + "/" + path + " HTTP/1.1\r\n" +
+      "Host: " + host_ + "\r\n";
+  if (method == "PUT") {
+    char length[48];
+    snprintf(length, sizeof(length), "Content-Length: %llu\r\n",
+             (unsigned long long)body.size());
+    request += length;
+  }
+  request += "\r\n";
+  request += body;
+
+  bool reused = fd_ >= 0;
+  int status = TryRequest(request, err);
+  if (status < 0 && reused) {
+    // The server may have closed the connection kept open since.
+    status = TryRequest(request, err);
+  }
+  return status;
+}
+
+int HttpCacheClient::Get(const string& path, string* contents,
+                         string* err) {
+  int status = Request("GET", path, "", err);
+  if (status < 0)
+    return -1;
+  contents->clear();
+  string discard;
+  if (!ReadBody(IsSuccess(status) ? contents : &discard, -1, err))
+    return -1;
+  if (IsSuccess(status))
+    return 1;
+  if (status == 404)
+    return 0;
+  *err = StatusError("GET", path, status);
+  return -1;
+}
+
+int HttpCacheClient::GetFile(const string& path, const string& file,
+                             int mode, string* err) {
+  int status = Request("GET", path, "", err);
+  if (status < 0)
+    return -1;
+  string discard;
+  if (!IsSuccess(status)) {
+    if (!ReadBody(&discard, -1, err))
+      return -1;
+    if (status == 404)
+      return 0;
+    *err = StatusError("GET", path, status);
+    return -1;
+  }
+
+  string temp = file + ".XXXXXX";
+  int fd = mkstemp(&temp[0]);
+  if (fd < 0) {
+    *err = temp + ": " + strerror(errno);
+    ReadBody(&discard, -1, &discard);
+    return -1;
+  }
+  fchmod(fd, mode & 0777);
+  bool ok = ReadBody(NULL, fd, err);
+  if (close(fd) < 0 && ok) {
+    *err = temp + ": " + strerror(errno);
+    ok = false;
+  }
+  if (ok && rename(temp.c_str(), file.c_str()) < 0) {
+    *err = file + ": " + strerror(errno);
+    ok = false;
+  }
+  if (!ok) {
+    unlink(temp.c_str());
+    return -1;
+  }
+  return 1;
+}
+
+int HttpCacheClient::Head(const string& path, string* err) {
+  int status = Request("HEAD", path, "", err);
+  if (status < 0)
+    return -1;
+  // A response to HEAD has no body, whatever its headers say.
+  if (close_)
+    Disconnect();
+  if (IsSuccess(status))
+    return 1;
+  if (status == 404)
+    return 0;
+  *err = StatusError("HEAD", path, status);
+  return -1;
+}
+
+bool HttpCacheClient::Put(const string& path, const string& contents,
+                          string* err) {
+  int status = Request("PUT", path, contents, err);
+  if (status < 0)
+    return false;
+  string discard;
+  if (!ReadBody(&discard, -1, err))
+    return false;
+  if (!IsSuccess(status)) {
+    *err = StatusError("PUT", path, status);
+    return false;
+  }
+  return true;
+}
+
+bool ServeHttpCache(const string& host, int port, const string& dir,
+                    string* err) {
+  int listen_fd = ListenTcp(host, port, err);
+  if (listen_fd < 0)
+    return false;
+
+  // No SA_RESTART, so that accept() returns.
+  struct sigaction act;
+  memset(&act, 0, sizeof(act));
+  act.sa_handler = HandleServerSignal;
+  sigaction(SIGINT, &act, NULL);
+  sigaction(SIGTERM, &act, NULL);
+
+  // A process per connection, as a client keeps its connection open.
+  while (!g_quit) {
+    while (waitpid(-1, NULL, WNOHANG) > 0) {}
+    int fd = accept(listen_fd, NULL, NULL);
+    if (fd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      *err = string("accept: ") + strerror(errno);
+      close(listen_fd);
+      return false;
+    }
+    SetCloseOnExec(fd);
+    pid_t pid = fork();
+    if (pid == 0) {
+      signal(SIGINT, SIG_DFL);
+      signal(SIGTERM, SIG_DFL);
+      close(listen_fd);
+      // Don't keep a process for a client that went quiet.
+      struct timeval timeout = { 60, 0 };
+      setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+      ServeConnection(fd, dir);
+      _exit(0);
+    }
+    close(fd);
+  }
+  close(listen_fd);
+  return true;
+}
@@ -0,0 +1,92 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef NINJA_HTTP_CACHE_H_
+#define NINJA_HTTP_CACHE_H_
+
+#include <string>
+using namespace std;
+
+#include "util.h"  // int64_t
+
+/// A client of a cache server speaking plain HTTP/1.1, where GET and
+/// HEAD read what PUT stored under a path: the protocol of the HTTP
+/// caches of other build tools, which e.g. nginx's WebDAV module serves,
+/// as does "ninja -t cache-server".  The requests of a client go one
+/// after the other over one connection.  No TLS.  POSIX only.
+struct HttpCacheClient {
+  HttpCacheClient();
+  ~HttpCacheClient();
+
+  /// Use the server at \a url, "http://HOST[:PORT][/PREFIX]".
+  bool Init(const string& url, string* err);
+
+  /// Read what is stored under \a path into \a contents.  Returns 1, 0 if
+  /// nothing is, or -1 filling in \a err.
+  int Get(const string& path, string* contents, string* err);
+
+  /// Like Get(), but write it to the file \a file with permissions
+  /// \a mode as it comes, through a temporary file beside it that only
+  /// replaces \a file once complete.
+  int GetFile(const string& path, const string& file, int mode, string* err);
+
+  /// Whether something is stored under \a path, returning as Get().
+  int Head(const string& path, string* err);
+
+  /// Store \a contents under \a path.
+  bool Put(const string& path, const string& contents, string* err);
+
+ private:
+  /// Send a request, retrying once on a new connection if the server
+  /// closed the one kept open, and read the status and headers of the
+  /// response.  Returns the status, or -1 filling in \a err.
+  int Request(const string& method, const string& path, const string& body,
+              string* err);
+  int TryRequest(const string& request, string* err);
+
+  /// Read the body of the response to \a contents, or to \a fd if not
+  /// -1.
+  bool ReadBody(string* contents, int fd, string* err);
+
+  /// Read \a size bytes of the response, or up to the end of the
+  /// connection if negative, as ReadBody().
+  bool Take(int64_t size, string* contents, int fd, string* err);
+  /// Read a line of the response, without its CRLF.
+  bool ReadLine(string* line, string* err);
+  /// Read more of the response into buf_.  Returns the bytes read, 0 at
+  /// the end of the connection, or -1 filling in \a err.
+  int Fill(string* err);
+
+  void Disconnect();
+
+  string host_;
+  int port_;
+  string prefix_;
+  int fd_;
+  /// Read from fd_ but not yet consumed, from buf_pos_.
+  string buf_;
+  size_t buf_pos_;
+  /// From the headers of the response being read.
+  int64_t content_length_;
+  bool chunked_;
+  bool close_;
+};
+
+/// Serve GET, HEAD and PUT of the files under \a dir on \a port of the
+/// address \a host, until stopped by SIGINT or SIGTERM.  Returns false,
+/// filling in \a err, if it can't.
+bool ServeHttpCache(const string& host, int port, const string& dir,
+                    string* err);
+
+#endif  // NINJA_HTTP_CACHE_H_
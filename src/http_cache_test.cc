@@ -0,0 +1,99 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "http_cache.h"
+
+#include <signal.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "disk_interface.h"
+#include "test.h"
+
+TEST(HttpCacheTest, Init) {
+  HttpCacheClient client;
+  string err;
+  EXPECT_TRUE(client.Init("http://cache.example.com:8080/ninja/", &err));
+  EXPECT_TRUE(client.Init("http://[::1]:8080", &err));
+  EXPECT_TRUE(client.Init("http://cache", &err));
+
+  EXPECT_FALSE(client.Init("https://cache", &err));
+  EXPECT_EQ("expected http://HOST[:PORT][/PREFIX], not 'https://cache'", err);
+  EXPECT_FALSE(client.Init("http://cache:http/", &err));
+  EXPECT_EQ("bad port in 'http://cache:http/'", err);
+  EXPECT_FALSE(client.Init("http:///ninja", &err));
+  EXPECT_EQ("no host in 'http:///ninja'", err);
+}
+
+TEST(HttpCacheTest, PutAndGet) {
+  ScopedTempDir temp_dir;
+  temp_dir.CreateAndEnter("ninja_http_cache_test");
+
+  // A port unlikely to be in use, so that tests run side by side don't
+  // collide.
+  int port = 20000 + (getpid() + 7) % 20000;
+  pid_t server = fork();
+  ASSERT_LE(0, server);
+  if (server == 0) {
+    string err;
+    _exit(ServeHttpCache("localhost", port, "served", &err) ? 0 : 1);
+  }
+
+  char url[64];
+  snprintf(url, sizeof(url), "http://localhost:%d/prefix/", port);
+  HttpCacheClient client;
+  string err;
+  ASSERT_TRUE(client.Init(url, &err));
+  int found = -1;
+  string contents;
+  for (int tries = 0; tries < 100 && found < 0; ++tries) {
+    found = client.Get("ac/1", &contents, &err);
+    if (found < 0)
+      usleep(20 * 1000);
+  }
+  EXPECT_EQ(0, found);
+  EXPECT_EQ(0, client.Head("ac/1", &err));
+
+  // The requests go over the same connection.
+  string big(1 << 20, 'x');
+  EXPECT_TRUE(client.Put("ac/1", "hello", &err)) << err;
+  EXPECT_TRUE(client.Put("cas/2", big, &err)) << err;
+  EXPECT_EQ(1, client.Get("ac/1", &contents, &err));
+  EXPECT_EQ("hello", contents);
+  EXPECT_EQ(1, client.Head("cas/2", &err));
+  EXPECT_EQ(1, client.GetFile("cas/2", "out", 0755, &err));
+  RealDiskInterface disk_interface;
+  EXPECT_EQ(big, disk_interface.ReadFile("out", &err));
+  struct stat st;
+  ASSERT_EQ(0, stat("out", &st));
+  EXPECT_EQ(0755, (int)(st.st_mode & 0777));
+  EXPECT_EQ(0, client.GetFile("cas/3", "out", 0644, &err));
+  EXPECT_EQ(big, disk_interface.ReadFile("out", &err));
+
+  // Outside the directory served.
+  EXPECT_EQ(-1, client.Get("../served/prefix/ac/1", &contents, &err));
+
+  kill(server, SIGTERM);
+  int status;
+  waitpid(server, &status, 0);
+  EXPECT_TRUE(WIFEXITED(status));
+
+  // Without a server.
+  HttpCacheClient other_client;
+  ASSERT_TRUE(other_client.Init(url, &err));
+  EXPECT_EQ(-1, other_client.Get("ac/1", &contents, &err));
+  temp_dir.Cleanup();
+}
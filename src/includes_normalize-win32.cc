@@ -19,6 +19,7 @@
 
 #include <algorithm>
 #include <iterator>
+#include <map>
 #include <sstream>
 
 #include <windows.h>
@@ -38,6 +39,49 @@ bool SameDrive(StringPiece a, StringPiece b)  {
   return _stricmp(a_drive, b_drive) == 0;
 }
 
+/// What Normalize() has worked out, kept for the life of the process: a
+/// compile lists thousands of includes, and the same headers come up in
+/// compile after compile.  The current directory is taken not to change
+/// once paths are normalized.  Not thread-safe.
+struct NormalizeCache {
+  /// A directory paths are made relative to.
+  struct Start {
+    string abs_path;
+    /// abs_path split, and lowercased to compare with.
+    vector<string> parts;
+    /// Normalize()'s results, by the path as given.
+    map<string, string> normalized;
+  };
+  /// By the directory as given to Normalize(), "" for the current one.
+  map<string, Start> starts;
+};
+
+NormalizeCache& Cache() {
+  static NormalizeCache cache;
+  return cache;
+}
+
+/// IncludesNormalize::Relativize(), from the split, lowercased absolute
+/// path of the directory to start from.
+string RelativizeTo(StringPiece path, const vector<string>& start_parts) {
+  vector<string> path_list =
+      IncludesNormalize::Split(IncludesNormalize::AbsPath(path), '\\');
+  size_t i;
+  for (i = 0; i < min(start_parts.size(), path_list.size()); ++i) {
+    if (start_parts[i] != IncludesNormalize::ToLower(path_list[i]))
+      break;
+  }
+
+  vector<string> rel_list;
+  for (size_t j = i; j < start_parts.size(); ++j)
+    rel_list.push_back("..");
+  for (size_t j = i; j < path_list.size(); ++j)
+    rel_list.push_back(path_list[j]);
+  if (rel_list.size() == 0)
+    return ".";
+  return IncludesNormalize::Join(rel_list, '\\');
+}
+
 }  // anonymous namespace
 
 string IncludesNormalize::Join(const vector<string>& list, char sep) {
@@ -72,27 +116,21 @@ string IncludesNormalize::AbsPath(StringPiece s) {
 }
 
 string IncludesNormalize::Relativize(StringPiece path, const string& start) {
-  vector<string> start_list = Split(AbsPath(start), '\\');
-  vector<string> path_list = Split(AbsPath(path), '\\');
-  int i;
-  for (i = 0; i < static_cast<int>(min(start_list.size(), path_list.size()));
-       ++i) {
-    if (ToLower(start_list[i]) != ToLower(path_list[i]))
-      break;
-  }
-
-  vector<string> rel_list;
-  for (int j = 0; j < static_cast<int>(start_list.size() - i); ++j)
-    rel_list.push_back("..");
-  for (int j = i; j < static_cast<int>(path_list.size()); ++j)
-    rel_list.push_back(path_list[j]);
-  if (rel_list.size() == 0)
-    return ".";
-  return Join(rel_list, '\\');
+  return RelativizeTo(path, Split(ToLower(AbsPath(start)), '\\'));
 }
 
 string IncludesNormalize::Normalize(const string& input,
                                     const char* relative_to) {
+  NormalizeCache::Start& start =
+      Cache().starts[relative_to ? relative_to : ""];
+  if (start.abs_path.empty()) {
+    start.abs_path = AbsPath(relative_to ? relative_to : ".");
+    start.parts = Split(ToLower(start.abs_path), '\\');
+  }
+  map<string, string>::iterator cached = start.normalized.find(input);
+  if (cached != start.normalized.end())
+    return cached->second;
+
   char copy[_MAX_PATH];
   size_t len = input.size();
   strncpy(copy, input.c_str(), input.size() + 1);
@@ -103,13 +141,12 @@ string IncludesNormalize::Normalize(const string& input,
   if (!CanonicalizePath(copy, &len, &err)) {
     Warning("couldn't canonicalize '%s: %s\n", input.c_str(), err.c_str());
   }
-  string curdir;
-  if (!relative_to) {
-    curdir = AbsPath(".");
-    relative_to = curdir.c_str();
-  }
   StringPiece partially_fixed(copy, len);
-  if (!SameDrive(partially_fixed, relative_to))
-    return ToLower(partially_fixed.AsString());
-  return ToLower(Relativize(partially_fixed, relative_to));
+  string result;
+  if (!SameDrive(partially_fixed, start.abs_path))
+    result = ToLower(partially_fixed.AsString());
+  else
+    result = ToLower(RelativizeTo(partially_fixed, start.parts));
+  start.normalized.insert(make_pair(input, result));
+  return result;
 }
@@ -30,6 +30,7 @@ struct IncludesNormalize {
 
   /// Normalize by fixing slashes style, fixing redundant .. and . and makes the
   /// path relative to |relative_to|. Case is normalized to lowercase on
-  /// Windows too.
+  /// Windows too.  Results are remembered for the life of the process,
+  /// by |relative_to| and |input|.
   static string Normalize(const string& input, const char* relative_to);
 };
@@ -49,6 +49,14 @@ TEST(IncludesNormalize, WithRelative) {
   EXPECT_EQ(".", IncludesNormalize::Normalize("a", "a"));
 }
 
+TEST(IncludesNormalize, Cached) {
+  // The same path again, and relative to another directory.
+  EXPECT_EQ("c", IncludesNormalize::Normalize("a/b/c", "a/b"));
+  EXPECT_EQ("c", IncludesNormalize::Normalize("a/b/c", "a/b"));
+  EXPECT_EQ("b\\c", IncludesNormalize::Normalize("a/b/c", "a"));
+  EXPECT_EQ("a\\b\\c", IncludesNormalize::Normalize("a/b/c", NULL));
+}
+
 TEST(IncludesNormalize, Case) {
   EXPECT_EQ("b", IncludesNormalize::Normalize("Abc\\..\\b", NULL));
   EXPECT_EQ("bdef", IncludesNormalize::Normalize("Abc\\..\\BdEf", NULL));
@@ -0,0 +1,315 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "io_uring.h"
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
+#endif
+
+// The operations used here came with Linux 5.6, as did this flag.
+#ifdef IORING_SETUP_CLAMP
+#define NINJA_HAVE_IO_URING
+#endif
+
+#ifdef NINJA_HAVE_IO_URING
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "metrics.h"
+#include "util.h"
+
+/// One operation, and its result: what the kernel returns, which is a
+/// negated errno on failure.
+struct IoUring::Op {
+  Op() : opcode(0), fd(-1), addr(NULL), len(0), off(0), flags(0), res(0) {}
+  unsigned char opcode;
+  int fd;
+  const void* addr;
+  unsigned len;
+  uint64_t off;
+  int flags;
+  int res;
+};
+
+IoUring::IoUring()
+    : fd_(-1), sq_ring_(NULL), sq_ring_size_(0), cq_ring_(NULL),
+      cq_ring_size_(0), sqes_(NULL) {}
+
+IoUring::~IoUring() {
+  if (sqes_)
+    munmap(sqes_, kEntries * sizeof(io_uring_sqe));
+  if (cq_ring_ && cq_ring_ != sq_ring_)
+    munmap(cq_ring_, cq_ring_size_);
+  if (sq_ring_)
+    munmap(sq_ring_, sq_ring_size_);
+  if (fd_ >= 0)
+    close(fd_);
+}
+
+bool IoUring::Init() {
+  io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  fd_ = (int)syscall(__NR_io_uring_setup, kEntries, &params);
+  if (fd_ < 0)
+    return false;
+
+  sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  cq_ring_size_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+  bool single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+  if (single_mmap)
+    sq_ring_size_ = cq_ring_size_ = max(sq_ring_size_, cq_ring_size_);
+  void* sq_ring = mmap(NULL, sq_ring_size_, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQ_RING);
+  if (sq_ring == MAP_FAILED)
+    return false;
+  sq_ring_ = sq_ring;
+  if (single_mmap) {
+    cq_ring_ = sq_ring_;
+  } else {
+    void* cq_ring = mmap(NULL, cq_ring_size_, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_CQ_RING);
+    if (cq_ring == MAP_FAILED)
+      return false;
+    cq_ring_ = cq_ring;
+  }
+  void* sqes = mmap(NULL, kEntries * sizeof(io_uring_sqe),
+                    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_,
+                    IORING_OFF_SQES);
+  if (sqes == MAP_FAILED)
+    return false;
+  sqes_ = sqes;
+
+  char* sq = (char*)sq_ring_;
+  sq_tail_ = (unsigned*)(sq + params.sq_off.tail);
+  sq_mask_ = (unsigned*)(sq + params.sq_off.ring_mask);
+  sq_array_ = (unsigned*)(sq + params.sq_off.array);
+  char* cq = (char*)cq_ring_;
+  cq_head_ = (unsigned*)(cq + params.cq_off.head);
+  cq_tail_ = (unsigned*)(cq + params.cq_off.tail);
+  cq_mask_ = (unsigned*)(cq + params.cq_off.ring_mask);
+  cqes_ = cq + params.cq_off.cqes;
+  return true;
+}
+
+void IoUring::StatAt(int dirfd, const vector<const char*>& names,
+                     vector<TimeStamp>* mtimes) {
+  vector<Op> ops(names.size());
+  vector<struct statx> bufs(names.size());
+  for (size_t i = 0; i < names.size(); ++i) {
+    ops[i].opcode = IORING_OP_STATX;
+    ops[i].fd = dirfd;
+    ops[i].addr = names[i];
+    ops[i].len = STATX_MTIME;
+    ops[i].off = (uint64_t)(uintptr_t)&bufs[i];
+  }
+  if (!ops.empty())
+    Run(&ops[0], ops.size());
+
+  mtimes->resize(names.size());
+  for (size_t i = 0; i < names.size(); ++i) {
+    if (ops[i].res == 0) {
+      (*mtimes)[i] = (TimeStamp)bufs[i].stx_mtime.tv_sec * 1000000000LL +
+          bufs[i].stx_mtime.tv_nsec;
+    } else if (ops[i].res == -ENOENT || ops[i].res == -ENOTDIR) {
+      (*mtimes)[i] = 0;
+    } else {
+      (*mtimes)[i] = -1;
+    }
+  }
+}
+
+void IoUring::Stat(const vector<const char*>& paths,
+                   vector<TimeStamp>* mtimes) {
+  StatAt(AT_FDCWD, paths, mtimes);
+}
+
+void IoUring::ReadFiles(const vector<string>& paths, vector<string>* contents,
+                        vector<bool>* ok) {
+  // How much of each file the first read asks for.  Depfiles are
+  // mostly smaller; bigger files take more reads, twice as big each.
+  const unsigned kFirstRead = 64 << 10;
+
+  contents->assign(paths.size(), string());
+  ok->assign(paths.size(), false);
+  vector<Op> ops(paths.size());
+  for (size_t i = 0; i < paths.size(); ++i) {
+    ops[i].opcode = IORING_OP_OPENAT;
+    ops[i].fd = AT_FDCWD;
+    ops[i].addr = paths[i].c_str();
+    ops[i].flags = O_RDONLY | O_CLOEXEC;
+  }
+  if (!ops.empty())
+    Run(&ops[0], ops.size());
+
+  // Read those opened until each comes up short.
+  vector<size_t> reading;
+  vector<int> fds;
+  vector<size_t> sizes(paths.size());
+  for (size_t i = 0; i < paths.size(); ++i) {
+    if (ops[i].res >= 0) {
+      reading.push_back(i);
+      fds.push_back(ops[i].res);
+    }
+  }
+  vector<int> opened = fds;
+  while (!reading.empty()) {
+    ops.assign(reading.size(), Op());
+    for (size_t j = 0; j < reading.size(); ++j) {
+      string* content = &(*contents)[reading[j]];
+      size_t& size = sizes[reading[j]];
+      unsigned len = size == 0 ? kFirstRead : (unsigned)size;
+      content->resize(size + len);
+      ops[j].opcode = IORING_OP_READ;
+      ops[j].fd = fds[j];
+      ops[j].addr = &(*content)[size];
+      ops[j].len = len;
+      ops[j].off = size;
+    }
+    Run(&ops[0], ops.size());
+
+    vector<size_t> more;
+    vector<int> more_fds;
+    for (size_t j = 0; j < reading.size(); ++j) {
+      size_t i = reading[j];
+      if (ops[j].res < 0) {
+        (*contents)[i].clear();
+        continue;
+      }
+      sizes[i] += ops[j].res;
+      (*contents)[i].resize(sizes[i]);
+      if ((unsigned)ops[j].res < ops[j].len) {
+        (*ok)[i] = true;
+      } else {
+        more.push_back(i);
+        more_fds.push_back(fds[j]);
+      }
+    }
+    reading.swap(more);
+    fds.swap(more_fds);
+  }
+
+  ops.assign(opened.size(), Op());
+  for (size_t j = 0; j < opened.size(); ++j) {
+    ops[j].opcode = IORING_OP_CLOSE;
+    ops[j].fd = opened[j];
+  }
+  if (!ops.empty())
+    Run(&ops[0], ops.size());
+  for (size_t j = 0; j < opened.size(); ++j) {
+    if (ops[j].res < 0)
+      close(opened[j]);
+  }
+}
+
+void IoUring::Run(Op* ops, size_t count) {
+  METRIC_RECORD("io_uring batch");
+  io_uring_sqe* sqes = (io_uring_sqe*)sqes_;
+  for (size_t start = 0; start < count; start += kEntries) {
+    unsigned batch = (unsigned)min(count - start, (size_t)kEntries);
+    unsigned tail = *sq_tail_;
+    for (unsigned i = 0; i < batch; ++i) {
+      const Op& op = ops[start + i];
+      unsigned index = (tail + i) & *sq_mask_;
+      io_uring_sqe* sqe = &sqes[index];
+      memset(sqe, 0, sizeof(*sqe));
+      sqe->opcode = op.opcode;
+      sqe->fd = op.fd;
+      sqe->addr = (uint64_t)(uintptr_t)op.addr;
+      sqe->len = op.len;
+      sqe->off = op.off;
+      // The open flags and the statx flags share the field.
+      sqe->open_flags = op.flags;
+      sqe->user_data = start + i;
+      sq_array_[index] = index;
+    }
+    __atomic_store_n(sq_tail_, tail + batch, __ATOMIC_RELEASE);
+
+    unsigned submitted = 0;
+    while (submitted < batch) {
+      int ret = (int)syscall(__NR_io_uring_enter, fd_, batch - submitted, 0,
+                             0, NULL, 0);
+      if (ret < 0) {
+        if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+          continue;
+        Fatal("io_uring_enter: %s", strerror(errno));
+      }
+      submitted += ret;
+    }
+    // The kernel writes into the callers' buffers until the last of the
+    // batch completes.
+    Reap(ops, batch);
+  }
+}
+
+void IoUring::Reap(Op* ops, unsigned count) {
+  io_uring_cqe* cqes = (io_uring_cqe*)cqes_;
+  unsigned reaped = 0;
+  while (reaped < count) {
+    unsigned head = *cq_head_;
+    unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+    if (head == tail) {
+      int ret = (int)syscall(__NR_io_uring_enter, fd_, 0, count - reaped,
+                             IORING_ENTER_GETEVENTS, NULL, 0);
+      if (ret < 0 && errno != EINTR)
+        Fatal("io_uring_enter: %s", strerror(errno));
+      continue;
+    }
+    for (; head != tail; ++head, ++reaped) {
+      const io_uring_cqe& cqe = cqes[head & *cq_mask_];
+      ops[cqe.user_data].res = cqe.res;
+    }
+    __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+  }
+}
+
+#else  // NINJA_HAVE_IO_URING
+
+struct IoUring::Op {};
+
+IoUring::IoUring() : fd_(-1) {}
+
+IoUring::~IoUring() {}
+
+bool IoUring::Init() {
+  return false;
+}
+
+void IoUring::StatAt(int dirfd, const vector<const char*>& names,
+                     vector<TimeStamp>* mtimes) {
+  mtimes->assign(names.size(), -1);
+}
+
+void IoUring::Stat(const vector<const char*>& paths,
+                   vector<TimeStamp>* mtimes) {
+  mtimes->assign(paths.size(), -1);
+}
+
+void IoUring::ReadFiles(const vector<string>& paths, vector<string>* contents,
+                        vector<bool>* ok) {
+  contents->assign(paths.size(), string());
+  ok->assign(paths.size(), false);
+}
+
+#endif  // NINJA_HAVE_IO_URING
@@ -0,0 +1,83 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef NINJA_IO_URING_H_
+#define NINJA_IO_URING_H_
+
+#include <string>
+#include <vector>
+using namespace std;
+
+#include "timestamp.h"
+
+/// Stats and file reads handed to the kernel a batch at a time through
+/// an io_uring, on Linux 5.6 and later: one system call for each batch
+/// of up to kEntries, rather than one or more per file, and the kernel
+/// is free to work on them at once.  For RealDiskInterface::StatMany()
+/// and ReadFiles().  Talks to the kernel directly, without liburing.
+///
+/// A ring isn't safe to use from two threads at once.  Where io_uring
+/// isn't there, or is forbidden (as by some container seccomp
+/// profiles), Init() fails and the caller goes on a file at a time.
+struct IoUring {
+  IoUring();
+  ~IoUring();
+
+  /// How many operations are in flight at once, at most.
+  enum { kEntries = 256 };
+
+  /// Set the ring up.  Returns false if io_uring can't be used.
+  bool Init();
+
+  /// Stat each of \a names, relative to the directory \a dirfd (or
+  /// AT_FDCWD), following symlinks, into \a mtimes: 0 for one that
+  /// doesn't exist, as for Stat(), and -1 for one that couldn't be
+  /// stat'ed, left for the caller to retry and report.
+  void StatAt(int dirfd, const vector<const char*>& names,
+              vector<TimeStamp>* mtimes);
+  /// StatAt() the working directory.
+  void Stat(const vector<const char*>& paths, vector<TimeStamp>* mtimes);
+
+  /// Read each of \a paths whole into \a contents, with \a ok false for
+  /// those that couldn't be read, to be retried and reported by the
+  /// caller.  Opens, reads and closes each go as a batch.
+  void ReadFiles(const vector<string>& paths, vector<string>* contents,
+                 vector<bool>* ok);
+
+ private:
+  struct Op;
+  /// Run \a count operations, in batches as the ring has room, setting
+  /// each one's result.
+  void Run(Op* ops, size_t count);
+  /// Wait for \a count completions, setting their operations' results.
+  void Reap(Op* ops, unsigned count);
+
+  int fd_;
+  /// The mapped rings.
+  void* sq_ring_;
+  size_t sq_ring_size_;
+  void* cq_ring_;
+  size_t cq_ring_size_;
+  void* sqes_;
+  /// Fields within them.
+  unsigned* sq_tail_;
+  unsigned* sq_mask_;
+  unsigned* sq_array_;
+  unsigned* cq_head_;
+  unsigned* cq_tail_;
+  unsigned* cq_mask_;
+  void* cqes_;
+};
+
+#endif  // NINJA_IO_URING_H_
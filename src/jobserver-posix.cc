@@ -0,0 +1,153 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "jobserver.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "util.h"
+
+Jobserver::Jobserver() : read_fd_(-1), write_fd_(-1), held_(0) {
+}
+
+Jobserver::~Jobserver() {
+  while (held_ > 0)
+    Release();
+  // The read descriptor is always our own; the write one may be make's.
+  if (read_fd_ >= 0)
+    close(read_fd_);
+  if (!fifo_.empty()) {
+    unlink(fifo_.c_str());
+    rmdir(fifo_dir_.c_str());
+  }
+}
+
+bool Jobserver::Connect(string* err) {
+  const char* makeflags = getenv("MAKEFLAGS");
+  Auth auth;
+  if (!makeflags || !ParseMakeflags(makeflags, &auth))
+    return false;
+
+  if (!auth.fifo.empty()) {
+    // Opened for writing too, so that opening doesn't wait for a writer.
+    read_fd_ = open(auth.fifo.c_str(), O_RDWR | O_NONBLOCK);
+    if (read_fd_ < 0) {
+      *err = "opening jobserver fifo " + auth.fifo + ": " + strerror(errno);
+      return false;
+    }
+    SetCloseOnExec(read_fd_);
+    write_fd_ = read_fd_;
+    return true;
+  }
+
+  if (auth.read_fd < 0) {
+    *err = "unsupported jobserver '" + auth.semaphore + "' in MAKEFLAGS";
+    return false;
+  }
+  // make closes the pipe for commands it doesn't know to run make, and
+  // the descriptors may since have been reused.
+  struct stat read_st, write_st;
+  if (fstat(auth.read_fd, &read_st) < 0 || !S_ISFIFO(read_st.st_mode) ||
+      fstat(auth.write_fd, &write_st) < 0 || !S_ISFIFO(write_st.st_mode)) {
+    *err = "jobserver pipe in MAKEFLAGS is closed; "
+           "mark the make rule running ninja with '+'";
+    return false;
+  }
+  // The pipe is shared with make, which expects reads from it to block,
+  // so it can't be made non-blocking.  A description of our own can.
+#ifdef linux
+  char path[64];
+  snprintf(path, sizeof(path), "/proc/self/fd/%d", auth.read_fd);
+  read_fd_ = open(path, O_RDONLY | O_NONBLOCK);
+#endif
+  if (read_fd_ < 0) {
+    *err = "can't share make's jobserver pipe here; "
+           "make 4.4 and later can pass a fifo instead";
+    return false;
+  }
+  SetCloseOnExec(read_fd_);
+  write_fd_ = auth.write_fd;
+  return true;
+}
+
+bool Jobserver::Serve(int jobs, string* err) {
+  const char* tmp_dir = getenv("TMPDIR");
+  string dir = string(tmp_dir && *tmp_dir ? tmp_dir : "/tmp") +
+      "/ninja-jobserver-XXXXXX";
+  if (!mkdtemp(&dir[0])) {
+    *err = "mkdtemp: " + string(strerror(errno));
+    return false;
+  }
+  string fifo = dir + "/fifo";
+  if (mkfifo(fifo.c_str(), 0600) < 0) {
+    *err = "mkfifo: " + string(strerror(errno));
+    rmdir(dir.c_str());
+    return false;
+  }
+  fifo_ = fifo;
+  fifo_dir_ = dir;
+
+  read_fd_ = open(fifo.c_str(), O_RDWR | O_NONBLOCK);
+  if (read_fd_ < 0) {
+    *err = "opening jobserver fifo " + fifo + ": " + strerror(errno);
+    return false;
+  }
+  SetCloseOnExec(read_fd_);
+  write_fd_ = read_fd_;
+  for (int i = 1; i < jobs; ++i) {
+    if (write(write_fd_, "+", 1) != 1) {
+      *err = "filling jobserver fifo: " + string(strerror(errno));
+      return false;
+    }
+  }
+
+  char flags[64];
+  snprintf(flags, sizeof(flags), "-j%d --jobserver-auth=fifo:", jobs);
+  string makeflags = flags + fifo;
+  const char* old_makeflags = getenv("MAKEFLAGS");
+  if (old_makeflags && *old_makeflags)
+    makeflags = string(old_makeflags) + " " + makeflags;
+  if (setenv("MAKEFLAGS", makeflags.c_str(), 1) < 0) {
+    *err = "setenv: " + string(strerror(errno));
+    return false;
+  }
+  return true;
+}
+
+bool Jobserver::Acquire() {
+  char token;
+  ssize_t len;
+  do {
+    len = read(read_fd_, &token, 1);
+  } while (len < 0 && errno == EINTR);
+  if (len != 1)
+    return false;
+  tokens_.push_back(token);
+  ++held_;
+  return true;
+}
+
+void Jobserver::Release() {
+  char token = tokens_.back();
+  tokens_.pop_back();
+  --held_;
+  while (write(write_fd_, &token, 1) < 0 && errno == EINTR) {
+  }
+}
@@ -0,0 +1,86 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "jobserver.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <algorithm>
+
+#include "util.h"
+
+Jobserver::Jobserver() : semaphore_(NULL), held_(0) {
+}
+
+Jobserver::~Jobserver() {
+  while (held_ > 0)
+    Release();
+  if (semaphore_)
+    CloseHandle(semaphore_);
+}
+
+bool Jobserver::Connect(string* err) {
+  const char* makeflags = getenv("MAKEFLAGS");
+  Auth auth;
+  if (!makeflags || !ParseMakeflags(makeflags, &auth))
+    return false;
+  if (auth.semaphore.empty()) {
+    *err = "unsupported jobserver in MAKEFLAGS";
+    return false;
+  }
+  semaphore_ = OpenSemaphoreA(SYNCHRONIZE | SEMAPHORE_MODIFY_STATE, FALSE,
+                              auth.semaphore.c_str());
+  if (!semaphore_) {
+    *err = "opening jobserver semaphore " + auth.semaphore + ": " +
+        GetLastErrorString();
+    return false;
+  }
+  return true;
+}
+
+bool Jobserver::Serve(int jobs, string* err) {
+  char name[64];
+  snprintf(name, sizeof(name), "ninja_jobserver_%lu",
+           GetCurrentProcessId());
+  semaphore_ = CreateSemaphoreA(NULL, jobs - 1, max(jobs - 1, 1), name);
+  if (!semaphore_) {
+    *err = "creating jobserver semaphore: " + GetLastErrorString();
+    return false;
+  }
+
+  char flags[128];
+  snprintf(flags, sizeof(flags), "-j%d --jobserver-auth=%s", jobs, name);
+  string makeflags = flags;
+  const char* old_makeflags = getenv("MAKEFLAGS");
+  if (old_makeflags && *old_makeflags)
+    makeflags = string(old_makeflags) + " " + makeflags;
+  if (!SetEnvironmentVariableA("MAKEFLAGS", makeflags.c_str())) {
+    *err = "SetEnvironmentVariable: " + GetLastErrorString();
+    return false;
+  }
+  return true;
+}
+
+bool Jobserver::Acquire() {
+  if (WaitForSingleObject(semaphore_, 0) != WAIT_OBJECT_0)
+    return false;
+  ++held_;
+  return true;
+}
+
+void Jobserver::Release() {
+  --held_;
+  ReleaseSemaphore(semaphore_, 1, NULL);
+}
@@ -0,0 +1,54 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "jobserver.h"
+
+#include <stdio.h>
+
+// static
+bool Jobserver::ParseMakeflags(const string& makeflags, Auth* auth) {
+  // make before 4.2 calls it --jobserver-fds.
+  const char* kOptions[] = { "--jobserver-auth=", "--jobserver-fds=" };
+  bool found = false;
+  size_t start = 0;
+  while (start < makeflags.size()) {
+    size_t end = makeflags.find(' ', start);
+    if (end == string::npos)
+      end = makeflags.size();
+    string word = makeflags.substr(start, end - start);
+    start = end + 1;
+    // Variables set on make's command line follow; they aren't flags.
+    if (word == "--")
+      break;
+
+    for (size_t i = 0; i < sizeof(kOptions) / sizeof(kOptions[0]); ++i) {
+      string option = kOptions[i];
+      if (word.compare(0, option.size(), option) != 0)
+        continue;
+      string value = word.substr(option.size());
+      Auth parsed;
+      char extra;
+      if (value.compare(0, 5, "fifo:") == 0) {
+        parsed.fifo = value.substr(5);
+      } else if (sscanf(value.c_str(), "%d,%d%c", &parsed.read_fd,
+                        &parsed.write_fd, &extra) != 2) {
+        parsed = Auth();
+        parsed.semaphore = value;
+      }
+      *auth = parsed;
+      found = true;
+    }
+  }
+  return found;
+}
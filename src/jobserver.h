@@ -0,0 +1,92 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef NINJA_JOBSERVER_H_
+#define NINJA_JOBSERVER_H_
+
+#include <string>
+#include <vector>
+using namespace std;
+
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+/// A GNU make jobserver: a pool of tokens, one for each job beyond the
+/// first, shared by make, Ninja and any make or Ninja their commands
+/// run, so that together they run no more jobs than the top level was
+/// told to.  Every process may run one job without a token; each further
+/// job takes one from the pool, and gives it back when done.
+///
+/// The pool is a pipe or a named FIFO holding a byte per token on POSIX,
+/// and a named semaphore on Windows.  Its name goes to child processes in
+/// MAKEFLAGS, as --jobserver-auth=R,W (the file descriptors of the pipe),
+/// --jobserver-auth=fifo:PATH, or --jobserver-auth=NAME on Windows.
+struct Jobserver {
+  Jobserver();
+  /// Give back any tokens still held, and remove a pool we made.
+  ~Jobserver();
+
+  /// Where the pool named in MAKEFLAGS is, as parsed by ParseMakeflags().
+  struct Auth {
+    Auth() : read_fd(-1), write_fd(-1) {}
+    /// The pipe, if the pool is passed as file descriptors.
+    int read_fd;
+    int write_fd;
+    /// The path of the FIFO, if it is passed that way.
+    string fifo;
+    /// The name of the semaphore, on Windows.
+    string semaphore;
+  };
+
+  /// Find the jobserver, if any, in the value of MAKEFLAGS.  Takes the
+  /// last one given, as make does.
+  static bool ParseMakeflags(const string& makeflags, Auth* auth);
+
+  /// Join the pool named in the MAKEFLAGS environment variable.  Returns
+  /// false if there is none, filling in \a err if there is one that
+  /// can't be used.
+  bool Connect(string* err);
+
+  /// Make a pool of \a jobs - 1 tokens, join it, and name it in MAKEFLAGS
+  /// for the commands run from now on.
+  bool Serve(int jobs, string* err);
+
+  /// Take a token, if one is free right away.
+  bool Acquire();
+
+  /// Give back a token taken by Acquire().
+  void Release();
+
+ private:
+#ifdef _WIN32
+  HANDLE semaphore_;
+#else
+  int read_fd_;
+  int write_fd_;
+  /// The tokens taken, to give back as they were: make may tell them
+  /// apart.
+  vector<char> tokens_;
+  /// The FIFO we made to serve from, and its directory, to remove.
+  string fifo_;
+  string fifo_dir_;
+#endif
+  /// Tokens taken and not given back, released on destruction.
+  int held_;
+
+  Jobserver(const Jobserver&);
+  void operator=(const Jobserver&);
+};
+
+#endif  // NINJA_JOBSERVER_H_
@@ -0,0 +1,96 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "jobserver.h"
+
+#include <stdlib.h>
+
+#include "test.h"
+
+TEST(JobserverTest, ParseMakeflags) {
+  Jobserver::Auth auth;
+  EXPECT_FALSE(Jobserver::ParseMakeflags("", &auth));
+  EXPECT_FALSE(Jobserver::ParseMakeflags("ki -j4", &auth));
+
+  EXPECT_TRUE(Jobserver::ParseMakeflags(" -j8 --jobserver-auth=3,4", &auth));
+  EXPECT_EQ(3, auth.read_fd);
+  EXPECT_EQ(4, auth.write_fd);
+  EXPECT_EQ("", auth.fifo);
+
+  // Older makes, and the last one given wins.
+  EXPECT_TRUE(Jobserver::ParseMakeflags(
+      "k --jobserver-fds=5,6 -j --jobserver-auth=fifo:/tmp/GMfifo12", &auth));
+  EXPECT_EQ(-1, auth.read_fd);
+  EXPECT_EQ("/tmp/GMfifo12", auth.fifo);
+
+  EXPECT_TRUE(Jobserver::ParseMakeflags("-j4 --jobserver-auth=gmake_sem_7",
+                                        &auth));
+  EXPECT_EQ("gmake_sem_7", auth.semaphore);
+
+  // What follows "--" is variables, not flags.
+  EXPECT_FALSE(Jobserver::ParseMakeflags("-- X=--jobserver-auth=3,4", &auth));
+}
+
+#ifndef _WIN32
+TEST(JobserverTest, ServeAndConnect) {
+  const char* old_makeflags = getenv("MAKEFLAGS");
+  string saved = old_makeflags ? old_makeflags : "";
+  unsetenv("MAKEFLAGS");
+
+  string err;
+  Jobserver server;
+  ASSERT_TRUE(server.Serve(3, &err));
+  EXPECT_EQ("", err);
+  Jobserver::Auth auth;
+  ASSERT_TRUE(Jobserver::ParseMakeflags(getenv("MAKEFLAGS"), &auth));
+  EXPECT_NE("", auth.fifo);
+
+  {
+    // Two tokens for three jobs, shared between the server and clients.
+    Jobserver client;
+    ASSERT_TRUE(client.Connect(&err));
+    EXPECT_TRUE(client.Acquire());
+    EXPECT_TRUE(server.Acquire());
+    EXPECT_FALSE(client.Acquire());
+    EXPECT_FALSE(server.Acquire());
+    server.Release();
+    EXPECT_TRUE(client.Acquire());
+    // The client gives back what it holds as it goes.
+  }
+  EXPECT_TRUE(server.Acquire());
+  EXPECT_TRUE(server.Acquire());
+  EXPECT_FALSE(server.Acquire());
+
+  if (old_makeflags)
+    setenv("MAKEFLAGS", saved.c_str(), 1);
+  else
+    unsetenv("MAKEFLAGS");
+}
+
+TEST(JobserverTest, ClosedPipe) {
+  const char* old_makeflags = getenv("MAKEFLAGS");
+  string saved = old_makeflags ? old_makeflags : "";
+  setenv("MAKEFLAGS", "-j4 --jobserver-auth=1000,1001", 1);
+
+  Jobserver client;
+  string err;
+  EXPECT_FALSE(client.Connect(&err));
+  EXPECT_NE("", err);
+
+  if (old_makeflags)
+    setenv("MAKEFLAGS", saved.c_str(), 1);
+  else
+    unsetenv("MAKEFLAGS");
+}
+#endif  // _WIN32
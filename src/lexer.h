@@ -41,6 +41,7 @@ struct Lexer {
     NEWLINE,
     PIPE,
     PIPE2,
+    POOL,
     RULE,
     SUBNINJA,
     TEOF,
@@ -88,6 +89,18 @@ struct Lexer {
   /// Construct an error message with context.
   bool Error(const string& message, string* err);
 
+  /// Choose whether to skip runs of plain text with SIMD instructions
+  /// where the platform has them (the default), or to lex every byte
+  /// through the state machine.  Used to compare the two in benchmarks.
+  static void SetVectorScan(bool enabled);
+
+  /// Like Error(), but pointing at a \a position previously returned by
+  /// position() instead of the last token.
+  bool ErrorAt(const char* position, const string& message, string* err);
+
+  /// The start of the last token read, for reporting errors there later.
+  const char* position() const { return last_token_; }
+
 private:
   /// Skip past whitespace (called after each read token/ident/etc.).
   void EatWhitespace();
@@ -95,6 +108,8 @@ private:
   /// Read a $-escaped string.
   bool ReadEvalString(EvalString* eval, bool path, string* err);
 
+  static bool vector_scan_;
+
   StringPiece filename_;
   StringPiece input_;
   const char* ofs_;
@@ -19,17 +19,121 @@
 #include "eval_env.h"
 #include "util.h"
 
+#if defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define NINJA_LEXER_SSE2
+#elif (defined(__ARM_NEON) || defined(__ARM_NEON__)) && defined(__GNUC__)
+#include <arm_neon.h>
+#define NINJA_LEXER_NEON
+#endif
+
+bool Lexer::vector_scan_ = true;
+
+namespace {
+
+#if defined(NINJA_LEXER_SSE2) || defined(NINJA_LEXER_NEON)
+#define NINJA_LEXER_VECTOR
+
+/// Return a mask of the bytes in the aligned 16-byte block at \a block
+/// that end a run: one of "$ :|\r\n" or NUL in an EvalString, or one of
+/// "\r\n" or NUL in a comment.  Each byte gets kMaskBitsPerByte bits.
+#ifdef NINJA_LEXER_SSE2
+const int kMaskBitsPerByte = 1;
+
+template<bool kEvalString>
+NINJA_NO_SANITIZE_ADDRESS
+inline uint64_t StopMask(const char* block) {
+  __m128i v = _mm_load_si128((const __m128i*)block);
+  __m128i m = _mm_or_si128(
+      _mm_or_si128(_mm_cmpeq_epi8(v, _mm_setzero_si128()),
+                   _mm_cmpeq_epi8(v, _mm_set1_epi8('\n'))),
+      _mm_cmpeq_epi8(v, _mm_set1_epi8('\r')));
+  if (kEvalString) {
+    m = _mm_or_si128(m, _mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('$')),
+                     _mm_cmpeq_epi8(v, _mm_set1_epi8(' '))),
+        _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(':')),
+                     _mm_cmpeq_epi8(v, _mm_set1_epi8('|')))));
+  }
+  return (unsigned)_mm_movemask_epi8(m);
+}
+#else  // NINJA_LEXER_NEON
+const int kMaskBitsPerByte = 4;
+
+template<bool kEvalString>
+NINJA_NO_SANITIZE_ADDRESS
+inline uint64_t StopMask(const char* block) {
+  uint8x16_t v = vld1q_u8((const uint8_t*)block);
+  uint8x16_t m = vorrq_u8(vorrq_u8(vceqq_u8(v, vdupq_n_u8(0)),
+                                   vceqq_u8(v, vdupq_n_u8('\n'))),
+                          vceqq_u8(v, vdupq_n_u8('\r')));
+  if (kEvalString) {
+    m = vorrq_u8(m, vorrq_u8(vorrq_u8(vceqq_u8(v, vdupq_n_u8('$')),
+                                      vceqq_u8(v, vdupq_n_u8(' '))),
+                             vorrq_u8(vceqq_u8(v, vdupq_n_u8(':')),
+                                      vceqq_u8(v, vdupq_n_u8('|')))));
+  }
+  // Narrow each byte of the comparison to a nibble.
+  uint8x8_t nibbles = vshrn_n_u16(vreinterpretq_u16_u8(m), 4);
+  return vget_lane_u64(vreinterpret_u64_u8(nibbles), 0);
+}
+#endif
+
+inline int CountTrailingZeros(uint64_t mask) {
+#ifdef _MSC_VER
+  unsigned long index;
+  if (_BitScanForward(&index, (unsigned long)mask))
+    return (int)index;
+  _BitScanForward(&index, (unsigned long)(mask >> 32));
+  return (int)index + 32;
+#else
+  return __builtin_ctzll(mask);
+#endif
+}
+
+/// Return the first stop byte (see StopMask()) at or after \a p.
+/// Only whole aligned blocks are loaded; they may extend past the NUL
+/// that terminates the input but never past the page holding it.
+template<bool kEvalString>
+NINJA_NO_SANITIZE_ADDRESS
+const char* ScanToStop(const char* p) {
+  size_t offset = (uintptr_t)p & 15;
+  const char* block = p - offset;
+  uint64_t mask = StopMask<kEvalString>(block);
+  mask &= ~(uint64_t)0 << (offset * kMaskBitsPerByte);
+  while (!mask) {
+    block += 16;
+    mask = StopMask<kEvalString>(block);
+  }
+  return block + CountTrailingZeros(mask) / kMaskBitsPerByte;
+}
+
+#endif  // NINJA_LEXER_SSE2 || NINJA_LEXER_NEON
+
+}  // anonymous namespace
+
+// static
+void Lexer::SetVectorScan(bool enabled) {
+  vector_scan_ = enabled;
+}
+
 bool Lexer::Error(const string& message, string* err) {
+  return ErrorAt(last_token_, message, err);
+}
+
+bool Lexer::ErrorAt(const char* position, const string& message,
+                    string* err) {
   // Compute line/column.
   int line = 1;
   const char* context = input_.str_;
-  for (const char* p = input_.str_; p < last_token_; ++p) {
+  for (const char* p = input_.str_; p < position; ++p) {
     if (*p == '\n') {
       ++line;
       context = p + 1;
     }
   }
-  int col = last_token_ ? (int)(last_token_ - context) : 0;
+  int col = position ? (int)(position - context) : 0;
 
   char buf[1024];
   snprintf(buf, sizeof(buf), "%s:%d: ", filename_.AsString().c_str(), line);
@@ -82,6 +186,7 @@ const char* Lexer::TokenName(Token t) {
   case NEWLINE:  return "newline";
   case PIPE2:    return "'||'";
   case PIPE:     return "'|'";
+  case POOL:     return "'pool'";
   case RULE:     return "'rule'";
   case SUBNINJA: return "'subninja'";
   case TEOF:     return "eof";
@@ -121,6 +226,21 @@ Lexer::Token Lexer::ReadToken() {
   Lexer::Token token;
   for (;;) {
     start = p;
+#ifdef NINJA_LEXER_VECTOR
+    // Skip whole comment lines without going through the state machine.
+    if (vector_scan_) {
+      const char* hash = p;
+      while (*hash == ' ')
+        ++hash;
+      if (*hash == '#') {
+        const char* end = ScanToStop<false>(hash + 1);
+        if (*end == '\n') {
+          p = end + 1;
+          continue;
+        }
+      }
+    }
+#endif
     /*!re2c
     re2c:define:YYCTYPE = "unsigned char";
     re2c:define:YYCURSOR = p;
@@ -135,6 +255,7 @@ Lexer::Token Lexer::ReadToken() {
     [ ]*[\n]   { token = NEWLINE;  break; }
     [ ]+       { token = INDENT;   break; }
     "build"    { token = BUILD;    break; }
+    "pool"     { token = POOL;     break; }
     "rule"     { token = RULE;     break; }
     "default"  { token = DEFAULT;  break; }
     "="        { token = EQUALS;   break; }
@@ -200,6 +321,16 @@ bool Lexer::ReadEvalString(EvalString* eval, bool path, string* err) {
   const char* start;
   for (;;) {
     start = p;
+#ifdef NINJA_LEXER_VECTOR
+    // Take a run of plain text in one go.
+    if (vector_scan_) {
+      p = ScanToStop<true>(p);
+      if (p != start) {
+        eval->AddText(StringPiece(start, p - start));
+        continue;
+      }
+    }
+#endif
     /*!re2c
     [^$ :\r\n|\000]+ {
       eval->AddText(StringPiece(start, p - start));
@@ -95,3 +95,38 @@ TEST(Lexer, Tabs) {
   EXPECT_EQ(Lexer::ERROR, token);
   EXPECT_EQ("tabs are not allowed, use spaces", lexer.DescribeLastError());
 }
+
+TEST(Lexer, LongRuns) {
+  // Runs of text and comments longer than a vector, split at every
+  // offset, lex the same with and without vectorized scanning.
+  string text = "a/long/path/to/some/generated/source/file.cc";
+  for (int vector = 0; vector < 2; ++vector) {
+    Lexer::SetVectorScan(vector != 0);
+    for (size_t split = 0; split <= text.size(); ++split) {
+      string comment = "  # " + text + "\r\n";
+      string input = "# " + text + "\n" + "build " +
+          text.substr(0, split) + "$$" + text.substr(split) + " " +
+          text + ":\n";
+      // A comment ending in \r\n is not allowed.
+      Lexer bad(comment.c_str());
+      EXPECT_EQ(Lexer::INDENT, bad.ReadToken());
+      EXPECT_EQ(Lexer::ERROR, bad.ReadToken());
+
+      Lexer lexer(input.c_str());
+      EXPECT_EQ(Lexer::BUILD, lexer.ReadToken());
+      EvalString eval;
+      string err;
+      EXPECT_TRUE(lexer.ReadPath(&eval, &err));
+      EXPECT_EQ("", err);
+      EXPECT_EQ("[" + text.substr(0, split) + "$" + text.substr(split) + "]",
+                eval.Serialize());
+      eval.Clear();
+      EXPECT_TRUE(lexer.ReadPath(&eval, &err));
+      EXPECT_EQ("[" + text + "]", eval.Serialize());
+      EXPECT_EQ(Lexer::COLON, lexer.ReadToken());
+      EXPECT_EQ(Lexer::NEWLINE, lexer.ReadToken());
+      EXPECT_EQ(Lexer::TEOF, lexer.ReadToken());
+    }
+  }
+  Lexer::SetVectorScan(true);
+}
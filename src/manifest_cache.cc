@@ -0,0 +1,734 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "manifest_cache.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+#include <map>
+
+#include "build_log.h"
+#include "disk_interface.h"
+#include "graph.h"
+#include "metrics.h"
+#include "state.h"
+#include "subninja_index.h"
+#include "util.h"
+
+// Implementation details:
+// The cache is a flat binary file in host byte order; it is never shared
+// between machines.  After a header identifying the format and the
+// manifest, it lists the files read while parsing with their mtimes and
+// content hashes, then the subninja index as one length-prefixed string
+// that Load() skips, followed by the graph: variable scopes (parents
+// before children), rules, pools, node paths, edges referencing those by
+// index, and default targets.
+
+namespace {
+
+const char kFileSignature[] = "ninjamc";
+const uint32_t kCurrentVersion = 9;
+
+}  // anonymous namespace
+
+struct ManifestCache::Writer {
+  void PutU32(uint32_t value) {
+    buf_.append((const char*)&value, sizeof(value));
+  }
+  void PutI64(int64_t value) {
+    buf_.append((const char*)&value, sizeof(value));
+  }
+  void PutString(const string& str) {
+    PutU32((uint32_t)str.size());
+    buf_.append(str);
+  }
+
+  string buf_;
+};
+
+struct ManifestCache::Reader {
+  Reader(const char* data, size_t size)
+      : pos_(data), end_(data + size), ok_(true) {}
+
+  uint32_t GetU32() {
+    uint32_t value = 0;
+    Get(&value, sizeof(value));
+    return value;
+  }
+  int64_t GetI64() {
+    int64_t value = 0;
+    Get(&value, sizeof(value));
+    return value;
+  }
+  StringPiece GetString() {
+    uint32_t len = GetU32();
+    if (!ok_ || (size_t)(end_ - pos_) < len) {
+      ok_ = false;
+      return StringPiece();
+    }
+    StringPiece str(pos_, len);
+    pos_ += len;
+    return str;
+  }
+  /// Read an index, checking it is below \a limit.  Only use it if ok():
+  /// on failure it is 0, which may be out of range too.
+  uint32_t GetIndex(size_t limit) {
+    uint32_t index = GetU32();
+    if (index >= limit)
+      ok_ = false;
+    return ok_ ? index : 0;
+  }
+
+  bool ok() const { return ok_; }
+  /// Note that what was read makes no sense, failing all further reads.
+  void Fail() { ok_ = false; }
+
+  /// The data not read yet.
+  StringPiece rest() const { return StringPiece(pos_, end_ - pos_); }
+
+ private:
+  void Get(void* out, size_t size) {
+    if (!ok_ || (size_t)(end_ - pos_) < size) {
+      ok_ = false;
+      return;
+    }
+    memcpy(out, pos_, size);
+    pos_ += size;
+  }
+
+  const char* pos_;
+  const char* end_;
+  bool ok_;
+};
+
+namespace {
+
+/// Replace the file at \a path with \a contents.
+bool WriteFileAtomically(const string& path, const string& contents,
+                         string* err) {
+  string temp_path = path + ".tmp";
+  FILE* f = fopen(temp_path.c_str(), "wb");
+  if (!f) {
+    *err = strerror(errno);
+    return false;
+  }
+  if (fwrite(contents.data(), 1, contents.size(), f) != contents.size()) {
+    *err = strerror(errno);
+    fclose(f);
+    unlink(temp_path.c_str());
+    return false;
+  }
+  if (fclose(f) == EOF) {
+    *err = strerror(errno);
+    unlink(temp_path.c_str());
+    return false;
+  }
+#ifdef _WIN32
+  // rename() won't replace an existing file on Windows.
+  unlink(path.c_str());
+#endif
+  if (rename(temp_path.c_str(), path.c_str()) < 0) {
+    *err = strerror(errno);
+    return false;
+  }
+  return true;
+}
+
+uint64_t HashContent(StringPiece content) {
+  return BuildLog::LogEntry::HashCommand(content);
+}
+
+}  // anonymous namespace
+
+void ManifestCache::PutEvalString(Writer* writer, const EvalString& eval) {
+  writer->PutU32((uint32_t)eval.parsed_.size());
+  for (EvalString::TokenList::const_iterator i = eval.parsed_.begin();
+       i != eval.parsed_.end(); ++i) {
+    writer->PutU32(i->type);
+    writer->PutString(i->type == EvalString::RAW ? i->text : i->symbol.name());
+  }
+}
+
+void ManifestCache::GetEvalString(Reader* reader, EvalString* eval) {
+  uint32_t count = reader->GetU32();
+  for (uint32_t i = 0; i < count && reader->ok(); ++i) {
+    uint32_t type = reader->GetU32();
+    StringPiece text = reader->GetString();
+    if (type == EvalString::RAW)
+      eval->AddText(text);
+    else
+      eval->AddSpecial(text);
+  }
+}
+
+int ManifestCache::EnvIndex(BindingEnv* env, map<BindingEnv*, int>* ids,
+                            vector<BindingEnv*>* envs) {
+  map<BindingEnv*, int>::iterator i = ids->find(env);
+  if (i != ids->end())
+    return i->second;
+  // The parser only ever creates BindingEnvs, so the parent chain is made
+  // of them too.
+  if (env->parent_)
+    EnvIndex(static_cast<BindingEnv*>(env->parent_), ids, envs);
+  int id = (int)envs->size();
+  envs->push_back(env);
+  ids->insert(make_pair(env, id));
+  return id;
+}
+
+size_t ManifestCache::RecordFile(const string& path) {
+  File file;
+  file.path = path;
+  file.mtime = disk_interface_->Stat(path);
+  file.hash = 0;
+  files_.push_back(file);
+  return files_.size() - 1;
+}
+
+void ManifestCache::RecordContent(size_t index, StringPiece content) {
+  files_[index].hash = HashContent(content);
+}
+
+void ManifestCache::RecordUnread(const string& path) {
+  map<string, File>::iterator i = unchanged_files_.find(path);
+  if (i != unchanged_files_.end())
+    files_.push_back(i->second);
+}
+
+// static
+void ManifestCache::PutFiles(Writer* writer, const vector<File>& files) {
+  writer->PutU32((uint32_t)files.size());
+  for (vector<File>::const_iterator i = files.begin(); i != files.end(); ++i) {
+    writer->PutString(i->path);
+    writer->PutI64(i->mtime);
+    writer->PutI64((int64_t)i->hash);
+  }
+}
+
+bool ManifestCache::ReadFiles(Reader* in, TimeStamp cache_mtime,
+                              vector<File>* files) {
+  uint32_t file_count = in->GetU32();
+  for (uint32_t i = 0; i < file_count && in->ok(); ++i) {
+    File file;
+    file.path = in->GetString().AsString();
+    file.mtime = (TimeStamp)in->GetI64();
+    file.hash = (uint64_t)in->GetI64();
+    if (!in->ok() || !Unchanged(&file, cache_mtime))
+      return false;
+    files->push_back(file);
+  }
+  return in->ok();
+}
+
+bool ManifestCache::Unchanged(File* file, TimeStamp cache_mtime) {
+  TimeStamp mtime = disk_interface_->Stat(file->path);
+  if (mtime <= 0)
+    return false;
+  if (mtime != file->mtime || mtime >= cache_mtime) {
+    // Rewritten, or possibly so; go by the contents.
+    string err;
+    string content = disk_interface_->ReadFile(file->path, &err);
+    if (!err.empty() || HashContent(content) != file->hash)
+      return false;
+    file->mtime = mtime;
+  }
+  return true;
+}
+
+// static
+void ManifestCache::PutIndex(Writer* writer, const SubninjaIndex& index,
+                             State* state) {
+  const vector<SubninjaIndex::Subninja>& subninjas = index.subninjas();
+  vector<vector<Node*> > outputs(subninjas.size());
+  for (vector<Edge*>::iterator e = state->edges_.begin();
+       e != state->edges_.end(); ++e) {
+    int subninja = index.EdgeSubninja(*e);
+    if (subninja >= 0) {
+      outputs[subninja].insert(outputs[subninja].end(),
+                               (*e)->outputs_.begin(), (*e)->outputs_.end());
+    }
+  }
+
+  const vector<string>& includes = index.includes();
+  writer->PutU32((uint32_t)includes.size());
+  for (vector<string>::const_iterator i = includes.begin();
+       i != includes.end(); ++i) {
+    writer->PutString(*i);
+  }
+
+  writer->PutU32((uint32_t)subninjas.size());
+  for (size_t i = 0; i < subninjas.size(); ++i) {
+    const SubninjaIndex::Subninja& subninja = subninjas[i];
+    writer->PutString(subninja.path);
+    writer->PutU32((uint32_t)subninja.parent);
+    writer->PutU32(subninja.shared);
+    writer->PutU32(subninja.rebound);
+    writer->PutU32((uint32_t)subninja.files.size());
+    for (vector<string>::const_iterator f = subninja.files.begin();
+         f != subninja.files.end(); ++f) {
+      writer->PutString(*f);
+    }
+    writer->PutU32((uint32_t)subninja.rules.size());
+    for (vector<string>::const_iterator r = subninja.rules.begin();
+         r != subninja.rules.end(); ++r) {
+      writer->PutString(*r);
+    }
+    writer->PutU32((uint32_t)subninja.pools.size());
+    for (vector<string>::const_iterator p = subninja.pools.begin();
+         p != subninja.pools.end(); ++p) {
+      writer->PutString(*p);
+    }
+    writer->PutU32((uint32_t)subninja.defaults.size());
+    for (vector<string>::const_iterator d = subninja.defaults.begin();
+         d != subninja.defaults.end(); ++d) {
+      writer->PutString(*d);
+    }
+    writer->PutU32((uint32_t)outputs[i].size());
+    for (vector<Node*>::iterator o = outputs[i].begin();
+         o != outputs[i].end(); ++o) {
+      writer->PutString((*o)->path());
+    }
+  }
+}
+
+bool ManifestCache::Save(const string& cache_path, const string& manifest,
+                         State* state, string* err,
+                         const SubninjaIndex* index) {
+  METRIC_RECORD("manifest cache save");
+  Writer writer;
+  writer.buf_.append(kFileSignature, sizeof(kFileSignature));
+  writer.PutU32(kCurrentVersion);
+  writer.PutString(manifest);
+
+  PutFiles(&writer, files_);
+
+  Writer index_writer;
+  if (index)
+    PutIndex(&index_writer, *index, state);
+  writer.PutString(index_writer.buf_);
+
+  map<BindingEnv*, int> env_ids;
+  vector<BindingEnv*> envs;
+  EnvIndex(&state->bindings_, &env_ids, &envs);
+  for (vector<Edge*>::iterator e = state->edges_.begin();
+       e != state->edges_.end(); ++e) {
+    EnvIndex(static_cast<BindingEnv*>((*e)->env_), &env_ids, &envs);
+  }
+  writer.PutU32((uint32_t)envs.size());
+  for (vector<BindingEnv*>::iterator i = envs.begin(); i != envs.end(); ++i) {
+    BindingEnv* env = *i;
+    writer.PutU32(env->parent_ ?
+        env_ids[static_cast<BindingEnv*>(env->parent_)] : (uint32_t)-1);
+    writer.PutU32((uint32_t)env->bindings_.size());
+    for (BindingEnv::Bindings::iterator b = env->bindings_.begin();
+         b != env->bindings_.end(); ++b) {
+      writer.PutString(b->first.name());
+      writer.PutString(b->second);
+    }
+  }
+
+  // Rule 0 is always the builtin phony rule.
+  map<const Rule*, int> rule_ids;
+  rule_ids[&State::kPhonyRule] = 0;
+  writer.PutU32((uint32_t)state->rules_.size() - 1);
+  for (map<string, const Rule*>::iterator i = state->rules_.begin();
+       i != state->rules_.end(); ++i) {
+    const Rule* rule = i->second;
+    if (rule == &State::kPhonyRule)
+      continue;
+    int id = (int)rule_ids.size();
+    rule_ids[rule] = id;
+    writer.PutString(rule->name_);
+    writer.PutU32(rule->generator_);
+    writer.PutU32(rule->restat_);
+    writer.PutU32(rule->remote_);
+    writer.PutU32(rule->shell_);
+    writer.PutU32(rule->batch_);
+    PutEvalString(&writer, rule->command_);
+    PutEvalString(&writer, rule->description_);
+    PutEvalString(&writer, rule->depfile_);
+    PutEvalString(&writer, rule->deps_);
+    PutEvalString(&writer, rule->rspfile_);
+    PutEvalString(&writer, rule->rspfile_content_);
+    PutEvalString(&writer, rule->pool_);
+    PutEvalString(&writer, rule->pool_weight_);
+    PutEvalString(&writer, rule->remote_inputs_);
+  }
+
+  // Pool 0 is always the default pool.
+  map<const Pool*, int> pool_ids;
+  pool_ids[&State::kDefaultPool] = 0;
+  writer.PutU32((uint32_t)state->pools_.size());
+  for (map<string, Pool*>::iterator i = state->pools_.begin();
+       i != state->pools_.end(); ++i) {
+    int id = (int)pool_ids.size();
+    pool_ids[i->second] = id;
+    writer.PutString(i->second->name());
+    writer.PutU32(i->second->depth());
+  }
+
+  // Loading the paths in order gives each node the same id again.
+  writer.PutU32((uint32_t)state->nodes_.size());
+  for (vector<Node*>::iterator i = state->nodes_.begin();
+       i != state->nodes_.end(); ++i) {
+    writer.PutString((*i)->path());
+  }
+
+  writer.PutU32((uint32_t)state->edges_.size());
+  for (vector<Edge*>::iterator e = state->edges_.begin();
+       e != state->edges_.end(); ++e) {
+    Edge* edge = *e;
+    writer.PutU32(rule_ids[edge->rule_]);
+    writer.PutU32(pool_ids[edge->pool_]);
+    writer.PutU32(edge->pool_weight_);
+    writer.PutU32(env_ids[static_cast<BindingEnv*>(edge->env_)]);
+    writer.PutU32((uint32_t)edge->inputs_.size());
+    for (EdgeInputs::iterator i = edge->inputs_.begin();
+         i != edge->inputs_.end(); ++i) {
+      writer.PutU32((*i)->id());
+    }
+    writer.PutU32(edge->implicit_deps_);
+    writer.PutU32(edge->order_only_deps_);
+    writer.PutU32((uint32_t)edge->outputs_.size());
+    for (vector<Node*>::iterator o = edge->outputs_.begin();
+         o != edge->outputs_.end(); ++o) {
+      writer.PutU32((*o)->id());
+    }
+  }
+
+  writer.PutU32((uint32_t)state->defaults_.size());
+  for (vector<Node*>::iterator i = state->defaults_.begin();
+       i != state->defaults_.end(); ++i) {
+    writer.PutU32((*i)->id());
+  }
+
+  return WriteFileAtomically(cache_path, writer.buf_, err);
+}
+
+bool ManifestCache::Load(const string& cache_path, const string& manifest,
+                         State* state, string* err) {
+  METRIC_RECORD("manifest cache load");
+  TimeStamp cache_mtime = disk_interface_->Stat(cache_path);
+  if (cache_mtime <= 0)
+    return false;
+
+  MappedFile file;
+  string read_err;
+  if (file.Open(cache_path, &read_err) < 0)
+    return false;
+
+  if (file.size_ < sizeof(kFileSignature) ||
+      memcmp(file.data_, kFileSignature, sizeof(kFileSignature)) != 0)
+    return false;
+  Reader in(file.data_ + sizeof(kFileSignature),
+            file.size_ - sizeof(kFileSignature));
+  if (in.GetU32() != kCurrentVersion)
+    return false;
+  if (in.GetString() != manifest)
+    return false;
+
+  // Validate every input file before touching |state|.
+  vector<File> files;
+  if (!ReadFiles(&in, cache_mtime, &files))
+    return false;
+  in.GetString();  // The subninja index.
+
+  // From here on a failure leaves |state| partially filled in.
+  uint32_t env_count = in.GetU32();
+  vector<BindingEnv*> envs;
+  for (uint32_t i = 0; i < env_count && in.ok(); ++i) {
+    uint32_t parent = in.GetU32();
+    BindingEnv* env;
+    if (i == 0) {
+      env = &state->bindings_;
+    } else {
+      if (parent >= envs.size()) {
+        in.Fail();
+        break;
+      }
+      env = new BindingEnv(envs[parent]);
+    }
+    envs.push_back(env);
+    uint32_t binding_count = in.GetU32();
+    for (uint32_t b = 0; b < binding_count && in.ok(); ++b) {
+      string key = in.GetString().AsString();
+      env->AddBinding(key, in.GetString().AsString());
+    }
+  }
+
+  uint32_t rule_count = in.GetU32();
+  vector<const Rule*> rules;
+  rules.push_back(&State::kPhonyRule);
+  for (uint32_t i = 0; i < rule_count && in.ok(); ++i) {
+    Rule* rule = new Rule(in.GetString().AsString());
+    rule->generator_ = in.GetU32() != 0;
+    rule->restat_ = in.GetU32() != 0;
+    rule->remote_ = in.GetU32() != 0;
+    rule->shell_ = in.GetU32() != 0;
+    rule->batch_ = (int)in.GetU32();
+    GetEvalString(&in, &rule->command_);
+    GetEvalString(&in, &rule->description_);
+    GetEvalString(&in, &rule->depfile_);
+    GetEvalString(&in, &rule->deps_);
+    GetEvalString(&in, &rule->rspfile_);
+    GetEvalString(&in, &rule->rspfile_content_);
+    GetEvalString(&in, &rule->pool_);
+    GetEvalString(&in, &rule->pool_weight_);
+    GetEvalString(&in, &rule->remote_inputs_);
+    if (!in.ok() || state->LookupRule(rule->name())) {
+      delete rule;
+      in.Fail();
+      break;
+    }
+    state->AddRule(rule);
+    rules.push_back(rule);
+  }
+
+  uint32_t pool_count = in.GetU32();
+  vector<Pool*> pools;
+  pools.push_back(&State::kDefaultPool);
+  for (uint32_t i = 0; i < pool_count && in.ok(); ++i) {
+    string name = in.GetString().AsString();
+    int depth = (int)in.GetU32();
+    if (!in.ok() || depth < 0 || state->LookupPool(name)) {
+      in.Fail();
+      break;
+    }
+    Pool* pool = new Pool(name, depth);
+    state->AddPool(pool);
+    pools.push_back(pool);
+  }
+
+  uint32_t node_count = in.GetU32();
+  vector<Node*> nodes;
+  // Each node takes at least 4 bytes, as for the inputs below.
+  if (in.ok() && node_count <= in.rest().len_ / 4)
+    nodes.reserve(node_count);
+  for (uint32_t i = 0; i < node_count && in.ok(); ++i)
+    nodes.push_back(state->GetNode(in.GetString()));
+
+  uint32_t edge_count = in.GetU32();
+  for (uint32_t i = 0; i < edge_count && in.ok(); ++i) {
+    uint32_t rule = in.GetIndex(rules.size());
+    uint32_t pool = in.GetIndex(pools.size());
+    int pool_weight = (int)in.GetU32();
+    uint32_t env = in.GetIndex(envs.size());
+    if (!in.ok() || pool_weight < 0) {
+      in.Fail();
+      break;
+    }
+    Edge* edge = state->AddEdge(rules[rule]);
+    edge->pool_ = pools[pool];
+    edge->pool_weight_ = pool_weight;
+    edge->env_ = envs[env];
+    uint32_t input_count = in.GetU32();
+    // Each input takes 4 bytes, which bounds what a corrupt count asks for.
+    if (input_count <= in.rest().len_ / 4)
+      edge->inputs_.reserve(input_count);
+    for (uint32_t n = 0; n < input_count && in.ok(); ++n) {
+      uint32_t index = in.GetIndex(nodes.size());
+      if (!in.ok())
+        break;
+      Node* node = nodes[index];
+      edge->inputs_.push_back(node);
+      node->AddOutEdge(edge);
+    }
+    uint32_t implicit_deps = in.GetU32();
+    uint32_t order_only_deps = in.GetU32();
+    // Both count back from the end of the inputs.
+    if (implicit_deps > input_count ||
+        order_only_deps > input_count - implicit_deps) {
+      in.Fail();
+      break;
+    }
+    edge->implicit_deps_ = implicit_deps;
+    edge->order_only_deps_ = order_only_deps;
+    uint32_t output_count = in.GetU32();
+    if (output_count == 0)
+      in.Fail();
+    for (uint32_t n = 0; n < output_count && in.ok(); ++n) {
+      uint32_t index = in.GetIndex(nodes.size());
+      if (!in.ok())
+        break;
+      Node* node = nodes[index];
+      edge->outputs_.push_back(node);
+      if (node->in_edge()) {
+        Warning("multiple rules generate %s. "
+                "build will not be correct; continuing anyway",
+                node->path().c_str());
+      }
+      node->set_in_edge(edge);
+    }
+  }
+
+  uint32_t default_count = in.GetU32();
+  for (uint32_t i = 0; i < default_count && in.ok(); ++i) {
+    uint32_t index = in.GetIndex(nodes.size());
+    if (in.ok())
+      state->defaults_.push_back(nodes[index]);
+  }
+
+  if (!in.ok() || envs.size() != env_count ||
+      rules.size() != rule_count + 1 || pools.size() != pool_count + 1 ||
+      nodes.size() != node_count || state->edges_.size() != edge_count) {
+    *err = "manifest cache '" + cache_path + "' is corrupt";
+    return false;
+  }
+  files_.swap(files);
+  return true;
+}
+
+bool ManifestCache::Refresh(const string& cache_path, const string& manifest,
+                            string* err) {
+  METRIC_RECORD("manifest cache refresh");
+  MappedFile file;
+  string read_err;
+  if (file.Open(cache_path, &read_err) < 0)
+    return false;
+
+  if (file.size_ < sizeof(kFileSignature) ||
+      memcmp(file.data_, kFileSignature, sizeof(kFileSignature)) != 0)
+    return false;
+  Reader in(file.data_ + sizeof(kFileSignature),
+            file.size_ - sizeof(kFileSignature));
+  if (in.GetU32() != kCurrentVersion)
+    return false;
+  if (in.GetString() != manifest)
+    return false;
+
+  // Every file is compared by content, including those written after the
+  // cache in the same second.
+  vector<File> files;
+  if (!ReadFiles(&in, 0, &files))
+    return false;
+
+  Writer writer;
+  writer.buf_.append(kFileSignature, sizeof(kFileSignature));
+  writer.PutU32(kCurrentVersion);
+  writer.PutString(manifest);
+  PutFiles(&writer, files);
+  StringPiece graph = in.rest();
+  writer.buf_.append(graph.str_, graph.len_);
+  if (!WriteFileAtomically(cache_path, writer.buf_, err))
+    return false;
+  files_.swap(files);
+  return true;
+}
+
+bool ManifestCache::LoadIndex(const string& cache_path, const string& manifest,
+                              SubninjaIndex* index) {
+  METRIC_RECORD("manifest cache index load");
+  TimeStamp cache_mtime = disk_interface_->Stat(cache_path);
+  if (cache_mtime <= 0)
+    return false;
+
+  MappedFile file;
+  string read_err;
+  if (file.Open(cache_path, &read_err) < 0)
+    return false;
+
+  if (file.size_ < sizeof(kFileSignature) ||
+      memcmp(file.data_, kFileSignature, sizeof(kFileSignature)) != 0)
+    return false;
+  Reader in(file.data_ + sizeof(kFileSignature),
+            file.size_ - sizeof(kFileSignature));
+  if (in.GetU32() != kCurrentVersion)
+    return false;
+  if (in.GetString() != manifest)
+    return false;
+
+  // Which files changed, unlike ReadFiles() checking them all.
+  map<string, bool> unchanged;
+  unchanged_files_.clear();
+  uint32_t file_count = in.GetU32();
+  for (uint32_t i = 0; i < file_count && in.ok(); ++i) {
+    File f;
+    f.path = in.GetString().AsString();
+    f.mtime = (TimeStamp)in.GetI64();
+    f.hash = (uint64_t)in.GetI64();
+    if (!in.ok())
+      break;
+    bool same = Unchanged(&f, cache_mtime);
+    unchanged[f.path] = same;
+    if (same)
+      unchanged_files_[f.path] = f;
+  }
+
+  StringPiece index_data = in.GetString();
+  if (!in.ok())
+    return false;
+  Reader index_in(index_data.str_, index_data.len_);
+  // The top-level manifest's files have to be as they were, as every
+  // subninja sees its variables.
+  vector<string> top_files(1, manifest);
+  uint32_t include_count = index_in.GetU32();
+  for (uint32_t i = 0; i < include_count && index_in.ok(); ++i)
+    top_files.push_back(index_in.GetString().AsString());
+  for (vector<string>::iterator i = top_files.begin(); i != top_files.end();
+       ++i) {
+    map<string, bool>::iterator u = unchanged.find(*i);
+    if (u == unchanged.end() || !u->second)
+      return false;
+  }
+
+  uint32_t count = index_in.GetU32();
+  vector<SubninjaIndex::Known> known;
+  // Whether each, and the subninjas it is loaded from, are as they were.
+  vector<bool> intact;
+  for (uint32_t i = 0; i < count && index_in.ok(); ++i) {
+    known.push_back(SubninjaIndex::Known());
+    SubninjaIndex::Known* subninja = &known.back();
+    subninja->path = index_in.GetString().AsString();
+    subninja->parent = (int)index_in.GetU32();
+    bool shared = index_in.GetU32() != 0;
+    bool rebound = index_in.GetU32() != 0;
+    if (subninja->parent < -1 || subninja->parent >= (int)i)
+      return false;
+    bool ok = !rebound &&
+        (subninja->parent < 0 || intact[subninja->parent]);
+    uint32_t files = index_in.GetU32();
+    for (uint32_t f = 0; f < files && index_in.ok(); ++f) {
+      subninja->files.push_back(index_in.GetString().AsString());
+      map<string, bool>::iterator u = unchanged.find(subninja->files.back());
+      if (u == unchanged.end() || !u->second)
+        ok = false;
+    }
+    uint32_t rules = index_in.GetU32();
+    for (uint32_t r = 0; r < rules && index_in.ok(); ++r)
+      subninja->rules.push_back(index_in.GetString().AsString());
+    uint32_t pools = index_in.GetU32();
+    for (uint32_t p = 0; p < pools && index_in.ok(); ++p)
+      subninja->pools.push_back(index_in.GetString().AsString());
+    uint32_t defaults = index_in.GetU32();
+    for (uint32_t d = 0; d < defaults && index_in.ok(); ++d)
+      subninja->defaults.push_back(index_in.GetString().AsString());
+    intact.push_back(ok);
+    subninja->deferrable = ok && !shared;
+    uint32_t outputs = index_in.GetU32();
+    for (uint32_t o = 0; o < outputs && index_in.ok(); ++o)
+      subninja->outputs.push_back(index_in.GetString().AsString());
+  }
+  if (!index_in.ok())
+    return false;
+  index->SetKnown(&known);
+  return true;
+}
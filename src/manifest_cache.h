@@ -0,0 +1,158 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef NINJA_MANIFEST_CACHE_H_
+#define NINJA_MANIFEST_CACHE_H_
+
+#include <map>
+#include <string>
+#include <vector>
+using namespace std;
+
+#include "manifest_parser.h"
+#include "thread_pool.h"
+#include "timestamp.h"
+#include "util.h"
+
+struct BindingEnv;
+struct DiskInterface;
+struct EvalString;
+struct State;
+struct SubninjaIndex;
+
+/// A compiled form of a fully-loaded State (rules, edges, node paths,
+/// variable scopes and defaults), written after a successful parse so that
+/// later runs can skip lexing and evaluating the manifest entirely.
+///
+/// The cache records the mtime and a hash of the contents of every file
+/// read while parsing, and is only used while all of those are unchanged.
+/// Files modified in the same second the cache was written, or rewritten
+/// since, are compared by content, as the mtime alone can't tell whether
+/// the cache saw the final contents.
+struct ManifestCache {
+  explicit ManifestCache(DiskInterface* disk_interface)
+      : disk_interface_(disk_interface) {}
+
+  /// Note that \a path is about to be read by the parser.  Must be called
+  /// before the read so a concurrent modification invalidates the cache.
+  /// Returns the index to pass to RecordContent() after the read.
+  size_t RecordFile(const string& path);
+
+  /// Note the \a content read for the file at \a index.
+  void RecordContent(size_t index, StringPiece content);
+
+  /// Note that \a path, which LoadIndex() found unchanged, went into the
+  /// State without being read, as by SubninjaIndex::CopyAll().
+  void RecordUnread(const string& path);
+
+  /// Write \a state, loaded from \a manifest, to \a cache_path, with
+  /// the subninjas recorded in \a index if given.
+  bool Save(const string& cache_path, const string& manifest, State* state,
+            string* err, const SubninjaIndex* index = NULL);
+
+  /// Populate the (empty) \a state from \a cache_path.  Returns false and
+  /// leaves \a state untouched if the cache is missing, stale, or was built
+  /// for a different manifest.  If the cache is corrupt, returns false with
+  /// \a err set and \a state partially filled in; callers should discard it.
+  bool Load(const string& cache_path, const string& manifest, State* state,
+            string* err);
+
+  /// Bring the cache at \a cache_path up to date if every file it was
+  /// built from still has the contents it had then, as when a generator
+  /// rewrites the manifest without changing it.  Returns false, leaving
+  /// the cache alone, if any file differs.
+  bool Refresh(const string& cache_path, const string& manifest, string* err);
+
+  /// Give \a index the subninjas of the cache at \a cache_path, noting
+  /// which can be put off: those that, like the subninjas they are loaded
+  /// from, are unchanged.  Returns false if there is no such cache for
+  /// \a manifest, or if the files outside its subninjas have changed.
+  bool LoadIndex(const string& cache_path, const string& manifest,
+                 SubninjaIndex* index);
+
+  struct File {
+    string path;
+    TimeStamp mtime;
+    uint64_t hash;
+  };
+  const vector<File>& files() const { return files_; }
+
+ private:
+  struct Reader;
+  struct Writer;
+
+  static void PutEvalString(Writer* writer, const EvalString& eval);
+  static void GetEvalString(Reader* reader, EvalString* eval);
+  /// Assign \a env an index in \a envs, after its parents.
+  static int EnvIndex(BindingEnv* env, map<BindingEnv*, int>* ids,
+                      vector<BindingEnv*>* envs);
+
+  /// Read the file list of the cache in \a reader into \a files, checking
+  /// each against the disk.  Returns false if any file has changed.
+  bool ReadFiles(Reader* reader, TimeStamp cache_mtime, vector<File>* files);
+  static void PutFiles(Writer* writer, const vector<File>& files);
+  /// Whether \a file still has the contents it had when the cache was
+  /// written at \a cache_mtime.  Updates its mtime if rewritten.
+  bool Unchanged(File* file, TimeStamp cache_mtime);
+
+  static void PutIndex(Writer* writer, const SubninjaIndex& index,
+                       State* state);
+
+  DiskInterface* disk_interface_;
+  vector<File> files_;
+  /// The files LoadIndex() found unchanged, by path.
+  map<string, File> unchanged_files_;
+};
+
+/// A FileReader that records every file it reads into a ManifestCache
+/// before forwarding to another reader.  Safe to use from several threads
+/// if the wrapped reader is.
+struct ManifestCacheFileReader : public ManifestParser::FileReader {
+  ManifestCacheFileReader(ManifestParser::FileReader* reader,
+                          ManifestCache* cache)
+      : reader_(reader), cache_(cache) {}
+
+  virtual bool ReadFile(const string& path, string* content, string* err) {
+    size_t index;
+    {
+      ScopedLock lock(&mutex_);
+      index = cache_->RecordFile(path);
+    }
+    if (!reader_->ReadFile(path, content, err))
+      return false;
+    ScopedLock lock(&mutex_);
+    cache_->RecordContent(index, *content);
+    return true;
+  }
+
+  virtual bool MapFile(const string& path, MappedFile* file, string* err) {
+    size_t index;
+    {
+      ScopedLock lock(&mutex_);
+      index = cache_->RecordFile(path);
+    }
+    if (!reader_->MapFile(path, file, err))
+      return false;
+    ScopedLock lock(&mutex_);
+    cache_->RecordContent(index, StringPiece(file->data_, file->size_));
+    return true;
+  }
+
+ private:
+  Mutex mutex_;
+  ManifestParser::FileReader* reader_;
+  ManifestCache* cache_;
+};
+
+#endif  // NINJA_MANIFEST_CACHE_H_
@@ -0,0 +1,506 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "manifest_cache.h"
+
+#include <stdio.h>
+
+#include "graph.h"
+#include "state.h"
+#include "subninja_index.h"
+#include "test.h"
+
+namespace {
+
+const char kCachePath[] = "ManifestCacheTest-tempfile";
+
+/// Reads manifests from the VirtualFileSystem; the cache itself lives on
+/// the real disk, but its mtime is looked up in the VirtualFileSystem too.
+struct ManifestCacheTest : public testing::Test,
+                           public ManifestParser::FileReader {
+  virtual void SetUp() {
+    temp_dir_.CreateAndEnter("ninja_manifest_cache_test");
+  }
+  virtual void TearDown() {
+    temp_dir_.Cleanup();
+  }
+
+  virtual bool ReadFile(const string& path, string* content, string* err) {
+    *content = fs_.ReadFile(path, err);
+    return err->empty();
+  }
+
+  /// Parse build.ninja into \a state and write the cache, marking it as
+  /// written at time \a cache_time.
+  void ParseAndSave(State* state, int cache_time) {
+    ManifestCache cache(&fs_);
+    ManifestCacheFileReader reader(this, &cache);
+    ManifestParser parser(state, &reader);
+    SubninjaIndex index;
+    parser.set_subninja_index(&index);
+    string err;
+    ASSERT_TRUE(parser.Load("build.ninja", &err)) << err;
+    ASSERT_TRUE(cache.Save(kCachePath, "build.ninja", state, &err, &index))
+        << err;
+    fs_.Create(kCachePath, cache_time, "");
+  }
+
+  /// Parse build.ninja into \a state, putting off the subninjas \a index
+  /// says can be.
+  void ParseLazily(State* state, SubninjaIndex* index) {
+    ManifestParser parser(state, this);
+    parser.set_subninja_index(index);
+    string err;
+    ASSERT_TRUE(parser.Load("build.ninja", &err)) << err;
+  }
+
+  ScopedTempDir temp_dir_;
+  VirtualFileSystem fs_;
+};
+
+TEST_F(ManifestCacheTest, RoundTrip) {
+  fs_.Create("build.ninja", 1,
+"cflags = -O2\n"
+"pool heavy\n"
+"  depth = 3\n"
+"rule cc\n"
+"  command = cc $cflags -c $in -o $out\n"
+"  description = CC $out\n"
+"  depfile = $out.d\n"
+"  remote = 1\n"
+"  remote_inputs = include\n"
+"rule gen\n"
+"  command = regen\n"
+"  generator = 1\n"
+"  restat = 1\n"
+"  shell = 1\n"
+"build build.ninja: gen gen.py\n"
+"subninja sub.ninja\n"
+"build b.o: cc b.c | b.h || order\n"
+"  cflags = -O0\n"
+"  pool = heavy\n"
+"  pool_weight = 2\n"
+"build all: phony a.o b.o\n"
+"default all\n");
+  fs_.Create("sub.ninja", 1,
+"cflags = -g\n"
+"build a.o: cc a.c\n");
+
+  State parsed;
+  ParseAndSave(&parsed, 2);
+
+  State loaded;
+  ManifestCache cache(&fs_);
+  string err;
+  ASSERT_TRUE(cache.Load(kCachePath, "build.ninja", &loaded, &err)) << err;
+  ASSERT_EQ("", err);
+
+  EXPECT_EQ("-O2", loaded.bindings_.LookupVariable("cflags"));
+  const Rule* gen = loaded.LookupRule("gen");
+  ASSERT_TRUE(gen);
+  EXPECT_TRUE(gen->generator());
+  EXPECT_TRUE(gen->restat());
+  const Rule* cc = loaded.LookupRule("cc");
+  ASSERT_TRUE(cc);
+  EXPECT_EQ(parsed.LookupRule("cc")->description().Serialize(),
+            cc->description().Serialize());
+  EXPECT_EQ(parsed.LookupRule("cc")->depfile().Serialize(),
+            cc->depfile().Serialize());
+  EXPECT_TRUE(cc->remote());
+  EXPECT_FALSE(gen->remote());
+  EXPECT_TRUE(gen->shell());
+  EXPECT_FALSE(cc->shell());
+  EXPECT_EQ("[include]", cc->remote_inputs().Serialize());
+
+  ASSERT_EQ(parsed.edges_.size(), loaded.edges_.size());
+  ASSERT_EQ(parsed.paths_.size(), loaded.paths_.size());
+  for (size_t i = 0; i < parsed.edges_.size(); ++i) {
+    Edge* expected = parsed.edges_[i];
+    Edge* edge = loaded.edges_[i];
+    EXPECT_EQ(expected->rule().name(), edge->rule().name());
+    EXPECT_EQ(expected->EvaluateCommand(), edge->EvaluateCommand());
+    EXPECT_EQ(expected->inputs_.size(), edge->inputs_.size());
+    EXPECT_EQ(expected->implicit_deps_, edge->implicit_deps_);
+    EXPECT_EQ(expected->order_only_deps_, edge->order_only_deps_);
+    EXPECT_EQ(expected->pool_->name(), edge->pool_->name());
+    EXPECT_EQ(expected->pool_weight_, edge->pool_weight_);
+    ASSERT_EQ(expected->outputs_.size(), edge->outputs_.size());
+    EXPECT_EQ(expected->outputs_[0]->path(), edge->outputs_[0]->path());
+    EXPECT_EQ(edge, edge->outputs_[0]->in_edge());
+  }
+  EXPECT_EQ("cc -g -c a.c -o a.o",
+            loaded.LookupNode("a.o")->in_edge()->EvaluateCommand());
+  EXPECT_EQ("cc -O0 -c b.c -o b.o",
+            loaded.LookupNode("b.o")->in_edge()->EvaluateCommand());
+  EXPECT_EQ(1u, loaded.LookupNode("a.c")->out_edges().size());
+  Pool* heavy = loaded.LookupPool("heavy");
+  ASSERT_TRUE(heavy);
+  EXPECT_EQ(3, heavy->depth());
+  EXPECT_EQ(heavy, loaded.LookupNode("b.o")->in_edge()->pool_);
+
+  ASSERT_EQ(1u, loaded.defaults_.size());
+  EXPECT_EQ("all", loaded.defaults_[0]->path());
+}
+
+TEST_F(ManifestCacheTest, StaleInput) {
+  fs_.Create("build.ninja", 1, "subninja sub.ninja\n");
+  fs_.Create("sub.ninja", 1, "build out: phony in\n");
+  State parsed;
+  ParseAndSave(&parsed, 2);
+
+  fs_.Create("sub.ninja", 3, "build out: phony in2\n");
+  State loaded;
+  ManifestCache cache(&fs_);
+  string err;
+  EXPECT_FALSE(cache.Load(kCachePath, "build.ninja", &loaded, &err));
+  EXPECT_EQ("", err);
+  EXPECT_TRUE(loaded.edges_.empty());
+}
+
+TEST_F(ManifestCacheTest, RacyInput) {
+  // An input modified in the same second the cache was written may have
+  // changed after it was read, so its contents are checked.
+  fs_.Create("build.ninja", 2, "build out: phony in\n");
+  State parsed;
+  ParseAndSave(&parsed, 2);
+
+  State loaded;
+  ManifestCache cache(&fs_);
+  string err;
+  EXPECT_TRUE(cache.Load(kCachePath, "build.ninja", &loaded, &err));
+  EXPECT_EQ("", err);
+  EXPECT_EQ(1u, loaded.edges_.size());
+
+  fs_.Create("build.ninja", 2, "build out: phony in2\n");
+  State reloaded;
+  EXPECT_FALSE(cache.Load(kCachePath, "build.ninja", &reloaded, &err));
+  EXPECT_EQ("", err);
+}
+
+TEST_F(ManifestCacheTest, Refresh) {
+  fs_.Create("build.ninja", 1, "subninja sub.ninja\n");
+  fs_.Create("sub.ninja", 1, "build out: phony in\n");
+  State parsed;
+  ParseAndSave(&parsed, 2);
+
+  // A generator rewriting the same contents makes the cache usable again.
+  fs_.Create("build.ninja", 3, "subninja sub.ninja\n");
+  ManifestCache cache(&fs_);
+  string err;
+  EXPECT_TRUE(cache.Refresh(kCachePath, "build.ninja", &err));
+  EXPECT_EQ("", err);
+  ASSERT_EQ(2u, cache.files().size());
+  EXPECT_EQ(3, cache.files()[0].mtime);
+  fs_.Create(kCachePath, 4, "");
+
+  State loaded;
+  EXPECT_TRUE(cache.Load(kCachePath, "build.ninja", &loaded, &err));
+  EXPECT_EQ("", err);
+  EXPECT_EQ(1u, loaded.edges_.size());
+
+  // But not if anything changed.
+  fs_.Create("sub.ninja", 5, "build out: phony in2\n");
+  EXPECT_FALSE(cache.Refresh(kCachePath, "build.ninja", &err));
+  EXPECT_EQ("", err);
+  State stale;
+  EXPECT_FALSE(cache.Load(kCachePath, "build.ninja", &stale, &err));
+}
+
+TEST_F(ManifestCacheTest, OtherManifest) {
+  fs_.Create("build.ninja", 1, "build out: phony in\n");
+  State parsed;
+  ParseAndSave(&parsed, 2);
+
+  State loaded;
+  ManifestCache cache(&fs_);
+  string err;
+  EXPECT_FALSE(cache.Load(kCachePath, "other.ninja", &loaded, &err));
+  EXPECT_EQ("", err);
+}
+
+TEST_F(ManifestCacheTest, Truncated) {
+  fs_.Create("build.ninja", 1,
+"rule cat\n"
+"  command = cat $in > $out\n"
+"build out: cat in1 in2\n");
+  State parsed;
+  ParseAndSave(&parsed, 2);
+
+  string contents, err;
+  ASSERT_EQ(0, ::ReadFile(kCachePath, &contents, &err));
+  FILE* f = fopen(kCachePath, "wb");
+  ASSERT_TRUE(f);
+  fwrite(contents.data(), 1, contents.size() - 3, f);
+  fclose(f);
+
+  State loaded;
+  ManifestCache cache(&fs_);
+  EXPECT_FALSE(cache.Load(kCachePath, "build.ninja", &loaded, &err));
+  EXPECT_NE("", err);
+}
+
+TEST_F(ManifestCacheTest, Corrupt) {
+  fs_.Create("build.ninja", 1,
+"x = 1\n"
+"pool p\n"
+"  depth = 2\n"
+"rule cat\n"
+"  command = cat $in > $out\n"
+"build out: cat in1 in2 | dep || order\n"
+"  x = 2\n"
+"  pool = p\n"
+"default out\n");
+  State parsed;
+  ParseAndSave(&parsed, 2);
+  string contents, err;
+  ASSERT_EQ(0, ::ReadFile(kCachePath, &contents, &err));
+
+  // Whatever is cut off or changed, Load() fails rather than crashing,
+  // unless it only changed a name or a count it can't tell from another.
+  for (size_t size = 0; size < contents.size(); ++size) {
+    FILE* f = fopen(kCachePath, "wb");
+    ASSERT_TRUE(f);
+    fwrite(contents.data(), 1, size, f);
+    fclose(f);
+    State loaded;
+    ManifestCache cache(&fs_);
+    EXPECT_FALSE(cache.Load(kCachePath, "build.ninja", &loaded, &err));
+  }
+  for (size_t i = 0; i < contents.size(); ++i) {
+    for (int flip = 1; flip < 256; flip += 254) {
+      string damaged = contents;
+      damaged[i] ^= flip;
+      FILE* f = fopen(kCachePath, "wb");
+      ASSERT_TRUE(f);
+      fwrite(damaged.data(), 1, damaged.size(), f);
+      fclose(f);
+      State loaded;
+      ManifestCache cache(&fs_);
+      cache.Load(kCachePath, "build.ninja", &loaded, &err);
+    }
+  }
+}
+
+TEST_F(ManifestCacheTest, LazySubninjas) {
+  fs_.Create("build.ninja", 1,
+"rule cc\n"
+"  command = cc $in -o $out\n"
+"subninja a.ninja\n"
+"subninja b.ninja\n"
+"build all: phony a.o b.o\n");
+  fs_.Create("a.ninja", 1, "build a.o: cc a.c\n");
+  fs_.Create("b.ninja", 1,
+"build b.o: cc b.c | gen.h\n"
+"subninja c.ninja\n");
+  fs_.Create("c.ninja", 1, "build gen.h: cc gen.in\n");
+  State parsed;
+  ParseAndSave(&parsed, 2);
+
+  // a.ninja is loaded as it changed; the others can wait.
+  fs_.Create("a.ninja", 3, "build a.o: cc a2.c\n");
+  ManifestCache cache(&fs_);
+  SubninjaIndex index;
+  ASSERT_TRUE(cache.LoadIndex(kCachePath, "build.ninja", &index));
+  ASSERT_EQ(3u, index.known().size());
+  EXPECT_FALSE(index.known()[0].deferrable);
+  EXPECT_TRUE(index.known()[1].deferrable);
+  EXPECT_TRUE(index.known()[2].deferrable);
+  EXPECT_EQ("gen.h", index.known()[2].outputs[0]);
+
+  State state;
+  ParseLazily(&state, &index);
+  EXPECT_TRUE(index.deferred());
+  EXPECT_EQ(2u, state.edges_.size());
+  EXPECT_TRUE(state.LookupNode("a2.c"));
+  EXPECT_FALSE(state.LookupNode("b.o")->in_edge());
+  EXPECT_TRUE(index.Builds("b.o"));
+  EXPECT_TRUE(index.Builds("gen.h"));
+  EXPECT_FALSE(index.Builds("a.o"));
+
+  // Building b.o needs c.ninja too, for gen.h.
+  string err;
+  EXPECT_TRUE(index.LoadFor(&state, this, NULL,
+                            vector<string>(1, "b.o"), &err)) << err;
+  EXPECT_FALSE(index.deferred());
+  EXPECT_EQ(4u, state.edges_.size());
+  EXPECT_TRUE(state.LookupNode("gen.h")->in_edge());
+  EXPECT_EQ("cc gen.in -o gen.h",
+            state.LookupNode("gen.h")->in_edge()->EvaluateCommand());
+}
+
+TEST_F(ManifestCacheTest, LazySubninjasKeptLoaded) {
+  fs_.Create("build.ninja", 1,
+"rule link\n"
+"  command = link\n"
+"  pool = heavy\n"
+"subninja pools.ninja\n"
+"build out: link in\n"
+"subninja early.ninja\n"
+"x = 1\n"
+"subninja late.ninja\n");
+  fs_.Create("pools.ninja", 1,
+"pool heavy\n"
+"  depth = 1\n");
+  fs_.Create("early.ninja", 1, "build early$x: phony\n");
+  fs_.Create("late.ninja", 1, "build late$x: phony\n");
+  State parsed;
+  ParseAndSave(&parsed, 2);
+
+  // Not pools.ninja, whose pool is used elsewhere, nor early.ninja,
+  // which saw x before it was set.
+  ManifestCache cache(&fs_);
+  SubninjaIndex index;
+  ASSERT_TRUE(cache.LoadIndex(kCachePath, "build.ninja", &index));
+  ASSERT_EQ(3u, index.known().size());
+  EXPECT_FALSE(index.known()[0].deferrable);
+  EXPECT_FALSE(index.known()[1].deferrable);
+  EXPECT_TRUE(index.known()[2].deferrable);
+
+  // Nor anything once the top-level manifest changes.
+  fs_.Create("build.ninja", 3,
+"rule link\n"
+"  command = link\n"
+"subninja pools.ninja\n"
+"build out: link in2\n");
+  SubninjaIndex stale;
+  EXPECT_FALSE(cache.LoadIndex(kCachePath, "build.ninja", &stale));
+}
+
+TEST_F(ManifestCacheTest, CopySubninjas) {
+  fs_.Create("build.ninja", 1,
+"cflags = -O2\n"
+"pool link\n"
+"  depth = 1\n"
+"rule cc\n"
+"  command = cc $cflags $in -o $out\n"
+"rule ld\n"
+"  command = ld $in -o $out\n"
+"subninja a.ninja\n"
+"subninja b.ninja\n"
+"subninja c.ninja\n");
+  fs_.Create("a.ninja", 1, "build a.o: cc a.c\n");
+  fs_.Create("b.ninja", 1,
+"bflags = -g\n"
+"pool heavy\n"
+"  depth = 2\n"
+"rule bcc\n"
+"  command = bcc $bflags $cflags $in -o $out\n"
+"  pool = heavy\n"
+"build b.o: bcc b.c || order\n"
+"  cflags = -O0\n"
+"build b: ld b.o\n"
+"  pool = link\n"
+"default b\n"
+"subninja d.ninja\n");
+  fs_.Create("c.ninja", 1, "build c.o: cc c.c\n");
+  fs_.Create("d.ninja", 1,
+"rule link\n"
+"  command = link $bflags $in -o $out\n"
+"build d: link d.c\n");
+  State* parsed = new State;
+  ParseAndSave(parsed, 2);
+
+  // As if a build had loaded a depfile for b.o.
+  Edge* b_o = parsed->LookupNode("b.o")->in_edge();
+  *b_o->inputs_.insert_gap(b_o->inputs_.end() - b_o->order_only_deps_, 1) =
+      parsed->GetNode("b.h");
+  ++b_o->implicit_deps_;
+  ++b_o->depfile_deps_;
+
+  // a.ninja is parsed as it changed, and b.ninja as it loads a subninja,
+  // but c.ninja and d.ninja are copied.
+  fs_.Create("a.ninja", 3, "build a.o: cc a2.c\n");
+  ManifestCache cache(&fs_);
+  SubninjaIndex index;
+  ASSERT_TRUE(cache.LoadIndex(kCachePath, "build.ninja", &index));
+  ASSERT_EQ(4u, index.known().size());
+  EXPECT_EQ("heavy", index.known()[1].pools[0]);
+  EXPECT_EQ("bcc", index.known()[1].rules[0]);
+  EXPECT_EQ("b", index.known()[1].defaults[0]);
+  State state;
+  ParseLazily(&state, &index);
+  string err;
+  EXPECT_TRUE(index.CopyAll(parsed, &state, this, &err)) << err;
+  EXPECT_FALSE(index.deferred());
+  const Rule* link = parsed->LookupRule("link");
+  delete parsed;
+
+  const vector<SubninjaIndex::Subninja>& subninjas = index.subninjas();
+  ASSERT_EQ(4u, subninjas.size());
+  EXPECT_FALSE(subninjas[0].copied);
+  EXPECT_FALSE(subninjas[1].copied);
+  EXPECT_TRUE(subninjas[2].copied);
+  EXPECT_TRUE(subninjas[3].copied);
+  EXPECT_EQ(link, state.LookupRule("link"));
+  EXPECT_EQ(vector<string>(1, "d.ninja"), subninjas[3].files);
+
+  // The same graph as parsing it all, but for the order.
+  State fresh;
+  ManifestParser parser(&fresh, this);
+  ASSERT_TRUE(parser.Load("build.ninja", &err)) << err;
+  ASSERT_EQ(fresh.edges_.size(), state.edges_.size());
+  for (vector<Edge*>::iterator i = fresh.edges_.begin();
+       i != fresh.edges_.end(); ++i) {
+    Edge* edge = state.LookupNode((*i)->outputs_[0]->path())->in_edge();
+    ASSERT_TRUE(edge);
+    EXPECT_EQ((*i)->EvaluateCommand(), edge->EvaluateCommand());
+    EXPECT_EQ((*i)->pool_->name(), edge->pool_->name());
+    EXPECT_EQ((*i)->inputs_.size(), edge->inputs_.size());
+    EXPECT_EQ((*i)->implicit_deps_, edge->implicit_deps_);
+    EXPECT_EQ((*i)->order_only_deps_, edge->order_only_deps_);
+  }
+  EXPECT_EQ("link -g d.c -o d",
+            state.LookupNode("d")->in_edge()->EvaluateCommand());
+  EXPECT_FALSE(state.LookupNode("b.h"));
+  ASSERT_EQ(1u, state.defaults_.size());
+  EXPECT_EQ("b", state.defaults_[0]->path());
+  EXPECT_EQ(2, state.LookupPool("heavy")->depth());
+}
+
+TEST_F(ManifestCacheTest, CopySubninjasUsingChangedRule) {
+  fs_.Create("build.ninja", 1,
+"pool p\n"
+"  depth = 1\n"
+"pool q\n"
+"  depth = 1\n"
+"subninja a.ninja\n"
+"subninja b.ninja\n");
+  fs_.Create("a.ninja", 1,
+"rule acc\n"
+"  command = acc $in\n"
+"  pool = p\n"
+"build a.o: acc a.c\n");
+  fs_.Create("b.ninja", 1, "build b.o: acc b.c\n");
+  State parsed;
+  ParseAndSave(&parsed, 2);
+
+  // b.ninja's edge was put in the rule's pool, which changed.
+  fs_.Create("a.ninja", 3,
+"rule acc\n"
+"  command = acc $in\n"
+"  pool = q\n"
+"build a.o: acc a.c\n");
+  ManifestCache cache(&fs_);
+  SubninjaIndex index;
+  ASSERT_TRUE(cache.LoadIndex(kCachePath, "build.ninja", &index));
+  State state;
+  ParseLazily(&state, &index);
+  EXPECT_TRUE(index.deferred());
+  string err;
+  EXPECT_TRUE(index.CopyAll(&parsed, &state, this, &err)) << err;
+  EXPECT_FALSE(index.subninjas()[1].copied);
+  EXPECT_EQ("q", state.LookupNode("b.o")->in_edge()->pool_->name());
+}
+
+}  // anonymous namespace
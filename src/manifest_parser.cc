@@ -12,99 +12,287 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+
 #include "manifest_parser.h"
 
 #include <assert.h>
 #include <errno.h>
+#include <limits.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "graph.h"
 #include "metrics.h"
 #include "state.h"
+#include "subninja_index.h"
+#include "thread_pool.h"
 #include "util.h"
 
+/// A statement as read from a manifest, before it is evaluated against
+/// the State and the variable scopes.
+struct ManifestParser::Statement {
+  enum Kind { ERROR, POOL, RULE, LET, EDGE, DEFAULT, INCLUDE, SUBNINJA };
+
+  Statement() : kind(ERROR), complete(true), rule(NULL), implicit(0),
+                order_only(0), rule_pos(NULL), pos(NULL) {}
+  ~Statement() { delete rule; }
+
+  /// Record a syntax error.  It is reported after evaluating whatever of
+  /// the statement a serial parse would have acted on before reaching it;
+  /// an ERROR statement has nothing to evaluate.
+  void Fail(const string& err) {
+    complete = false;
+    error = err;
+  }
+
+  Kind kind;
+  bool complete;
+  string error;
+
+  /// RULE: the rule, until it is added to the State.
+  Rule* rule;
+
+  /// LET: name = value.  POOL: the name, and the depth in value.
+  /// INCLUDE, SUBNINJA: the path is in value.
+  string name;
+  EvalString value;
+
+  /// EDGE: the paths and rule.  DEFAULT: the targets are in ins.
+  vector<EvalString> outs, ins;
+  int implicit, order_only;
+  string rule_name;
+  const char* rule_pos;
+  /// EDGE: the variables of the edge's own scope.
+  vector<pair<string, EvalString> > bindings;
+
+  /// Where to report errors found while evaluating an EDGE's paths or a
+  /// POOL's depth, or loading an INCLUDE or SUBNINJA file.  DEFAULT has one per target.
+  const char* pos;
+  vector<const char*> positions;
+};
+
+/// An included file, read and split into statements on the thread pool.
+struct ManifestParser::Prefetch : public ThreadPool::Task {
+  Prefetch(const string& path, State* state, FileReader* file_reader)
+      : path_(path), state_(state), file_reader_(file_reader),
+        read_ok_(false) {}
+  virtual ~Prefetch() {
+    for (vector<Statement*>::iterator i = statements_.begin();
+         i != statements_.end(); ++i) {
+      delete *i;
+    }
+  }
+
+  virtual void Run() {
+    read_ok_ = file_reader_->MapFile(path_, &file_, &read_err_);
+    if (!read_ok_)
+      return;
+    // Reading statements doesn't touch the State.
+    ManifestParser parser(state_, file_reader_);
+    parser.lexer_.Start(path_, StringPiece(file_.data_, file_.size_));
+    parser.ReadAllStatements(&statements_);
+    lexer_ = parser.lexer_;
+  }
+
+  string path_;
+  State* state_;
+  FileReader* file_reader_;
+
+  bool read_ok_;
+  string read_err_;
+  MappedFile file_;
+  /// Refers to file_, for reporting errors.
+  Lexer lexer_;
+  vector<Statement*> statements_;
+};
+
 ManifestParser::ManifestParser(State* state, FileReader* file_reader)
-  : state_(state), file_reader_(file_reader) {
+  : state_(state), file_reader_(file_reader), parallelism_(1), pool_(NULL),
+    prefetches_(NULL), subninja_index_(NULL), subninja_(-1) {
   env_ = &state->bindings_;
 }
-bool ManifestParser::Load(const string& filename, string* err) {
+
+bool ManifestParser::FileReader::MapFile(const string& path, MappedFile* file,
+                                         string* err) {
   string contents;
+  if (!ReadFile(path, &contents, err))
+    return false;
+  file->Adopt(&contents);
+  return true;
+}
+
+bool ManifestParser::Load(const string& filename, string* err) {
+  MappedFile file;
   string read_err;
-  if (!file_reader_->ReadFile(filename, &contents, &read_err)) {
+  if (!file_reader_->MapFile(filename, &file, &read_err)) {
     *err = "loading '" + filename + "': " + read_err;
     return false;
   }
-  contents.resize(contents.size() + 10);
-  return Parse(filename, contents, err);
+  StringPiece contents(file.data_, file.size_);
+  if (parallelism_ <= 1 || pool_)
+    return Parse(filename, contents, err);
+
+  Prefetches prefetches;
+  bool success;
+  {
+    ThreadPool pool(parallelism_);
+    pool_ = &pool;
+    prefetches_ = &prefetches;
+    success = Parse(filename, contents, err);
+    pool_ = NULL;
+    prefetches_ = NULL;
+  }
+  // Drop files read for guesses that turned out wrong.
+  for (Prefetches::iterator i = prefetches.begin(); i != prefetches.end(); ++i)
+    delete i->second;
+  return success;
 }
 
-bool ManifestParser::Parse(const string& filename, const string& input,
+bool ManifestParser::LoadSubninja(const string& filename, int subninja,
+                                  BindingEnv* env, SubninjaIndex* index,
+                                  string* err) {
+  env_ = new BindingEnv(env);
+  subninja_index_ = index;
+  subninja_ = subninja;
+  return Load(filename, err);
+}
+
+bool ManifestParser::Parse(const string& filename, StringPiece input,
                            string* err) {
   METRIC_RECORD(".ninja parse");
   lexer_.Start(filename, input);
 
+  if (pool_) {
+    // Read the whole file first so that the files it includes can be
+    // fetched while it is evaluated.
+    vector<Statement*> statements;
+    ReadAllStatements(&statements);
+    bool success = EvaluateFile(statements, err);
+    for (vector<Statement*>::iterator i = statements.begin();
+         i != statements.end(); ++i) {
+      delete *i;
+    }
+    return success;
+  }
+
+  for (;;) {
+    Statement stmt;
+    if (!ReadStatement(&stmt))
+      return true;
+    if (!Evaluate(&stmt, err))
+      return false;
+  }
+  return false;  // not reached
+}
+
+bool ManifestParser::ReadStatement(Statement* stmt) {
+  string err;
   for (;;) {
     Lexer::Token token = lexer_.ReadToken();
     switch (token) {
     case Lexer::BUILD:
-      if (!ParseEdge(err))
-        return false;
-      break;
+      if (!ParseEdge(stmt, &err))
+        stmt->Fail(err);
+      return true;
+    case Lexer::POOL:
+      if (!ParsePool(stmt, &err))
+        stmt->Fail(err);
+      return true;
     case Lexer::RULE:
-      if (!ParseRule(err))
-        return false;
-      break;
+      if (!ParseRule(stmt, &err))
+        stmt->Fail(err);
+      return true;
     case Lexer::DEFAULT:
-      if (!ParseDefault(err))
-        return false;
-      break;
-    case Lexer::IDENT: {
+      if (!ParseDefault(stmt, &err))
+        stmt->Fail(err);
+      return true;
+    case Lexer::IDENT:
       lexer_.UnreadToken();
-      string name;
-      EvalString value;
-      if (!ParseLet(&name, &value, err))
-        return false;
-      env_->AddBinding(name, value.Evaluate(env_));
-      break;
-    }
+      if (ParseLet(&stmt->name, &stmt->value, &err))
+        stmt->kind = Statement::LET;
+      else
+        stmt->Fail(err);
+      return true;
     case Lexer::INCLUDE:
-      if (!ParseFileInclude(false, err))
-        return false;
-      break;
+      if (!ParseFileInclude(false, stmt, &err))
+        stmt->Fail(err);
+      return true;
     case Lexer::SUBNINJA:
-      if (!ParseFileInclude(true, err))
-        return false;
-      break;
-    case Lexer::ERROR: {
-      return lexer_.Error(lexer_.DescribeLastError(), err);
-    }
-    case Lexer::TEOF:
+      if (!ParseFileInclude(true, stmt, &err))
+        stmt->Fail(err);
+      return true;
+    case Lexer::ERROR:
+      lexer_.Error(lexer_.DescribeLastError(), &err);
+      stmt->Fail(err);
       return true;
+    case Lexer::TEOF:
+      return false;
     case Lexer::NEWLINE:
       break;
     default:
-      return lexer_.Error(string("unexpected ") + Lexer::TokenName(token),
-                          err);
+      lexer_.Error(string("unexpected ") + Lexer::TokenName(token), &err);
+      stmt->Fail(err);
+      return true;
     }
   }
   return false;  // not reached
 }
 
-bool ManifestParser::ParseRule(string* err) {
+void ManifestParser::ReadAllStatements(vector<Statement*>* statements) {
+  for (;;) {
+    Statement* stmt = new Statement;
+    if (!ReadStatement(stmt)) {
+      delete stmt;
+      break;
+    }
+    statements->push_back(stmt);
+    if (!stmt->complete)
+      break;
+  }
+}
+
+bool ManifestParser::ParsePool(Statement* stmt, string* err) {
   string name;
   if (!lexer_.ReadIdent(&name))
-    return lexer_.Error("expected rule name", err);
+    return lexer_.Error("expected pool name", err);
 
   if (!ExpectToken(Lexer::NEWLINE, err))
     return false;
 
-  if (state_->LookupRule(name) != NULL) {
-    *err = "duplicate rule '" + name + "'";
-    return false;
+  stmt->kind = Statement::POOL;
+  stmt->name = name;
+
+  while (lexer_.PeekToken(Lexer::INDENT)) {
+    string key;
+    EvalString value;
+    if (!ParseLet(&key, &value, err))
+      return false;
+
+    if (key == "depth") {
+      stmt->value = value;
+      stmt->pos = lexer_.position();
+    } else {
+      return lexer_.Error("unexpected variable '" + key + "'", err);
+    }
   }
 
-  Rule* rule = new Rule(name);  // XXX scoped_ptr
+  if (stmt->value.empty())
+    return lexer_.Error("expected 'depth =' line", err);
+
+  return true;
+}
+
+bool ManifestParser::ParseRule(Statement* stmt, string* err) {
+  string name;
+  if (!lexer_.ReadIdent(&name))
+    return lexer_.Error("expected rule name", err);
+
+  if (!ExpectToken(Lexer::NEWLINE, err))
+    return false;
+
+  stmt->kind = Statement::RULE;
+  Rule* rule = stmt->rule = new Rule(name);
 
   while (lexer_.PeekToken(Lexer::INDENT)) {
     string key;
@@ -116,12 +304,33 @@ bool ManifestParser::ParseRule(string* err) {
       rule->command_ = value;
     } else if (key == "depfile") {
       rule->depfile_ = value;
+    } else if (key == "deps") {
+      rule->deps_ = value;
     } else if (key == "description") {
       rule->description_ = value;
+    } else if (key == "pool") {
+      rule->pool_ = value;
+    } else if (key == "pool_weight") {
+      rule->pool_weight_ = value;
     } else if (key == "generator") {
       rule->generator_ = true;
     } else if (key == "restat") {
       rule->restat_ = true;
+    } else if (key == "remote") {
+      rule->remote_ = true;
+    } else if (key == "shell") {
+      rule->shell_ = true;
+    } else if (key == "batch") {
+      // A number, known before any edge is.
+      BindingEnv none;
+      string batch = value.Evaluate(&none);
+      char* end;
+      long count = strtol(batch.c_str(), &end, 10);
+      if (batch.empty() || *end != '\0' || count < 0 || count > INT_MAX)
+        return lexer_.Error("batch must be a number of commands", err);
+      rule->batch_ = (int)count;
+    } else if (key == "remote_inputs") {
+      rule->remote_inputs_ = value;
     } else if (key == "rspfile") {
       rule->rspfile_ = value;
     } else if (key == "rspfile_content") {
@@ -139,7 +348,6 @@ bool ManifestParser::ParseRule(string* err) {
   if (rule->command_.empty())
     return lexer_.Error("expected 'command =' line", err);
 
-  state_->AddRule(rule);
   return true;
 }
 
@@ -153,20 +361,17 @@ bool ManifestParser::ParseLet(string* key, EvalString* value, string* err) {
   return true;
 }
 
-bool ManifestParser::ParseDefault(string* err) {
+bool ManifestParser::ParseDefault(Statement* stmt, string* err) {
   EvalString eval;
   if (!lexer_.ReadPath(&eval, err))
     return false;
   if (eval.empty())
     return lexer_.Error("expected target name", err);
 
+  stmt->kind = Statement::DEFAULT;
   do {
-    string path = eval.Evaluate(env_);
-    string path_err;
-    if (!CanonicalizePath(&path, &path_err))
-      return lexer_.Error(path_err, err);
-    if (!state_->AddDefault(path, &path_err))
-      return lexer_.Error(path_err, err);
+    stmt->ins.push_back(eval);
+    stmt->positions.push_back(lexer_.position());
 
     eval.Clear();
     if (!lexer_.ReadPath(&eval, err))
@@ -179,9 +384,7 @@ bool ManifestParser::ParseDefault(string* err) {
   return true;
 }
 
-bool ManifestParser::ParseEdge(string* err) {
-  vector<EvalString> ins, outs;
-
+bool ManifestParser::ParseEdge(Statement* stmt, string* err) {
   {
     EvalString out;
     if (!lexer_.ReadPath(&out, err))
@@ -190,7 +393,7 @@ bool ManifestParser::ParseEdge(string* err) {
       return lexer_.Error("expected path", err);
 
     do {
-      outs.push_back(out);
+      stmt->outs.push_back(out);
 
       out.Clear();
       if (!lexer_.ReadPath(&out, err))
@@ -201,13 +404,12 @@ bool ManifestParser::ParseEdge(string* err) {
   if (!ExpectToken(Lexer::COLON, err))
     return false;
 
-  string rule_name;
-  if (!lexer_.ReadIdent(&rule_name))
+  if (!lexer_.ReadIdent(&stmt->rule_name))
     return lexer_.Error("expected build command name", err);
 
-  const Rule* rule = state_->LookupRule(rule_name);
-  if (!rule)
-    return lexer_.Error("unknown build rule '" + rule_name + "'", err);
+  // From here on the rule is checked even if there's a syntax error.
+  stmt->kind = Statement::EDGE;
+  stmt->rule_pos = lexer_.position();
 
   for (;;) {
     // XXX should we require one path here?
@@ -216,25 +418,23 @@ bool ManifestParser::ParseEdge(string* err) {
       return false;
     if (in.empty())
       break;
-    ins.push_back(in);
+    stmt->ins.push_back(in);
   }
 
   // Add all implicit deps, counting how many as we go.
-  int implicit = 0;
   if (lexer_.PeekToken(Lexer::PIPE)) {
     for (;;) {
       EvalString in;
       if (!lexer_.ReadPath(&in, err))
-        return err;
+        return false;
       if (in.empty())
         break;
-      ins.push_back(in);
-      ++implicit;
+      stmt->ins.push_back(in);
+      ++stmt->implicit;
     }
   }
 
   // Add all order-only deps, counting how many as we go.
-  int order_only = 0;
   if (lexer_.PeekToken(Lexer::PIPE2)) {
     for (;;) {
       EvalString in;
@@ -242,87 +442,325 @@ bool ManifestParser::ParseEdge(string* err) {
         return false;
       if (in.empty())
         break;
-      ins.push_back(in);
-      ++order_only;
+      stmt->ins.push_back(in);
+      ++stmt->order_only;
     }
   }
 
   if (!ExpectToken(Lexer::NEWLINE, err))
     return false;
 
+  // Read the variables of a nested scope, if any.
+  while (lexer_.PeekToken(Lexer::INDENT)) {
+    string key;
+    EvalString val;
+    if (!ParseLet(&key, &val, err))
+      return false;
+    stmt->bindings.push_back(make_pair(key, val));
+  }
+
+  stmt->pos = lexer_.position();
+  return true;
+}
+
+bool ManifestParser::ParseFileInclude(bool new_scope, Statement* stmt,
+                                      string* err) {
+  // XXX this should use ReadPath!
+  if (!lexer_.ReadPath(&stmt->value, err))
+    return false;
+
+  stmt->kind = new_scope ? Statement::SUBNINJA : Statement::INCLUDE;
+  stmt->pos = lexer_.position();
+
+  if (!ExpectToken(Lexer::NEWLINE, err))
+    return false;
+
+  return true;
+}
+
+bool ManifestParser::ExpectToken(Lexer::Token expected, string* err) {
+  Lexer::Token token = lexer_.ReadToken();
+  if (token != expected) {
+    string message = string("expected ") + Lexer::TokenName(expected);
+    message += string(", got ") + Lexer::TokenName(token);
+    message += Lexer::TokenErrorHint(expected);
+    return lexer_.Error(message, err);
+  }
+  return true;
+}
+
+bool ManifestParser::Evaluate(Statement* stmt, string* err) {
+  switch (stmt->kind) {
+  case Statement::ERROR:
+    break;
+  case Statement::POOL:
+    if (!EvaluatePool(stmt, err))
+      return false;
+    break;
+  case Statement::RULE:
+    if (state_->LookupRule(stmt->rule->name()) != NULL) {
+      *err = "duplicate rule '" + stmt->rule->name() + "'";
+      return false;
+    }
+    if (stmt->complete) {
+      if (subninja_index_)
+        subninja_index_->AddRule(subninja_, stmt->rule->name());
+      state_->AddRule(stmt->rule);
+      stmt->rule = NULL;
+    }
+    break;
+  case Statement::LET:
+    env_->AddBinding(stmt->name, stmt->value.Evaluate(env_));
+    if (subninja_index_)
+      subninja_index_->AddBinding(env_);
+    break;
+  case Statement::EDGE:
+    if (!EvaluateEdge(stmt, err))
+      return false;
+    break;
+  case Statement::DEFAULT:
+    if (!EvaluateDefault(stmt, err))
+      return false;
+    break;
+  case Statement::INCLUDE:
+  case Statement::SUBNINJA:
+    if (!EvaluateFileInclude(stmt, err))
+      return false;
+    break;
+  }
+
+  if (!stmt->complete) {
+    *err = stmt->error;
+    return false;
+  }
+  return true;
+}
+
+bool ManifestParser::EvaluatePool(Statement* stmt, string* err) {
+  if (state_->LookupPool(stmt->name) != NULL) {
+    *err = "duplicate pool '" + stmt->name + "'";
+    return false;
+  }
+  if (!stmt->complete)
+    return true;
+
+  string depth_string = stmt->value.Evaluate(env_);
+  char* end;
+  long depth = strtol(depth_string.c_str(), &end, 10);
+  if (depth_string.empty() || *end != '\0' || depth < 0 || depth > INT_MAX)
+    return lexer_.ErrorAt(stmt->pos, "invalid pool depth", err);
+
+  state_->AddPool(new Pool(stmt->name, (int)depth));
+  if (subninja_index_)
+    subninja_index_->AddPool(subninja_, stmt->name);
+  return true;
+}
+
+bool ManifestParser::EvaluateEdge(Statement* stmt, string* err) {
+  const Rule* rule = state_->LookupRule(stmt->rule_name);
+  if (!rule) {
+    return lexer_.ErrorAt(stmt->rule_pos,
+                          "unknown build rule '" + stmt->rule_name + "'", err);
+  }
+  if (!stmt->complete)
+    return true;
+
   // Default to using outer env.
   BindingEnv* env = env_;
 
   // But create and fill a nested env if there are variables in scope.
-  if (lexer_.PeekToken(Lexer::INDENT)) {
-    // XXX scoped_ptr to handle error case.
+  if (!stmt->bindings.empty()) {
     env = new BindingEnv(env_);
-    do {
-      string key;
-      EvalString val;
-      if (!ParseLet(&key, &val, err))
-        return false;
-      env->AddBinding(key, val.Evaluate(env_));
-    } while (lexer_.PeekToken(Lexer::INDENT));
+    for (vector<pair<string, EvalString> >::iterator i =
+             stmt->bindings.begin(); i != stmt->bindings.end(); ++i) {
+      env->AddBinding(i->first, i->second.Evaluate(env_));
+    }
   }
 
   Edge* edge = state_->AddEdge(rule);
   edge->env_ = env;
-  for (vector<EvalString>::iterator i = ins.begin(); i != ins.end(); ++i) {
+  edge->inputs_.reserve(stmt->ins.size());
+  for (vector<EvalString>::iterator i = stmt->ins.begin();
+       i != stmt->ins.end(); ++i) {
     string path = i->Evaluate(env);
     string path_err;
     if (!CanonicalizePath(&path, &path_err))
-      return lexer_.Error(path_err, err);
+      return lexer_.ErrorAt(stmt->pos, path_err, err);
     state_->AddIn(edge, path);
   }
-  for (vector<EvalString>::iterator i = outs.begin(); i != outs.end(); ++i) {
+  for (vector<EvalString>::iterator i = stmt->outs.begin();
+       i != stmt->outs.end(); ++i) {
     string path = i->Evaluate(env);
     string path_err;
     if (!CanonicalizePath(&path, &path_err))
-      return lexer_.Error(path_err, err);
+      return lexer_.ErrorAt(stmt->pos, path_err, err);
     state_->AddOut(edge, path);
   }
-  edge->implicit_deps_ = implicit;
-  edge->order_only_deps_ = order_only;
+  edge->implicit_deps_ = stmt->implicit;
+  edge->order_only_deps_ = stmt->order_only;
 
+  if (!EvaluateEdgePool(stmt, edge, err))
+    return false;
+  if (subninja_index_)
+    subninja_index_->AddEdge(subninja_, edge);
   return true;
 }
 
-bool ManifestParser::ParseFileInclude(bool new_scope, string* err) {
-  // XXX this should use ReadPath!
-  EvalString eval;
-  if (!lexer_.ReadPath(&eval, err))
-    return false;
-  string path = eval.Evaluate(env_);
+bool ManifestParser::EvaluateEdgePool(Statement* stmt, Edge* edge,
+                                      string* err) {
+  // The edge's own 'pool' and 'pool_weight' take precedence over the
+  // rule's.
+  string pool_name, weight_string;
+  bool have_pool = false, have_weight = false;
+  for (vector<pair<string, EvalString> >::iterator i =
+           stmt->bindings.begin(); i != stmt->bindings.end(); ++i) {
+    if (i->first == "pool")
+      have_pool = true;
+    else if (i->first == "pool_weight")
+      have_weight = true;
+  }
+  pool_name = have_pool ? edge->env_->LookupVariable("pool")
+                        : edge->EvaluatePool();
+  if (pool_name.empty())
+    return true;
+
+  Pool* pool = state_->LookupPool(pool_name);
+  if (!pool)
+    return lexer_.ErrorAt(stmt->pos, "unknown pool name '" + pool_name + "'",
+                          err);
+  edge->pool_ = pool;
+
+  weight_string = have_weight ? edge->env_->LookupVariable("pool_weight")
+                              : edge->EvaluatePoolWeight();
+  if (weight_string.empty())
+    return true;
+  char* end;
+  long weight = strtol(weight_string.c_str(), &end, 10);
+  if (*end != '\0' || weight < 1 || weight > INT_MAX)
+    return lexer_.ErrorAt(stmt->pos, "invalid pool_weight", err);
+  // A heavier edge could never start.
+  if (pool->depth() != 0 && weight > pool->depth()) {
+    return lexer_.ErrorAt(stmt->pos, "pool_weight exceeds the depth of pool '" +
+                          pool_name + "'", err);
+  }
+  edge->pool_weight_ = (int)weight;
+  return true;
+}
 
-  string contents;
-  string read_err;
-  if (!file_reader_->ReadFile(path, &contents, &read_err))
-    return lexer_.Error("loading '" + path + "': " + read_err, err);
+bool ManifestParser::EvaluateDefault(Statement* stmt, string* err) {
+  for (size_t i = 0; i < stmt->ins.size(); ++i) {
+    string path = stmt->ins[i].Evaluate(env_);
+    string path_err;
+    if (!CanonicalizePath(&path, &path_err))
+      return lexer_.ErrorAt(stmt->positions[i], path_err, err);
+    if (!state_->AddDefault(path, &path_err))
+      return lexer_.ErrorAt(stmt->positions[i], path_err, err);
+    if (subninja_index_)
+      subninja_index_->AddDefault(subninja_, path);
+  }
+  return true;
+}
+
+bool ManifestParser::EvaluateFileInclude(Statement* stmt, string* err) {
+  string path = stmt->value.Evaluate(env_);
 
   ManifestParser subparser(state_, file_reader_);
-  if (new_scope) {
+  subparser.parallelism_ = parallelism_;
+  subparser.pool_ = pool_;
+  subparser.prefetches_ = prefetches_;
+  subparser.subninja_index_ = subninja_index_;
+  subparser.subninja_ = subninja_;
+  if (subninja_index_) {
+    if (stmt->kind == Statement::SUBNINJA) {
+      subparser.subninja_ =
+          subninja_index_->AddSubninja(path, subninja_, env_);
+      // Put off, so not read; a prefetch of it is left unused.
+      if (subninja_index_->subninjas()[subparser.subninja_].deferred)
+        return true;
+    } else {
+      subninja_index_->AddInclude(subninja_, path);
+    }
+  }
+
+  Prefetch* prefetch = TakePrefetch(path);
+  MappedFile file;
+  string read_err;
+  bool read_ok;
+  if (prefetch) {
+    read_ok = prefetch->read_ok_;
+    read_err = prefetch->read_err_;
+  } else {
+    read_ok = file_reader_->MapFile(path, &file, &read_err);
+  }
+  if (!read_ok) {
+    delete prefetch;
+    return lexer_.ErrorAt(stmt->pos, "loading '" + path + "': " + read_err,
+                          err);
+  }
+
+  if (stmt->kind == Statement::SUBNINJA) {
     subparser.env_ = new BindingEnv(env_);
   } else {
     subparser.env_ = env_;
   }
 
-  if (!subparser.Parse(path, contents, err))
-    return false;
-
-  if (!ExpectToken(Lexer::NEWLINE, err))
-    return false;
+  if (prefetch) {
+    subparser.lexer_ = prefetch->lexer_;
+    bool ok = subparser.EvaluateFile(prefetch->statements_, err);
+    delete prefetch;
+    return ok;
+  }
+  return subparser.Parse(path, StringPiece(file.data_, file.size_), err);
+}
 
+bool ManifestParser::EvaluateFile(const vector<Statement*>& statements,
+                                  string* err) {
+  StartPrefetches(statements);
+  for (vector<Statement*>::const_iterator i = statements.begin();
+       i != statements.end(); ++i) {
+    if (!Evaluate(*i, err))
+      return false;
+  }
   return true;
 }
 
-bool ManifestParser::ExpectToken(Lexer::Token expected, string* err) {
-  Lexer::Token token = lexer_.ReadToken();
-  if (token != expected) {
-    string message = string("expected ") + Lexer::TokenName(expected);
-    message += string(", got ") + Lexer::TokenName(token);
-    message += Lexer::TokenErrorHint(expected);
-    return lexer_.Error(message, err);
+void ManifestParser::StartPrefetches(const vector<Statement*>& statements) {
+  if (!pool_)
+    return;
+
+  // Included paths usually only depend on variables set earlier in the
+  // same file, so work them out up front.  A wrong guess only means the
+  // file is read again when the include is evaluated.
+  BindingEnv scope(env_);
+  for (vector<Statement*>::const_iterator i = statements.begin();
+       i != statements.end(); ++i) {
+    Statement* stmt = *i;
+    if (stmt->kind == Statement::LET) {
+      scope.AddBinding(stmt->name, stmt->value.Evaluate(&scope));
+    } else if (stmt->kind == Statement::INCLUDE ||
+               stmt->kind == Statement::SUBNINJA) {
+      string path = stmt->value.Evaluate(&scope);
+      if (prefetches_->find(path) != prefetches_->end())
+        continue;
+      if (stmt->kind == Statement::SUBNINJA && subninja_index_ &&
+          subninja_index_->MayDefer(path)) {
+        continue;
+      }
+      Prefetch* prefetch = new Prefetch(path, state_, file_reader_);
+      prefetches_->insert(make_pair(path, prefetch));
+      pool_->Post(prefetch);
+    }
   }
-  return true;
+}
+
+ManifestParser::Prefetch* ManifestParser::TakePrefetch(const string& path) {
+  if (!prefetches_)
+    return NULL;
+  Prefetches::iterator i = prefetches_->find(path);
+  if (i == prefetches_->end())
+    return NULL;
+  Prefetch* prefetch = i->second;
+  prefetches_->erase(i);
+  pool_->Wait(prefetch);
+  return prefetch;
 }
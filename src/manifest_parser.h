@@ -15,9 +15,10 @@
 #ifndef NINJA_MANIFEST_PARSER_H_
 #define NINJA_MANIFEST_PARSER_H_
 
+#include <limits>
+#include <map>
 #include <string>
 #include <vector>
-#include <limits>
 
 using namespace std;
 
@@ -25,47 +26,115 @@ using namespace std;
 #include "string_piece.h"
 
 struct BindingEnv;
+struct Edge;
 struct EvalString;
+struct MappedFile;
 struct State;
+struct SubninjaIndex;
+struct ThreadPool;
 
 /// Parses .ninja files.
+///
+/// Each statement is first read into a Statement without looking at the
+/// State or variable scopes, then evaluated to update them.  Normally
+/// that happens one statement at a time; in parallel mode included files
+/// are read and tokenized on worker threads ahead of being evaluated.
 struct ManifestParser {
   struct FileReader {
     virtual ~FileReader() {}
     virtual bool ReadFile(const string& path, string* content, string* err) = 0;
+
+    /// Get the contents of \a path into \a file, which the parser keeps
+    /// for as long as it refers to them.  The default uses ReadFile(); a
+    /// reader of real files can map them instead.
+    virtual bool MapFile(const string& path, MappedFile* file, string* err);
   };
 
   ManifestParser(State* state, FileReader* file_reader);
 
+  /// Read and tokenize subninja and include files on up to \a jobs
+  /// threads, ahead of evaluating them in order.  The resulting State and
+  /// any error are the same as for a serial parse, but the FileReader must
+  /// be safe to call from several threads at once.
+  void set_parallelism(int jobs) { parallelism_ = jobs; }
+
+  /// Record the subninjas loaded in \a index, which may put some off.
+  void set_subninja_index(SubninjaIndex* index) { subninja_index_ = index; }
+
   /// Load and parse a file.
   bool Load(const string& filename, string* err);
 
+  /// Load the subninja \a filename, numbered \a subninja in \a index, in
+  /// a new scope under \a env, as its subninja statement would have.
+  bool LoadSubninja(const string& filename, int subninja, BindingEnv* env,
+                    SubninjaIndex* index, string* err);
+
   /// Parse a text string of input.  Used by tests.
   bool ParseTest(const string& input, string* err) {
     return Parse("input", input, err);
   }
 
 private:
+  struct Statement;
+  struct Prefetch;
+  typedef map<string, Prefetch*> Prefetches;
+
   /// Parse a file, given its contents as a string.
-  bool Parse(const string& filename, const string& input, string* err);
+  bool Parse(const string& filename, StringPiece input, string* err);
+
+  /// Read the next statement into \a stmt.  Returns false at the end of
+  /// the input; syntax errors are recorded in \a stmt.
+  bool ReadStatement(Statement* stmt);
+
+  /// Read all statements, up to the end or the first syntax error.
+  void ReadAllStatements(vector<Statement*>* statements);
 
   /// Parse various statement types.
-  bool ParseRule(string* err);
+  bool ParsePool(Statement* stmt, string* err);
+  bool ParseRule(Statement* stmt, string* err);
   bool ParseLet(string* key, EvalString* val, string* err);
-  bool ParseEdge(string* err);
-  bool ParseDefault(string* err);
+  bool ParseEdge(Statement* stmt, string* err);
+  bool ParseDefault(Statement* stmt, string* err);
 
   /// Parse either a 'subninja' or 'include' line.
-  bool ParseFileInclude(bool new_scope, string* err);
+  bool ParseFileInclude(bool new_scope, Statement* stmt, string* err);
 
   /// If the next token is not \a expected, produce an error string
   /// saying "expectd foo, got bar".
   bool ExpectToken(Lexer::Token expected, string* err);
 
+  /// Apply a statement to the State and the current scope.
+  bool Evaluate(Statement* stmt, string* err);
+  bool EvaluatePool(Statement* stmt, string* err);
+  bool EvaluateEdge(Statement* stmt, string* err);
+  bool EvaluateEdgePool(Statement* stmt, Edge* edge, string* err);
+  bool EvaluateDefault(Statement* stmt, string* err);
+  bool EvaluateFileInclude(Statement* stmt, string* err);
+
+  /// Evaluate a file read ahead of time.
+  bool EvaluateFile(const vector<Statement*>& statements, string* err);
+
+  /// Start reading the files included by \a statements on the pool.
+  void StartPrefetches(const vector<Statement*>& statements);
+
+  /// Take the prefetched contents of \a path, waiting for them to be
+  /// ready, or return NULL if the file wasn't prefetched.
+  Prefetch* TakePrefetch(const string& path);
+
   State* state_;
   BindingEnv* env_;
   FileReader* file_reader_;
   Lexer lexer_;
+
+  int parallelism_;
+  /// Set in parallel mode; shared by the parsers of all included files.
+  ThreadPool* pool_;
+  Prefetches* prefetches_;
+
+  SubninjaIndex* subninja_index_;
+  /// The number in subninja_index_ of the subninja being parsed, or -1
+  /// for the top-level manifest.
+  int subninja_;
 };
 
 #endif  // NINJA_MANIFEST_PARSER_H_
@@ -18,6 +18,7 @@
 
 #include "graph.h"
 #include "state.h"
+#include "thread_pool.h"
 
 struct ParserTest : public testing::Test,
                     public ManifestParser::FileReader {
@@ -29,6 +30,8 @@ struct ParserTest : public testing::Test,
   }
 
   virtual bool ReadFile(const string& path, string* content, string* err) {
+    // Called from worker threads by parallel loads.
+    ScopedLock lock(&mutex_);
     files_read_.push_back(path);
     map<string, string>::iterator i = files_.find(path);
     if (i == files_.end()) {
@@ -42,6 +45,7 @@ struct ParserTest : public testing::Test,
   State state;
   map<string, string> files_;
   vector<string> files_read_;
+  Mutex mutex_;
 };
 
 TEST_F(ParserTest, Empty) {
@@ -75,9 +79,59 @@ TEST_F(ParserTest, RuleAttributes) {
 "  restat = a\n"
 "  rspfile = a\n"
 "  rspfile_content = a\n"
+"  pool = \n"
+"  pool_weight = 1\n"
+"  batch = 4\n"
 ));
 }
 
+TEST_F(ParserTest, Batch) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(
+"rule stamp\n"
+"  command = touch $out\n"
+"  batch = 16\n"
+"rule cc\n"
+"  command = cc $in\n"));
+  EXPECT_EQ(16, state.LookupRule("stamp")->batch());
+  EXPECT_EQ(0, state.LookupRule("cc")->batch());
+}
+
+TEST_F(ParserTest, Pools) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(
+"pool link_pool\n"
+"  depth = 4\n"
+"n = 2\n"
+"pool codegen\n"
+"  depth = $n\n"
+"rule link\n"
+"  command = link $in\n"
+"  pool = link_pool\n"
+"  pool_weight = 2\n"
+"rule cc\n"
+"  command = cc $in\n"
+"build a.o: cc a.c\n"
+"build a.h: cc a.in\n"
+"  pool = codegen\n"
+"build a: link a.o\n"
+"build b: link a.o\n"
+"  pool_weight = 4\n"));
+
+  ASSERT_EQ(2u, state.pools_.size());
+  Pool* link_pool = state.LookupPool("link_pool");
+  ASSERT_TRUE(link_pool);
+  EXPECT_EQ(4, link_pool->depth());
+  Pool* codegen = state.LookupPool("codegen");
+  ASSERT_TRUE(codegen);
+  EXPECT_EQ(2, codegen->depth());
+
+  EXPECT_EQ(&State::kDefaultPool, state.LookupNode("a.o")->in_edge()->pool_);
+  EXPECT_EQ(codegen, state.LookupNode("a.h")->in_edge()->pool_);
+  EXPECT_EQ(1, state.LookupNode("a.h")->in_edge()->pool_weight_);
+  EXPECT_EQ(link_pool, state.LookupNode("a")->in_edge()->pool_);
+  EXPECT_EQ(2, state.LookupNode("a")->in_edge()->pool_weight_);
+  EXPECT_EQ(4, state.LookupNode("b")->in_edge()->pool_weight_);
+}
+
 TEST_F(ParserTest, IgnoreIndentedComments) {
   ASSERT_NO_FATAL_FAILURE(AssertParse(
 "  #indented comment\n"
@@ -572,6 +626,92 @@ TEST_F(ParserTest, Errors) {
                                   "  generator = 1\n", &err));
     EXPECT_EQ("input:4: unexpected indent\n", err);
   }
+
+  {
+    State state;
+    ManifestParser parser(&state, NULL);
+    string err;
+    EXPECT_FALSE(parser.ParseTest("pool\n", &err));
+    EXPECT_EQ("input:1: expected pool name\n", err);
+  }
+
+  {
+    State state;
+    ManifestParser parser(&state, NULL);
+    string err;
+    EXPECT_FALSE(parser.ParseTest("pool foo\n", &err));
+    EXPECT_EQ("input:2: expected 'depth =' line\n", err);
+  }
+
+  {
+    State state;
+    ManifestParser parser(&state, NULL);
+    string err;
+    EXPECT_FALSE(parser.ParseTest("pool foo\n"
+                                  "  depth = 4\n"
+                                  "pool foo\n"
+                                  "  depth = 2\n", &err));
+    EXPECT_EQ("duplicate pool 'foo'", err);
+  }
+
+  {
+    State state;
+    ManifestParser parser(&state, NULL);
+    string err;
+    EXPECT_FALSE(parser.ParseTest("pool foo\n"
+                                  "  depth = -1\n", &err));
+    EXPECT_EQ("input:2: invalid pool depth\n"
+              "  depth = -1\n"
+              "            ^ near here", err);
+  }
+
+  {
+    State state;
+    ManifestParser parser(&state, NULL);
+    string err;
+    EXPECT_FALSE(parser.ParseTest("rule stamp\n"
+                                  "  command = touch $out\n"
+                                  "  batch = $n\n", &err));
+    EXPECT_EQ("input:3: batch must be a number of commands\n"
+              "  batch = $n\n"
+              "            ^ near here", err);
+  }
+
+  {
+    State state;
+    ManifestParser parser(&state, NULL);
+    string err;
+    EXPECT_FALSE(parser.ParseTest("pool foo\n"
+                                  "  bar = 1\n", &err));
+    EXPECT_EQ("input:2: unexpected variable 'bar'\n"
+              "  bar = 1\n"
+              "         ^ near here", err);
+  }
+
+  {
+    State state;
+    ManifestParser parser(&state, NULL);
+    string err;
+    EXPECT_FALSE(parser.ParseTest("rule run\n"
+                                  "  command = echo\n"
+                                  "  pool = unnamed_pool\n"
+                                  "build out: run in\n", &err));
+    EXPECT_EQ("input:5: unknown pool name 'unnamed_pool'\n", err);
+  }
+
+  {
+    State state;
+    ManifestParser parser(&state, NULL);
+    string err;
+    EXPECT_FALSE(parser.ParseTest("pool link\n"
+                                  "  depth = 2\n"
+                                  "rule run\n"
+                                  "  command = echo\n"
+                                  "  pool = link\n"
+                                  "build out: run in\n"
+                                  "  pool_weight = 3\n", &err));
+    EXPECT_EQ("input:8: pool_weight exceeds the depth of pool 'link'\n", err);
+  }
 }
 
 TEST_F(ParserTest, MissingInput) {
@@ -638,6 +778,87 @@ TEST_F(ParserTest, Include) {
   EXPECT_EQ("inner", state.bindings_.LookupVariable("var"));
 }
 
+TEST_F(ParserTest, ParallelLoad) {
+  files_["build.ninja"] =
+"builddir = out\n"
+"rule cc\n"
+"  command = cc $cflags $in -o $out\n"
+"cflags = -O2\n"
+"include $builddir/common.ninja\n"
+"subninja $builddir/a.ninja\n"
+"subninja $builddir/b.ninja\n"
+"subninja $dir/c.ninja\n"
+"default $builddir/a.o\n";
+  files_["out/common.ninja"] = "dir = out\n";
+  files_["out/a.ninja"] =
+"cflags = -g\n"
+"build $builddir/a.o: cc a.c\n"
+"subninja $builddir/nested.ninja\n";
+  files_["out/b.ninja"] = "build $builddir/b.o: cc b.c | a.h || gen\n";
+  files_["out/c.ninja"] = "build $builddir/c.o: cc c.c\n  cflags = -O0\n";
+  files_["out/nested.ninja"] = "build $builddir/n.o: cc n.c\n";
+
+  State serial;
+  ManifestParser serial_parser(&serial, this);
+  string err;
+  ASSERT_TRUE(serial_parser.Load("build.ninja", &err)) << err;
+
+  ManifestParser parser(&state, this);
+  parser.set_parallelism(4);
+  ASSERT_TRUE(parser.Load("build.ninja", &err)) << err;
+  EXPECT_EQ("", err);
+
+  ASSERT_EQ(serial.edges_.size(), state.edges_.size());
+  for (size_t i = 0; i < state.edges_.size(); ++i) {
+    EXPECT_EQ(serial.edges_[i]->EvaluateCommand(),
+              state.edges_[i]->EvaluateCommand());
+    EXPECT_EQ(serial.edges_[i]->outputs_[0]->path(),
+              state.edges_[i]->outputs_[0]->path());
+    EXPECT_EQ(serial.edges_[i]->implicit_deps_,
+              state.edges_[i]->implicit_deps_);
+    EXPECT_EQ(serial.edges_[i]->order_only_deps_,
+              state.edges_[i]->order_only_deps_);
+  }
+  EXPECT_EQ("cc -g a.c -o out/a.o", state.edges_[0]->EvaluateCommand());
+  EXPECT_EQ("cc -O0 c.c -o out/c.o", state.edges_[3]->EvaluateCommand());
+  ASSERT_EQ(1u, state.defaults_.size());
+  EXPECT_EQ("out/a.o", state.defaults_[0]->path());
+}
+
+TEST_F(ParserTest, ParallelLoadErrors) {
+  const char* kManifests[] = {
+    // Error in a prefetched file.
+    "subninja a.ninja\n"
+    "subninja b.ninja\n",
+    // Missing prefetched file.
+    "subninja a.ninja\n"
+    "subninja missing.ninja\n",
+    // Evaluation error before a later syntax error.
+    "subninja b.ninja\n"
+    "build x: cc\n"
+    "build y: phony $\n",
+  };
+  files_["a.ninja"] = "build a: phony\n";
+  files_["b.ninja"] = "build b: phony\nbuild c: cc\n";
+
+  for (size_t i = 0; i < sizeof(kManifests) / sizeof(kManifests[0]); ++i) {
+    files_["build.ninja"] = kManifests[i];
+
+    State serial;
+    ManifestParser serial_parser(&serial, this);
+    string serial_err;
+    EXPECT_FALSE(serial_parser.Load("build.ninja", &serial_err));
+
+    State parallel;
+    ManifestParser parser(&parallel, this);
+    parser.set_parallelism(4);
+    string err;
+    EXPECT_FALSE(parser.Load("build.ninja", &err));
+    EXPECT_EQ(serial_err, err);
+    EXPECT_NE("", err);
+  }
+}
+
 TEST_F(ParserTest, Implicit) {
   ASSERT_NO_FATAL_FAILURE(AssertParse(
 "rule cat\n"
@@ -0,0 +1,291 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Times ManifestParser over a generated manifest, reporting parse time,
+// peak RSS and heap allocations.  The manifest only depends on the
+// options, so runs with the same options are comparable.
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <map>
+#include <new>
+
+#ifdef _WIN32
+#include "getopt.h"
+#else
+#include <getopt.h>
+#endif
+
+#include "manifest_parser.h"
+#include "metrics.h"
+#include "state.h"
+#include "util.h"
+
+namespace {
+
+/// Heap allocations made through operator new.
+uint64_t g_allocations;
+uint64_t g_allocated_bytes;
+
+void CountAllocation(size_t size) {
+#ifdef __GNUC__
+  // The parser may allocate from several threads.
+  __sync_fetch_and_add(&g_allocations, 1);
+  __sync_fetch_and_add(&g_allocated_bytes, size);
+#else
+  ++g_allocations;
+  g_allocated_bytes += size;
+#endif
+}
+
+}  // anonymous namespace
+
+#if __cplusplus >= 201103L
+#define NINJA_THROW_BAD_ALLOC
+#define NINJA_NOTHROW noexcept
+#else
+#define NINJA_THROW_BAD_ALLOC throw(std::bad_alloc)
+#define NINJA_NOTHROW throw()
+#endif
+
+void* operator new(size_t size) NINJA_THROW_BAD_ALLOC {
+  CountAllocation(size);
+  void* p = malloc(size ? size : 1);
+  if (!p)
+    Fatal("out of memory");
+  return p;
+}
+
+void* operator new[](size_t size) NINJA_THROW_BAD_ALLOC {
+  return operator new(size);
+}
+
+void operator delete(void* p) NINJA_NOTHROW {
+  free(p);
+}
+
+void operator delete[](void* p) NINJA_NOTHROW {
+  free(p);
+}
+
+#ifdef __cpp_sized_deallocation
+void operator delete(void* p, size_t) NINJA_NOTHROW {
+  operator delete(p);
+}
+
+void operator delete[](void* p, size_t) NINJA_NOTHROW {
+  operator delete(p);
+}
+#endif
+
+namespace {
+
+/// The shape of the generated manifest.
+struct Options {
+  Options()
+      : edges(100000), fan_in(4), bindings(2), depth(2), branching(4),
+        jobs(1), runs(5) {}
+
+  int edges;
+  /// Explicit inputs per edge.
+  int fan_in;
+  /// Variables bound on each edge.
+  int bindings;
+  /// Levels of subninja files below build.ninja.
+  int depth;
+  /// Subninja files included by each file above the last level.
+  int branching;
+  /// Threads to parse with; see ManifestParser::set_parallelism().
+  int jobs;
+  int runs;
+};
+
+/// A FileReader over generated files in memory, so that timings don't
+/// include the disk.
+struct MemoryFileReader : public ManifestParser::FileReader {
+  virtual bool ReadFile(const string& path, string* content, string* err) {
+    map<string, string>::const_iterator i = files_.find(path);
+    if (i == files_.end()) {
+      *err = "No such file or directory";
+      return false;
+    }
+    *content = i->second;
+    return true;
+  }
+
+  map<string, string> files_;
+};
+
+/// A small deterministic PRNG, so the manifest doesn't depend on the
+/// platform's rand().
+struct Random {
+  Random() : state_(0x2545F491) {}
+  uint32_t Next(uint32_t limit) {
+    state_ = state_ * 1103515245 + 12345;
+    return (uint32_t)(state_ >> 33) % limit;
+  }
+  uint64_t state_;
+};
+
+/// Add \a path, and the files it includes down to \a options.depth, to
+/// \a reader.  Writes \a edges_per_file edges into each file, numbering
+/// them from \a *next_edge.
+void GenerateFile(const Options& options, const string& path, int level,
+                  int edges_per_file, int* next_edge, Random* random,
+                  MemoryFileReader* reader) {
+  string out;
+  char buf[256];
+  if (level == 0) {
+    out +=
+      "cflags = -O2 -Wall -fno-exceptions -Iout/gen/include\n"
+      "rule cxx\n"
+      "  command = c++ -MMD -MF $out.d $cflags $defines -c $in -o $out\n"
+      "  description = CXX $out\n"
+      "  depfile = $out.d\n"
+      "rule link\n"
+      "  command = c++ $ldflags -o $out $in $libs\n"
+      "  description = LINK $out\n";
+  }
+  snprintf(buf, sizeof(buf), "dir = out/obj/level%d/part%d\n",
+           level, *next_edge);
+  out += buf;
+
+  for (int e = 0; e < edges_per_file && *next_edge < options.edges; ++e) {
+    int edge = (*next_edge)++;
+    snprintf(buf, sizeof(buf), "build $dir/file%d.o: cxx", edge);
+    out += buf;
+    for (int i = 0; i < options.fan_in; ++i) {
+      // Mix sources with the outputs of earlier edges.
+      int input = random->Next(edge + 1);
+      if (input < edge && random->Next(2)) {
+        snprintf(buf, sizeof(buf), " $\n    gen/file%d.h", input);
+      } else {
+        snprintf(buf, sizeof(buf), " $\n    ../../src/module%d/file%d.cc",
+                 input / 100, input);
+      }
+      out += buf;
+    }
+    out += "\n";
+    for (int b = 0; b < options.bindings; ++b) {
+      snprintf(buf, sizeof(buf),
+               "  var%d = $cflags -DMODULE=%d -DMODULE_FILE=file%d\n",
+               b, edge / 100, edge);
+      out += buf;
+    }
+  }
+
+  if (level < options.depth) {
+    for (int i = 0; i < options.branching; ++i) {
+      snprintf(buf, sizeof(buf), "%s.%d", path.c_str(), i);
+      string child = buf;
+      out += "subninja " + child + "\n";
+      GenerateFile(options, child, level + 1, edges_per_file, next_edge,
+                   random, reader);
+    }
+  }
+  reader->files_[path] = out;
+}
+
+void Usage() {
+  printf(
+"usage: manifest_perftest [options]\n"
+"\n"
+"options:\n"
+"  -e N  edges [default=100000]\n"
+"  -i N  explicit inputs per edge [default=4]\n"
+"  -v N  variables bound per edge [default=2]\n"
+"  -d N  levels of subninja files [default=2]\n"
+"  -b N  subninja files included per file [default=4]\n"
+"  -j N  parse with N threads [default=1]\n"
+"  -r N  runs, of which the fastest is reported [default=5]\n");
+}
+
+}  // anonymous namespace
+
+int main(int argc, char* argv[]) {
+  Options options;
+  int opt;
+  while ((opt = getopt(argc, argv, "e:i:v:d:b:j:r:h")) != -1) {
+    int value = atoi(optarg ? optarg : "0");
+    switch (opt) {
+      case 'e': options.edges = value; break;
+      case 'i': options.fan_in = value; break;
+      case 'v': options.bindings = value; break;
+      case 'd': options.depth = value; break;
+      case 'b': options.branching = value; break;
+      case 'j': options.jobs = value; break;
+      case 'r': options.runs = value; break;
+      default:
+        Usage();
+        return 1;
+    }
+  }
+  if (options.edges < 0 || options.fan_in < 0 || options.bindings < 0 ||
+      options.depth < 0 || options.branching < 1 || options.runs < 1) {
+    Usage();
+    return 1;
+  }
+
+  MemoryFileReader reader;
+  int files = 1;
+  for (int level = 0, width = 1; level < options.depth; ++level) {
+    width *= options.branching;
+    files += width;
+  }
+  int next_edge = 0;
+  Random random;
+  GenerateFile(options, "build.ninja", 0, (options.edges + files - 1) / files,
+               &next_edge, &random, &reader);
+
+  size_t bytes = 0;
+  for (map<string, string>::iterator i = reader.files_.begin();
+       i != reader.files_.end(); ++i) {
+    bytes += i->second.size();
+  }
+  printf("%d files, %.1f MB\n", (int)reader.files_.size(), bytes / 1048576.0);
+
+  int64_t best = -1;
+  uint64_t allocations = 0, allocated_bytes = 0;
+  size_t nodes = 0, edges = 0;
+  for (int run = 0; run < options.runs; ++run) {
+    State state;
+    ManifestParser parser(&state, &reader);
+    parser.set_parallelism(options.jobs);
+    string err;
+    uint64_t start_allocations = g_allocations;
+    uint64_t start_allocated_bytes = g_allocated_bytes;
+    int64_t start = GetTimeMillis();
+    if (!parser.Load("build.ninja", &err)) {
+      fprintf(stderr, "manifest_perftest: %s\n", err.c_str());
+      return 1;
+    }
+    int64_t delta = GetTimeMillis() - start;
+    allocations = g_allocations - start_allocations;
+    allocated_bytes = g_allocated_bytes - start_allocated_bytes;
+    nodes = state.paths_.size();
+    edges = state.edges_.size();
+    if (best < 0 || delta < best)
+      best = delta;
+    printf("run %d: %dms\n", run + 1, (int)delta);
+  }
+
+  printf("%d nodes, %d edges\n", (int)nodes, (int)edges);
+  printf("parse: %dms (%.1f MB/s)\n", (int)best,
+         bytes / 1048576.0 / (best ? best : 1) * 1000);
+  printf("allocations: %.0f (%.1f MB)\n", (double)allocations,
+         allocated_bytes / 1048576.0);
+  printf("peak RSS: %ld kB\n", GetPeakRSS());
+  return 0;
+}
@@ -0,0 +1,132 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "memstats.h"
+
+#include "build_log.h"
+#include "eval_env.h"
+#include "graph.h"
+#include "metrics.h"
+#include "state.h"
+
+void MemoryStats::AddState(State* state) {
+  for (vector<Node*>::iterator i = state->nodes_.begin();
+       i != state->nodes_.end(); ++i) {
+    Node* node = *i;
+    nodes.Add(sizeof(Node));
+    paths.Add(HeapBytes(node->path()));
+    out_edges.Add(node->out_edges().capacity() * sizeof(Edge*));
+  }
+  node_status.count = (int)state->node_status_.size();
+  node_status.bytes = state->node_status_.size() * sizeof(NodeStatus);
+
+  set<BindingEnv*> seen;
+  AddBindingEnv(&state->bindings_, &seen);
+  for (vector<Edge*>::iterator i = state->edges_.begin();
+       i != state->edges_.end(); ++i) {
+    Edge* edge = *i;
+    edges.Add(sizeof(Edge) + HeapBytes(edge->command_));
+    inputs.Add(edge->inputs_.capacity() * sizeof(Node*));
+    outputs.Add(edge->outputs_.capacity() * sizeof(Node*));
+    // The manifest parser and cache only give edges BindingEnvs, and
+    // there is no RTTI to check.
+    if (edge->env_)
+      AddBindingEnv(static_cast<BindingEnv*>(edge->env_), &seen);
+  }
+
+  for (map<string, const Rule*>::iterator i = state->rules_.begin();
+       i != state->rules_.end(); ++i) {
+    const Rule* rule = i->second;
+    AddEvalString(rule->command());
+    AddEvalString(rule->description());
+    AddEvalString(rule->depfile());
+    AddEvalString(rule->deps());
+    AddEvalString(rule->rspfile());
+    AddEvalString(rule->rspfile_content());
+    AddEvalString(rule->pool());
+    AddEvalString(rule->pool_weight());
+    AddEvalString(rule->remote_inputs());
+  }
+
+  path_slots.count = (int)state->paths_.bucket_count();
+  path_slots.bytes = state->paths_.bucket_count() * sizeof(State::Paths::Slot);
+}
+
+void MemoryStats::AddBuildLog(BuildLog* log) {
+  for (BuildLog::Entries::iterator i = log->entries_.begin();
+       i != log->entries_.end(); ++i) {
+    log_entries.Add(sizeof(BuildLog::LogEntry) +
+                    HeapBytes(i->second->output));
+  }
+  log_entry_slots.count = (int)log->entries_.bucket_count();
+  log_entry_slots.bytes =
+      log->entries_.bucket_count() * sizeof(BuildLog::Entries::Slot);
+  log_file.count = (int)log->record_count_;
+  log_file.bytes = log->file_.size_;
+}
+
+void MemoryStats::Record(Metrics* metrics) const {
+  const struct {
+    const char* name;
+    const Use* use;
+  } uses[] = {
+    { "memory: Node", &nodes },
+    { "memory: NodeStatus", &node_status },
+    { "memory: Edge", &edges },
+    { "memory: Node::path_", &paths },
+    { "memory: Node::out_edges_", &out_edges },
+    { "memory: Edge::inputs_", &inputs },
+    { "memory: Edge::outputs_", &outputs },
+    { "memory: EvalString tokens", &tokens },
+    { "memory: BindingEnv bindings", &bindings },
+    { "memory: State::paths_ slots", &path_slots },
+    { "memory: BuildLog entries", &log_entries },
+    { "memory: BuildLog entry slots", &log_entry_slots },
+    { "memory: BuildLog file", &log_file },
+  };
+  for (size_t i = 0; i < sizeof(uses) / sizeof(uses[0]); ++i) {
+    metrics->RecordCount(metrics->NewCounter(uses[i].name),
+                         uses[i].use->count, uses[i].use->bytes);
+  }
+}
+
+// static
+int64_t MemoryStats::HeapBytes(const string& str) {
+  // Short strings are kept in the string object itself.
+  const char* data = str.data();
+  const char* self = reinterpret_cast<const char*>(&str);
+  if (str.capacity() == 0 || (data >= self && data < self + sizeof(str)))
+    return 0;
+  return str.capacity() + 1;
+}
+
+void MemoryStats::AddEvalString(const EvalString& str) {
+  tokens.bytes += str.parsed_.capacity() * sizeof(EvalString::Token);
+  for (EvalString::TokenList::const_iterator i = str.parsed_.begin();
+       i != str.parsed_.end(); ++i) {
+    tokens.Add(HeapBytes(i->text));
+  }
+}
+
+void MemoryStats::AddBindingEnv(BindingEnv* env, set<BindingEnv*>* seen) {
+  while (env && seen->insert(env).second) {
+    bindings.bytes += sizeof(BindingEnv) +
+        env->bindings_.capacity() * sizeof(BindingEnv::Bindings::value_type);
+    for (BindingEnv::Bindings::iterator i = env->bindings_.begin();
+         i != env->bindings_.end(); ++i) {
+      bindings.Add(HeapBytes(i->second));
+    }
+    env = static_cast<BindingEnv*>(env->parent_);
+  }
+}
@@ -0,0 +1,90 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef NINJA_MEMSTATS_H_
+#define NINJA_MEMSTATS_H_
+
+#include <set>
+#include <string>
+using namespace std;
+
+#include "util.h"  // For int64_t.
+
+struct BindingEnv;
+struct BuildLog;
+struct EvalString;
+struct Metrics;
+struct State;
+
+/// The memory the graph and the build log take, by what it is taken
+/// for, for -d memstats.  Bytes are those of the objects and of what
+/// they allocate, as far as can be seen from outside the allocator:
+/// capacities rather than sizes, and no allocator overhead.
+struct MemoryStats {
+  /// A number of objects and the bytes they take.
+  struct Use {
+    Use() : count(0), bytes(0) {}
+    void Add(int64_t object_bytes) {
+      ++count;
+      bytes += object_bytes;
+    }
+
+    int count;
+    int64_t bytes;
+  };
+
+  /// Account for the graph of \a state: its nodes and edges, the rules'
+  /// EvalStrings and the scopes the edges see.
+  void AddState(State* state);
+  /// Account for the entries of \a log loaded as LogEntry objects.
+  void AddBuildLog(BuildLog* log);
+
+  /// Record each Use as a counter of \a metrics, so that Report() prints
+  /// its count and bytes.
+  void Record(Metrics* metrics) const;
+
+  /// The bytes \a str allocates beyond itself, which are none for a
+  /// string short enough to be kept inside it.
+  static int64_t HeapBytes(const string& str);
+
+  Use nodes;
+  Use node_status;
+  /// Edge::command_, where kept, included.
+  Use edges;
+  /// Node::path_, by node.
+  Use paths;
+  /// By node, and by edge for the two others.
+  Use out_edges;
+  Use inputs;
+  Use outputs;
+  /// The tokens of the rules' EvalStrings, text included.
+  Use tokens;
+  /// The bindings of the scopes edges see, the scopes themselves
+  /// included in the bytes.
+  Use bindings;
+  Use log_entries;
+  /// The log file as loaded, by record of its index.
+  Use log_file;
+  /// The slots of State::paths_ and of BuildLog::entries_, empty ones
+  /// included, which is their overhead beyond what they point to.
+  Use path_slots;
+  Use log_entry_slots;
+
+ private:
+  void AddEvalString(const EvalString& str);
+  /// Account for \a env and its parents, those not in \a seen.
+  void AddBindingEnv(BindingEnv* env, set<BindingEnv*>* seen);
+};
+
+#endif  // NINJA_MEMSTATS_H_
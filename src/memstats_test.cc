@@ -0,0 +1,62 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "memstats.h"
+
+#include "build_log.h"
+#include "graph.h"
+#include "state.h"
+#include "test.h"
+
+struct MemoryStatsTest : public StateTestWithBuiltinRules {};
+
+TEST_F(MemoryStatsTest, HeapBytes) {
+  EXPECT_EQ(0, MemoryStats::HeapBytes(""));
+  string big(1000, 'x');
+  EXPECT_LE(1001, MemoryStats::HeapBytes(big));
+}
+
+TEST_F(MemoryStatsTest, State) {
+  ASSERT_NO_FATAL_FAILURE(AssertParse(&state_,
+"rule cc\n"
+"  command = cc $flags $in -o $out\n"
+"flags = -O2\n"
+"build a.o: cc a.c\n"
+"  flags = -g\n"
+"build b.o: cc b.c | a.o\n"));
+
+  MemoryStats stats;
+  stats.AddState(&state_);
+  EXPECT_EQ(4, stats.nodes.count);
+  EXPECT_EQ(4 * (int64_t)sizeof(Node), stats.nodes.bytes);
+  EXPECT_EQ(4, stats.paths.count);
+  EXPECT_EQ(2, stats.edges.count);
+  EXPECT_EQ(2, stats.inputs.count);
+  EXPECT_LE(3 * (int64_t)sizeof(Node*), stats.inputs.bytes);
+  EXPECT_EQ(2, stats.outputs.count);
+  // The top-level scope's binding and a.o's.
+  EXPECT_EQ(2, stats.bindings.count);
+  // cat's command (4 tokens) and cc's (6).
+  EXPECT_EQ(10, stats.tokens.count);
+  EXPECT_EQ((int)state_.paths_.bucket_count(), stats.path_slots.count);
+  EXPECT_LE(4, stats.path_slots.count);
+}
+
+TEST_F(MemoryStatsTest, BuildLog) {
+  BuildLog log;
+  MemoryStats stats;
+  stats.AddBuildLog(&log);
+  EXPECT_EQ(0, stats.log_entries.count);
+  EXPECT_EQ(0, stats.log_file.bytes);
+}
@@ -19,17 +19,36 @@
 #include <string.h>
 
 #ifndef _WIN32
+#define __STDC_FORMAT_MACROS
+#include <inttypes.h>
+#include <sys/resource.h>
 #include <sys/time.h>
 #else
 #include <windows.h>
 #endif
 
+#include <algorithm>
+
+#include "trace.h"
 #include "util.h"
 
+#ifdef _MSC_VER
+#define THREAD_LOCAL __declspec(thread)
+#else
+#define THREAD_LOCAL __thread
+#endif
+
 Metrics* g_metrics = NULL;
 
+int Metrics::next_serial_ = 0;
+
 namespace {
 
+/// The values the calling thread recorded, and the serial of the Metrics
+/// they belong to.
+THREAD_LOCAL vector<MetricValues>* t_values = NULL;
+THREAD_LOCAL int t_values_serial = -1;
+
 #ifndef _WIN32
 /// Compute a platform-specific high-res timer value that fits into an int64.
 int64_t HighResTimer() {
@@ -82,20 +101,119 @@ ScopedMetric::ScopedMetric(Metric* metric) {
 ScopedMetric::~ScopedMetric() {
   if (!metric_)
     return;
-  metric_->count++;
   int64_t dt = TimerToMicros(HighResTimer() - start_);
-  metric_->sum += dt;
+  if (g_metrics && metric_->id >= 0)
+    g_metrics->Record(metric_, dt);
+  if (g_tracer)
+    g_tracer->Span(metric_->name, TimerToMicros(start_), dt);
+}
+
+void MetricValues::Add(int64_t value, bool timer) {
+  ++count;
+  sum += value;
+  max_value = max(max_value, value);
+  if (timer) {
+    int bucket = Bucket(value);
+    if (bucket >= (int)histogram.size())
+      histogram.resize(bucket + 1);
+    ++histogram[bucket];
+  }
+}
+
+void MetricValues::Merge(const MetricValues& other) {
+  count += other.count;
+  sum += other.sum;
+  max_value = max(max_value, other.max_value);
+  if (other.histogram.size() > histogram.size())
+    histogram.resize(other.histogram.size());
+  for (size_t i = 0; i < other.histogram.size(); ++i)
+    histogram[i] += other.histogram[i];
+}
+
+int64_t MetricValues::Percentile(double fraction) const {
+  // The rank of the value wanted, counting from 1.
+  int64_t rank = (int64_t)(fraction * count + 0.999999);
+  int64_t seen = 0;
+  for (size_t i = 0; i < histogram.size(); ++i) {
+    seen += histogram[i];
+    if (seen >= rank && seen > 0)
+      return min(BucketTop((int)i), max_value);
+  }
+  return max_value;
+}
+
+// static
+int MetricValues::Bucket(int64_t value) {
+  if (value < 4)
+    return value < 0 ? 0 : (int)value;
+  // Four buckets between each power of two and the next, told apart by
+  // the two bits below the top one.
+  int top = 2;
+  while (value >> (top + 1))
+    ++top;
+  return 4 * (top - 1) + (int)((value >> (top - 2)) & 3);
+}
+
+// static
+int64_t MetricValues::BucketTop(int bucket) {
+  if (bucket < 4)
+    return bucket;
+  int top = bucket / 4 + 1;
+  int64_t width = (int64_t)1 << (top - 2);
+  return (4 + bucket % 4) * width + width - 1;
 }
 
 Metric* Metrics::NewMetric(const string& name) {
+  return Add(name, true);
+}
+
+Metric* Metrics::NewCounter(const string& name) {
+  return Add(name, false);
+}
+
+Metric* Metrics::Add(const string& name, bool timer) {
+  ScopedLock lock(&mutex_);
   Metric* metric = new Metric;
   metric->name = name;
-  metric->count = 0;
-  metric->sum = 0;
+  metric->timer = timer;
+  metric->id = (int)metrics_.size();
   metrics_.push_back(metric);
   return metric;
 }
 
+void Metrics::Record(Metric* metric, int64_t value) {
+  ThreadValues(metric)->Add(value, metric->timer);
+}
+
+void Metrics::RecordCount(Metric* metric, int count, int64_t sum) {
+  MetricValues* values = ThreadValues(metric);
+  values->count += count;
+  values->sum += sum;
+}
+
+MetricValues* Metrics::ThreadValues(Metric* metric) {
+  if (t_values_serial != serial_) {
+    ScopedLock lock(&mutex_);
+    t_values = new vector<MetricValues>;
+    t_values_serial = serial_;
+    threads_.push_back(t_values);
+  }
+  if (metric->id >= (int)t_values->size())
+    t_values->resize(metric->id + 1);
+  return &(*t_values)[metric->id];
+}
+
+MetricValues Metrics::Merged(const Metric* metric) {
+  ScopedLock lock(&mutex_);
+  MetricValues merged;
+  for (vector<vector<MetricValues>*>::iterator i = threads_.begin();
+       i != threads_.end(); ++i) {
+    if (metric->id < (int)(*i)->size())
+      merged.Merge((**i)[metric->id]);
+  }
+  return merged;
+}
+
 void Metrics::Report() {
   int width = 0;
   for (vector<Metric*>::iterator i = metrics_.begin();
@@ -103,16 +221,72 @@ void Metrics::Report() {
     width = max((int)(*i)->name.size(), width);
   }
 
-  printf("%-*s\t%-6s\t%-9s\t%s\n", width,
-         "metric", "count", "avg (us)", "total (ms)");
+  printf("%-*s\t%-6s\t%-9s\t%-8s\t%-8s\t%-8s\t%-8s\t%s\n", width,
+         "metric", "count", "avg (us)", "p50 (us)", "p90 (us)", "p99 (us)",
+         "max (us)", "total (ms)");
+  for (vector<Metric*>::iterator i = metrics_.begin();
+       i != metrics_.end(); ++i) {
+    if (!(*i)->timer)
+      continue;
+    MetricValues values = Merged(*i);
+    double total = values.sum / (double)1000;
+    double avg = values.sum / (double)values.count;
+    printf("%-*s\t%-6d\t%-8.1f\t%-8" PRId64 "\t%-8" PRId64 "\t%-8" PRId64
+           "\t%-8" PRId64 "\t%.1f\n", width, (*i)->name.c_str(),
+           values.count, avg, values.Percentile(0.5), values.Percentile(0.9),
+           values.Percentile(0.99), values.max_value, total);
+  }
+
+  printf("\n%-*s\t%-6s\t%s\n", width, "counter", "count", "total");
+  for (vector<Metric*>::iterator i = metrics_.begin();
+       i != metrics_.end(); ++i) {
+    if ((*i)->timer)
+      continue;
+    MetricValues values = Merged(*i);
+    printf("%-*s\t%-6d\t%" PRId64 "\n", width, (*i)->name.c_str(),
+           values.count, values.sum);
+  }
+}
+
+bool Metrics::WriteJSON(const string& path, string* err) {
+  FILE* f = fopen(path.c_str(), "w");
+  if (!f) {
+    *err = strerror(errno);
+    return false;
+  }
+  fprintf(f, "{\"metrics\":[");
+  bool first = true;
+  for (vector<Metric*>::iterator i = metrics_.begin();
+       i != metrics_.end(); ++i) {
+    if (!(*i)->timer)
+      continue;
+    MetricValues values = Merged(*i);
+    fprintf(f, "%s\n{\"name\":%s,\"count\":%d,\"total_us\":%" PRId64
+            ",\"p50_us\":%" PRId64 ",\"p90_us\":%" PRId64 ",\"p99_us\":%"
+            PRId64 ",\"max_us\":%" PRId64 "}", first ? "" : ",",
+            JSONString((*i)->name).c_str(), values.count, values.sum,
+            values.Percentile(0.5), values.Percentile(0.9),
+            values.Percentile(0.99), values.max_value);
+    first = false;
+  }
+  fprintf(f, "],\n\"counters\":[");
+  first = true;
   for (vector<Metric*>::iterator i = metrics_.begin();
        i != metrics_.end(); ++i) {
-    Metric* metric = *i;
-    double total = metric->sum / (double)1000;
-    double avg = metric->sum / (double)metric->count;
-    printf("%-*s\t%-6d\t%-8.1f\t%.1f\n", width, metric->name.c_str(),
-           metric->count, avg, total);
+    if ((*i)->timer)
+      continue;
+    MetricValues values = Merged(*i);
+    fprintf(f, "%s\n{\"name\":%s,\"count\":%d,\"total\":%" PRId64 "}",
+            first ? "" : ",", JSONString((*i)->name).c_str(), values.count,
+            values.sum);
+    first = false;
   }
+  fprintf(f, "]}\n");
+  if (fclose(f) != 0) {
+    *err = strerror(errno);
+    return false;
+  }
+  return true;
 }
 
 uint64_t Stopwatch::Now() const {
@@ -120,6 +294,42 @@ uint64_t Stopwatch::Now() const {
 }
 
 int64_t GetTimeMillis() {
-  return TimerToMicros(HighResTimer()) / 1000;
+  return GetTimeMicros() / 1000;
+}
+
+int64_t GetTimeMicros() {
+  return TimerToMicros(HighResTimer());
+}
+
+Metric* NewMetricIfEnabled(const char* name) {
+  if (g_metrics)
+    return g_metrics->NewMetric(name);
+  if (!g_tracer)
+    return NULL;
+  // Only for the trace.
+  Metric* metric = new Metric;
+  metric->name = name;
+  metric->timer = true;
+  metric->id = -1;
+  return metric;
+}
+
+Metric* NewCounterIfEnabled(const char* name) {
+  return g_metrics ? g_metrics->NewCounter(name) : NULL;
+}
+
+long GetPeakRSS() {
+#ifdef _WIN32
+  return 0;
+#else
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) < 0)
+    return 0;
+#ifdef __APPLE__
+  return usage.ru_maxrss / 1024;
+#else
+  return usage.ru_maxrss;
+#endif
+#endif
 }
 
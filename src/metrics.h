@@ -19,18 +19,49 @@
 #include <vector>
 using namespace std;
 
+#include "thread_pool.h"
 #include "util.h"  // For int64_t.
 
 /// The Metrics module is used for the debug mode that dumps timing stats of
-/// various actions.  To use, see METRIC_RECORD below.
+/// various actions, and for the spans of -d trace (see trace.h).  To use,
+/// see METRIC_RECORD and METRIC_COUNT below.
 
-/// A single metrics we're tracking, like "depfile load time".
+/// A single metrics we're tracking, like "depfile load time", or a
+/// count of things, like "bytes read".
 struct Metric {
   string name;
+  /// Whether what is recorded is times, in micros, rather than counts.
+  bool timer;
+  /// The index of its values in each thread's, or -1 if only traced.
+  int id;
+};
+
+/// What has been recorded in a Metric, by one thread or by all.
+struct MetricValues {
+  MetricValues() : count(0), sum(0), max_value(0) {}
+
+  /// Record \a value.  A \a timer also keeps a histogram of the values.
+  void Add(int64_t value, bool timer);
+  void Merge(const MetricValues& other);
+
+  /// The value that \a fraction of the values recorded are at most, or
+  /// rather the top of its histogram bucket, which is within a fifth.
+  int64_t Percentile(double fraction) const;
+
+  /// The histogram bucket of \a value: there are four for each power of
+  /// two, so that long tails stand out without many buckets.
+  static int Bucket(int64_t value);
+  /// The largest value in \a bucket.
+  static int64_t BucketTop(int bucket);
+
   /// Number of times we've hit the code path.
   int count;
-  /// Total time (in micros) we've spent on the code path.
+  /// Total time (in micros) we've spent on the code path, or the total
+  /// counted.
   int64_t sum;
+  int64_t max_value;
+  /// Number of values in each bucket.
+  vector<int> histogram;
 };
 
 
@@ -47,21 +78,67 @@ private:
   int64_t start_;
 };
 
-/// The singleton that stores metrics and prints the report.
+/// The singleton that stores metrics and prints the report.  Each thread
+/// records into values of its own, which are only merged for the report,
+/// so that threads scanning side by side don't contend for them.
 struct Metrics {
+  Metrics() : serial_(next_serial_++) {}
+
   Metric* NewMetric(const string& name);
+  Metric* NewCounter(const string& name);
+
+  /// Add \a value to \a metric for the calling thread.
+  void Record(Metric* metric, int64_t value);
+  /// Add \a count values adding up to \a sum to the counter \a metric
+  /// at once.
+  void RecordCount(Metric* metric, int count, int64_t sum);
+
+  /// What all threads recorded in \a metric.  Not to be called while
+  /// other threads record.
+  MetricValues Merged(const Metric* metric);
 
   /// Print a summary report to stdout.
   void Report();
 
+  /// Write what Report() prints to \a path, as JSON.  Returns false,
+  /// filling in \a err, on error.
+  bool WriteJSON(const string& path, string* err);
+
 private:
+  Metric* Add(const string& name, bool timer);
+  /// The calling thread's values of \a metric.
+  MetricValues* ThreadValues(Metric* metric);
+
+  /// Guards metrics_ and threads_.
+  Mutex mutex_;
   vector<Metric*> metrics_;
+  /// The values each thread recorded, by Metric::id.
+  vector<vector<MetricValues>*> threads_;
+  /// Tells this Metrics apart from those before it, for the calling
+  /// thread to find its values in.
+  int serial_;
+  static int next_serial_;
 };
 
 /// Get the current time as relative to some epoch.
 /// Epoch varies between platforms; only useful for measuring elapsed time.
 int64_t GetTimeMillis();
 
+/// GetTimeMillis(), in microseconds.
+int64_t GetTimeMicros();
+
+/// The Metric for METRIC_RECORD(\a name) to record in, or NULL if neither
+/// -d stats nor -d trace is on.
+Metric* NewMetricIfEnabled(const char* name);
+
+/// The Metric for METRIC_COUNT(\a name) to count in, or NULL if -d stats
+/// is off.
+Metric* NewCounterIfEnabled(const char* name);
+
+/// Get the peak resident set size of the process in kB, or 0 if unknown.
+/// For benchmarks.
+long GetPeakRSS();
+
 
 /// A simple stopwatch which returns the time
 /// in seconds since Restart() was called.
@@ -84,10 +161,18 @@ private:
 /// The primary interface to metrics.  Use METRIC_RECORD("foobar") at the top
 /// of a function to get timing stats recorded for each call of the function.
 #define METRIC_RECORD(name)                                             \
-  static Metric* metrics_h_metric =                                     \
-      g_metrics ? g_metrics->NewMetric(name) : NULL;                    \
+  static Metric* metrics_h_metric = NewMetricIfEnabled(name);           \
   ScopedMetric metrics_h_scoped(metrics_h_metric);
 
+/// Use METRIC_COUNT("bytes read", n) to add up how many of something
+/// there were, for -d stats.
+#define METRIC_COUNT(name, n)                                           \
+  do {                                                                  \
+    static Metric* metrics_h_counter = NewCounterIfEnabled(name);       \
+    if (metrics_h_counter)                                              \
+      g_metrics->Record(metrics_h_counter, n);                          \
+  } while (0)
+
 extern Metrics* g_metrics;
 
 #endif // NINJA_METRICS_H_
@@ -0,0 +1,115 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "metrics.h"
+
+#include "test.h"
+
+TEST(MetricValuesTest, Buckets) {
+  // Every value is at most the top of its bucket, and more than the top
+  // of the one before.
+  for (int64_t value = 0; value < 5000; ++value) {
+    int bucket = MetricValues::Bucket(value);
+    EXPECT_LE(value, MetricValues::BucketTop(bucket));
+    if (bucket > 0) {
+      EXPECT_GT(value, MetricValues::BucketTop(bucket - 1));
+    }
+  }
+  EXPECT_EQ(7, MetricValues::Bucket(7));
+  EXPECT_EQ(8, MetricValues::Bucket(8));
+  EXPECT_EQ(8, MetricValues::Bucket(9));
+  EXPECT_EQ(11, MetricValues::BucketTop(MetricValues::Bucket(10)));
+  int64_t big = (int64_t)1 << 62;
+  EXPECT_LE(big, MetricValues::BucketTop(MetricValues::Bucket(big)));
+}
+
+TEST(MetricValuesTest, Percentiles) {
+  MetricValues values;
+  for (int i = 0; i < 98; ++i)
+    values.Add(10, true);
+  values.Add(1000, true);
+  values.Add(100000, true);
+  EXPECT_EQ(100, values.count);
+  EXPECT_EQ(98 * 10 + 1000 + 100000, values.sum);
+  EXPECT_EQ(100000, values.max_value);
+  EXPECT_EQ(11, values.Percentile(0.5));
+  EXPECT_EQ(11, values.Percentile(0.9));
+  // Within a fifth of 1000.
+  EXPECT_LE(1000, values.Percentile(0.99));
+  EXPECT_GE(1200, values.Percentile(0.99));
+  EXPECT_EQ(100000, values.Percentile(1.0));
+
+  MetricValues counter;
+  counter.Add(5, false);
+  counter.Add(7, false);
+  EXPECT_EQ(2, counter.count);
+  EXPECT_EQ(12, counter.sum);
+  EXPECT_TRUE(counter.histogram.empty());
+}
+
+namespace {
+
+struct RecordTask : public ThreadPool::Task {
+  RecordTask(Metrics* metrics, Metric* metric)
+      : metrics_(metrics), metric_(metric) {}
+
+  virtual void Run() {
+    for (int i = 1; i <= 1000; ++i)
+      metrics_->Record(metric_, i);
+  }
+
+  Metrics* metrics_;
+  Metric* metric_;
+};
+
+}  // anonymous namespace
+
+TEST(MetricsTest, MergesThreads) {
+  Metrics metrics;
+  Metric* timer = metrics.NewMetric("timer");
+  Metric* counter = metrics.NewCounter("counter");
+  metrics.Record(counter, 3);
+
+  ThreadPool pool(4);
+  vector<RecordTask*> tasks;
+  for (int i = 0; i < 8; ++i) {
+    tasks.push_back(new RecordTask(&metrics, timer));
+    pool.Post(tasks.back());
+  }
+  for (int i = 0; i < 8; ++i) {
+    pool.Wait(tasks[i]);
+    delete tasks[i];
+  }
+
+  MetricValues values = metrics.Merged(timer);
+  EXPECT_EQ(8000, values.count);
+  EXPECT_EQ(8 * 500500, values.sum);
+  EXPECT_EQ(1000, values.max_value);
+  EXPECT_LE(500, values.Percentile(0.5));
+  EXPECT_GE(600, values.Percentile(0.5));
+
+  values = metrics.Merged(counter);
+  EXPECT_EQ(1, values.count);
+  EXPECT_EQ(3, values.sum);
+}
+
+TEST(MetricsTest, RecordCount) {
+  Metrics metrics;
+  Metric* counter = metrics.NewCounter("things");
+  metrics.Record(counter, 5);
+  metrics.RecordCount(counter, 3, 42);
+  MetricValues values = metrics.Merged(counter);
+  EXPECT_EQ(4, values.count);
+  EXPECT_EQ(47, values.sum);
+}
@@ -14,54 +14,11 @@
 
 #include "msvc_helper.h"
 
-#include <string.h>
 #include <windows.h>
 
-#include "includes_normalize.h"
+#include "clparser.h"
 #include "util.h"
 
-namespace {
-
-/// Return true if \a input ends with \a needle.
-bool EndsWith(const string& input, const string& needle) {
-  return (input.size() >= needle.size() &&
-          input.substr(input.size() - needle.size()) == needle);
-}
-
-}  // anonymous namespace
-
-// static
-string CLWrapper::FilterShowIncludes(const string& line) {
-  static const char kMagicPrefix[] = "Note: including file: ";
-  const char* in = line.c_str();
-  const char* end = in + line.size();
-
-  if (end - in > (int)sizeof(kMagicPrefix) - 1 &&
-      memcmp(in, kMagicPrefix, sizeof(kMagicPrefix) - 1) == 0) {
-    in += sizeof(kMagicPrefix) - 1;
-    while (*in == ' ')
-      ++in;
-    return line.substr(in - line.c_str());
-  }
-  return "";
-}
-
-// static
-bool CLWrapper::IsSystemInclude(const string& path) {
-  // TODO: this is a heuristic, perhaps there's a better way?
-  return (path.find("program files") != string::npos ||
-          path.find("microsoft visual studio") != string::npos);
-}
-
-// static
-bool CLWrapper::FilterInputFilename(const string& line) {
-  // TODO: other extensions, like .asm?
-  return EndsWith(line, ".c") ||
-      EndsWith(line, ".cc") ||
-      EndsWith(line, ".cxx") ||
-      EndsWith(line, ".cpp");
-}
-
 int CLWrapper::Run(const string& command, string* extra_output) {
   SECURITY_ATTRIBUTES security_attributes = {};
   security_attributes.nLength = sizeof(SECURITY_ATTRIBUTES);
@@ -102,7 +59,7 @@ int CLWrapper::Run(const string& command, string* extra_output) {
     Win32Fatal("CloseHandle");
   }
 
-  // Read output of the subprocess and parse it.
+  // Read output of the subprocess, to parse once it's all there.
   string output;
   DWORD read_len = 1;
   while (read_len) {
@@ -113,40 +70,17 @@ int CLWrapper::Run(const string& command, string* extra_output) {
       Win32Fatal("ReadFile");
     }
     output.append(buf, read_len);
-
-    // Loop over all lines in the output and process them.
-    for (;;) {
-      size_t ofs = output.find_first_of("\r\n");
-      if (ofs == string::npos)
-        break;
-      string line = output.substr(0, ofs);
-
-      string include = FilterShowIncludes(line);
-      if (!include.empty()) {
-        include = IncludesNormalize::Normalize(include, NULL);
-        if (!IsSystemInclude(include))
-          includes_.push_back(include);
-      } else if (FilterInputFilename(line)) {
-        // Drop it.
-        // TODO: if we support compiling multiple output files in a single
-        // cl.exe invocation, we should stash the filename.
-      } else {
-        if (extra_output) {
-          extra_output->append(line);
-          extra_output->append("\n");
-        } else {
-          printf("%s\n", line.c_str());
-        }
-      }
-
-      if (ofs < output.size() && output[ofs] == '\r')
-        ++ofs;
-      if (ofs < output.size() && output[ofs] == '\n')
-        ++ofs;
-      output = output.substr(ofs);
-    }
   }
 
+  CLParser parser;
+  string filtered;
+  parser.Parse(output, &filtered);
+  includes_.swap(parser.includes_);
+  if (extra_output)
+    extra_output->append(filtered);
+  else
+    printf("%s", filtered.c_str());
+
   if (WaitForSingleObject(process_info.hProcess, INFINITE) == WAIT_FAILED)
     Win32Fatal("WaitForSingleObject");
 
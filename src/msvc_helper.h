@@ -12,14 +12,16 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+#include <set>
 #include <string>
-#include <vector>
 using namespace std;
 
 /// Visual Studio's cl.exe requires some massaging to work with Ninja;
 /// for example, it emits include information on stderr in a funny
 /// format when building with /showIncludes.  This class wraps a CL
-/// process and parses that output to extract the file list.
+/// process and parses that output, with CLParser, to extract the file
+/// list.  Rules with "deps = msvc" don't need it: Ninja parses their
+/// output itself.
 struct CLWrapper {
   CLWrapper() : env_block_(NULL) {}
 
@@ -33,22 +35,6 @@ struct CLWrapper {
   /// Crashes (calls Fatal()) on error.
   int Run(const string& command, string* extra_output=NULL);
 
-  /// Parse a line of cl.exe output and extract /showIncludes info.
-  /// If a dependency is extracted, returns a nonempty string.
-  /// Exposed for testing.
-  static string FilterShowIncludes(const string& line);
-
-  /// Return true if a mentioned include file is a system path.
-  /// Expects the path to already by normalized (including lower case).
-  /// Filtering these out reduces dependency information considerably.
-  static bool IsSystemInclude(const string& path);
-
-  /// Parse a line of cl.exe output and return true if it looks like
-  /// it's printing an input filename.  This is a heuristic but it appears
-  /// to be the best we can do.
-  /// Exposed for testing.
-  static bool FilterInputFilename(const string& line);
-
   void* env_block_;
-  vector<string> includes_;
+  set<string> includes_;
 };
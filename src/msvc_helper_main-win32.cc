@@ -105,7 +105,7 @@ int MSVCHelperMain(int argc, char** argv) {
     Fatal("opening %s: %s", depfile.c_str(), GetLastErrorString().c_str());
   }
   fprintf(output, "%s: ", output_filename);
-  for (vector<string>::iterator i = cl.includes_.begin();
+  for (set<string>::iterator i = cl.includes_.begin();
        i != cl.includes_.end(); ++i) {
     fprintf(output, "%s\n", i->c_str());
   }
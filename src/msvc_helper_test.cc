@@ -19,28 +19,6 @@
 #include "test.h"
 #include "util.h"
 
-TEST(MSVCHelperTest, ShowIncludes) {
-  ASSERT_EQ("", CLWrapper::FilterShowIncludes(""));
-
-  ASSERT_EQ("", CLWrapper::FilterShowIncludes("Sample compiler output"));
-  ASSERT_EQ("c:\\Some Files\\foobar.h",
-            CLWrapper::FilterShowIncludes("Note: including file: "
-                                          "c:\\Some Files\\foobar.h"));
-  ASSERT_EQ("c:\\initspaces.h",
-            CLWrapper::FilterShowIncludes("Note: including file:    "
-                                          "c:\\initspaces.h"));
-}
-
-TEST(MSVCHelperTest, FilterInputFilename) {
-  ASSERT_TRUE(CLWrapper::FilterInputFilename("foobar.cc"));
-  ASSERT_TRUE(CLWrapper::FilterInputFilename("foo bar.cc"));
-  ASSERT_TRUE(CLWrapper::FilterInputFilename("baz.c"));
-
-  ASSERT_FALSE(CLWrapper::FilterInputFilename(
-                   "src\\cl_helper.cc(166) : fatal error C1075: end "
-                   "of file found ..."));
-}
-
 TEST(MSVCHelperTest, Run) {
   CLWrapper cl;
   string output;
@@ -48,7 +26,7 @@ TEST(MSVCHelperTest, Run) {
          &output);
   ASSERT_EQ("foo\nbar\n", output);
   ASSERT_EQ(1u, cl.includes_.size());
-  ASSERT_EQ("foo.h", cl.includes_[0]);
+  ASSERT_EQ("foo.h", *cl.includes_.begin());
 }
 
 TEST(MSVCHelperTest, RunFilenameFilter) {
@@ -70,7 +48,7 @@ TEST(MSVCHelperTest, RunSystemInclude) {
   // system headers.
   ASSERT_EQ("", output);
   ASSERT_EQ(1u, cl.includes_.size());
-  ASSERT_EQ("path.h", cl.includes_[0]);
+  ASSERT_EQ("path.h", *cl.includes_.begin());
 }
 
 TEST(MSVCHelperTest, EnvBlock) {
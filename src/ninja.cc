@@ -15,6 +15,7 @@
 #include <errno.h>
 #include <limits.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -25,21 +26,44 @@
 #include <windows.h>
 #else
 #include <getopt.h>
+#define __STDC_FORMAT_MACROS
+#include <inttypes.h>
+#include <sys/wait.h>
 #include <unistd.h>
 #endif
 
+#include <algorithm>
+#include <map>
+#include <memory>
+
 #include "browse.h"
 #include "build.h"
 #include "build_log.h"
+#include "build_estimate.h"
+#include "critical_path.h"
+#include "deps_log.h"
 #include "clean.h"
 #include "disk_interface.h"
 #include "edit_distance.h"
+#include "event_stream.h"
 #include "explain.h"
+#include "file_watcher.h"
 #include "graph.h"
 #include "graphviz.h"
+#include "jobserver.h"
+#include "manifest_cache.h"
 #include "manifest_parser.h"
+#include "memstats.h"
 #include "metrics.h"
+#ifndef _WIN32
+#include "action_cache.h"
+#include "http_cache.h"
+#include "remote.h"
+#include "server.h"
+#endif
 #include "state.h"
+#include "subninja_index.h"
+#include "trace.h"
 #include "util.h"
 
 // Defined in msvc_helper_main-win32.cc.
@@ -51,25 +75,71 @@ namespace {
 /// be "git" on trunk.
 const char* kVersion = "git";
 
+/// Where the compiled form of the manifest is kept, relative to the
+/// working directory.
+const char* kManifestCachePath = ".ninja_manifest_cache";
+
+/// Where "ninja -t server" listens, relative to the working directory.
+const char* kServerSocketPath = ".ninja_server";
+
+/// Whether to load and save the manifest cache; see -d nomanifestcache.
+bool g_use_manifest_cache = true;
+
+/// Whether to cache stats by directory while scanning; see -d nostatcache.
+bool g_use_stat_cache = true;
+
+/// Whether to batch stats and reads through io_uring; see -d uring.
+bool g_use_io_uring = false;
+
+/// Whether "ninja -t server" watches files to avoid stat'ing them again;
+/// see -d nowatch.
+bool g_use_file_watcher = true;
+
+/// Where to write -d stats as JSON too, if anywhere; see -d stats=PATH.
+string g_metrics_json_path;
+
+/// Whether -d stats also accounts for memory; see -d memstats.
+bool g_memstats = false;
+
 /// Global information passed into subtools.
 struct Globals {
-  Globals() : state(new State()) {}
+  Globals()
+      : input_file("build.ninja"), state(new State()), state_cached(false),
+        lazy_subninjas(false), subninjas(NULL) {}
   ~Globals() {
+    delete subninjas;
     delete state;
   }
 
   /// Deletes and recreates state so it is empty.
   void ResetState() {
+    delete subninjas;
+    subninjas = NULL;
     delete state;
     state = new State();
+    state_cached = false;
+    manifest_files.clear();
   }
 
   /// Command line used to run Ninja.
   const char* ninja_command;
   /// Build configuration set from flags (e.g. parallelism).
   BuildConfig* config;
+  /// Build file to load, from -f.
+  const char* input_file;
   /// Loaded state (rules, nodes). This is a pointer so it can be reset.
   State* state;
+  /// The files state was loaded from, with their mtimes at the time, if
+  /// known (i.e. the manifest cache was in use).
+  vector<ManifestCache::File> manifest_files;
+  /// Whether state is all of what the manifest cache holds, so that a
+  /// reload can copy what didn't change from it.
+  bool state_cached;
+  /// Whether to put off loading the subninjas the targets don't need;
+  /// see --lazy.
+  bool lazy_subninjas;
+  /// The subninjas put off, if any, which state is missing.
+  SubninjaIndex* subninjas;
 };
 
 /// The type of functions that are the entry points to tools (subcommands).
@@ -105,6 +175,30 @@ void Usage(const BuildConfig& config) {
 "\n"
 "options:\n"
 "  --version  print ninja version (\"%s\")\n"
+"  --jobserver  share the jobs with make and ninja run by the commands,\n"
+"               through a GNU make jobserver\n"
+"  --content-digests  don't rebuild for inputs whose mtimes changed but\n"
+"               whose contents didn't\n"
+"  --events=FD|FILE  write what the build does as JSON lines, to the file\n"
+"               descriptor FD or to FILE\n"
+"  --lazy  given targets, only load the subninjas needed to build them,\n"
+"               going by those the manifest cache saw last\n"
+"  --estimate  don't run commands, but tell how long they would take at\n"
+"               -j N, going by the build log, and what would hold them up\n"
+"  --speculate  with jobs to spare, run commands waiting on restat rules\n"
+"               early, and again if those change their inputs after all\n"
+#ifndef _WIN32
+"  --remote=HOST:PORT,...  also run the commands of rules marked 'remote'\n"
+"               on these workers (see -t worker)\n"
+"  --action-cache=DIR  copy the outputs of commands run before on the same\n"
+"               inputs from DIR, rather than running them, and keep the\n"
+"               outputs of those run there\n"
+"  --action-cache-size=N  keep DIR within N MB [default=10240]\n"
+"  --action-cache-remote=URL  also look for outputs in, and upload them to,\n"
+"               the HTTP cache at URL (see -t cache-server)\n"
+"  --numa  spread the commands over the NUMA nodes, each bound to one\n"
+"               node's CPUs (Linux)\n"
+#endif
 "\n"
 "  -C DIR   change to DIR before doing anything else\n"
 "  -f FILE  specify input build file [default=build.ninja]\n"
@@ -114,6 +208,13 @@ void Usage(const BuildConfig& config) {
 #ifdef _WIN32
 "           (not yet implemented on Windows)\n"
 #endif
+"  -l auto  run fewer jobs, down to one, while tasks wait for CPUs or I/O\n"
+#ifndef linux
+"           (only implemented on Linux)\n"
+#endif
+"  -m N     do not start new jobs if those running are expected to use more\n"
+"           than N MB of memory, going by the build log; 0 for no limit\n"
+"           [default=memory available at the start]\n"
 "  -k N     keep going until N jobs fail [default=1]\n"
 "  -n       dry run (don't run commands but act like they succeeded)\n"
 "  -v       show all command lines while building\n"
@@ -143,8 +244,156 @@ struct RealFileReader : public ManifestParser::FileReader {
   bool ReadFile(const string& path, string* content, string* err) {
     return ::ReadFile(path, content, err) == 0;
   }
+  bool MapFile(const string& path, MappedFile* file, string* err) {
+    return file->Open(path, err) == 0;
+  }
 };
 
+/// Load \a input_file into \a globals->state, from the manifest cache if
+/// it is up to date and by parsing (then refreshing the cache) otherwise.
+/// After a rebuild of the manifest, \a old_state is the state it was
+/// rebuilt with, if that is what the cache holds: the subninjas that
+/// didn't change are copied from it rather than parsed again.
+bool LoadManifest(Globals* globals, const char* input_file,
+                  DiskInterface* disk_interface, string* err,
+                  State* old_state = NULL) {
+  RealFileReader file_reader;
+  if (!g_use_manifest_cache) {
+    ManifestParser parser(globals->state, &file_reader);
+#ifndef _WIN32
+    parser.set_parallelism(GetProcessorCount());
+#endif
+    return parser.Load(input_file, err);
+  }
+
+  ManifestCache cache(disk_interface);
+  if (cache.Load(kManifestCachePath, input_file, globals->state, err)) {
+    globals->manifest_files = cache.files();
+    globals->state_cached = true;
+    return true;
+  }
+  if (!err->empty()) {
+    Warning("%s; reparsing manifest", err->c_str());
+    err->clear();
+    globals->ResetState();
+  }
+
+  auto_ptr<SubninjaIndex> index(new SubninjaIndex);
+  if (globals->lazy_subninjas || old_state)
+    cache.LoadIndex(kManifestCachePath, input_file, index.get());
+  ManifestCacheFileReader cache_reader(&file_reader, &cache);
+  ManifestParser parser(globals->state, &cache_reader);
+#ifndef _WIN32
+  parser.set_parallelism(GetProcessorCount());
+#endif
+  parser.set_subninja_index(index.get());
+  if (!parser.Load(input_file, err))
+    return false;
+  if (old_state && index->deferred()) {
+    if (!index->CopyAll(old_state, globals->state, &cache_reader, err))
+      return false;
+    const vector<SubninjaIndex::Subninja>& subninjas = index->subninjas();
+    for (vector<SubninjaIndex::Subninja>::const_iterator i =
+             subninjas.begin();
+         i != subninjas.end(); ++i) {
+      if (!i->copied)
+        continue;
+      for (vector<string>::const_iterator f = i->files.begin();
+           f != i->files.end(); ++f) {
+        cache.RecordUnread(*f);
+      }
+    }
+  }
+  if (index->deferred()) {
+    // Not all of the manifest is loaded, so none of it can be cached.
+    globals->subninjas = index.release();
+    return true;
+  }
+  string cache_err;
+  if (cache.Save(kManifestCachePath, input_file, globals->state,
+                 &cache_err, index.get())) {
+    globals->state_cached = true;
+  } else {
+    Warning("writing manifest cache: %s", cache_err.c_str());
+  }
+  globals->manifest_files = cache.files();
+  return true;
+}
+
+/// With --lazy, load the subninjas put off that the manifest and the
+/// targets in \a argv need: all of them if a target isn't a path, to
+/// build with or to report as unknown.
+bool LoadSubninjas(Globals* globals, DepsLog* deps_log, int argc,
+                   char** argv) {
+  RealFileReader file_reader;
+  SubninjaIndex* index = globals->subninjas;
+  vector<string> paths(1, globals->input_file);
+  bool all = false;
+  for (int i = 0; i < argc && !all; ++i) {
+    string path = argv[i];
+    string err;
+    if (path.empty() || path[path.size() - 1] == '^' ||
+        !CanonicalizePath(&path, &err)) {
+      all = true;
+    }
+    paths.push_back(path);
+  }
+  string err;
+  if (!all &&
+      !index->LoadFor(globals->state, &file_reader, deps_log, paths, &err)) {
+    Error("%s", err.c_str());
+    return false;
+  }
+  // The manifest needn't be in the graph.
+  for (size_t i = 1; i < paths.size() && !all; ++i)
+    all = !globals->state->LookupNode(paths[i]);
+  if (all && !index->LoadAll(globals->state, &file_reader, &err)) {
+    Error("%s", err.c_str());
+    return false;
+  }
+  return true;
+}
+
+/// After a rebuild of the manifest, let the next load come from the
+/// manifest cache if the generator left every file as it was.
+void RefreshManifestCache(const char* input_file,
+                          DiskInterface* disk_interface) {
+  ManifestCache cache(disk_interface);
+  string err;
+  if (!cache.Refresh(kManifestCachePath, input_file, &err) && !err.empty())
+    Warning("writing manifest cache: %s", err.c_str());
+}
+
+/// Give the nodes of \a state the mtimes \a old_state found for the same
+/// files, unless its build may have changed them since.  \a manifest_files
+/// are the files \a state was loaded from, as they were then.
+void CarryOverStats(State* old_state, State* state,
+                    const vector<ManifestCache::File>& manifest_files) {
+  METRIC_RECORD("carry over stats");
+  // A generator often rewrites more manifest files than it declares as
+  // outputs; those were stat()ed again while loading.
+  map<string, TimeStamp> loaded;
+  for (vector<ManifestCache::File>::const_iterator i =
+           manifest_files.begin();
+       i != manifest_files.end(); ++i) {
+    loaded[i->path] = i->mtime;
+  }
+  for (vector<Node*>::iterator i = old_state->nodes_.begin();
+       i != old_state->nodes_.end(); ++i) {
+    Node* old_node = *i;
+    // Anything the build wrote was dirty; the exception is outputs that a
+    // restat found unchanged, which are then marked clean.
+    if (!old_node->status_known() || old_node->dirty())
+      continue;
+    map<string, TimeStamp>::const_iterator file =
+        loaded.find(old_node->path());
+    if (file != loaded.end() && file->second != old_node->mtime())
+      continue;
+    if (Node* node = state->LookupNode(old_node->path()))
+      node->set_mtime(old_node->mtime());
+  }
+}
+
 /// Rebuild the build manifest, if necessary.
 /// Returns true if the manifest was rebuilt.
 bool RebuildManifest(Builder* builder, const char* input_file, string* err) {
@@ -222,6 +471,44 @@ bool CollectTargetsFromArgs(State* state, int argc, char* argv[],
 }
 
 int ToolGraph(Globals* globals, int argc, char* argv[]) {
+  // Like the clean tool, expects argv[0] to be the name of the tool.
+  argc++;
+  argv--;
+
+  GraphViz graph;
+  optind = 1;
+  int opt;
+  while ((opt = getopt(argc, argv, const_cast<char*>("hd:x:r:c:"))) != -1) {
+    switch (opt) {
+    case 'd':
+      graph.set_max_depth(atoi(optarg));
+      break;
+    case 'x':
+      graph.Exclude(optarg);
+      break;
+    case 'r':
+      graph.HideRule(optarg);
+      break;
+    case 'c':
+      graph.Collapse(optarg);
+      break;
+    case 'h':
+    default:
+      printf("usage: ninja -t graph [options] [targets]\n"
+"\n"
+"output graphviz dot file for targets\n"
+"options:\n"
+"  -d DEPTH   only files at most DEPTH edges from the targets\n"
+"  -x PREFIX  leave out files whose paths start with PREFIX\n"
+"  -r RULE    draw the outputs of RULE as if they were sources\n"
+"  -c PREFIX  draw files whose paths start with PREFIX as one\n"
+"all options but -d may be repeated\n");
+      return 1;
+    }
+  }
+  argv += optind;
+  argc -= optind;
+
   vector<Node*> nodes;
   string err;
   if (!CollectTargetsFromArgs(globals->state, argc, argv, &nodes, &err)) {
@@ -229,7 +516,6 @@ int ToolGraph(Globals* globals, int argc, char* argv[]) {
     return 1;
   }
 
-  GraphViz graph;
   graph.Start();
   for (vector<Node*>::const_iterator n = nodes.begin(); n != nodes.end(); ++n)
     graph.AddTarget(*n);
@@ -238,57 +524,115 @@ int ToolGraph(Globals* globals, int argc, char* argv[]) {
   return 0;
 }
 
+/// Look up \a path for "ninja -t query", printing why not if it isn't
+/// there.
+Node* LookupQueried(State* state, const string& path) {
+  Node* node = state->LookupNode(path);
+  if (!node) {
+    Node* suggestion = state->SpellcheckNode(path);
+    if (suggestion) {
+      printf("%s unknown, did you mean %s?\n",
+             path.c_str(), suggestion->path().c_str());
+    } else {
+      printf("%s unknown\n", path.c_str());
+    }
+  }
+  return node;
+}
+
+/// Print the inputs of the edge building \a node, and the outputs of
+/// those using it.
+void PrintQuery(Node* node) {
+  printf("%s:\n", node->path().c_str());
+  if (Edge* edge = node->in_edge()) {
+    printf("  input: %s\n", edge->rule_->name().c_str());
+    for (int in = 0; in < (int)edge->inputs_.size(); in++) {
+      const char* label = "";
+      if (edge->is_implicit(in))
+        label = "| ";
+      else if (edge->is_order_only(in))
+        label = "|| ";
+      printf("    %s%s\n", label, edge->inputs_[in]->path().c_str());
+    }
+  }
+  printf("  outputs:\n");
+  for (vector<Edge*>::const_iterator edge = node->out_edges().begin();
+       edge != node->out_edges().end(); ++edge) {
+    for (vector<Node*>::iterator out = (*edge)->outputs_.begin();
+         out != (*edge)->outputs_.end(); ++out) {
+      printf("    %s\n", (*out)->path().c_str());
+    }
+  }
+}
+
+/// Defined below, with the build log code it uses.
+int RunQueries(Globals* globals);
+
 int ToolQuery(Globals* globals, int argc, char* argv[]) {
+  if (argc == 1 && strcmp(argv[0], "-b") == 0)
+    return RunQueries(globals);
   if (argc == 0) {
     Error("expected a target to query");
     return 1;
   }
   for (int i = 0; i < argc; ++i) {
-    Node* node = globals->state->LookupNode(argv[i]);
-    if (!node) {
-      Node* suggestion = globals->state->SpellcheckNode(argv[i]);
-      if (suggestion) {
-        printf("%s unknown, did you mean %s?\n",
-               argv[i], suggestion->path().c_str());
-      } else {
-        printf("%s unknown\n", argv[i]);
-      }
+    Node* node = LookupQueried(globals->state, argv[i]);
+    if (!node)
       return 1;
-    }
-
-    printf("%s:\n", argv[i]);
-    if (Edge* edge = node->in_edge()) {
-      printf("  input: %s\n", edge->rule_->name().c_str());
-      for (int in = 0; in < (int)edge->inputs_.size(); in++) {
-        const char* label = "";
-        if (edge->is_implicit(in))
-          label = "| ";
-        else if (edge->is_order_only(in))
-          label = "|| ";
-        printf("    %s%s\n", label, edge->inputs_[in]->path().c_str());
-      }
-    }
-    printf("  outputs:\n");
-    for (vector<Edge*>::const_iterator edge = node->out_edges().begin();
-         edge != node->out_edges().end(); ++edge) {
-      for (vector<Node*>::iterator out = (*edge)->outputs_.begin();
-           out != (*edge)->outputs_.end(); ++out) {
-        printf("    %s\n", (*out)->path().c_str());
-      }
-    }
+    PrintQuery(node);
   }
   return 0;
 }
 
-#if !defined(_WIN32) && !defined(NINJA_BOOTSTRAP)
+#ifndef _WIN32
 int ToolBrowse(Globals* globals, int argc, char* argv[]) {
-  if (argc < 1) {
-    Error("expected a target to browse");
+  // Like the clean tool, expects argv[0] to be the name of the tool.
+  argc++;
+  argv--;
+
+  int port = 8000;
+  bool open_browser = true;
+  optind = 1;
+  int opt;
+  while ((opt = getopt(argc, argv, const_cast<char*>("hp:n"))) != -1) {
+    switch (opt) {
+    case 'p':
+      port = atoi(optarg);
+      break;
+    case 'n':
+      open_browser = false;
+      break;
+    case 'h':
+    default:
+      printf("usage: ninja -t browse [options] [target]\n"
+"\n"
+"browse the dependency graph from target [default=first default target]\n"
+"options:\n"
+"  -p PORT  serve pages on PORT [default=8000]\n"
+"  -n       don't open a web browser\n");
+      return 1;
+    }
+  }
+  argv += optind;
+  argc -= optind;
+
+  string initial_target;
+  string err;
+  if (argc >= 1) {
+    initial_target = argv[0];
+  } else {
+    vector<Node*> defaults = globals->state->DefaultNodes(&err);
+    if (defaults.empty()) {
+      Error("expected a target to browse");
+      return 1;
+    }
+    initial_target = defaults[0]->path();
+  }
+  if (!RunBrowse(globals->state, port, initial_target, open_browser, &err)) {
+    Error("%s", err.c_str());
     return 1;
   }
-  RunBrowsePython(globals->state, globals->ninja_command, argv[0]);
-  // If we get here, the browse failed.
-  return 1;
+  return 0;
 }
 #endif  // _WIN32
 
@@ -311,8 +655,11 @@ int ToolTargetsList(const vector<Node*>& nodes, int depth, int indent) {
     const char* target = (*n)->path().c_str();
     if ((*n)->in_edge()) {
       printf("%s: %s\n", target, (*n)->in_edge()->rule_->name().c_str());
-      if (depth > 1 || depth <= 0)
-        ToolTargetsList((*n)->in_edge()->inputs_, depth - 1, indent + 1);
+      if (depth > 1 || depth <= 0) {
+        const EdgeInputs& inputs = (*n)->in_edge()->inputs_;
+        ToolTargetsList(vector<Node*>(inputs.begin(), inputs.end()),
+                        depth - 1, indent + 1);
+      }
     } else {
       printf("%s\n", target);
     }
@@ -323,7 +670,7 @@ int ToolTargetsList(const vector<Node*>& nodes, int depth, int indent) {
 int ToolTargetsSourceList(State* state) {
   for (vector<Edge*>::iterator e = state->edges_.begin();
        e != state->edges_.end(); ++e) {
-    for (vector<Node*>::iterator inps = (*e)->inputs_.begin();
+    for (EdgeInputs::iterator inps = (*e)->inputs_.begin();
          inps != (*e)->inputs_.end(); ++inps) {
       if (!(*inps)->in_edge())
         printf("%s\n", (*inps)->path().c_str());
@@ -431,7 +778,7 @@ void PrintCommands(Edge* edge, set<Edge*>* seen) {
   if (!seen->insert(edge).second)
     return;
 
-  for (vector<Node*>::iterator in = edge->inputs_.begin();
+  for (EdgeInputs::iterator in = edge->inputs_.begin();
        in != edge->inputs_.end(); ++in)
     PrintCommands((*in)->in_edge(), seen);
 
@@ -454,6 +801,49 @@ int ToolCommands(Globals* globals, int argc, char* argv[]) {
   return 0;
 }
 
+/// Append \a text to \a buffer, writing it out once it is large.
+void BufferedWrite(string* buffer, const string& text) {
+  *buffer += text;
+  if (buffer->size() >= (1 << 20)) {
+    fwrite(buffer->data(), 1, buffer->size(), stdout);
+    buffer->clear();
+  }
+}
+
+int ToolCompilationDatabase(Globals* globals, int argc, char* argv[]) {
+  // Entries are written as they are made, each command evaluated once,
+  // so that huge manifests don't need the whole document in memory.
+  set<string> rules(argv, argv + argc);
+  char cwd[PATH_MAX];
+  if (!getcwd(cwd, sizeof(cwd))) {
+    Error("cannot determine working directory: %s", strerror(errno));
+    return 1;
+  }
+  string directory = JSONString(cwd);
+
+  string buffer;
+  bool first = true;
+  BufferedWrite(&buffer, "[");
+  for (vector<Edge*>::iterator e = globals->state->edges_.begin();
+       e != globals->state->edges_.end(); ++e) {
+    Edge* edge = *e;
+    if (edge->is_phony() || edge->inputs_.empty())
+      continue;
+    if (!rules.empty() && !rules.count(edge->rule().name()))
+      continue;
+    BufferedWrite(&buffer, string(first ? "" : ",") +
+        "\n  {\n    \"directory\": " + directory +
+        ",\n    \"command\": " + JSONString(edge->EvaluateCommand()) +
+        ",\n    \"file\": " + JSONString(edge->inputs_[0]->path()) +
+        ",\n    \"output\": " + JSONString(edge->outputs_[0]->path()) +
+        "\n  }");
+    first = false;
+  }
+  BufferedWrite(&buffer, "\n]\n");
+  fwrite(buffer.data(), 1, buffer.size(), stdout);
+  return 0;
+}
+
 int ToolClean(Globals* globals, int argc, char* argv[]) {
   // The clean tool uses getopt, and expects argv[0] to contain the name of
   // the tool, i.e. "clean".
@@ -503,6 +893,174 @@ int ToolClean(Globals* globals, int argc, char* argv[]) {
   }
 }
 
+#ifndef _WIN32
+int ToolWorker(Globals* globals, int argc, char* argv[]) {
+  // The worker tool uses getopt, and expects argv[0] to contain the name of
+  // the tool, i.e. "worker".
+  argc++;
+  argv--;
+
+  int jobs = GetProcessorCount();
+  const char* cache_dir = ".ninja_worker";
+  const char* host = "localhost";
+  const option kLongOptions[] = {
+    { "listen", required_argument, NULL, 'l' },
+    { NULL, 0, NULL, 0 }
+  };
+  optind = 1;
+  int opt;
+  while ((opt = getopt_long(argc, argv, "hj:d:l:", kLongOptions,
+                            NULL)) != -1) {
+    switch (opt) {
+    case 'j':
+      jobs = atoi(optarg);
+      break;
+    case 'd':
+      cache_dir = optarg;
+      break;
+    case 'l':
+      host = optarg;
+      break;
+    case 'h':
+    default:
+      printf("usage: ninja -t worker [options] PORT\n"
+"\n"
+"options:\n"
+"  -j N    run N commands at once [default=%d]\n"
+"  -d DIR  keep uploaded files in DIR [default=.ninja_worker]\n"
+"  -l, --listen=HOST  listen on the address HOST [default=localhost]\n"
+"\n"
+"clients must send the token in NINJA_REMOTE_TOKEN, which is required\n",
+             GetProcessorCount());
+      return 1;
+    }
+  }
+  argv += optind;
+  argc -= optind;
+
+  int port = argc == 1 ? atoi(argv[0]) : 0;
+  if (port <= 0 || jobs < 1) {
+    Error("expected a port to listen on, and -j of at least 1");
+    return 1;
+  }
+  printf("ninja: running up to %d commands for builds on %s port %d\n",
+         jobs, host, port);
+  string err;
+  if (!ServeRemoteJobs(host, port, jobs, cache_dir, &err)) {
+    Error("%s", err.c_str());
+    return 1;
+  }
+  return 0;
+}
+
+int ToolCacheServer(Globals* globals, int argc, char* argv[]) {
+  // The cache-server tool uses getopt, and expects argv[0] to contain the
+  // name of the tool, i.e. "cache-server".
+  argc++;
+  argv--;
+
+  const char* dir = ".ninja_cache_server";
+  const char* host = "localhost";
+  const option kLongOptions[] = {
+    { "listen", required_argument, NULL, 'l' },
+    { NULL, 0, NULL, 0 }
+  };
+  optind = 1;
+  int opt;
+  while ((opt = getopt_long(argc, argv, "hd:l:", kLongOptions, NULL)) !=
+         -1) {
+    switch (opt) {
+    case 'd':
+      dir = optarg;
+      break;
+    case 'l':
+      host = optarg;
+      break;
+    case 'h':
+    default:
+      printf("usage: ninja -t cache-server [options] PORT\n"
+"\n"
+"options:\n"
+"  -d DIR  keep what is stored in DIR [default=.ninja_cache_server]\n"
+"  -l, --listen=HOST  listen on the address HOST [default=localhost]\n");
+      return 1;
+    }
+  }
+  argv += optind;
+  argc -= optind;
+
+  int port = argc == 1 ? atoi(argv[0]) : 0;
+  if (port <= 0) {
+    Error("expected a port to listen on");
+    return 1;
+  }
+  printf("ninja: serving the files under %s on %s port %d\n", dir, host,
+         port);
+  string err;
+  if (!ServeHttpCache(host, port, dir, &err)) {
+    Error("%s", err.c_str());
+    return 1;
+  }
+  return 0;
+}
+
+int ToolRemoteCache(Globals* globals, int argc, char* argv[]) {
+  // "fetch URL DIR KEY FILE...", exiting with 0 if found, 1 if not;
+  // or "store URL DIR KEY ENTRY_KEY COUNT".
+  string mode = argc > 0 ? argv[0] : "";
+  if (!((mode == "fetch" && argc >= 4) || (mode == "store" && argc == 6))) {
+    Error("usage: ninja -t remote-cache fetch URL DIR KEY FILE...\n"
+          "       ninja -t remote-cache store URL DIR KEY ENTRY_KEY COUNT");
+    return 2;
+  }
+  ActionCache cache(argv[2], 0);
+  uint64_t inputs_key = strtoull(argv[3], NULL, 16);
+  string err;
+  if (mode == "fetch") {
+    vector<string> files(argv + 4, argv + argc);
+    int found = cache.FetchRemote(argv[1], inputs_key, files, &err);
+    if (found < 0)
+      Error("remote cache %s: %s", argv[1], err.c_str());
+    return found == 1 ? 0 : 1;
+  }
+  if (!cache.UploadRemote(argv[1], inputs_key, strtoull(argv[4], NULL, 16),
+                          atoi(argv[5]), &err)) {
+    Error("remote cache %s: %s", argv[1], err.c_str());
+    return 1;
+  }
+  return 0;
+}
+
+int ToolRemoteExec(Globals* globals, int argc, char* argv[]) {
+  if (argc != 2) {
+    Error("usage: ninja -t remote-exec HOST:PORT JOB_FILE");
+    return 1;
+  }
+  RemoteJob job;
+  string err;
+  if (!job.Load(argv[1], &err)) {
+    Error("%s", err.c_str());
+    return 1;
+  }
+  string output;
+  int exit_code;
+  bool ran;
+  if (!RunRemoteJob(argv[0], job, &output, &exit_code, &ran, &err)) {
+    if (ran) {
+      Error("remote worker %s: %s", argv[0], err.c_str());
+      return 1;
+    }
+    // Nothing ran; the command can run here as well.
+    Warning("remote worker %s: %s; running the command here", argv[0],
+            err.c_str());
+    int status = system(job.command.c_str());
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+  }
+  fwrite(output.data(), 1, output.size(), stdout);
+  return exit_code;
+}
+#endif  // _WIN32
+
 int ToolUrtle(Globals* globals, int argc, char** argv) {
   // RLE encoded.
   const char* urtle =
@@ -529,32 +1087,73 @@ int ToolUrtle(Globals* globals, int argc, char** argv) {
   return 0;
 }
 
+/// Defined below, with the other build log code.
+int ToolLog(Globals* globals, int argc, char* argv[]);
+int ToolCleanDead(Globals* globals, int argc, char* argv[]);
+int ToolUsage(Globals* globals, int argc, char* argv[]);
+int ToolCritPath(Globals* globals, int argc, char* argv[]);
+
+#ifndef _WIN32
+/// Defined below, as it runs builds.
+int ToolServer(Globals* globals, int argc, char* argv[]);
+#endif
+
 /// Find the function to execute for \a tool_name and return it via \a func.
 /// If there is no tool to run (e.g.: unknown tool), returns an exit code.
 int ChooseTool(const string& tool_name, const Tool** tool_out) {
   static const Tool kTools[] = {
-#if !defined(_WIN32) && !defined(NINJA_BOOTSTRAP)
+#ifndef _WIN32
     { "browse", "browse dependency graph in a web browser",
       Tool::RUN_AFTER_LOAD, ToolBrowse },
 #endif
+#ifndef _WIN32
+    { "cache-server", "serve a cache shared by builds, given "
+      "--action-cache-remote",
+      Tool::RUN_AFTER_FLAGS, ToolCacheServer },
+#endif
 #if defined(WIN32)
     { "msvc", "build helper for MSVC cl.exe (EXPERIMENTAL)",
       Tool::RUN_AFTER_FLAGS, ToolMSVC },
 #endif
     { "clean", "clean built files",
       Tool::RUN_AFTER_LOAD, ToolClean },
+    { "cleandead", "clean built files that are no longer produced by the "
+      "manifest",
+      Tool::RUN_AFTER_LOAD, ToolCleanDead },
     { "commands", "list all commands required to rebuild given targets",
       Tool::RUN_AFTER_LOAD, ToolCommands },
+    { "compdb", "dump a JSON compilation database of the edges of given rules",
+      Tool::RUN_AFTER_LOAD, ToolCompilationDatabase },
+    { "critpath", "show the longest chain of commands given targets wait on",
+      Tool::RUN_AFTER_LOAD, ToolCritPath },
     { "graph", "output graphviz dot file for targets",
       Tool::RUN_AFTER_LOAD, ToolGraph },
+    { "log", "print the build log in its text format",
+      Tool::RUN_AFTER_LOAD, ToolLog },
     { "query", "show inputs/outputs for a path",
       Tool::RUN_AFTER_LOAD, ToolQuery },
+#ifndef _WIN32
+    { "remote-cache", NULL,
+      Tool::RUN_AFTER_FLAGS, ToolRemoteCache },
+    { "remote-exec", NULL,
+      Tool::RUN_AFTER_FLAGS, ToolRemoteExec },
+#endif
     { "rules",    "list all rules",
       Tool::RUN_AFTER_LOAD, ToolRules },
+#ifndef _WIN32
+    { "server", "keep the manifest loaded and run builds for ninja here",
+      Tool::RUN_AFTER_LOAD, ToolServer },
+#endif
     { "targets",  "list targets by their rule or depth in the DAG",
       Tool::RUN_AFTER_LOAD, ToolTargets },
     { "urtle", NULL,
       Tool::RUN_AFTER_FLAGS, ToolUrtle },
+    { "usage", "list the commands of the last build by the CPU time they took",
+      Tool::RUN_AFTER_LOAD, ToolUsage },
+#ifndef _WIN32
+    { "worker", "run commands for builds elsewhere, given --remote",
+      Tool::RUN_AFTER_FLAGS, ToolWorker },
+#endif
     { NULL, NULL, Tool::RUN_AFTER_FLAGS, NULL }
   };
 
@@ -587,45 +1186,148 @@ int ChooseTool(const string& tool_name, const Tool** tool_out) {
   return 1;
 }
 
+/// Finish the trace of -d trace however ninja exits.
+void CloseTrace() {
+  if (g_tracer)
+    g_tracer->Close();
+}
+
 /// Enable a debugging mode.  Returns false if Ninja should exit instead
 /// of continuing.
 bool DebugEnable(const string& name, Globals* globals) {
   if (name == "list") {
     printf("debugging modes:\n"
 "  stats    print operation counts/timing info\n"
+"  stats=PATH  also write them to PATH as JSON\n"
+"  memstats  print stats, with the memory the graph and build log take\n"
+"  trace=PATH  write a Chrome trace of ninja's work and the jobs run to PATH\n"
 "  explain  explain what caused a command to execute\n"
+"  nomanifestcache  always parse the manifest, ignoring its cache\n"
+"  serialscan  stat files one at a time while checking what is dirty\n"
+"  nostatcache  stat each file by its path, rather than whole directories\n"
+"  uring    batch the scan's stats and reads through io_uring, on Linux\n"
+"           5.6 and up; it may help where each stat waits on a network\n"
+"  keepdepfile  don't delete depfiles once they are in the deps log\n"
+"  synclog  write each finished command to the build log right away\n"
+"  nowatch  make -t server stat every file on each build, as after changes\n"
+"           it can't see, e.g. from other machines to network file systems\n"
 "multiple modes can be enabled via -d FOO -d BAR\n");
     return false;
   } else if (name == "stats") {
     g_metrics = new Metrics;
     return true;
+  } else if (name.compare(0, 6, "stats=") == 0) {
+    g_metrics = new Metrics;
+    g_metrics_json_path = name.substr(6);
+    return true;
+  } else if (name == "memstats") {
+    if (!g_metrics)
+      g_metrics = new Metrics;
+    g_memstats = true;
+    return true;
+  } else if (name.compare(0, 6, "trace=") == 0) {
+    string err;
+    Tracer* tracer = new Tracer;
+    if (!tracer->Open(name.substr(6), &err)) {
+      Error("opening trace %s: %s", name.substr(6).c_str(), err.c_str());
+      delete tracer;
+      return false;
+    }
+    delete g_tracer;
+    g_tracer = tracer;
+    atexit(CloseTrace);
+    return true;
   } else if (name == "explain") {
     g_explaining = true;
     return true;
+  } else if (name == "nomanifestcache") {
+    g_use_manifest_cache = false;
+    return true;
+  } else if (name == "serialscan") {
+    globals->config->scan_threads = 0;
+    return true;
+  } else if (name == "nostatcache") {
+    g_use_stat_cache = false;
+    return true;
+  } else if (name == "uring") {
+    g_use_io_uring = true;
+    return true;
+  } else if (name == "nowatch") {
+    g_use_file_watcher = false;
+    return true;
+  } else if (name == "keepdepfile") {
+    globals->config->keep_depfiles = true;
+    return true;
+  } else if (name == "synclog") {
+    globals->config->sync_log = true;
+    return true;
   } else {
     printf("ninja: unknown debug setting '%s'\n", name.c_str());
     return false;
   }
 }
 
-bool OpenLog(BuildLog* build_log, Globals* globals,
-             DiskInterface* disk_interface) {
+/// Where the file \a name of globals->state's build goes.
+string BuildDirPath(Globals* globals, const char* name) {
   const string build_dir =
       globals->state->bindings_.LookupVariable("builddir");
-  const char* kLogPath = ".ninja_log";
-  string log_path = kLogPath;
-  if (!build_dir.empty()) {
-    log_path = build_dir + "/" + kLogPath;
-    if (!disk_interface->MakeDirs(log_path) && errno != EEXIST) {
-      Error("creating build directory %s: %s",
-            build_dir.c_str(), strerror(errno));
-      return false;
-    }
-  }
+  if (build_dir.empty())
+    return name;
+  return build_dir + "/" + name;
+}
 
-  string err;
-  if (!build_log->Load(log_path, &err)) {
-    Error("loading build log %s: %s", log_path.c_str(), err.c_str());
+/// Where the build log of globals->state goes.
+string BuildLogPath(Globals* globals) {
+  return BuildDirPath(globals, ".ninja_log");
+}
+
+/// Where the deps log of globals->state goes.
+string DepsLogPath(Globals* globals) {
+  return BuildDirPath(globals, ".ninja_deps");
+}
+
+/// Tells the build log which of its outputs are dead: those no edge
+/// builds any more, once their files are gone too, as -t cleandead
+/// leaves them.  Files still there keep their entries, for generators
+/// that read the log.
+struct DeadPaths : public BuildLogUser {
+  DeadPaths(State* state, SubninjaIndex* subninjas,
+            DiskInterface* disk_interface)
+      : state_(state), subninjas_(subninjas),
+        disk_interface_(disk_interface) {}
+
+  virtual bool IsPathDead(StringPiece path) const {
+    Node* node = state_->LookupNode(path);
+    if (node && node->in_edge())
+      return false;
+    if (subninjas_ && subninjas_->Builds(path))
+      return false;
+    return disk_interface_->Stat(path.AsString()) == 0;
+  }
+
+ private:
+  State* state_;
+  /// The subninjas put off, which build more than state knows.
+  SubninjaIndex* subninjas_;
+  DiskInterface* disk_interface_;
+};
+
+bool OpenLog(BuildLog* build_log, Globals* globals,
+             DiskInterface* disk_interface) {
+  const string build_dir =
+      globals->state->bindings_.LookupVariable("builddir");
+  const string log_path = BuildLogPath(globals);
+  if (!build_dir.empty()) {
+    if (!disk_interface->MakeDirs(log_path) && errno != EEXIST) {
+      Error("creating build directory %s: %s",
+            build_dir.c_str(), strerror(errno));
+      return false;
+    }
+  }
+
+  string err;
+  if (!build_log->Load(log_path, &err)) {
+    Error("loading build log %s: %s", log_path.c_str(), err.c_str());
     return false;
   }
   if (!err.empty()) {
@@ -635,7 +1337,10 @@ bool OpenLog(BuildLog* build_log, Globals* globals,
   }
 
   if (!globals->config->dry_run) {
-    if (!build_log->OpenForWrite(log_path, &err)) {
+    if (globals->config->sync_log)
+      build_log->SetBatching(0, 0);
+    DeadPaths dead_paths(globals->state, globals->subninjas, disk_interface);
+    if (!build_log->OpenForWrite(log_path, &err, &dead_paths)) {
       Error("opening build log: %s", err.c_str());
       return false;
     }
@@ -644,29 +1349,395 @@ bool OpenLog(BuildLog* build_log, Globals* globals,
   return true;
 }
 
+/// Load the deps log of globals->state into it, and open it for writing.
+/// OpenLog() must have made the build directory.
+bool OpenDepsLog(DepsLog* deps_log, Globals* globals) {
+  const string path = DepsLogPath(globals);
+
+  string err;
+  if (!deps_log->Load(path, globals->state, &err)) {
+    Error("loading deps log %s: %s", path.c_str(), err.c_str());
+    return false;
+  }
+  if (!err.empty()) {
+    // Hack: Load() can return a warning via err by returning true.
+    Warning("%s", err.c_str());
+    err.clear();
+  }
+
+  // Recompacting keeps only the deps of what the State builds.
+  if (globals->subninjas && deps_log->needs_recompaction() &&
+      !globals->config->dry_run) {
+    RealFileReader file_reader;
+    if (!globals->subninjas->LoadAll(globals->state, &file_reader, &err)) {
+      Error("%s", err.c_str());
+      return false;
+    }
+  }
+
+  if (!globals->config->dry_run) {
+    if (!deps_log->OpenForWrite(path, &err)) {
+      Error("opening deps log: %s", err.c_str());
+      return false;
+    }
+  }
+
+  return true;
+}
+
+int ToolLog(Globals* globals, int /* argc */, char* /* argv */[]) {
+  const string log_path = BuildLogPath(globals);
+  BuildLog build_log;
+  string err;
+  if (!build_log.Load(log_path, &err)) {
+    Error("loading build log %s: %s", log_path.c_str(), err.c_str());
+    return 1;
+  }
+  if (!err.empty())
+    Warning("%s", err.c_str());
+  if (!build_log.Export(stdout)) {
+    Error("writing build log: %s", strerror(errno));
+    return 1;
+  }
+  return 0;
+}
+
+int ToolCleanDead(Globals* globals, int /* argc */, char* /* argv */[]) {
+  // Outputs the deps log knows of are in the graph, if only as inputs of
+  // nothing; see Cleaner::CleanDead().
+  string err;
+  DepsLog deps_log;
+  if (!deps_log.Load(DepsLogPath(globals), globals->state, &err)) {
+    Error("loading deps log: %s", err.c_str());
+    return 1;
+  }
+  const string log_path = BuildLogPath(globals);
+  BuildLog build_log;
+  err.clear();
+  if (!build_log.Load(log_path, &err)) {
+    Error("loading build log %s: %s", log_path.c_str(), err.c_str());
+    return 1;
+  }
+  if (!err.empty())
+    Warning("%s", err.c_str());
+
+  vector<BuildLog::LogEntry> entries;
+  build_log.GetEntries(&entries);
+  Cleaner cleaner(globals->state, *globals->config);
+  int status = cleaner.CleanDead(entries);
+  if (globals->config->dry_run || entries.empty())
+    return status;
+
+  // Drop the entries of what was removed now, rather than at the next
+  // recompaction of a build.
+  RealDiskInterface disk_interface;
+  DeadPaths dead_paths(globals->state, NULL, &disk_interface);
+  err.clear();
+  if (!build_log.Recompact(log_path, &err, &dead_paths)) {
+    Error("recompacting build log: %s", err.c_str());
+    return 1;
+  }
+  return status;
+}
+
+/// What "ninja -t query -b" keeps between requests.
+struct QuerySession {
+  explicit QuerySession(Globals* globals)
+      : globals(globals),
+        scan(globals->state, &build_log, &deps_log, &disk_interface),
+        logs_loaded(false) {
+    scan.set_content_digests(globals->config->content_digests);
+  }
+
+  Globals* globals;
+  BuildLog build_log;
+  DepsLog deps_log;
+  RealDiskInterface disk_interface;
+  DependencyScan scan;
+  /// Whether the logs are loaded, which the first "dirty" does.
+  bool logs_loaded;
+};
+
+/// Answer one request of "ninja -t query -b": \a line is a path, or one
+/// of the words below and a path.
+void AnswerQuery(QuerySession* session, const string& line) {
+  Globals* globals = session->globals;
+  string request = "query";
+  string path = line;
+  string::size_type space = line.find(' ');
+  if (space != string::npos) {
+    request = line.substr(0, space);
+    path = line.substr(space + 1);
+  }
+  Node* node = LookupQueried(globals->state, path);
+  if (!node)
+    return;
+
+  if (request == "query") {
+    PrintQuery(node);
+  } else if (request == "inputs") {
+    if (Edge* edge = node->in_edge()) {
+      for (EdgeInputs::iterator i = edge->inputs_.begin();
+           i != edge->inputs_.end(); ++i) {
+        printf("%s\n", (*i)->path().c_str());
+      }
+    }
+  } else if (request == "outputs") {
+    for (vector<Edge*>::const_iterator e = node->out_edges().begin();
+         e != node->out_edges().end(); ++e) {
+      for (vector<Node*>::iterator o = (*e)->outputs_.begin();
+           o != (*e)->outputs_.end(); ++o) {
+        printf("%s\n", (*o)->path().c_str());
+      }
+    }
+  } else if (request == "rdeps") {
+    // Everything built from the node, near to far.
+    set<Node*> seen;
+    vector<Node*> queue(1, node);
+    for (size_t i = 0; i < queue.size(); ++i) {
+      for (vector<Edge*>::const_iterator e = queue[i]->out_edges().begin();
+           e != queue[i]->out_edges().end(); ++e) {
+        for (vector<Node*>::iterator o = (*e)->outputs_.begin();
+             o != (*e)->outputs_.end(); ++o) {
+          if (seen.insert(*o).second) {
+            queue.push_back(*o);
+            printf("%s\n", (*o)->path().c_str());
+          }
+        }
+      }
+    }
+  } else if (request == "commands") {
+    set<Edge*> seen;
+    PrintCommands(node->in_edge(), &seen);
+  } else if (request == "dirty") {
+    if (!node->in_edge()) {
+      printf("source\n");
+      return;
+    }
+    if (!session->logs_loaded) {
+      string err;
+      const string log_path = BuildLogPath(globals);
+      if (!session->build_log.Load(log_path, &err))
+        Warning("loading build log %s: %s", log_path.c_str(), err.c_str());
+      const string deps_path = DepsLogPath(globals);
+      err.clear();
+      if (!session->deps_log.Load(deps_path, globals->state, &err))
+        Warning("loading deps log %s: %s", deps_path.c_str(), err.c_str());
+      session->logs_loaded = true;
+    }
+    // Files may have changed since the last request.
+    globals->state->Reset();
+    string err;
+    if (!session->scan.RecomputeDirty(node->in_edge(), &err))
+      printf("error: %s\n", err.c_str());
+    else
+      printf("%s\n", node->dirty() ? "dirty" : "clean");
+  } else {
+    printf("unknown request '%s'; expected query, inputs, outputs, rdeps, "
+           "commands or dirty\n", request.c_str());
+  }
+}
+
+int RunQueries(Globals* globals) {
+  QuerySession session(globals);
+  string line;
+  char buf[4096];
+  while (fgets(buf, sizeof(buf), stdin)) {
+    line += buf;
+    if (line.empty() || line[line.size() - 1] != '\n')
+      continue;  // The rest of a long line.
+    line.resize(line.size() - 1);
+    if (!line.empty() && line[line.size() - 1] == '\r')
+      line.resize(line.size() - 1);
+    if (!line.empty())
+      AnswerQuery(&session, line);
+    // A blank line ends each answer.
+    printf("\n");
+    fflush(stdout);
+    line.clear();
+  }
+  return 0;
+}
+
+namespace {
+
+int64_t CpuMillis(const BuildLog::LogEntry& entry) {
+  return entry.usage.user_millis + entry.usage.system_millis;
+}
+
+/// Orders entries by the CPU time they took, most first.
+struct MoreCpu {
+  bool operator()(const BuildLog::LogEntry& a,
+                  const BuildLog::LogEntry& b) const {
+    return CpuMillis(a) > CpuMillis(b);
+  }
+};
+
+}  // anonymous namespace
+
+int ToolUsage(Globals* globals, int argc, char* argv[]) {
+  // Like the clean tool, expects argv[0] to be the name of the tool.
+  argc++;
+  argv--;
+
+  int limit = -1;
+  optind = 1;
+  int opt;
+  while ((opt = getopt(argc, argv, const_cast<char*>("hn:"))) != -1) {
+    switch (opt) {
+    case 'n':
+      limit = atoi(optarg);
+      break;
+    case 'h':
+    default:
+      printf("usage: ninja -t usage [-n COUNT]\n"
+"\n"
+"list the commands of the last build, by the CPU time they took\n"
+"options:\n"
+"  -n COUNT  only the first COUNT\n");
+      return 1;
+    }
+  }
+
+  const string log_path = BuildLogPath(globals);
+  BuildLog build_log;
+  string err;
+  if (!build_log.Load(log_path, &err)) {
+    Error("loading build log %s: %s", log_path.c_str(), err.c_str());
+    return 1;
+  }
+  if (!err.empty())
+    Warning("%s", err.c_str());
+
+  vector<BuildLog::LogEntry> entries;
+  build_log.GetEntries(&entries);
+  stable_sort(entries.begin(), entries.end(), MoreCpu());
+  if (limit >= 0 && (size_t)limit < entries.size())
+    entries.resize(limit);
+
+  printf("%8s %8s %8s %8s %8s %8s %8s %8s  %s\n", "cpu ms", "user ms",
+         "sys ms", "wall ms", "peak MB", "blk in", "blk out", "ctx sw",
+         "output");
+  for (vector<BuildLog::LogEntry>::const_iterator i = entries.begin();
+       i != entries.end(); ++i) {
+    const ResourceUsage& usage = i->usage;
+    printf("%8" PRId64 " %8" PRId64 " %8" PRId64 " %8d %8.1f %8" PRId64
+           " %8" PRId64 " %8" PRId64 "  %s\n",
+           CpuMillis(*i), usage.user_millis, usage.system_millis,
+           i->end_time - i->start_time, usage.peak_rss / (1024.0 * 1024.0),
+           usage.blocks_read, usage.blocks_written, usage.context_switches,
+           i->output.c_str());
+  }
+  return 0;
+}
+
+int ToolCritPath(Globals* globals, int argc, char* argv[]) {
+  vector<Node*> targets;
+  string err;
+  if (!CollectTargetsFromArgs(globals->state, argc, argv, &targets, &err)) {
+    Error("%s", err.c_str());
+    return 1;
+  }
+
+  const string log_path = BuildLogPath(globals);
+  BuildLog build_log;
+  if (!build_log.Load(log_path, &err)) {
+    Error("loading build log %s: %s", log_path.c_str(), err.c_str());
+    return 1;
+  }
+  if (!err.empty())
+    Warning("%s", err.c_str());
+
+  CriticalPath critical_path;
+  critical_path.Compute(targets, &build_log);
+  if (critical_path.edges.empty()) {
+    printf("ninja: no commands to run for these targets\n");
+    return 0;
+  }
+
+  printf("%8s %8s  %s\n", "start s", "time s", "output");
+  int64_t start = 0;
+  for (vector<Edge*>::iterator i = critical_path.path.begin();
+       i != critical_path.path.end(); ++i) {
+    int64_t duration = critical_path.Duration(*i);
+    printf("%8.3f %8.3f  %s\n", start / 1000.0, duration / 1000.0,
+           (*i)->outputs_[0]->path().c_str());
+    start += duration;
+  }
+  printf("\n");
+
+  printf("critical path  %.3f s, %d of %d commands\n",
+         critical_path.length / 1000.0, (int)critical_path.path.size(),
+         (int)critical_path.edges.size());
+  printf("total work     %.3f s", critical_path.total_work / 1000.0);
+  if (critical_path.guessed) {
+    printf(", taking the %d commands not in the build log to take the "
+           "average", critical_path.guessed);
+  }
+  printf("\n");
+  if (critical_path.length > 0) {
+    printf("ideal speedup  %.1fx\n",
+           critical_path.total_work / (double)critical_path.length);
+  }
+  if (critical_path.logged_span > 0) {
+    printf("last build     %.3f s, %.1fx parallelism\n",
+           critical_path.logged_span / 1000.0,
+           critical_path.logged_work / (double)critical_path.logged_span);
+  }
+  return 0;
+}
+
 /// Dump the output requested by '-d stats'.
-void DumpMetrics(Globals* globals) {
+void DumpMetrics(Globals* globals, BuildLog* build_log) {
+  if (g_memstats) {
+    MemoryStats memory;
+    memory.AddState(globals->state);
+    memory.AddBuildLog(build_log);
+    memory.Record(g_metrics);
+  }
   g_metrics->Report();
+  string err;
+  if (!g_metrics_json_path.empty() &&
+      !g_metrics->WriteJSON(g_metrics_json_path, &err)) {
+    Error("writing %s: %s", g_metrics_json_path.c_str(), err.c_str());
+  }
 
   printf("\n");
   int count = (int)globals->state->paths_.size();
   int buckets = (int)globals->state->paths_.bucket_count();
   printf("path->node hash load %.2f (%d entries / %d buckets)\n",
          count / (double) buckets, count, buckets);
+  printf("node/edge arena %.1f kB used (%.1f kB allocated)\n",
+         globals->state->arena_.bytes_used() / 1024.0,
+         globals->state->arena_.bytes_allocated() / 1024.0);
+}
+
+/// Send the end of the build, which failed with \a err if not empty, to
+/// --events.
+void ReportResult(Builder* builder, const string& err) {
+  if (builder->config_.events)
+    builder->config_.events->BuildFinished(err.empty(), err);
 }
 
-int RunBuild(Builder* builder, int argc, char** argv) {
+int RunBuild(Builder* builder, RealDiskInterface* disk_interface,
+             int argc, char** argv) {
   string err;
   vector<Node*> targets;
   if (!CollectTargetsFromArgs(builder->state_, argc, argv, &targets, &err)) {
     Error("%s", err.c_str());
+    ReportResult(builder, err);
     return 1;
   }
 
+  // Nothing writes files until the build starts.
+  disk_interface->AllowStatCache(g_use_stat_cache);
+  disk_interface->AllowIoUring(g_use_io_uring);
+  builder->PrefetchTargets(targets);
   for (size_t i = 0; i < targets.size(); ++i) {
     if (!builder->AddTarget(targets[i], &err)) {
       if (!err.empty()) {
         Error("%s", err.c_str());
+        ReportResult(builder, err);
         return 1;
       } else {
         // Added a target that is already up-to-date; not really
@@ -675,16 +1746,21 @@ int RunBuild(Builder* builder, int argc, char** argv) {
     }
   }
 
+  disk_interface->AllowStatCache(false);
+
   if (builder->AlreadyUpToDate()) {
     printf("ninja: no work to do.\n");
+    ReportResult(builder, "");
     return 0;
   }
 
   if (!builder->Build(&err)) {
     printf("ninja: build stopped: %s.\n", err.c_str());
+    ReportResult(builder, err);
     return 1;
   }
 
+  ReportResult(builder, "");
   return 0;
 }
 
@@ -718,40 +1794,92 @@ int ExceptionFilter(unsigned int code, struct _EXCEPTION_POINTERS *ep) {
 
 #endif  // _MSC_VER
 
-int NinjaMain(int argc, char** argv) {
-  BuildConfig config;
-  Globals globals;
-  globals.ninja_command = argv[0];
-  globals.config = &config;
-  const char* input_file = "build.ninja";
-  const char* working_dir = NULL;
-  string tool_name;
-
-  setvbuf(stdout, NULL, _IOLBF, BUFSIZ);
+/// Command-line options that aren't part of the BuildConfig.
+struct Options {
+  Options()
+      : input_file("build.ninja"), working_dir(NULL), tool(NULL),
+        serve_jobs(false), action_cache_dir(NULL),
+        action_cache_size((int64_t)10240 << 20), action_cache_remote(NULL),
+        events(NULL), lazy(false), estimate(false) {}
+
+  /// Build file to load.
+  const char* input_file;
+  /// Directory to change into before doing anything else.
+  const char* working_dir;
+  /// Tool to run rather than building.
+  const Tool* tool;
+  /// Whether to share -j among the commands through a jobserver, if
+  /// not a client of one already.
+  bool serve_jobs;
+  /// The action cache's directory, if any, and how big it may get.
+  const char* action_cache_dir;
+  int64_t action_cache_size;
+  /// The URL of the action cache's remote backend, if any.
+  const char* action_cache_remote;
+  /// Where to write the build's events to, if anywhere.
+  const char* events;
+  /// Whether to only load the subninjas the targets need.
+  bool lazy;
+  /// Whether to estimate how long the build would take, rather than run
+  /// it.
+  bool estimate;
+};
 
-  config.parallelism = GuessParallelism();
+/// Set the defaults of \a config that depend on the machine.
+void InitConfig(BuildConfig* config) {
+  config->parallelism = GuessParallelism();
+  // Scanning waits on stat() more than the CPU; on network file systems
+  // much more.
+  config->scan_threads = GuessParallelism();
+  // Enough to keep a few directories and rspfiles in the making while
+  // commands run, without taking edges from the plan long before they
+  // can start.
+  config->io_threads = 4;
+}
 
-  enum { OPT_VERSION = 1 };
+/// Parse the toplevel options in \a argv, leaving \a argc and \a argv at
+/// the targets (or the tool's arguments).  Returns an exit code if Ninja
+/// should exit now, or -1 to carry on.
+int ReadFlags(int* argc, char*** argv, Options* options, BuildConfig* config,
+              Globals* globals) {
+  enum { OPT_VERSION = 1, OPT_JOBSERVER, OPT_CONTENT_DIGESTS, OPT_EVENTS,
+         OPT_REMOTE, OPT_ACTION_CACHE, OPT_ACTION_CACHE_SIZE,
+         OPT_ACTION_CACHE_REMOTE, OPT_LAZY, OPT_ESTIMATE, OPT_NUMA,
+         OPT_SPECULATE };
   const option kLongOptions[] = {
     { "help", no_argument, NULL, 'h' },
     { "version", no_argument, NULL, OPT_VERSION },
+    { "jobserver", no_argument, NULL, OPT_JOBSERVER },
+    { "content-digests", no_argument, NULL, OPT_CONTENT_DIGESTS },
+    { "events", required_argument, NULL, OPT_EVENTS },
+    { "lazy", no_argument, NULL, OPT_LAZY },
+    { "estimate", no_argument, NULL, OPT_ESTIMATE },
+    { "speculate", no_argument, NULL, OPT_SPECULATE },
+#ifndef _WIN32
+    { "remote", required_argument, NULL, OPT_REMOTE },
+    { "action-cache", required_argument, NULL, OPT_ACTION_CACHE },
+    { "action-cache-size", required_argument, NULL, OPT_ACTION_CACHE_SIZE },
+    { "action-cache-remote", required_argument, NULL,
+      OPT_ACTION_CACHE_REMOTE },
+    { "numa", no_argument, NULL, OPT_NUMA },
+#endif
     { NULL, 0, NULL, 0 }
   };
 
   int opt;
-  while (tool_name.empty() &&
-         (opt = getopt_long(argc, argv, "d:f:j:k:l:nt:vC:", kLongOptions,
+  while (!options->tool &&
+         (opt = getopt_long(*argc, *argv, "d:f:j:k:l:m:nt:vC:", kLongOptions,
                             NULL)) != -1) {
     switch (opt) {
       case 'd':
-        if (!DebugEnable(optarg, &globals))
+        if (!DebugEnable(optarg, globals))
           return 1;
         break;
       case 'f':
-        input_file = optarg;
+        options->input_file = optarg;
         break;
       case 'j':
-        config.parallelism = atoi(optarg);
+        config->parallelism = atoi(optarg);
         break;
       case 'k': {
         char* end;
@@ -762,77 +1890,550 @@ int NinjaMain(int argc, char** argv) {
         // We want to go until N jobs fail, which means we should allow
         // N failures and then stop.  For N <= 0, INT_MAX is close enough
         // to infinite for most sane builds.
-        config.failures_allowed = value > 0 ? value : INT_MAX;
+        config->failures_allowed = value > 0 ? value : INT_MAX;
         break;
       }
       case 'l': {
+        if (string(optarg) == "auto") {
+          config->adaptive_parallelism = true;
+          break;
+        }
         char* end;
         double value = strtod(optarg, &end);
         if (end == optarg)
           Fatal("-l parameter not numeric: did you mean -l 0.0?");
-        config.max_load_average = value;
+        config->max_load_average = value;
+        break;
+      }
+      case 'm': {
+        char* end;
+        long value = strtol(optarg, &end, 10);
+        if (*end != 0 || value < 0)
+          Fatal("-m parameter not a number of megabytes; did you mean -m 0?");
+        config->max_memory = (int64_t)value << 20;
         break;
       }
       case 'n':
-        config.dry_run = true;
+        config->dry_run = true;
         break;
-      case 't':
-        tool_name = optarg;
+      case 't': {
+        // Select a tool as early as possible, so commands like -t list
+        // can run before we attempt to load build.ninja etc.
+        int exit_code = ChooseTool(optarg, &options->tool);
+        if (!options->tool)
+          return exit_code;
         break;
+      }
       case 'v':
-        config.verbosity = BuildConfig::VERBOSE;
+        config->verbosity = BuildConfig::VERBOSE;
         break;
       case 'C':
-        working_dir = optarg;
+        options->working_dir = optarg;
+        break;
+      case OPT_JOBSERVER:
+        options->serve_jobs = true;
+        break;
+      case OPT_CONTENT_DIGESTS:
+        config->content_digests = true;
+        break;
+      case OPT_EVENTS:
+        options->events = optarg;
+        break;
+      case OPT_LAZY:
+        options->lazy = true;
+        break;
+      case OPT_ESTIMATE:
+        // A dry run, its commands' lines making way for the estimate.
+        options->estimate = true;
+        config->dry_run = true;
+        config->verbosity = BuildConfig::QUIET;
+        break;
+      case OPT_REMOTE: {
+        string workers = optarg;
+        for (size_t start = 0, end; start <= workers.size(); start = end + 1) {
+          end = workers.find(',', start);
+          if (end == string::npos)
+            end = workers.size();
+          string host, err;
+          int port;
+          string worker = workers.substr(start, end - start);
+          if (!ParseRemoteAddress(worker, &host, &port, &err))
+            Fatal("--remote: %s", err.c_str());
+          config->remote_workers.push_back(worker);
+        }
+        break;
+      }
+      case OPT_ACTION_CACHE:
+        options->action_cache_dir = optarg;
+        break;
+      case OPT_ACTION_CACHE_SIZE: {
+        char* end;
+        long value = strtol(optarg, &end, 10);
+        if (*end != 0 || value <= 0)
+          Fatal("--action-cache-size not a number of megabytes");
+        options->action_cache_size = (int64_t)value << 20;
+        break;
+      }
+      case OPT_ACTION_CACHE_REMOTE: {
+        HttpCacheClient client;
+        string err;
+        if (!client.Init(optarg, &err))
+          Fatal("--action-cache-remote: %s", err.c_str());
+        options->action_cache_remote = optarg;
+        break;
+      }
+      case OPT_SPECULATE:
+        config->speculate = true;
+        break;
+      case OPT_NUMA:
+        config->numa_placement = true;
         break;
       case OPT_VERSION:
         printf("%s\n", kVersion);
         return 0;
       case 'h':
       default:
-        Usage(config);
+        Usage(*config);
         return 1;
     }
   }
-  argv += optind;
-  argc -= optind;
+  *argv += optind;
+  *argc -= optind;
+  return -1;
+}
 
-  // If specified, select a tool as early as possible, so commands like
-  // -t list can run before we attempt to load build.ninja etc.
-  const Tool* tool = NULL;
-  if (!tool_name.empty()) {
-    int exit_code = ChooseTool(tool_name, &tool);
-    if (!tool)
-      return exit_code;
+#ifndef _WIN32
+/// What "ninja -t server" keeps between builds, besides globals->state.
+struct ServerSession {
+  ServerSession() : log_size_limit(0), deps_log_size_limit(0) {}
+
+  RealDiskInterface disk_interface;
+  /// The build log, open for writing.
+  auto_ptr<BuildLog> build_log;
+  string log_path;
+  /// Size past which the log is loaded again, which recompacts it.
+  off_t log_size_limit;
+  /// The deps log, loaded into globals->state and open for writing; it
+  /// has to be loaded again whenever the state is replaced.
+  auto_ptr<DepsLog> deps_log;
+  string deps_log_path;
+  off_t deps_log_size_limit;
+  FileWatcher watcher;
+  /// Mtimes of the files in globals->state that have been watched since
+  /// they were looked up, by node id, with -1 for the rest.
+  vector<TimeStamp> mtimes;
+};
+
+/// Forget the mtimes of files that have changed since the last build.
+void ForgetChangedMtimes(ServerSession* session, State* state) {
+  vector<string> changed;
+  vector<string> gone_dirs;
+  if (!session->watcher.ReadChanges(&changed, &gone_dirs)) {
+    session->mtimes.clear();
+    return;
+  }
+  for (vector<string>::iterator i = changed.begin(); i != changed.end();
+       ++i) {
+    Node* node = state->LookupNode(*i);
+    if (node && (size_t)node->id() < session->mtimes.size())
+      session->mtimes[node->id()] = -1;
+  }
+  for (vector<string>::iterator d = gone_dirs.begin(); d != gone_dirs.end();
+       ++d) {
+    for (vector<Node*>::iterator i = state->nodes_.begin();
+         i != state->nodes_.end(); ++i) {
+      size_t id = (*i)->id();
+      if (id < session->mtimes.size() &&
+          FileWatcher::InDir((*i)->path(), *d)) {
+        session->mtimes[id] = -1;
+      }
+    }
+  }
+}
+
+/// Whether a change to \a path's mtime shows in its directory's entry,
+/// as the watcher needs: not so for a symlink, whose target changes
+/// unseen, or a directory, which changes with its contents.
+bool WatchableFile(const string& path) {
+  struct stat st;
+  if (lstat(path.c_str(), &st) < 0)
+    return true;  // Missing, until its directory says otherwise.
+  return !S_ISLNK(st.st_mode) && !S_ISDIR(st.st_mode);
+}
+
+/// Remember the mtimes the last build found, for the files that are
+/// being watched.  Watch the rest from now on.
+void RecordMtimes(ServerSession* session, State* state) {
+  vector<TimeStamp> mtimes(state->nodes_.size(), -1);
+  for (vector<Node*>::iterator i = state->nodes_.begin();
+       i != state->nodes_.end(); ++i) {
+    Node* node = *i;
+    size_t id = node->id();
+    TimeStamp known = id < session->mtimes.size() ? session->mtimes[id] : -1;
+    TimeStamp mtime;
+    if (!node->status_known()) {
+      // Not part of the build, so still what we knew before.
+      mtime = known;
+    } else if (node->dirty()) {
+      // As in CarryOverStats(), the build may have changed it.
+      continue;
+    } else {
+      mtime = node->mtime();
+    }
+    // What was kept before was checked then, and is unchanged since.
+    if (mtime > 0 && mtime != known && !WatchableFile(node->path()))
+      continue;
+    if (session->watcher.Watch(node->path()))
+      mtimes[id] = mtime;
+  }
+  session->mtimes.swap(mtimes);
+}
+
+/// Whether any of the files the manifest was loaded from has changed
+/// since, or we don't know.
+bool ManifestChanged(Globals* globals, DiskInterface* disk_interface) {
+  if (globals->manifest_files.empty())
+    return true;
+  for (vector<ManifestCache::File>::const_iterator
+       i = globals->manifest_files.begin();
+       i != globals->manifest_files.end(); ++i) {
+    if (disk_interface->Stat(i->path) != i->mtime)
+      return true;
+  }
+  return false;
+}
+
+/// Open the build log of globals->state for \a session, unless it is
+/// open already and hasn't grown much since.  The requests the server
+/// declines run in the client, and may have replaced the log: they load
+/// it again, which can recompact it.
+bool OpenSessionLog(ServerSession* session, Globals* globals) {
+  const string log_path = BuildLogPath(globals);
+  struct stat st;
+  if (session->build_log.get() && log_path == session->log_path &&
+      session->build_log->IsOpenAt(log_path) &&
+      stat(log_path.c_str(), &st) == 0 &&
+      st.st_size <= session->log_size_limit) {
+    return true;
+  }
+
+  session->build_log.reset();
+  session->build_log.reset(new BuildLog);
+  if (!OpenLog(session->build_log.get(), globals,
+               &session->disk_interface)) {
+    session->build_log.reset();
+    return false;
+  }
+  session->log_path = log_path;
+  off_t size = stat(log_path.c_str(), &st) == 0 ? st.st_size : 0;
+  session->log_size_limit = max(3 * size, (off_t)1 << 20);
+  return true;
+}
+
+/// Like OpenSessionLog(), for the deps log.
+bool OpenSessionDepsLog(ServerSession* session, Globals* globals) {
+  const string path = DepsLogPath(globals);
+  struct stat st;
+  if (session->deps_log.get() && path == session->deps_log_path &&
+      session->deps_log->IsOpenAt(path) &&
+      stat(path.c_str(), &st) == 0 &&
+      st.st_size <= session->deps_log_size_limit) {
+    return true;
+  }
+
+  session->deps_log.reset();
+  session->deps_log.reset(new DepsLog);
+  if (!OpenDepsLog(session->deps_log.get(), globals)) {
+    session->deps_log.reset();
+    return false;
+  }
+  session->deps_log_path = path;
+  off_t size = stat(path.c_str(), &st) == 0 ? st.st_size : 0;
+  session->deps_log_size_limit = max(3 * size, (off_t)1 << 20);
+  return true;
+}
+
+/// Run the build \a request asks for, as NinjaMain() would.  Returns the
+/// exit code, or -1 if the client should run the request itself.
+int ServeRequest(ServerSession* session, Globals* globals,
+                 const ServerRequest& request) {
+  vector<char*> args;
+  args.push_back(const_cast<char*>(globals->ninja_command));
+  for (vector<string>::const_iterator i = request.args.begin();
+       i != request.args.end(); ++i) {
+    args.push_back(const_cast<char*>(i->c_str()));
+  }
+  args.push_back(NULL);
+  int argc = (int)args.size() - 1;
+  char** argv = &args[0];
+
+  // getopt needs resetting to parse another argv.
+#ifdef __GLIBC__
+  optind = 0;
+#else
+  optind = 1;
+#if defined(__APPLE__) || defined(__FreeBSD__) || defined(__NetBSD__) || \
+    defined(__OpenBSD__)
+  optreset = 1;
+#endif
+#endif
+
+  // The client already parsed these flags without error, so ReadFlags()
+  // won't get to Fatal().  -C is the client's to follow: it found us in
+  // the directory it names.
+  Metrics* metrics = g_metrics;
+  Options options;
+  int exit_code = ReadFlags(&argc, &argv, &options, globals->config,
+                            globals);
+  if (g_metrics != metrics) {
+    // -d stats wants the counts of this process only.
+    delete g_metrics;
+    g_metrics = metrics;
+    return -1;
+  }
+  if (exit_code >= 0)
+    return exit_code;
+  if (options.tool || globals->config->dry_run ||
+      strcmp(options.input_file, globals->input_file) != 0) {
+    return -1;
+  }
+
+  const char* input_file = globals->input_file;
+  DiskInterface* disk_interface = &session->disk_interface;
+  string err;
+  if (g_use_file_watcher)
+    ForgetChangedMtimes(session, globals->state);
+  else
+    session->mtimes.clear();
+  if (ManifestChanged(globals, disk_interface)) {
+    session->mtimes.clear();
+    session->deps_log.reset();
+    globals->ResetState();
+    if (!LoadManifest(globals, input_file, disk_interface, &err)) {
+      Error("%s", err.c_str());
+      globals->ResetState();
+      return 1;
+    }
+  } else {
+    globals->state->Reset();
+  }
+  if (!OpenSessionLog(session, globals) ||
+      !OpenSessionDepsLog(session, globals)) {
+    return 1;
+  }
+
+  bool rebuilt_manifest;
+  {
+    Builder manifest_builder(globals->state, *globals->config,
+                             session->build_log.get(),
+                             session->deps_log.get(), disk_interface);
+    manifest_builder.UseMtimes(session->mtimes);
+    rebuilt_manifest = RebuildManifest(&manifest_builder, input_file, &err);
+  }
+  if (rebuilt_manifest) {
+    if (g_use_manifest_cache)
+      RefreshManifestCache(input_file, disk_interface);
+    session->mtimes.clear();
+    session->deps_log.reset();
+    State* old_state = globals->state;
+    bool old_state_cached = globals->state_cached;
+    globals->state = new State();
+    globals->state_cached = false;
+    globals->manifest_files.clear();
+    if (!LoadManifest(globals, input_file, disk_interface, &err,
+                      old_state_cached ? old_state : NULL)) {
+      Error("%s", err.c_str());
+      delete old_state;
+      globals->ResetState();
+      return 1;
+    }
+    CarryOverStats(old_state, globals->state, globals->manifest_files);
+    delete old_state;
+    if (!OpenSessionLog(session, globals) ||
+        !OpenSessionDepsLog(session, globals)) {
+      return 1;
+    }
+  } else if (!err.empty()) {
+    Error("rebuilding '%s': %s", input_file, err.c_str());
+    return 1;
   }
 
+  Builder builder(globals->state, *globals->config, session->build_log.get(),
+                  session->deps_log.get(), &session->disk_interface);
+  builder.UseMtimes(session->mtimes);
+  // Few files are left to stat, too few to read whole directories for.
+  if (!session->mtimes.empty())
+    g_use_stat_cache = false;
+  exit_code = RunBuild(&builder, &session->disk_interface, argc, argv);
+  if (g_use_file_watcher)
+    RecordMtimes(session, globals->state);
+  return exit_code;
+}
+
+int ToolServer(Globals* globals, int argc, char* argv[]) {
+  Server server;
+  string err;
+  if (!server.Listen(kServerSocketPath, &err)) {
+    Error("%s", err.c_str());
+    return 1;
+  }
+  printf("ninja: serving builds of '%s' on %s\n", globals->input_file,
+         kServerSocketPath);
+
+  // Each request starts out with the -d modes we started with.
+  const bool explaining = g_explaining;
+  const bool use_manifest_cache = g_use_manifest_cache;
+  const bool use_stat_cache = g_use_stat_cache;
+  const bool use_file_watcher = g_use_file_watcher;
+  BuildConfig* server_config = globals->config;
+
+  ServerSession session;
+  ServerRequest request;
+  while (server.Accept(&request, &err)) {
+    g_explaining = explaining;
+    g_use_manifest_cache = use_manifest_cache;
+    g_use_stat_cache = use_stat_cache;
+    g_use_file_watcher = use_file_watcher;
+    BuildConfig config;
+    InitConfig(&config);
+    globals->config = &config;
+    int exit_code = ServeRequest(&session, globals, request);
+    globals->config = server_config;
+    if (exit_code < 0)
+      server.Decline();
+    else
+      server.Reply(exit_code);
+  }
+  if (!err.empty()) {
+    Error("%s", err.c_str());
+    return 1;
+  }
+  return 0;
+}
+#endif  // _WIN32
+
+int NinjaMain(int argc, char** argv) {
+  BuildConfig config;
+  Globals globals;
+  globals.ninja_command = argv[0];
+  globals.config = &config;
+  const int original_argc = argc;
+  char** const original_argv = argv;
+
+  setvbuf(stdout, NULL, _IOLBF, BUFSIZ);
+
+  InitConfig(&config);
+  Options options;
+  int exit_code = ReadFlags(&argc, &argv, &options, &config, &globals);
+  if (exit_code >= 0)
+    return exit_code;
+  const char* input_file = options.input_file;
+  globals.input_file = input_file;
+  const Tool* tool = options.tool;
+  // The default targets could be anywhere.
+  globals.lazy_subninjas = options.lazy && !tool && argc > 0;
+
   if (tool && tool->when == Tool::RUN_AFTER_FLAGS)
     return tool->func(&globals, argc, argv);
 
-  if (working_dir) {
+  // The commands run remotely go through this ninja; find it from the
+  // build directory too.
+  config.ninja_command = globals.ninja_command;
+  if ((!config.remote_workers.empty() || options.action_cache_remote) &&
+      config.ninja_command.find('/') != string::npos &&
+      config.ninja_command[0] != '/') {
+    char cwd[PATH_MAX];
+    if (getcwd(cwd, sizeof(cwd)))
+      config.ninja_command = string(cwd) + "/" + config.ninja_command;
+  }
+  // Open the events file before -C, as given relative to here.
+  EventStream events;
+  if (options.events && !tool) {
+    string err;
+    if (!events.Open(options.events, &err))
+      Fatal("--events: %s", err.c_str());
+    config.events = &events;
+  }
+#ifndef _WIN32
+  // Likewise the action cache, which is often shared between checkouts.
+  auto_ptr<ActionCache> action_cache;
+  if (options.action_cache_dir && !tool) {
+    string dir = options.action_cache_dir;
+    char cwd[PATH_MAX];
+    if (dir[0] != '/' && getcwd(cwd, sizeof(cwd)))
+      dir = string(cwd) + "/" + dir;
+    action_cache.reset(new ActionCache(dir, options.action_cache_size));
+    config.action_cache = action_cache.get();
+    if (options.action_cache_remote) {
+      action_cache->SetRemote(options.action_cache_remote,
+                              config.ninja_command);
+    }
+  } else if (options.action_cache_remote && !tool) {
+    // What is uploaded is first stored there.
+    Fatal("--action-cache-remote needs --action-cache");
+  }
+#endif
+
+  if (options.working_dir) {
     // The formatting of this string, complete with funny quotes, is
     // so Emacs can properly identify that the cwd has changed for
     // subsequent commands.
     // Don't print this if a tool is being used, so that tool output
     // can be piped into a file without this string showing up.
     if (!tool)
-      printf("ninja: Entering directory `%s'\n", working_dir);
-    if (chdir(working_dir) < 0) {
-      Fatal("chdir to '%s' - %s", working_dir, strerror(errno));
+      printf("ninja: Entering directory `%s'\n", options.working_dir);
+    if (chdir(options.working_dir) < 0) {
+      Fatal("chdir to '%s' - %s", options.working_dir, strerror(errno));
+    }
+  }
+
+  // Share the jobs with the make or Ninja that runs us, if it has a
+  // jobserver, or else with the commands we run, if asked to.
+  Jobserver jobserver;
+  if (!tool && !config.dry_run) {
+    string jobserver_err;
+    if (jobserver.Connect(&jobserver_err) ||
+        (jobserver_err.empty() && options.serve_jobs &&
+         jobserver.Serve(config.parallelism, &jobserver_err))) {
+      config.jobserver = &jobserver;
+    } else if (!jobserver_err.empty()) {
+      Warning("jobserver: %s; running up to %d jobs",
+              jobserver_err.c_str(), config.parallelism);
     }
   }
 
+#ifndef _WIN32
+  // Hand the build to "ninja -t server", if one is running here.  Not
+  // with a jobserver, which the server can't share in, remote workers or
+  // an action cache.
+  if (!tool && !g_metrics && !g_tracer && !config.events &&
+      !config.dry_run && !config.jobserver &&
+      config.remote_workers.empty() && !config.action_cache &&
+      RunOnServer(kServerSocketPath, original_argc, original_argv,
+                  &exit_code)) {
+    return exit_code;
+  }
+#endif
+
   bool rebuilt_manifest = false;
+  // The state the manifest was rebuilt with, while reloading it, and
+  // whether it is what the manifest cache holds.
+  State* old_state = NULL;
+  bool old_state_cached = false;
 
 reload:
   RealDiskInterface disk_interface;
-  RealFileReader file_reader;
-  ManifestParser parser(globals.state, &file_reader);
   string err;
-  if (!parser.Load(input_file, &err)) {
+  if (!LoadManifest(&globals, input_file, &disk_interface, &err,
+                    old_state_cached ? old_state : NULL)) {
     Error("%s", err.c_str());
     return 1;
   }
+  if (old_state) {
+    CarryOverStats(old_state, globals.state, globals.manifest_files);
+    delete old_state;
+    old_state = NULL;
+  }
 
   if (tool && tool->when == Tool::RUN_AFTER_LOAD)
     return tool->func(&globals, argc, argv);
@@ -841,13 +2442,29 @@ reload:
   if (!OpenLog(&build_log, &globals, &disk_interface))
     return 1;
 
+  DepsLog deps_log;
+  if (!OpenDepsLog(&deps_log, &globals))
+    return 1;
+
+  if (globals.subninjas &&
+      !LoadSubninjas(&globals, &deps_log, argc, argv)) {
+    return 1;
+  }
+
   if (!rebuilt_manifest) { // Don't get caught in an infinite loop by a rebuild
                            // target that is never up to date.
-    Builder manifest_builder(globals.state, config, &build_log,
+    Builder manifest_builder(globals.state, config, &build_log, &deps_log,
                              &disk_interface);
     if (RebuildManifest(&manifest_builder, input_file, &err)) {
       rebuilt_manifest = true;
-      globals.ResetState();
+      if (g_use_manifest_cache)
+        RefreshManifestCache(input_file, &disk_interface);
+      old_state = globals.state;
+      old_state_cached = globals.state_cached;
+      globals.state = new State();
+      globals.state_cached = false;
+      delete globals.subninjas;
+      globals.subninjas = NULL;
       goto reload;
     } else if (!err.empty()) {
       Error("rebuilding '%s': %s", input_file, err.c_str());
@@ -855,10 +2472,29 @@ reload:
     }
   }
 
-  Builder builder(globals.state, config, &build_log, &disk_interface);
-  int result = RunBuild(&builder, argc, argv);
-  if (g_metrics)
-    DumpMetrics(&globals);
+  Builder builder(globals.state, config, &build_log, &deps_log,
+                  &disk_interface);
+  BuildEstimate* estimate = NULL;
+  if (options.estimate) {
+    estimate = new BuildEstimate(config, &build_log, &builder.plan_);
+    builder.command_runner_.reset(estimate);
+  }
+  int result = RunBuild(&builder, &disk_interface, argc, argv);
+  if (estimate && result == 0 && estimate->commands())
+    estimate->Print();
+#ifndef _WIN32
+  if (action_cache.get())
+    action_cache->Trim();
+#endif
+  if (g_metrics) {
+    DumpMetrics(&globals, &build_log);
+    if (builder.command_runner_.get())
+      builder.command_runner_->Report();
+#ifndef _WIN32
+    if (action_cache.get())
+      action_cache->Report();
+#endif
+  }
   return result;
 }
 
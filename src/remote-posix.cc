@@ -0,0 +1,837 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "remote.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/fs.h>  // FICLONE
+#endif
+
+#include <algorithm>
+#include <set>
+
+#include "build_log.h"
+#include "disk_interface.h"
+#include "util.h"
+
+// Protocol, over TCP, in the byte order of the machines, which are
+// expected to be alike:
+// - every connection starts with the token, which the worker checks
+//   before reading anything else;
+// - a client asking how many commands the worker runs at once sends
+//   kQuery, and reads back the count;
+// - a client running a command sends kJob, the command, the paths of the
+//   inputs followed by the hash, size and mode of each, and the paths of
+//   the outputs; the worker answers with the indices of the inputs it
+//   doesn't have, whose contents the client then sends one after the
+//   other;
+// - the worker runs the command and answers with its exit code and
+//   output, and for each output whether it was written and if so its
+//   mode and contents.
+// A client that goes away stops the command.
+
+namespace {
+
+const char kQuery = 'Q';
+const char kJob = 'J';
+
+/// Limits on what a message may contain, against garbage on the socket.
+const uint32_t kMaxStrings = 1 << 20;
+const uint32_t kMaxStringLength = 1 << 30;
+const uint32_t kMaxTokenLength = 4 << 10;
+
+#ifdef MSG_NOSIGNAL
+const int kSendFlags = MSG_NOSIGNAL;
+#else
+const int kSendFlags = 0;
+#endif
+
+/// The secret shared by workers and clients, from NINJA_REMOTE_TOKEN.
+bool GetRemoteToken(string* token, string* err) {
+  const char* value = getenv("NINJA_REMOTE_TOKEN");
+  if (!value || !*value) {
+    *err = "NINJA_REMOTE_TOKEN isn't set";
+    return false;
+  }
+  *token = value;
+  return true;
+}
+
+/// Whether \a token is \a expected, taking as long wherever they differ.
+bool TokenMatches(const string& token, const string& expected) {
+  unsigned char diff = token.size() != expected.size();
+  for (size_t i = 0; i < token.size() && i < expected.size(); ++i)
+    diff |= token[i] ^ expected[i];
+  return diff == 0;
+}
+
+bool ReadAll(int fd, void* data, size_t size) {
+  char* p = static_cast<char*>(data);
+  while (size > 0) {
+    ssize_t len = read(fd, p, size);
+    if (len < 0 && errno == EINTR)
+      continue;
+    if (len <= 0)
+      return false;
+    p += len;
+    size -= len;
+  }
+  return true;
+}
+
+void PutU32(string* buf, uint32_t value) {
+  buf->append((const char*)&value, sizeof(value));
+}
+
+void PutU64(string* buf, uint64_t value) {
+  buf->append((const char*)&value, sizeof(value));
+}
+
+void PutString(string* buf, const string& str) {
+  PutU32(buf, (uint32_t)str.size());
+  buf->append(str);
+}
+
+void PutStrings(string* buf, const vector<string>& strings) {
+  PutU32(buf, (uint32_t)strings.size());
+  for (vector<string>::const_iterator i = strings.begin();
+       i != strings.end(); ++i) {
+    PutString(buf, *i);
+  }
+}
+
+bool GetU32(int fd, uint32_t* value) {
+  return ReadAll(fd, value, sizeof(*value));
+}
+
+bool GetU64(int fd, uint64_t* value) {
+  return ReadAll(fd, value, sizeof(*value));
+}
+
+bool GetString(int fd, string* str) {
+  uint32_t len;
+  if (!GetU32(fd, &len) || len > kMaxStringLength)
+    return false;
+  str->resize(len);
+  return len == 0 || ReadAll(fd, &(*str)[0], len);
+}
+
+bool GetStrings(int fd, vector<string>* strings) {
+  uint32_t count;
+  if (!GetU32(fd, &count) || count > kMaxStrings)
+    return false;
+  strings->resize(count);
+  for (uint32_t i = 0; i < count; ++i) {
+    if (!GetString(fd, &(*strings)[i]))
+      return false;
+  }
+  return true;
+}
+
+/// Add \a path to \a files if it is a file, or the files under it if it
+/// is a directory.  Missing paths, e.g. those of phony targets, are
+/// skipped.
+void ListFiles(const string& path, set<string>* files) {
+  struct stat st;
+  if (stat(path.c_str(), &st) < 0)
+    return;
+  if (S_ISREG(st.st_mode)) {
+    files->insert(path);
+    return;
+  }
+  if (!S_ISDIR(st.st_mode))
+    return;
+  DIR* dir = opendir(path.c_str());
+  if (!dir)
+    return;
+  while (struct dirent* entry = readdir(dir)) {
+    string name = entry->d_name;
+    if (name == "." || name == "..")
+      continue;
+    string child = path + "/" + name;
+    // Don't follow links to directories, which may loop.
+    if (lstat(child.c_str(), &st) == 0 && S_ISLNK(st.st_mode) &&
+        (stat(child.c_str(), &st) < 0 || !S_ISREG(st.st_mode))) {
+      continue;
+    }
+    ListFiles(child, files);
+  }
+  closedir(dir);
+}
+
+/// Remove \a path, and everything under it if it is a directory.
+void RemoveTree(const string& path) {
+  struct stat st;
+  if (lstat(path.c_str(), &st) < 0)
+    return;
+  if (S_ISDIR(st.st_mode)) {
+    if (DIR* dir = opendir(path.c_str())) {
+      while (struct dirent* entry = readdir(dir)) {
+        string name = entry->d_name;
+        if (name != "." && name != "..")
+          RemoveTree(path + "/" + name);
+      }
+      closedir(dir);
+    }
+    rmdir(path.c_str());
+  } else {
+    unlink(path.c_str());
+  }
+}
+
+/// The number of "../" that \a path starts with, or -1 if it leads
+/// anywhere but below the directory that many levels up.
+int UpLevels(const string& path) {
+  if (path.empty() || path[0] == '/')
+    return -1;
+  int levels = 0;
+  size_t start = 0;
+  while (path.compare(start, 3, "../") == 0) {
+    ++levels;
+    start += 3;
+  }
+  for (size_t i = start; i < path.size(); ) {
+    size_t end = path.find('/', i);
+    if (end == string::npos)
+      end = path.size();
+    string component = path.substr(i, end - i);
+    if (component.empty() || component == "." || component == "..")
+      return -1;
+    i = end + 1;
+  }
+  return levels;
+}
+
+/// Where the worker keeps an uploaded file.  Executables are kept apart,
+/// as the copies of a file share its mode.
+string BlobPath(const string& cache_dir, uint64_t hash, uint64_t size,
+                uint32_t mode) {
+  char name[64];
+  snprintf(name, sizeof(name), "/blobs/%016llx-%llu%s",
+           (unsigned long long)hash, (unsigned long long)size,
+           (mode & 0111) ? "x" : "");
+  return cache_dir + name;
+}
+
+/// Copy the blob \a blob to \a path, so that the command may change it
+/// without changing the blob: as a reflink where the file system can
+/// share the blocks, or else in full.
+bool CopyBlob(const string& blob, const string& path, uint32_t mode) {
+  int in_fd = open(blob.c_str(), O_RDONLY);
+  if (in_fd < 0)
+    return false;
+  int out_fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  if (out_fd < 0) {
+    close(in_fd);
+    return false;
+  }
+  bool ok = false;
+#ifdef FICLONE
+  ok = ioctl(out_fd, FICLONE, in_fd) == 0;
+#endif
+  char buf[64 << 10];
+  while (!ok) {
+    ssize_t len = read(in_fd, buf, sizeof(buf));
+    if (len < 0 && errno == EINTR)
+      continue;
+    if (len <= 0) {
+      ok = len == 0;
+      break;
+    }
+    const char* p = buf;
+    while (len > 0) {
+      ssize_t written = write(out_fd, p, len);
+      if (written < 0 && errno == EINTR)
+        continue;
+      if (written < 0)
+        break;
+      p += written;
+      len -= written;
+    }
+    if (len > 0)
+      break;
+  }
+  ok = ok && fchmod(out_fd, (mode & 0111) ? 0755 : 0644) == 0;
+  close(in_fd);
+  return close(out_fd) == 0 && ok;
+}
+
+/// Run \a command in \a dir, collecting its output, until it exits or
+/// the client on \a client_fd goes away.  Returns its exit code.
+int RunCommand(const string& command, const string& dir, int client_fd,
+               string* output) {
+  int pipe_fds[2];
+  if (pipe(pipe_fds) < 0) {
+    *output = string("pipe: ") + strerror(errno) + "\n";
+    return 1;
+  }
+  pid_t pid = fork();
+  if (pid < 0) {
+    *output = string("fork: ") + strerror(errno) + "\n";
+    return 1;
+  }
+  if (pid == 0) {
+    setpgid(0, 0);
+    int devnull = open("/dev/null", O_RDONLY);
+    dup2(devnull, 0);
+    dup2(pipe_fds[1], 1);
+    dup2(pipe_fds[1], 2);
+    if (chdir(dir.c_str()) < 0)
+      _exit(1);
+    execl("/bin/sh", "/bin/sh", "-c", command.c_str(), (char*)NULL);
+    _exit(127);
+  }
+  setpgid(pid, pid);
+  close(pipe_fds[1]);
+
+  struct pollfd fds[2];
+  fds[0].fd = pipe_fds[0];
+  fds[0].events = POLLIN;
+  fds[1].fd = client_fd;
+  fds[1].events = POLLIN;
+  char buf[4 << 10];
+  for (;;) {
+    if (poll(fds, 2, -1) < 0) {
+      if (errno == EINTR)
+        continue;
+      break;
+    }
+    if (fds[1].revents) {
+      // The client sends nothing more until it has the result, so this
+      // is it going away.
+      kill(-pid, SIGKILL);
+      break;
+    }
+    if (fds[0].revents) {
+      ssize_t len = read(pipe_fds[0], buf, sizeof(buf));
+      if (len < 0 && errno == EINTR)
+        continue;
+      if (len <= 0)
+        break;
+      output->append(buf, len);
+    }
+  }
+  close(pipe_fds[0]);
+
+  int status;
+  while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {}
+  if (WIFEXITED(status))
+    return WEXITSTATUS(status);
+  return 128 + WTERMSIG(status);
+}
+
+/// Serve the job that follows on \a fd.
+void ServeJob(int fd, const string& cache_dir) {
+  string command;
+  vector<string> inputs, outputs;
+  if (!GetString(fd, &command) || !GetStrings(fd, &inputs))
+    return;
+  vector<uint64_t> hashes(inputs.size()), sizes(inputs.size());
+  vector<uint32_t> modes(inputs.size());
+  for (size_t i = 0; i < inputs.size(); ++i) {
+    if (!GetU64(fd, &hashes[i]) || !GetU64(fd, &sizes[i]) ||
+        !GetU32(fd, &modes[i]) || sizes[i] > kMaxStringLength) {
+      return;
+    }
+  }
+  if (!GetStrings(fd, &outputs))
+    return;
+
+  // The build directory is as deep in the scratch directory as the paths
+  // reach up out of it.
+  int depth = 0;
+  for (size_t i = 0; i < inputs.size() + outputs.size(); ++i) {
+    int levels = UpLevels(i < inputs.size() ? inputs[i]
+                                            : outputs[i - inputs.size()]);
+    if (levels < 0)
+      return;
+    depth = max(depth, levels);
+  }
+
+  string reply;
+  vector<uint32_t> missing;
+  for (size_t i = 0; i < inputs.size(); ++i) {
+    string blob = BlobPath(cache_dir, hashes[i], sizes[i], modes[i]);
+    if (access(blob.c_str(), F_OK) < 0)
+      missing.push_back((uint32_t)i);
+  }
+  PutU32(&reply, (uint32_t)missing.size());
+  for (vector<uint32_t>::iterator i = missing.begin(); i != missing.end(); ++i)
+    PutU32(&reply, *i);
+  if (!SendAll(fd, reply.data(), reply.size()))
+    return;
+
+  for (vector<uint32_t>::iterator i = missing.begin(); i != missing.end();
+       ++i) {
+    string contents(sizes[*i], '\0');
+    if (!contents.empty() && !ReadAll(fd, &contents[0], contents.size()))
+      return;
+    if (BuildLog::LogEntry::HashCommand(contents) != hashes[*i])
+      return;
+    // Other jobs may be after the same file; whichever is first to
+    // rename its copy into place wins.
+    string temp = cache_dir + "/blobs/tmp.XXXXXX";
+    int temp_fd = mkstemp(&temp[0]);
+    if (temp_fd < 0)
+      return;
+    bool written = write(temp_fd, contents.data(), contents.size()) ==
+                   (ssize_t)contents.size();
+    fchmod(temp_fd, (modes[*i] & 0111) ? 0755 : 0644);
+    close(temp_fd);
+    string blob = BlobPath(cache_dir, hashes[*i], sizes[*i], modes[*i]);
+    if (!written || rename(temp.c_str(), blob.c_str()) < 0) {
+      unlink(temp.c_str());
+      return;
+    }
+  }
+
+  string root = cache_dir + "/work/XXXXXX";
+  if (!mkdtemp(&root[0]))
+    return;
+  string build_dir = root;
+  for (int i = 0; i < depth; ++i)
+    build_dir += "/w";
+  RealDiskInterface disk_interface;
+  disk_interface.MakeDirs(build_dir + "/.");
+  for (size_t i = 0; i < inputs.size(); ++i) {
+    string path = build_dir + "/" + inputs[i];
+    string blob = BlobPath(cache_dir, hashes[i], sizes[i], modes[i]);
+    disk_interface.MakeDirs(path);
+    // Not a hard link, through which the command could change the blob.
+    if (!CopyBlob(blob, path, modes[i])) {
+      RemoveTree(root);
+      return;
+    }
+  }
+  for (vector<string>::iterator i = outputs.begin(); i != outputs.end(); ++i)
+    disk_interface.MakeDirs(build_dir + "/" + *i);
+
+  string output;
+  int exit_code = RunCommand(command, build_dir, fd, &output);
+
+  reply.clear();
+  PutU32(&reply, (uint32_t)exit_code);
+  PutString(&reply, output);
+  for (vector<string>::iterator i = outputs.begin(); i != outputs.end(); ++i) {
+    string path = build_dir + "/" + *i;
+    string contents, err;
+    struct stat st;
+    if (stat(path.c_str(), &st) < 0 || !S_ISREG(st.st_mode) ||
+        ::ReadFile(path, &contents, &err) < 0) {
+      PutU32(&reply, 0);
+      continue;
+    }
+    PutU32(&reply, 1);
+    PutU32(&reply, st.st_mode & 0777);
+    PutString(&reply, contents);
+  }
+  SendAll(fd, reply.data(), reply.size());
+  RemoveTree(root);
+}
+
+volatile sig_atomic_t g_quit;
+
+void HandleWorkerSignal(int signum) {
+  g_quit = 1;
+}
+
+}  // anonymous namespace
+
+bool SendAll(int fd, const void* data, size_t size) {
+  const char* p = static_cast<const char*>(data);
+  while (size > 0) {
+    ssize_t len = send(fd, p, size, kSendFlags);
+    if (len < 0 && errno == EINTR)
+      continue;
+    if (len <= 0)
+      return false;
+    p += len;
+    size -= len;
+  }
+  return true;
+}
+
+int ConnectTcp(const string& host, int port, string* err) {
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  char service[16];
+  snprintf(service, sizeof(service), "%d", port);
+  struct addrinfo* addrs;
+  int ret = getaddrinfo(host.c_str(), service, &hints, &addrs);
+  if (ret != 0) {
+    *err = host + ": " + gai_strerror(ret);
+    return -1;
+  }
+  int fd = -1;
+  for (struct addrinfo* addr = addrs; addr; addr = addr->ai_next) {
+    fd = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+    if (fd < 0)
+      continue;
+    if (connect(fd, addr->ai_addr, addr->ai_addrlen) == 0)
+      break;
+    close(fd);
+    fd = -1;
+  }
+  if (fd < 0)
+    *err = host + ": " + strerror(errno);
+  freeaddrinfo(addrs);
+  if (fd < 0)
+    return -1;
+  SetCloseOnExec(fd);
+  int on = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+#ifdef SO_NOSIGPIPE
+  setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+  return fd;
+}
+
+int ListenTcp(const string& host, int port, string* err) {
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE;
+  char service[16];
+  snprintf(service, sizeof(service), "%d", port);
+  struct addrinfo* addrs;
+  int ret = getaddrinfo(host.c_str(), service, &hints, &addrs);
+  if (ret != 0) {
+    *err = host + ": " + gai_strerror(ret);
+    return -1;
+  }
+  int listen_fd = -1;
+  for (struct addrinfo* addr = addrs; addr; addr = addr->ai_next) {
+    listen_fd = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+    if (listen_fd < 0)
+      continue;
+    SetCloseOnExec(listen_fd);
+    int on = 1;
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    if (bind(listen_fd, addr->ai_addr, addr->ai_addrlen) == 0 &&
+        listen(listen_fd, 64) == 0) {
+      break;
+    }
+    close(listen_fd);
+    listen_fd = -1;
+  }
+  if (listen_fd < 0)
+    *err = host + ":" + service + ": " + strerror(errno);
+  freeaddrinfo(addrs);
+  return listen_fd;
+}
+
+bool RemoteJob::Save(const string& path, string* err) const {
+  string buf;
+  PutString(&buf, command);
+  PutStrings(&buf, inputs);
+  PutStrings(&buf, outputs);
+  RealDiskInterface disk_interface;
+  if (!disk_interface.WriteFile(path, buf)) {
+    *err = path + ": " + strerror(errno);
+    return false;
+  }
+  return true;
+}
+
+bool RemoteJob::Load(const string& path, string* err) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    *err = path + ": " + strerror(errno);
+    return false;
+  }
+  bool ok = GetString(fd, &command) && GetStrings(fd, &inputs) &&
+            GetStrings(fd, &outputs);
+  close(fd);
+  if (!ok)
+    *err = path + ": not a remote job";
+  return ok;
+}
+
+bool ParseRemoteAddress(const string& address, string* host, int* port,
+                        string* err) {
+  string::size_type colon = address.rfind(':');
+  if (colon == string::npos || colon == 0) {
+    *err = "expected HOST:PORT, not '" + address + "'";
+    return false;
+  }
+  char* end;
+  long value = strtol(address.c_str() + colon + 1, &end, 10);
+  if (*end != '\0' || value <= 0 || value > 65535) {
+    *err = "bad port in '" + address + "'";
+    return false;
+  }
+  *host = address.substr(0, colon);
+  // An IPv6 address is written in brackets, to tell its colons apart.
+  if (host->size() > 2 && (*host)[0] == '[' &&
+      (*host)[host->size() - 1] == ']') {
+    *host = host->substr(1, host->size() - 2);
+  }
+  *port = (int)value;
+  return true;
+}
+
+int QueryRemoteSlots(const string& address, string* err) {
+  string host;
+  int port;
+  if (!ParseRemoteAddress(address, &host, &port, err))
+    return 0;
+  string token;
+  if (!GetRemoteToken(&token, err))
+    return 0;
+  int fd = ConnectTcp(host, port, err);
+  if (fd < 0)
+    return 0;
+  string request;
+  PutString(&request, token);
+  request += kQuery;
+  uint32_t slots = 0;
+  if (!SendAll(fd, request.data(), request.size()) || !GetU32(fd, &slots))
+    *err = "no answer from " + address;
+  close(fd);
+  return (int)slots;
+}
+
+bool RunRemoteJob(const string& address, const RemoteJob& job,
+                  string* output, int* exit_code, bool* ran, string* err) {
+  *ran = false;
+  string host;
+  int port;
+  string token;
+  if (!ParseRemoteAddress(address, &host, &port, err) ||
+      !GetRemoteToken(&token, err)) {
+    return false;
+  }
+
+  set<string> files;
+  for (vector<string>::const_iterator i = job.inputs.begin();
+       i != job.inputs.end(); ++i) {
+    string path = *i;
+    string path_err;
+    if (path.empty() || path[0] == '/' || !CanonicalizePath(&path, &path_err))
+      continue;
+    ListFiles(path, &files);
+  }
+  vector<string> inputs(files.begin(), files.end());
+  vector<uint64_t> sizes(inputs.size());
+  string request;
+  PutString(&request, token);
+  request += kJob;
+  PutString(&request, job.command);
+  PutStrings(&request, inputs);
+  for (size_t i = 0; i < inputs.size(); ++i) {
+    string contents;
+    struct stat st;
+    if (::ReadFile(inputs[i], &contents, err) < 0 ||
+        stat(inputs[i].c_str(), &st) < 0) {
+      return false;
+    }
+    sizes[i] = contents.size();
+    PutU64(&request, BuildLog::LogEntry::HashCommand(contents));
+    PutU64(&request, sizes[i]);
+    PutU32(&request, st.st_mode & 0777);
+  }
+  PutStrings(&request, job.outputs);
+
+  int fd = ConnectTcp(host, port, err);
+  if (fd < 0)
+    return false;
+  uint32_t count;
+  if (!SendAll(fd, request.data(), request.size()) || !GetU32(fd, &count) ||
+      count > inputs.size()) {
+    *err = "lost connection to " + address;
+    close(fd);
+    return false;
+  }
+  vector<uint32_t> missing(count);
+  for (uint32_t i = 0; i < count; ++i) {
+    if (!GetU32(fd, &missing[i]) || missing[i] >= inputs.size()) {
+      *err = "lost connection to " + address;
+      close(fd);
+      return false;
+    }
+  }
+  for (vector<uint32_t>::iterator i = missing.begin(); i != missing.end();
+       ++i) {
+    string contents;
+    if (::ReadFile(inputs[*i], &contents, err) < 0) {
+      close(fd);
+      return false;
+    }
+    if (contents.size() != sizes[*i]) {
+      *err = inputs[*i] + " changed while uploading it";
+      close(fd);
+      return false;
+    }
+    if (!SendAll(fd, contents.data(), contents.size())) {
+      *err = "lost connection to " + address;
+      close(fd);
+      return false;
+    }
+  }
+
+  // From here on the command may be running.
+  *ran = true;
+  uint32_t code;
+  if (!GetU32(fd, &code) || !GetString(fd, output)) {
+    *err = "lost connection to " + address;
+    close(fd);
+    return false;
+  }
+  *exit_code = (int)code;
+  RealDiskInterface disk_interface;
+  for (vector<string>::const_iterator i = job.outputs.begin();
+       i != job.outputs.end(); ++i) {
+    uint32_t written, mode;
+    string contents;
+    if (!GetU32(fd, &written) ||
+        (written && (!GetU32(fd, &mode) || !GetString(fd, &contents)))) {
+      *err = "lost connection to " + address;
+      close(fd);
+      return false;
+    }
+    if (!written)
+      continue;
+    if (!disk_interface.MakeDirs(*i) ||
+        !disk_interface.WriteFile(*i, contents)) {
+      *err = *i + ": " + strerror(errno);
+      close(fd);
+      return false;
+    }
+    chmod(i->c_str(), mode);
+  }
+  close(fd);
+  return true;
+}
+
+bool ServeRemoteJobs(const string& host, int port, int jobs,
+                     const string& cache_dir, string* err) {
+  string expected_token;
+  if (!GetRemoteToken(&expected_token, err))
+    return false;
+
+  mkdir(cache_dir.c_str(), 0777);
+  mkdir((cache_dir + "/blobs").c_str(), 0777);
+  mkdir((cache_dir + "/work").c_str(), 0777);
+
+  int listen_fd = ListenTcp(host, port, err);
+  if (listen_fd < 0)
+    return false;
+  int on = 1;
+
+  // No SA_RESTART, so that accept() and waitpid() return.
+  struct sigaction act;
+  memset(&act, 0, sizeof(act));
+  act.sa_handler = HandleWorkerSignal;
+  sigaction(SIGINT, &act, NULL);
+  sigaction(SIGTERM, &act, NULL);
+
+  int running = 0;
+  while (!g_quit) {
+    while (running > 0 && waitpid(-1, NULL, WNOHANG) > 0)
+      --running;
+    int fd = accept(listen_fd, NULL, NULL);
+    if (fd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      *err = string("accept: ") + strerror(errno);
+      close(listen_fd);
+      return false;
+    }
+    SetCloseOnExec(fd);
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+#ifdef SO_NOSIGPIPE
+    setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+    // Don't let a client that sends nothing hold up the others.
+    struct timeval timeout = { 10, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    uint32_t token_len;
+    string token;
+    if (!GetU32(fd, &token_len) || token_len > kMaxTokenLength) {
+      close(fd);
+      continue;
+    }
+    token.resize(token_len);
+    if ((token_len > 0 && !ReadAll(fd, &token[0], token_len)) ||
+        !TokenMatches(token, expected_token)) {
+      Warning("turning away a client without the token");
+      close(fd);
+      continue;
+    }
+
+    char kind;
+    if (!ReadAll(fd, &kind, 1)) {
+      close(fd);
+      continue;
+    }
+    if (kind == kQuery) {
+      string reply;
+      PutU32(&reply, (uint32_t)jobs);
+      SendAll(fd, reply.data(), reply.size());
+      close(fd);
+      continue;
+    }
+    if (kind != kJob) {
+      close(fd);
+      continue;
+    }
+
+    // Wait for a free slot; the client waits with us.
+    while (running >= jobs && !g_quit) {
+      if (waitpid(-1, NULL, 0) > 0)
+        --running;
+    }
+    if (g_quit) {
+      close(fd);
+      break;
+    }
+    pid_t pid = fork();
+    if (pid == 0) {
+      signal(SIGINT, SIG_DFL);
+      signal(SIGTERM, SIG_DFL);
+      close(listen_fd);
+      struct timeval no_timeout = { 0, 0 };
+      setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &no_timeout,
+                 sizeof(no_timeout));
+      ServeJob(fd, cache_dir);
+      _exit(0);
+    }
+    if (pid > 0)
+      ++running;
+    close(fd);
+  }
+  close(listen_fd);
+  return true;
+}
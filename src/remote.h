@@ -0,0 +1,89 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef NINJA_REMOTE_H_
+#define NINJA_REMOTE_H_
+
+#include <string>
+#include <vector>
+using namespace std;
+
+/// Remote execution (see "ninja -t worker"), in which the commands of
+/// rules marked "remote" run on other machines.  A worker listens on a
+/// TCP port.  Workers and clients share a secret, the token in
+/// NINJA_REMOTE_TOKEN, and a worker hangs up on a client that doesn't
+/// send it first; it isn't encrypted, nor is anything else sent.
+/// For each command a client connects, names the files the
+/// command reads by the hash of their contents, and uploads those the
+/// worker hasn't seen before; the worker lays the files out in a scratch
+/// directory as they are laid out around the build directory, runs the
+/// command there, and sends back its exit code, its output and the files
+/// it wrote.  Absolute paths, like those of the compiler and the system
+/// headers, aren't sent: the workers are expected to have the same ones.
+/// POSIX only.
+
+/// A command to run on a worker.
+struct RemoteJob {
+  string command;
+  /// The files the command reads, relative to the build directory or
+  /// absolute.  A directory stands for the files under it.
+  vector<string> inputs;
+  /// The files the command writes, relative to the build directory.
+  vector<string> outputs;
+
+  /// Write the job to the file \a path, for "ninja -t remote-exec".
+  bool Save(const string& path, string* err) const;
+
+  /// Read a job written by Save().
+  bool Load(const string& path, string* err);
+};
+
+/// Split a worker's address, "HOST:PORT".
+bool ParseRemoteAddress(const string& address, string* host, int* port,
+                        string* err);
+
+/// Ask the worker at \a address how many commands it runs at once.
+/// Returns 0, filling in \a err, if it can't be reached.
+int QueryRemoteSlots(const string& address, string* err);
+
+/// Run \a job on the worker at \a address, writing the files it wrote
+/// here.  Sets \a output to what the command printed and \a exit_code to
+/// its exit code.  Returns false, filling in \a err, if the worker could
+/// not be reached or dropped the connection; \a ran tells whether that
+/// was after the command may have started.
+bool RunRemoteJob(const string& address, const RemoteJob& job,
+                  string* output, int* exit_code, bool* ran, string* err);
+
+/// Serve jobs on \a port of the address \a host, running up to \a jobs
+/// commands at once and keeping the files uploaded under \a cache_dir,
+/// until stopped by SIGINT or SIGTERM.  Returns false, filling in \a err,
+/// if it can't, as when there is no token to expect.
+bool ServeRemoteJobs(const string& host, int port, int jobs,
+                     const string& cache_dir, string* err);
+
+/// Socket helpers, also used by the HTTP cache (see http_cache.h).
+
+/// Send all of \a data on the socket \a fd.
+bool SendAll(int fd, const void* data, size_t size);
+
+/// Connect to \a port on \a host.  Returns the socket, or -1 filling in
+/// \a err.
+int ConnectTcp(const string& host, int port, string* err);
+
+/// Listen on \a port of the address \a host, such as "localhost", or
+/// "0.0.0.0" for all addresses.  Returns the socket, or -1 filling in
+/// \a err.
+int ListenTcp(const string& host, int port, string* err);
+
+#endif  // NINJA_REMOTE_H_
@@ -0,0 +1,152 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "remote.h"
+
+#include <signal.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "disk_interface.h"
+#include "test.h"
+
+TEST(RemoteTest, ParseRemoteAddress) {
+  string host, err;
+  int port = 0;
+  EXPECT_TRUE(ParseRemoteAddress("build1.example.com:8765", &host, &port,
+                                 &err));
+  EXPECT_EQ("build1.example.com", host);
+  EXPECT_EQ(8765, port);
+
+  EXPECT_TRUE(ParseRemoteAddress("[::1]:99", &host, &port, &err));
+  EXPECT_EQ("::1", host);
+  EXPECT_EQ(99, port);
+
+  EXPECT_FALSE(ParseRemoteAddress("build1", &host, &port, &err));
+  EXPECT_EQ("expected HOST:PORT, not 'build1'", err);
+  EXPECT_FALSE(ParseRemoteAddress("build1:http", &host, &port, &err));
+  EXPECT_EQ("bad port in 'build1:http'", err);
+}
+
+TEST(RemoteTest, SaveAndLoad) {
+  ScopedTempDir temp_dir;
+  temp_dir.CreateAndEnter("ninja_remote_test");
+
+  RemoteJob job;
+  job.command = "cc -c in.c\n-o out.o";
+  job.inputs.push_back("in.c");
+  job.inputs.push_back("../include");
+  job.outputs.push_back("out.o");
+  string err;
+  ASSERT_TRUE(job.Save("job", &err));
+
+  RemoteJob loaded;
+  ASSERT_TRUE(loaded.Load("job", &err));
+  EXPECT_EQ(job.command, loaded.command);
+  EXPECT_EQ(job.inputs, loaded.inputs);
+  EXPECT_EQ(job.outputs, loaded.outputs);
+
+  EXPECT_FALSE(loaded.Load("missing", &err));
+  temp_dir.Cleanup();
+}
+
+TEST(RemoteTest, RunOnWorker) {
+  ScopedTempDir temp_dir;
+  temp_dir.CreateAndEnter("ninja_remote_test");
+  RealDiskInterface disk_interface;
+  // The build directory is a level down, with sources beside it.
+  ASSERT_TRUE(disk_interface.MakeDirs("src/inc/a.h"));
+  ASSERT_TRUE(disk_interface.WriteFile("src/in.txt", "hello\n"));
+  ASSERT_TRUE(disk_interface.WriteFile("src/inc/a.h", "header\n"));
+  ASSERT_TRUE(disk_interface.MakeDir("out"));
+  ASSERT_EQ(0, chdir("out"));
+
+  // A port unlikely to be in use, so that tests run side by side don't
+  // collide.
+  int port = 20000 + getpid() % 20000;
+  const char* old_token = getenv("NINJA_REMOTE_TOKEN");
+  string saved_token = old_token ? old_token : "";
+  setenv("NINJA_REMOTE_TOKEN", "secret", 1);
+  pid_t worker = fork();
+  ASSERT_LE(0, worker);
+  if (worker == 0) {
+    string err;
+    _exit(ServeRemoteJobs("localhost", port, 2, "../cache", &err) ? 0 : 1);
+  }
+
+  char address[32];
+  snprintf(address, sizeof(address), "localhost:%d", port);
+  string err;
+  int slots = 0;
+  for (int tries = 0; tries < 100 && slots == 0; ++tries) {
+    slots = QueryRemoteSlots(address, &err);
+    if (slots == 0)
+      usleep(20 * 1000);
+  }
+  EXPECT_EQ(2, slots);
+
+  // Without the token, the worker hangs up.
+  setenv("NINJA_REMOTE_TOKEN", "guess", 1);
+  EXPECT_EQ(0, QueryRemoteSlots(address, &err));
+  unsetenv("NINJA_REMOTE_TOKEN");
+  EXPECT_EQ(0, QueryRemoteSlots(address, &err));
+  EXPECT_EQ("NINJA_REMOTE_TOKEN isn't set", err);
+  setenv("NINJA_REMOTE_TOKEN", "secret", 1);
+
+  // The command changes its copy of an input, not the worker's.
+  RemoteJob job;
+  job.command = "cat ../src/in.txt ../src/inc/a.h > gen/result; "
+                "echo changed >> ../src/in.txt; echo done; exit 3";
+  job.inputs.push_back("../src/in.txt");
+  job.inputs.push_back("../src/inc");
+  job.inputs.push_back("/usr/include");
+  job.outputs.push_back("gen/result");
+  job.outputs.push_back("gen/never_written");
+  // The second time round, the worker has the inputs already.
+  for (int run = 0; run < 2; ++run) {
+    string output;
+    int exit_code = 0;
+    bool ran = false;
+    ASSERT_TRUE(RunRemoteJob(address, job, &output, &exit_code, &ran, &err))
+        << err;
+    EXPECT_TRUE(ran);
+    EXPECT_EQ(3, exit_code);
+    EXPECT_EQ("done\n", output);
+    EXPECT_EQ("hello\nheader\n", disk_interface.ReadFile("gen/result", &err));
+    EXPECT_EQ(0, disk_interface.Stat("gen/never_written"));
+    unlink("gen/result");
+  }
+
+  kill(worker, SIGTERM);
+  int status;
+  waitpid(worker, &status, 0);
+  EXPECT_TRUE(WIFEXITED(status));
+
+  // Without a worker, nothing runs.
+  string output;
+  int exit_code;
+  bool ran = true;
+  EXPECT_FALSE(RunRemoteJob(address, job, &output, &exit_code, &ran, &err));
+  EXPECT_FALSE(ran);
+
+  if (old_token)
+    setenv("NINJA_REMOTE_TOKEN", saved_token.c_str(), 1);
+  else
+    unsetenv("NINJA_REMOTE_TOKEN");
+
+  ASSERT_EQ(0, chdir(".."));
+  temp_dir.Cleanup();
+}
@@ -0,0 +1,46 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#ifndef NINJA_RESOURCE_USAGE_H_
+#define NINJA_RESOURCE_USAGE_H_
+
+#include "util.h"  // int64_t
+
+/// What a command used of the machine, as far as the platform tells;
+/// what it doesn't is 0.
+struct ResourceUsage {
+  ResourceUsage()
+      : user_millis(0), system_millis(0), peak_rss(0), blocks_read(0),
+        blocks_written(0), context_switches(0) {}
+
+  /// CPU time in user and kernel mode.
+  int64_t user_millis;
+  int64_t system_millis;
+  /// The most memory, in bytes, used at once.
+  int64_t peak_rss;
+  /// Reads and writes that went to the disk, in blocks on POSIX and in
+  /// operations on Windows.
+  int64_t blocks_read;
+  int64_t blocks_written;
+  /// Voluntary and involuntary context switches.
+  int64_t context_switches;
+
+  bool operator==(const ResourceUsage& o) const {
+    return user_millis == o.user_millis && system_millis == o.system_millis &&
+        peak_rss == o.peak_rss && blocks_read == o.blocks_read &&
+        blocks_written == o.blocks_written &&
+        context_switches == o.context_switches;
+  }
+};
+
+#endif  // NINJA_RESOURCE_USAGE_H_
@@ -0,0 +1,388 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "server.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "util.h"
+
+extern char** environ;
+
+// Protocol, over a stream socket:
+// - the client sends one byte carrying its stdout and stderr as
+//   SCM_RIGHTS, then its arguments and environment, each as a count
+//   followed by that many length-prefixed strings;
+// - the server answers with its pid, so the client can pass on SIGINT,
+//   and once the build is done with the exit code, or kDeclined.
+
+namespace {
+
+const int32_t kDeclined = -1;
+
+/// Limits on what a request may contain, against garbage on the socket.
+const uint32_t kMaxStrings = 1 << 20;
+const uint32_t kMaxStringLength = 1 << 24;
+
+#ifdef MSG_NOSIGNAL
+const int kSendFlags = MSG_NOSIGNAL;
+#else
+const int kSendFlags = 0;
+#endif
+
+bool WriteAll(int fd, const void* data, size_t size) {
+  const char* p = static_cast<const char*>(data);
+  while (size > 0) {
+    ssize_t len = send(fd, p, size, kSendFlags);
+    if (len < 0 && errno == EINTR)
+      continue;
+    if (len <= 0)
+      return false;
+    p += len;
+    size -= len;
+  }
+  return true;
+}
+
+bool ReadAll(int fd, void* data, size_t size) {
+  char* p = static_cast<char*>(data);
+  while (size > 0) {
+    ssize_t len = read(fd, p, size);
+    if (len < 0 && errno == EINTR)
+      continue;
+    if (len <= 0)
+      return false;
+    p += len;
+    size -= len;
+  }
+  return true;
+}
+
+void PutStrings(string* buf, const vector<string>& strings) {
+  uint32_t count = (uint32_t)strings.size();
+  buf->append((const char*)&count, sizeof(count));
+  for (vector<string>::const_iterator i = strings.begin();
+       i != strings.end(); ++i) {
+    uint32_t len = (uint32_t)i->size();
+    buf->append((const char*)&len, sizeof(len));
+    buf->append(*i);
+  }
+}
+
+bool GetStrings(int fd, vector<string>* strings) {
+  uint32_t count;
+  if (!ReadAll(fd, &count, sizeof(count)) || count > kMaxStrings)
+    return false;
+  strings->resize(count);
+  for (uint32_t i = 0; i < count; ++i) {
+    uint32_t len;
+    if (!ReadAll(fd, &len, sizeof(len)) || len > kMaxStringLength)
+      return false;
+    (*strings)[i].resize(len);
+    if (len && !ReadAll(fd, &(*strings)[i][0], len))
+      return false;
+  }
+  return true;
+}
+
+bool MakeAddress(const string& path, struct sockaddr_un* addr) {
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  if (path.size() >= sizeof(addr->sun_path))
+    return false;
+  strcpy(addr->sun_path, path.c_str());
+  return true;
+}
+
+/// Whether the client at the other end of \a fd runs as the user we do.
+/// Its build runs as ours, in an environment it chooses.
+bool ClientIsOurUser(int fd) {
+#ifdef SO_PEERCRED
+  struct ucred cred;
+  socklen_t len = sizeof(cred);
+  if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0)
+    return false;
+  return cred.uid == geteuid();
+#else
+  uid_t uid;
+  gid_t gid;
+  if (getpeereid(fd, &uid, &gid) < 0)
+    return false;
+  return uid == geteuid();
+#endif
+}
+
+/// Connect to the socket at \a path, returning the fd or -1.
+int Connect(const string& path) {
+  struct sockaddr_un addr;
+  if (!MakeAddress(path, &addr))
+    return -1;
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0)
+    return -1;
+  if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+    close(fd);
+    return -1;
+  }
+  SetCloseOnExec(fd);
+#ifdef SO_NOSIGPIPE
+  int on = 1;
+  setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+  return fd;
+}
+
+/// Set while a server waits for a client, which is when SIGINT stops it;
+/// during a build, SIGINT is the client's and interrupts the build.
+volatile sig_atomic_t g_accepting;
+volatile sig_atomic_t g_quit;
+
+void HandleServerSignal(int signum) {
+  if (signum == SIGTERM || g_accepting)
+    g_quit = 1;
+}
+
+/// The server a client waits on, for ForwardSignal().
+pid_t g_server_pid;
+
+void ForwardSignal(int signum) {
+  kill(g_server_pid, SIGINT);
+}
+
+}  // anonymous namespace
+
+Server::Server()
+    : listen_fd_(-1), client_fd_(-1), saved_stdout_(-1), saved_stderr_(-1),
+      saved_environ_(NULL) {}
+
+Server::~Server() {
+  if (listen_fd_ < 0)
+    return;
+  close(listen_fd_);
+  unlink(path_.c_str());
+}
+
+bool Server::Listen(const string& path, string* err) {
+  struct sockaddr_un addr;
+  if (!MakeAddress(path, &addr)) {
+    *err = "socket path '" + path + "' too long";
+    return false;
+  }
+  int fd = Connect(path);
+  if (fd >= 0) {
+    close(fd);
+    *err = "a server is already running on '" + path + "'";
+    return false;
+  }
+  unlink(path.c_str());
+
+  listen_fd_ = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listen_fd_ < 0) {
+    *err = string("socket: ") + strerror(errno);
+    return false;
+  }
+  SetCloseOnExec(listen_fd_);
+  // Accept() turns away other users too; this keeps them from
+  // connecting at all where the system heeds the socket's mode.
+  if (bind(listen_fd_, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+      chmod(path.c_str(), S_IRUSR | S_IWUSR) < 0 ||
+      listen(listen_fd_, 16) < 0) {
+    *err = path + ": " + strerror(errno);
+    close(listen_fd_);
+    listen_fd_ = -1;
+    return false;
+  }
+  path_ = path;
+
+  // No SA_RESTART, so that accept() returns.
+  struct sigaction act;
+  memset(&act, 0, sizeof(act));
+  act.sa_handler = HandleServerSignal;
+  sigaction(SIGINT, &act, NULL);
+  sigaction(SIGTERM, &act, NULL);
+  return true;
+}
+
+bool Server::Accept(ServerRequest* request, string* err) {
+  for (;;) {
+    g_accepting = 1;
+    int fd = g_quit ? -1 : accept(listen_fd_, NULL, NULL);
+    g_accepting = 0;
+    if (g_quit) {
+      if (fd >= 0)
+        close(fd);
+      return false;
+    }
+    if (fd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      *err = string("accept: ") + strerror(errno);
+      return false;
+    }
+    SetCloseOnExec(fd);
+    if (!ClientIsOurUser(fd)) {
+      Warning("turning away a client run by another user");
+      close(fd);
+      continue;
+    }
+
+    // The first byte brings the client's stdout and stderr.
+    char byte;
+    struct iovec iov = { &byte, 1 };
+    char control[CMSG_SPACE(2 * sizeof(int))];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    int fds[2] = { -1, -1 };
+    if (recvmsg(fd, &msg, 0) == 1) {
+      struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+      if (cmsg && cmsg->cmsg_level == SOL_SOCKET &&
+          cmsg->cmsg_type == SCM_RIGHTS &&
+          cmsg->cmsg_len == CMSG_LEN(sizeof(fds))) {
+        memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+      }
+    }
+    pid_t pid = getpid();
+    if (fds[0] < 0 || fds[1] < 0 ||
+        !GetStrings(fd, &request->args) || !GetStrings(fd, &request->env) ||
+        !WriteAll(fd, &pid, sizeof(pid))) {
+      // Not a client we can serve; wait for the next.
+      if (fds[0] >= 0)
+        close(fds[0]);
+      if (fds[1] >= 0)
+        close(fds[1]);
+      close(fd);
+      continue;
+    }
+    client_fd_ = fd;
+
+    fflush(stdout);
+    fflush(stderr);
+    saved_stdout_ = dup(1);
+    saved_stderr_ = dup(2);
+    SetCloseOnExec(saved_stdout_);
+    SetCloseOnExec(saved_stderr_);
+    dup2(fds[0], 1);
+    dup2(fds[1], 2);
+    close(fds[0]);
+    close(fds[1]);
+
+    env_ = request->env;
+    environ_.clear();
+    for (vector<string>::iterator i = env_.begin(); i != env_.end(); ++i)
+      environ_.push_back(&(*i)[0]);
+    environ_.push_back(NULL);
+    saved_environ_ = environ;
+    environ = &environ_[0];
+    return true;
+  }
+}
+
+void Server::Reply(int exit_code) {
+  Finish(exit_code);
+}
+
+void Server::Decline() {
+  Finish(kDeclined);
+}
+
+void Server::Finish(int code) {
+  environ = saved_environ_;
+  fflush(stdout);
+  fflush(stderr);
+  dup2(saved_stdout_, 1);
+  dup2(saved_stderr_, 2);
+  close(saved_stdout_);
+  close(saved_stderr_);
+
+  int32_t exit_code = code;
+  WriteAll(client_fd_, &exit_code, sizeof(exit_code));
+  close(client_fd_);
+  client_fd_ = -1;
+}
+
+bool RunOnServer(const string& path, int argc, char** argv, int* exit_code) {
+  int fd = Connect(path);
+  if (fd < 0)
+    return false;
+
+  char byte = 0;
+  struct iovec iov = { &byte, 1 };
+  int fds[2] = { 1, 2 };
+  char control[CMSG_SPACE(sizeof(fds))];
+  memset(control, 0, sizeof(control));
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+  memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+  vector<string> args(argv + 1, argv + argc);
+  vector<string> env;
+  for (char** e = environ; *e; ++e)
+    env.push_back(*e);
+  string buf;
+  PutStrings(&buf, args);
+  PutStrings(&buf, env);
+
+  fflush(stdout);
+  pid_t pid;
+  if (sendmsg(fd, &msg, kSendFlags) != 1 ||
+      !WriteAll(fd, buf.data(), buf.size()) ||
+      !ReadAll(fd, &pid, sizeof(pid))) {
+    close(fd);
+    return false;
+  }
+
+  // Let an interrupt stop the build on the server, rather than us.
+  g_server_pid = pid;
+  struct sigaction act, old_int, old_term;
+  memset(&act, 0, sizeof(act));
+  act.sa_handler = ForwardSignal;
+  sigaction(SIGINT, &act, &old_int);
+  sigaction(SIGTERM, &act, &old_term);
+
+  int32_t code;
+  bool ok = ReadAll(fd, &code, sizeof(code));
+  sigaction(SIGINT, &old_int, NULL);
+  sigaction(SIGTERM, &old_term, NULL);
+  close(fd);
+
+  if (!ok) {
+    Error("lost connection to ninja server");
+    *exit_code = 1;
+    return true;
+  }
+  if (code == kDeclined)
+    return false;
+  *exit_code = code;
+  return true;
+}
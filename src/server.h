@@ -0,0 +1,79 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef NINJA_SERVER_H_
+#define NINJA_SERVER_H_
+
+#include <string>
+#include <vector>
+using namespace std;
+
+/// The transport for server mode (see "ninja -t server"), in which a
+/// long-lived ninja keeps the loaded manifest and build log in memory and
+/// runs builds on behalf of ordinary ninja invocations in the same
+/// directory.  A client connects to a Unix socket and hands over its
+/// arguments, its environment, and its stdout and stderr, so the build's
+/// output goes straight to the client's terminal; it then waits for the
+/// exit code.  POSIX only.
+
+/// A build asked for by a client.
+struct ServerRequest {
+  /// The client's arguments, without argv[0].
+  vector<string> args;
+  /// The client's environment, as "NAME=value" strings.
+  vector<string> env;
+};
+
+struct Server {
+  Server();
+  /// Stop listening, and remove the socket.
+  ~Server();
+
+  /// Listen on the socket at \a path.  Fails if another server is
+  /// listening there already; a stale socket is replaced.
+  bool Listen(const string& path, string* err);
+
+  /// Wait for the next client and read its request.  Until Reply(), the
+  /// client's stdout and stderr replace ours and its environment replaces
+  /// ours.  Returns false with \a err empty if interrupted by SIGINT or
+  /// SIGTERM, which is the way to stop a server.
+  bool Accept(ServerRequest* request, string* err);
+
+  /// Send the client \a exit_code and put our stdio and environment back.
+  void Reply(int exit_code);
+
+  /// Tell the client to run the request itself, e.g. because it asks for
+  /// something the server doesn't do.
+  void Decline();
+
+ private:
+  void Finish(int code);
+
+  string path_;
+  int listen_fd_;
+  int client_fd_;
+  int saved_stdout_;
+  int saved_stderr_;
+  char** saved_environ_;
+  vector<string> env_;
+  vector<char*> environ_;
+};
+
+/// Run the invocation \a argv (with argv[0]) on the server listening at
+/// \a path.  Returns false if there is no server or it declined the
+/// request, in which case the caller should run it itself; otherwise
+/// sets \a exit_code to the build's.
+bool RunOnServer(const string& path, int argc, char** argv, int* exit_code);
+
+#endif  // NINJA_SERVER_H_
@@ -16,18 +16,77 @@
 
 #include <assert.h>
 #include <stdio.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <new>
 
 #include "edit_distance.h"
 #include "graph.h"
 #include "metrics.h"
 #include "util.h"
 
+void Pool::EdgeScheduled(const Edge* edge) {
+  if (depth_ != 0)
+    current_use_ += edge->pool_weight_;
+}
+
+void Pool::EdgeFinished(const Edge* edge) {
+  if (depth_ != 0)
+    current_use_ -= edge->pool_weight_;
+}
+
+void Pool::Reset() {
+  current_use_ = 0;
+  delayed_.clear();
+}
+
+void Pool::DelayEdge(Edge* edge) {
+  assert(depth_ != 0);
+  delayed_.insert(edge);
+}
+
+void Pool::RetrieveReadyEdges(set<Edge*, EdgeCriticalPathCmp>* ready_queue) {
+  // FindWork() checks again, so only count what would fit, rather than
+  // reserving it.
+  int use = current_use_;
+  while (!delayed_.empty()) {
+    Edge* edge = *delayed_.begin();
+    if (use + edge->pool_weight_ > depth_)
+      break;
+    use += edge->pool_weight_;
+    ready_queue->insert(edge);
+    delayed_.erase(delayed_.begin());
+  }
+}
+
+void Pool::Dump() const {
+  printf("%s (%d/%d) ->\n", name_.c_str(), current_use_, depth_);
+  for (set<Edge*, EdgeCriticalPathCmp>::const_iterator i = delayed_.begin();
+       i != delayed_.end(); ++i) {
+    printf("\t");
+    (*i)->Dump();
+  }
+}
+
 const Rule State::kPhonyRule("phony");
+Pool State::kDefaultPool("", 0);
 
-State::State() {
+State::State() : spellcheck_indexed_(0) {
   AddRule(&kPhonyRule);
 }
 
+State::~State() {
+  // Nodes and edges live in arena_, which frees their memory; only the
+  // containers they own need releasing.
+  for (vector<Node*>::iterator i = nodes_.begin(); i != nodes_.end(); ++i)
+    (*i)->~Node();
+  for (vector<Edge*>::iterator i = edges_.begin(); i != edges_.end(); ++i)
+    (*i)->~Edge();
+  for (map<string, Pool*>::iterator i = pools_.begin(); i != pools_.end(); ++i)
+    delete i->second;
+}
+
 void State::AddRule(const Rule* rule) {
   assert(LookupRule(rule->name()) == NULL);
   rules_[rule->name()] = rule;
@@ -40,9 +99,22 @@ const Rule* State::LookupRule(const string& rule_name) {
   return i->second;
 }
 
+void State::AddPool(Pool* pool) {
+  assert(LookupPool(pool->name()) == NULL);
+  pools_[pool->name()] = pool;
+}
+
+Pool* State::LookupPool(const string& pool_name) {
+  map<string, Pool*>::iterator i = pools_.find(pool_name);
+  if (i == pools_.end())
+    return NULL;
+  return i->second;
+}
+
 Edge* State::AddEdge(const Rule* rule) {
-  Edge* edge = new Edge();
+  Edge* edge = new (arena_.Allocate(sizeof(Edge))) Edge((int)edges_.size());
   edge->rule_ = rule;
+  edge->pool_ = &kDefaultPool;
   edge->env_ = &bindings_;
   edges_.push_back(edge);
   return edge;
@@ -52,7 +124,10 @@ Node* State::GetNode(StringPiece path) {
   Node* node = LookupNode(path);
   if (node)
     return node;
-  node = new Node(path.AsString());
+  node_status_.push_back(NodeStatus());
+  node = new (arena_.Allocate(sizeof(Node)))
+      Node(path.AsString(), (int)nodes_.size(), &node_status_.back());
+  nodes_.push_back(node);
   paths_[node->path()] = node;
   return node;
 }
@@ -65,18 +140,81 @@ Node* State::LookupNode(StringPiece path) {
   return NULL;
 }
 
+namespace {
+
+/// How many times each of 16 groups of characters occurs in \a s, 4 bits
+/// each, stopping at 15.
+uint64_t CharacterCounts(StringPiece s) {
+  uint64_t counts = 0;
+  for (size_t i = 0; i < s.len_; ++i) {
+    unsigned char c = s.str_[i];
+    int shift = ((c ^ (c >> 4)) & 15) * 4;
+    if (((counts >> shift) & 15) != 15)
+      counts += (uint64_t)1 << shift;
+  }
+  return counts;
+}
+
+/// At most the edit distance between the strings \a a and \a b sum up,
+/// as each edit adds or removes at most one character of either.
+int CountsDistance(uint64_t a, uint64_t b) {
+  int added = 0, removed = 0;
+  for (int shift = 0; shift < 64; shift += 4) {
+    int diff = (int)((a >> shift) & 15) - (int)((b >> shift) & 15);
+    if (diff > 0)
+      added += diff;
+    else
+      removed -= diff;
+  }
+  return max(added, removed);
+}
+
+}  // anonymous namespace
+
 Node* State::SpellcheckNode(const string& path) {
+  METRIC_RECORD("spellcheck node");
   const bool kAllowReplacements = true;
   const int kMaxValidEditDistance = 3;
 
+  // Comparing with every path takes long in big graphs, so the paths are
+  // indexed by length, which no more than kMaxValidEditDistance edits
+  // change that much, and with counts of their characters, which bound
+  // the distance from below.  Only the few paths left are compared.
+  for (; spellcheck_indexed_ < nodes_.size(); ++spellcheck_indexed_) {
+    Node* node = nodes_[spellcheck_indexed_];
+    size_t length = node->path().size();
+    if (length >= spellcheck_index_.size())
+      spellcheck_index_.resize(length + 1);
+    SpellcheckEntry entry = { node, CharacterCounts(node->path()) };
+    spellcheck_index_[length].push_back(entry);
+  }
+
+  uint64_t counts = CharacterCounts(path);
   int min_distance = kMaxValidEditDistance + 1;
   Node* result = NULL;
-  for (Paths::iterator i = paths_.begin(); i != paths_.end(); ++i) {
-    int distance = EditDistance(
-        i->first, path, kAllowReplacements, kMaxValidEditDistance);
-    if (distance < min_distance && i->second) {
-      min_distance = distance;
-      result = i->second;
+  size_t min_length = path.size() > (size_t)kMaxValidEditDistance ?
+      path.size() - kMaxValidEditDistance : 0;
+  for (size_t length = min_length;
+       length <= path.size() + kMaxValidEditDistance &&
+       length < spellcheck_index_.size(); ++length) {
+    // The greatest distance that could still do, if only as a tie.
+    int limit = result ? min_distance : min_distance - 1;
+    if (abs((int)length - (int)path.size()) > limit)
+      continue;
+    const vector<SpellcheckEntry>& entries = spellcheck_index_[length];
+    for (vector<SpellcheckEntry>::const_iterator i = entries.begin();
+         i != entries.end(); ++i) {
+      limit = result ? min_distance : min_distance - 1;
+      if (CountsDistance(i->counts, counts) > limit)
+        continue;
+      int distance = EditDistance(i->node->path(), path, kAllowReplacements,
+                                  kMaxValidEditDistance);
+      if (distance < min_distance ||
+          (result && distance == min_distance &&
+           i->node->id() < result->id())) {
+        min_distance = distance;
+        result = i->node;
+      }
     }
   }
   return result;
@@ -132,18 +270,50 @@ vector<Node*> State::DefaultNodes(string* err) {
 }
 
 void State::Reset() {
-  for (Paths::iterator i = paths_.begin(); i != paths_.end(); ++i)
-    i->second->ResetState();
-  for (vector<Edge*>::iterator e = edges_.begin(); e != edges_.end(); ++e)
-    (*e)->outputs_ready_ = false;
+  fill(node_status_.begin(), node_status_.end(), NodeStatus());
+  for (map<string, Pool*>::iterator i = pools_.begin(); i != pools_.end(); ++i)
+    i->second->Reset();
+  bool loaded_depfiles = false;
+  for (vector<Edge*>::iterator e = edges_.begin(); e != edges_.end(); ++e) {
+    Edge* edge = *e;
+    edge->outputs_ready_ = false;
+    if (!edge->depfile_deps_)
+      continue;
+    // The next scan loads the depfile again.
+    EdgeInputs::iterator end = edge->inputs_.end() - edge->order_only_deps_;
+    edge->inputs_.erase(end - edge->depfile_deps_, end);
+    edge->implicit_deps_ -= edge->depfile_deps_;
+    edge->depfile_deps_ = 0;
+    loaded_depfiles = true;
+  }
+  if (!loaded_depfiles)
+    return;
+
+  // Drop the depfile deps' out-edges too.  Rebuilding the lists in edge
+  // order gives them the order they had when the graph was loaded.
+  for (vector<Node*>::iterator n = nodes_.begin(); n != nodes_.end(); ++n)
+    (*n)->ClearOutEdges();
+  for (vector<Edge*>::iterator e = edges_.begin(); e != edges_.end(); ++e) {
+    for (EdgeInputs::iterator i = (*e)->inputs_.begin();
+         i != (*e)->inputs_.end(); ++i) {
+      (*i)->AddOutEdge(*e);
+    }
+  }
 }
 
 void State::Dump() {
-  for (Paths::iterator i = paths_.begin(); i != paths_.end(); ++i) {
-    Node* node = i->second;
+  for (vector<Node*>::iterator i = nodes_.begin(); i != nodes_.end(); ++i) {
+    Node* node = *i;
     printf("%s %s\n",
            node->path().c_str(),
            node->status_known() ? (node->dirty() ? "dirty" : "clean")
                                 : "unknown");
   }
+  if (!pools_.empty()) {
+    printf("resource_pools:\n");
+    for (map<string, Pool*>::const_iterator i = pools_.begin();
+         i != pools_.end(); ++i) {
+      i->second->Dump();
+    }
+  }
 }
@@ -15,31 +15,79 @@
 #ifndef NINJA_STATE_H_
 #define NINJA_STATE_H_
 
+#include <deque>
 #include <map>
+#include <set>
 #include <string>
 #include <vector>
 using namespace std;
 
+#include "arena.h"
 #include "eval_env.h"
+#include "graph.h"
 #include "hash_map.h"
 
-struct Edge;
-struct Node;
-struct Rule;
+/// A pool limits how many of the edges assigned to it run at once,
+/// whatever the overall parallelism: each running edge takes up its
+/// weight (usually 1) of the pool's depth.  Edges that would overflow
+/// the pool wait in it until enough of the running ones finish.
+struct Pool {
+  Pool(const string& name, int depth)
+      : name_(name), depth_(depth), current_use_(0) {}
+
+  const string& name() const { return name_; }
+  /// How much weight may run at once; 0 for no limit.
+  int depth() const { return depth_; }
+  int current_use() const { return current_use_; }
+
+  /// Whether \a edge may start now without overflowing the pool.
+  bool HasRoomFor(const Edge* edge) const {
+    return depth_ == 0 || current_use_ + edge->pool_weight_ <= depth_;
+  }
+
+  void EdgeScheduled(const Edge* edge);
+  void EdgeFinished(const Edge* edge);
+
+  /// Forget the edges running and waiting, for another build.
+  void Reset();
+
+  /// Hold on to \a edge until there is room for it.
+  void DelayEdge(Edge* edge);
+
+  /// Move the waiting edges that now fit into \a ready_queue, in order,
+  /// stopping at the first that doesn't.
+  void RetrieveReadyEdges(set<Edge*, EdgeCriticalPathCmp>* ready_queue);
+
+  void Dump() const;
+
+ private:
+  string name_;
+  int depth_;
+  int current_use_;
+  set<Edge*, EdgeCriticalPathCmp> delayed_;
+};
 
 /// Global state (file status, loaded rules) for a single run.
 struct State {
   static const Rule kPhonyRule;
+  /// The pool of edges not assigned to any other; it has no limit.
+  static Pool kDefaultPool;
 
   State();
+  ~State();
 
   void AddRule(const Rule* rule);
   const Rule* LookupRule(const string& rule_name);
 
+  void AddPool(Pool* pool);
+  Pool* LookupPool(const string& pool_name);
+
   Edge* AddEdge(const Rule* rule);
 
   Node* GetNode(StringPiece path);
   Node* LookupNode(StringPiece path);
+  /// The node whose path is nearest to \a path, within a few edits, or
+  /// NULL.  Of equally near ones, the one created first.
   Node* SpellcheckNode(const string& path);
 
   void AddIn(Edge* edge, StringPiece path);
@@ -47,7 +95,8 @@ struct State {
   bool AddDefault(StringPiece path, string* error);
 
   /// Reset state.  Keeps all nodes and edges, but restores them to the
-  /// state where we haven't yet examined the disk for dirty state.
+  /// state where we haven't yet examined the disk for dirty state,
+  /// dropping the deps loaded from depfiles.
   void Reset();
 
   /// Dump the nodes (useful for debugging).
@@ -62,14 +111,39 @@ struct State {
   typedef ExternalStringHashMap<Node*>::Type Paths;
   Paths paths_;
 
+  /// All the nodes of the graph, indexed by Node::id().
+  vector<Node*> nodes_;
+
+  /// The status of each node, indexed by Node::id().  A deque, as growing
+  /// it must not move the entries the nodes point to.
+  deque<NodeStatus> node_status_;
+
   /// All the rules used in the graph.
   map<string, const Rule*> rules_;
 
-  /// All the edges of the graph.
+  /// All the pools declared in the manifest, which State owns.
+  map<string, Pool*> pools_;
+
+  /// All the edges of the graph, indexed by Edge::id().
   vector<Edge*> edges_;
 
   BindingEnv bindings_;
   vector<Node*> defaults_;
+
+  /// Storage for all the Nodes and Edges.
+  Arena arena_;
+
+ private:
+  /// A node and a summary of the characters of its path; see
+  /// SpellcheckNode().
+  struct SpellcheckEntry {
+    Node* node;
+    uint64_t counts;
+  };
+  /// The nodes by the length of their path, indexed by SpellcheckNode()
+  /// when first called, and the number of nodes_ indexed.
+  vector<vector<SpellcheckEntry> > spellcheck_index_;
+  size_t spellcheck_indexed_;
 };
 
 #endif  // NINJA_STATE_H_
@@ -44,4 +44,70 @@ TEST(State, Basic) {
   EXPECT_FALSE(state.GetNode("out")->dirty());
 }
 
+TEST(State, DenseIds) {
+  State state;
+  Edge* edge = state.AddEdge(&State::kPhonyRule);
+  state.AddIn(edge, "in");
+  state.AddOut(edge, "out");
+  Edge* edge2 = state.AddEdge(&State::kPhonyRule);
+  state.AddIn(edge2, "out");
+  state.AddOut(edge2, "out2");
+
+  EXPECT_EQ(0, edge->id());
+  EXPECT_EQ(1, edge2->id());
+  ASSERT_EQ(3u, state.nodes_.size());
+  for (int i = 0; i < 3; ++i)
+    EXPECT_EQ(i, state.nodes_[i]->id());
+  EXPECT_EQ("out", state.nodes_[1]->path());
+
+  state.GetNode("out")->MarkDirty();
+  state.GetNode("in")->MarkMissing();
+  state.Reset();
+  for (int i = 0; i < 3; ++i) {
+    EXPECT_FALSE(state.nodes_[i]->dirty());
+    EXPECT_FALSE(state.nodes_[i]->status_known());
+  }
+}
+
+TEST(State, ResetPools) {
+  State state;
+  Pool* pool = new Pool("p", 1);
+  state.AddPool(pool);
+  Edge* edge = state.AddEdge(&State::kPhonyRule);
+  Edge* edge2 = state.AddEdge(&State::kPhonyRule);
+  pool->EdgeScheduled(edge);
+  pool->DelayEdge(edge2);
+  EXPECT_EQ(1, pool->current_use());
+
+  // A build left off halfway leaves nothing in the pool for the next.
+  state.Reset();
+  EXPECT_EQ(0, pool->current_use());
+  set<Edge*, EdgeCriticalPathCmp> ready;
+  pool->RetrieveReadyEdges(&ready);
+  EXPECT_TRUE(ready.empty());
+}
+
+TEST(State, SpellcheckNode) {
+  State state;
+  state.GetNode("out/obj/foo.o");
+  state.GetNode("out/obj/bar.o");
+  state.GetNode("chrome");
+  state.GetNode("chromium");
+
+  EXPECT_EQ("out/obj/foo.o", state.SpellcheckNode("out/obj/fooo.o")->path());
+  EXPECT_EQ("out/obj/bar.o", state.SpellcheckNode("out/ojb/bar.o")->path());
+  EXPECT_EQ("chrome", state.SpellcheckNode("chorme")->path());
+  EXPECT_FALSE(state.SpellcheckNode("out/obj/quux.o"));
+  EXPECT_FALSE(state.SpellcheckNode(""));
+
+  // Of equally near ones, the first.
+  state.GetNode("lib2");
+  state.GetNode("lib1");
+  EXPECT_EQ("lib2", state.SpellcheckNode("lib3")->path());
+
+  // Nodes added since are found too.
+  state.GetNode("out/obj/qux.o");
+  EXPECT_EQ("out/obj/qux.o", state.SpellcheckNode("out/obj/quux.o")->path());
+}
+
 }  // namespace
@@ -0,0 +1,184 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "status_writer.h"
+
+#include <errno.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "metrics.h"
+
+namespace {
+
+/// Write all of \a data to \a fd, giving up on an error.
+void WriteAll(int fd, const string& data) {
+  const char* p = data.data();
+  size_t left = data.size();
+  while (left > 0) {
+    ssize_t len = write(fd, p, left);
+    if (len < 0) {
+      if (errno == EINTR)
+        continue;
+      return;
+    }
+    p += len;
+    left -= len;
+  }
+}
+
+}  // anonymous namespace
+
+StatusWriter::StatusWriter(int fd, int64_t interval_millis)
+    : fd_(fd), interval_millis_(interval_millis), started_(false),
+      status_changed_(false), writing_(false), flushing_(false),
+      quit_(false) {
+  pthread_mutex_init(&mutex_, NULL);
+  pthread_cond_init(&cond_, NULL);
+  int ret = pthread_create(&thread_, NULL, ThreadMain, this);
+  if (ret != 0)
+    Warning("pthread_create: %s", strerror(ret));  // Writes as they come.
+  else
+    started_ = true;
+}
+
+StatusWriter::~StatusWriter() {
+  Flush();
+  if (started_) {
+    pthread_mutex_lock(&mutex_);
+    quit_ = true;
+    pthread_cond_broadcast(&cond_);
+    pthread_mutex_unlock(&mutex_);
+    pthread_join(thread_, NULL);
+  }
+  pthread_cond_destroy(&cond_);
+  pthread_mutex_destroy(&mutex_);
+}
+
+void StatusWriter::SetStatus(const string& line) {
+  pthread_mutex_lock(&mutex_);
+  status_ = line;
+  // The thread already waits to show the last line, if not shown.
+  if (!status_changed_) {
+    status_changed_ = true;
+    pthread_cond_broadcast(&cond_);
+  }
+  pthread_mutex_unlock(&mutex_);
+  if (!started_)
+    Flush();
+}
+
+void StatusWriter::Write(const string& text) {
+  pthread_mutex_lock(&mutex_);
+  // Follow the status line as it is now, not as it will be when written.
+  if (status_changed_) {
+    output_ += StatusLine(status_);
+    status_changed_ = false;
+  }
+  output_ += text;
+  pthread_cond_broadcast(&cond_);
+  pthread_mutex_unlock(&mutex_);
+  if (!started_)
+    Flush();
+}
+
+void StatusWriter::Flush() {
+  pthread_mutex_lock(&mutex_);
+  if (!started_) {
+    // Do what the thread would.
+    string buf;
+    buf.swap(output_);
+    if (status_changed_) {
+      buf += StatusLine(status_);
+      status_changed_ = false;
+    }
+    WriteAll(fd_, buf);
+  } else {
+    flushing_ = true;
+    pthread_cond_broadcast(&cond_);
+    while (status_changed_ || !output_.empty() || writing_)
+      pthread_cond_wait(&cond_, &mutex_);
+    flushing_ = false;
+  }
+  pthread_mutex_unlock(&mutex_);
+}
+
+string StatusWriter::StatusLine(const string& status) const {
+  // Limit the line to the width of the terminal, so as not to wrap.
+  string line = status;
+  winsize size;
+  if (ioctl(fd_, TIOCGWINSZ, &size) == 0 && size.ws_col)
+    line = ElideMiddle(line, size.ws_col);
+  // Over the previous line, clearing what is left of it.
+  return "\r" + line + "\x1B[K";
+}
+
+// static
+void* StatusWriter::ThreadMain(void* writer) {
+  static_cast<StatusWriter*>(writer)->Run();
+  return NULL;
+}
+
+void StatusWriter::Run() {
+  int64_t last_shown = GetTimeMillis() - interval_millis_;
+  pthread_mutex_lock(&mutex_);
+  for (;;) {
+    // Wait for output, or until the status line is due.
+    while (output_.empty() && !quit_) {
+      if (status_changed_) {
+        int64_t wait = last_shown + interval_millis_ - GetTimeMillis();
+        if (wait <= 0 || flushing_)
+          break;
+        struct timeval now;
+        gettimeofday(&now, NULL);
+        int64_t deadline_usec = now.tv_usec + wait * 1000;
+        struct timespec deadline;
+        deadline.tv_sec = now.tv_sec + deadline_usec / 1000000;
+        deadline.tv_nsec = (deadline_usec % 1000000) * 1000;
+        pthread_cond_timedwait(&cond_, &mutex_, &deadline);
+      } else {
+        pthread_cond_wait(&cond_, &mutex_);
+      }
+    }
+    if (quit_ && output_.empty() && !status_changed_)
+      break;
+
+    string status;
+    bool show_status = status_changed_;
+    if (show_status) {
+      status = status_;
+      status_changed_ = false;
+    }
+    string output;
+    output.swap(output_);
+    writing_ = true;
+    pthread_mutex_unlock(&mutex_);
+
+    // Write() put the status line shown before the output in it; the one
+    // set since is newer.
+    string buf = output;
+    if (show_status) {
+      buf += StatusLine(status);
+      last_shown = GetTimeMillis();
+    }
+    WriteAll(fd_, buf);
+
+    pthread_mutex_lock(&mutex_);
+    writing_ = false;
+    pthread_cond_broadcast(&cond_);
+  }
+  pthread_mutex_unlock(&mutex_);
+}
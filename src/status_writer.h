@@ -0,0 +1,72 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef NINJA_STATUS_WRITER_H_
+#define NINJA_STATUS_WRITER_H_
+
+#include <string>
+using namespace std;
+
+#include <pthread.h>
+
+#include "util.h"  // int64_t
+
+/// Writes a build's status line and output to a terminal from a thread
+/// of its own, so that a slow terminal (e.g. over ssh) doesn't hold up
+/// starting commands.  The status line is redrawn over itself at most
+/// every \a interval_millis, with the latest line set; output is written
+/// in full and in order, each time after redrawing the status line.
+/// POSIX only.
+struct StatusWriter {
+  StatusWriter(int fd, int64_t interval_millis);
+  /// Flush() and stop the thread.
+  ~StatusWriter();
+
+  /// Show \a line as the status line, once the last was shown long
+  /// enough.  Lines set meanwhile are never shown.
+  void SetStatus(const string& line);
+
+  /// Write \a text after the status line.
+  void Write(const string& text);
+
+  /// Wait until all set and written is on the terminal.
+  void Flush();
+
+ private:
+  /// What draws \a status over the status line shown.
+  string StatusLine(const string& status) const;
+
+  static void* ThreadMain(void* writer);
+  void Run();
+
+  int fd_;
+  int64_t interval_millis_;
+  pthread_t thread_;
+  bool started_;
+
+  /// Guards the members below, which cond_ signals changes to.
+  pthread_mutex_t mutex_;
+  pthread_cond_t cond_;
+  string status_;
+  /// Whether status_ is yet to be shown.
+  bool status_changed_;
+  string output_;
+  /// Whether the thread is writing what it took out of the above.
+  bool writing_;
+  /// Whether to show status_ now rather than when due.
+  bool flushing_;
+  bool quit_;
+};
+
+#endif  // NINJA_STATUS_WRITER_H_
@@ -0,0 +1,58 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "status_writer.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "test.h"
+
+namespace {
+
+/// All there is to read from \a fd, which mustn't block.
+string ReadAvailable(int fd) {
+  string contents;
+  char buf[4096];
+  ssize_t len;
+  while ((len = read(fd, buf, sizeof(buf))) > 0)
+    contents.append(buf, len);
+  return contents;
+}
+
+}  // anonymous namespace
+
+TEST(StatusWriterTest, LatestStatusAndAllOutput) {
+  int fds[2];
+  ASSERT_EQ(0, pipe(fds));
+  fcntl(fds[0], F_SETFL, O_NONBLOCK);
+  {
+    // Long enough that only the first line and the last are shown.
+    StatusWriter writer(fds[1], 60 * 1000);
+    writer.SetStatus("[1/3] a");
+    writer.Flush();
+    writer.SetStatus("[2/3] b");
+    writer.SetStatus("[3/3] c");
+    writer.Write("\nFAILED: c\n");
+    writer.SetStatus("[3/3] d");
+    writer.Flush();
+  }
+  // Not the line set for "b", which came too soon after "a"; "c" is shown
+  // before the output written after it, though also too soon.
+  EXPECT_EQ("\r[1/3] a\x1B[K"
+            "\r[3/3] c\x1B[K\nFAILED: c\n"
+            "\r[3/3] d\x1B[K", ReadAvailable(fds[0]));
+  close(fds[0]);
+  close(fds[1]);
+}
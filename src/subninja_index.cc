@@ -0,0 +1,391 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "subninja_index.h"
+
+#include <algorithm>
+#include <set>
+
+#include "deps_log.h"
+#include "graph.h"
+#include "metrics.h"
+#include "state.h"
+
+namespace {
+
+/// Mark \a id in \a visited, growing it as needed.  Returns false if it
+/// was already.
+bool Visit(vector<bool>* visited, int id) {
+  if ((size_t)id >= visited->size())
+    visited->resize(id + 1);
+  if ((*visited)[id])
+    return false;
+  (*visited)[id] = true;
+  return true;
+}
+
+}  // anonymous namespace
+
+int SubninjaIndex::AddSubninja(const string& path, int parent,
+                               BindingEnv* env) {
+  int id = (int)subninjas_.size();
+  subninjas_.push_back(Subninja());
+  Subninja* subninja = &subninjas_.back();
+  subninja->path = path;
+  subninja->parent = parent;
+  subninja->env = env;
+  subninja->files.push_back(path);
+  scopes_[env].push_back(id);
+
+  // Put it off if the earlier parse loaded it from the same place, and
+  // found it could be.
+  ExternalStringHashMap<int>::Type::iterator i = known_paths_.find(path);
+  if (i == known_paths_.end())
+    return id;
+  int known = i->second;
+  int known_parent = parent < 0 ? -1 : subninjas_[parent].known;
+  if (known_[known].parent != known_parent)
+    return id;
+  subninja->known = known;
+  if (known_[known].deferrable) {
+    subninja->deferred = true;
+    deferred_as_[known] = id;
+    ++deferred_count_;
+  }
+  return id;
+}
+
+void SubninjaIndex::AddInclude(int subninja, const string& path) {
+  if (subninja >= 0)
+    subninjas_[subninja].files.push_back(path);
+  else
+    includes_.push_back(path);
+}
+
+void SubninjaIndex::AddRule(int subninja, const string& name) {
+  rules_[name] = subninja;
+  if (subninja >= 0)
+    subninjas_[subninja].rules.push_back(name);
+}
+
+void SubninjaIndex::AddPool(int subninja, const string& name) {
+  pools_[name] = subninja;
+  if (subninja >= 0)
+    subninjas_[subninja].pools.push_back(name);
+}
+
+void SubninjaIndex::AddEdge(int subninja, Edge* edge) {
+  if ((size_t)edge->id() >= edge_subninjas_.size())
+    edge_subninjas_.resize(edge->id() + 1, -1);
+  edge_subninjas_[edge->id()] = subninja;
+
+  // The builtin phony rule and default pool aren't in the maps.
+  map<string, int>::iterator i = rules_.find(edge->rule().name());
+  if (i != rules_.end() && i->second >= 0 && i->second != subninja)
+    subninjas_[i->second].shared = true;
+  if (edge->pool_) {
+    i = pools_.find(edge->pool_->name());
+    if (i != pools_.end() && i->second >= 0 && i->second != subninja)
+      subninjas_[i->second].shared = true;
+  }
+}
+
+void SubninjaIndex::AddDefault(int subninja, const string& path) {
+  if (subninja >= 0)
+    subninjas_[subninja].defaults.push_back(path);
+}
+
+void SubninjaIndex::AddBinding(BindingEnv* env) {
+  map<BindingEnv*, vector<int> >::iterator i = scopes_.find(env);
+  if (i == scopes_.end())
+    return;
+  for (vector<int>::iterator s = i->second.begin(); s != i->second.end(); ++s)
+    subninjas_[*s].rebound = true;
+}
+
+int SubninjaIndex::EdgeSubninja(Edge* edge) const {
+  if ((size_t)edge->id() >= edge_subninjas_.size())
+    return -1;
+  return edge_subninjas_[edge->id()];
+}
+
+void SubninjaIndex::SetKnown(vector<Known>* known) {
+  known_.swap(*known);
+  known_paths_.clear();
+  known_outputs_.clear();
+  for (size_t k = 0; k < known_.size(); ++k) {
+    // A subninja loaded twice can't be told apart.
+    pair<ExternalStringHashMap<int>::Type::iterator, bool> inserted =
+        known_paths_.insert(make_pair(StringPiece(known_[k].path), (int)k));
+    if (!inserted.second) {
+      known_[k].deferrable = false;
+      known_[inserted.first->second].deferrable = false;
+    }
+    for (vector<string>::iterator o = known_[k].outputs.begin();
+         o != known_[k].outputs.end(); ++o) {
+      known_outputs_.insert(make_pair(StringPiece(*o), (int)k));
+    }
+  }
+  deferred_as_.assign(known_.size(), -1);
+}
+
+bool SubninjaIndex::MayDefer(const string& path) {
+  ExternalStringHashMap<int>::Type::iterator i = known_paths_.find(path);
+  return i != known_paths_.end() && known_[i->second].deferrable;
+}
+
+int SubninjaIndex::FindDeferred(StringPiece path) {
+  ExternalStringHashMap<int>::Type::iterator i = known_outputs_.find(path);
+  if (i == known_outputs_.end())
+    return -1;
+  // If it wasn't put off itself, the subninja loading it may have been.
+  for (int k = i->second; k >= 0; k = known_[k].parent) {
+    int id = deferred_as_[k];
+    if (id >= 0 && subninjas_[id].deferred)
+      return id;
+  }
+  return -1;
+}
+
+bool SubninjaIndex::Load(State* state, ManifestParser::FileReader* file_reader,
+                         int subninja, string* err) {
+  METRIC_COUNT("subninjas loaded lazily", 1);
+  subninjas_[subninja].deferred = false;
+  --deferred_count_;
+  ManifestParser parser(state, file_reader);
+  return parser.LoadSubninja(subninjas_[subninja].path, subninja,
+                             subninjas_[subninja].env, this, err);
+}
+
+bool SubninjaIndex::LoadFor(State* state,
+                            ManifestParser::FileReader* file_reader,
+                            DepsLog* deps_log, const vector<string>& paths,
+                            string* err) {
+  METRIC_RECORD("subninja lazy load");
+  vector<Node*> queue;
+  vector<bool> visited;
+  for (vector<string>::const_iterator i = paths.begin(); i != paths.end();
+       ++i) {
+    int subninja;
+    while (!state->LookupNode(*i) && (subninja = FindDeferred(*i)) >= 0) {
+      if (!Load(state, file_reader, subninja, err))
+        return false;
+    }
+    Node* node = state->LookupNode(*i);
+    if (node && Visit(&visited, node->id()))
+      queue.push_back(node);
+  }
+
+  // Breadth first, loading the subninja building each file found not to
+  // be built yet, if there is one.
+  for (size_t i = 0; i < queue.size(); ++i) {
+    Node* node = queue[i];
+    int subninja;
+    while (!node->in_edge() && (subninja = FindDeferred(node->path())) >= 0) {
+      if (!Load(state, file_reader, subninja, err))
+        return false;
+    }
+    Edge* edge = node->in_edge();
+    if (!edge)
+      continue;
+    for (EdgeInputs::iterator in = edge->inputs_.begin();
+         in != edge->inputs_.end(); ++in) {
+      if (Visit(&visited, (*in)->id()))
+        queue.push_back(*in);
+    }
+    if (!deps_log)
+      continue;
+    for (vector<Node*>::iterator out = edge->outputs_.begin();
+         out != edge->outputs_.end(); ++out) {
+      DepsLog::Deps* deps = deps_log->GetDeps(*out);
+      for (int d = 0; deps && d < deps->node_count; ++d) {
+        if (Visit(&visited, deps->nodes[d]->id()))
+          queue.push_back(deps->nodes[d]);
+      }
+    }
+  }
+  return true;
+}
+
+bool SubninjaIndex::LoadAll(State* state,
+                            ManifestParser::FileReader* file_reader,
+                            string* err) {
+  // Loading one may put off more, after it.
+  for (size_t i = 0; i < subninjas_.size(); ++i) {
+    if (subninjas_[i].deferred && !Load(state, file_reader, (int)i, err))
+      return false;
+  }
+  return true;
+}
+
+bool SubninjaIndex::CopyAll(State* old_state, State* state,
+                            ManifestParser::FileReader* file_reader,
+                            string* err) {
+  METRIC_RECORD("subninja copy");
+  vector<bool> leaf(known_.size(), true);
+  for (size_t k = 0; k < known_.size(); ++k) {
+    if (known_[k].parent >= 0)
+      leaf[known_[k].parent] = false;
+  }
+  // Parsing one may put off more, after it.  Those with subninjas of
+  // their own are parsed, as what they define may be used by them.
+  for (size_t i = 0; i < subninjas_.size(); ++i) {
+    if (!subninjas_[i].deferred)
+      continue;
+    if (leaf[subninjas_[i].known] && Copy(old_state, state, (int)i))
+      continue;
+    if (!Load(state, file_reader, (int)i, err))
+      return false;
+  }
+  return true;
+}
+
+bool SubninjaIndex::Copy(State* old_state, State* state, int subninja) {
+  const Known& known = known_[subninjas_[subninja].known];
+
+  // Check everything before adding anything, so that it can be parsed
+  // instead.  Its own rules and pools must not be defined yet.
+  for (vector<string>::const_iterator i = known.rules.begin();
+       i != known.rules.end(); ++i) {
+    if (!old_state->LookupRule(*i) || state->LookupRule(*i))
+      return false;
+  }
+  for (vector<string>::const_iterator i = known.pools.begin();
+       i != known.pools.end(); ++i) {
+    if (!old_state->LookupPool(*i) || state->LookupPool(*i))
+      return false;
+  }
+
+  // Its edges, which must have had all of the outputs recorded: another
+  // edge may have taken one over since.
+  vector<Edge*> edges;
+  vector<string>::const_iterator output = known.outputs.begin();
+  while (output != known.outputs.end()) {
+    Node* node = old_state->LookupNode(*output);
+    Edge* edge = node ? node->in_edge() : NULL;
+    if (!edge)
+      return false;
+    for (vector<Node*>::iterator o = edge->outputs_.begin();
+         o != edge->outputs_.end(); ++o, ++output) {
+      if (output == known.outputs.end() || (*o)->path() != *output)
+        return false;
+    }
+    edges.push_back(edge);
+  }
+
+  // Its edges' variables are looked up in their own scope if they have
+  // one, then in the subninja's, then in those it is loaded in, up to
+  // the top-level manifest's.  Only the subninja's is taken over.
+  size_t depth = 2;
+  for (int k = known.parent; k >= 0; k = known_[k].parent)
+    ++depth;
+  BindingEnv* env = NULL;
+  set<Node*> nodes;
+  for (vector<Edge*>::iterator e = edges.begin(); e != edges.end(); ++e) {
+    Edge* edge = *e;
+    const string& rule_name = edge->rule().name();
+    if (find(known.rules.begin(), known.rules.end(), rule_name) ==
+        known.rules.end()) {
+      // Another subninja's rule may have changed; the edge's pool came
+      // from it.
+      const Rule* rule = state->LookupRule(rule_name);
+      if (!rule || (rule != &edge->rule() &&
+                    (rule->pool().Serialize() !=
+                         edge->rule().pool().Serialize() ||
+                     rule->pool_weight().Serialize() !=
+                         edge->rule().pool_weight().Serialize()))) {
+        return false;
+      }
+    }
+    if (edge->pool_ != &State::kDefaultPool &&
+        find(known.pools.begin(), known.pools.end(), edge->pool_->name()) ==
+            known.pools.end() &&
+        !state->LookupPool(edge->pool_->name())) {
+      return false;
+    }
+
+    vector<BindingEnv*> scopes;
+    for (BindingEnv* scope = static_cast<BindingEnv*>(edge->env_); scope;
+         scope = static_cast<BindingEnv*>(scope->parent_)) {
+      scopes.push_back(scope);
+    }
+    if (scopes.size() != depth && scopes.size() != depth + 1)
+      return false;
+    BindingEnv* own = scopes[scopes.size() - depth];
+    if (env && own != env)
+      return false;
+    env = own;
+
+    nodes.insert(edge->inputs_.begin(), edge->inputs_.end());
+    nodes.insert(edge->outputs_.begin(), edge->outputs_.end());
+  }
+  for (vector<string>::const_iterator i = known.defaults.begin();
+       i != known.defaults.end(); ++i) {
+    if (!state->LookupNode(*i) && !nodes.count(old_state->LookupNode(*i)))
+      return false;
+  }
+
+  METRIC_COUNT("subninjas copied", 1);
+  Subninja* copy = &subninjas_[subninja];
+  copy->deferred = false;
+  copy->copied = true;
+  --deferred_count_;
+  copy->files = known.files;
+  if (env)
+    env->parent_ = copy->env;
+  for (vector<string>::const_iterator i = known.rules.begin();
+       i != known.rules.end(); ++i) {
+    // Rules are never freed, so the old State's can be shared.
+    state->AddRule(old_state->LookupRule(*i));
+    AddRule(subninja, *i);
+  }
+  for (vector<string>::const_iterator i = known.pools.begin();
+       i != known.pools.end(); ++i) {
+    state->AddPool(new Pool(*i, old_state->LookupPool(*i)->depth()));
+    AddPool(subninja, *i);
+  }
+  for (vector<Edge*>::iterator e = edges.begin(); e != edges.end(); ++e) {
+    Edge* old_edge = *e;
+    Edge* edge = state->AddEdge(state->LookupRule(old_edge->rule().name()));
+    if (old_edge->pool_ != &State::kDefaultPool)
+      edge->pool_ = state->LookupPool(old_edge->pool_->name());
+    edge->pool_weight_ = old_edge->pool_weight_;
+    edge->env_ = old_edge->env_;
+    // Not the deps loaded from a depfile or the deps log, which come
+    // just before the order-only ones.
+    size_t order_only = old_edge->inputs_.size() - old_edge->order_only_deps_;
+    size_t loaded = order_only - old_edge->depfile_deps_;
+    edge->inputs_.reserve(old_edge->inputs_.size() -
+                          old_edge->depfile_deps_);
+    for (size_t i = 0; i < old_edge->inputs_.size(); ++i) {
+      if (i < loaded || i >= order_only)
+        state->AddIn(edge, old_edge->inputs_[i]->path());
+    }
+    for (vector<Node*>::iterator o = old_edge->outputs_.begin();
+         o != old_edge->outputs_.end(); ++o) {
+      state->AddOut(edge, (*o)->path());
+    }
+    edge->implicit_deps_ =
+        old_edge->implicit_deps_ - old_edge->depfile_deps_;
+    edge->order_only_deps_ = old_edge->order_only_deps_;
+    AddEdge(subninja, edge);
+  }
+  for (vector<string>::const_iterator i = known.defaults.begin();
+       i != known.defaults.end(); ++i) {
+    string err;
+    state->AddDefault(*i, &err);
+    AddDefault(subninja, *i);
+  }
+  return true;
+}
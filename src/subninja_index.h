@@ -0,0 +1,194 @@
+// Copyright 2011 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef NINJA_SUBNINJA_INDEX_H_
+#define NINJA_SUBNINJA_INDEX_H_
+
+#include <map>
+#include <string>
+#include <vector>
+using namespace std;
+
+#include "hash_map.h"
+#include "manifest_parser.h"
+#include "util.h"
+
+struct BindingEnv;
+struct DepsLog;
+struct Edge;
+struct State;
+
+/// The subninjas of a manifest and what each builds, which the manifest
+/// cache keeps so that "ninja --lazy TARGET" can put off loading those
+/// TARGET doesn't need.
+///
+/// A subninja here is what one subninja statement loads: its file and
+/// the files it includes, but not the subninjas it has in turn, which
+/// are subninjas of their own.  Subninjas are numbered in the order
+/// they are loaded.
+///
+/// While parsing, the ManifestParser records each subninja, and what it
+/// defines, here.  With the index of an earlier parse given by
+/// ManifestCache::LoadIndex(), it also asks whether to put off loading
+/// each subninja: one can be while neither it nor the subninjas it is
+/// loaded from has changed since, and nothing outside it could depend
+/// on having loaded it, i.e. its rules and pools are its own.
+/// LoadFor() then loads those that build what the targets need.
+///
+/// After a rebuild of the manifest, CopyAll() instead takes what the
+/// subninjas put off defined from the State loaded before the rebuild,
+/// so that only the subninjas the generator changed are parsed again.
+struct SubninjaIndex {
+  SubninjaIndex() : deferred_count_(0) {}
+
+  // Recording, by the ManifestParser.
+
+  /// Note the subninja \a path, loaded from \a parent (-1 for the
+  /// top-level manifest) in the scope \a env, and return its number.
+  /// Given the index of an earlier parse, it may be put off instead of
+  /// loaded: see Subninja::deferred.
+  int AddSubninja(const string& path, int parent, BindingEnv* env);
+  /// Note that \a subninja includes \a path.
+  void AddInclude(int subninja, const string& path);
+  void AddRule(int subninja, const string& name);
+  void AddPool(int subninja, const string& name);
+  void AddEdge(int subninja, Edge* edge);
+  void AddDefault(int subninja, const string& path);
+  /// Note that a variable was set in \a env, which the subninjas loaded
+  /// in it earlier didn't see.
+  void AddBinding(BindingEnv* env);
+
+  // Lazy loading.
+
+  /// Whether the subninja \a path may be put off, so is not worth
+  /// reading ahead.
+  bool MayDefer(const string& path);
+
+  /// Whether any subninja is put off, so that the State is missing some
+  /// of the manifest.
+  bool deferred() const { return deferred_count_ > 0; }
+
+  /// Whether a subninja put off builds \a path.
+  bool Builds(StringPiece path) {
+    return FindDeferred(path) >= 0;
+  }
+
+  /// Load the subninjas put off that build the files at \a paths and
+  /// what they need in turn, their inputs and the deps in \a deps_log
+  /// (which may be NULL), into \a state.  Returns false on error.
+  bool LoadFor(State* state, ManifestParser::FileReader* file_reader,
+               DepsLog* deps_log, const vector<string>& paths, string* err);
+
+  /// Load every subninja put off into \a state.  Returns false on error.
+  bool LoadAll(State* state, ManifestParser::FileReader* file_reader,
+               string* err);
+
+  // Reloading.
+
+  /// Load every subninja put off into \a state, as LoadAll() does, but
+  /// take the rules, pools, edges and defaults of those that load no
+  /// subninjas of their own from \a old_state, the State the earlier
+  /// parse loaded, rather than parsing them again.  \a old_state must be
+  /// all of that parse, which the subninjas copied then no longer use.
+  /// Returns false on error.
+  bool CopyAll(State* old_state, State* state,
+               ManifestParser::FileReader* file_reader, string* err);
+
+  struct Subninja {
+    Subninja()
+        : parent(-1), env(NULL), shared(false), rebound(false), known(-1),
+          deferred(false), copied(false) {}
+    string path;
+    /// The subninja it is loaded from, or -1 for the top-level manifest.
+    int parent;
+    /// The scope it is loaded in.
+    BindingEnv* env;
+    /// Its file and those it includes.
+    vector<string> files;
+    /// The rules and pools it defines and its default targets.
+    vector<string> rules;
+    vector<string> pools;
+    vector<string> defaults;
+    /// Whether an edge outside it uses one of its rules or pools.
+    bool shared;
+    /// Whether a variable was set in its scope after it was loaded, so
+    /// that loading it later would see a different value.
+    bool rebound;
+
+    /// Its number in the index of the earlier parse, or -1.
+    int known;
+    /// Whether it is put off, and not yet loaded.
+    bool deferred;
+    /// Whether it was loaded by copying it from an earlier State; see
+    /// CopyAll().  Its files were not read.
+    bool copied;
+  };
+  const vector<Subninja>& subninjas() const { return subninjas_; }
+  /// The files the top-level manifest includes.
+  const vector<string>& includes() const { return includes_; }
+  /// The subninja each edge comes from, by Edge::id(): -1 for the
+  /// top-level manifest, or for edges created outside the parser.
+  int EdgeSubninja(Edge* edge) const;
+
+  /// A subninja of the earlier parse, as the manifest cache keeps it.
+  struct Known {
+    Known() : parent(-1), deferrable(false) {}
+    string path;
+    int parent;
+    /// As in Subninja.
+    vector<string> files;
+    vector<string> rules;
+    vector<string> pools;
+    vector<string> defaults;
+    /// The outputs of its edges.
+    vector<string> outputs;
+    /// Whether it can be put off: computed by ManifestCache::LoadIndex().
+    bool deferrable;
+  };
+  /// Use the index of an earlier parse, \a known, which this takes,
+  /// to put off loading subninjas.
+  void SetKnown(vector<Known>* known);
+  const vector<Known>& known() const { return known_; }
+
+ private:
+  /// The subninja put off and not yet loaded that would build \a path,
+  /// once it and the subninjas it loads are, or -1.
+  int FindDeferred(StringPiece path);
+  bool Load(State* state, ManifestParser::FileReader* file_reader,
+            int subninja, string* err);
+  /// Load \a subninja, put off, by copying it from \a old_state.
+  /// Returns false, leaving \a state as it was, if it can't be; it is
+  /// then to be parsed.
+  bool Copy(State* old_state, State* state, int subninja);
+
+  vector<Subninja> subninjas_;
+  vector<string> includes_;
+  /// Where each rule and pool is defined, as subninja numbers.
+  map<string, int> rules_;
+  map<string, int> pools_;
+  vector<int> edge_subninjas_;
+  /// The subninjas loaded in each scope.
+  map<BindingEnv*, vector<int> > scopes_;
+
+  /// The earlier parse's subninjas, their numbers by path, and the one
+  /// building each output.
+  vector<Known> known_;
+  ExternalStringHashMap<int>::Type known_paths_;
+  ExternalStringHashMap<int>::Type known_outputs_;
+  /// What each known subninja was put off as, or -1.
+  vector<int> deferred_as_;
+  int deferred_count_;
+};
+
+#endif  // NINJA_SUBNINJA_INDEX_H_
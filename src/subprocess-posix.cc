@@ -20,9 +20,19 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <poll.h>
+#include <spawn.h>
+#ifdef linux
+#include <sched.h>
+#include <sys/epoll.h>
+#elif defined(__APPLE__) || defined(__FreeBSD__) || defined(__OpenBSD__) || \
+    defined(__DragonFly__)
+#include <sys/event.h>
+#define USE_KQUEUE
+#endif
 #include <unistd.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/resource.h>
 #include <sys/wait.h>
 
 // Older versions of glibc (like 2.4) won't find this in <poll.h>.  glibc
@@ -34,76 +44,148 @@
 
 #include "util.h"
 
-Subprocess::Subprocess() : fd_(-1), pid_(-1) {
+extern char** environ;
+
+Subprocess::Subprocess() : max_output_(0), dropped_(0), fd_(-1), pid_(-1),
+                           poll_fd_(-1), node_(-1) {
 }
 Subprocess::~Subprocess() {
   if (fd_ >= 0)
-    close(fd_);
+    ClosePipe();
   // Reap child if forgotten.
   if (pid_ != -1)
     Finish();
 }
 
-bool Subprocess::Start(SubprocessSet* set, const string& command) {
+namespace {
+
+/// Words /bin/sh gives a meaning of its own as the first word of a
+/// command: reserved words, and builtins that change the shell or act
+/// differently from the programs of the same name.
+const char* const kShellWords[] = {
+  "alias", "bg", "break", "case", "cd", "command", "continue", "do", "done",
+  "echo", "elif", "else", "esac", "eval", "exec", "exit", "export", "fc",
+  "fg", "fi", "for", "function", "getopts", "hash", "if", "in", "jobs",
+  "kill", "let", "local", "printf", "pwd", "read", "readonly", "return",
+  "select", "set", "shift", "source", "test", "then", "time", "times", "trap",
+  "type", "typeset", "ulimit", "umask", "unalias", "unset", "until", "wait",
+  "while",
+};
+
+/// Split \a command into the words /bin/sh would run it as, if it would
+/// run it as a program given just those words: if it is only words of
+/// characters the shell passes on as they are, none of them quotes,
+/// expansions, redirections, globs or operators, and the first isn't
+/// a variable assignment nor a word of kShellWords.
+bool SplitPlainCommand(const string& command, vector<string>* words) {
+  string word;
+  for (size_t i = 0; i <= command.size(); ++i) {
+    char c = i < command.size() ? command[i] : ' ';
+    if (c == ' ' || c == '\t') {
+      if (!word.empty())
+        words->push_back(word);
+      word.clear();
+    } else if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+               (c >= '0' && c <= '9') || strchr("%+,-./:=@_", c)) {
+      word.push_back(c);
+    } else {
+      return false;
+    }
+  }
+  if (words->empty() || (*words)[0].find('=') != string::npos)
+    return false;
+  for (size_t i = 0; i < sizeof(kShellWords) / sizeof(kShellWords[0]); ++i) {
+    if ((*words)[0] == kShellWords[i])
+      return false;
+  }
+  return true;
+}
+
+}  // anonymous namespace
+
+bool Subprocess::Start(SubprocessSet* set, const string& command,
+                       bool use_shell) {
   int output_pipe[2];
   if (pipe(output_pipe) < 0)
     Fatal("pipe: %s", strerror(errno));
   fd_ = output_pipe[0];
 #if !defined(linux)
-  // On linux we use ppoll in DoWork(); elsewhere we use pselect and so must
-  // avoid overly-large FDs.
-  if (fd_ >= static_cast<int>(FD_SETSIZE))
+  // Without kqueue, DoWork() uses pselect and so must avoid overly-large
+  // FDs.
+  if (set->poll_fd_ < 0 && fd_ >= static_cast<int>(FD_SETSIZE))
     Fatal("pipe: %s", strerror(EMFILE));
 #endif  // !linux
   SetCloseOnExec(fd_);
 
-  pid_ = fork();
-  if (pid_ < 0)
-    Fatal("fork: %s", strerror(errno));
-
-  if (pid_ == 0) {
-    close(output_pipe[0]);
-
-    // Track which fd we use to report errors on.
-    int error_pipe = output_pipe[1];
-    do {
-      if (setpgid(0, 0) < 0)
-        break;
-
-      if (sigaction(SIGINT, &set->old_act_, 0) < 0)
-        break;
-      if (sigprocmask(SIG_SETMASK, &set->old_mask_, 0) < 0)
-        break;
-
-      // Open /dev/null over stdin.
-      int devnull = open("/dev/null", O_WRONLY);
-      if (devnull < 0)
-        break;
-      if (dup2(devnull, 0) < 0)
-        break;
-      close(devnull);
-
-      if (dup2(output_pipe[1], 1) < 0 ||
-          dup2(output_pipe[1], 2) < 0)
-        break;
-
-      // Now can use stderr for errors.
-      error_pipe = 2;
-      close(output_pipe[1]);
-
-      execl("/bin/sh", "/bin/sh", "-c", command.c_str(), (char *) NULL);
-    } while (false);
-
-    // If we get here, something went wrong; the execl should have
-    // replaced us.
-    char* err = strerror(errno);
-    if (write(error_pipe, err, strlen(err)) < 0) {
-      // If the write fails, there's nothing we can do.
-      // But this block seems necessary to silence the warning.
-    }
-    _exit(1);
+  // posix_spawn() rather than fork(), whose copy of the page tables takes
+  // longer the more memory ninja uses; where it is vfork() underneath, it
+  // takes no longer for a big build than a small one.
+  posix_spawn_file_actions_t actions;
+  int err = posix_spawn_file_actions_init(&actions);
+  if (err != 0)
+    Fatal("posix_spawn_file_actions_init: %s", strerror(err));
+
+  // Open /dev/null over stdin, and the pipe over stdout and stderr.
+  err = posix_spawn_file_actions_addopen(&actions, 0, "/dev/null", O_RDONLY,
+                                         0);
+  if (err == 0)
+    err = posix_spawn_file_actions_adddup2(&actions, output_pipe[1], 1);
+  if (err == 0)
+    err = posix_spawn_file_actions_adddup2(&actions, output_pipe[1], 2);
+  if (err == 0)
+    err = posix_spawn_file_actions_addclose(&actions, output_pipe[1]);
+  if (err != 0)
+    Fatal("posix_spawn_file_actions: %s", strerror(err));
+
+  posix_spawnattr_t attr;
+  err = posix_spawnattr_init(&attr);
+  if (err != 0)
+    Fatal("posix_spawnattr_init: %s", strerror(err));
+
+  // In a process group of its own, with the signal mask ninja started
+  // with and SIGINT handled by default.
+  short flags = POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSIGMASK |
+      POSIX_SPAWN_SETSIGDEF;
+  sigset_t default_signals;
+  sigemptyset(&default_signals);
+  sigaddset(&default_signals, SIGINT);
+#ifdef POSIX_SPAWN_USEVFORK
+  // glibc before 2.24 only uses vfork() when asked.
+  flags |= POSIX_SPAWN_USEVFORK;
+#endif
+  err = posix_spawnattr_setflags(&attr, flags);
+  if (err == 0)
+    err = posix_spawnattr_setpgroup(&attr, 0);
+  if (err == 0)
+    err = posix_spawnattr_setsigmask(&attr, &set->old_mask_);
+  if (err == 0)
+    err = posix_spawnattr_setsigdefault(&attr, &default_signals);
+  if (err != 0)
+    Fatal("posix_spawnattr: %s", strerror(err));
+
+  // Run a command that needs nothing of the shell directly, saving the
+  // start of a shell.  If that fails, as for a program that doesn't exist,
+  // run it through the shell after all, to fail as it would have.
+  vector<string> words;
+  err = -1;
+  if (!use_shell && SplitPlainCommand(command, &words)) {
+    vector<char*> args;
+    for (vector<string>::iterator i = words.begin(); i != words.end(); ++i)
+      args.push_back(&(*i)[0]);
+    args.push_back(NULL);
+    err = posix_spawnp(&pid_, args[0], &actions, &attr, &args[0], environ);
+  }
+  if (err != 0) {
+    const char* spawned_args[] = { "/bin/sh", "-c", command.c_str(), NULL };
+    err = posix_spawn(&pid_, "/bin/sh", &actions, &attr,
+                      const_cast<char**>(spawned_args), environ);
+    if (err != 0)
+      Fatal("posix_spawn: %s", strerror(err));
   }
 
+  posix_spawnattr_destroy(&attr);
+  posix_spawn_file_actions_destroy(&actions);
+
   close(output_pipe[1]);
   return true;
 }
@@ -112,21 +194,45 @@ void Subprocess::OnPipeReady() {
   char buf[4 << 10];
   ssize_t len = read(fd_, buf, sizeof(buf));
   if (len > 0) {
-    buf_.append(buf, len);
+    AppendOutput(buf, len);
   } else {
     if (len < 0)
       Fatal("read: %s", strerror(errno));
-    close(fd_);
-    fd_ = -1;
+    ClosePipe();
   }
 }
 
+void Subprocess::ClosePipe() {
+#ifdef linux
+  // Children forked since may still have the pipe open, which would keep
+  // it in the epoll set after it is closed here.  (A kqueue forgets fds
+  // as they are closed.)
+  if (poll_fd_ >= 0 && epoll_ctl(poll_fd_, EPOLL_CTL_DEL, fd_, NULL) < 0)
+    Fatal("epoll_ctl: %s", strerror(errno));
+#endif
+  close(fd_);
+  fd_ = -1;
+}
+
 ExitStatus Subprocess::Finish() {
   assert(pid_ != -1);
   int status;
-  if (waitpid(pid_, &status, 0) < 0)
-    Fatal("waitpid(%d): %s", pid_, strerror(errno));
+  struct rusage usage;
+  if (wait4(pid_, &status, 0, &usage) < 0)
+    Fatal("wait4(%d): %s", pid_, strerror(errno));
   pid_ = -1;
+  usage_.user_millis = (int64_t)usage.ru_utime.tv_sec * 1000 +
+      usage.ru_utime.tv_usec / 1000;
+  usage_.system_millis = (int64_t)usage.ru_stime.tv_sec * 1000 +
+      usage.ru_stime.tv_usec / 1000;
+#ifdef __APPLE__
+  usage_.peak_rss = usage.ru_maxrss;
+#else
+  usage_.peak_rss = (int64_t)usage.ru_maxrss * 1024;  // In kilobytes.
+#endif
+  usage_.blocks_read = usage.ru_inblock;
+  usage_.blocks_written = usage.ru_oublock;
+  usage_.context_switches = usage.ru_nvcsw + usage.ru_nivcsw;
 
   if (WIFEXITED(status)) {
     int exit = WEXITSTATUS(status);
@@ -143,10 +249,6 @@ bool Subprocess::Done() const {
   return fd_ == -1;
 }
 
-const string& Subprocess::GetOutput() const {
-  return buf_;
-}
-
 bool SubprocessSet::interrupted_;
 
 void SubprocessSet::SetInterruptedFlag(int signum) {
@@ -154,7 +256,7 @@ void SubprocessSet::SetInterruptedFlag(int signum) {
   interrupted_ = true;
 }
 
-SubprocessSet::SubprocessSet() {
+SubprocessSet::SubprocessSet() : max_output_(1 << 20) {
   interrupted_ = false;
 
   sigset_t set;
@@ -168,6 +270,25 @@ SubprocessSet::SubprocessSet() {
   act.sa_handler = SetInterruptedFlag;
   if (sigaction(SIGINT, &act, &old_act_) < 0)
     Fatal("sigaction: %s", strerror(errno));
+
+  // Without one, fall back to polling.
+#ifdef linux
+  poll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+#elif defined(USE_KQUEUE)
+  poll_fd_ = kqueue();
+  if (poll_fd_ >= 0) {
+    SetCloseOnExec(poll_fd_);
+    // SIGINT stays blocked while waiting, so watch for it being sent.
+    struct kevent change;
+    EV_SET(&change, SIGINT, EVFILT_SIGNAL, EV_ADD, 0, 0, NULL);
+    if (kevent(poll_fd_, &change, 1, NULL, 0, NULL) < 0) {
+      close(poll_fd_);
+      poll_fd_ = -1;
+    }
+  }
+#else
+  poll_fd_ = -1;
+#endif
 }
 
 SubprocessSet::~SubprocessSet() {
@@ -177,20 +298,140 @@ SubprocessSet::~SubprocessSet() {
     Fatal("sigaction: %s", strerror(errno));
   if (sigprocmask(SIG_SETMASK, &old_mask_, 0) < 0)
     Fatal("sigprocmask: %s", strerror(errno));
+  if (poll_fd_ >= 0)
+    close(poll_fd_);
 }
 
-Subprocess *SubprocessSet::Add(const string& command) {
+Subprocess *SubprocessSet::Add(const string& command, bool use_shell) {
   Subprocess *subprocess = new Subprocess;
-  if (!subprocess->Start(this, command)) {
+  subprocess->max_output_ = max_output_;
+  if (!subprocess->Start(this, command, use_shell)) {
     delete subprocess;
     return 0;
   }
+  if (poll_fd_ >= 0) {
+#ifdef linux
+    epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN | EPOLLPRI | EPOLLRDHUP;
+    event.data.ptr = subprocess;
+    if (epoll_ctl(poll_fd_, EPOLL_CTL_ADD, subprocess->fd_, &event) < 0)
+      Fatal("epoll_ctl: %s", strerror(errno));
+    subprocess->poll_fd_ = poll_fd_;
+#elif defined(USE_KQUEUE)
+    struct kevent change;
+    EV_SET(&change, subprocess->fd_, EVFILT_READ, EV_ADD, 0, 0, subprocess);
+    if (kevent(poll_fd_, &change, 1, NULL, 0, NULL) < 0)
+      Fatal("kevent: %s", strerror(errno));
+#endif
+  }
+#ifdef linux
+  if (nodes_.size() > 1)
+    Place(subprocess);
+#endif
   running_.push_back(subprocess);
   return subprocess;
 }
 
 #ifdef linux
+void SubprocessSet::Place(Subprocess* subprocess) {
+  vector<int> running(nodes_.size());
+  for (vector<Subprocess*>::iterator i = running_.begin();
+       i != running_.end(); ++i) {
+    if ((*i)->node_ >= 0)
+      ++running[(*i)->node_];
+  }
+  int node = (int)(min_element(running.begin(), running.end()) -
+                   running.begin());
+
+  // The child has exec()ed by now, but has barely started; the threads
+  // it starts later are bound too.  One that has exited already is left.
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  for (vector<int>::iterator cpu = nodes_[node].begin();
+       cpu != nodes_[node].end(); ++cpu) {
+    CPU_SET(*cpu, &cpus);
+  }
+  if (sched_setaffinity(subprocess->pid_, sizeof(cpus), &cpus) == 0)
+    subprocess->node_ = node;
+}
+#endif
+
 bool SubprocessSet::DoWork() {
+  if (poll_fd_ >= 0)
+    return WaitForEvents();
+  return PollAll();
+}
+
+#ifdef linux
+bool SubprocessSet::WaitForEvents() {
+  // Take several events per wait, as commands often finish together.
+  epoll_event events[64];
+  int ret = epoll_pwait(poll_fd_, events, sizeof(events) / sizeof(events[0]),
+                        -1, &old_mask_);
+  if (ret == -1) {
+    if (errno != EINTR) {
+      perror("ninja: epoll_pwait");
+      return false;
+    }
+    bool interrupted = interrupted_;
+    interrupted_ = false;
+    return interrupted;
+  }
+
+  for (int i = 0; i < ret; ++i) {
+    Subprocess* subproc = static_cast<Subprocess*>(events[i].data.ptr);
+    subproc->OnPipeReady();
+    if (subproc->Done()) {
+      finished_.push(subproc);
+      running_.erase(find(running_.begin(), running_.end(), subproc));
+    }
+  }
+
+  return false;
+}
+#elif defined(USE_KQUEUE)
+bool SubprocessSet::WaitForEvents() {
+  // Take several events per wait, as commands often finish together.
+  struct kevent events[64];
+  int ret = kevent(poll_fd_, NULL, 0, events,
+                   sizeof(events) / sizeof(events[0]), NULL);
+  if (ret == -1) {
+    if (errno != EINTR)
+      perror("ninja: kevent");
+    return false;
+  }
+
+  for (int i = 0; i < ret; ++i) {
+    if (events[i].filter == EVFILT_SIGNAL) {
+      // Let the SIGINT sent through, to SetInterruptedFlag().
+      sigset_t blocked;
+      sigprocmask(SIG_SETMASK, &old_mask_, &blocked);
+      sigprocmask(SIG_SETMASK, &blocked, 0);
+      if (interrupted_) {
+        interrupted_ = false;
+        return true;
+      }
+      continue;
+    }
+    Subprocess* subproc = reinterpret_cast<Subprocess*>(events[i].udata);
+    subproc->OnPipeReady();
+    if (subproc->Done()) {
+      finished_.push(subproc);
+      running_.erase(find(running_.begin(), running_.end(), subproc));
+    }
+  }
+
+  return false;
+}
+#else
+bool SubprocessSet::WaitForEvents() {
+  return PollAll();
+}
+#endif
+
+#ifdef linux
+bool SubprocessSet::PollAll() {
   vector<pollfd> fds;
   nfds_t nfds = 0;
 
@@ -237,7 +478,7 @@ bool SubprocessSet::DoWork() {
 }
 
 #else  // linux
-bool SubprocessSet::DoWork() {
+bool SubprocessSet::PollAll() {
   fd_set set;
   int nfds = 0;
   FD_ZERO(&set);
@@ -14,13 +14,36 @@
 
 #include "subprocess.h"
 
+#include <psapi.h>
 #include <stdio.h>
 
 #include <algorithm>
 
 #include "util.h"
 
-Subprocess::Subprocess() : child_(NULL) , overlapped_(), is_reading_(false) {
+#ifdef _MSC_VER
+#pragma comment(lib, "psapi.lib")
+#endif
+
+namespace {
+
+/// \a time, in 100 ns units, in milliseconds.
+int64_t Millis(const LARGE_INTEGER& time) {
+  return time.QuadPart / 10000;
+}
+
+int64_t Millis(const FILETIME& time) {
+  LARGE_INTEGER large;
+  large.LowPart = time.dwLowDateTime;
+  large.HighPart = time.dwHighDateTime;
+  return Millis(large);
+}
+
+}  // anonymous namespace
+
+Subprocess::Subprocess() : max_output_(0), dropped_(0), child_(NULL),
+                           job_(NULL), overlapped_(),
+                           overlapped_buf_(4 << 10), is_reading_(false) {
 }
 
 Subprocess::~Subprocess() {
@@ -69,7 +92,8 @@ HANDLE Subprocess::SetupPipe(HANDLE ioport) {
   return output_write_child;
 }
 
-bool Subprocess::Start(SubprocessSet* set, const string& command) {
+bool Subprocess::Start(SubprocessSet* set, const string& command,
+                       bool /* use_shell */) {
   HANDLE child_pipe = SetupPipe(set->ioport_);
 
   SECURITY_ATTRIBUTES security_attributes;
@@ -97,7 +121,8 @@ bool Subprocess::Start(SubprocessSet* set, const string& command) {
   // Do not prepend 'cmd /c' on Windows, this breaks command
   // lines greater than 8,191 chars.
   if (!CreateProcessA(NULL, (char*)command.c_str(), NULL, NULL,
-                      /* inherit handles */ TRUE, CREATE_NEW_PROCESS_GROUP,
+                      /* inherit handles */ TRUE,
+                      CREATE_NEW_PROCESS_GROUP | CREATE_SUSPENDED,
                       NULL, NULL,
                       &startup_info, &process_info)) {
     DWORD error = GetLastError();
@@ -120,6 +145,19 @@ bool Subprocess::Start(SubprocessSet* set, const string& command) {
     CloseHandle(child_pipe);
   CloseHandle(nul);
 
+  // Put the command in a job of its own before it runs, so that the
+  // processes it starts are in it too: their CPU time and I/O count as
+  // the command's, and Clear() can end them all at once.
+  job_ = CreateJobObjectA(NULL, NULL);
+  if (job_ && !AssignProcessToJobObject(job_, process_info.hProcess)) {
+    // Before Windows 8 a process can't be in two jobs, so this fails if
+    // ninja itself runs in one.
+    CloseHandle(job_);
+    job_ = NULL;
+  }
+  if (ResumeThread(process_info.hThread) == (DWORD)-1)
+    Win32Fatal("ResumeThread");
+
   CloseHandle(process_info.hThread);
   child_ = process_info.hProcess;
 
@@ -137,12 +175,17 @@ void Subprocess::OnPipeReady() {
     Win32Fatal("GetOverlappedResult");
   }
 
-  if (is_reading_ && bytes)
-    buf_.append(overlapped_buf_, bytes);
+  if (is_reading_ && bytes) {
+    AppendOutput(&overlapped_buf_[0], bytes);
+    // A command writing a lot fills the buffer each time; read more at
+    // once.
+    if (bytes == overlapped_buf_.size() && overlapped_buf_.size() < (64 << 10))
+      overlapped_buf_.resize(overlapped_buf_.size() * 2);
+  }
 
   memset(&overlapped_, 0, sizeof(overlapped_));
   is_reading_ = true;
-  if (!::ReadFile(pipe_, overlapped_buf_, sizeof(overlapped_buf_),
+  if (!::ReadFile(pipe_, &overlapped_buf_[0], (DWORD)overlapped_buf_.size(),
                   &bytes, &overlapped_)) {
     if (GetLastError() == ERROR_BROKEN_PIPE) {
       CloseHandle(pipe_);
@@ -167,8 +210,38 @@ ExitStatus Subprocess::Finish() {
   DWORD exit_code = 0;
   GetExitCodeProcess(child_, &exit_code);
 
+  // The job's totals include the processes the command started, as a
+  // compiler driver does the compiler.
+  JOBOBJECT_BASIC_AND_IO_ACCOUNTING_INFORMATION job_info;
+  FILETIME creation, exit, kernel, user;
+  IO_COUNTERS io;
+  if (job_ && QueryInformationJobObject(
+                  job_, JobObjectBasicAndIoAccountingInformation, &job_info,
+                  sizeof(job_info), NULL)) {
+    usage_.user_millis = Millis(job_info.BasicInfo.TotalUserTime);
+    usage_.system_millis = Millis(job_info.BasicInfo.TotalKernelTime);
+    usage_.blocks_read = job_info.IoInfo.ReadOperationCount;
+    usage_.blocks_written = job_info.IoInfo.WriteOperationCount;
+  } else {
+    if (GetProcessTimes(child_, &creation, &exit, &kernel, &user)) {
+      usage_.user_millis = Millis(user);
+      usage_.system_millis = Millis(kernel);
+    }
+    if (GetProcessIoCounters(child_, &io)) {
+      usage_.blocks_read = io.ReadOperationCount;
+      usage_.blocks_written = io.WriteOperationCount;
+    }
+  }
+  PROCESS_MEMORY_COUNTERS counters;
+  if (GetProcessMemoryInfo(child_, &counters, sizeof(counters)))
+    usage_.peak_rss = counters.PeakWorkingSetSize;
+
   CloseHandle(child_);
   child_ = NULL;
+  if (job_) {
+    CloseHandle(job_);
+    job_ = NULL;
+  }
 
   return exit_code == 0              ? ExitSuccess :
          exit_code == CONTROL_C_EXIT ? ExitInterrupted :
@@ -179,13 +252,9 @@ bool Subprocess::Done() const {
   return pipe_ == NULL;
 }
 
-const string& Subprocess::GetOutput() const {
-  return buf_;
-}
-
 HANDLE SubprocessSet::ioport_;
 
-SubprocessSet::SubprocessSet() {
+SubprocessSet::SubprocessSet() : max_output_(1 << 20) {
   ioport_ = ::CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 1);
   if (!ioport_)
     Win32Fatal("CreateIoCompletionPort");
@@ -210,9 +279,10 @@ BOOL WINAPI SubprocessSet::NotifyInterrupted(DWORD dwCtrlType) {
   return FALSE;
 }
 
-Subprocess *SubprocessSet::Add(const string& command) {
+Subprocess *SubprocessSet::Add(const string& command, bool use_shell) {
   Subprocess *subprocess = new Subprocess;
-  if (!subprocess->Start(this, command)) {
+  subprocess->max_output_ = max_output_;
+  if (!subprocess->Start(this, command, use_shell)) {
     delete subprocess;
     return 0;
   }
@@ -224,32 +294,37 @@ Subprocess *SubprocessSet::Add(const string& command) {
 }
 
 bool SubprocessSet::DoWork() {
-  DWORD bytes_read;
-  Subprocess* subproc;
-  OVERLAPPED* overlapped;
-
-  if (!GetQueuedCompletionStatus(ioport_, &bytes_read, (PULONG_PTR)&subproc,
-                                 &overlapped, INFINITE)) {
-    if (GetLastError() != ERROR_BROKEN_PIPE)
-      Win32Fatal("GetQueuedCompletionStatus");
+  // Take all the completions there are at once, rather than one per
+  // call, as with many commands running several are often ready.
+  OVERLAPPED_ENTRY entries[64];
+  ULONG count = 0;
+  if (!GetQueuedCompletionStatusEx(ioport_, entries, 64, &count, INFINITE,
+                                   FALSE)) {
+    Win32Fatal("GetQueuedCompletionStatusEx");
   }
 
-  if (!subproc) // A NULL subproc indicates that we were interrupted and is
-                // delivered by NotifyInterrupted above.
-    return true;
+  bool interrupted = false;
+  for (ULONG i = 0; i < count; ++i) {
+    Subprocess* subproc = (Subprocess*)entries[i].lpCompletionKey;
+    if (!subproc) { // A NULL subproc indicates that we were interrupted and
+                    // is delivered by NotifyInterrupted above.
+      interrupted = true;
+      continue;
+    }
 
-  subproc->OnPipeReady();
+    subproc->OnPipeReady();
 
-  if (subproc->Done()) {
-    vector<Subprocess*>::iterator end =
-        std::remove(running_.begin(), running_.end(), subproc);
-    if (running_.end() != end) {
-      finished_.push(subproc);
-      running_.resize(end - running_.begin());
+    if (subproc->Done()) {
+      vector<Subprocess*>::iterator end =
+          std::remove(running_.begin(), running_.end(), subproc);
+      if (running_.end() != end) {
+        finished_.push(subproc);
+        running_.resize(end - running_.begin());
+      }
     }
   }
 
-  return false;
+  return interrupted;
 }
 
 Subprocess* SubprocessSet::NextFinished() {
@@ -263,7 +338,11 @@ Subprocess* SubprocessSet::NextFinished() {
 void SubprocessSet::Clear() {
   for (vector<Subprocess*>::iterator i = running_.begin();
        i != running_.end(); ++i) {
-    if ((*i)->child_) {
+    if ((*i)->job_) {
+      // Ends the command and all it started, console or not.
+      if (!TerminateJobObject((*i)->job_, CONTROL_C_EXIT))
+        Win32Fatal("TerminateJobObject");
+    } else if ((*i)->child_) {
       if (!GenerateConsoleCtrlEvent(CTRL_BREAK_EVENT,
                                     GetProcessId((*i)->child_))) {
         Win32Fatal("GenerateConsoleCtrlEvent");
@@ -0,0 +1,88 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "subprocess.h"
+
+#include <stdio.h>
+
+#include <algorithm>
+
+#ifndef _WIN32
+#define __STDC_FORMAT_MACROS
+#include <inttypes.h>
+#endif
+
+void Subprocess::AppendOutput(const char* data, size_t size) {
+  if (marker_.empty()) {
+    KeepOutput(data, size);
+    return;
+  }
+  held_.append(data, size);
+  size_t start = 0;
+  for (;;) {
+    size_t mark = held_.find(marker_, start);
+    if (mark == string::npos) {
+      // Hold back what may be the start of a marker.
+      size_t keep = held_.size() - min(held_.size() - start,
+                                       marker_.size() - 1);
+      KeepOutput(held_.data() + start, keep - start);
+      held_.erase(0, keep);
+      return;
+    }
+    size_t end = held_.find('\n', mark);
+    if (end == string::npos) {
+      // The rest of the line, an exit code, is a few bytes at most;
+      // otherwise this wasn't a marker line after all.
+      if (held_.size() - mark > marker_.size() + 16) {
+        KeepOutput(held_.data() + start, mark + 1 - start);
+        start = mark + 1;
+        continue;
+      }
+      KeepOutput(held_.data() + start, mark - start);
+      held_.erase(0, mark);
+      return;
+    }
+    KeepOutput(held_.data() + start, mark - start);
+    parts_.push_back(KeptOutput() + held_.substr(mark, end + 1 - mark));
+    buf_.clear();
+    dropped_ = 0;
+    start = end + 1;
+  }
+}
+
+void Subprocess::KeepOutput(const char* data, size_t size) {
+  buf_.append(data, size);
+  // Once the end kept is twice as long as it need be, drop its first
+  // half, so that each byte is moved at most once.
+  size_t half = max_output_ / 2;
+  if (max_output_ && buf_.size() > half + max_output_) {
+    size_t drop = buf_.size() - max_output_;
+    buf_.erase(half, drop);
+    dropped_ += drop;
+  }
+}
+
+string Subprocess::GetOutput() const {
+  return KeptOutput() + held_;
+}
+
+string Subprocess::KeptOutput() const {
+  if (!dropped_)
+    return buf_;
+  size_t half = max_output_ / 2;
+  char marker[64];
+  snprintf(marker, sizeof(marker), "%s[%" PRId64 " bytes of output left out]\n",
+           buf_[half - 1] == '\n' ? "" : "\n", dropped_);
+  return buf_.substr(0, half) + marker + buf_.substr(half);
+}
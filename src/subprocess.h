@@ -27,6 +27,7 @@ using namespace std;
 #endif
 
 #include "exit_status.h"
+#include "resource_usage.h"
 
 /// Subprocess wraps a single async subprocess.  It is entirely
 /// passive: it expects the caller to notify it when its fds are ready
@@ -41,14 +42,51 @@ struct Subprocess {
 
   bool Done() const;
 
-  const string& GetOutput() const;
+  /// What the command wrote to stdout and stderr.  Past
+  /// SubprocessSet::max_output_ bytes, only the beginning and the end of
+  /// it, with a line between saying how much was left out.  After
+  /// SplitOutput(), only what came after the last part split off.
+  string GetOutput() const;
+
+  /// Split the output as it comes in at each \a marker, after the rest
+  /// of its line, as for several commands run one after another that
+  /// are each followed by such a line.  Each part is kept within
+  /// SubprocessSet::max_output_ on its own, and the marker lines whole.
+  /// Call before DoWork() first reads the output.
+  void SplitOutput(const string& marker) { marker_ = marker; }
+  /// The parts split off so far, each ending with its marker line.
+  const vector<string>& output_parts() const { return parts_; }
+
+  /// What the process used, known once Finish() returns.
+  const ResourceUsage& usage() const { return usage_; }
 
  private:
   Subprocess();
-  bool Start(struct SubprocessSet* set, const string& command);
+  bool Start(struct SubprocessSet* set, const string& command,
+             bool use_shell);
   void OnPipeReady();
+  /// Add what the command wrote to buf_, within max_output_, splitting
+  /// it off into parts_ at each marker_.
+  void AppendOutput(const char* data, size_t size);
+  void KeepOutput(const char* data, size_t size);
+  /// buf_, with a line in place of what was left out.
+  string KeptOutput() const;
+#ifndef _WIN32
+  /// Stop watching fd_ and close it.
+  void ClosePipe();
+#endif
 
+  /// The first half of max_output_ bytes of output, then up to its last
+  /// max_output_ bytes, dropped_ bytes after the first half.
   string buf_;
+  size_t max_output_;
+  int64_t dropped_;
+  /// See SplitOutput().  held_ is what may be the start of a marker
+  /// line, not yet added to buf_.
+  string marker_;
+  string held_;
+  vector<string> parts_;
+  ResourceUsage usage_;
 
 #ifdef _WIN32
   /// Set up pipe_ as the parent-side pipe of the subprocess; return the
@@ -56,26 +94,41 @@ struct Subprocess {
   HANDLE SetupPipe(HANDLE ioport);
 
   HANDLE child_;
+  /// The job object child_ and the processes it starts run in, or NULL
+  /// if it couldn't be put in one.
+  HANDLE job_;
   HANDLE pipe_;
   OVERLAPPED overlapped_;
-  char overlapped_buf_[4 << 10];
+  /// Read into.  Doubled, up to 64 KB, each time a read fills it.
+  vector<char> overlapped_buf_;
   bool is_reading_;
 #else
   int fd_;
   pid_t pid_;
+  /// The epoll instance watching fd_, or -1.
+  int poll_fd_;
+  /// The index of the NUMA node it is bound to, or -1.
+  int node_;
 #endif
 
   friend struct SubprocessSet;
 };
 
-/// SubprocessSet runs a ppoll/pselect() loop around a set of Subprocesses.
-/// DoWork() waits for any state change in subprocesses; finished_
-/// is a queue of subprocesses as they finish.
+/// SubprocessSet runs an event loop around a set of Subprocesses: epoll
+/// on Linux and kqueue on the BSDs and macOS, where each pipe is watched
+/// from when its command starts until it ends, or else a ppoll/pselect()
+/// loop over all the pipes at each wait; on Windows an I/O completion
+/// port, whose completions are taken in batches, with each command in a
+/// job object of its own.  DoWork() waits for any state change in
+/// subprocesses; finished_ is a queue of subprocesses as they finish.
 struct SubprocessSet {
   SubprocessSet();
   ~SubprocessSet();
 
-  Subprocess* Add(const string& command);
+  /// Start \a command.  On POSIX it runs through /bin/sh, unless it is
+  /// only words /bin/sh would pass on as they are, in which case, unless
+  /// \a use_shell, it is run directly, saving starting a shell.
+  Subprocess* Add(const string& command, bool use_shell = true);
   bool DoWork();
   Subprocess* NextFinished();
   void Clear();
@@ -83,6 +136,19 @@ struct SubprocessSet {
   vector<Subprocess*> running_;
   queue<Subprocess*> finished_;
 
+  /// The most output kept of each command, in bytes, so that commands
+  /// writing without end don't use up memory.
+  size_t max_output_;
+
+  /// Bind each command started to the CPUs of one of \a nodes, as from
+  /// GetNumaNodes(): whichever has the fewest of the commands running,
+  /// so that the commands are spread evenly, and each stays on one
+  /// socket, with the memory it touches first, which Linux allocates on
+  /// the node touching it.  Linux only; with fewer than two nodes, or
+  /// elsewhere, the kernel places commands as it likes.
+  void SetPlacement(const vector<vector<int> >& nodes) { nodes_ = nodes; }
+  vector<vector<int> > nodes_;
+
 #ifdef _WIN32
   static BOOL WINAPI NotifyInterrupted(DWORD dwCtrlType);
   static HANDLE ioport_;
@@ -92,6 +158,17 @@ struct SubprocessSet {
 
   struct sigaction old_act_;
   sigset_t old_mask_;
+
+  /// The epoll or kqueue instance watching the pipes of running_, or -1
+  /// to poll them all at each DoWork().
+  int poll_fd_;
+  /// DoWork() with poll_fd_, and without.
+  bool WaitForEvents();
+  bool PollAll();
+#ifdef linux
+  /// Bind \a subprocess to a node; see SetPlacement().
+  void Place(Subprocess* subprocess);
+#endif
 #endif
 };
 
@@ -0,0 +1,69 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "metrics.h"
+#include "subprocess.h"
+#include "util.h"
+
+/// Commands started per second, each running \a parallelism at a time,
+/// over \a count commands, through /bin/sh if \a use_shell.
+double Measure(int count, int parallelism, bool use_shell) {
+  SubprocessSet subprocs;
+  int started = 0, finished = 0;
+  int64_t start = GetTimeMillis();
+  while (finished < count) {
+    while (started < count && started - finished < parallelism) {
+      if (!subprocs.Add("true", use_shell))
+        Fatal("couldn't start 'true'");
+      ++started;
+    }
+    subprocs.DoWork();
+    while (Subprocess* subproc = subprocs.NextFinished()) {
+      subproc->Finish();
+      delete subproc;
+      ++finished;
+    }
+  }
+  int64_t delta = GetTimeMillis() - start;
+  return count * 1000.0 / (delta ? delta : 1);
+}
+
+int main() {
+  const int kCount = 2000;
+  const int kParallelism = 64;
+
+  // Starting a command should take as long whatever memory ninja uses, as
+  // it does with posix_spawn() but not with fork(); so time it with the
+  // heap of a small build and of a big one.
+  const int heap_mb[] = { 0, 1024, 4096 };
+  for (size_t i = 0; i < sizeof(heap_mb) / sizeof(heap_mb[0]); ++i) {
+    size_t size = (size_t)heap_mb[i] << 20;
+    char* heap = (char*)malloc(size ? size : 1);
+    if (!heap) {
+      printf("couldn't allocate %d MB\n", heap_mb[i]);
+      continue;
+    }
+    // Touch every page, so that the memory is really mapped.
+    memset(heap, 1, size);
+    printf("%5d MB heap: %8.0f commands/s, %8.0f without /bin/sh\n",
+           heap_mb[i], Measure(kCount, kParallelism, true),
+           Measure(kCount, kParallelism, false));
+    free(heap);
+  }
+  return 0;
+}
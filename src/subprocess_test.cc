@@ -22,6 +22,10 @@
 #include <sys/resource.h>
 #include <unistd.h>
 #endif
+#ifdef linux
+#include <sched.h>
+#include <stdio.h>
+#endif
 
 namespace {
 
@@ -70,6 +74,83 @@ TEST_F(SubprocessTest, NoSuchCommand) {
 
 #ifndef _WIN32
 
+// Commands run directly, without /bin/sh, as they would through it.
+TEST_F(SubprocessTest, RunDirectly) {
+  const char* kCommands[] = {
+    "ls /",  // Run directly.
+    "false",
+    "ninja_no_such_command",  // Falls back to the shell, to say so.
+    "echo $0 | cat",  // Needs the shell.
+    "cd /",
+  };
+  for (size_t i = 0; i < sizeof(kCommands) / sizeof(kCommands[0]); ++i) {
+    Subprocess* shell = subprocs_.Add(kCommands[i], true);
+    Subprocess* direct = subprocs_.Add(kCommands[i], false);
+    ASSERT_NE((Subprocess *) 0, shell);
+    ASSERT_NE((Subprocess *) 0, direct);
+    while (!shell->Done() || !direct->Done())
+      subprocs_.DoWork();
+    EXPECT_EQ(shell->Finish(), direct->Finish()) << kCommands[i];
+    EXPECT_EQ(shell->GetOutput(), direct->GetOutput()) << kCommands[i];
+  }
+}
+
+// Only the beginning and the end of too much output are kept.
+TEST_F(SubprocessTest, LimitOutput) {
+  subprocs_.max_output_ = 1000;
+  Subprocess* subproc = subprocs_.Add("yes | head -c 100000");
+  ASSERT_NE((Subprocess *) 0, subproc);
+  while (!subproc->Done())
+    subprocs_.DoWork();
+  EXPECT_EQ(ExitSuccess, subproc->Finish());
+
+  string output = subproc->GetOutput();
+  string lines;
+  for (int i = 0; i < 250; ++i)
+    lines += "y\n";
+  EXPECT_EQ(lines + "[99000 bytes of output left out]\n" + lines, output);
+}
+
+// Split output is kept within the limit part by part, with the marker
+// lines whole.
+TEST_F(SubprocessTest, SplitOutput) {
+  subprocs_.max_output_ = 1000;
+  Subprocess* subproc = subprocs_.Add(
+      "yes | head -c 100000; printf '\\036mark 0\\n'; "
+      "printf 'short'; printf '\\036mark 1\\n'; "
+      "yes | head -c 3000; printf '\\036mark'");
+  ASSERT_NE((Subprocess *) 0, subproc);
+  subproc->SplitOutput("\036mark");
+  while (!subproc->Done())
+    subprocs_.DoWork();
+  EXPECT_EQ(ExitSuccess, subproc->Finish());
+
+  // How much of the end is kept depends on how the output is read.
+  const vector<string>& parts = subproc->output_parts();
+  ASSERT_EQ(2u, parts.size());
+  EXPECT_GT(2100u, parts[0].size());
+  EXPECT_NE(string::npos, parts[0].find(" bytes of output left out]\n"));
+  EXPECT_EQ("y\n\036mark 0\n", parts[0].substr(parts[0].size() - 10));
+  EXPECT_EQ("short\036mark 1\n", parts[1]);
+  string rest = subproc->GetOutput();
+  EXPECT_GT(2100u, rest.size());
+  EXPECT_NE(string::npos, rest.find(" bytes of output left out]\n"));
+  EXPECT_EQ("y\n\036mark", rest.substr(rest.size() - 7));
+}
+
+TEST_F(SubprocessTest, ResourceUsage) {
+  Subprocess* subproc = subprocs_.Add(
+      "i=0; while [ $i -lt 200000 ]; do i=$((i + 1)); done");
+  ASSERT_NE((Subprocess *) 0, subproc);
+  while (!subproc->Done())
+    subprocs_.DoWork();
+  ASSERT_EQ(ExitSuccess, subproc->Finish());
+  const ResourceUsage& usage = subproc->usage();
+  EXPECT_GT(usage.user_millis + usage.system_millis, 0);
+  EXPECT_GT(usage.peak_rss, 0);
+  EXPECT_GT(usage.context_switches, 0);
+}
+
 TEST_F(SubprocessTest, InterruptChild) {
   Subprocess* subproc = subprocs_.Add("kill -INT $$");
   ASSERT_NE((Subprocess *) 0, subproc);
@@ -105,6 +186,7 @@ TEST_F(SubprocessTest, SetWithSingle) {
   }
   ASSERT_EQ(ExitSuccess, subproc->Finish());
   ASSERT_NE("", subproc->GetOutput());
+  EXPECT_GT(subproc->usage().peak_rss, 0);
 
   ASSERT_EQ(1u, subprocs_.finished_.size());
 }
@@ -178,4 +260,39 @@ TEST_F(SubprocessTest, SetWithLots) {
   }
   ASSERT_EQ(kNumProcs, subprocs_.finished_.size());
 }
+
+TEST_F(SubprocessTest, Placement) {
+  // Two nodes of one CPU each, or the same one twice on a machine with
+  // one: the commands go to each in turn, and run only there.
+  cpu_set_t allowed;
+  ASSERT_EQ(0, sched_getaffinity(0, sizeof(allowed), &allowed));
+  vector<int> cpus;
+  for (int cpu = 0; cpu < CPU_SETSIZE && cpus.size() < 2; ++cpu) {
+    if (CPU_ISSET(cpu, &allowed))
+      cpus.push_back(cpu);
+  }
+  if (cpus.size() < 2)
+    cpus.push_back(cpus[0]);
+  vector<vector<int> > nodes(2);
+  nodes[0].push_back(cpus[0]);
+  nodes[1].push_back(cpus[1]);
+  subprocs_.SetPlacement(nodes);
+
+  // Each waits to be bound before looking.
+  const char kCommand[] =
+      "sleep 0.1; grep Cpus_allowed_list: /proc/$$/status | cut -f2";
+  Subprocess* first = subprocs_.Add(kCommand);
+  Subprocess* second = subprocs_.Add(kCommand);
+  ASSERT_NE((Subprocess*)0, first);
+  ASSERT_NE((Subprocess*)0, second);
+  while (!first->Done() || !second->Done())
+    subprocs_.DoWork();
+  EXPECT_EQ(ExitSuccess, first->Finish());
+  EXPECT_EQ(ExitSuccess, second->Finish());
+  char expected[16];
+  snprintf(expected, sizeof(expected), "%d\n", cpus[0]);
+  EXPECT_EQ(expected, first->GetOutput());
+  snprintf(expected, sizeof(expected), "%d\n", cpus[1]);
+  EXPECT_EQ(expected, second->GetOutput());
+}
 #endif  // linux
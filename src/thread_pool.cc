@@ -0,0 +1,167 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "thread_pool.h"
+
+#include <string.h>
+
+#include <algorithm>
+
+#include "util.h"
+
+#ifdef _WIN32
+
+Mutex::Mutex() {
+  InitializeCriticalSection(&critical_section_);
+}
+
+Mutex::~Mutex() {
+  DeleteCriticalSection(&critical_section_);
+}
+
+void Mutex::Lock() {
+  EnterCriticalSection(&critical_section_);
+}
+
+void Mutex::Unlock() {
+  LeaveCriticalSection(&critical_section_);
+}
+
+ThreadPool::ThreadPool(int threads) {}
+
+ThreadPool::~ThreadPool() {}
+
+void ThreadPool::Post(Task* task) {
+  task->status_ = Task::kQueued;
+}
+
+void ThreadPool::Wait(Task* task) {
+  if (task->status_ == Task::kDone)
+    return;
+  task->status_ = Task::kRunning;
+  task->Run();
+  task->status_ = Task::kDone;
+}
+
+bool ThreadPool::Done(Task* task) {
+  if (task->status_ == Task::kQueued)
+    Wait(task);
+  return task->status_ == Task::kDone;
+}
+
+#else  // !_WIN32
+
+Mutex::Mutex() {
+  pthread_mutex_init(&mutex_, NULL);
+}
+
+Mutex::~Mutex() {
+  pthread_mutex_destroy(&mutex_);
+}
+
+void Mutex::Lock() {
+  pthread_mutex_lock(&mutex_);
+}
+
+void Mutex::Unlock() {
+  pthread_mutex_unlock(&mutex_);
+}
+
+ThreadPool::ThreadPool(int threads) : quit_(false) {
+  pthread_mutex_init(&mutex_, NULL);
+  pthread_cond_init(&cond_, NULL);
+  for (int i = 0; i < threads; ++i) {
+    pthread_t thread;
+    int ret = pthread_create(&thread, NULL, WorkerMain, this);
+    if (ret != 0) {
+      // Tasks still run from Wait(), just with less parallelism.
+      Warning("pthread_create: %s", strerror(ret));
+      break;
+    }
+    threads_.push_back(thread);
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  pthread_mutex_lock(&mutex_);
+  quit_ = true;
+  pthread_cond_broadcast(&cond_);
+  pthread_mutex_unlock(&mutex_);
+  for (vector<pthread_t>::iterator i = threads_.begin();
+       i != threads_.end(); ++i) {
+    pthread_join(*i, NULL);
+  }
+  pthread_cond_destroy(&cond_);
+  pthread_mutex_destroy(&mutex_);
+}
+
+void ThreadPool::Post(Task* task) {
+  pthread_mutex_lock(&mutex_);
+  task->status_ = Task::kQueued;
+  queue_.push_back(task);
+  pthread_cond_broadcast(&cond_);
+  pthread_mutex_unlock(&mutex_);
+}
+
+void ThreadPool::Wait(Task* task) {
+  pthread_mutex_lock(&mutex_);
+  if (task->status_ == Task::kIdle || task->status_ == Task::kQueued) {
+    // Claim it before a worker does.
+    deque<Task*>::iterator i = find(queue_.begin(), queue_.end(), task);
+    if (i != queue_.end())
+      queue_.erase(i);
+    task->status_ = Task::kRunning;
+    pthread_mutex_unlock(&mutex_);
+    task->Run();
+    pthread_mutex_lock(&mutex_);
+    task->status_ = Task::kDone;
+  }
+  while (task->status_ != Task::kDone)
+    pthread_cond_wait(&cond_, &mutex_);
+  pthread_mutex_unlock(&mutex_);
+}
+
+bool ThreadPool::Done(Task* task) {
+  pthread_mutex_lock(&mutex_);
+  bool done = task->status_ == Task::kDone;
+  pthread_mutex_unlock(&mutex_);
+  return done;
+}
+
+// static
+void* ThreadPool::WorkerMain(void* pool) {
+  static_cast<ThreadPool*>(pool)->Work();
+  return NULL;
+}
+
+void ThreadPool::Work() {
+  pthread_mutex_lock(&mutex_);
+  for (;;) {
+    while (queue_.empty() && !quit_)
+      pthread_cond_wait(&cond_, &mutex_);
+    if (quit_)
+      break;
+    Task* task = queue_.front();
+    queue_.pop_front();
+    task->status_ = Task::kRunning;
+    pthread_mutex_unlock(&mutex_);
+    task->Run();
+    pthread_mutex_lock(&mutex_);
+    task->status_ = Task::kDone;
+    pthread_cond_broadcast(&cond_);
+  }
+  pthread_mutex_unlock(&mutex_);
+}
+
+#endif  // _WIN32
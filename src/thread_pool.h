@@ -0,0 +1,104 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef NINJA_THREAD_POOL_H_
+#define NINJA_THREAD_POOL_H_
+
+#include <deque>
+#include <vector>
+using namespace std;
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+/// A non-recursive mutual exclusion lock.
+struct Mutex {
+  Mutex();
+  ~Mutex();
+
+  void Lock();
+  void Unlock();
+
+ private:
+#ifdef _WIN32
+  CRITICAL_SECTION critical_section_;
+#else
+  pthread_mutex_t mutex_;
+#endif
+
+  Mutex(const Mutex&);
+  void operator=(const Mutex&);
+};
+
+/// Holds a Mutex for the lifetime of the object.
+struct ScopedLock {
+  explicit ScopedLock(Mutex* mutex) : mutex_(mutex) { mutex_->Lock(); }
+  ~ScopedLock() { mutex_->Unlock(); }
+
+ private:
+  Mutex* mutex_;
+};
+
+/// A fixed set of worker threads running Tasks in the order they were
+/// posted.  On Windows no threads are started; tasks run on the calling
+/// thread when they are waited for.
+struct ThreadPool {
+  struct Task {
+    Task() : status_(kIdle) {}
+    virtual ~Task() {}
+
+    /// Do the work.  Called exactly once, from some thread.
+    virtual void Run() = 0;
+
+   private:
+    friend struct ThreadPool;
+    enum Status { kIdle, kQueued, kRunning, kDone };
+    Status status_;
+  };
+
+  explicit ThreadPool(int threads);
+  /// Wait for running tasks to finish and stop the workers.  Tasks that
+  /// were posted but not started are never run.
+  ~ThreadPool();
+
+  /// Queue \a task to run on a worker thread.  The task must outlive
+  /// either the pool or a call to Wait() for it.
+  void Post(Task* task);
+
+  /// Wait until \a task has run.  If no worker has picked it up yet it
+  /// is run right away on the calling thread instead.
+  void Wait(Task* task);
+
+  /// Whether \a task has run, without waiting for it.  On Windows, where
+  /// there are no workers, a posted task is run now.
+  bool Done(Task* task);
+
+ private:
+#ifndef _WIN32
+  static void* WorkerMain(void* pool);
+  void Work();
+
+  pthread_mutex_t mutex_;
+  /// Signalled when a task is queued or finishes.
+  pthread_cond_t cond_;
+  deque<Task*> queue_;
+  bool quit_;
+  vector<pthread_t> threads_;
+#endif
+};
+
+#endif  // NINJA_THREAD_POOL_H_
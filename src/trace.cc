@@ -0,0 +1,141 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "trace.h"
+
+#include <errno.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#define __STDC_FORMAT_MACROS
+#include <inttypes.h>
+#endif
+
+Tracer* g_tracer = NULL;
+
+namespace {
+
+/// The "pid" of each group of tracks.
+const int kNinjaProcess = 1;
+const int kJobsProcess = 2;
+
+}  // anonymous namespace
+
+string JSONString(const string& s) {
+  string out = "\"";
+  for (string::const_iterator i = s.begin(); i != s.end(); ++i) {
+    unsigned char c = *i;
+    if (c == '"' || c == '\\') {
+      out += '\\';
+      out += c;
+    } else if (c < 0x20) {
+      char buf[8];
+      snprintf(buf, sizeof(buf), "\\u%04x", c);
+      out += buf;
+    } else {
+      out += c;
+    }
+  }
+  out += '"';
+  return out;
+}
+
+Tracer::Tracer() : file_(NULL), job_tracks_(0) {}
+
+Tracer::~Tracer() {
+  Close();
+}
+
+bool Tracer::Open(const string& path, string* err) {
+  file_ = fopen(path.c_str(), "w");
+  if (!file_) {
+    *err = strerror(errno);
+    return false;
+  }
+  // The closing "]" is optional, so the trace loads even if ninja
+  // doesn't get to Close().
+  fprintf(file_, "[\n"
+          "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,"
+          "\"args\":{\"name\":\"ninja\"}},\n"
+          "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,"
+          "\"args\":{\"name\":\"jobs\"}}",
+          kNinjaProcess, kJobsProcess);
+  ScopedLock lock(&mutex_);
+  ThreadTrack();  // The main thread's is the first.
+  return true;
+}
+
+void Tracer::Span(const string& name, int64_t start, int64_t duration) {
+  if (duration < kMinSpanMicros)
+    return;
+  ScopedLock lock(&mutex_);
+  if (!file_)
+    return;
+  int track = ThreadTrack();
+  fprintf(file_, ",\n{\"name\":%s,\"ph\":\"X\",\"pid\":%d,\"tid\":%d,"
+          "\"ts\":%" PRId64 ",\"dur\":%" PRId64 "}",
+          JSONString(name).c_str(), kNinjaProcess, track, start, duration);
+}
+
+void Tracer::JobSpan(const string& name, int slot, int64_t start,
+                     int64_t end, const string& args) {
+  ScopedLock lock(&mutex_);
+  if (!file_)
+    return;
+  // Name the tracks so that they sort by slot.
+  for (; job_tracks_ <= slot; ++job_tracks_) {
+    fprintf(file_, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,"
+            "\"tid\":%d,\"args\":{\"name\":\"job %d\"}}",
+            kJobsProcess, job_tracks_, job_tracks_ + 1);
+  }
+  fprintf(file_, ",\n{\"name\":%s,\"cat\":\"job\",\"ph\":\"X\",\"pid\":%d,"
+          "\"tid\":%d,\"ts\":%" PRId64 ",\"dur\":%" PRId64 ","
+          "\"args\":{%s}}",
+          JSONString(name).c_str(), kJobsProcess, slot, start, end - start,
+          args.c_str());
+}
+
+void Tracer::Close() {
+  ScopedLock lock(&mutex_);
+  if (!file_)
+    return;
+  fprintf(file_, "\n]\n");
+  fclose(file_);
+  file_ = NULL;
+}
+
+int Tracer::ThreadTrack() {
+#ifdef _WIN32
+  return (int)GetCurrentThreadId();
+#else
+  pthread_t self = pthread_self();
+  for (size_t i = 0; i < threads_.size(); ++i) {
+    if (pthread_equal(threads_[i], self))
+      return (int)i + 1;
+  }
+  threads_.push_back(self);
+  int track = (int)threads_.size();
+  char name[32];
+  if (track == 1)
+    snprintf(name, sizeof(name), "main");
+  else
+    snprintf(name, sizeof(name), "thread %d", track);
+  fprintf(file_, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,"
+          "\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+          kNinjaProcess, track, name);
+  return track;
+#endif
+}
@@ -0,0 +1,81 @@
+// Copyright 2012 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef NINJA_TRACE_H_
+#define NINJA_TRACE_H_
+
+#include <stdio.h>
+
+#include <string>
+#include <vector>
+using namespace std;
+
+#ifndef _WIN32
+#include <pthread.h>
+#endif
+
+#include "thread_pool.h"
+#include "util.h"  // int64_t
+
+/// Writes what a build did as Chrome trace events, for -d trace=PATH,
+/// in the JSON format chrome://tracing and Perfetto load.  There are two
+/// groups of tracks: ninja's own, one per thread, with a span for each
+/// METRIC_RECORD (see metrics.h) that took long enough to matter; and the
+/// jobs, one track per command running at once, with a span for each.
+/// Times are in microseconds, as GetTimeMicros() gives them.
+struct Tracer {
+  Tracer();
+  ~Tracer();
+
+  /// Start writing to \a path.  Returns false, filling in \a err, if it
+  /// can't be opened.  To be called on the main thread.
+  bool Open(const string& path, string* err);
+
+  /// Record ninja's own \a name, from \a start for \a duration, on the
+  /// calling thread's track.  Spans shorter than kMinSpanMicros are left
+  /// out, as the likes of canonicalizing a path happen millions of times.
+  void Span(const string& name, int64_t start, int64_t duration);
+
+  /// Record a command, \a name, from \a start to \a end, on the track of
+  /// the job slot \a slot.  \a args is the body of a JSON object.
+  void JobSpan(const string& name, int slot, int64_t start, int64_t end,
+               const string& args);
+
+  /// Finish the file.
+  void Close();
+
+  static const int64_t kMinSpanMicros = 20;
+
+ private:
+  /// The track of the calling thread, naming it if new.  Called with
+  /// mutex_ held.
+  int ThreadTrack();
+
+  FILE* file_;
+  Mutex mutex_;
+  /// The job slots named so far.
+  int job_tracks_;
+#ifndef _WIN32
+  /// The threads seen so far, whose track is their index plus one.
+  vector<pthread_t> threads_;
+#endif
+};
+
+/// \a s quoted as a JSON string.
+string JSONString(const string& s);
+
+/// The tracer of -d trace, or NULL.
+extern Tracer* g_tracer;
+
+#endif  // NINJA_TRACE_H_
@@ -29,22 +29,32 @@
 #include <sys/types.h>
 
 #ifndef _WIN32
+#include <sys/mman.h>
 #include <sys/time.h>
+#include <unistd.h>
 #endif
 
+#include <algorithm>
 #include <vector>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #if defined(__APPLE__) || defined(__FreeBSD__)
 #include <sys/sysctl.h>
 #elif defined(__SVR4) && defined(__sun)
 #include <unistd.h>
 #include <sys/loadavg.h>
 #elif defined(linux)
+#include <dirent.h>
+#include <sched.h>
 #include <sys/sysinfo.h>
 #endif
 
 #include "edit_distance.h"
 #include "metrics.h"
+#include "string_piece.h"
 
 void Fatal(const char* msg, ...) {
   va_list ap;
@@ -82,34 +92,77 @@ void Error(const char* msg, ...) {
   fprintf(stderr, "\n");
 }
 
-bool CanonicalizePath(string* path, string* err) {
-  METRIC_RECORD("canonicalize str");
-  size_t len = path->size();
-  char* str = 0;
-  if (len > 0)
-    str = &(*path)[0];
-  if (!CanonicalizePath(str, &len, err))
-    return false;
-  path->resize(len);
-  return true;
+namespace {
+
+const int kMaxPathComponents = 30;
+
+/// Add a component starting at \a start to CanonicalizePath()'s list.
+inline void AddComponent(char* start, char** components, int* count) {
+  if (*count == kMaxPathComponents)
+    Fatal("path has too many components");
+  components[(*count)++] = start;
 }
 
-bool CanonicalizePath(char* path, size_t* len, string* err) {
-  // WARNING: this function is performance-critical; please benchmark
-  // any changes you make to it.
-  METRIC_RECORD("canonicalize path");
+/// Find the first place in [src, end) where CanonicalizePath() has more
+/// to do than keep what is there: a '/' followed by '/' or '.', or a
+/// final '/'.  Returns it, or \a end if there is none.  Before it there
+/// are only components, none starting with '.', separated by single
+/// slashes; they canonicalize to themselves, so this just adds each to
+/// \a components, as CanonicalizePath() would have.  \a src must start
+/// the first of them.
+///
+/// With SSE2 this looks at 16 bytes at a time, which on typical paths
+/// leaves almost nothing for the byte-at-a-time loop to do.
+char* SkipCanonicalComponents(char* src, const char* end, char** components,
+                              int* count) {
+  AddComponent(src, components, count);
+  char* p = src;
+#ifdef __SSE2__
+  const __m128i kSlash = _mm_set1_epi8('/');
+  const __m128i kDot = _mm_set1_epi8('.');
+  // Each byte is compared with the one after it, so stop a byte short.
+  while (end - p > 16) {
+    __m128i here = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+    __m128i next = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 1));
+    unsigned slashes = _mm_movemask_epi8(_mm_cmpeq_epi8(here, kSlash));
+    unsigned special = _mm_movemask_epi8(
+        _mm_or_si128(_mm_cmpeq_epi8(next, kSlash),
+                     _mm_cmpeq_epi8(next, kDot)));
+    unsigned stop = slashes & special;
+    if (stop)
+      slashes &= (stop & -stop) - 1;  // The slashes before the first stop.
+    while (slashes) {
+      AddComponent(p + __builtin_ctz(slashes) + 1, components, count);
+      slashes &= slashes - 1;
+    }
+    if (stop)
+      return p + __builtin_ctz(stop);
+    p += 16;
+  }
+#endif
+  for (; p < end; ++p) {
+    if (*p != '/')
+      continue;
+    if (p + 1 == end || p[1] == '/' || p[1] == '.')
+      return p;
+    AddComponent(p + 1, components, count);
+  }
+  return p;
+}
+
+bool CanonicalizePathImpl(char* path, size_t* len, bool vector_scan,
+                          string* err) {
   if (*len == 0) {
     *err = "empty path";
     return false;
   }
 
-  const int kMaxPathComponents = 30;
   char* components[kMaxPathComponents];
   int component_count = 0;
 
   char* start = path;
   char* dst = start;
-  const char* src = start;
+  char* src = start;
   const char* end = start + *len;
 
   if (*src == '/') {
@@ -128,6 +181,20 @@ bool CanonicalizePath(char* path, size_t* len, string* err) {
 #endif
   }
 
+  if (vector_scan) {
+    // Leading '..' components stay, as do the components after them up
+    // to the first that needs work; most paths are all of that.
+    while (end - src > 3 && src[0] == '.' && src[1] == '.' && src[2] == '/')
+      src += 3;
+    if (src < end && *src != '.' && *src != '/') {
+      // Resume after the '/' that needs work, as if the loop below had
+      // copied everything before it (and the byte at |end|) in place.
+      src = SkipCanonicalComponents(src, end, components,
+                                    &component_count) + 1;
+    }
+    dst = src;
+  }
+
   while (src < end) {
     if (*src == '.') {
       if (src + 1 == end || src[1] == '/') {
@@ -154,10 +221,7 @@ bool CanonicalizePath(char* path, size_t* len, string* err) {
       continue;
     }
 
-    if (component_count == kMaxPathComponents)
-      Fatal("path has too many components");
-    components[component_count] = dst;
-    ++component_count;
+    AddComponent(dst, components, &component_count);
 
     while (*src != '/' && src != end)
       *dst++ = *src++;
@@ -173,6 +237,43 @@ bool CanonicalizePath(char* path, size_t* len, string* err) {
   return true;
 }
 
+}  // anonymous namespace
+
+bool CanonicalizePath(string* path, string* err) {
+  METRIC_RECORD("canonicalize str");
+  size_t len = path->size();
+  char* str = 0;
+  if (len > 0)
+    str = &(*path)[0];
+  if (!CanonicalizePath(str, &len, err))
+    return false;
+  path->resize(len);
+  return true;
+}
+
+bool CanonicalizePath(char* path, size_t* len, string* err) {
+  // WARNING: this function is performance-critical; please benchmark
+  // any changes you make to it (see canon_perftest).
+  METRIC_RECORD("canonicalize path");
+  return CanonicalizePathImpl(path, len, true, err);
+}
+
+bool CanonicalizePathScalar(char* path, size_t* len, string* err) {
+  return CanonicalizePathImpl(path, len, false, err);
+}
+
+bool CanonicalizePaths(vector<StringPiece>* paths, string* err) {
+  METRIC_RECORD("canonicalize paths");
+  for (vector<StringPiece>::iterator i = paths->begin(); i != paths->end();
+       ++i) {
+    if (!CanonicalizePathImpl(const_cast<char*>(i->str_), &i->len_, true,
+                              err)) {
+      return false;
+    }
+  }
+  return true;
+}
+
 int ReadFile(const string& path, string* contents, string* err) {
   FILE* f = fopen(path.c_str(), "r");
   if (!f) {
@@ -185,6 +286,7 @@ int ReadFile(const string& path, string* contents, string* err) {
   while ((len = fread(buf, 1, sizeof(buf), f)) > 0) {
     contents->append(buf, len);
   }
+  METRIC_COUNT("bytes read", contents->size());
   if (ferror(f)) {
     err->assign(strerror(errno));  // XXX errno?
     contents->clear();
@@ -195,6 +297,58 @@ int ReadFile(const string& path, string* contents, string* err) {
   return 0;
 }
 
+MappedFile::~MappedFile() {
+#ifndef _WIN32
+  if (mapped_)
+    munmap((void*)data_, size_);
+#endif
+}
+
+int MappedFile::Open(const string& path, string* err) {
+#ifndef _WIN32
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    err->assign(strerror(errno));
+    return -errno;
+  }
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    err->assign(strerror(errno));
+    close(fd);
+    return -errno;
+  }
+  // The kernel fills the rest of the last page with zeros, which gives
+  // the trailing NUL; a file that exactly fills its pages has none.
+  static const long page_size = sysconf(_SC_PAGESIZE);
+  if (S_ISREG(st.st_mode) && st.st_size > 0 && st.st_size % page_size != 0) {
+    void* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data != MAP_FAILED) {
+      data_ = (const char*)data;
+      size_ = st.st_size;
+      mapped_ = true;
+    }
+  }
+  close(fd);
+  if (mapped_)
+    return 0;
+#endif
+  string contents;
+  int ret = ::ReadFile(path, &contents, err);
+  Adopt(&contents);
+  return ret;
+}
+
+void MappedFile::Adopt(string* contents) {
+#ifndef _WIN32
+  if (mapped_)
+    munmap((void*)data_, size_);
+#endif
+  mapped_ = false;
+  contents_.swap(*contents);
+  data_ = contents_.c_str();
+  size_ = contents_.size();
+}
+
 void SetCloseOnExec(int fd) {
 #ifndef _WIN32
   int flags = fcntl(fd, F_GETFD);
@@ -212,6 +366,30 @@ void SetCloseOnExec(int fd) {
 #endif  // ! _WIN32
 }
 
+bool IsSameFile(int fd, const string& path) {
+#ifndef _WIN32
+  struct stat open_st, path_st;
+  if (fstat(fd, &open_st) < 0 || stat(path.c_str(), &path_st) < 0)
+    return false;
+  return open_st.st_dev == path_st.st_dev && open_st.st_ino == path_st.st_ino;
+#else
+  HANDLE path_handle = CreateFileA(path.c_str(), 0,
+      FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL,
+      OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, NULL);
+  if (path_handle == INVALID_HANDLE_VALUE)
+    return false;
+  BY_HANDLE_FILE_INFORMATION open_info, path_info;
+  bool same =
+      GetFileInformationByHandle((HANDLE)_get_osfhandle(fd), &open_info) &&
+      GetFileInformationByHandle(path_handle, &path_info) &&
+      open_info.dwVolumeSerialNumber == path_info.dwVolumeSerialNumber &&
+      open_info.nFileIndexHigh == path_info.nFileIndexHigh &&
+      open_info.nFileIndexLow == path_info.nFileIndexLow;
+  CloseHandle(path_handle);
+  return same;
+#endif  // ! _WIN32
+}
+
 
 const char* SpellcheckStringV(const string& text,
                               const vector<const char*>& words) {
@@ -295,6 +473,75 @@ string StripAnsiEscapeCodes(const string& in) {
   return stripped;
 }
 
+bool ParseCpuList(const string& list, vector<int>* cpus) {
+  const char* p = list.c_str();
+  while (*p && *p != '\n') {
+    char* end;
+    long first = strtol(p, &end, 10);
+    if (end == p || first < 0)
+      return false;
+    long last = first;
+    p = end;
+    if (*p == '-') {
+      ++p;
+      last = strtol(p, &end, 10);
+      if (end == p || last < first)
+        return false;
+      p = end;
+    }
+    for (long cpu = first; cpu <= last; ++cpu)
+      cpus->push_back((int)cpu);
+    if (*p == ',')
+      ++p;
+    else if (*p && *p != '\n')
+      return false;
+  }
+  return true;
+}
+
+#if defined(linux)
+vector<vector<int> > GetNumaNodes() {
+  vector<vector<int> > nodes;
+  cpu_set_t allowed;
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0)
+    return nodes;
+  DIR* dir = opendir("/sys/devices/system/node");
+  if (!dir)
+    return nodes;
+  // Nodes may be numbered with gaps; keep them in order.
+  vector<int> ids;
+  while (struct dirent* entry = readdir(dir)) {
+    int id;
+    char rest;
+    if (sscanf(entry->d_name, "node%d%c", &id, &rest) == 1)
+      ids.push_back(id);
+  }
+  closedir(dir);
+  sort(ids.begin(), ids.end());
+  for (vector<int>::iterator id = ids.begin(); id != ids.end(); ++id) {
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist",
+             *id);
+    string list, err;
+    vector<int> cpus;
+    if (ReadFile(path, &list, &err) < 0 || !ParseCpuList(list, &cpus))
+      return vector<vector<int> >();
+    vector<int> usable;
+    for (vector<int>::iterator cpu = cpus.begin(); cpu != cpus.end(); ++cpu) {
+      if (*cpu < CPU_SETSIZE && CPU_ISSET(*cpu, &allowed))
+        usable.push_back(*cpu);
+    }
+    if (!usable.empty())
+      nodes.push_back(usable);
+  }
+  return nodes;
+}
+#else
+vector<vector<int> > GetNumaNodes() {
+  return vector<vector<int> >();
+}
+#endif
+
 #if defined(linux)
 int GetProcessorCount() {
   return get_nprocs();
@@ -343,6 +590,144 @@ double GetLoadAverage() {
 }
 #endif // _WIN32
 
+#if defined(linux)
+namespace {
+
+/// The total time, in microseconds, that some task stalled on the
+/// resource of the /proc/pressure file \a path, or -1.
+int64_t ReadPressureStallTotal(const char* path) {
+  FILE* f = fopen(path, "r");
+  if (!f)
+    return -1;
+  long long total = -1;
+  char line[256];
+  // Kernels without pressure accounting enabled fail the read.
+  if (fgets(line, sizeof(line), f) && strncmp(line, "some ", 5) == 0) {
+    const char* field = strstr(line, " total=");
+    if (field)
+      total = atoll(field + 7);
+  }
+  fclose(f);
+  return total;
+}
+
+/// The time all CPUs have spent, and spent waiting for I/O, in ticks.
+bool ReadCpuTimes(int64_t* total, int64_t* iowait) {
+  FILE* f = fopen("/proc/stat", "r");
+  if (!f)
+    return false;
+  long long user, nice, system, idle, io, irq, softirq;
+  int fields = fscanf(f, "cpu %lld %lld %lld %lld %lld %lld %lld",
+                      &user, &nice, &system, &idle, &io, &irq, &softirq);
+  fclose(f);
+  if (fields != 7)
+    return false;
+  *total = user + nice + system + idle + io + irq + softirq;
+  *iowait = io;
+  return true;
+}
+
+/// How many tasks are running or waiting to, or -1.
+int ReadRunnableTasks() {
+  FILE* f = fopen("/proc/loadavg", "r");
+  if (!f)
+    return -1;
+  int runnable = -1;
+  if (fscanf(f, "%*f %*f %*f %d/", &runnable) != 1)
+    runnable = -1;
+  fclose(f);
+  return runnable;
+}
+
+}  // anonymous namespace
+
+bool PressureSampler::Sample(double* cpu, double* io) {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  int64_t now = (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+
+  if (psi_) {
+    int64_t cpu_stall = ReadPressureStallTotal("/proc/pressure/cpu");
+    int64_t io_stall = ReadPressureStallTotal("/proc/pressure/io");
+    if (cpu_stall >= 0 && io_stall >= 0) {
+      bool sampled = last_time_ != 0 && now > last_time_;
+      if (sampled) {
+        *cpu = min(1.0, (cpu_stall - last_cpu_) / (double)(now - last_time_));
+        *io = min(1.0, (io_stall - last_io_) / (double)(now - last_time_));
+      }
+      last_time_ = now;
+      last_cpu_ = cpu_stall;
+      last_io_ = io_stall;
+      return sampled;
+    }
+    psi_ = false;
+    last_time_ = 0;
+  }
+
+  // Without pressure stall information, the share of the CPU time spent
+  // waiting for I/O will do for I/O, and the share of the runnable tasks
+  // that don't fit on the CPUs, right now, for the CPU.
+  int64_t total, iowait;
+  int runnable = ReadRunnableTasks();
+  int processors = GetProcessorCount();
+  if (!ReadCpuTimes(&total, &iowait) || runnable < 0 || processors <= 0)
+    return false;
+  bool sampled = last_time_ != 0 && total > last_cpu_;
+  if (sampled) {
+    *io = (iowait - last_io_) / (double)(total - last_cpu_);
+    *cpu = runnable > processors ?
+        (runnable - processors) / (double)runnable : 0.0;
+  }
+  last_time_ = now;
+  last_cpu_ = total;
+  last_io_ = iowait;
+  return sampled;
+}
+
+int64_t GetAvailableMemory() {
+  FILE* f = fopen("/proc/meminfo", "r");
+  if (!f)
+    return -1;
+  // Kernels before 3.14 don't estimate MemAvailable; free memory plus
+  // the page cache is close enough.
+  int64_t available = -1, free_memory = -1, cached = -1;
+  char line[256];
+  while (fgets(line, sizeof(line), f)) {
+    long long kb;
+    if (sscanf(line, "MemAvailable: %lld kB", &kb) == 1)
+      available = kb * 1024;
+    else if (sscanf(line, "MemFree: %lld kB", &kb) == 1)
+      free_memory = kb * 1024;
+    else if (sscanf(line, "Cached: %lld kB", &kb) == 1)
+      cached = kb * 1024;
+  }
+  fclose(f);
+  if (available < 0 && free_memory >= 0 && cached >= 0)
+    available = free_memory + cached;
+  return available;
+}
+#elif defined(_WIN32)
+int64_t GetAvailableMemory() {
+  MEMORYSTATUSEX status;
+  status.dwLength = sizeof(status);
+  if (!GlobalMemoryStatusEx(&status))
+    return -1;
+  return status.ullAvailPhys;
+}
+
+bool PressureSampler::Sample(double* cpu, double* io) {
+  return false;
+}
+#else
+int64_t GetAvailableMemory() {
+  return -1;
+}
+
+bool PressureSampler::Sample(double* cpu, double* io) {
+  return false;
+}
+#endif
+
 string ElideMiddle(const string& str, size_t width) {
   const int kMargin = 3;  // Space for "...".
   string result = str;
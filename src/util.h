@@ -25,6 +25,18 @@
 #include <vector>
 using namespace std;
 
+/// For functions that load whole aligned blocks, which may run past the
+/// end of the buffer they scan but never past the page holding its end.
+#if defined(__clang__) || \
+    (defined(__GNUC__) && (__GNUC__ > 4 || \
+                           (__GNUC__ == 4 && __GNUC_MINOR__ >= 8)))
+#define NINJA_NO_SANITIZE_ADDRESS __attribute__((no_sanitize_address))
+#else
+#define NINJA_NO_SANITIZE_ADDRESS
+#endif
+
+struct StringPiece;
+
 /// Log a fatal message and exit.
 void Fatal(const char* msg, ...);
 
@@ -39,14 +51,50 @@ bool CanonicalizePath(string* path, string* err);
 
 bool CanonicalizePath(char* path, size_t* len, string* err);
 
+/// CanonicalizePath() without the vector scan of the parts of the path
+/// that are already canonical; for tests and benchmarks.
+bool CanonicalizePathScalar(char* path, size_t* len, string* err);
+
+/// Canonicalize each of \a paths, which must point into writable memory,
+/// in place, e.g. all of a depfile's inputs.  Stops at the first error.
+bool CanonicalizePaths(vector<StringPiece>* paths, string* err);
+
 /// Read a file to a string (in text mode: with CRLF conversion
 /// on Windows).
 /// Returns -errno and fills in \a err on error.
 int ReadFile(const string& path, string* contents, string* err);
 
+/// A read-only view of a whole file, memory-mapped where possible and
+/// read into memory with ReadFile() otherwise.  The contents are always
+/// followed by a NUL byte, as the Lexer expects.
+struct MappedFile {
+  MappedFile() : data_(NULL), size_(0), mapped_(false) {}
+  ~MappedFile();
+
+  /// Returns -errno and fills in \a err on error.
+  int Open(const string& path, string* err);
+
+  /// Use \a contents, which this takes over, instead of a file.
+  void Adopt(string* contents);
+
+  const char* data_;
+  size_t size_;
+
+ private:
+  bool mapped_;
+  string contents_;
+
+  MappedFile(const MappedFile&);
+  void operator=(const MappedFile&);
+};
+
 /// Mark a file descriptor to not be inherited on exec()s.
 void SetCloseOnExec(int fd);
 
+/// Whether the file open as \a fd is still the one at \a path: another
+/// process may have replaced it, as by renaming another over it.
+bool IsSameFile(int fd, const string& path);
+
 /// Given a misspelled string and a list of correct spellings, returns
 /// the closest match or NULL if there is no close enough match.
 const char* SpellcheckStringV(const string& text, const vector<const char*>& words);
@@ -65,6 +113,38 @@ int GetProcessorCount();
 /// on error.
 double GetLoadAverage();
 
+/// Samples how contended the machine is: how much of the time runnable
+/// tasks wait for a CPU, and for I/O.
+struct PressureSampler {
+  PressureSampler() : psi_(true), last_time_(0), last_cpu_(0), last_io_(0) {}
+
+  /// Fill in the share of the time since the previous call, from 0 to 1,
+  /// that tasks waited for a CPU in \a cpu and for I/O in \a io.
+  /// Returns false on the first call, and where it can't be told.
+  bool Sample(double* cpu, double* io);
+
+ private:
+  /// Whether the kernel's pressure stall information is readable; if
+  /// not, the CPU times and run queue length stand in for it.
+  bool psi_;
+  /// The time and counters of the previous sample.
+  int64_t last_time_;
+  int64_t last_cpu_;
+  int64_t last_io_;
+};
+
+/// @return the memory, in bytes, that programs can use without the
+/// machine swapping.  A negative value is returned where it isn't known.
+int64_t GetAvailableMemory();
+
+/// Parse a Linux CPU list, such as "0-3,8,10-11\n", into \a cpus.
+/// Returns false if it isn't one.
+bool ParseCpuList(const string& list, vector<int>* cpus);
+
+/// The CPUs of each NUMA node that this process may run on, leaving out
+/// nodes it may use none of.  Empty where they can't be told; Linux only.
+vector<vector<int> > GetNumaNodes();
+
 /// Elide the given string @a str with '...' in the middle if the length
 /// exceeds @a width.
 string ElideMiddle(const string& str, size_t width);
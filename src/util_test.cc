@@ -14,6 +14,8 @@
 
 #include "util.h"
 
+#include "string_piece.h"
+
 #include "test.h"
 
 TEST(CanonicalizePath, PathSamples) {
@@ -136,6 +138,54 @@ TEST(CanonicalizePath, NotNullTerminated) {
   EXPECT_EQ("file ./file bar/.", string(path));
 }
 
+TEST(CanonicalizePath, LongPaths) {
+  // Long enough that the vector scan finds the work to do past its first
+  // block, or not at all.
+  const char* kPaths[] = {
+    "../../third_party/WebKit/Source/WebCore/platform/LevelDB.cpp",
+    "third_party/WebKit/Source/WebCore/platform/../leveldb/LevelDB.cpp",
+    "third_party/WebKit/Source/WebCore/platform/./leveldb/LevelDB.cpp",
+    "third_party/WebKit/Source/WebCore/platform//leveldb/LevelDB.cpp",
+    "third_party/WebKit/Source/WebCore/platform/leveldb/.hidden/",
+    "third_party/WebKit/Source/WebCore/platform/leveldb/../../../../..",
+    "/usr/include/x86_64-linux-gnu/bits/../sys/../bits/stdio2.h",
+    "abcdefghijklmno/p/q",
+    "abcdefghijklmnop/../q",
+  };
+  for (size_t i = 0; i < sizeof(kPaths) / sizeof(kPaths[0]); ++i) {
+    string scalar = kPaths[i], vector = kPaths[i], err;
+    size_t scalar_len = scalar.size(), vector_len = vector.size();
+    EXPECT_TRUE(CanonicalizePathScalar(&scalar[0], &scalar_len, &err));
+    EXPECT_TRUE(CanonicalizePath(&vector[0], &vector_len, &err));
+    EXPECT_EQ(scalar.substr(0, scalar_len), vector.substr(0, vector_len));
+  }
+
+  string path = "third_party/WebKit/Source/WebCore/platform/../LevelDB.cpp";
+  string err;
+  EXPECT_TRUE(CanonicalizePath(&path, &err));
+  EXPECT_EQ("third_party/WebKit/Source/WebCore/LevelDB.cpp", path);
+}
+
+TEST(CanonicalizePaths, Batch) {
+  string buf = "foo/./bar.h ../baz/../qux.h third_party/long/path.h";
+  vector<StringPiece> paths;
+  paths.push_back(StringPiece(&buf[0], 11));
+  paths.push_back(StringPiece(&buf[12], 15));
+  paths.push_back(StringPiece(&buf[28], 23));
+  string err;
+  EXPECT_TRUE(CanonicalizePaths(&paths, &err));
+  EXPECT_EQ("foo/bar.h", paths[0].AsString());
+  EXPECT_EQ("../qux.h", paths[1].AsString());
+  EXPECT_EQ("third_party/long/path.h", paths[2].AsString());
+
+  buf = "foo.h bar/..";
+  paths.clear();
+  paths.push_back(StringPiece(&buf[0], 5));
+  paths.push_back(StringPiece(&buf[6], 6));
+  EXPECT_FALSE(CanonicalizePaths(&paths, &err));
+  EXPECT_EQ("path canonicalizes to the empty path", err);
+}
+
 TEST(StripAnsiEscapeCodes, EscapeAtEnd) {
   string stripped = StripAnsiEscapeCodes("foo\33");
   EXPECT_EQ("foo", stripped);
@@ -163,3 +213,60 @@ TEST(ElideMiddle, ElideInTheMiddle) {
   string elided = ElideMiddle(input, 10);
   EXPECT_EQ("012...789", elided);
 }
+
+TEST(ParseCpuList, Ranges) {
+  vector<int> cpus;
+  EXPECT_TRUE(ParseCpuList("0-3,8,10-11\n", &cpus));
+  int expected[] = { 0, 1, 2, 3, 8, 10, 11 };
+  EXPECT_EQ(vector<int>(expected, expected + 7), cpus);
+
+  cpus.clear();
+  EXPECT_TRUE(ParseCpuList("\n", &cpus));
+  EXPECT_TRUE(cpus.empty());
+
+  EXPECT_FALSE(ParseCpuList("3-1", &cpus));
+  EXPECT_FALSE(ParseCpuList("0-", &cpus));
+  EXPECT_FALSE(ParseCpuList("0;1", &cpus));
+  EXPECT_FALSE(ParseCpuList("a", &cpus));
+}
+
+TEST(PressureSampler, Range) {
+  PressureSampler sampler;
+  double cpu = -1, io = -1;
+  // There is nothing to compare the first sample with.
+  EXPECT_FALSE(sampler.Sample(&cpu, &io));
+  if (sampler.Sample(&cpu, &io)) {
+    EXPECT_GE(cpu, 0.0);
+    EXPECT_LE(cpu, 1.0);
+    EXPECT_GE(io, 0.0);
+    EXPECT_LE(io, 1.0);
+  }
+}
+
+TEST(MappedFile, NulTerminated) {
+  ScopedTempDir temp_dir;
+  temp_dir.CreateAndEnter("ninja_util_test");
+  // Sizes just below, at and above a typical page boundary.
+  const size_t sizes[] = { 0, 1, 4095, 4096, 4097, 8192 };
+  for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+    string contents(sizes[i], 'x');
+    FILE* f = fopen("mapped", "wb");
+    ASSERT_TRUE(f);
+    fwrite(contents.data(), 1, contents.size(), f);
+    fclose(f);
+
+    MappedFile file;
+    string err;
+    ASSERT_EQ(0, file.Open("mapped", &err));
+    EXPECT_EQ("", err);
+    ASSERT_EQ(sizes[i], file.size_);
+    EXPECT_EQ(contents, string(file.data_, file.size_));
+    EXPECT_EQ('\0', file.data_[file.size_]);
+  }
+  temp_dir.Cleanup();
+
+  MappedFile missing;
+  string err;
+  EXPECT_GT(0, missing.Open("ninja_util_test_missing", &err));
+  EXPECT_NE("", err);
+}